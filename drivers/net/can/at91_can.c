@@ -42,20 +42,34 @@
 #include <mach/board.h>
 
 #define DRV_NAME		"at91_can"
-#define AT91_NAPI_WEIGHT	12
 
 /*
  * RX/TX Mailbox split
- * don't dare to touch
+ *
+ * The last 2^tx_shift of the 16 mailboxes are used for TX, all others
+ * for RX. The default of 4 TX and 12 RX mailboxes may be changed with
+ * the "tx_shift" module parameter, e.g. 8/8 for nodes which mostly
+ * send or 2/14 for pure loggers. About two thirds of the RX mailboxes
+ * form the lower group of the RX FIFO, see at91_poll_rx().
  */
-#define AT91_MB_RX_NUM		12
-#define AT91_MB_TX_SHIFT	2
+#define AT91_MB_NUM		16
+#define AT91_MB_TX_SHIFT_MIN	1
+#define AT91_MB_TX_SHIFT_MAX	3
+
+static int tx_shift = 2;
+module_param(tx_shift, int, S_IRUGO);
+MODULE_PARM_DESC(tx_shift, "Use 2^tx_shift mailboxes for TX, 1..3 "
+		 "(default: 2)");
+
+#define AT91_MB_TX_SHIFT	(tx_shift)
+#define AT91_MB_RX_NUM		(AT91_MB_NUM - AT91_MB_TX_NUM)
+#define AT91_NAPI_WEIGHT	AT91_MB_RX_NUM
 
 #define AT91_MB_RX_FIRST	0
 #define AT91_MB_RX_LAST		(AT91_MB_RX_FIRST + AT91_MB_RX_NUM - 1)
 
 #define AT91_MB_RX_MASK(i)	((1 << (i)) - 1)
-#define AT91_MB_RX_SPLIT	8
+#define AT91_MB_RX_SPLIT	(AT91_MB_RX_NUM - AT91_MB_RX_NUM / 3)
 #define AT91_MB_RX_LOW_LAST	(AT91_MB_RX_SPLIT - 1)
 #define AT91_MB_RX_LOW_MASK	(AT91_MB_RX_MASK(AT91_MB_RX_SPLIT))
 
@@ -160,6 +174,7 @@ struct at91_priv {
 	struct can_priv		can;	   /* must be the first member! */
 	struct net_device	*dev;
 	struct napi_struct	napi;
+	struct can_rx_list	rx_list;   /* frames of the current poll */
 
 	void __iomem		*reg_base;
 
@@ -236,15 +251,15 @@ static void at91_setup_mailboxes(struct net_device *dev)
 	unsigned int i;
 
 	/*
-	 * The first 12 mailboxes are used as a reception FIFO. The
-	 * last mailbox is configured with overwrite option. The
-	 * overwrite flag indicates a FIFO overflow.
+	 * The first AT91_MB_RX_NUM mailboxes are used as a reception
+	 * FIFO. The last mailbox is configured with overwrite option.
+	 * The overwrite flag indicates a FIFO overflow.
 	 */
 	for (i = AT91_MB_RX_FIRST; i < AT91_MB_RX_LAST; i++)
 		set_mb_mode(priv, i, AT91_MB_MODE_RX);
 	set_mb_mode(priv, AT91_MB_RX_LAST, AT91_MB_MODE_RX_OVRWR);
 
-	/* The last 4 mailboxes are used for transmitting. */
+	/* The last AT91_MB_TX_NUM mailboxes are used for transmitting. */
 	for (i = AT91_MB_TX_FIRST; i <= AT91_MB_TX_LAST; i++)
 		set_mb_mode_prio(priv, i, AT91_MB_MODE_TX, 0);
 
@@ -327,8 +342,9 @@ static void at91_chip_stop(struct net_device *dev, enum can_state state)
  * again with mailbox AT91_MB_TX_FIRST prio 0.
  *
  * We use the priv->tx_next as counter for the next transmission
- * mailbox, but without the offset AT91_MB_TX_FIRST. The lower bits
- * encode the mailbox number, the upper 4 bits the mailbox priority:
+ * mailbox, but without the offset AT91_MB_TX_FIRST. The lower
+ * AT91_MB_TX_SHIFT bits encode the mailbox number, the upper 4 bits
+ * the mailbox priority:
  *
  * priv->tx_next = (prio << AT91_NEXT_PRIO_SHIFT) ||
  *                 (mb - AT91_MB_TX_FIRST);
@@ -437,6 +453,7 @@ static inline void at91_activate_rx_mb(const struct at91_priv *priv,
  */
 static void at91_rx_overflow_err(struct net_device *dev)
 {
+	struct at91_priv *priv = netdev_priv(dev);
 	struct net_device_stats *stats = &dev->stats;
 	struct sk_buff *skb;
 	struct can_frame *cf;
@@ -451,7 +468,7 @@ static void at91_rx_overflow_err(struct net_device *dev)
 
 	cf->can_id |= CAN_ERR_CRTL;
 	cf->data[1] = CAN_ERR_CRTL_RX_OVERFLOW;
-	netif_receive_skb(skb);
+	can_rx_list_add(&priv->rx_list, skb);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
 	dev->last_rx = jiffies;
@@ -503,6 +520,7 @@ static void at91_read_mb(struct net_device *dev, unsigned int mb,
  */
 static void at91_read_msg(struct net_device *dev, unsigned int mb)
 {
+	struct at91_priv *priv = netdev_priv(dev);
 	struct net_device_stats *stats = &dev->stats;
 	struct can_frame *cf;
 	struct sk_buff *skb;
@@ -514,7 +532,10 @@ static void at91_read_msg(struct net_device *dev, unsigned int mb)
 	}
 
 	at91_read_mb(dev, mb, cf);
-	netif_receive_skb(skb);
+	can_rx_steer(skb);
+	can_rx_bus_load(skb);
+	can_rx_napi_id(skb, &priv->napi);
+	can_rx_list_add(&priv->rx_list, skb);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
 	dev->last_rx = jiffies;
@@ -530,8 +551,9 @@ static void at91_read_msg(struct net_device *dev, unsigned int mb)
  *
  * Theory of Operation:
  *
- * 12 of the 16 mailboxes on the chip are reserved for RX. we split
- * them into 2 groups. The lower group holds 8 and upper 4 mailboxes.
+ * 12 of the 16 mailboxes on the chip are reserved for RX by default
+ * (see tx_shift). we split them into 2 groups. The lower group holds
+ * AT91_MB_RX_SPLIT (8) and upper the rest (4) mailboxes.
  *
  * Like it or not, but the chip always saves a received CAN message
  * into the first free mailbox it finds (starting with the
@@ -659,6 +681,7 @@ static void at91_poll_err_frame(struct net_device *dev,
 
 static int at91_poll_err(struct net_device *dev, int quota, u32 reg_sr)
 {
+	struct at91_priv *priv = netdev_priv(dev);
 	struct sk_buff *skb;
 	struct can_frame *cf;
 
@@ -670,7 +693,7 @@ static int at91_poll_err(struct net_device *dev, int quota, u32 reg_sr)
 		return 0;
 
 	at91_poll_err_frame(dev, cf, reg_sr);
-	netif_receive_skb(skb);
+	can_rx_list_add(&priv->rx_list, skb);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
 	dev->last_rx = jiffies;
@@ -684,10 +707,12 @@ static int at91_poll_err(struct net_device *dev, int quota, u32 reg_sr)
 static int at91_poll(struct napi_struct *napi, int quota)
 {
 	struct net_device *dev = napi->dev;
-	const struct at91_priv *priv = netdev_priv(dev);
+	struct at91_priv *priv = netdev_priv(dev);
 	u32 reg_sr = at91_read(priv, AT91_SR);
 	int work_done = 0;
 
+	can_rx_list_init(&priv->rx_list);
+
 	if (reg_sr & AT91_IRQ_MB_RX)
 		work_done += at91_poll_rx(dev, quota - work_done);
 
@@ -699,12 +724,17 @@ static int at91_poll(struct napi_struct *napi, int quota)
 	if (reg_sr & AT91_IRQ_ERR_FRAME)
 		work_done += at91_poll_err(dev, quota - work_done, reg_sr);
 
+	can_rx_list_flush(&priv->rx_list);
+
 	if (work_done < quota) {
 		/* enable IRQs for frame errors and all mailboxes >= rx_next */
 		u32 reg_ier = AT91_IRQ_ERR_FRAME;
-		reg_ier |= AT91_IRQ_MB_RX & ~AT91_MB_RX_MASK(priv->rx_next);
 
-		napi_complete(napi);
+		/* the mailboxes wait for the next poll with IFLA_CAN_COALESCE */
+		if (can_coalesce_complete(dev, work_done))
+			reg_ier |= AT91_IRQ_MB_RX &
+				~AT91_MB_RX_MASK(priv->rx_next);
+
 		at91_write(priv, AT91_IER, reg_ier);
 	}
 
@@ -1102,6 +1132,7 @@ static int __init at91_can_probe(struct platform_device *pdev)
 	priv->pdata = pdev->dev.platform_data;
 
 	netif_napi_add(dev, &priv->napi, at91_poll, AT91_NAPI_WEIGHT);
+	priv->can.coalesce_napi = &priv->napi;
 
 	dev_set_drvdata(&pdev->dev, dev);
 	SET_NETDEV_DEV(dev, &pdev->dev);
@@ -1162,7 +1193,15 @@ static struct platform_driver at91_can_driver = {
 
 static int __init at91_can_module_init(void)
 {
-	printk(KERN_INFO "%s netdevice driver\n", DRV_NAME);
+	if (tx_shift < AT91_MB_TX_SHIFT_MIN ||
+	    tx_shift > AT91_MB_TX_SHIFT_MAX) {
+		printk(KERN_WARNING "%s: tx_shift must be %d..%d, using 2\n",
+		       DRV_NAME, AT91_MB_TX_SHIFT_MIN, AT91_MB_TX_SHIFT_MAX);
+		tx_shift = 2;
+	}
+
+	printk(KERN_INFO "%s netdevice driver (%d RX, %d TX mailboxes)\n",
+	       DRV_NAME, AT91_MB_RX_NUM, AT91_MB_TX_NUM);
 	return platform_driver_register(&at91_can_driver);
 }
 
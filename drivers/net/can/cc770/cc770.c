@@ -111,6 +111,21 @@ module_param(i82527_compat, int, S_IRUGO);
 MODULE_PARM_DESC(i82527_compat, "Strict Intel 82527 comptibility mode "
 		 "without using additional functions");
 
+/*
+ * Back-to-back frames overwrite a message object before the interrupt
+ * handler has read it out. With "rx_fifo" set, the message objects
+ * 1..rx_fifo receive the frames of the type of the first RX object in
+ * addition. The chip stores a frame in the lowest numbered valid object,
+ * so an object is invalidated on its interrupt and the next frame goes to
+ * the next object of the chain. As on the at91 CAN, the objects are
+ * re-enabled in a low and a high group to keep the frames in order. The
+ * objects 11..15 only get frames of that type when the FIFO is full.
+ */
+static int rx_fifo;
+module_param(rx_fifo, int, S_IRUGO);
+MODULE_PARM_DESC(rx_fifo, "Message objects chained to an RX FIFO, 2..10 "
+		 "(default: 0 = off)");
+
 /*
  * This driver uses the last 5 message objects 11..15. The definitions
  * and structure below allows to configure and assign them to the real
@@ -145,6 +160,56 @@ static inline int intid2obj(unsigned int intid)
 		return MSGOBJ_LAST + 2 - intid;
 }
 
+/* index of the RX FIFO object of an interrupt id, -1 if none */
+static inline int intid2fifo(const struct cc770_priv *priv,
+			     unsigned int intid)
+{
+	if (intid > 2 && intid - 2 - MSGOBJ_FIRST < priv->rx_fifo_len)
+		return intid - 2 - MSGOBJ_FIRST;
+	return -1;
+}
+
+static void enable_fifo_obj(const struct cc770_priv *priv, unsigned int mo)
+{
+	cc770_write_reg(priv, msgobj[mo].ctrl1,
+			NEWDAT_RES | MSGLST_RES | TXRQST_RES | RMTPND_RES);
+	cc770_write_reg(priv, msgobj[mo].ctrl0,
+			MSGVAL_SET | TXIE_RES | RXIE_SET | INTPND_RES);
+}
+
+static void enable_fifo_objs(struct cc770_priv *priv)
+{
+	unsigned int i, mo;
+	u8 msgcfg = 0;
+
+	if (priv->obj_flags[CC770_OBJ_RX0] & CC770_OBJ_FLAG_EFF)
+		msgcfg = MSGCFG_XTD;
+
+	priv->rx_next = 0;
+	priv->rx_fifo_pending = 0;
+
+	for (i = 0; i < priv->rx_fifo_len; i++) {
+		mo = MSGOBJ_FIRST + i;
+		cc770_write_reg(priv, msgobj[mo].config, msgcfg);
+		enable_fifo_obj(priv, mo);
+	}
+}
+
+static void disable_fifo_objs(const struct cc770_priv *priv)
+{
+	unsigned int i, mo;
+
+	for (i = 0; i < priv->rx_fifo_len; i++) {
+		mo = MSGOBJ_FIRST + i;
+		cc770_write_reg(priv, msgobj[mo].ctrl1,
+				NEWDAT_RES | MSGLST_RES |
+				TXRQST_RES | RMTPND_RES);
+		cc770_write_reg(priv, msgobj[mo].ctrl0,
+				MSGVAL_RES | TXIE_RES |
+				RXIE_RES | INTPND_RES);
+	}
+}
+
 static void enable_all_objs(const struct net_device *dev)
 {
 	struct cc770_priv *priv = netdev_priv(dev);
@@ -207,6 +272,12 @@ static void enable_all_objs(const struct net_device *dev)
 					RXIE_RES | INTPND_RES);
 		}
 	}
+
+	if (priv->rx_fifo_len) {
+		dev_dbg(ND2D(dev), "Message objects %d..%d for RX FIFO\n",
+			MSGOBJ_FIRST, MSGOBJ_FIRST + priv->rx_fifo_len - 1);
+		enable_fifo_objs(priv);
+	}
 }
 
 static void disable_all_objs(const struct cc770_priv *priv)
@@ -237,6 +308,8 @@ static void disable_all_objs(const struct cc770_priv *priv)
 					RXIE_RES | INTPND_RES);
 		}
 	}
+
+	disable_fifo_objs(priv);
 }
 
 static void set_reset_mode(struct net_device *dev)
@@ -506,7 +579,8 @@ static netdev_tx_t cc770_start_xmit(struct sk_buff *skb, struct net_device *dev)
 	return NETDEV_TX_OK;
 }
 
-static void cc770_rx(struct net_device *dev, unsigned int mo, u8 ctrl1)
+static struct sk_buff *cc770_read_msgobj(struct net_device *dev,
+					 unsigned int mo, u8 ctrl1)
 {
 	struct cc770_priv *priv = netdev_priv(dev);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
@@ -521,8 +595,10 @@ static void cc770_rx(struct net_device *dev, unsigned int mo, u8 ctrl1)
 	int i;
 
 	skb = alloc_can_skb(dev, &cf);
-	if (skb == NULL)
-		return;
+	if (skb == NULL) {
+		stats->rx_dropped++;
+		return NULL;
+	}
 
 	config = cc770_read_reg(priv, msgobj[mo].config);
 
@@ -555,13 +631,26 @@ static void cc770_rx(struct net_device *dev, unsigned int mo, u8 ctrl1)
 		for (i = 0; i < cf->can_dlc; i++)
 			cf->data[i] = cc770_read_reg(priv, msgobj[mo].data[i]);
 	}
-	netif_rx(skb);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
 	dev->last_rx = jiffies;
 #endif
 	stats->rx_packets++;
 	stats->rx_bytes += cf->can_dlc;
+
+	return skb;
+}
+
+static void cc770_rx(struct net_device *dev, unsigned int mo, u8 ctrl1)
+{
+	struct sk_buff *skb;
+
+	skb = cc770_read_msgobj(dev, mo, ctrl1);
+	if (skb) {
+		can_rx_steer(skb);
+		can_rx_bus_load(skb);
+		netif_rx(skb);
+	}
 }
 
 static int cc770_err(struct net_device *dev, u8 status)
@@ -742,6 +831,102 @@ static void cc770_tx_interrupt(struct net_device *dev, unsigned int o)
 	netif_wake_queue(dev);
 }
 
+/*
+ * A FIFO object got a frame: take it out of the acceptance filtering, so
+ * that the next frame is stored in the next object of the chain.
+ */
+static void cc770_fifo_interrupt(struct net_device *dev, unsigned int i)
+{
+	struct cc770_priv *priv = netdev_priv(dev);
+
+	cc770_write_reg(priv, msgobj[MSGOBJ_FIRST + i].ctrl0,
+			MSGVAL_RES | TXIE_RES | RXIE_RES | INTPND_RES);
+	set_bit(i, &priv->rx_fifo_pending);
+}
+
+/*
+ * Read up to quota frames from the RX FIFO objects, in the order they were
+ * filled. The objects of the low group are re-enabled all at once when the
+ * last one of them has been read, those of the high group one by one.
+ */
+static int cc770_rx_fifo(struct net_device *dev, int quota)
+{
+	struct cc770_priv *priv = netdev_priv(dev);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
+	struct net_device_stats *stats = can_get_stats(dev);
+#else
+	struct net_device_stats *stats = &dev->stats;
+#endif
+	unsigned int len = priv->rx_fifo_len;
+	unsigned int split = len / 2;
+	struct sk_buff *skb;
+	unsigned int i, j;
+	int n = 0;
+	u8 ctrl1;
+
+again:
+	while (n < quota) {
+		i = find_next_bit(&priv->rx_fifo_pending, len, priv->rx_next);
+		if (i >= len)
+			break;
+
+		clear_bit(i, &priv->rx_fifo_pending);
+		ctrl1 = cc770_read_reg(priv, msgobj[MSGOBJ_FIRST + i].ctrl1);
+		if (ctrl1 & MSGLST_SET) {
+			stats->rx_over_errors++;
+			stats->rx_errors++;
+		}
+
+		skb = cc770_read_msgobj(dev, MSGOBJ_FIRST + i, ctrl1);
+		if (skb) {
+			can_rx_steer(skb);
+			can_rx_bus_load(skb);
+#ifdef CC770_NAPI
+			netif_receive_skb(skb);
+#else
+			netif_rx(skb);
+#endif
+		}
+		n++;
+
+		priv->rx_next = i + 1;
+		if (i >= split)
+			enable_fifo_obj(priv, MSGOBJ_FIRST + i);
+		else if (priv->rx_next == split)
+			for (j = 0; j < split; j++)
+				enable_fifo_obj(priv, MSGOBJ_FIRST + j);
+	}
+
+	/* high group done, continue with the low one */
+	if (priv->rx_next >= split && n < quota &&
+	    find_next_bit(&priv->rx_fifo_pending, len, priv->rx_next) >= len) {
+		priv->rx_next = 0;
+		if (priv->rx_fifo_pending)
+			goto again;
+	}
+
+	return n;
+}
+
+#ifdef CC770_NAPI
+static int cc770_poll(struct napi_struct *napi, int quota)
+{
+	struct net_device *dev = napi->dev;
+	struct cc770_priv *priv = netdev_priv(dev);
+	int work;
+
+	work = cc770_rx_fifo(dev, quota);
+	if (work < quota) {
+		napi_complete(napi);
+		/* objects filled while the poll was running */
+		if (priv->rx_fifo_pending && napi_schedule_prep(napi))
+			__napi_schedule(napi);
+	}
+
+	return work;
+}
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,19)
 irqreturn_t cc770_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 #else
@@ -752,6 +937,7 @@ irqreturn_t cc770_interrupt(int irq, void *dev_id)
 	struct cc770_priv *priv = netdev_priv(dev);
 	u8 intid;
 	int o, n = 0;
+	int fifo = 0;
 
 	/* Shared interrupts and IRQ off? */
 	if (priv->can.state == CAN_STATE_STOPPED)
@@ -771,6 +957,9 @@ irqreturn_t cc770_interrupt(int irq, void *dev_id)
 			/* Exit in case of bus-off */
 			if (cc770_status_interrupt(dev))
 				break;
+		} else if ((o = intid2fifo(priv, intid)) >= 0) {
+			cc770_fifo_interrupt(dev, o);
+			fifo = 1;
 		} else {
 			o = intid2obj(intid);
 
@@ -789,6 +978,13 @@ irqreturn_t cc770_interrupt(int irq, void *dev_id)
 		}
 	}
 
+	if (fifo)
+#ifdef CC770_NAPI
+		napi_schedule(&priv->napi);
+#else
+		cc770_rx_fifo(dev, priv->rx_fifo_len);
+#endif
+
 	if (priv->post_irq)
 		priv->post_irq(priv);
 
@@ -823,6 +1019,10 @@ static int cc770_open(struct net_device *dev)
 	memset(&priv->can.net_stats, 0, sizeof(priv->can.net_stats));
 #endif
 
+#ifdef CC770_NAPI
+	napi_enable(&priv->napi);
+#endif
+
 	/* init and start chip */
 	cc770_start(dev);
 	priv->open_time = jiffies;
@@ -840,6 +1040,9 @@ static int cc770_close(struct net_device *dev)
 	set_reset_mode(dev);
 
 	free_irq(dev->irq, (void *)dev);
+#ifdef CC770_NAPI
+	napi_disable(&priv->napi);
+#endif
 	close_candev(dev);
 
 	priv->open_time = 0;
@@ -866,6 +1069,10 @@ struct net_device *alloc_cc770dev(int sizeof_priv)
 	priv->can.ctrlmode_supported = CAN_CTRLMODE_3_SAMPLES;
 
 	memcpy(priv->obj_flags, cc770_obj_flags, sizeof(cc770_obj_flags));
+	priv->rx_fifo_len = rx_fifo;
+#ifdef CC770_NAPI
+	netif_napi_add(dev, &priv->napi, cc770_poll, CC770_NAPI_WEIGHT);
+#endif
 
 	if (sizeof_priv)
 		priv->priv = (void *)priv + sizeof(struct cc770_priv);
@@ -876,6 +1083,11 @@ EXPORT_SYMBOL_GPL(alloc_cc770dev);
 
 void free_cc770dev(struct net_device *dev)
 {
+#ifdef CC770_NAPI
+	struct cc770_priv *priv = netdev_priv(dev);
+
+	netif_napi_del(&priv->napi);
+#endif
 	free_candev(dev);
 }
 EXPORT_SYMBOL_GPL(free_cc770dev);
@@ -935,6 +1147,12 @@ static __init int cc770_init(void)
 		cc770_obj_flags[CC770_OBJ_RX1] &= ~CC770_OBJ_FLAG_EFF;
 	}
 
+	if (rx_fifo && (rx_fifo < 2 || rx_fifo > CC770_RX_FIFO_MAX)) {
+		printk(KERN_WARNING "%s: rx_fifo must be 2..%d, FIFO disabled\n",
+		       DRV_NAME, CC770_RX_FIFO_MAX);
+		rx_fifo = 0;
+	}
+
 	printk(KERN_INFO "%s CAN netdevice driver\n", DRV_NAME);
 
 	return 0;
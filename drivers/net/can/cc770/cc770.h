@@ -214,6 +214,18 @@ enum {
 
 #define obj2msgobj(o)	(MSGOBJ_LAST - (o)) /* message object 11..15 */
 
+/*
+ * The free message objects 1..10 may be chained to a software managed
+ * RX FIFO, see the "rx_fifo" module parameter. The FIFO objects are read
+ * in a NAPI poll where available.
+ */
+#define CC770_RX_FIFO_MAX	(obj2msgobj(CC770_OBJ_MAX - 1) - MSGOBJ_FIRST)
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+#define CC770_NAPI
+#define CC770_NAPI_WEIGHT	16
+#endif
+
 /*
  * CC770 private data structure
  */
@@ -239,6 +251,13 @@ struct cc770_priv {
 	u8 cpu_interface;	/* CPU interface register */
 	u8 clkout;		/* Clock out register */
 	u8 bus_config;		/* Bus conffiguration register */
+
+	unsigned int rx_fifo_len;	/* message objects of the RX FIFO */
+	unsigned int rx_next;		/* next FIFO object to read */
+	unsigned long rx_fifo_pending;	/* FIFO objects with a frame */
+#ifdef CC770_NAPI
+	struct napi_struct napi;
+#endif
 };
 
 struct net_device *alloc_cc770dev(int sizeof_priv);
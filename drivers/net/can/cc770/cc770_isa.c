@@ -108,22 +108,37 @@ static void cc770_isa_port_write_reg(const struct cc770_priv *priv,
 	outb(val, (unsigned long)priv->reg_base + reg);
 }
 
+/*
+ * The address and data port access must not be interrupted, e.g. by the
+ * interrupt handler while the RX FIFO is read in the NAPI poll.
+ */
+static DEFINE_SPINLOCK(cc770_isa_port_lock);
+
 static u8 cc770_isa_port_read_reg_indirect(const struct cc770_priv *priv,
 					     int reg)
 {
 	unsigned long base = (unsigned long)priv->reg_base;
+	unsigned long flags;
+	u8 val;
 
+	spin_lock_irqsave(&cc770_isa_port_lock, flags);
 	outb(reg, base);
-	return inb(base + 1);
+	val = inb(base + 1);
+	spin_unlock_irqrestore(&cc770_isa_port_lock, flags);
+
+	return val;
 }
 
 static void cc770_isa_port_write_reg_indirect(const struct cc770_priv *priv,
 						int reg, u8 val)
 {
 	unsigned long base = (unsigned long)priv->reg_base;
+	unsigned long flags;
 
+	spin_lock_irqsave(&cc770_isa_port_lock, flags);
 	outb(reg, base);
 	outb(val, base + 1);
+	spin_unlock_irqrestore(&cc770_isa_port_lock, flags);
 }
 
 static int __devinit cc770_isa_match(struct device *pdev, unsigned int idx)
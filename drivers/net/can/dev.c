@@ -24,7 +24,12 @@
 #include <linux/kernel.h>
 #include <linux/netdevice.h>
 #include <linux/if_arp.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+#include <linux/math64.h>
+#endif
+#include <net/sock.h>
 #include <socketcan/can.h>
+#include <socketcan/can/core.h>
 #include <socketcan/can/dev.h>
 #ifndef CONFIG_CAN_DEV_SYSFS
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24)
@@ -264,6 +269,178 @@ int can_get_bittiming(struct net_device *dev, struct can_bittiming *bt)
 	return 0;
 }
 
+#ifdef CAN_BUS_LOAD
+/* bits from the CRC delimiter to the end of the interframe space */
+#define CAN_FRAME_TAIL_BITS (1 + 2 + 7 + 3)
+
+/* the bit stream from SOF to the CRC with its stuff bits and the CRC-15 */
+struct can_bitstream {
+	unsigned int bits;
+	u16 crc;
+	u8 last;
+	u8 run;
+};
+
+static void can_bits_put(struct can_bitstream *s, u32 val, int n, int crc)
+{
+	while (n--) {
+		u8 bit = (val >> n) & 1;
+
+		if (crc) {
+			int nxt = bit ^ ((s->crc >> 14) & 1);
+
+			s->crc = (s->crc << 1) & 0x7fff;
+			if (nxt)
+				s->crc ^= 0x4599;
+		}
+
+		s->bits++;
+
+		if (bit != s->last) {
+			s->last = bit;
+			s->run = 1;
+		} else if (++s->run == 5) {
+			/* the stuff bit starts the next run */
+			s->bits++;
+			s->last = !bit;
+			s->run = 1;
+		}
+	}
+}
+
+/* exact length of a classic CAN frame on the bus in bits */
+static unsigned int can_frame_bits(const struct can_frame *cf)
+{
+	struct can_bitstream s = { .last = 1 };	/* recessive bus idle */
+	int rtr = !!(cf->can_id & CAN_RTR_FLAG);
+	u8 dlc = min_t(u8, cf->can_dlc, 15);
+	int i;
+
+	/* SOF */
+	can_bits_put(&s, 0, 1, 1);
+
+	if (cf->can_id & CAN_EFF_FLAG) {
+		/* base ID, SRR and IDE recessive, ID extension, RTR r1 r0 */
+		can_bits_put(&s, (cf->can_id >> 18) & 0x7ff, 11, 1);
+		can_bits_put(&s, 3, 2, 1);
+		can_bits_put(&s, cf->can_id & 0x3ffff, 18, 1);
+		can_bits_put(&s, rtr << 2, 3, 1);
+	} else {
+		/* ID, RTR IDE r0 */
+		can_bits_put(&s, cf->can_id & CAN_SFF_MASK, 11, 1);
+		can_bits_put(&s, rtr << 2, 3, 1);
+	}
+
+	can_bits_put(&s, dlc, 4, 1);
+
+	if (!rtr)
+		for (i = 0; i < min_t(u8, dlc, 8); i++)
+			can_bits_put(&s, cf->data[i], 8, 1);
+
+	can_bits_put(&s, s.crc, 15, 0);
+
+	return s.bits + CAN_FRAME_TAIL_BITS;
+}
+
+/*
+ * can_bus_load_account - account the bus time of a frame
+ *
+ * tx != 0 for the looped back frames. Called from hard or soft irq
+ * context, the per-CPU counters are updated with the irqs disabled.
+ */
+void can_bus_load_account(struct net_device *dev, struct sk_buff *skb, int tx)
+{
+	struct can_priv *priv = netdev_priv(dev);
+	const struct can_frame *cf = (struct can_frame *)skb->data;
+	struct can_bus_load_pcpu *p;
+	unsigned long flags;
+	unsigned int bits;
+	u64 now, prev, gap = 0;
+
+	/* error frames are generated by the drivers */
+	if (skb->len != CAN_MTU || cf->can_id & CAN_ERR_FLAG)
+		return;
+
+	bits = can_frame_bits(cf);
+
+	now = ktime_to_ns(ktime_get());
+	prev = atomic64_xchg(&priv->bus_last_ns, now);
+
+	/* the idle time before the frame */
+	if (prev && priv->bus_bit_ns) {
+		gap = now - prev;
+		if (gap > (u64)bits * priv->bus_bit_ns)
+			gap -= (u64)bits * priv->bus_bit_ns;
+		else
+			gap = 0;
+	}
+
+	local_irq_save(flags);
+	p = this_cpu_ptr(priv->bus_load);
+	p->frames[tx]++;
+	p->bits[tx] += bits;
+	if (prev && priv->bus_bit_ns) {
+		if (!p->gaps || gap < p->gap_min_ns)
+			p->gap_min_ns = gap;
+		if (gap > p->gap_max_ns)
+			p->gap_max_ns = gap;
+		p->gap_sum_ns += gap;
+		p->gaps++;
+	}
+	local_irq_restore(flags);
+}
+EXPORT_SYMBOL_GPL(can_bus_load_account);
+
+/* once a second while the device is up: the load of the last interval */
+static void can_bus_load_timer(unsigned long data)
+{
+	struct net_device *dev = (struct net_device *)data;
+	struct can_priv *priv = netdev_priv(dev);
+	unsigned long now = jiffies;
+	unsigned long elapsed = now - priv->bus_prev_jiffies;
+	struct can_bus_load bl;
+	u64 bits, frames, div;
+
+	can_get_bus_load(dev, &bl);
+	bits = bl.rx_bits + bl.tx_bits - priv->bus_prev_bits;
+	frames = bl.rx_frames + bl.tx_frames - priv->bus_prev_frames;
+
+	if (elapsed) {
+		div = (u64)priv->bittiming.bitrate * elapsed;
+		priv->bus_load_pm = div ? div64_u64(bits * 1000 * HZ, div) : 0;
+		priv->bus_frame_rate = div64_u64(frames * HZ, elapsed);
+	}
+
+	priv->bus_prev_jiffies = now;
+	priv->bus_prev_bits = bl.rx_bits + bl.tx_bits;
+	priv->bus_prev_frames = bl.rx_frames + bl.tx_frames;
+
+	mod_timer(&priv->bus_load_timer, now + HZ);
+}
+
+static void can_bus_load_start(struct net_device *dev)
+{
+	struct can_priv *priv = netdev_priv(dev);
+	struct can_bus_load bl;
+	u32 bitrate = priv->bittiming.bitrate;
+
+	priv->bus_bit_ns = bitrate ? DIV_ROUND_CLOSEST(NSEC_PER_SEC,
+						       bitrate) : 0;
+	atomic64_set(&priv->bus_last_ns, 0);
+
+	can_get_bus_load(dev, &bl);
+	priv->bus_prev_jiffies = jiffies;
+	priv->bus_prev_bits = bl.rx_bits + bl.tx_bits;
+	priv->bus_prev_frames = bl.rx_frames + bl.tx_frames;
+	priv->bus_load_pm = 0;
+	priv->bus_frame_rate = 0;
+
+	setup_timer(&priv->bus_load_timer, can_bus_load_timer,
+		    (unsigned long)dev);
+	mod_timer(&priv->bus_load_timer, jiffies + HZ);
+}
+#endif
+
 /*
  * Local echo of CAN messages
  *
@@ -274,6 +451,33 @@ int can_get_bittiming(struct net_device *dev, struct can_bittiming *bt)
  * the IFF_ECHO remains clear in dev->flags. This causes the PF_CAN core
  * to perform the echo as a fallback solution.
  */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+/* the sending socket asked for a tx timestamp (SO_TIMESTAMPING) */
+static inline int can_echo_skb_tstamp(struct sk_buff *skb)
+{
+	return skb->sk && (skb_shinfo(skb)->tx_flags &
+			   (SKBTX_SW_TSTAMP | SKBTX_HW_TSTAMP));
+}
+#else
+static inline int can_echo_skb_tstamp(struct sk_buff *skb)
+{
+	return 0;
+}
+#endif
+
+/*
+ * Free an echo skb. Echo skbs that wait for a tx timestamp hold a
+ * reference to the sending socket.
+ */
+static void can_release_echo_skb(struct sk_buff *skb)
+{
+	struct sock *sk = can_echo_skb_tstamp(skb) ? skb->sk : NULL;
+
+	kfree_skb(skb);
+	if (sk)
+		sock_put(sk);
+}
+
 static void can_flush_echo_skb(struct net_device *dev)
 {
 	struct can_priv *priv = netdev_priv(dev);
@@ -286,12 +490,43 @@ static void can_flush_echo_skb(struct net_device *dev)
 
 	for (i = 0; i < priv->echo_skb_max; i++) {
 		if (priv->echo_skb[i]) {
-			kfree_skb(priv->echo_skb[i]);
+			can_release_echo_skb(priv->echo_skb[i]);
 			priv->echo_skb[i] = NULL;
 			stats->tx_dropped++;
 			stats->tx_aborted_errors++;
 		}
 	}
+
+	/* both ends of the echo ring are quiet here */
+	priv->echo_head = 0;
+	priv->echo_tail = 0;
+}
+
+/*
+ * Hand a sent skb back. Unless the pool is full it is reset and kept
+ * for alloc_can_skb(), already set up as a received CAN frame.
+ */
+static void can_recycle_skb(struct net_device *dev, struct sk_buff *skb)
+{
+#ifdef CAN_SKB_POOL
+	struct can_priv *priv = netdev_priv(dev);
+
+	if (skb_queue_len(&priv->skb_pool) < CAN_SKB_POOL_SIZE &&
+	    skb_recycle_check(skb, sizeof(struct can_frame))) {
+		skb->dev = dev;
+		skb->protocol = __constant_htons(ETH_P_CAN);
+		skb->pkt_type = PACKET_BROADCAST;
+		skb->ip_summed = CHECKSUM_UNNECESSARY;
+		skb_queue_tail(&priv->skb_pool, skb);
+		return;
+	}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+	consume_skb(skb);
+#else
+	kfree_skb(skb);
+#endif
 }
 
 /*
@@ -300,17 +535,21 @@ static void can_flush_echo_skb(struct net_device *dev)
  * The function is typically called in the start_xmit function
  * of the device driver. The driver must protect access to
  * priv->echo_skb, if necessary.
+ *
+ * Frames that are not looped back are kept as well when the sending
+ * socket requested a tx timestamp, which is taken at tx done time.
  */
 void can_put_echo_skb(struct sk_buff *skb, struct net_device *dev,
 		      unsigned int idx)
 {
 	struct can_priv *priv = netdev_priv(dev);
+	int loop = skb->pkt_type == PACKET_LOOPBACK;
 
 	BUG_ON(idx >= priv->echo_skb_max);
 
 	/* check flag whether this packet has to be looped back */
-	if (!(dev->flags & IFF_ECHO) || skb->pkt_type != PACKET_LOOPBACK) {
-		kfree_skb(skb);
+	if (!(dev->flags & IFF_ECHO) || (!loop && !can_echo_skb_tstamp(skb))) {
+		can_recycle_skb(dev, skb);
 		return;
 	}
 
@@ -329,9 +568,14 @@ void can_put_echo_skb(struct sk_buff *skb, struct net_device *dev,
 
 		skb->sk = srcsk;
 
+		/* the tx timestamp is queued to srcsk at tx done time */
+		if (can_echo_skb_tstamp(skb))
+			sock_hold(srcsk);
+
 		/* make settings for echo to reduce code in irq context */
 		skb->protocol = __constant_htons(ETH_P_CAN);
-		skb->pkt_type = PACKET_BROADCAST;
+		/* PACKET_HOST => only kept for the tx timestamp */
+		skb->pkt_type = loop ? PACKET_BROADCAST : PACKET_HOST;
 		skb->ip_summed = CHECKSUM_UNNECESSARY;
 		skb->dev = dev;
 
@@ -354,17 +598,63 @@ EXPORT_SYMBOL_GPL(can_put_echo_skb);
  * access to priv->echo_skb, if necessary.
  */
 void can_get_echo_skb(struct net_device *dev, unsigned int idx)
+{
+	can_get_echo_skb_hwtstamp(dev, idx, ktime_set(0, 0));
+}
+EXPORT_SYMBOL_GPL(can_get_echo_skb);
+
+/*
+ * Like can_get_echo_skb() for controllers that provide the time when the
+ * frame has been sent on the bus. A zero hwtstamp means 'not available'.
+ * The requested tx timestamps are put on the error queue of the sending
+ * socket before the frame is looped back.
+ */
+void can_get_echo_skb_hwtstamp(struct net_device *dev, unsigned int idx,
+			       ktime_t hwtstamp)
 {
 	struct can_priv *priv = netdev_priv(dev);
+	struct sk_buff *skb;
+	struct sock *sk = NULL;
 
 	BUG_ON(idx >= priv->echo_skb_max);
 
-	if (priv->echo_skb[idx]) {
-		netif_rx(priv->echo_skb[idx]);
-		priv->echo_skb[idx] = NULL;
+	skb = priv->echo_skb[idx];
+	if (!skb)
+		return;
+
+	priv->echo_skb[idx] = NULL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+	if (can_echo_skb_tstamp(skb)) {
+		sk = skb->sk;
+
+		if ((skb_shinfo(skb)->tx_flags & SKBTX_HW_TSTAMP) &&
+		    ktime_to_ns(hwtstamp)) {
+			struct skb_shared_hwtstamps hwts;
+
+			memset(&hwts, 0, sizeof(hwts));
+			hwts.hwtstamp = hwtstamp;
+			skb_tstamp_tx(skb, &hwts);
+		}
+
+		if (skb_shinfo(skb)->tx_flags & SKBTX_SW_TSTAMP)
+			skb_tstamp_tx(skb, NULL);
 	}
+#endif
+
+#ifdef CAN_BUS_LOAD
+	can_bus_load_account(dev, skb, 1);
+#endif
+
+	if (skb->pkt_type == PACKET_HOST)
+		can_recycle_skb(dev, skb);
+	else
+		netif_rx(skb);
+
+	if (sk)
+		sock_put(sk);
 }
-EXPORT_SYMBOL_GPL(can_get_echo_skb);
+EXPORT_SYMBOL_GPL(can_get_echo_skb_hwtstamp);
 
 /*
   * Remove the skb from the stack and free it.
@@ -378,12 +668,125 @@ void can_free_echo_skb(struct net_device *dev, unsigned int idx)
 	BUG_ON(idx >= priv->echo_skb_max);
 
 	if (priv->echo_skb[idx]) {
-		kfree_skb(priv->echo_skb[idx]);
+		can_release_echo_skb(priv->echo_skb[idx]);
 		priv->echo_skb[idx] = NULL;
 	}
 }
 EXPORT_SYMBOL_GPL(can_free_echo_skb);
 
+/*
+ * Echo ring
+ *
+ * Instead of choosing the echo_skb index itself the driver may use
+ * priv->echo_skb as a FIFO of echo_skb_max entries, which must be a power
+ * of two. can_put_echo_skb_ring() is the only producer (start_xmit) and
+ * can_get_echo_skb_ring() the only consumer (tx done), so no lock is needed
+ * between them as long as each side is serialized on its own. The frames
+ * have to be completed by the controller in the order they were queued and
+ * echo_skb_max must not exceed the number of frames it can take.
+ *
+ * This only pays off for controllers with an in-order tx FIFO of several
+ * entries. Controllers with a single tx buffer (e.g. sja1000, cc770) gain
+ * nothing over echo_skb[0]. mscan and the USB adapters complete their
+ * frames by priority or by urb context, and at91 has to drain all its
+ * mailboxes on a priority wrap, which the queue wake-up of the ring would
+ * defeat. They keep choosing the index themselves.
+ */
+static inline int can_echo_ring_full(struct can_priv *priv)
+{
+	return priv->echo_head - READ_ONCE(priv->echo_tail) >=
+		priv->echo_skb_max;
+}
+
+/*
+ * Put the skb into the next free ring entry and return its index, e.g.
+ * to tag the frame in the controller. The tx queue is stopped when the
+ * ring becomes full and woken up again by can_get_echo_skb_ring().
+ */
+unsigned int can_put_echo_skb_ring(struct sk_buff *skb, struct net_device *dev)
+{
+	struct can_priv *priv = netdev_priv(dev);
+	unsigned int idx;
+
+	BUG_ON(!priv->echo_skb_max ||
+	       (priv->echo_skb_max & (priv->echo_skb_max - 1)));
+	BUG_ON(can_echo_ring_full(priv));
+
+	idx = priv->echo_head & (priv->echo_skb_max - 1);
+	can_put_echo_skb(skb, dev, idx);
+
+	/* publish the entry before the consumer can see the new head */
+	smp_wmb();
+	priv->echo_head++;
+
+	if (can_echo_ring_full(priv)) {
+		netif_stop_queue(dev);
+		/* order the stop against the tail update of the consumer */
+		smp_mb();
+		if (!can_echo_ring_full(priv))
+			netif_wake_queue(dev);
+	}
+
+	return idx;
+}
+EXPORT_SYMBOL_GPL(can_put_echo_skb_ring);
+
+/* complete the oldest ring entry, loop it back or just drop it */
+static int can_pop_echo_skb_ring(struct net_device *dev, ktime_t hwtstamp,
+				 int drop)
+{
+	struct can_priv *priv = netdev_priv(dev);
+	unsigned int idx;
+
+	if (READ_ONCE(priv->echo_head) == priv->echo_tail)
+		return -ENOENT;
+
+	/* read the entry only after the head that published it */
+	smp_rmb();
+	idx = priv->echo_tail & (priv->echo_skb_max - 1);
+	if (drop)
+		can_free_echo_skb(dev, idx);
+	else
+		can_get_echo_skb_hwtstamp(dev, idx, hwtstamp);
+
+	/* the entry must be free before the producer may reuse it */
+	smp_mb();
+	priv->echo_tail++;
+
+	/* pairs with the barrier after netif_stop_queue() */
+	smp_mb();
+	if (netif_queue_stopped(dev) && !can_echo_ring_full(priv))
+		netif_wake_queue(dev);
+
+	return idx;
+}
+
+/*
+ * Loop back the oldest frame of the ring. Returns the ring index of the
+ * completed frame or -ENOENT when the ring is empty.
+ */
+int can_get_echo_skb_ring(struct net_device *dev)
+{
+	return can_pop_echo_skb_ring(dev, ktime_set(0, 0), 0);
+}
+EXPORT_SYMBOL_GPL(can_get_echo_skb_ring);
+
+int can_get_echo_skb_ring_hwtstamp(struct net_device *dev, ktime_t hwtstamp)
+{
+	return can_pop_echo_skb_ring(dev, hwtstamp, 0);
+}
+EXPORT_SYMBOL_GPL(can_get_echo_skb_ring_hwtstamp);
+
+/*
+ * Drop the oldest frame of the ring, e.g. when the controller reported
+ * that its transmission has failed.
+ */
+int can_free_echo_skb_ring(struct net_device *dev)
+{
+	return can_pop_echo_skb_ring(dev, ktime_set(0, 0), 1);
+}
+EXPORT_SYMBOL_GPL(can_free_echo_skb_ring);
+
 /*
  * CAN device restart for bus-off recovery
  */
@@ -507,13 +910,22 @@ struct sk_buff *alloc_can_skb(struct net_device *dev, struct can_frame **cf)
 {
 	struct sk_buff *skb;
 
-	skb = netdev_alloc_skb(dev, sizeof(struct can_frame));
-	if (unlikely(!skb))
-		return NULL;
+#ifdef CAN_SKB_POOL
+	struct can_priv *priv = netdev_priv(dev);
+
+	/* recycled skbs already carry the settings below */
+	skb = skb_dequeue(&priv->skb_pool);
+	if (!skb)
+#endif
+	{
+		skb = netdev_alloc_skb(dev, sizeof(struct can_frame));
+		if (unlikely(!skb))
+			return NULL;
 
-	skb->protocol = __constant_htons(ETH_P_CAN);
-	skb->pkt_type = PACKET_BROADCAST;
-	skb->ip_summed = CHECKSUM_UNNECESSARY;
+		skb->protocol = __constant_htons(ETH_P_CAN);
+		skb->pkt_type = PACKET_BROADCAST;
+		skb->ip_summed = CHECKSUM_UNNECESSARY;
+	}
 	*cf = (struct can_frame *)skb_put(skb, sizeof(struct can_frame));
 	memset(*cf, 0, sizeof(struct can_frame));
 
@@ -536,6 +948,116 @@ struct sk_buff *alloc_can_err_skb(struct net_device *dev, struct can_frame **cf)
 }
 EXPORT_SYMBOL_GPL(alloc_can_err_skb);
 
+/*
+ * Pass up the frames collected by can_rx_list_add() as one rx batch. To be
+ * called at the end of the NAPI poll.
+ */
+void can_rx_list_flush(struct can_rx_list *l)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+	netif_receive_skb_list(&l->head);
+	INIT_LIST_HEAD(&l->head);
+#else
+	struct sk_buff *skb;
+
+	if (skb_queue_empty(&l->queue))
+		return;
+
+	/* the sockets are woken up once in can_rx_batch_close() */
+	can_rx_batch_open();
+	while ((skb = __skb_dequeue(&l->queue)))
+		netif_receive_skb(skb);
+	can_rx_batch_close();
+#endif
+}
+EXPORT_SYMBOL_GPL(can_rx_list_flush);
+
+/*
+ * can_get_hw_filter - get the hardware filter to be programmed
+ *
+ * Without the CAN core filter offload (or before it computed a filter)
+ * this is the accept-all filter.
+ */
+void can_get_hw_filter(struct net_device *dev, struct can_hw_filter *f)
+{
+#ifdef CAN_HW_FILTER
+	struct can_priv *priv = netdev_priv(dev);
+
+	spin_lock_bh(&priv->hw_filter_lock);
+	*f = priv->hw_filter;
+	spin_unlock_bh(&priv->hw_filter_lock);
+#else
+	memset(f, 0, sizeof(*f));
+#endif
+}
+EXPORT_SYMBOL_GPL(can_get_hw_filter);
+
+#ifdef CAN_COALESCE
+/*
+ * can_coalesce_complete - end a NAPI poll with receive interrupt moderation
+ *
+ * To be called instead of napi_complete() when less than the quota has
+ * been done. Returns 1 when the driver is to enable its receive interrupts
+ * again. Otherwise the next poll has been scheduled rx_usecs later and the
+ * receive interrupts are to be kept disabled until then.
+ */
+int can_coalesce_complete(struct net_device *dev, int work_done)
+{
+	struct can_priv *priv = netdev_priv(dev);
+	/* may change while the device is up */
+	u32 usecs = READ_ONCE(priv->coalesce.rx_usecs);
+	u32 frames = READ_ONCE(priv->coalesce.rx_frames);
+
+	napi_complete(priv->coalesce_napi);
+
+	/* a quiet bus - back to one interrupt per frame */
+	if (!usecs || work_done < max_t(u32, frames, 1))
+		return 1;
+
+	hrtimer_start(&priv->coalesce_timer,
+		      ktime_set(0, usecs * NSEC_PER_USEC), HRTIMER_MODE_REL);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(can_coalesce_complete);
+
+/* hardirq context - a disabled NAPI context is not scheduled */
+static enum hrtimer_restart can_coalesce_timeout(struct hrtimer *timer)
+{
+	struct can_priv *priv = container_of(timer, struct can_priv,
+					     coalesce_timer);
+
+	napi_schedule(priv->coalesce_napi);
+
+	return HRTIMER_NORESTART;
+}
+#endif
+
+#ifdef CAN_HW_FILTER
+static void can_hw_filter_work(struct work_struct *work)
+{
+	struct can_priv *priv = container_of(work, struct can_priv,
+					     hw_filter_work.work);
+	struct net_device *dev = priv->dev;
+	struct can_hw_filter f;
+	int err = 0;
+
+	can_get_hw_filter(dev, &f);
+
+	/* serialize with ndo_open/ndo_stop of the driver */
+	rtnl_lock();
+	if (netif_running(dev))
+		err = priv->do_set_filter(dev, &f);
+	rtnl_unlock();
+
+	if (err == -EBUSY)
+		schedule_delayed_work(&priv->hw_filter_work, 1);
+	else if (err)
+		dev_warn(ND2D(dev), "setting hardware filter failed (%d)\n",
+			 err);
+}
+#endif
+
 /*
  * Allocate and setup space for the CAN network device
  */
@@ -557,6 +1079,15 @@ struct net_device *alloc_candev(int sizeof_priv, unsigned int echo_skb_max)
 
 	priv = netdev_priv(dev);
 
+#ifdef CAN_BUS_LOAD
+	priv->bus_load = alloc_percpu(struct can_bus_load_pcpu);
+	if (!priv->bus_load) {
+		free_netdev(dev);
+		return NULL;
+	}
+	init_timer(&priv->bus_load_timer);
+#endif
+
 	if (echo_skb_max) {
 		priv->echo_skb_max = echo_skb_max;
 		priv->echo_skb = (void *)priv +
@@ -567,6 +1098,21 @@ struct net_device *alloc_candev(int sizeof_priv, unsigned int echo_skb_max)
 
 	init_timer(&priv->restart_timer);
 
+#ifdef CAN_SKB_POOL
+	skb_queue_head_init(&priv->skb_pool);
+#endif
+
+#ifdef CAN_HW_FILTER
+	priv->dev = dev;
+	spin_lock_init(&priv->hw_filter_lock);
+	INIT_DELAYED_WORK(&priv->hw_filter_work, can_hw_filter_work);
+#endif
+
+#ifdef CAN_COALESCE
+	hrtimer_init(&priv->coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	priv->coalesce_timer.function = can_coalesce_timeout;
+#endif
+
 	return dev;
 }
 EXPORT_SYMBOL_GPL(alloc_candev);
@@ -576,6 +1122,19 @@ EXPORT_SYMBOL_GPL(alloc_candev);
  */
 void free_candev(struct net_device *dev)
 {
+#if defined(CAN_SKB_POOL) || defined(CAN_HW_FILTER) || defined(CAN_BUS_LOAD)
+	struct can_priv *priv = netdev_priv(dev);
+#endif
+
+#ifdef CAN_HW_FILTER
+	cancel_delayed_work_sync(&priv->hw_filter_work);
+#endif
+#ifdef CAN_SKB_POOL
+	skb_queue_purge(&priv->skb_pool);
+#endif
+#ifdef CAN_BUS_LOAD
+	free_percpu(priv->bus_load);
+#endif
 	free_netdev(dev);
 }
 EXPORT_SYMBOL_GPL(free_candev);
@@ -628,6 +1187,10 @@ int open_candev(struct net_device *dev)
 
 	setup_timer(&priv->restart_timer, can_restart, (unsigned long)dev);
 
+#ifdef CAN_BUS_LOAD
+	can_bus_load_start(dev);
+#endif
+
 	return 0;
 }
 EXPORT_SYMBOL_GPL(open_candev);
@@ -644,7 +1207,16 @@ void close_candev(struct net_device *dev)
 
 	if (del_timer_sync(&priv->restart_timer))
 		dev_put(dev);
+#ifdef CAN_COALESCE
+	hrtimer_cancel(&priv->coalesce_timer);
+#endif
+#ifdef CAN_BUS_LOAD
+	del_timer_sync(&priv->bus_load_timer);
+#endif
 	can_flush_echo_skb(dev);
+#ifdef CAN_SKB_POOL
+	skb_queue_purge(&priv->skb_pool);
+#endif
 }
 EXPORT_SYMBOL_GPL(close_candev);
 
@@ -662,6 +1234,8 @@ static const struct nla_policy can_policy[IFLA_CAN_MAX + 1] = {
 				= { .len = sizeof(struct can_bittiming_const) },
 	[IFLA_CAN_CLOCK]	= { .len = sizeof(struct can_clock) },
 	[IFLA_CAN_BERR_COUNTER]	= { .len = sizeof(struct can_berr_counter) },
+	[IFLA_CAN_RX_STEER]	= { .type = NLA_U32 },
+	[IFLA_CAN_COALESCE]	= { .len = sizeof(struct can_coalesce) },
 };
 
 static int can_changelink(struct net_device *dev,
@@ -715,6 +1289,32 @@ static int can_changelink(struct net_device *dev,
 		priv->restart_ms = nla_get_u32(data[IFLA_CAN_RESTART_MS]);
 	}
 
+	if (data[IFLA_CAN_RX_STEER]) {
+		u32 steer = nla_get_u32(data[IFLA_CAN_RX_STEER]);
+
+		if (steer > CAN_RX_STEER_ID)
+			return -EINVAL;
+#ifndef CAN_RX_STEER
+		if (steer != CAN_RX_STEER_OFF)
+			return -EOPNOTSUPP;
+#endif
+		/* read locklessly by can_rx_steer(), may change while up */
+		priv->rx_steer = steer;
+	}
+
+	if (data[IFLA_CAN_COALESCE]) {
+		struct can_coalesce *cc = nla_data(data[IFLA_CAN_COALESCE]);
+
+		if (!priv->coalesce_napi)
+			return -EOPNOTSUPP;
+		if (cc->rx_usecs > CAN_COALESCE_MAX_USECS)
+			return -EINVAL;
+
+		/* read locklessly by can_coalesce_complete() */
+		priv->coalesce.rx_frames = cc->rx_frames;
+		priv->coalesce.rx_usecs = cc->rx_usecs;
+	}
+
 	if (data[IFLA_CAN_RESTART]) {
 		/* Do not allow a restart while not running */
 		if (!(dev->flags & IFF_UP))
@@ -737,8 +1337,11 @@ static size_t can_get_size(const struct net_device *dev)
 	size += nla_total_size(sizeof(u32));  /* IFLA_CAN_RESTART_MS */
 	size += sizeof(struct can_bittiming); /* IFLA_CAN_BITTIMING */
 	size += sizeof(struct can_clock);     /* IFLA_CAN_CLOCK */
+	size += nla_total_size(sizeof(u32));  /* IFLA_CAN_RX_STEER */
 	if (priv->do_get_berr_counter)        /* IFLA_CAN_BERR_COUNTER */
 		size += sizeof(struct can_berr_counter);
+	if (priv->coalesce_napi)	      /* IFLA_CAN_COALESCE */
+		size += nla_total_size(sizeof(struct can_coalesce));
 	if (priv->bittiming_const)	      /* IFLA_CAN_BITTIMING_CONST */
 		size += sizeof(struct can_bittiming_const);
 
@@ -760,8 +1363,12 @@ static int can_fill_info(struct sk_buff *skb, const struct net_device *dev)
 	NLA_PUT(skb, IFLA_CAN_BITTIMING,
 		sizeof(priv->bittiming), &priv->bittiming);
 	NLA_PUT(skb, IFLA_CAN_CLOCK, sizeof(cm), &priv->clock);
+	NLA_PUT_U32(skb, IFLA_CAN_RX_STEER, priv->rx_steer);
 	if (priv->do_get_berr_counter && !priv->do_get_berr_counter(dev, &bec))
 		NLA_PUT(skb, IFLA_CAN_BERR_COUNTER, sizeof(bec), &bec);
+	if (priv->coalesce_napi)
+		NLA_PUT(skb, IFLA_CAN_COALESCE,
+			sizeof(priv->coalesce), &priv->coalesce);
 	if (priv->bittiming_const)
 		NLA_PUT(skb, IFLA_CAN_BITTIMING_CONST,
 			sizeof(*priv->bittiming_const), priv->bittiming_const);
@@ -772,17 +1379,35 @@ nla_put_failure:
 	return -EMSGSIZE;
 }
 
+/* struct can_device_stats, followed by struct can_bus_load if available */
+struct can_xstats {
+	struct can_device_stats can_stats;
+	struct can_bus_load bus_load;
+};
+
 static size_t can_get_xstats_size(const struct net_device *dev)
 {
+#ifdef CAN_BUS_LOAD
+	return sizeof(struct can_xstats);
+#else
 	return sizeof(struct can_device_stats);
+#endif
 }
 
 static int can_fill_xstats(struct sk_buff *skb, const struct net_device *dev)
 {
 	struct can_priv *priv = netdev_priv(dev);
+#ifdef CAN_BUS_LOAD
+	struct can_xstats xs;
 
+	xs.can_stats = priv->can_stats;
+	can_get_bus_load(dev, &xs.bus_load);
+
+	NLA_PUT(skb, IFLA_INFO_XSTATS, sizeof(xs), &xs);
+#else
 	NLA_PUT(skb, IFLA_INFO_XSTATS,
 		sizeof(priv->can_stats), &priv->can_stats);
+#endif
 
 	return 0;
 
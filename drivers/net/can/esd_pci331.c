@@ -67,6 +67,8 @@ MODULE_SUPPORTED_DEVICE("esd CAN-PCI/331, CAN-CPCI/331, CAN-PMC/331");
 #define ESD331_DPRSIZE			1024
 /* Max. messages to handle per interrupt */
 #define ESD331_MAX_INTERRUPT_WORK	8
+/* Max. messages copied from the card's fifo at once */
+#define ESD331_RX_BURST			16
 #define ESD331_MAX_BOARD_MESSAGES	5
 #define ESD331_RTR_FLAG			0x10
 #define ESD331_ERR_OK			0x00
@@ -101,6 +103,16 @@ MODULE_SUPPORTED_DEVICE("esd CAN-PCI/331, CAN-CPCI/331, CAN-PMC/331");
 
 #define ESD331_ECHO_SKB_MAX		1
 
+/*
+ * The interrupt handler only acks the card, the fifo is consumed in a NAPI
+ * poll per board. The nets share the fifo, so the NAPI context is hosted
+ * by a dummy netdev of the board.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+#define ESD331_NAPI
+#define ESD331_NAPI_WEIGHT		32
+#endif
+
 static struct pci_device_id esd331_pci_tbl[] = {
 	{PCI_VENDOR_ID_PLX, PCI_DEVICE_ID_PLX_9050,
 	PCI_VENDOR_ID_ESDGMBH, ESD_PCI_SUB_SYS_ID_PCI331},
@@ -150,6 +162,11 @@ struct esd331_pci {
 	struct esd331_dpr *dpr;
 	int eff_supp;
 	int net_count;
+	struct esd331_can_msg rx_buf[ESD331_RX_BURST];
+#ifdef ESD331_NAPI
+	struct net_device napi_dev;
+	struct napi_struct napi;
+#endif
 };
 
 struct esd331_priv {
@@ -277,45 +294,55 @@ static int esd331_write(struct esd331_can_msg *mesg, struct esd331_pci *board)
 	return err;
 }
 
-static int esd331_read(struct esd331_can_msg *mesg, struct esd331_pci *board)
+/*
+ * Copy up to max messages from the card's fifo. Only the contiguous part
+ * up to the end of the ring is taken, so one memcpy_fromio() does.
+ */
+static int esd331_read_burst(struct esd331_pci *board,
+				struct esd331_can_msg *mesg, int max)
 {
 	u16 in;
 	u16 out;
 	unsigned long irq_flags;
-	int err = -ENODATA;
+	int cnt = 0;
+	int i;
 
 	spin_lock_irqsave(&board->irq_lock, irq_flags);
 
 	out = be16_to_cpu(readw(&board->dpr->tx_ou));
 	in = be16_to_cpu(readw(&board->dpr->tx_in));
 
-	if (in != out) {
-		u16 *ptr1;
-		u16 *ptr2;
-		int ll;
+	if ((in != out) && (in < ESD331_DPRSIZE) && (out < ESD331_DPRSIZE)) {
+		cnt = (in > out) ? in - out : ESD331_DPRSIZE - out;
+		if (cnt > max)
+			cnt = max;
 
-		ptr1 = (u16 *)mesg;
-		ptr2 = (u16 *)&board->dpr->tx_buff[out];
-		for (ll = 0; ll < ESD331_CM_SSIZE; ll++)
-			*ptr1++ = readw(ptr2++);
+		memcpy_fromio(mesg, &board->dpr->tx_buff[out],
+				cnt * sizeof(*mesg));
 
-		out++;
+		out += cnt;
 		out %= ESD331_DPRSIZE;
 
 		wmb();
 		writew(cpu_to_be16(out), &board->dpr->tx_ou);
+	}
+
+	spin_unlock_irqrestore(&board->irq_lock, irq_flags);
 
+	for (i = 0; i < cnt; i++, mesg++) {
 		mesg->id = be16_to_cpu(mesg->id);
 		mesg->len = be16_to_cpu(mesg->len);
 		mesg->x1 = be16_to_cpu(mesg->x1);
 		mesg->x2 = be16_to_cpu(mesg->x2);
 		mesg->x3 = be16_to_cpu(mesg->x3);
-
-		err = 0;
 	}
 
-	spin_unlock_irqrestore(&board->irq_lock, irq_flags);
-	return err;
+	return cnt;
+}
+
+static int esd331_read(struct esd331_can_msg *mesg, struct esd331_pci *board)
+{
+	return (esd331_read_burst(board, mesg, 1) == 1) ? 0 : -ENODATA;
 }
 
 static int esd331_write_allid(u8 net, struct esd331_pci *board)
@@ -406,6 +433,17 @@ static int esd331_read_features(struct esd331_pci *board)
 	return (board->net_count < 1) ? -EIO : 0;
 }
 
+static inline void esd331_rx_skb(struct sk_buff *skb)
+{
+	can_rx_steer(skb);
+	can_rx_bus_load(skb);
+#ifdef ESD331_NAPI
+	netif_receive_skb(skb);
+#else
+	netif_rx(skb);
+#endif
+}
+
 static int esd331_create_err_frame(struct net_device *dev, canid_t idflags,
 					u8 d1)
 {
@@ -426,7 +464,7 @@ static int esd331_create_err_frame(struct net_device *dev, canid_t idflags,
 	cf->can_id |= idflags;
 	cf->data[1] = d1;
 
-	netif_rx(skb);
+	esd331_rx_skb(skb);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
 	dev->last_rx = jiffies;
@@ -472,7 +510,7 @@ static void esd331_irq_rx(struct net_device *dev, struct esd331_can_msg *msg,
 	for (i = 0; i < cfrm->can_dlc; ++i)
 		cfrm->data[i] = msg->data[i];
 
-	netif_rx(skb);
+	esd331_rx_skb(skb);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
 	dev->last_rx = jiffies;
@@ -523,63 +561,103 @@ static void esd331_handle_errmsg(struct net_device *dev,
 
 }
 
-static void esd331_handle_messages(struct esd331_pci *board)
+static void esd331_handle_msg(struct esd331_pci *board,
+				struct esd331_can_msg *msg)
 {
 	struct net_device *dev;
 	struct esd331_priv *priv;
 	struct net_device_stats *stats;
-	struct esd331_can_msg msg;
-	int msg_count = ESD331_MAX_INTERRUPT_WORK;
 
-	while ((esd331_read(&msg, board) == 0) && (msg_count--)) {
-		if (unlikely((msg.net >= ESD331_MAX_CAN)
-				|| (board->dev[msg.net] == NULL)))
-			continue;
+	if (unlikely((msg->net >= ESD331_MAX_CAN)
+			|| (board->dev[msg->net] == NULL)))
+		return;
 
-		dev = board->dev[msg.net];
-		priv = netdev_priv(dev);
-		if (priv->can.state == CAN_STATE_STOPPED)
-			continue;
+	dev = board->dev[msg->net];
+	priv = netdev_priv(dev);
+	if (priv->can.state == CAN_STATE_STOPPED)
+		return;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
-		stats = can_get_stats(dev);
+	stats = can_get_stats(dev);
 #else
-		stats = &dev->stats;
+	stats = &dev->stats;
 #endif
-		switch (msg.cmmd) {
+	switch (msg->cmmd) {
 
-		case ESD331_I20_BCAN:
-		case ESD331_I20_EX_BCAN:
-			esd331_irq_rx(dev, &msg,
-					(msg.cmmd == ESD331_I20_EX_BCAN));
-			break;
+	case ESD331_I20_BCAN:
+	case ESD331_I20_EX_BCAN:
+		esd331_irq_rx(dev, msg, (msg->cmmd == ESD331_I20_EX_BCAN));
+		break;
 
-		case ESD331_I20_TXDONE:
-		case ESD331_I20_EX_TXDONE:
-			stats->tx_packets++;
-			stats->tx_bytes += msg.x1;
-			can_get_echo_skb(dev, 0);
-			netif_wake_queue(dev);
-			break;
+	case ESD331_I20_TXDONE:
+	case ESD331_I20_EX_TXDONE:
+		stats->tx_packets++;
+		stats->tx_bytes += msg->x1;
+		can_get_echo_skb(dev, 0);
+		netif_wake_queue(dev);
+		break;
 
-		case ESD331_I20_TXTOUT:
-		case ESD331_I20_EX_TXTOUT:
-			stats->tx_errors++;
-			stats->tx_dropped++;
-			can_free_echo_skb(dev, 0);
-			netif_wake_queue(dev);
-			break;
+	case ESD331_I20_TXTOUT:
+	case ESD331_I20_EX_TXTOUT:
+		stats->tx_errors++;
+		stats->tx_dropped++;
+		can_free_echo_skb(dev, 0);
+		netif_wake_queue(dev);
+		break;
 
-		case ESD331_I20_ERROR:
-			esd331_handle_errmsg(dev, &msg);
-			break;
+	case ESD331_I20_ERROR:
+		esd331_handle_errmsg(dev, msg);
+		break;
 
-		default:
+	default:
+		break;
+	}
+}
+
+/* handle up to quota messages of the card's fifo, burst by burst */
+static int esd331_handle_messages(struct esd331_pci *board, int quota)
+{
+	int work = 0;
+	int cnt;
+	int i;
+
+	while (work < quota) {
+		cnt = esd331_read_burst(board, board->rx_buf,
+				min(quota - work, ESD331_RX_BURST));
+		if (!cnt)
 			break;
-		}
+
+		for (i = 0; i < cnt; i++)
+			esd331_handle_msg(board, &board->rx_buf[i]);
+		work += cnt;
 	}
+
+	return work;
+}
+
+#ifdef ESD331_NAPI
+static int esd331_rx_pending(struct esd331_pci *board)
+{
+	return readw(&board->dpr->tx_in) != readw(&board->dpr->tx_ou);
 }
 
+static int esd331_poll(struct napi_struct *napi, int quota)
+{
+	struct esd331_pci *board = container_of(napi, struct esd331_pci, napi);
+	int work;
+
+	work = esd331_handle_messages(board, quota);
+	if (work < quota) {
+		napi_complete(napi);
+		/* messages whose interrupt came in while polling */
+		if (esd331_rx_pending(board) && napi_schedule_prep(napi))
+			__napi_schedule(napi);
+	}
+
+	return work;
+}
+#endif
+
 static int esd331_all_nets_stopped(struct esd331_pci *board)
 {
 	int i;
@@ -611,7 +689,11 @@ irqreturn_t esd331_interrupt(int irq, void *dev_id)
 		return IRQ_NONE;
 
 	writew(0xffff, board->base_addr2 + ESD331_OFFS_IRQ_ACK);
-	esd331_handle_messages(board);
+#ifdef ESD331_NAPI
+	napi_schedule(&board->napi);
+#else
+	esd331_handle_messages(board, ESD331_MAX_INTERRUPT_WORK);
+#endif
 
 	return IRQ_HANDLED;
 }
@@ -871,6 +953,13 @@ retry_features:
 	if (esd331_write_fast(board))
 		dev_err(&pdev->dev, "failed to enable fast mode\n");
 
+#ifdef ESD331_NAPI
+	init_dummy_netdev(&board->napi_dev);
+	netif_napi_add(&board->napi_dev, &board->napi, esd331_poll,
+			ESD331_NAPI_WEIGHT);
+	napi_enable(&board->napi);
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,18)
 	err = request_irq(pdev->irq, &esd331_interrupt, SA_SHIRQ, "pci331",
 			(void *)board);
@@ -880,11 +969,17 @@ retry_features:
 #endif
 	if (err) {
 		err = -EAGAIN;
-		goto failure_iounmap_base2;
+		goto failure_napi;
 	}
 	pci_set_drvdata(pdev, board);
 	return 0;
 
+failure_napi:
+#ifdef ESD331_NAPI
+	napi_disable(&board->napi);
+	netif_napi_del(&board->napi);
+#endif
+
 failure_iounmap_base2:
 	pci_iounmap(pdev, board->base_addr2);
 
@@ -910,6 +1005,10 @@ static void __devexit esd331_pci_remove_one(struct pci_dev *pdev)
 
 	esd331_disable_irq(board->conf_addr);
 	free_irq(pdev->irq, (void *)board);
+#ifdef ESD331_NAPI
+	napi_disable(&board->napi);
+	netif_napi_del(&board->napi);
+#endif
 
 	for (i = 0; i < ESD331_MAX_CAN; i++) {
 		if (board->dev[i] == NULL)
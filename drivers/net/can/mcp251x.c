@@ -143,6 +143,7 @@
 #  define TXBCTRL_MLOA	0x20
 #  define TXBCTRL_TXERR 0x10
 #  define TXBCTRL_TXREQ 0x08
+#  define TXBCTRL_TXP_MASK 0x03
 #define TXBSIDH(n)  (((n) * 0x10) + 0x30 + TXBSIDH_OFF)
 #  define SIDH_SHIFT    3
 #define TXBSIDL(n)  (((n) * 0x10) + 0x30 + TXBSIDL_OFF)
@@ -198,7 +199,30 @@
 #define SPI_TRANSFER_BUF_LEN	(6 + CAN_FRAME_MAX_DATA_LEN)
 #define CAN_FRAME_MAX_BITS	128
 
-#define TX_ECHO_SKB_MAX	1
+/*
+ * Behind the single register area the buffers hold the pre-built
+ * transfers of the interrupt service: the CANINTF/EFLG status read, both
+ * READ RX BUFFER instructions and the flag acknowledges.
+ */
+#define SPI_STATUS_OFF		SPI_TRANSFER_BUF_LEN
+#define SPI_RXB_OFF(n)		(SPI_STATUS_OFF + 4 + \
+				 (n) * SPI_TRANSFER_BUF_LEN)
+#define SPI_INTF_OFF		SPI_RXB_OFF(2)
+#define SPI_EFLG_OFF		(SPI_INTF_OFF + 4)
+#define SPI_BUF_LEN		(SPI_EFLG_OFF + 4)
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
+#define MCP251X_THREADED_IRQ
+#endif
+
+/*
+ * All three transmit buffers are used. The chip sends the pending buffer
+ * with the highest TXP priority first, so consecutive frames get falling
+ * priorities to keep the order of the queue. Once the lowest priority
+ * has been handed out, new frames wait until all buffers are drained.
+ */
+#define TX_ECHO_SKB_MAX	3
+#define TX_BUSY_ALL	((1 << TX_ECHO_SKB_MAX) - 1)
 
 #define DEVICE_NAME "mcp251x"
 
@@ -223,14 +247,23 @@ struct mcp251x_priv {
 	struct net_device *net;
 	struct spi_device *spi;
 
+	struct mutex mcp_lock; /* interrupt service lock */
 	struct mutex spi_lock; /* SPI buffer lock */
 	u8 *spi_tx_buf;
 	u8 *spi_rx_buf;
 	dma_addr_t spi_tx_dma;
 	dma_addr_t spi_rx_dma;
 
+	/* pre-built transfers of the interrupt service */
+	struct spi_transfer status_xfer;
+	struct spi_transfer rxb_xfer[2];
+	struct spi_transfer intf_xfer;
+	struct spi_transfer eflg_xfer;
+
 	struct sk_buff *tx_skb;
-	int tx_len;
+	int tx_len[TX_ECHO_SKB_MAX];
+	u8 tx_busy;	/* bitmask of the transmit buffers in use */
+	int tx_prio;	/* TXP priority of the next frame */
 	struct workqueue_struct *wq;
 	struct work_struct tx_work;
 	struct work_struct irq_work;
@@ -248,13 +281,31 @@ static void mcp251x_clean(struct net_device *net)
 {
 	struct mcp251x_priv *priv = netdev_priv(net);
 
+	int i;
+
 	net->stats.tx_errors++;
 	if (priv->tx_skb)
 		dev_kfree_skb(priv->tx_skb);
-	if (priv->tx_len)
-		can_free_echo_skb(priv->net, 0);
+	for (i = 0; i < TX_ECHO_SKB_MAX; i++)
+		if (priv->tx_busy & (1 << i))
+			can_free_echo_skb(priv->net, i);
 	priv->tx_skb = NULL;
-	priv->tx_len = 0;
+	priv->tx_busy = 0;
+	priv->tx_prio = TXBCTRL_TXP_MASK;
+}
+
+/* a transmit buffer and a priority are left for the next frame */
+static inline int mcp251x_tx_ready(struct mcp251x_priv *priv)
+{
+	return priv->tx_busy != TX_BUSY_ALL && priv->tx_prio >= 0;
+}
+
+static void mcp251x_tx_abort(struct spi_device *spi)
+{
+	int i;
+
+	for (i = 0; i < TX_ECHO_SKB_MAX; i++)
+		mcp251x_write_reg(spi, TXBCTRL(i), 0);
 }
 
 /*
@@ -298,6 +349,64 @@ static int mcp251x_spi_trans(struct spi_device *spi, int len)
 	return ret;
 }
 
+static void mcp251x_init_xfer(struct mcp251x_priv *priv,
+			      struct spi_transfer *t, int off, int len)
+{
+	memset(t, 0, sizeof(*t));
+	t->tx_buf = priv->spi_tx_buf + off;
+	t->rx_buf = priv->spi_rx_buf + off;
+	t->len = len;
+	if (mcp251x_enable_dma) {
+		t->tx_dma = priv->spi_tx_dma + off;
+		t->rx_dma = priv->spi_rx_dma + off;
+	}
+}
+
+static void mcp251x_init_xfers(struct mcp251x_priv *priv)
+{
+	mcp251x_init_xfer(priv, &priv->status_xfer, SPI_STATUS_OFF, 4);
+	priv->spi_tx_buf[SPI_STATUS_OFF] = INSTRUCTION_READ;
+	priv->spi_tx_buf[SPI_STATUS_OFF + 1] = CANINTF;
+
+	mcp251x_init_xfer(priv, &priv->rxb_xfer[0], SPI_RXB_OFF(0),
+			  SPI_TRANSFER_BUF_LEN);
+	priv->spi_tx_buf[SPI_RXB_OFF(0)] = INSTRUCTION_READ_RXB(0);
+	mcp251x_init_xfer(priv, &priv->rxb_xfer[1], SPI_RXB_OFF(1),
+			  SPI_TRANSFER_BUF_LEN);
+	priv->spi_tx_buf[SPI_RXB_OFF(1)] = INSTRUCTION_READ_RXB(1);
+
+	mcp251x_init_xfer(priv, &priv->intf_xfer, SPI_INTF_OFF, 4);
+	priv->spi_tx_buf[SPI_INTF_OFF] = INSTRUCTION_BIT_MODIFY;
+	priv->spi_tx_buf[SPI_INTF_OFF + 1] = CANINTF;
+	priv->spi_tx_buf[SPI_INTF_OFF + 3] = 0x00;
+
+	mcp251x_init_xfer(priv, &priv->eflg_xfer, SPI_EFLG_OFF, 4);
+	priv->spi_tx_buf[SPI_EFLG_OFF] = INSTRUCTION_BIT_MODIFY;
+	priv->spi_tx_buf[SPI_EFLG_OFF + 1] = EFLG;
+	priv->spi_tx_buf[SPI_EFLG_OFF + 3] = 0x00;
+}
+
+/*
+ * Send the transfers queued in m as one SPI message. The chip takes
+ * every transfer as a separate instruction, so chip select is toggled
+ * between them.
+ */
+static int mcp251x_spi_batch(struct spi_device *spi, struct spi_message *m)
+{
+	struct spi_transfer *t;
+	int ret;
+
+	list_for_each_entry(t, &m->transfers, transfer_list)
+		t->cs_change = !list_is_last(&t->transfer_list, &m->transfers);
+
+	m->is_dma_mapped = mcp251x_enable_dma;
+
+	ret = spi_sync(spi, m);
+	if (ret)
+		dev_err(&spi->dev, "spi transfer failed: ret = %d\n", ret);
+	return ret;
+}
+
 static u8 mcp251x_read_reg(struct spi_device *spi, uint8_t reg)
 {
 	struct mcp251x_priv *priv = dev_get_drvdata(&spi->dev);
@@ -331,6 +440,27 @@ static void mcp251x_write_reg(struct spi_device *spi, u8 reg, uint8_t val)
 	mutex_unlock(&priv->spi_lock);
 }
 
+static void mcp251x_read_status(struct spi_device *spi, u8 *intf, u8 *eflag)
+{
+	struct mcp251x_priv *priv = dev_get_drvdata(&spi->dev);
+	struct spi_message m;
+
+	mutex_lock(&priv->spi_lock);
+
+	spi_message_init(&m);
+	spi_message_add_tail(&priv->status_xfer, &m);
+
+	if (mcp251x_spi_batch(spi, &m)) {
+		*intf = 0;
+		*eflag = 0;
+	} else {
+		*intf = priv->spi_rx_buf[SPI_STATUS_OFF + 2];
+		*eflag = priv->spi_rx_buf[SPI_STATUS_OFF + 3];
+	}
+
+	mutex_unlock(&priv->spi_lock);
+}
+
 static void mcp251x_write_bits(struct spi_device *spi, u8 reg,
 			       u8 mask, uint8_t val)
 {
@@ -371,7 +501,7 @@ static void mcp251x_hw_tx_frame(struct spi_device *spi, u8 *buf,
 }
 
 static void mcp251x_hw_tx(struct spi_device *spi, struct can_frame *frame,
-			  int tx_buf_idx)
+			  int tx_buf_idx, int tx_prio)
 {
 	u32 sid, eid, exide, rtr;
 	u8 buf[SPI_TRANSFER_BUF_LEN];
@@ -394,7 +524,7 @@ static void mcp251x_hw_tx(struct spi_device *spi, struct can_frame *frame,
 	buf[TXBDLC_OFF] = (rtr << DLC_RTR_SHIFT) | frame->can_dlc;
 	memcpy(buf + TXBDAT_OFF, frame->data, frame->can_dlc);
 	mcp251x_hw_tx_frame(spi, buf, frame->can_dlc, tx_buf_idx);
-	mcp251x_write_reg(spi, TXBCTRL(tx_buf_idx), TXBCTRL_TXREQ);
+	mcp251x_write_reg(spi, TXBCTRL(tx_buf_idx), TXBCTRL_TXREQ | tx_prio);
 }
 
 static void mcp251x_hw_rx_frame(struct spi_device *spi, u8 *buf,
@@ -423,12 +553,11 @@ static void mcp251x_hw_rx_frame(struct spi_device *spi, u8 *buf,
 	}
 }
 
-static void mcp251x_hw_rx(struct spi_device *spi, int buf_idx)
+static void mcp251x_hw_rx_skb(struct spi_device *spi, const u8 *buf)
 {
 	struct mcp251x_priv *priv = dev_get_drvdata(&spi->dev);
 	struct sk_buff *skb;
 	struct can_frame *frame;
-	u8 buf[SPI_TRANSFER_BUF_LEN];
 
 	skb = alloc_can_skb(priv->net, &frame);
 	if (!skb) {
@@ -437,7 +566,6 @@ static void mcp251x_hw_rx(struct spi_device *spi, int buf_idx)
 		return;
 	}
 
-	mcp251x_hw_rx_frame(spi, buf, buf_idx);
 	if (buf[RXBSIDL_OFF] & RXBSIDL_IDE) {
 		/* Extended ID format */
 		frame->can_id = CAN_EFF_FLAG;
@@ -464,9 +592,67 @@ static void mcp251x_hw_rx(struct spi_device *spi, int buf_idx)
 
 	priv->net->stats.rx_packets++;
 	priv->net->stats.rx_bytes += frame->can_dlc;
+	can_rx_steer(skb);
+	can_rx_bus_load(skb);
 	netif_rx(skb);
 }
 
+static void mcp251x_hw_rx(struct spi_device *spi, int buf_idx)
+{
+	u8 buf[SPI_TRANSFER_BUF_LEN];
+
+	mcp251x_hw_rx_frame(spi, buf, buf_idx);
+	mcp251x_hw_rx_skb(spi, buf);
+}
+
+/*
+ * MCP2515 only: fetch the signalled receive buffers with READ RX BUFFER,
+ * which releases each buffer when chip select rises, and acknowledge the
+ * remaining interrupt and overflow flags within the same message.
+ */
+static void mcp251x_hw_rx_ack(struct spi_device *spi, u8 intf, u8 eflag)
+{
+	struct mcp251x_priv *priv = dev_get_drvdata(&spi->dev);
+	u8 buf[2][SPI_TRANSFER_BUF_LEN];
+	u8 rx = intf & (CANINTF_RX0IF | CANINTF_RX1IF);
+	struct spi_message m;
+	int i;
+
+	mutex_lock(&priv->spi_lock);
+
+	spi_message_init(&m);
+
+	for (i = 0; i < 2; i++)
+		if (rx & (CANINTF_RX0IF << i))
+			spi_message_add_tail(&priv->rxb_xfer[i], &m);
+
+	intf &= ~(CANINTF_RX0IF | CANINTF_RX1IF);
+	if (intf) {
+		priv->spi_tx_buf[SPI_INTF_OFF + 2] = intf;
+		spi_message_add_tail(&priv->intf_xfer, &m);
+	}
+
+	eflag &= EFLG_RX0OVR | EFLG_RX1OVR;
+	if (eflag) {
+		priv->spi_tx_buf[SPI_EFLG_OFF + 2] = eflag;
+		spi_message_add_tail(&priv->eflg_xfer, &m);
+	}
+
+	if (list_empty(&m.transfers) || mcp251x_spi_batch(spi, &m))
+		rx = 0;
+
+	for (i = 0; i < 2; i++)
+		if (rx & (CANINTF_RX0IF << i))
+			memcpy(buf[i], priv->spi_rx_buf + SPI_RXB_OFF(i),
+			       SPI_TRANSFER_BUF_LEN);
+
+	mutex_unlock(&priv->spi_lock);
+
+	for (i = 0; i < 2; i++)
+		if (rx & (CANINTF_RX0IF << i))
+			mcp251x_hw_rx_skb(spi, buf[i]);
+}
+
 static void mcp251x_hw_sleep(struct spi_device *spi)
 {
 	mcp251x_write_reg(spi, CANCTRL, CANCTRL_REQOP_SLEEP);
@@ -482,7 +668,7 @@ static netdev_tx_t mcp251x_hard_start_xmit(struct sk_buff *skb,
 	struct mcp251x_priv *priv = netdev_priv(net);
 	struct spi_device *spi = priv->spi;
 
-	if (priv->tx_skb || priv->tx_len) {
+	if (priv->tx_skb) {
 		dev_warn(&spi->dev, "hard_xmit called while tx busy\n");
 		netif_stop_queue(net);
 		return NETDEV_TX_BUSY;
@@ -644,6 +830,21 @@ static int mcp251x_hw_probe(struct spi_device *spi)
 	return (st1 == 0x80 && st2 == 0x07) ? 1 : 0;
 }
 
+static void mcp251x_can_service(struct mcp251x_priv *priv);
+
+#ifdef MCP251X_THREADED_IRQ
+static irqreturn_t mcp251x_can_ist(int irq, void *dev_id)
+{
+	struct net_device *net = (struct net_device *)dev_id;
+	struct mcp251x_priv *priv = netdev_priv(net);
+
+	mutex_lock(&priv->mcp_lock);
+	mcp251x_can_service(priv);
+	mutex_unlock(&priv->mcp_lock);
+
+	return IRQ_HANDLED;
+}
+#else
 static irqreturn_t mcp251x_can_isr(int irq, void *dev_id)
 {
 	struct net_device *net = (struct net_device *)dev_id;
@@ -655,6 +856,7 @@ static irqreturn_t mcp251x_can_isr(int irq, void *dev_id)
 
 	return IRQ_HANDLED;
 }
+#endif
 
 static int mcp251x_open(struct net_device *net)
 {
@@ -674,10 +876,17 @@ static int mcp251x_open(struct net_device *net)
 
 	priv->force_quit = 0;
 	priv->tx_skb = NULL;
-	priv->tx_len = 0;
+	priv->tx_busy = 0;
+	priv->tx_prio = TXBCTRL_TXP_MASK;
 
+#ifdef MCP251X_THREADED_IRQ
+	ret = request_threaded_irq(spi->irq, NULL, mcp251x_can_ist,
+				   IRQF_TRIGGER_FALLING | IRQF_ONESHOT,
+				   DEVICE_NAME, net);
+#else
 	ret = request_irq(spi->irq, mcp251x_can_isr,
 			  IRQF_TRIGGER_FALLING, DEVICE_NAME, net);
+#endif
 	if (ret) {
 		dev_err(&spi->dev, "failed to acquire irq %d\n", spi->irq);
 		if (pdata->transceiver_enable)
@@ -718,8 +927,8 @@ static int mcp251x_stop(struct net_device *net)
 	free_irq(spi->irq, net);
 	flush_workqueue(priv->wq);
 
-	mcp251x_write_reg(spi, TXBCTRL(0), 0);
-	if (priv->tx_skb || priv->tx_len)
+	mcp251x_tx_abort(spi);
+	if (priv->tx_skb || priv->tx_busy)
 		mcp251x_clean(net);
 
 	mcp251x_hw_sleep(spi);
@@ -739,6 +948,9 @@ static void mcp251x_tx_work_handler(struct work_struct *ws)
 	struct spi_device *spi = priv->spi;
 	struct net_device *net = priv->net;
 	struct can_frame *frame;
+	int idx;
+
+	mutex_lock(&priv->mcp_lock);
 
 	if (priv->tx_skb) {
 		frame = (struct can_frame *)priv->tx_skb->data;
@@ -746,25 +958,52 @@ static void mcp251x_tx_work_handler(struct work_struct *ws)
 		if (priv->can.state == CAN_STATE_BUS_OFF) {
 			mcp251x_clean(net);
 			netif_wake_queue(net);
-			return;
+			goto out;
 		}
+
+		/* picked up again when a transmit buffer completes */
+		if (!mcp251x_tx_ready(priv))
+			goto out;
+
 		if (frame->can_dlc > CAN_FRAME_MAX_DATA_LEN)
 			frame->can_dlc = CAN_FRAME_MAX_DATA_LEN;
-		mcp251x_hw_tx(spi, frame, 0);
-		priv->tx_len = 1 + frame->can_dlc;
-		can_put_echo_skb(priv->tx_skb, net, 0);
+		idx = ffz(priv->tx_busy);
+		mcp251x_hw_tx(spi, frame, idx, priv->tx_prio--);
+		priv->tx_len[idx] = frame->can_dlc;
+		priv->tx_busy |= 1 << idx;
+		can_put_echo_skb(priv->tx_skb, net, idx);
 		priv->tx_skb = NULL;
+
+		if (mcp251x_tx_ready(priv))
+			netif_wake_queue(net);
 	}
+out:
+	mutex_unlock(&priv->mcp_lock);
 }
 
 static void mcp251x_irq_work_handler(struct work_struct *ws)
 {
 	struct mcp251x_priv *priv = container_of(ws, struct mcp251x_priv,
 						 irq_work);
+
+	mutex_lock(&priv->mcp_lock);
+	mcp251x_can_service(priv);
+	mutex_unlock(&priv->mcp_lock);
+}
+
+/*
+ * Interrupt service, called with mcp_lock held from the threaded irq
+ * handler or from irq_work (restart, resume and kernels without
+ * threaded interrupts).
+ */
+static void mcp251x_can_service(struct mcp251x_priv *priv)
+{
+	struct mcp251x_platform_data *pdata = priv->spi->dev.platform_data;
 	struct spi_device *spi = priv->spi;
 	struct net_device *net = priv->net;
 	u8 intf;
 	enum can_state new_state;
+	int i;
 
 	if (priv->after_suspend) {
 		mdelay(10);
@@ -775,7 +1014,7 @@ static void mcp251x_irq_work_handler(struct work_struct *ws)
 		} else if (priv->after_suspend & AFTER_SUSPEND_UP) {
 			netif_device_attach(net);
 			/* Clean since we lost tx buffer */
-			if (priv->tx_skb || priv->tx_len) {
+			if (priv->tx_skb || priv->tx_busy) {
 				mcp251x_clean(net);
 				netif_wake_queue(net);
 			}
@@ -795,28 +1034,31 @@ static void mcp251x_irq_work_handler(struct work_struct *ws)
 
 		if (priv->restart_tx) {
 			priv->restart_tx = 0;
-			mcp251x_write_reg(spi, TXBCTRL(0), 0);
-			if (priv->tx_skb || priv->tx_len)
+			mcp251x_tx_abort(spi);
+			if (priv->tx_skb || priv->tx_busy)
 				mcp251x_clean(net);
 			netif_wake_queue(net);
 			can_id |= CAN_ERR_RESTARTED;
 		}
 
-		intf = mcp251x_read_reg(spi, CANINTF);
-
-		if (intf & CANINTF_RX0IF) {
-			mcp251x_hw_rx(spi, 0);
-			/* Free one buffer ASAP */
-			mcp251x_write_bits(spi, CANINTF, intf & CANINTF_RX0IF, 0x00);
-                }
+		mcp251x_read_status(spi, &intf, &eflag);
 
-		if (intf & CANINTF_RX1IF)
-			mcp251x_hw_rx(spi, 1);
+		if (pdata->model == CAN_MCP251X_MCP2510) {
+			if (intf & CANINTF_RX0IF) {
+				mcp251x_hw_rx(spi, 0);
+				/* Free one buffer ASAP */
+				mcp251x_write_bits(spi, CANINTF,
+						   intf & CANINTF_RX0IF, 0x00);
+			}
 
-		mcp251x_write_bits(spi, CANINTF, intf, 0x00);
+			if (intf & CANINTF_RX1IF)
+				mcp251x_hw_rx(spi, 1);
 
-		eflag = mcp251x_read_reg(spi, EFLG);
-		mcp251x_write_reg(spi, EFLG, 0x00);
+			mcp251x_write_bits(spi, CANINTF, intf, 0x00);
+			mcp251x_write_reg(spi, EFLG, 0x00);
+		} else {
+			mcp251x_hw_rx_ack(spi, intf, eflag);
+		}
 
 		/* Update can state */
 		if (eflag & EFLG_TXBO) {
@@ -899,13 +1141,22 @@ static void mcp251x_irq_work_handler(struct work_struct *ws)
 			break;
 
 		if (intf & (CANINTF_TX2IF | CANINTF_TX1IF | CANINTF_TX0IF)) {
-			net->stats.tx_packets++;
-			net->stats.tx_bytes += priv->tx_len - 1;
-			if (priv->tx_len) {
-				can_get_echo_skb(net, 0);
-				priv->tx_len = 0;
+			for (i = 0; i < TX_ECHO_SKB_MAX; i++) {
+				if (!(intf & (CANINTF_TX0IF << i)) ||
+				    !(priv->tx_busy & (1 << i)))
+					continue;
+				net->stats.tx_packets++;
+				net->stats.tx_bytes += priv->tx_len[i];
+				can_get_echo_skb(net, i);
+				priv->tx_busy &= ~(1 << i);
 			}
-			netif_wake_queue(net);
+			if (!priv->tx_busy)
+				priv->tx_prio = TXBCTRL_TXP_MASK;
+
+			if (priv->tx_skb)
+				queue_work(priv->wq, &priv->tx_work);
+			else if (mcp251x_tx_ready(priv))
+				netif_wake_queue(net);
 		}
 	}
 }
@@ -957,6 +1208,7 @@ static int __devinit mcp251x_can_probe(struct spi_device *spi)
 	dev_set_drvdata(&spi->dev, priv);
 
 	priv->spi = spi;
+	mutex_init(&priv->mcp_lock);
 	mutex_init(&priv->spi_lock);
 
 	/* If requested, allocate DMA buffers */
@@ -985,18 +1237,20 @@ static int __devinit mcp251x_can_probe(struct spi_device *spi)
 
 	/* Allocate non-DMA buffers */
 	if (!mcp251x_enable_dma) {
-		priv->spi_tx_buf = kmalloc(SPI_TRANSFER_BUF_LEN, GFP_KERNEL);
+		priv->spi_tx_buf = kzalloc(SPI_BUF_LEN, GFP_KERNEL);
 		if (!priv->spi_tx_buf) {
 			ret = -ENOMEM;
 			goto error_tx_buf;
 		}
-		priv->spi_rx_buf = kmalloc(SPI_TRANSFER_BUF_LEN, GFP_KERNEL);
+		priv->spi_rx_buf = kmalloc(SPI_BUF_LEN, GFP_KERNEL);
 		if (!priv->spi_rx_buf) {
 			ret = -ENOMEM;
 			goto error_rx_buf;
 		}
 	}
 
+	mcp251x_init_xfers(priv);
+
 	if (pdata->power_enable)
 		pdata->power_enable(1);
 
@@ -342,7 +342,8 @@ static int __devinit mpc52xx_can_probe(struct of_device *ofdev,
 	struct mscan_priv *priv;
 	struct resource res;
 	void __iomem *base;
-	int err, irq, res_size, clock_src;
+	const u32 *pval;
+	int err, irq, plen, res_size, clock_src;
 
 	err = of_address_to_resource(np, 0, &res);
 	if (err) {
@@ -384,6 +385,10 @@ static int __devinit mpc52xx_can_probe(struct of_device *ofdev,
 	priv->reg_base = base;
 	dev->irq = irq;
 
+	pval = of_get_property(np, "fsl,mscan-napi-weight", &plen);
+	if (pval && plen == sizeof(*pval) && *pval > 0)
+		mscan_set_napi_weight(dev, *pval);
+
 	/*
 	 * Either the oscillator clock (SYS_XTAL_IN) or the IP bus clock
 	 * (IP_CLK) can be selected as MSCAN clock source. According to
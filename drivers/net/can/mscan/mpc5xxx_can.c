@@ -266,7 +266,8 @@ static int __devinit mpc5xxx_can_probe(struct of_device *ofdev,
 	struct mscan_priv *priv;
 	void __iomem *base;
 	const char *clock_name = NULL;
-	int irq, mscan_clksrc = 0;
+	const u32 *pval;
+	int irq, plen, mscan_clksrc = 0;
 	int err = -ENOMEM;
 
 	base = of_iomap(np, 0);
@@ -290,6 +291,10 @@ static int __devinit mpc5xxx_can_probe(struct of_device *ofdev,
 	priv->reg_base = base;
 	dev->irq = irq;
 
+	pval = of_get_property(np, "fsl,mscan-napi-weight", &plen);
+	if (pval && plen == sizeof(*pval) && *pval > 0)
+		mscan_set_napi_weight(dev, *pval);
+
 	clock_name = of_get_property(np, "fsl,mscan-clock-source", NULL);
 
 	BUG_ON(!data);
@@ -40,8 +40,17 @@
 #include "mscan.h"
 
 #include <socketcan/can/version.h>	/* for RCSID. Removed by mkpatch script */
+
 RCSID("$Id$");
 
+/*
+ * NAPI weight of the MSCAN interfaces. The board code may set another
+ * value per interface, e.g. from the device tree.
+ */
+static int napi_weight = 8;
+module_param(napi_weight, int, S_IRUGO);
+MODULE_PARM_DESC(napi_weight, "NAPI weight of the interfaces (default: 8)");
+
 static struct can_bittiming_const mscan_bittiming_const = {
 	.name = "mscan",
 	.tseg1_min = 4,
@@ -443,37 +452,61 @@ static int mscan_rx_poll(struct net_device *dev, int *budget)
 	int npackets = 0;
 	int ret = 1;
 	struct sk_buff *skb;
-	struct can_frame *frame;
+	struct can_frame *cf;
+	struct can_frame frames[MSCAN_RX_FIFO_DEPTH];
+	struct can_rx_list rx_list;
 	u8 canrflg;
+	int i, n;
 
-	while (npackets < quota) {
-		canrflg = in_8(&regs->canrflg);
-		if (!(canrflg & (MSCAN_RXF | MSCAN_ERR_IF)))
-			break;
+	can_rx_list_init(&rx_list);
 
-		skb = alloc_can_skb(dev, &frame);
-		if (!skb) {
-			if (printk_ratelimit())
-				dev_notice(ND2D(dev), "packet dropped\n");
-			stats->rx_dropped++;
-			out_8(&regs->canrflg, canrflg);
-			continue;
+	while (npackets < quota) {
+		/*
+		 * Empty the RX FIFO into the local buffer first, so that
+		 * the chip gets its buffers back before the frames go up
+		 * the stack.
+		 */
+		for (n = 0; n < MSCAN_RX_FIFO_DEPTH && npackets + n < quota;
+		     n++) {
+			canrflg = in_8(&regs->canrflg);
+			if (!(canrflg & (MSCAN_RXF | MSCAN_ERR_IF)))
+				break;
+
+			memset(&frames[n], 0, sizeof(frames[n]));
+			if (canrflg & MSCAN_RXF)
+				mscan_get_rx_frame(dev, &frames[n]);
+			else
+				mscan_get_err_frame(dev, &frames[n], canrflg);
 		}
+		if (!n)
+			break;
 
-		if (canrflg & MSCAN_RXF)
-			mscan_get_rx_frame(dev, frame);
-		else if (canrflg & MSCAN_ERR_IF)
-			mscan_get_err_frame(dev, frame, canrflg);
+		for (i = 0; i < n; i++) {
+			skb = alloc_can_skb(dev, &cf);
+			if (!skb) {
+				if (printk_ratelimit())
+					dev_notice(ND2D(dev),
+						   "packet dropped\n");
+				stats->rx_dropped++;
+				continue;
+			}
+			memcpy(cf, &frames[i], sizeof(*cf));
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
-		dev->last_rx = jiffies;
+			dev->last_rx = jiffies;
 #endif
-		stats->rx_packets++;
-		stats->rx_bytes += frame->can_dlc;
-		npackets++;
-		netif_receive_skb(skb);
+			stats->rx_packets++;
+			stats->rx_bytes += cf->can_dlc;
+			can_rx_steer(skb);
+			can_rx_bus_load(skb);
+			can_rx_napi_id(skb, &priv->napi);
+			can_rx_list_add(&rx_list, skb);
+		}
+		npackets += n;
 	}
 
+	can_rx_list_flush(&rx_list);
+
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,23)
 	*budget -= npackets;
 	dev->quota -= npackets;
@@ -755,13 +788,13 @@ struct net_device *alloc_mscandev(void)
 	dev->flags |= IFF_ECHO;	/* we support local echo */
 
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,28)
-	netif_napi_add(dev, &priv->napi, mscan_rx_poll, 8);
+	netif_napi_add(dev, &priv->napi, mscan_rx_poll, napi_weight);
 #elif LINUX_VERSION_CODE > KERNEL_VERSION(2,6,23)
 	priv->dev = dev;
-	netif_napi_add(dev, &priv->napi, mscan_rx_poll, 8);
+	netif_napi_add(dev, &priv->napi, mscan_rx_poll, napi_weight);
 #else
 	dev->poll = mscan_rx_poll;
-	dev->weight = 8;
+	dev->weight = napi_weight;
 #endif
 
 	priv->can.bittiming_const = &mscan_bittiming_const;
@@ -777,6 +810,17 @@ struct net_device *alloc_mscandev(void)
 	return dev;
 }
 
+void mscan_set_napi_weight(struct net_device *dev, int weight)
+{
+#if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,23)
+	struct mscan_priv *priv = netdev_priv(dev);
+
+	priv->napi.weight = weight;
+#else
+	dev->weight = weight;
+#endif
+}
+
 MODULE_AUTHOR("Andrey Volkov <avolkov@varma-el.com>");
 MODULE_LICENSE("GPL v2");
 MODULE_DESCRIPTION("CAN port driver for a MSCAN based chips");
@@ -244,6 +244,7 @@ struct mscan_regs {
 #define MSCAN_POWEROFF_MODE	(MSCAN_CSWAI | MSCAN_SLPRQ)
 #define MSCAN_SET_MODE_RETRIES	255
 #define MSCAN_ECHO_SKB_MAX	3
+#define MSCAN_RX_FIFO_DEPTH	5
 #define MSCAN_RX_INTS_ENABLE	(MSCAN_OVRIE | MSCAN_RXFIE | MSCAN_CSCIE | \
 				 MSCAN_RSTATE1 | MSCAN_RSTATE0 | \
 				 MSCAN_TSTATE1 | MSCAN_TSTATE0)
@@ -316,5 +317,6 @@ struct mscan_platform_data {
 extern struct net_device *alloc_mscandev(void);
 extern int register_mscandev(struct net_device *dev, int mscan_clksrc);
 extern void unregister_mscandev(struct net_device *dev);
+extern void mscan_set_napi_weight(struct net_device *dev, int weight);
 
 #endif /* __MSCAN_H__ */
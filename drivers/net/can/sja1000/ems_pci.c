@@ -58,6 +58,8 @@ struct ems_pci_card {
 
 	void __iomem *conf_addr;
 	void __iomem *base_addr;
+
+	int irq_requested;
 };
 
 #define EMS_PCI_CAN_CLOCK (16000000 / 2)
@@ -79,6 +81,7 @@ struct ems_pci_card {
  */
 #define PLX_ICSR            0x4c   /* Interrupt Control/Status register */
 #define PLX_ICSR_LINTI1_ENA 0x0001 /* LINTi1 Enable */
+#define PLX_ICSR_LINTI1_STA 0x0004 /* LINTi1 Status */
 #define PLX_ICSR_PCIINT_ENA 0x0040 /* PCI Interrupt Enable */
 #define PLX_ICSR_LINTI1_CLR 0x0400 /* Local Edge Triggerable Interrupt Clear */
 #define PLX_ICSR_ENA_CLR    (PLX_ICSR_LINTI1_ENA | PLX_ICSR_PCIINT_ENA | \
@@ -143,15 +146,6 @@ static void ems_pci_v1_write_reg(const struct sja1000_priv *priv,
 	writeb(val, priv->reg_base + (port * 4));
 }
 
-static void ems_pci_v1_post_irq(const struct sja1000_priv *priv)
-{
-	struct ems_pci_card *card = (struct ems_pci_card *)priv->priv;
-
-	/* reset int flag of pita */
-	writel(PITA2_ICR_INT0_EN | PITA2_ICR_INT0,
-	       card->conf_addr + PITA2_ICR);
-}
-
 static u8 ems_pci_v2_read_reg(const struct sja1000_priv *priv, int port)
 {
 	return readb(priv->reg_base + port);
@@ -163,11 +157,59 @@ static void ems_pci_v2_write_reg(const struct sja1000_priv *priv,
 	writeb(val, priv->reg_base + port);
 }
 
-static void ems_pci_v2_post_irq(const struct sja1000_priv *priv)
+static void ems_pci_v2_read_regs(const struct sja1000_priv *priv,
+				 int port, u8 *buf, int len)
 {
-	struct ems_pci_card *card = (struct ems_pci_card *)priv->priv;
+	memcpy_fromio(buf, priv->reg_base + port, len);
+}
 
-	writel(PLX_ICSR_ENA_CLR, card->conf_addr + PLX_ICSR);
+static void ems_pci_v2_write_regs(const struct sja1000_priv *priv,
+				  int port, const u8 *buf, int len)
+{
+	memcpy_toio(priv->reg_base + port, buf, len);
+}
+
+/*
+ * Check and acknowledge the bridge interrupt of the card
+ */
+static int ems_pci_ack_irq(struct ems_pci_card *card)
+{
+	if (card->version == 1) {
+		if (!(readl(card->conf_addr + PITA2_ICR) & PITA2_ICR_INT0))
+			return 0;
+
+		/* reset int flag of pita */
+		writel(PITA2_ICR_INT0_EN | PITA2_ICR_INT0,
+		       card->conf_addr + PITA2_ICR);
+	} else {
+		if (!(readl(card->conf_addr + PLX_ICSR) & PLX_ICSR_LINTI1_STA))
+			return 0;
+
+		writel(PLX_ICSR_ENA_CLR, card->conf_addr + PLX_ICSR);
+	}
+
+	return 1;
+}
+
+/*
+ * One handler per card. All controllers share a single local interrupt
+ * of the bridge, so the bridge status only filters foreign interrupts on
+ * the shared PCI line before the channels are serviced.
+ */
+static irqreturn_t ems_pci_interrupt(int irq, void *dev_id)
+{
+	struct ems_pci_card *card = (struct ems_pci_card *)dev_id;
+	irqreturn_t ret = IRQ_NONE;
+	int n = 0;
+
+	while (ems_pci_ack_irq(card) && (n < SJA1000_MAX_IRQ)) {
+		n++;
+		sja1000_board_interrupt(irq, card->net_dev,
+					(1UL << EMS_PCI_MAX_CHAN) - 1);
+		ret = IRQ_HANDLED;
+	}
+
+	return ret;
 }
 
 /*
@@ -198,7 +240,10 @@ static void ems_pci_del_card(struct pci_dev *pdev)
 	struct net_device *dev;
 	int i = 0;
 
-	for (i = 0; i < card->channels; i++) {
+	if (card->irq_requested)
+		free_irq(pdev->irq, card);
+
+	for (i = 0; i < EMS_PCI_MAX_CHAN; i++) {
 		dev = card->net_dev[i];
 
 		if (!dev)
@@ -315,11 +360,7 @@ static int __devinit ems_pci_add_card(struct pci_dev *pdev,
 		card->net_dev[i] = dev;
 		priv = netdev_priv(dev);
 		priv->priv = card;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,18)
-		priv->irq_flags = SA_SHIRQ;
-#else
-		priv->irq_flags = IRQF_SHARED;
-#endif
+		priv->flags |= SJA1000_CUSTOM_IRQ_HANDLER;
 
 		dev->irq = pdev->irq;
 		priv->reg_base = card->base_addr + EMS_PCI_CAN_BASE_OFFSET
@@ -327,11 +368,11 @@ static int __devinit ems_pci_add_card(struct pci_dev *pdev,
 		if (card->version == 1) {
 			priv->read_reg  = ems_pci_v1_read_reg;
 			priv->write_reg = ems_pci_v1_write_reg;
-			priv->post_irq  = ems_pci_v1_post_irq;
 		} else {
 			priv->read_reg  = ems_pci_v2_read_reg;
 			priv->write_reg = ems_pci_v2_write_reg;
-			priv->post_irq  = ems_pci_v2_post_irq;
+			priv->read_regs  = ems_pci_v2_read_regs;
+			priv->write_regs = ems_pci_v2_write_regs;
 		}
 
 		/* Check if channel is present */
@@ -356,6 +397,7 @@ static int __devinit ems_pci_add_card(struct pci_dev *pdev,
 			if (err) {
 				dev_err(&pdev->dev, "Registering device failed "
 							"(err=%d)\n", err);
+				card->net_dev[i] = NULL;
 				free_sja1000dev(dev);
 				goto failure_cleanup;
 			}
@@ -365,10 +407,19 @@ static int __devinit ems_pci_add_card(struct pci_dev *pdev,
 			dev_info(&pdev->dev, "Channel #%d at 0x%p, irq %d\n",
 					i + 1, priv->reg_base, dev->irq);
 		} else {
+			card->net_dev[i] = NULL;
 			free_sja1000dev(dev);
 		}
 	}
 
+	err = request_irq(pdev->irq, ems_pci_interrupt, IRQF_SHARED,
+			  DRV_NAME, card);
+	if (err) {
+		dev_err(&pdev->dev, "Requesting irq %d failed\n", pdev->irq);
+		goto failure_cleanup;
+	}
+	card->irq_requested = 1;
+
 	return 0;
 
 failure_cleanup:
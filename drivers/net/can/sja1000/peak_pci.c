@@ -73,6 +73,10 @@ struct peak_pci {
 					   control register */
 #define PITA_MISC	     0x1C	/* miscellanoes register */
 
+#define PITA_ICR_SLAVE	     0x0001	/* slave channel irq */
+#define PITA_ICR_MASTER	     0x0002	/* master/single channel irq */
+#define PITA_ICR_MASK	     (PITA_ICR_SLAVE | PITA_ICR_MASTER)
+
 #define PCI_CONFIG_PORT_SIZE 0x1000	/* size of the config io-memory */
 #define PCI_PORT_SIZE        0x0400	/* size of a channel io-memory */
 
@@ -101,20 +105,34 @@ static void peak_pci_write_reg(const struct sja1000_priv *priv,
 	writeb(val, priv->reg_base + (port << 2));
 }
 
-static void peak_pci_post_irq(const struct sja1000_priv *priv)
+/*
+ * One handler per board: the PITA ICR tells which channel raised the
+ * interrupt, so only those controllers are serviced and acknowledged.
+ */
+static irqreturn_t peak_pci_interrupt(int irq, void *dev_id)
 {
+	struct net_device *dev = (struct net_device *)dev_id;
+	struct sja1000_priv *priv = netdev_priv(dev);
 	struct peak_pci *board = priv->priv;
+	struct net_device *devs[2];	/* indexed by ICR bit */
+	irqreturn_t ret = IRQ_NONE;
 	u16 icr_low;
+	int n = 0;
 
-	/* Select and clear in Pita stored interrupt */
-	icr_low = readw(board->conf_addr + PITA_ICR);
-	if (board->channel == PEAK_PCI_SLAVE) {
-		if (icr_low & 0x0001)
-			writew(0x0001, board->conf_addr + PITA_ICR);
-	} else {
-		if (icr_low & 0x0002)
-			writew(0x0002, board->conf_addr + PITA_ICR);
+	devs[0] = board->slave_dev;
+	devs[1] = dev;
+
+	while ((icr_low = readw(board->conf_addr + PITA_ICR) & PITA_ICR_MASK)
+	       && (n < SJA1000_MAX_IRQ)) {
+		n++;
+		sja1000_board_interrupt(irq, devs, icr_low);
+
+		/* clear in Pita stored interrupt */
+		writew(icr_low, board->conf_addr + PITA_ICR);
+		ret = IRQ_HANDLED;
 	}
+
+	return ret;
 }
 
 static void peak_pci_del_chan(struct net_device *dev, int init_step)
@@ -140,9 +158,9 @@ static void peak_pci_del_chan(struct net_device *dev, int init_step)
 	case 4:
 		icr_high = readw(board->conf_addr + PITA_ICR + 2);
 		if (board->channel == PEAK_PCI_SLAVE)
-			icr_high &= ~0x0001;
+			icr_high &= ~PITA_ICR_SLAVE;
 		else
-			icr_high &= ~0x0002;
+			icr_high &= ~PITA_ICR_MASTER;
 		writew(icr_high, board->conf_addr + PITA_ICR + 2);
 	case 3:
 		iounmap(priv->reg_base);
@@ -220,7 +238,6 @@ static int peak_pci_add_chan(struct pci_dev *pdev, int channel,
 
 	priv->read_reg = peak_pci_read_reg;
 	priv->write_reg = peak_pci_write_reg;
-	priv->post_irq = peak_pci_post_irq;
 
 	priv->can.clock.freq = PEAK_PCI_CAN_CLOCK;
 
@@ -231,18 +248,14 @@ static int peak_pci_add_chan(struct pci_dev *pdev, int channel,
 	else
 		priv->cdr = PEAK_PCI_CDR_SINGLE;
 
-	/* Setup interrupt handling */
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,18)
-	priv->irq_flags = SA_SHIRQ;
-#else
-	priv->irq_flags = IRQF_SHARED;
-#endif
+	/* Setup interrupt handling, the board irq is requested by init_one */
+	priv->flags |= SJA1000_CUSTOM_IRQ_HANDLER;
 	dev->irq = pdev->irq;
 	icr_high = readw(board->conf_addr + PITA_ICR + 2);
 	if (channel == PEAK_PCI_SLAVE)
-		icr_high |= 0x0001;
+		icr_high |= PITA_ICR_SLAVE;
 	else
-		icr_high |= 0x0002;
+		icr_high |= PITA_ICR_MASTER;
 	writew(icr_high, board->conf_addr + PITA_ICR + 2);
 	init_step = 4;
 
@@ -265,6 +278,11 @@ static int peak_pci_add_chan(struct pci_dev *pdev, int channel,
 	return 0;
 
 failure:
+	if (channel == PEAK_PCI_SLAVE) {
+		struct sja1000_priv *master_priv = netdev_priv(*master_dev);
+		struct peak_pci *master_board = master_priv->priv;
+		master_board->slave_dev = NULL;
+	}
 	peak_pci_del_chan(dev, init_step);
 	return err;
 }
@@ -312,12 +330,26 @@ static int __devinit peak_pci_init_one(struct pci_dev *pdev,
 			goto failure_cleanup;
 	}
 
+	err = request_irq(pdev->irq, peak_pci_interrupt, IRQF_SHARED,
+			  DRV_NAME, master_dev);
+	if (err) {
+		printk(KERN_ERR "%s: requesting irq %d failed (err=%d)\n",
+		       DRV_NAME, pdev->irq, err);
+		goto failure_cleanup;
+	}
+
 	pci_set_drvdata(pdev, master_dev);
 	return 0;
 
 failure_cleanup:
-	if (master_dev)
+	if (master_dev) {
+		struct sja1000_priv *priv = netdev_priv(master_dev);
+		struct peak_pci *board = priv->priv;
+
+		if (board->slave_dev)
+			peak_pci_del_chan(board->slave_dev, 0);
 		peak_pci_del_chan(master_dev, 0);
+	}
 
 	pci_release_regions(pdev);
 
@@ -332,6 +364,8 @@ static void __devexit peak_pci_remove_one(struct pci_dev *pdev)
 	struct sja1000_priv *priv = netdev_priv(dev);
 	struct peak_pci *board = priv->priv;
 
+	free_irq(pdev->irq, dev);
+
 	if (board->slave_dev)
 		peak_pci_del_chan(board->slave_dev, 0);
 	peak_pci_del_chan(dev, 0);
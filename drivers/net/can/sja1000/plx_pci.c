@@ -210,6 +210,19 @@ static void plx_pci_write_reg(const struct sja1000_priv *priv, int port, u8 val)
 	iowrite8(val, priv->reg_base + port);
 }
 
+/* frame buffer access for chips in a memory BAR */
+static void plx_pci_read_regs(const struct sja1000_priv *priv, int port,
+			      u8 *buf, int len)
+{
+	memcpy_fromio(buf, priv->reg_base + port, len);
+}
+
+static void plx_pci_write_regs(const struct sja1000_priv *priv, int port,
+			       const u8 *buf, int len)
+{
+	memcpy_toio(priv->reg_base + port, buf, len);
+}
+
 /*
  * Check if a CAN controller is present at the specified location
  * by trying to switch 'em from the Basic mode into the PeliCAN mode.
@@ -406,6 +419,10 @@ static int __devinit plx_pci_add_card(struct pci_dev *pdev,
 		priv->reg_base = addr + cm->offset;
 		priv->read_reg = plx_pci_read_reg;
 		priv->write_reg = plx_pci_write_reg;
+		if (pci_resource_flags(pdev, cm->bar) & IORESOURCE_MEM) {
+			priv->read_regs = plx_pci_read_regs;
+			priv->write_regs = plx_pci_write_regs;
+		}
 
 		/* Check if channel is present */
 		if (plx_pci_check_sja1000(priv)) {
@@ -102,6 +102,43 @@ static void sja1000_write_cmdreg(struct sja1000_priv *priv, u8 val)
 	spin_unlock_irqrestore(&priv->cmdreg_lock, flags);
 }
 
+/*
+ * read resp. write the frame buffer at REG_FI - with one bus transfer when
+ * the adapter provides read_regs()/write_regs()
+ */
+static void sja1000_read_frame(const struct sja1000_priv *priv, u8 *buf)
+{
+	int len, i;
+
+	if (priv->read_regs) {
+		priv->read_regs(priv, REG_FI, buf, SJA1000_FRAME_LEN);
+		return;
+	}
+
+	buf[0] = priv->read_reg(priv, REG_FI);
+
+	len = (buf[0] & FI_FF) ? 5 : 3;
+	if (!(buf[0] & FI_RTR))
+		len += get_can_dlc(buf[0] & 0x0F);
+
+	for (i = 1; i < len; i++)
+		buf[i] = priv->read_reg(priv, REG_FI + i);
+}
+
+static void sja1000_write_frame(const struct sja1000_priv *priv,
+				const u8 *buf, int len)
+{
+	int i;
+
+	if (priv->write_regs) {
+		priv->write_regs(priv, REG_FI, buf, len);
+		return;
+	}
+
+	for (i = 0; i < len; i++)
+		priv->write_reg(priv, REG_FI + i, buf[i]);
+}
+
 static int sja1000_probe_chip(struct net_device *dev)
 {
 	struct sja1000_priv *priv = netdev_priv(dev);
@@ -138,6 +175,15 @@ static void set_reset_mode(struct net_device *dev)
 	dev_err(ND2D(dev), "setting SJA1000 into reset mode failed!\n");
 }
 
+/* the interrupts that are enabled in normal mode */
+static inline u8 sja1000_irq_mask(const struct sja1000_priv *priv)
+{
+	if (priv->can.ctrlmode & CAN_CTRLMODE_BERR_REPORTING)
+		return IRQ_ALL;
+	else
+		return IRQ_ALL & ~IRQ_BEI;
+}
+
 static void set_normal_mode(struct net_device *dev)
 {
 	struct sja1000_priv *priv = netdev_priv(dev);
@@ -149,16 +195,12 @@ static void set_normal_mode(struct net_device *dev)
 		if ((status & MOD_RM) == 0) {
 			priv->can.state = CAN_STATE_ERROR_ACTIVE;
 			/* enable interrupts */
-			if (priv->can.ctrlmode & CAN_CTRLMODE_BERR_REPORTING)
-				priv->write_reg(priv, REG_IER, IRQ_ALL);
-			else
-				priv->write_reg(priv, REG_IER,
-						IRQ_ALL & ~IRQ_BEI);
+			priv->write_reg(priv, REG_IER, sja1000_irq_mask(priv));
 			return;
 		}
 
-		/* set chip to normal mode */
-		priv->write_reg(priv, REG_MOD, 0x00);
+		/* set chip to normal mode (keeping the filter mode) */
+		priv->write_reg(priv, REG_MOD, status & MOD_AFM);
 		udelay(10);
 		status = priv->read_reg(priv, REG_MOD);
 	}
@@ -236,6 +278,102 @@ static int sja1000_get_berr_counter(const struct net_device *dev,
 	return 0;
 }
 
+/*
+ * Get the acceptance code and the checked bits of it. In single filter
+ * mode the 32 bit code/mask registers cover the identifier bits of
+ * either frame format: ID.28-18 in bits 31-21 for SFF frames and
+ * ID.28-0 in bits 31-3 for EFF frames. When both formats are subscribed
+ * only the identifier bits common to both filters can be checked.
+ */
+static void sja1000_filter_regs(const struct can_hw_filter *f,
+				u32 *acc_code, u32 *acc_care)
+{
+	u32 code = 0, care = 0;
+	int n = 0;
+
+	if (!(f->flags & CAN_HW_FILTER_NO_SFF)) {
+		code = (f->sff_id & f->sff_mask & CAN_SFF_MASK) << 21;
+		care = (f->sff_mask & CAN_SFF_MASK) << 21;
+		n++;
+	}
+
+	if (!(f->flags & CAN_HW_FILTER_NO_EFF)) {
+		u32 c = (f->eff_id & f->eff_mask & CAN_EFF_MASK) << 3;
+		u32 m = (f->eff_mask & CAN_EFF_MASK) << 3;
+
+		if (n++) {
+			care &= m & ~(code ^ c);
+			code &= care;
+		} else {
+			code = c;
+			care = m;
+		}
+	}
+
+	/* no CAN frame receivers at all (e.g. error frames only): accept all */
+	if (!n)
+		care = 0;
+
+	*acc_code = code;
+	*acc_care = care;
+}
+
+/* program the acceptance filter (chip in reset mode) */
+static void sja1000_write_filter(struct net_device *dev, u32 code, u32 care)
+{
+	struct sja1000_priv *priv = netdev_priv(dev);
+	int i;
+
+	priv->acc_code = code;
+	priv->acc_care = care;
+
+	for (i = 0; i < 4; i++) {
+		priv->write_reg(priv, REG_ACCC0 + i, code >> (24 - 8 * i));
+		priv->write_reg(priv, REG_ACCM0 + i, ~care >> (24 - 8 * i));
+	}
+
+	/* single filter mode, dual filter mode (reset default) for accept all */
+	priv->write_reg(priv, REG_MOD, MOD_RM | (care ? MOD_AFM : 0));
+}
+
+/*
+ * Called from the CAN device work queue when the subscribed filters of
+ * the CAN core changed. The chip has to enter reset mode to update the
+ * acceptance filter which would abort a pending transmission. Reset mode
+ * also clears the receive FIFO: the frames received but not yet read out
+ * are lost. So the chip is only reset when the register values change,
+ * which many receiver changes do not (e.g. the second filter of a socket
+ * in the same identifier range).
+ */
+static int sja1000_set_filter(struct net_device *dev,
+			      const struct can_hw_filter *f)
+{
+	struct sja1000_priv *priv = netdev_priv(dev);
+	u32 code, care;
+	int err = 0;
+
+	if (priv->can.state == CAN_STATE_BUS_OFF)
+		return 0;
+
+	sja1000_filter_regs(f, &code, &care);
+	if (code == priv->acc_code && care == priv->acc_care)
+		return 0;
+
+	netif_tx_lock_bh(dev);
+
+	if (!(priv->read_reg(priv, REG_SR) & SR_TCS)) {
+		err = -EBUSY;
+	} else {
+		set_reset_mode(dev);
+		sja1000_write_filter(dev, code, care);
+		set_normal_mode(dev);
+	}
+
+	netif_tx_unlock_bh(dev);
+
+	return err;
+}
+
 /*
  * initialize SJA1000 chip:
  *   - reset chip
@@ -247,20 +385,16 @@ static int sja1000_get_berr_counter(const struct net_device *dev,
 static void chipset_init(struct net_device *dev)
 {
 	struct sja1000_priv *priv = netdev_priv(dev);
+	struct can_hw_filter f;
+	u32 code, care;
 
 	/* set clock divider and output control register */
 	priv->write_reg(priv, REG_CDR, priv->cdr | CDR_PELICAN);
 
-	/* set acceptance filter (accept all) */
-	priv->write_reg(priv, REG_ACCC0, 0x00);
-	priv->write_reg(priv, REG_ACCC1, 0x00);
-	priv->write_reg(priv, REG_ACCC2, 0x00);
-	priv->write_reg(priv, REG_ACCC3, 0x00);
-
-	priv->write_reg(priv, REG_ACCM0, 0xFF);
-	priv->write_reg(priv, REG_ACCM1, 0xFF);
-	priv->write_reg(priv, REG_ACCM2, 0xFF);
-	priv->write_reg(priv, REG_ACCM3, 0xFF);
+	/* set acceptance filter (accept all without the filter offload) */
+	can_get_hw_filter(dev, &f);
+	sja1000_filter_regs(&f, &code, &care);
+	sja1000_write_filter(dev, code, care);
 
 	priv->write_reg(priv, REG_OCR, priv->ocr | OCR_MODE_NORMAL);
 }
@@ -280,11 +414,11 @@ static netdev_tx_t sja1000_start_xmit(struct sk_buff *skb,
 {
 	struct sja1000_priv *priv = netdev_priv(dev);
 	struct can_frame *cf = (struct can_frame *)skb->data;
+	uint8_t buf[SJA1000_FRAME_LEN];
 	uint8_t fi;
 	uint8_t dlc;
 	canid_t id;
 	uint8_t dreg;
-	int i;
 
 	if (can_dropped_invalid_skb(dev, skb))
 		return NETDEV_TX_OK;
@@ -297,23 +431,23 @@ static netdev_tx_t sja1000_start_xmit(struct sk_buff *skb,
 	if (id & CAN_RTR_FLAG)
 		fi |= FI_RTR;
 
+	/* build the frame buffer content starting at REG_FI */
 	if (id & CAN_EFF_FLAG) {
 		fi |= FI_FF;
 		dreg = EFF_BUF;
-		priv->write_reg(priv, REG_FI, fi);
-		priv->write_reg(priv, REG_ID1, (id & 0x1fe00000) >> (5 + 16));
-		priv->write_reg(priv, REG_ID2, (id & 0x001fe000) >> (5 + 8));
-		priv->write_reg(priv, REG_ID3, (id & 0x00001fe0) >> 5);
-		priv->write_reg(priv, REG_ID4, (id & 0x0000001f) << 3);
+		buf[REG_ID1 - REG_FI] = (id & 0x1fe00000) >> (5 + 16);
+		buf[REG_ID2 - REG_FI] = (id & 0x001fe000) >> (5 + 8);
+		buf[REG_ID3 - REG_FI] = (id & 0x00001fe0) >> 5;
+		buf[REG_ID4 - REG_FI] = (id & 0x0000001f) << 3;
 	} else {
 		dreg = SFF_BUF;
-		priv->write_reg(priv, REG_FI, fi);
-		priv->write_reg(priv, REG_ID1, (id & 0x000007f8) >> 3);
-		priv->write_reg(priv, REG_ID2, (id & 0x00000007) << 5);
+		buf[REG_ID1 - REG_FI] = (id & 0x000007f8) >> 3;
+		buf[REG_ID2 - REG_FI] = (id & 0x00000007) << 5;
 	}
+	buf[0] = fi;
 
-	for (i = 0; i < dlc; i++)
-		priv->write_reg(priv, dreg++, cf->data[i]);
+	memcpy(buf + dreg - REG_FI, cf->data, dlc);
+	sja1000_write_frame(priv, buf, dreg - REG_FI + dlc);
 
 	dev->trans_start = jiffies;
 
@@ -334,39 +468,39 @@ static void sja1000_rx(struct net_device *dev)
 #endif
 	struct can_frame *cf;
 	struct sk_buff *skb;
+	uint8_t buf[SJA1000_FRAME_LEN];
 	uint8_t fi;
 	uint8_t dreg;
 	canid_t id;
-	int i;
 
 	/* create zero'ed CAN frame buffer */
 	skb = alloc_can_skb(dev, &cf);
 	if (skb == NULL)
 		return;
 
-	fi = priv->read_reg(priv, REG_FI);
+	sja1000_read_frame(priv, buf);
+	fi = buf[0];
 
 	if (fi & FI_FF) {
 		/* extended frame format (EFF) */
 		dreg = EFF_BUF;
-		id = (priv->read_reg(priv, REG_ID1) << (5 + 16))
-		    | (priv->read_reg(priv, REG_ID2) << (5 + 8))
-		    | (priv->read_reg(priv, REG_ID3) << 5)
-		    | (priv->read_reg(priv, REG_ID4) >> 3);
+		id = (buf[REG_ID1 - REG_FI] << (5 + 16))
+		    | (buf[REG_ID2 - REG_FI] << (5 + 8))
+		    | (buf[REG_ID3 - REG_FI] << 5)
+		    | (buf[REG_ID4 - REG_FI] >> 3);
 		id |= CAN_EFF_FLAG;
 	} else {
 		/* standard frame format (SFF) */
 		dreg = SFF_BUF;
-		id = (priv->read_reg(priv, REG_ID1) << 3)
-		    | (priv->read_reg(priv, REG_ID2) >> 5);
+		id = (buf[REG_ID1 - REG_FI] << 3)
+		    | (buf[REG_ID2 - REG_FI] >> 5);
 	}
 
 	if (fi & FI_RTR) {
 		id |= CAN_RTR_FLAG;
 	} else {
 		cf->can_dlc = get_can_dlc(fi & 0x0F);
-		for (i = 0; i < cf->can_dlc; i++)
-			cf->data[i] = priv->read_reg(priv, dreg++);
+		memcpy(cf->data, buf + dreg - REG_FI, cf->can_dlc);
 	}
 
 	cf->can_id = id;
@@ -374,7 +508,14 @@ static void sja1000_rx(struct net_device *dev)
 	/* release receive buffer */
 	sja1000_write_cmdreg(priv, CMD_RRB);
 
+	can_rx_steer(skb);
+	can_rx_bus_load(skb);
+#ifdef SJA1000_NAPI
+	can_rx_napi_id(skb, &priv->napi);
+	can_rx_list_add(&priv->rx_list, skb);
+#else
 	netif_rx(skb);
+#endif
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
 	dev->last_rx = jiffies;
@@ -491,7 +632,11 @@ static int sja1000_err(struct net_device *dev, uint8_t isrc, uint8_t status)
 
 	priv->can.state = state;
 
+#ifdef SJA1000_NAPI
+	can_rx_list_add(&priv->rx_list, skb);
+#else
 	netif_rx(skb);
+#endif
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
 	dev->last_rx = jiffies;
@@ -502,6 +647,54 @@ static int sja1000_err(struct net_device *dev, uint8_t isrc, uint8_t status)
 	return 0;
 }
 
+#ifdef SJA1000_NAPI
+/*
+ * The receive and error interrupts are disabled in the interrupt handler
+ * until the poll has read the RX FIFO within the given quota. The error
+ * interrupt bits are clear on read - the ISR saves them in priv->irq_err.
+ * With IFLA_CAN_COALESCE the receive interrupt may stay disabled until the
+ * next poll from the moderation timer.
+ */
+static int sja1000_poll(struct napi_struct *napi, int quota)
+{
+	struct net_device *dev = napi->dev;
+	struct sja1000_priv *priv = netdev_priv(dev);
+	int work_done = 0;
+	uint8_t isrc = priv->irq_err;
+	uint8_t status = priv->read_reg(priv, REG_SR);
+
+	can_rx_list_init(&priv->rx_list);
+
+	if (isrc) {
+		priv->irq_err = 0;
+		if (!sja1000_err(dev, isrc, status))
+			work_done++;
+	}
+
+	while ((status & SR_RBS) && work_done < quota) {
+		sja1000_rx(dev);
+		work_done++;
+		status = priv->read_reg(priv, REG_SR);
+	}
+
+	can_rx_list_flush(&priv->rx_list);
+
+	if (work_done < quota) {
+		uint8_t ier = sja1000_irq_mask(priv);
+
+		if (!can_coalesce_complete(dev, work_done))
+			ier &= ~IRQ_RI;
+
+		/* not after a set_reset_mode() from close or bus-off */
+		if (priv->can.state != CAN_STATE_STOPPED &&
+		    priv->can.state != CAN_STATE_BUS_OFF)
+			priv->write_reg(priv, REG_IER, ier);
+	}
+
+	return work_done;
+}
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,19)
 irqreturn_t sja1000_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 #else
@@ -539,6 +732,15 @@ irqreturn_t sja1000_interrupt(int irq, void *dev_id)
 			can_get_echo_skb(dev, 0);
 			netif_wake_queue(dev);
 		}
+#ifdef SJA1000_NAPI
+		if (isrc & (IRQ_RI | IRQ_ERR)) {
+			/* receive or error interrupt -> napi */
+			priv->irq_err |= isrc & IRQ_ERR;
+			priv->write_reg(priv, REG_IER, sja1000_irq_mask(priv) &
+					~(IRQ_RI | IRQ_ERR));
+			napi_schedule(&priv->napi);
+		}
+#else
 		if (isrc & IRQ_RI) {
 			/* receive interrupt */
 			while (status & SR_RBS) {
@@ -546,11 +748,12 @@ irqreturn_t sja1000_interrupt(int irq, void *dev_id)
 				status = priv->read_reg(priv, REG_SR);
 			}
 		}
-		if (isrc & (IRQ_DOI | IRQ_EI | IRQ_BEI | IRQ_EPI | IRQ_ALI)) {
+		if (isrc & IRQ_ERR) {
 			/* error interrupt */
 			if (sja1000_err(dev, isrc, status))
 				break;
 		}
+#endif
 	}
 
 	if (priv->post_irq)
@@ -563,6 +766,37 @@ irqreturn_t sja1000_interrupt(int irq, void *dev_id)
 }
 EXPORT_SYMBOL_GPL(sja1000_interrupt);
 
+/*
+ * Dispatcher for boards with several controllers on one interrupt line:
+ * the board handler reads its bridge interrupt status once and passes the
+ * signalling channels as bitmask, so idle controllers are not polled.
+ */
+irqreturn_t sja1000_board_interrupt(int irq, struct net_device **devs,
+				    unsigned long pending)
+{
+	irqreturn_t ret = IRQ_NONE;
+	int i;
+
+	while (pending) {
+		i = __ffs(pending);
+		pending &= pending - 1;
+
+		if (!devs[i])
+			continue;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,19)
+		if (sja1000_interrupt(irq, devs[i], NULL) == IRQ_HANDLED)
+			ret = IRQ_HANDLED;
+#else
+		if (sja1000_interrupt(irq, devs[i]) == IRQ_HANDLED)
+			ret = IRQ_HANDLED;
+#endif
+	}
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(sja1000_board_interrupt);
+
 static int sja1000_open(struct net_device *dev)
 {
 	struct sja1000_priv *priv = netdev_priv(dev);
@@ -591,6 +825,10 @@ static int sja1000_open(struct net_device *dev)
 	memset(&priv->can.net_stats, 0, sizeof(priv->can.net_stats));
 #endif
 
+#ifdef SJA1000_NAPI
+	napi_enable(&priv->napi);
+#endif
+
 	/* init and start chi */
 	sja1000_start(dev);
 	priv->open_time = jiffies;
@@ -605,6 +843,9 @@ static int sja1000_close(struct net_device *dev)
 	struct sja1000_priv *priv = netdev_priv(dev);
 
 	netif_stop_queue(dev);
+#ifdef SJA1000_NAPI
+	napi_disable(&priv->napi);
+#endif
 	set_reset_mode(dev);
 
 	if (!(priv->flags & SJA1000_CUSTOM_IRQ_HANDLER))
@@ -633,12 +874,18 @@ struct net_device *alloc_sja1000dev(int sizeof_priv)
 	priv->can.bittiming_const = &sja1000_bittiming_const;
 	priv->can.do_set_bittiming = sja1000_set_bittiming;
 	priv->can.do_set_mode = sja1000_set_mode;
+	priv->can.do_set_filter = sja1000_set_filter;
 	priv->can.do_get_berr_counter = sja1000_get_berr_counter;
 	priv->can.ctrlmode_supported = CAN_CTRLMODE_3_SAMPLES |
 		CAN_CTRLMODE_BERR_REPORTING;
 
 	spin_lock_init(&priv->cmdreg_lock);
 
+#ifdef SJA1000_NAPI
+	netif_napi_add(dev, &priv->napi, sja1000_poll, SJA1000_NAPI_WEIGHT);
+	priv->can.coalesce_napi = &priv->napi;
+#endif
+
 	if (sizeof_priv)
 		priv->priv = (void *)priv + sizeof(struct sja1000_priv);
 
@@ -54,6 +54,15 @@
 
 #define SJA1000_MAX_IRQ 20	/* max. number of interrupts handled in ISR */
 
+/*
+ * With NAPI the received frames and the error interrupts are processed in
+ * sja1000_poll() while the ISR only handles the tx complete interrupts.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+#define SJA1000_NAPI
+#define SJA1000_NAPI_WEIGHT 16
+#endif
+
 /* SJA1000 registers - manual section 6.4 (Pelican Mode) */
 #define REG_MOD		0x00
 #define REG_CMR		0x01
@@ -96,6 +105,9 @@
 
 #define CAN_RAM		0x20
 
+/* frame info, 4 byte EFF identifier and 8 data bytes from REG_FI on */
+#define SJA1000_FRAME_LEN 13
+
 /* mode register */
 #define MOD_RM		0x01
 #define MOD_LOM		0x02
@@ -121,6 +133,7 @@
 #define IRQ_RI		0x01
 #define IRQ_ALL		0xFF
 #define IRQ_OFF		0x00
+#define IRQ_ERR		(IRQ_DOI | IRQ_EI | IRQ_BEI | IRQ_EPI | IRQ_ALI)
 
 /* status register content */
 #define SR_BS		0x80
@@ -159,6 +172,15 @@ struct sja1000_priv {
 	/* the lower-layer is responsible for appropriate locking */
 	u8 (*read_reg) (const struct sja1000_priv *priv, int reg);
 	void (*write_reg) (const struct sja1000_priv *priv, int reg, u8 val);
+
+	/*
+	 * optional access to len consecutive registers, e.g. for adapters
+	 * that map the chip linearly - used for the rx/tx frame buffers
+	 */
+	void (*read_regs) (const struct sja1000_priv *priv, int reg,
+			   u8 *buf, int len);
+	void (*write_regs) (const struct sja1000_priv *priv, int reg,
+			    const u8 *buf, int len);
 	void (*pre_irq) (const struct sja1000_priv *priv);
 	void (*post_irq) (const struct sja1000_priv *priv);
 
@@ -173,6 +195,14 @@ struct sja1000_priv {
 	u16 flags;		/* custom mode flags */
 	u8 ocr;			/* output control register */
 	u8 cdr;			/* clock divider register */
+	u32 acc_code;		/* programmed acceptance code ... */
+	u32 acc_care;		/* ... and the checked bits of it */
+
+#ifdef SJA1000_NAPI
+	struct napi_struct napi;
+	struct can_rx_list rx_list; /* frames of the current poll */
+	u8 irq_err;		/* error interrupts deferred to the poll */
+#endif
 };
 
 struct net_device *alloc_sja1000dev(int sizeof_priv);
@@ -185,5 +215,7 @@ irqreturn_t sja1000_interrupt(int irq, void *dev_id, struct pt_regs *regs);
 #else
 irqreturn_t sja1000_interrupt(int irq, void *dev_id);
 #endif
+irqreturn_t sja1000_board_interrupt(int irq, struct net_device **devs,
+				    unsigned long pending);
 
 #endif /* SJA1000_DEV_H */
@@ -61,7 +61,9 @@
 #include <linux/sched.h>
 #include <linux/delay.h>
 #include <linux/init.h>
+#include <linux/workqueue.h>
 #include <socketcan/can.h>
+#include <socketcan/can/slcan.h>
 
 #include <socketcan/can/version.h> /* for RCSID. Removed by mkpatch script */
 RCSID("$Id$");
@@ -73,6 +75,11 @@ MODULE_ALIAS_LDISC(N_SLCAN);
 MODULE_DESCRIPTION("serial line CAN interface");
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Oliver Hartkopp <socketcan@hartkopp.net>");
+
+#ifndef ETH_P_CANFD
+#define ETH_P_CANFD	0x000D	/* CAN FD 2.0 frame */
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,14)
 static inline void *kzalloc(size_t size, unsigned int __nocast flags)
 {
@@ -122,6 +129,21 @@ MODULE_PARM_DESC(maxdev, "Maximum number of slcan interfaces");
 /* maximum rx buffer len: extended CAN frame with timestamp */
 #define SLC_MTU (sizeof("T1111222281122334455667788EA5F\r")+1)
 
+/* binary mode CAN FD frame before and after (worst case) SLIP escaping */
+#define SLC_BIN_MTU (SLCAN_BIN_HDR + CANFD_MAX_DLEN)
+#define SLC_BIN_XMTU (2 * SLC_BIN_MTU + 2)
+
+/* buffer sizes fitting the frames of all framing modes */
+#define SLC_RBUFF SLC_BIN_MTU
+#define SLC_XMTU SLC_BIN_XMTU
+
+/*
+ * The tx buffer holds several encoded frames. While the tty is busy the
+ * frames from the netdevice queue are appended and go out in one write.
+ */
+#define SLC_TX_FRAMES 16
+#define SLC_XBUFF (SLC_XMTU * SLC_TX_FRAMES)
+
 struct slcan {
 	int			magic;
 
@@ -131,11 +153,13 @@ struct slcan {
 	spinlock_t		lock;
 
 	/* These are pointers to the malloc()ed frame buffers. */
-	unsigned char		rbuff[SLC_MTU];	/* receiver buffer	     */
+	unsigned char		rbuff[SLC_RBUFF]; /* receiver buffer	     */
 	int			rcount;         /* received chars counter    */
-	unsigned char		xbuff[SLC_MTU];	/* transmitter buffer	     */
+	unsigned char		xbuff[SLC_XBUFF]; /* transmitter buffer	     */
 	unsigned char		*xhead;         /* pointer to next XMIT byte */
 	int			xleft;          /* bytes left in XMIT queue  */
+	int			xframes;        /* frames in XMIT queue      */
+	struct work_struct	tx_work;        /* flushes the XMIT queue    */
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
 	/* SLCAN interface statistics. */
@@ -145,6 +169,9 @@ struct slcan {
 	unsigned long		flags;		/* Flag values/ mode etc     */
 #define SLF_INUSE		0		/* Channel in use            */
 #define SLF_ERROR		1               /* Parity, etc. error        */
+#define SLF_ESCAPE		2               /* ESC received (binary)     */
+
+	int			mode;		/* SLCAN_MODE_* framing      */
 
 	unsigned char		leased;
 	dev_t			line;
@@ -196,37 +223,66 @@ static struct net_device_stats *slc_get_stats(struct net_device *dev)
  * T12ABCDEF2AA55 : extended can_id 0x12ABCDEF, can_dlc 2, data 0xAA 0x55
  * r1230 : can_id 0x123, can_dlc 0, no data, remote transmission request
  *
+ * Alternatively the SLCAN_SIOCSMODE tty ioctl selects a compact binary
+ * framing with SLIP escaping (see socketcan/can/slcan.h) which needs about
+ * 16 instead of 27 characters for an 8 byte frame and carries CAN FD
+ * frames in SLCAN_MODE_BINARY_FD.
+ *
  */
 
  /************************************************************************
   *			STANDARD SLCAN DECAPSULATION			 *
   ************************************************************************/
 
-static int asc2nibble(char c)
-{
+/* ASCII hex character to nibble value, 16 marks an illegal character */
+static const u8 slc_nibble[256] = {
+	[0 ... 255] = 16,
+	['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+	['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+	['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+	['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+};
 
-	if ((c >= '0') && (c <= '9'))
-		return c - '0';
+/* Send one decapsulated CAN (FD) frame of size mtu to the network layer */
+static void slc_rx(struct slcan *sl, const struct canfd_frame *cfd, int mtu)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
+	struct net_device_stats *stats = slc_get_stats(sl->dev);
+#endif
+	struct sk_buff *skb;
 
-	if ((c >= 'A') && (c <= 'F'))
-		return c - 'A' + 10;
+	skb = dev_alloc_skb(mtu);
+	if (!skb)
+		return;
 
-	if ((c >= 'a') && (c <= 'f'))
-		return c - 'a' + 10;
+	skb->dev = sl->dev;
+	if (mtu == CANFD_MTU)
+		skb->protocol = htons(ETH_P_CANFD);
+	else
+		skb->protocol = htons(ETH_P_CAN);
+	skb->pkt_type = PACKET_BROADCAST;
+	skb->ip_summed = CHECKSUM_UNNECESSARY;
+	memcpy(skb_put(skb, mtu), cfd, mtu);
+	netif_rx(skb);
 
-	return 16; /* error */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
+	sl->dev->last_rx = jiffies;
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
+	stats->rx_packets++;
+	stats->rx_bytes += cfd->len;
+#else
+	sl->dev->stats.rx_packets++;
+	sl->dev->stats.rx_bytes += cfd->len;
+#endif
 }
 
 /* Send one completely decapsulated can_frame to the network layer */
 static void slc_bump(struct slcan *sl)
 {
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
-	struct net_device_stats *stats = slc_get_stats(sl->dev);
-#endif
-	struct sk_buff *skb;
 	struct can_frame cf;
-	int i, dlc_pos, tmp;
-	unsigned long ultmp;
+	int i, pos, dlc_pos, tmp;
+	canid_t id = 0;
 	char cmd = sl->rbuff[0];
 
 	if ((cmd != 't') && (cmd != 'T') && (cmd != 'r') && (cmd != 'R'))
@@ -237,21 +293,26 @@ static void slc_bump(struct slcan *sl)
 	else
 		dlc_pos = 9; /* dlc position Tiiiiiiiid */
 
+	if (sl->rcount <= dlc_pos)
+		return;
+
 	if (!((sl->rbuff[dlc_pos] >= '0') && (sl->rbuff[dlc_pos] < '9')))
 		return;
 
 	cf.can_dlc = sl->rbuff[dlc_pos] - '0'; /* get can_dlc from ASCII val */
 
-	sl->rbuff[dlc_pos] = 0; /* terminate can_id string */
-
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,25)
-	ultmp = simple_strtoul(sl->rbuff+1, NULL, 16);
-#else
-	if (strict_strtoul(sl->rbuff+1, 16, &ultmp))
+	/* stale bytes from an earlier pdu must not become payload */
+	if (sl->rcount < dlc_pos + 1 + 2 * cf.can_dlc)
 		return;
-#endif
 
-	cf.can_id = ultmp;
+	for (pos = 1; pos < dlc_pos; pos++) {
+		tmp = slc_nibble[sl->rbuff[pos]];
+		if (tmp > 0x0F)
+			return;
+		id = (id << 4) | tmp;
+	}
+
+	cf.can_id = id;
 
 	if (!(cmd & 0x20)) /* NO tiny chars => extended frame format */
 		cf.can_id |= CAN_EFF_FLAG;
@@ -261,41 +322,16 @@ static void slc_bump(struct slcan *sl)
 
 	*(u64 *) (&cf.data) = 0; /* clear payload */
 
-	for (i = 0, dlc_pos++; i < cf.can_dlc; i++) {
+	for (i = 0, pos = dlc_pos + 1; i < cf.can_dlc; i++, pos += 2) {
+		int hi = slc_nibble[sl->rbuff[pos]];
+		int lo = slc_nibble[sl->rbuff[pos + 1]];
 
-		tmp = asc2nibble(sl->rbuff[dlc_pos++]);
-		if (tmp > 0x0F)
-			return;
-		cf.data[i] = (tmp << 4);
-		tmp = asc2nibble(sl->rbuff[dlc_pos++]);
-		if (tmp > 0x0F)
+		/* check both nibbles, an invalid low nibble sets bit 4 */
+		if (hi > 0x0F || lo > 0x0F)
 			return;
-		cf.data[i] |= tmp;
+		cf.data[i] = (hi << 4) | lo;
 	}
-
-
-	skb = dev_alloc_skb(sizeof(struct can_frame));
-	if (!skb)
-		return;
-
-	skb->dev = sl->dev;
-	skb->protocol = htons(ETH_P_CAN);
-	skb->pkt_type = PACKET_BROADCAST;
-	skb->ip_summed = CHECKSUM_UNNECESSARY;
-	memcpy(skb_put(skb, sizeof(struct can_frame)),
-	       &cf, sizeof(struct can_frame));
-	netif_rx(skb);
-
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
-	sl->dev->last_rx = jiffies;
-#endif
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
-	stats->rx_packets++;
-	stats->rx_bytes += cf.can_dlc;
-#else
-	sl->dev->stats.rx_packets++;
-	sl->dev->stats.rx_bytes += cf.can_dlc;
-#endif
+	slc_rx(sl, (struct canfd_frame *) &cf, CAN_MTU);
 }
 
 /* parse tty input stream */
@@ -329,96 +365,289 @@ static void slcan_unesc(struct slcan *sl, unsigned char s)
 }
 
  /************************************************************************
-  *			STANDARD SLCAN ENCAPSULATION			 *
+  *			BINARY SLCAN DECAPSULATION			 *
   ************************************************************************/
 
-/* Encapsulate one can_frame and stuff into a TTY queue. */
-static void slc_encaps(struct slcan *sl, struct can_frame *cf)
+/* Send one completely unescaped binary frame to the network layer */
+static void slc_bump_bin(struct slcan *sl)
+{
+	struct canfd_frame cfd;
+	u8 flags = sl->rbuff[0];
+	int len = sl->rbuff[5];
+	int fd = flags & SLCAN_BIN_FD;
+
+	if (sl->rcount != SLCAN_BIN_HDR + len)
+		return;
+
+	if (fd) {
+		if (sl->mode != SLCAN_MODE_BINARY_FD || len > CANFD_MAX_DLEN)
+			return;
+	} else if (len > CAN_MAX_DLEN)
+		return;
+
+	memset(&cfd, 0, sizeof(cfd));
+	cfd.can_id = (sl->rbuff[1] << 24) | (sl->rbuff[2] << 16) |
+		(sl->rbuff[3] << 8) | sl->rbuff[4];
+	cfd.len = len;
+	if (fd)
+		cfd.flags = flags & (CANFD_BRS | CANFD_ESI);
+	memcpy(cfd.data, &sl->rbuff[SLCAN_BIN_HDR], len);
+
+	slc_rx(sl, &cfd, fd ? CANFD_MTU : CAN_MTU);
+}
+
+/* parse SLIP escaped tty input stream */
+static void slcan_unesc_bin(struct slcan *sl, unsigned char s)
 {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
 	struct net_device_stats *stats = slc_get_stats(sl->dev);
 #endif
-	int actual, idx, i;
-	char cmd;
+
+	switch (s) {
+	case SLCAN_BIN_END:
+		if (!test_and_clear_bit(SLF_ERROR, &sl->flags) &&
+		    (sl->rcount >= SLCAN_BIN_HDR))
+			slc_bump_bin(sl);
+		clear_bit(SLF_ESCAPE, &sl->flags);
+		sl->rcount = 0;
+		return;
+
+	case SLCAN_BIN_ESC:
+		set_bit(SLF_ESCAPE, &sl->flags);
+		return;
+
+	case SLCAN_BIN_ESC_ESC:
+		if (test_and_clear_bit(SLF_ESCAPE, &sl->flags))
+			s = SLCAN_BIN_ESC;
+		break;
+
+	case SLCAN_BIN_ESC_END:
+		if (test_and_clear_bit(SLF_ESCAPE, &sl->flags))
+			s = SLCAN_BIN_END;
+		break;
+	}
+
+	if (!test_bit(SLF_ERROR, &sl->flags))  {
+		if (sl->rcount < SLC_BIN_MTU)  {
+			sl->rbuff[sl->rcount++] = s;
+			return;
+		}
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
+		stats->rx_over_errors++;
+#else
+		sl->dev->stats.rx_over_errors++;
+#endif
+		set_bit(SLF_ERROR, &sl->flags);
+	}
+}
+
+ /************************************************************************
+  *			STANDARD SLCAN ENCAPSULATION			 *
+  ************************************************************************/
+
+static const char slc_hex[] = "0123456789ABCDEF";
+
+/* Encode one can_frame at pos and return the number of characters */
+static int slc_encode(const struct can_frame *cf, unsigned char *pos)
+{
+	unsigned char *p = pos;
+	canid_t id;
+	int i;
 
 	if (cf->can_id & CAN_RTR_FLAG)
-		cmd = 'R'; /* becomes 'r' in standard frame format */
+		*p = 'R'; /* becomes 'r' in standard frame format */
 	else
-		cmd = 'T'; /* becomes 't' in standard frame format */
+		*p = 'T'; /* becomes 't' in standard frame format */
 
-	if (cf->can_id & CAN_EFF_FLAG)
-		sprintf(sl->xbuff, "%c%08X%d", cmd,
-			cf->can_id & CAN_EFF_MASK, cf->can_dlc);
-	else
-		sprintf(sl->xbuff, "%c%03X%d", cmd | 0x20,
-			cf->can_id & CAN_SFF_MASK, cf->can_dlc);
+	if (cf->can_id & CAN_EFF_FLAG) {
+		id = cf->can_id & CAN_EFF_MASK;
+		p += 8;
+	} else {
+		*pos |= 0x20;
+		id = cf->can_id & CAN_SFF_MASK;
+		p += 3;
+	}
 
-	idx = strlen(sl->xbuff);
+	/* fill in the can_id digits backwards from the last one */
+	for (i = p - pos; i > 0; i--, id >>= 4)
+		pos[i] = slc_hex[id & 0x0F];
+	p++;
 
-	for (i = 0; i < cf->can_dlc; i++)
-		sprintf(&sl->xbuff[idx + 2*i], "%02X", cf->data[i]);
+	*p++ = '0' + cf->can_dlc;
 
-	strcat(sl->xbuff, "\r"); /* add terminating character */
+	for (i = 0; i < cf->can_dlc; i++) {
+		*p++ = slc_hex[cf->data[i] >> 4];
+		*p++ = slc_hex[cf->data[i] & 0x0F];
+	}
+
+	*p++ = '\r'; /* add terminating character */
+
+	return p - pos;
+}
+
+/* SLIP escape len bytes from src to dst and return the new end of dst */
+static unsigned char *slc_esc(const u8 *src, int len, unsigned char *dst)
+{
+	while (len--) {
+		switch (*src) {
+		case SLCAN_BIN_END:
+			*dst++ = SLCAN_BIN_ESC;
+			*dst++ = SLCAN_BIN_ESC_END;
+			break;
+		case SLCAN_BIN_ESC:
+			*dst++ = SLCAN_BIN_ESC;
+			*dst++ = SLCAN_BIN_ESC_ESC;
+			break;
+		default:
+			*dst++ = *src;
+			break;
+		}
+		src++;
+	}
+
+	return dst;
+}
+
+/* Encode one CAN (FD) frame in binary mode and return the number of bytes */
+static int slc_encode_bin(const struct canfd_frame *cfd, int fd,
+			  unsigned char *pos)
+{
+	u8 hdr[SLCAN_BIN_HDR];
+	unsigned char *p = pos;
+
+	hdr[0] = fd ? SLCAN_BIN_FD | (cfd->flags & (CANFD_BRS | CANFD_ESI)) : 0;
+	hdr[1] = cfd->can_id >> 24;
+	hdr[2] = cfd->can_id >> 16;
+	hdr[3] = cfd->can_id >> 8;
+	hdr[4] = cfd->can_id;
+	hdr[5] = cfd->len;
+
+	/* leading END flushes any line noise at the receiver (see slip.c) */
+	*p++ = SLCAN_BIN_END;
+	p = slc_esc(hdr, SLCAN_BIN_HDR, p);
+	p = slc_esc(cfd->data, cfd->len, p);
+	*p++ = SLCAN_BIN_END;
+
+	return p - pos;
+}
+
+/* Hand as much of the XMIT queue to the tty as it takes. */
+static void slc_write(struct slcan *sl)
+{
+	int actual;
 
-	/* Order of next two lines is *very* important.
-	 * When we are sending a little amount of data,
-	 * the transfer may be completed inside the ops->write()
-	 * routine, because it's running with interrupts enabled.
-	 * In this case we *never* got WRITE_WAKEUP event,
-	 * if we did not request it before write operation.
-	 *       14 Oct 1994  Dmitry Gorodchanin.
-	 */
-	set_bit(TTY_DO_WRITE_WAKEUP, &sl->tty->flags);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
-	actual = sl->tty->driver->write(sl->tty, sl->xbuff, strlen(sl->xbuff));
+	actual = sl->tty->driver->write(sl->tty, sl->xhead, sl->xleft);
 #else
-	actual = sl->tty->ops->write(sl->tty, sl->xbuff, strlen(sl->xbuff));
+	actual = sl->tty->ops->write(sl->tty, sl->xhead, sl->xleft);
+#endif
+	if (actual < 0)
+		actual = 0;
+
+	sl->xleft -= actual;
+	sl->xhead += actual;
+}
+
+/* Encapsulate one CAN (FD) frame and stuff into a TTY queue. */
+static void slc_encaps(struct slcan *sl, struct sk_buff *skb)
+{
+	struct canfd_frame *cfd = (struct canfd_frame *) skb->data;
+	unsigned char *pos;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
+	struct net_device_stats *stats = slc_get_stats(sl->dev);
 #endif
-	sl->xleft = strlen(sl->xbuff) - actual;
-	sl->xhead = sl->xbuff + actual;
+	int idle = !sl->xleft;
+
+	/* make room at the end of the buffer for this frame */
+	if (sl->xhead + sl->xleft + SLC_XMTU > sl->xbuff + SLC_XBUFF) {
+		memmove(sl->xbuff, sl->xhead, sl->xleft);
+		sl->xhead = sl->xbuff;
+	}
+
+	pos = sl->xhead + sl->xleft;
+	if (sl->mode == SLCAN_MODE_ASCII)
+		sl->xleft += slc_encode((struct can_frame *) cfd, pos);
+	else
+		sl->xleft += slc_encode_bin(cfd, skb->len == CANFD_MTU, pos);
+	sl->xframes++;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
-	stats->tx_bytes += cf->can_dlc;
+	stats->tx_bytes += cfd->len;
 #else
-	sl->dev->stats.tx_bytes += cf->can_dlc;
+	sl->dev->stats.tx_bytes += cfd->len;
 #endif
+
+	/*
+	 * A busy tty gets the appended frame with the next write_wakeup,
+	 * together with all the others which have been queued meanwhile.
+	 */
+	if (idle) {
+		/* Order of next two lines is *very* important.
+		 * When we are sending a little amount of data,
+		 * the transfer may be completed inside the ops->write()
+		 * routine, because it's running with interrupts enabled.
+		 * In this case we *never* got WRITE_WAKEUP event,
+		 * if we did not request it before write operation.
+		 *       14 Oct 1994  Dmitry Gorodchanin.
+		 */
+		set_bit(TTY_DO_WRITE_WAKEUP, &sl->tty->flags);
+		slc_write(sl);
+	}
+
+	if (SLC_XBUFF - sl->xleft < SLC_XMTU)
+		netif_stop_queue(sl->dev);
 }
 
-/*
- * Called by the driver when there's room for more data.  If we have
- * more packets to send, we send them here.
- */
-static void slcan_write_wakeup(struct tty_struct *tty)
+/* Write out the XMIT queue in process context, see slcan_write_wakeup() */
+static void slc_transmit(struct work_struct *work)
 {
-	int actual;
-	struct slcan *sl = (struct slcan *) tty->disc_data;
+	struct slcan *sl = container_of(work, struct slcan, tx_work);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
 	struct net_device_stats *stats = slc_get_stats(sl->dev);
 #endif
 
+	spin_lock_bh(&sl->lock);
 	/* First make sure we're connected. */
-	if (!sl || sl->magic != SLCAN_MAGIC || !netif_running(sl->dev))
+	if (!sl->tty || sl->magic != SLCAN_MAGIC || !netif_running(sl->dev)) {
+		spin_unlock_bh(&sl->lock);
 		return;
+	}
 
 	if (sl->xleft <= 0)  {
 		/* Now serial buffer is almost free & we can start
-		 * transmission of another packet */
+		 * transmission of further packets */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
-		stats->tx_packets++;
+		stats->tx_packets += sl->xframes;
 #else
-		sl->dev->stats.tx_packets++;
+		sl->dev->stats.tx_packets += sl->xframes;
 #endif
-		clear_bit(TTY_DO_WRITE_WAKEUP, &tty->flags);
+		sl->xframes = 0;
+		sl->xhead = sl->xbuff;
+		clear_bit(TTY_DO_WRITE_WAKEUP, &sl->tty->flags);
+		spin_unlock_bh(&sl->lock);
 		netif_wake_queue(sl->dev);
 		return;
 	}
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
-	actual = tty->driver->write(tty, sl->xhead, sl->xleft);
-#else
-	actual = tty->ops->write(tty, sl->xhead, sl->xleft);
-#endif
-	sl->xleft -= actual;
-	sl->xhead += actual;
+	slc_write(sl);
+	spin_unlock_bh(&sl->lock);
+}
+
+/*
+ * Called by the driver when there's room for more data.  If we have
+ * more packets to send, we send them here.
+ *
+ * This may be called from within the tty write() we issued under
+ * sl->lock, so the actual work is deferred to slc_transmit().
+ */
+static void slcan_write_wakeup(struct tty_struct *tty)
+{
+	struct slcan *sl = (struct slcan *) tty->disc_data;
+
+	/* First make sure we're connected. */
+	if (!sl || sl->magic != SLCAN_MAGIC || !netif_running(sl->dev))
+		return;
+
+	schedule_work(&sl->tx_work);
 }
 
 /* Send a can_frame to a TTY queue. */
@@ -430,7 +659,9 @@ static netdev_tx_t slc_xmit(struct sk_buff *skb, struct net_device *dev)
 {
 	struct slcan *sl = netdev_priv(dev);
 
-	if (skb->len != sizeof(struct can_frame))
+	/* CAN FD frames are only accepted in SLCAN_MODE_BINARY_FD */
+	if (skb->len != CAN_MTU &&
+	    (skb->len != CANFD_MTU || sl->mode != SLCAN_MODE_BINARY_FD))
 		goto out;
 
 	spin_lock(&sl->lock);
@@ -444,8 +675,7 @@ static netdev_tx_t slc_xmit(struct sk_buff *skb, struct net_device *dev)
 		goto out;
 	}
 
-	netif_stop_queue(sl->dev);
-	slc_encaps(sl, (struct can_frame *) skb->data); /* encaps & send */
+	slc_encaps(sl, skb); /* encaps & send */
 	spin_unlock(&sl->lock);
 
 out:
@@ -475,6 +705,8 @@ static int slc_close(struct net_device *dev)
 	netif_stop_queue(dev);
 	sl->rcount   = 0;
 	sl->xleft    = 0;
+	sl->xframes  = 0;
+	sl->xhead    = sl->xbuff;
 	spin_unlock_bh(&sl->lock);
 
 	return 0;
@@ -503,11 +735,25 @@ static void slc_free_netdev(struct net_device *dev)
 }
 #endif
 
+/* the CAN FD MTU is only valid with the SLCAN_MODE_BINARY_FD framing */
+static int slc_change_mtu(struct net_device *dev, int new_mtu)
+{
+	struct slcan *sl = netdev_priv(dev);
+
+	if (new_mtu != CAN_MTU &&
+	    (new_mtu != CANFD_MTU || sl->mode != SLCAN_MODE_BINARY_FD))
+		return -EINVAL;
+
+	dev->mtu = new_mtu;
+	return 0;
+}
+
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,28)
 static const struct net_device_ops slc_netdev_ops = {
 	.ndo_open               = slc_open,
 	.ndo_stop               = slc_close,
 	.ndo_start_xmit         = slc_xmit,
+	.ndo_change_mtu         = slc_change_mtu,
 };
 #endif
 
@@ -519,6 +765,7 @@ static void slc_setup(struct net_device *dev)
 	dev->open		= slc_open;
 	dev->stop		= slc_close;
 	dev->hard_start_xmit	= slc_xmit;
+	dev->change_mtu		= slc_change_mtu;
 #endif
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,31)
 	dev->destructor		= slc_free_netdev;
@@ -584,7 +831,10 @@ static void slcan_receive_buf(struct tty_struct *tty,
 			cp++;
 			continue;
 		}
-		slcan_unesc(sl, *cp++);
+		if (sl->mode == SLCAN_MODE_ASCII)
+			slcan_unesc(sl, *cp++);
+		else
+			slcan_unesc_bin(sl, *cp++);
 	}
 }
 
@@ -710,6 +960,7 @@ static struct slcan *slc_alloc(dev_t line)
 	sl->magic = SLCAN_MAGIC;
 	sl->dev	= dev;
 	spin_lock_init(&sl->lock);
+	INIT_WORK(&sl->tx_work, slc_transmit);
 	slcan_devs[i] = dev;
 
 	return sl;
@@ -775,6 +1026,10 @@ static int slcan_open(struct tty_struct *tty)
 		/* Perform the low-level SLCAN initialization. */
 		sl->rcount   = 0;
 		sl->xleft    = 0;
+		sl->xframes  = 0;
+		sl->xhead    = sl->xbuff;
+		sl->mode     = SLCAN_MODE_ASCII;
+		sl->dev->mtu = CAN_MTU;
 
 		set_bit(SLF_INUSE, &sl->flags);
 
@@ -818,8 +1073,14 @@ static void slcan_close(struct tty_struct *tty)
 	if (!sl || sl->magic != SLCAN_MAGIC || sl->tty != tty)
 		return;
 
+	spin_lock_bh(&sl->lock);
 	tty->disc_data = NULL;
 	sl->tty = NULL;
+	spin_unlock_bh(&sl->lock);
+
+	/* no pending slc_transmit() may touch the tty after we return */
+	cancel_work_sync(&sl->tx_work);
+
 	if (!sl->leased)
 		sl->line = 0;
 
@@ -846,6 +1107,7 @@ static int slcan_ioctl(struct tty_struct *tty, struct file *file,
 {
 	struct slcan *sl = (struct slcan *) tty->disc_data;
 	unsigned int tmp;
+	int mode;
 
 	/* First make sure we're connected. */
 	if (!sl || sl->magic != SLCAN_MAGIC)
@@ -861,6 +1123,35 @@ static int slcan_ioctl(struct tty_struct *tty, struct file *file,
 	case SIOCSIFHWADDR:
 		return -EINVAL;
 
+	case SLCAN_SIOCSMODE:
+		if (get_user(mode, (int __user *)arg))
+			return -EFAULT;
+		if (mode < SLCAN_MODE_ASCII || mode >= SLCAN_MODE_MAX)
+			return -EINVAL;
+
+		/* the framing must not change under running rx/tx paths */
+		rtnl_lock();
+		if (netif_running(sl->dev)) {
+			rtnl_unlock();
+			return -EBUSY;
+		}
+		spin_lock_bh(&sl->lock);
+		sl->mode = mode;
+		sl->rcount = 0;
+		sl->flags &= (1 << SLF_INUSE);
+		if (mode == SLCAN_MODE_BINARY_FD)
+			sl->dev->mtu = CANFD_MTU;
+		else
+			sl->dev->mtu = CAN_MTU;
+		spin_unlock_bh(&sl->lock);
+		rtnl_unlock();
+		return 0;
+
+	case SLCAN_SIOCGMODE:
+		if (put_user(sl->mode, (int __user *)arg))
+			return -EFAULT;
+		return 0;
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,27)
 	/* Allow stty to read, but not set, the serial port */
 	case TCGETS:
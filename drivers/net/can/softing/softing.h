@@ -16,6 +16,20 @@ struct sofing_desc;
 /* softing firmware directory prefix */
 #define fw_dir "softing-4.6/"
 
+/*
+ * The card service runs as a NAPI poll with a budget where possible. It
+ * copies the DPRAM rx fifo in bulk and hands the frames of the busses out
+ * in turns.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+#define SOFTING_NAPI
+#define SOFTING_NAPI_WEIGHT	16
+#endif
+
+/* DPRAM rx fifo geometry */
+#define RXMAX	16
+#define RXSLOT	32
+
 /* special attribute, so we should not rely on the ->priv pointers
  * before knowing how to interpret these
  */
@@ -31,6 +45,10 @@ struct softing_priv {
 		int echo_put;
 		int echo_get;
 	} tx;
+#ifdef SOFTING_NAPI
+	/* frames of the current card service run, not yet delivered */
+	struct sk_buff_head rxq;
+#endif
 	struct can_bittiming_const btr_const;
 	int index;
 	u8 output;
@@ -80,7 +98,17 @@ struct softing {
 		int requested;
 		struct tasklet_struct bh;
 		int svc_count;
+#ifdef SOFTING_NAPI
+		struct net_device napi_dev;
+		struct napi_struct napi;
+#endif
 	} irq;
+	struct {
+		/* local copy of the DPRAM rx fifo slots */
+		u8 buf[RXMAX][RXSLOT];
+		/* the bus that got the last frame delivered */
+		int last_bus;
+	} rx;
 	struct {
 		int pending;
 		int last_bus;
@@ -173,7 +201,7 @@ extern void softing_bus_sysfs_remove(struct softing_priv *bus);
 
 /* SOFTING DPRAM mappings */
 struct softing_rx {
-	u8  fifo[16][32];
+	u8  fifo[RXMAX][RXSLOT];
 	u8  dummy1;
 	u16 rd;
 	u16 dummy2;
@@ -142,86 +142,103 @@ xmit_done:
 	return ret;
 }
 
-int softing_rx(struct net_device *netdev, const struct can_frame *msg,
-	ktime_t ktime)
+static struct sk_buff *softing_rx_skb(struct net_device *netdev,
+	const struct can_frame *msg, ktime_t ktime)
 {
 	struct sk_buff *skb;
 	struct can_frame *cf;
-	int ret;
-	struct net_device_stats *stats;
 
 	skb = alloc_can_skb(netdev, &cf);
 	if (!skb)
-		return -ENOMEM;
+		return NULL;
 	memcpy(cf, msg, sizeof(*msg));
 	skb->tstamp = ktime;
+	if (ktime_to_ns(ktime))
+		can_skb_set_hwtstamp(skb, ktime);
+	return skb;
+}
+
+int softing_rx(struct net_device *netdev, const struct can_frame *msg,
+	ktime_t ktime)
+{
+	struct sk_buff *skb;
+	int ret;
+
+	skb = softing_rx_skb(netdev, msg, ktime);
+	if (!skb)
+		return -ENOMEM;
+	can_rx_steer(skb);
+	can_rx_bus_load(skb);
 	ret = netif_rx(skb);
-	if (ret == NET_RX_DROP) {
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
-		stats = can_get_stats(netdev);
+	if (ret == NET_RX_DROP)
+		++netdev->stats.rx_dropped;
+	return ret;
+}
+
+/*
+ * frames of the card service, the NAPI poll queues them per bus
+ * until the spinlock is released
+ */
+static void softing_svc_rx(struct softing_priv *bus,
+	const struct can_frame *msg, ktime_t ktime)
+{
+#ifdef SOFTING_NAPI
+	struct sk_buff *skb;
+
+	skb = softing_rx_skb(bus->netdev, msg, ktime);
+	if (!skb) {
+		++bus->netdev->stats.rx_dropped;
+		return;
+	}
+	__skb_queue_tail(&bus->rxq, skb);
 #else
-		stats = &netdev->stats;
+	softing_rx(bus->netdev, msg, ktime);
 #endif
-		++stats->rx_dropped;
-	}
-	return ret;
 }
 
-static int softing_dev_svc_once(struct softing *card)
+static int softing_svc_lost(struct softing *card)
 {
 	int j;
 	struct softing_priv *bus;
-	ktime_t ktime;
 	struct can_frame msg;
 
-	unsigned int fifo_rd;
-	unsigned int cnt = 0;
+	if (!card->dpram.rx->lost_msg)
+		return 0;
+	/*reset condition */
+	card->dpram.rx->lost_msg = 0;
+	/* prepare msg */
+	memset(&msg, 0, sizeof(msg));
+	msg.can_id = CAN_ERR_FLAG | CAN_ERR_CRTL;
+	msg.can_dlc = CAN_ERR_DLC;
+	msg.data[1] = CAN_ERR_CRTL_RX_OVERFLOW;
+	/*
+	 * service to all busses, we don't know which it was applicable
+	 * but only service busses that are online
+	 */
+	for (j = 0; j < card->nbus; ++j) {
+		bus = card->bus[j];
+		if (!bus)
+			continue;
+		if (!canif_is_active(bus->netdev))
+			/* a dead bus has no overflows */
+			continue;
+		++bus->netdev->stats.rx_over_errors;
+		softing_svc_rx(bus, &msg, ktime_set(0, 0));
+	}
+	return 1;
+}
+
+/* handle one rx fifo entry, ptr points to the local copy of its slot */
+static void softing_svc_msg(struct softing *card, const u8 *ptr)
+{
+	struct softing_priv *bus;
+	ktime_t ktime;
+	struct can_frame msg;
 	struct net_device_stats *stats;
-	u8 *ptr;
 	u32 tmp;
 	u8 cmd;
 
 	memset(&msg, 0, sizeof(msg));
-	if (card->dpram.rx->lost_msg) {
-		/*reset condition */
-		card->dpram.rx->lost_msg = 0;
-		/* prepare msg */
-		msg.can_id = CAN_ERR_FLAG | CAN_ERR_CRTL;
-		msg.can_dlc = CAN_ERR_DLC;
-		msg.data[1] = CAN_ERR_CRTL_RX_OVERFLOW;
-		/*
-		 * service to all busses, we don't know which it was applicable
-		 * but only service busses that are online
-		 */
-		for (j = 0; j < card->nbus; ++j) {
-			bus = card->bus[j];
-			if (!bus)
-				continue;
-			if (!canif_is_active(bus->netdev))
-				/* a dead bus has no overflows */
-				continue;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
-			stats = can_get_stats(bus->netdev);
-#else
-			stats = &bus->netdev->stats;
-#endif
-			++stats->rx_over_errors;
-			softing_rx(bus->netdev, &msg, ktime_set(0, 0));
-		}
-		/* prepare for other use */
-		memset(&msg, 0, sizeof(msg));
-		++cnt;
-	}
-
-	fifo_rd = card->dpram.rx->rd;
-	if (++fifo_rd >= ARRAY_SIZE(card->dpram.rx->fifo))
-		fifo_rd = 0;
-
-	if (card->dpram.rx->wr == fifo_rd)
-		return cnt;
-
-	ptr = &card->dpram.rx->fifo[fifo_rd][0];
-
 	cmd = *ptr++;
 	if (cmd == 0xff) {
 		/*not quite useful, probably the card has got out */
@@ -233,11 +250,7 @@ static int softing_dev_svc_once(struct softing *card)
 	if (cmd & CMD_BUS2)
 		bus = card->bus[1];
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
-	stats = can_get_stats(bus->netdev);
-#else
 	stats = &bus->netdev->stats;
-#endif
 	if (cmd & CMD_ERR) {
 		u8 can_state;
 		u8 state;
@@ -270,9 +283,6 @@ static int softing_dev_svc_once(struct softing *card)
 		    | (ptr[2] << 16) | (ptr[3] << 24);
 		ptr += 4;
 		ktime = softing_raw2ktime(card, tmp);
-		/*trigger dual port RAM */
-		mb();
-		card->dpram.rx->rd = fifo_rd;
 
 		++bus->can.can_stats.bus_error;
 		++stats->rx_errors;
@@ -287,7 +297,7 @@ static int softing_dev_svc_once(struct softing *card)
 				netif_stop_queue(bus->netdev);
 			}
 			/*trigger socketcan */
-			softing_rx(bus->netdev, &msg, ktime);
+			softing_svc_rx(bus, &msg, ktime);
 		}
 
 	} else {
@@ -312,18 +322,16 @@ static int softing_dev_svc_once(struct softing *card)
 		    | (ptr[2] << 16) | (ptr[3] << 24);
 		ptr += 4;
 		ktime = softing_raw2ktime(card, tmp);
-		memcpy_fromio(&msg.data[0], ptr, 8);
+		memcpy(&msg.data[0], ptr, 8);
 		ptr += 8;
-		/*trigger dual port RAM */
-		mb();
-		card->dpram.rx->rd = fifo_rd;
 		/*update socket */
 		if (cmd & CMD_ACK) {
 			struct sk_buff *skb;
 			skb = bus->can.echo_skb[bus->tx.echo_get];
 			if (skb)
 				skb->tstamp = ktime;
-			can_get_echo_skb(bus->netdev, bus->tx.echo_get);
+			can_get_echo_skb_hwtstamp(bus->netdev,
+						  bus->tx.echo_get, ktime);
 			++bus->tx.echo_get;
 			if (bus->tx.echo_get >= TX_ECHO_SKB_MAX)
 				bus->tx.echo_get = 0;
@@ -339,24 +347,65 @@ static int softing_dev_svc_once(struct softing *card)
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
 			bus->netdev->last_rx = jiffies;
 #endif
-			softing_rx(bus->netdev, &msg, ktime);
+			softing_svc_rx(bus, &msg, ktime);
 		}
 	}
-	++cnt;
-	return cnt;
 }
 
-static void softing_dev_svc(unsigned long param)
+/*
+ * Service up to quota entries of the DPRAM rx fifo. The filled slots are
+ * copied with one memcpy_fromio() per contiguous run and released to the
+ * card before they are decoded. Called with card->spin held.
+ */
+static int softing_svc_fifo(struct softing *card, int quota)
+{
+	unsigned int fifo_rd, fifo_wr, idx, cnt;
+	int n = 0;
+	int j;
+
+	if (quota > RXMAX)
+		quota = RXMAX;
+
+	fifo_rd = card->dpram.rx->rd;
+	fifo_wr = card->dpram.rx->wr;
+	if (fifo_rd >= RXMAX || fifo_wr >= RXMAX)
+		/* the card is lost, the irq handler tells */
+		return 0;
+
+	while (n < quota) {
+		/* rd is the last slot read, wr the next one the card fills */
+		idx = fifo_rd + 1;
+		if (idx >= RXMAX)
+			idx = 0;
+		if (idx == fifo_wr)
+			break;
+		cnt = (fifo_wr > idx) ? fifo_wr - idx : RXMAX - idx;
+		if (cnt > quota - n)
+			cnt = quota - n;
+		memcpy_fromio(card->rx.buf[n], card->dpram.rx->fifo[idx],
+			cnt * RXSLOT);
+		n += cnt;
+		fifo_rd = idx + cnt - 1;
+	}
+	if (!n)
+		return 0;
+
+	/*trigger dual port RAM */
+	mb();
+	card->dpram.rx->rd = fifo_rd;
+
+	for (j = 0; j < n; ++j)
+		softing_svc_msg(card, card->rx.buf[j]);
+	card->irq.svc_count += n;
+	return n;
+}
+
+static void softing_wake_queues(struct softing *card)
 {
-	struct softing *card = (struct softing *)param;
 	struct softing_priv *bus;
 	int j;
 	int offset;
 
-	spin_lock(&card->spin);
-	while (softing_dev_svc_once(card) > 0)
-		++card->irq.svc_count;
-	spin_unlock(&card->spin);
 	/*resume tx queue's */
 	offset = card->tx.last_bus;
 	for (j = 0; j < card->nbus; ++j) {
@@ -374,6 +423,104 @@ static void softing_dev_svc(unsigned long param)
 	}
 }
 
+#ifdef SOFTING_NAPI
+/*
+ * Deliver the queued frames, one frame per bus in turn, starting after
+ * the bus that was served last, like card->tx.last_bus does for tx.
+ */
+static void softing_svc_deliver(struct softing *card)
+{
+	struct softing_priv *bus;
+	struct sk_buff *skb;
+	int j, offset, more;
+
+	do {
+		more = 0;
+		offset = card->rx.last_bus;
+		for (j = 0; j < card->nbus; ++j) {
+			bus = card->bus[(j + offset + 1) % card->nbus];
+			if (!bus)
+				continue;
+			skb = __skb_dequeue(&bus->rxq);
+			if (!skb)
+				continue;
+			if (netif_receive_skb(skb) == NET_RX_DROP)
+				++bus->netdev->stats.rx_dropped;
+			card->rx.last_bus = bus->index;
+			more = 1;
+		}
+	} while (more);
+}
+
+static int softing_svc_pending(struct softing *card)
+{
+	unsigned int idx;
+
+	if (card->dpram.rx->lost_msg)
+		return 1;
+	idx = card->dpram.rx->rd + 1;
+	if (idx >= RXMAX)
+		idx = 0;
+	return idx != card->dpram.rx->wr;
+}
+
+static int softing_poll(struct napi_struct *napi, int quota)
+{
+	struct softing *card = container_of(napi, struct softing, irq.napi);
+	int work = 0;
+	int n;
+
+	do {
+		spin_lock(&card->spin);
+		softing_svc_lost(card);
+		n = softing_svc_fifo(card, quota - work);
+		spin_unlock(&card->spin);
+		softing_svc_deliver(card);
+		work += n;
+	} while (n && work < quota);
+
+	softing_wake_queues(card);
+
+	if (work < quota) {
+		napi_complete(napi);
+		/* the irq of entries that came in meanwhile was swallowed */
+		if (softing_svc_pending(card) && napi_schedule_prep(napi))
+			__napi_schedule(napi);
+	}
+	return work;
+}
+#else
+static void softing_dev_svc(unsigned long param)
+{
+	struct softing *card = (struct softing *)param;
+
+	spin_lock(&card->spin);
+	while (softing_svc_lost(card) | softing_svc_fifo(card, RXMAX))
+		;
+	spin_unlock(&card->spin);
+	softing_wake_queues(card);
+}
+#endif
+
+static inline void softing_svc_schedule(struct softing *card)
+{
+#ifdef SOFTING_NAPI
+	napi_schedule(&card->irq.napi);
+#else
+	tasklet_schedule(&card->irq.bh);
+#endif
+}
+
+/* wait for a running card service, the irq must be released already */
+static inline void softing_svc_sync(struct softing *card)
+{
+#ifdef SOFTING_NAPI
+	napi_synchronize(&card->irq.napi);
+#else
+	tasklet_kill(&card->irq.bh);
+#endif
+}
+
 static
 irqreturn_t dev_interrupt_shared(int irq, void *dev_id)
 {
@@ -386,7 +533,7 @@ irqreturn_t dev_interrupt_shared(int irq, void *dev_id)
 		return IRQ_NONE;
 	}
 	if (ir == 1) {
-		tasklet_schedule(&card->irq.bh);
+		softing_svc_schedule(card);
 		return IRQ_HANDLED;
 	} else if (ir == 0x10) {
 		return IRQ_NONE;
@@ -410,7 +557,7 @@ irqreturn_t dev_interrupt_nshared(int irq, void *dev_id)
 		dev_alert(card->dev, "I think the card is gone\n");
 		return IRQ_NONE;
 	}
-	tasklet_schedule(&card->irq.bh);
+	softing_svc_schedule(card);
 	return IRQ_HANDLED;
 }
 
@@ -512,7 +659,7 @@ static void shutdown_card(struct softing *card)
 			card->fn.reset(card, 1);
 	}
 	mutex_unlock(&card->fw.lock);
-	tasklet_kill(&card->irq.bh);
+	softing_svc_sync(card);
 }
 
 static int boot_card(struct softing *card)
@@ -657,6 +804,9 @@ static struct softing_priv *mk_netdev(struct softing *card, u16 chip_id)
 	priv->can.bittiming_const = &priv->btr_const;
 	priv->can.clock.freq	= 8000000;
 	priv->chip 		= chip_id;
+#ifdef SOFTING_NAPI
+	skb_queue_head_init(&priv->rxq);
+#endif
 	priv->output = softing_default_output(card, priv);
 	SET_NETDEV_DEV(ndev, card->dev);
 
@@ -714,6 +864,10 @@ void rm_softing(struct softing *card)
 
 	softing_card_sysfs_remove(card);
 
+#ifdef SOFTING_NAPI
+	napi_disable(&card->irq.napi);
+	netif_napi_del(&card->irq.napi);
+#endif
 	iounmap(card->dpram.virt);
 }
 EXPORT_SYMBOL(rm_softing);
@@ -725,7 +879,14 @@ int mk_softing(struct softing *card)
 	/* try_module_get(THIS_MODULE); */
 	mutex_init(&card->fw.lock);
 	spin_lock_init(&card->spin);
+#ifdef SOFTING_NAPI
+	init_dummy_netdev(&card->irq.napi_dev);
+	netif_napi_add(&card->irq.napi_dev, &card->irq.napi, softing_poll,
+		SOFTING_NAPI_WEIGHT);
+	napi_enable(&card->irq.napi);
+#else
 	tasklet_init(&card->irq.bh, softing_dev_svc, (unsigned long)card);
+#endif
 
 	if (!card->desc) {
 		dev_alert(card->dev, "no card description\n");
@@ -812,7 +973,12 @@ boot_failed:
 	card->dpram.end = 0;
 ioremap_failed:
 lookup_failed:
+#ifdef SOFTING_NAPI
+	napi_disable(&card->irq.napi);
+	netif_napi_del(&card->irq.napi);
+#else
 	tasklet_kill(&card->irq.bh);
+#endif
 	return EINVAL;
 }
 EXPORT_SYMBOL(mk_softing);
@@ -227,20 +227,56 @@ static struct usb_device_id ems_usb_table[] = {
 
 MODULE_DEVICE_TABLE(usb, ems_usb_table);
 
-#define RX_BUFFER_SIZE      64
+/*
+ * Bulk IN transfers carry as many CPC messages as the interface has queued,
+ * large buffers let one completion drain a whole burst.
+ */
+#define RX_BUFFER_SIZE      1024
 #define CPC_HEADER_SIZE     4
 #define INTR_IN_BUFFER_SIZE 4
 
-#define MAX_RX_URBS 10
-#define MAX_TX_URBS 10
+/* Upper limits for the rx_urbs and tx_urbs module parameters */
+#define MAX_RX_URBS 32
+#define MAX_TX_URBS 32
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+/*
+ * Completed bulk IN URBs are parsed in a NAPI poll, the URB completion
+ * only queues them in rx_done
+ */
+#define EMS_USB_NAPI
+#define EMS_USB_NAPI_WEIGHT 32
+#endif
+
+static unsigned int rx_urbs = 10;
+module_param(rx_urbs, uint, S_IRUGO);
+MODULE_PARM_DESC(rx_urbs, "Number of bulk IN URBs (1-32, default 10)");
+
+static unsigned int tx_urbs = 10;
+module_param(tx_urbs, uint, S_IRUGO);
+MODULE_PARM_DESC(tx_urbs, "Number of bulk OUT URBs (1-32, default 10)");
+
+/*
+ * While TX URBs are in flight further CAN messages are collected in one
+ * pending URB, which is sent when it is full or when the USB core
+ * completes a TX URB. Each context owns MAX_TX_MSGS echo skb slots.
+ */
+#define MAX_TX_MSGS    8
+#define TX_BUFFER_SIZE (CPC_HEADER_SIZE + MAX_TX_MSGS * \
+			(CPC_MSG_HEADER_LEN + sizeof(struct cpc_can_msg)))
+#define MAX_TX_ECHO    (MAX_TX_URBS * MAX_TX_MSGS)
 
 struct ems_usb;
 
 struct ems_tx_urb_context {
 	struct ems_usb *dev;
+	struct urb *urb;
+	u8 *buf;
 
-	u32 echo_index;
-	u8 dlc;
+	u32 echo_index; /* first echo skb slot, MAX_TX_ECHO if unused */
+	unsigned int size; /* bytes filled in buf */
+	unsigned int count; /* CAN messages in buf */
+	unsigned int bytes; /* CAN payload bytes for the statistics */
 };
 
 struct ems_usb {
@@ -255,9 +291,21 @@ struct ems_usb {
 	atomic_t active_tx_urbs;
 	struct usb_anchor tx_submitted;
 	struct ems_tx_urb_context tx_contexts[MAX_TX_URBS];
+	struct ems_tx_urb_context *tx_pending; /* not yet submitted */
+	spinlock_t tx_lock; /* protects tx_contexts and tx_pending */
 
 	struct usb_anchor rx_submitted;
 
+#ifdef EMS_USB_NAPI
+	struct napi_struct napi;
+	spinlock_t rx_lock; /* protects rx_done, rx_head and rx_tail */
+	struct urb *rx_done[MAX_RX_URBS]; /* completed, not yet parsed */
+	unsigned int rx_head;
+	unsigned int rx_tail;
+	unsigned int rx_pos; /* parse state of rx_done[rx_tail] */
+	unsigned int rx_count;
+#endif
+
 	struct urb *intr_urb;
 
 	u8 *tx_msg_buffer;
@@ -330,7 +378,14 @@ static void ems_usb_rx_can_msg(struct ems_usb *dev, struct ems_cpc_msg *msg)
 			cf->data[i] = msg->msg.can_msg.msg[i];
 	}
 
+	can_rx_steer(skb);
+	can_rx_bus_load(skb);
+#ifdef EMS_USB_NAPI
+	can_rx_napi_id(skb, &dev->napi);
+	netif_receive_skb(skb);
+#else
 	netif_rx(skb);
+#endif
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
 	dev->netdev->last_rx = jiffies;
@@ -408,7 +463,11 @@ static void ems_usb_rx_err(struct ems_usb *dev, struct ems_cpc_msg *msg)
 		stats->rx_errors++;
 	}
 
+#ifdef EMS_USB_NAPI
+	netif_receive_skb(skb);
+#else
 	netif_rx(skb);
+#endif
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
 	dev->netdev->last_rx = jiffies;
@@ -417,6 +476,147 @@ static void ems_usb_rx_err(struct ems_usb *dev, struct ems_cpc_msg *msg)
 	stats->rx_bytes += cf->can_dlc;
 }
 
+/*
+ * Process up to quota CPC messages of a bulk IN transfer, starting at *pos
+ * with *count messages left. Returns the number of messages processed.
+ */
+static int ems_usb_rx_msgs(struct ems_usb *dev, struct urb *urb,
+			   unsigned int *pos, unsigned int *count, int quota)
+{
+	struct net_device *netdev = dev->netdev;
+	u8 *ibuf = urb->transfer_buffer;
+	struct ems_cpc_msg *msg;
+	int done = 0;
+
+	while (*count && done < quota) {
+		if (*pos + CPC_MSG_HEADER_LEN > urb->actual_length) {
+			dev_err(ND2D(netdev), "format error\n");
+			*count = 0;
+			break;
+		}
+
+		msg = (struct ems_cpc_msg *)&ibuf[*pos];
+
+		switch (msg->type) {
+		case CPC_MSG_TYPE_CAN_STATE:
+			/* Process CAN state changes */
+			ems_usb_rx_err(dev, msg);
+			break;
+
+		case CPC_MSG_TYPE_CAN_FRAME:
+		case CPC_MSG_TYPE_EXT_CAN_FRAME:
+		case CPC_MSG_TYPE_RTR_FRAME:
+		case CPC_MSG_TYPE_EXT_RTR_FRAME:
+			ems_usb_rx_can_msg(dev, msg);
+			break;
+
+		case CPC_MSG_TYPE_CAN_FRAME_ERROR:
+			/* Process errorframe */
+			ems_usb_rx_err(dev, msg);
+			break;
+
+		case CPC_MSG_TYPE_OVERRUN:
+			/* Message lost while receiving */
+			ems_usb_rx_err(dev, msg);
+			break;
+		}
+
+		*pos += CPC_MSG_HEADER_LEN + msg->length;
+		(*count)--;
+		done++;
+
+		if (*pos > urb->actual_length) {
+			dev_err(ND2D(netdev), "format error\n");
+			*count = 0;
+			break;
+		}
+	}
+
+	return done;
+}
+
+static void ems_usb_read_bulk_callback(struct urb *urb);
+
+static void ems_usb_rx_resubmit(struct ems_usb *dev, struct urb *urb)
+{
+	struct net_device *netdev = dev->netdev;
+	int retval;
+
+	usb_fill_bulk_urb(urb, dev->udev, usb_rcvbulkpipe(dev->udev, 2),
+			  urb->transfer_buffer, RX_BUFFER_SIZE,
+			  ems_usb_read_bulk_callback, dev);
+	usb_anchor_urb(urb, &dev->rx_submitted);
+
+	retval = usb_submit_urb(urb, GFP_ATOMIC);
+	if (retval)
+		usb_unanchor_urb(urb);
+
+	if (retval == -ENODEV)
+		netif_device_detach(netdev);
+	else if (retval)
+		dev_err(ND2D(netdev),
+			"failed resubmitting read bulk urb: %d\n", retval);
+}
+
+#ifdef EMS_USB_NAPI
+static int ems_usb_poll(struct napi_struct *napi, int quota)
+{
+	struct ems_usb *dev = container_of(napi, struct ems_usb, napi);
+	struct urb *urb;
+	unsigned long flags;
+	int work_done = 0;
+	int pending;
+
+	while (work_done < quota) {
+		spin_lock_irqsave(&dev->rx_lock, flags);
+		urb = NULL;
+		if (dev->rx_tail != dev->rx_head)
+			urb = dev->rx_done[dev->rx_tail & (MAX_RX_URBS - 1)];
+		spin_unlock_irqrestore(&dev->rx_lock, flags);
+
+		if (!urb)
+			break;
+
+		if (!dev->rx_pos) {
+			u8 *ibuf = urb->transfer_buffer;
+
+			dev->rx_pos = CPC_HEADER_SIZE;
+			dev->rx_count = ibuf[0] & ~0x80;
+		}
+
+		work_done += ems_usb_rx_msgs(dev, urb, &dev->rx_pos,
+					     &dev->rx_count,
+					     quota - work_done);
+
+		/* quota exhausted within this transfer */
+		if (dev->rx_count)
+			break;
+
+		spin_lock_irqsave(&dev->rx_lock, flags);
+		dev->rx_tail++;
+		spin_unlock_irqrestore(&dev->rx_lock, flags);
+		dev->rx_pos = 0;
+
+		ems_usb_rx_resubmit(dev, urb);
+		usb_free_urb(urb);
+	}
+
+	if (work_done < quota) {
+		napi_complete(napi);
+
+		/* catch URBs queued while we were completing */
+		spin_lock_irqsave(&dev->rx_lock, flags);
+		pending = dev->rx_tail != dev->rx_head;
+		spin_unlock_irqrestore(&dev->rx_lock, flags);
+
+		if (pending && napi_schedule_prep(napi))
+			__napi_schedule(napi);
+	}
+
+	return work_done;
+}
+#endif
+
 /*
  * callback for bulk IN urb
  */
@@ -424,7 +624,6 @@ static void ems_usb_read_bulk_callback(struct urb *urb)
 {
 	struct ems_usb *dev = urb->context;
 	struct net_device *netdev;
-	int retval;
 
 	netdev = dev->netdev;
 
@@ -445,76 +644,104 @@ static void ems_usb_read_bulk_callback(struct urb *urb)
 	}
 
 	if (urb->actual_length > CPC_HEADER_SIZE) {
-		struct ems_cpc_msg *msg;
+#ifdef EMS_USB_NAPI
+		unsigned long flags;
+
+		/* keep the URB until the poll has parsed it */
+		usb_get_urb(urb);
+
+		spin_lock_irqsave(&dev->rx_lock, flags);
+		dev->rx_done[dev->rx_head++ & (MAX_RX_URBS - 1)] = urb;
+		spin_unlock_irqrestore(&dev->rx_lock, flags);
+
+		napi_schedule(&dev->napi);
+		return;
+#else
 		u8 *ibuf = urb->transfer_buffer;
-		u8 msg_count, again, start;
+		unsigned int pos = CPC_HEADER_SIZE;
+		unsigned int count = ibuf[0] & ~0x80;
 
-		msg_count = ibuf[0] & ~0x80;
-		again = ibuf[0] & 0x80;
+		ems_usb_rx_msgs(dev, urb, &pos, &count, INT_MAX);
+#endif
+	}
 
-		start = CPC_HEADER_SIZE;
+resubmit_urb:
+	ems_usb_rx_resubmit(dev, urb);
+}
 
-		while (msg_count) {
-			msg = (struct ems_cpc_msg *)&ibuf[start];
+static void ems_usb_write_bulk_callback(struct urb *urb);
 
-			switch (msg->type) {
-			case CPC_MSG_TYPE_CAN_STATE:
-				/* Process CAN state changes */
-				ems_usb_rx_err(dev, msg);
-				break;
+/*
+ * Submit the pending TX URB, called with tx_lock held
+ */
+static void ems_usb_tx_submit(struct ems_usb *dev)
+{
+	struct ems_tx_urb_context *context = dev->tx_pending;
+	struct net_device *netdev = dev->netdev;
+	struct urb *urb;
+	int i, err;
 
-			case CPC_MSG_TYPE_CAN_FRAME:
-			case CPC_MSG_TYPE_EXT_CAN_FRAME:
-			case CPC_MSG_TYPE_RTR_FRAME:
-			case CPC_MSG_TYPE_EXT_RTR_FRAME:
-				ems_usb_rx_can_msg(dev, msg);
-				break;
+	if (!context)
+		return;
 
-			case CPC_MSG_TYPE_CAN_FRAME_ERROR:
-				/* Process errorframe */
-				ems_usb_rx_err(dev, msg);
-				break;
+	dev->tx_pending = NULL;
+	urb = context->urb;
 
-			case CPC_MSG_TYPE_OVERRUN:
-				/* Message lost while receiving */
-				ems_usb_rx_err(dev, msg);
-				break;
-			}
+	/* CPC header: number of messages in this transfer */
+	memset(context->buf, 0, CPC_HEADER_SIZE);
+	context->buf[0] = context->count;
 
-			start += CPC_MSG_HEADER_LEN + msg->length;
-			msg_count--;
+	usb_fill_bulk_urb(urb, dev->udev, usb_sndbulkpipe(dev->udev, 2),
+			  context->buf, context->size,
+			  ems_usb_write_bulk_callback, context);
+	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	usb_anchor_urb(urb, &dev->tx_submitted);
 
-			if (start > urb->transfer_buffer_length) {
-				dev_err(ND2D(netdev), "format error\n");
-				break;
-			}
-		}
-	}
+	atomic_inc(&dev->active_tx_urbs);
 
-resubmit_urb:
-	usb_fill_bulk_urb(urb, dev->udev, usb_rcvbulkpipe(dev->udev, 2),
-			  urb->transfer_buffer, RX_BUFFER_SIZE,
-			  ems_usb_read_bulk_callback, dev);
+	err = usb_submit_urb(urb, GFP_ATOMIC);
+	if (unlikely(err)) {
+		for (i = 0; i < context->count; i++)
+			can_free_echo_skb(netdev, context->echo_index + i);
 
-	retval = usb_submit_urb(urb, GFP_ATOMIC);
+		usb_unanchor_urb(urb);
+		usb_buffer_free(dev->udev, TX_BUFFER_SIZE, context->buf,
+				urb->transfer_dma);
 
-	if (retval == -ENODEV)
-		netif_device_detach(netdev);
-	else if (retval)
-		dev_err(ND2D(netdev),
-			"failed resubmitting read bulk urb: %d\n", retval);
+		atomic_dec(&dev->active_tx_urbs);
 
-	return;
+		if (err == -ENODEV) {
+			netif_device_detach(netdev);
+		} else {
+			dev_warn(ND2D(netdev), "failed tx_urb %d\n", err);
+
+			netdev->stats.tx_dropped += context->count;
+		}
+
+		/* Release context */
+		context->echo_index = MAX_TX_ECHO;
+	} else {
+		netdev->trans_start = jiffies;
+	}
+
+	/*
+	 * Release our reference to this URB, the USB core will eventually free
+	 * it entirely.
+	 */
+	usb_free_urb(urb);
+	context->urb = NULL;
 }
 
 /*
- * callback for bulk IN urb
+ * callback for bulk OUT urb
  */
 static void ems_usb_write_bulk_callback(struct urb *urb)
 {
 	struct ems_tx_urb_context *context = urb->context;
 	struct ems_usb *dev;
 	struct net_device *netdev;
+	unsigned long flags;
+	int i;
 
 	BUG_ON(!context);
 
@@ -522,7 +749,7 @@ static void ems_usb_write_bulk_callback(struct urb *urb)
 	netdev = dev->netdev;
 
 	/* free up our allocated buffer */
-	usb_buffer_free(urb->dev, urb->transfer_buffer_length,
+	usb_buffer_free(urb->dev, TX_BUFFER_SIZE,
 			urb->transfer_buffer, urb->transfer_dma);
 
 	atomic_dec(&dev->active_tx_urbs);
@@ -537,13 +764,30 @@ static void ems_usb_write_bulk_callback(struct urb *urb)
 	netdev->trans_start = jiffies;
 
 	/* transmission complete interrupt */
-	netdev->stats.tx_packets++;
-	netdev->stats.tx_bytes += context->dlc;
+	netdev->stats.tx_packets += context->count;
+	netdev->stats.tx_bytes += context->bytes;
 
-	can_get_echo_skb(netdev, context->echo_index);
+	for (i = 0; i < context->count; i++)
+		can_get_echo_skb(netdev, context->echo_index + i);
+
+	spin_lock_irqsave(&dev->tx_lock, flags);
 
 	/* Release context */
-	context->echo_index = MAX_TX_URBS;
+	context->echo_index = MAX_TX_ECHO;
+
+	/* Send the messages collected while this URB was in flight */
+	switch (urb->status) {
+	case -ECONNRESET: /* unlink */
+	case -ENOENT:
+	case -ESHUTDOWN:
+		break;
+
+	default:
+		ems_usb_tx_submit(dev);
+		break;
+	}
+
+	spin_unlock_irqrestore(&dev->tx_lock, flags);
 
 	if (netif_queue_stopped(netdev))
 		netif_wake_queue(netdev);
@@ -608,7 +852,7 @@ static int ems_usb_start(struct ems_usb *dev)
 	dev->intr_in_buffer[0] = 0;
 	dev->free_slots = 15; /* initial size */
 
-	for (i = 0; i < MAX_RX_URBS; i++) {
+	for (i = 0; i < rx_urbs; i++) {
 		struct urb *urb = NULL;
 		u8 *buf = NULL;
 
@@ -657,7 +901,7 @@ static int ems_usb_start(struct ems_usb *dev)
 	}
 
 	/* Warn if we've couldn't transmit all the URBs */
-	if (i < MAX_RX_URBS)
+	if (i < rx_urbs)
 		dev_warn(ND2D(netdev), "rx performance may be slow\n");
 
 	/* Setup and start interrupt URB */
@@ -712,6 +956,8 @@ failed:
 
 static void unlink_all_urbs(struct ems_usb *dev)
 {
+	struct ems_tx_urb_context *context;
+	unsigned long flags;
 	int i;
 
 	usb_unlink_urb(dev->intr_urb);
@@ -721,8 +967,40 @@ static void unlink_all_urbs(struct ems_usb *dev)
 	usb_kill_anchored_urbs(&dev->tx_submitted);
 	atomic_set(&dev->active_tx_urbs, 0);
 
+	/* Drop the messages that have not been submitted yet */
+	spin_lock_irqsave(&dev->tx_lock, flags);
+
+	context = dev->tx_pending;
+	if (context) {
+		for (i = 0; i < context->count; i++)
+			can_free_echo_skb(dev->netdev, context->echo_index + i);
+
+		usb_buffer_free(dev->udev, TX_BUFFER_SIZE, context->buf,
+				context->urb->transfer_dma);
+		usb_free_urb(context->urb);
+		context->urb = NULL;
+		dev->tx_pending = NULL;
+	}
+
 	for (i = 0; i < MAX_TX_URBS; i++)
-		dev->tx_contexts[i].echo_index = MAX_TX_URBS;
+		dev->tx_contexts[i].echo_index = MAX_TX_ECHO;
+
+	spin_unlock_irqrestore(&dev->tx_lock, flags);
+
+#ifdef EMS_USB_NAPI
+	/* Free the URBs the poll did not get to */
+	spin_lock_irqsave(&dev->rx_lock, flags);
+	while (dev->rx_tail != dev->rx_head) {
+		struct urb *urb;
+
+		urb = dev->rx_done[dev->rx_tail++ & (MAX_RX_URBS - 1)];
+		usb_buffer_free(dev->udev, RX_BUFFER_SIZE,
+				urb->transfer_buffer, urb->transfer_dma);
+		usb_free_urb(urb);
+	}
+	dev->rx_pos = 0;
+	spin_unlock_irqrestore(&dev->rx_lock, flags);
+#endif
 }
 
 static int ems_usb_open(struct net_device *netdev)
@@ -739,6 +1017,10 @@ static int ems_usb_open(struct net_device *netdev)
 	if (err)
 		return err;
 
+#ifdef EMS_USB_NAPI
+	napi_enable(&dev->napi);
+#endif
+
 	/* finally start device */
 	err = ems_usb_start(dev);
 	if (err) {
@@ -748,6 +1030,9 @@ static int ems_usb_open(struct net_device *netdev)
 		dev_warn(ND2D(netdev), "couldn't start device: %d\n",
 			 err);
 
+#ifdef EMS_USB_NAPI
+		napi_disable(&dev->napi);
+#endif
 		close_candev(netdev);
 
 		return err;
@@ -767,34 +1052,67 @@ static netdev_tx_t ems_usb_start_xmit(struct sk_buff *skb, struct net_device *ne
 #endif
 {
 	struct ems_usb *dev = netdev_priv(netdev);
-	struct ems_tx_urb_context *context = NULL;
+	struct ems_tx_urb_context *context;
 	struct net_device_stats *stats = &netdev->stats;
 	struct can_frame *cf = (struct can_frame *)skb->data;
 	struct ems_cpc_msg *msg;
-	struct urb *urb;
-	u8 *buf;
-	int i, err;
-	size_t size = CPC_HEADER_SIZE + CPC_MSG_HEADER_LEN
-			+ sizeof(struct cpc_can_msg);
+	unsigned long flags;
+	int i;
 
 	if (can_dropped_invalid_skb(netdev, skb))
 		return NETDEV_TX_OK;
 
-	/* create a URB, and a buffer for it, and copy the data to the URB */
-	urb = usb_alloc_urb(0, GFP_ATOMIC);
-	if (!urb) {
-		dev_err(ND2D(netdev), "No memory left for URBs\n");
-		goto nomem;
-	}
+	spin_lock_irqsave(&dev->tx_lock, flags);
 
-	buf = usb_buffer_alloc(dev->udev, size, GFP_ATOMIC, &urb->transfer_dma);
-	if (!buf) {
-		dev_err(ND2D(netdev), "No memory left for USB buffer\n");
-		usb_free_urb(urb);
-		goto nomem;
+	context = dev->tx_pending;
+	if (!context) {
+		for (i = 0; i < tx_urbs; i++) {
+			if (dev->tx_contexts[i].echo_index == MAX_TX_ECHO) {
+				context = &dev->tx_contexts[i];
+				break;
+			}
+		}
+
+		/*
+		 * May never happen! When this happens we'd more URBs in flight
+		 * as allowed (tx_urbs).
+		 */
+		if (!context) {
+			spin_unlock_irqrestore(&dev->tx_lock, flags);
+
+			dev_warn(ND2D(netdev), "couldn't find free context\n");
+
+			return NETDEV_TX_BUSY;
+		}
+
+		/* create a URB, and a buffer for it */
+		context->urb = usb_alloc_urb(0, GFP_ATOMIC);
+		if (!context->urb) {
+			dev_err(ND2D(netdev), "No memory left for URBs\n");
+			goto nomem;
+		}
+
+		context->buf = usb_buffer_alloc(dev->udev, TX_BUFFER_SIZE,
+						GFP_ATOMIC,
+						&context->urb->transfer_dma);
+		if (!context->buf) {
+			dev_err(ND2D(netdev), "No memory left for USB buffer\n");
+			usb_free_urb(context->urb);
+			context->urb = NULL;
+			goto nomem;
+		}
+
+		context->dev = dev;
+		context->echo_index = i * MAX_TX_MSGS;
+		context->size = CPC_HEADER_SIZE;
+		context->count = 0;
+		context->bytes = 0;
+
+		dev->tx_pending = context;
 	}
 
-	msg = (struct ems_cpc_msg *)&buf[CPC_HEADER_SIZE];
+	/* copy the data into the pending URB */
+	msg = (struct ems_cpc_msg *)&context->buf[context->size];
 
 	msg->msg.can_msg.id = cf->can_id & CAN_ERR_MASK;
 	msg->msg.can_msg.length = cf->can_dlc;
@@ -814,77 +1132,31 @@ static netdev_tx_t ems_usb_start_xmit(struct sk_buff *skb, struct net_device *ne
 		msg->length = CPC_CAN_MSG_MIN_SIZE + cf->can_dlc;
 	}
 
-	for (i = 0; i < MAX_TX_URBS; i++) {
-		if (dev->tx_contexts[i].echo_index == MAX_TX_URBS) {
-			context = &dev->tx_contexts[i];
-			break;
-		}
-	}
+	context->size += CPC_MSG_HEADER_LEN + msg->length;
+	context->bytes += cf->can_dlc;
 
-	/*
-	 * May never happen! When this happens we'd more URBs in flight as
-	 * allowed (MAX_TX_URBS).
-	 */
-	if (!context) {
-		usb_unanchor_urb(urb);
-		usb_buffer_free(dev->udev, size, buf, urb->transfer_dma);
+	can_put_echo_skb(skb, netdev, context->echo_index + context->count);
+	context->count++;
 
-		dev_warn(ND2D(netdev), "couldn't find free context\n");
+	/* send at once when the bus is idle, else at the next completion */
+	if (!atomic_read(&dev->active_tx_urbs) ||
+	    context->count == MAX_TX_MSGS)
+		ems_usb_tx_submit(dev);
 
-		return NETDEV_TX_BUSY;
+	/* Slow down tx path */
+	if (atomic_read(&dev->active_tx_urbs) >= tx_urbs ||
+	    dev->free_slots < 5) {
+		netif_stop_queue(netdev);
 	}
 
-	context->dev = dev;
-	context->echo_index = i;
-	context->dlc = cf->can_dlc;
-
-	usb_fill_bulk_urb(urb, dev->udev, usb_sndbulkpipe(dev->udev, 2), buf,
-			  size, ems_usb_write_bulk_callback, context);
-	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-	usb_anchor_urb(urb, &dev->tx_submitted);
-
-	can_put_echo_skb(skb, netdev, context->echo_index);
-
-	atomic_inc(&dev->active_tx_urbs);
-
-	err = usb_submit_urb(urb, GFP_ATOMIC);
-	if (unlikely(err)) {
-		can_free_echo_skb(netdev, context->echo_index);
-
-		usb_unanchor_urb(urb);
-		usb_buffer_free(dev->udev, size, buf, urb->transfer_dma);
-		dev_kfree_skb(skb);
-
-		atomic_dec(&dev->active_tx_urbs);
-
-		if (err == -ENODEV) {
-			netif_device_detach(netdev);
-		} else {
-			dev_warn(ND2D(netdev), "failed tx_urb %d\n", err);
-
-			stats->tx_dropped++;
-		}
-	} else {
-		netdev->trans_start = jiffies;
-
-		/* Slow down tx path */
-		if (atomic_read(&dev->active_tx_urbs) >= MAX_TX_URBS ||
-		    dev->free_slots < 5) {
-			netif_stop_queue(netdev);
-		}
-	}
-
-	/*
-	 * Release our reference to this URB, the USB core will eventually free
-	 * it entirely.
-	 */
-	usb_free_urb(urb);
+	spin_unlock_irqrestore(&dev->tx_lock, flags);
 
 	return NETDEV_TX_OK;
 
 nomem:
-	if (skb)
-		dev_kfree_skb(skb);
+	spin_unlock_irqrestore(&dev->tx_lock, flags);
+
+	dev_kfree_skb(skb);
 
 	stats->tx_dropped++;
 
@@ -896,6 +1168,9 @@ static int ems_usb_close(struct net_device *netdev)
 	struct ems_usb *dev = netdev_priv(netdev);
 
 	/* Stop polling */
+#ifdef EMS_USB_NAPI
+	napi_disable(&dev->napi);
+#endif
 	unlink_all_urbs(dev);
 
 	netif_stop_queue(netdev);
@@ -1015,7 +1290,7 @@ static int ems_usb_probe(struct usb_interface *intf,
 	struct ems_usb *dev;
 	int i, err = -ENOMEM;
 
-	netdev = alloc_candev(sizeof(struct ems_usb), MAX_TX_URBS);
+	netdev = alloc_candev(sizeof(struct ems_usb), tx_urbs * MAX_TX_MSGS);
 	if (!netdev) {
 		dev_err(ND2D(netdev), "Couldn't alloc candev\n");
 		return -ENOMEM;
@@ -1049,9 +1324,15 @@ static int ems_usb_probe(struct usb_interface *intf,
 
 	init_usb_anchor(&dev->tx_submitted);
 	atomic_set(&dev->active_tx_urbs, 0);
+	spin_lock_init(&dev->tx_lock);
+
+#ifdef EMS_USB_NAPI
+	spin_lock_init(&dev->rx_lock);
+	netif_napi_add(netdev, &dev->napi, ems_usb_poll, EMS_USB_NAPI_WEIGHT);
+#endif
 
 	for (i = 0; i < MAX_TX_URBS; i++)
-		dev->tx_contexts[i].echo_index = MAX_TX_URBS;
+		dev->tx_contexts[i].echo_index = MAX_TX_ECHO;
 
 	dev->intr_urb = usb_alloc_urb(0, GFP_KERNEL);
 	if (!dev->intr_urb) {
@@ -1120,13 +1401,15 @@ static void ems_usb_disconnect(struct usb_interface *intf)
 
 	if (dev) {
 		unregister_netdev(dev->netdev);
-		free_candev(dev->netdev);
 
 		unlink_all_urbs(dev);
 
 		usb_free_urb(dev->intr_urb);
 
 		kfree(dev->intr_in_buffer);
+
+		/* dev is part of the netdev, free it last */
+		free_candev(dev->netdev);
 	}
 }
 
@@ -1144,6 +1427,11 @@ static int __init ems_usb_init(void)
 
 	printk(KERN_INFO "CPC-USB kernel driver loaded\n");
 
+	rx_urbs = min_t(unsigned int, max_t(unsigned int, rx_urbs, 1),
+			MAX_RX_URBS);
+	tx_urbs = min_t(unsigned int, max_t(unsigned int, tx_urbs, 1),
+			MAX_TX_URBS);
+
 	/* register this driver with the USB subsystem */
 	err = usb_register(&ems_usb_driver);
 
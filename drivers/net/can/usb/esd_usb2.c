@@ -94,9 +94,27 @@ MODULE_LICENSE("GPL v2");
 #define ESD_BUSSTATE_BUSOFF	0xc0
 
 #define RX_BUFFER_SIZE		1024
-#define MAX_RX_URBS		4
+#define MAX_RX_URBS		4 /* must be power of 2 */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+/*
+ * Completed bulk IN URBs are parsed in a NAPI poll, the URB completion
+ * only queues them in rx_done. The nets share the URBs, so the NAPI
+ * context hangs off a dummy netdev of the USB device.
+ */
+#define ESD_USB2_NAPI
+#define ESD_USB2_NAPI_WEIGHT	32
+#endif
 #define MAX_TX_URBS		16 /* must be power of 2 */
 
+/*
+ * While a TX URB is in flight further CAN messages are collected in one
+ * pending URB, which is sent when it is full or when the USB core
+ * completes the previous one.
+ */
+#define MAX_TX_MSGS		8
+#define TX_BUFFER_SIZE		(MAX_TX_MSGS * sizeof(struct tx_msg))
+
 struct header_msg {
 	u8 len; /* len is always the total message length in 32bit words */
 	u8 cmd;
@@ -204,6 +222,16 @@ struct esd_usb2 {
 	int net_count;
 	u32 version;
 	int rxinitdone;
+
+#ifdef ESD_USB2_NAPI
+	struct net_device napi_dev;
+	struct napi_struct napi;
+	spinlock_t rx_lock; /* protects rx_done, rx_head and rx_tail */
+	struct urb *rx_done[MAX_RX_URBS]; /* completed, not yet parsed */
+	unsigned int rx_head;
+	unsigned int rx_tail;
+	int rx_pos; /* parse position in rx_done[rx_tail] */
+#endif
 };
 
 struct esd_usb2_net_priv {
@@ -213,6 +241,13 @@ struct esd_usb2_net_priv {
 	struct usb_anchor tx_submitted;
 	struct esd_tx_urb_context tx_contexts[MAX_TX_URBS];
 
+	spinlock_t tx_lock; /* protects the pending TX URB */
+	atomic_t active_tx_urbs;
+	struct urb *tx_urb; /* pending, not yet submitted */
+	u8 *tx_buf;
+	int tx_len;
+	int tx_count;
+
 	int open_time;
 	struct esd_usb2 *usb2;
 	struct net_device *netdev;
@@ -295,7 +330,11 @@ static void esd_usb2_rx_event(struct esd_usb2_net_priv *priv,
 			}
 		}
 
+#ifdef ESD_USB2_NAPI
+		netif_receive_skb(skb);
+#else
 		netif_rx(skb);
+#endif
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
 		priv->netdev->last_rx = jiffies;
@@ -305,6 +344,17 @@ static void esd_usb2_rx_event(struct esd_usb2_net_priv *priv,
 	}
 }
 
+/*
+ * The rx and tx done messages carry the free running microsecond counter
+ * of the device. It is passed on as hardware timestamp.
+ */
+static inline ktime_t esd_usb2_hwtstamp(__le32 ts)
+{
+	u32 us = le32_to_cpu(ts);
+
+	return ktime_set(us / USEC_PER_SEC, (us % USEC_PER_SEC) * NSEC_PER_USEC);
+}
+
 static void esd_usb2_rx_can_msg(struct esd_usb2_net_priv *priv,
 				struct esd_usb2_msg *msg)
 {
@@ -341,7 +391,16 @@ static void esd_usb2_rx_can_msg(struct esd_usb2_net_priv *priv,
 				cf->data[i] = msg->msg.rx.data[i];
 		}
 
+		can_skb_set_hwtstamp(skb, esd_usb2_hwtstamp(msg->msg.rx.ts));
+
+		can_rx_steer(skb);
+		can_rx_bus_load(skb);
+#ifdef ESD_USB2_NAPI
+		can_rx_napi_id(skb, &priv->usb2->napi);
+		netif_receive_skb(skb);
+#else
 		netif_rx(skb);
+#endif
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
 		priv->netdev->last_rx = jiffies;
@@ -368,7 +427,8 @@ static void esd_usb2_tx_done_msg(struct esd_usb2_net_priv *priv,
 	if (!msg->msg.txdone.status) {
 		stats->tx_packets++;
 		stats->tx_bytes += context->dlc;
-		can_get_echo_skb(netdev, context->echo_index);
+		can_get_echo_skb_hwtstamp(netdev, context->echo_index,
+				esd_usb2_hwtstamp(msg->msg.txdone.ts));
 	} else {
 		stats->tx_errors++;
 		can_free_echo_skb(netdev, context->echo_index);
@@ -381,31 +441,24 @@ static void esd_usb2_tx_done_msg(struct esd_usb2_net_priv *priv,
 	netif_wake_queue(netdev);
 }
 
-static void esd_usb2_read_bulk_callback(struct urb *urb)
+/*
+ * Process up to quota messages of a bulk IN transfer, starting at *pos.
+ * Returns the number of messages processed.
+ */
+static int esd_usb2_rx_msgs(struct esd_usb2 *dev, struct urb *urb,
+			    int *pos, int quota)
 {
-	struct esd_usb2 *dev = urb->context;
-	int retval;
-	int pos = 0;
-	int i;
-
-	switch (urb->status) {
-	case 0: /* success */
-		break;
-
-	case -ENOENT:
-	case -ESHUTDOWN:
-		return;
-
-	default:
-		dev_info(dev->udev->dev.parent,
-			 "Rx URB aborted (%d)\n", urb->status);
-		goto resubmit_urb;
-	}
+	struct esd_usb2_msg *msg;
+	int done = 0;
 
-	while (pos < urb->actual_length) {
-		struct esd_usb2_msg *msg;
+	while (*pos < urb->actual_length && done < quota) {
+		msg = (struct esd_usb2_msg *)(urb->transfer_buffer + *pos);
 
-		msg = (struct esd_usb2_msg *)(urb->transfer_buffer + pos);
+		if (!msg->msg.hdr.len) {
+			dev_err(dev->udev->dev.parent, "format error\n");
+			*pos = urb->actual_length;
+			break;
+		}
 
 		switch (msg->msg.hdr.cmd) {
 		case CMD_CAN_RX:
@@ -418,20 +471,34 @@ static void esd_usb2_read_bulk_callback(struct urb *urb)
 			break;
 		}
 
-		pos += msg->msg.hdr.len << 2;
+		*pos += msg->msg.hdr.len << 2;
+		done++;
 
-		if (pos > urb->actual_length) {
+		if (*pos > urb->actual_length) {
 			dev_err(dev->udev->dev.parent, "format error\n");
 			break;
 		}
 	}
 
-resubmit_urb:
+	return done;
+}
+
+static void esd_usb2_read_bulk_callback(struct urb *urb);
+
+static void esd_usb2_rx_resubmit(struct esd_usb2 *dev, struct urb *urb)
+{
+	int retval;
+	int i;
+
 	usb_fill_bulk_urb(urb, dev->udev, usb_rcvbulkpipe(dev->udev, 1),
 			  urb->transfer_buffer, RX_BUFFER_SIZE,
 			  esd_usb2_read_bulk_callback, dev);
+	usb_anchor_urb(urb, &dev->rx_submitted);
 
 	retval = usb_submit_urb(urb, GFP_ATOMIC);
+	if (retval)
+		usb_unanchor_urb(urb);
+
 	if (retval == -ENODEV) {
 		for (i = 0; i < dev->net_count; i++) {
 			if (dev->nets[i])
@@ -441,39 +508,221 @@ resubmit_urb:
 		dev_err(dev->udev->dev.parent,
 			"failed resubmitting read bulk urb: %d\n", retval);
 	}
+}
 
-	return;
+#ifdef ESD_USB2_NAPI
+static int esd_usb2_poll(struct napi_struct *napi, int quota)
+{
+	struct esd_usb2 *dev = container_of(napi, struct esd_usb2, napi);
+	struct urb *urb;
+	unsigned long flags;
+	int work_done = 0;
+	int pending;
+
+	while (work_done < quota) {
+		spin_lock_irqsave(&dev->rx_lock, flags);
+		urb = NULL;
+		if (dev->rx_tail != dev->rx_head)
+			urb = dev->rx_done[dev->rx_tail & (MAX_RX_URBS - 1)];
+		spin_unlock_irqrestore(&dev->rx_lock, flags);
+
+		if (!urb)
+			break;
+
+		work_done += esd_usb2_rx_msgs(dev, urb, &dev->rx_pos,
+					      quota - work_done);
+
+		/* quota exhausted within this transfer */
+		if (dev->rx_pos < urb->actual_length)
+			break;
+
+		spin_lock_irqsave(&dev->rx_lock, flags);
+		dev->rx_tail++;
+		spin_unlock_irqrestore(&dev->rx_lock, flags);
+		dev->rx_pos = 0;
+
+		esd_usb2_rx_resubmit(dev, urb);
+		usb_free_urb(urb);
+	}
+
+	if (work_done < quota) {
+		napi_complete(napi);
+
+		/* catch URBs queued while we were completing */
+		spin_lock_irqsave(&dev->rx_lock, flags);
+		pending = dev->rx_tail != dev->rx_head;
+		spin_unlock_irqrestore(&dev->rx_lock, flags);
+
+		if (pending && napi_schedule_prep(napi))
+			__napi_schedule(napi);
+	}
+
+	return work_done;
+}
+#endif
+
+static void esd_usb2_read_bulk_callback(struct urb *urb)
+{
+	struct esd_usb2 *dev = urb->context;
+#ifdef ESD_USB2_NAPI
+	unsigned long flags;
+#else
+	int pos = 0;
+#endif
+
+	switch (urb->status) {
+	case 0: /* success */
+		break;
+
+	case -ENOENT:
+	case -ESHUTDOWN:
+		return;
+
+	default:
+		dev_info(dev->udev->dev.parent,
+			 "Rx URB aborted (%d)\n", urb->status);
+		goto resubmit_urb;
+	}
+
+#ifdef ESD_USB2_NAPI
+	if (urb->actual_length > 0) {
+		/* keep the URB until the poll has parsed it */
+		usb_get_urb(urb);
+
+		spin_lock_irqsave(&dev->rx_lock, flags);
+		dev->rx_done[dev->rx_head++ & (MAX_RX_URBS - 1)] = urb;
+		spin_unlock_irqrestore(&dev->rx_lock, flags);
+
+		napi_schedule(&dev->napi);
+		return;
+	}
+#else
+	esd_usb2_rx_msgs(dev, urb, &pos, INT_MAX);
+#endif
+
+resubmit_urb:
+	esd_usb2_rx_resubmit(dev, urb);
+}
+
+/*
+ * Release the TX contexts of all messages in a TX buffer that will
+ * never be sent
+ */
+static void esd_usb2_tx_discard(struct esd_usb2_net_priv *priv,
+				u8 *buf, int len)
+{
+	struct esd_usb2_msg *msg;
+	int pos = 0;
+	u32 hnd;
+
+	while (pos < len) {
+		msg = (struct esd_usb2_msg *)(buf + pos);
+		hnd = msg->msg.tx.hnd & (MAX_TX_URBS - 1);
+
+		can_free_echo_skb(priv->netdev, hnd);
+		priv->tx_contexts[hnd].echo_index = MAX_TX_URBS;
+		atomic_dec(&priv->active_tx_jobs);
+
+		pos += msg->msg.hdr.len << 2;
+	}
+}
+
+static void esd_usb2_write_bulk_callback(struct urb *urb);
+
+/*
+ * Submit the pending TX URB, called with tx_lock held
+ */
+static void esd_usb2_tx_submit(struct esd_usb2_net_priv *priv)
+{
+	struct esd_usb2 *dev = priv->usb2;
+	struct net_device *netdev = priv->netdev;
+	struct urb *urb = priv->tx_urb;
+	int err;
+
+	if (!urb)
+		return;
+
+	priv->tx_urb = NULL;
+
+	usb_fill_bulk_urb(urb, dev->udev, usb_sndbulkpipe(dev->udev, 2),
+			  priv->tx_buf, priv->tx_len,
+			  esd_usb2_write_bulk_callback, priv);
+
+	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+	usb_anchor_urb(urb, &priv->tx_submitted);
+
+	atomic_inc(&priv->active_tx_urbs);
+
+	err = usb_submit_urb(urb, GFP_ATOMIC);
+	if (err) {
+		esd_usb2_tx_discard(priv, priv->tx_buf, priv->tx_len);
+
+		atomic_dec(&priv->active_tx_urbs);
+		usb_unanchor_urb(urb);
+		usb_buffer_free(dev->udev, TX_BUFFER_SIZE, priv->tx_buf,
+				urb->transfer_dma);
+
+		netdev->stats.tx_dropped += priv->tx_count;
+
+		if (err == -ENODEV)
+			netif_device_detach(netdev);
+		else
+			dev_warn(ND2D(netdev), "failed tx_urb %d\n", err);
+	} else {
+		netdev->trans_start = jiffies;
+	}
+
+	/*
+	 * Release our reference to this URB, the USB core will eventually free
+	 * it entirely.
+	 */
+	usb_free_urb(urb);
 }
 
 /*
- * callback for bulk IN urb
+ * callback for bulk OUT urb
  */
 static void esd_usb2_write_bulk_callback(struct urb *urb)
 {
-	struct esd_tx_urb_context *context = urb->context;
-	struct esd_usb2_net_priv *priv;
-	struct esd_usb2 *dev;
+	struct esd_usb2_net_priv *priv = urb->context;
 	struct net_device *netdev;
-	size_t size = sizeof(struct esd_usb2_msg);
+	unsigned long flags;
 
-	BUG_ON(!context);
+	BUG_ON(!priv);
 
-	priv = context->priv;
 	netdev = priv->netdev;
-	dev = priv->usb2;
 
 	/* free up our allocated buffer */
-	usb_buffer_free(urb->dev, size,
+	usb_buffer_free(urb->dev, TX_BUFFER_SIZE,
 			urb->transfer_buffer, urb->transfer_dma);
 
+	atomic_dec(&priv->active_tx_urbs);
+
 	if (!netif_device_present(netdev))
 		return;
 
-	if (urb->status)
+	switch (urb->status) {
+	case 0: /* success */
+		break;
+
+	case -ECONNRESET: /* unlink */
+	case -ENOENT:
+	case -ESHUTDOWN:
+		return;
+
+	default:
 		dev_info(ND2D(netdev), "Tx URB aborted (%d)\n",
 			 urb->status);
+		break;
+	}
 
 	netdev->trans_start = jiffies;
+
+	/* Send the messages collected while this URB was in flight */
+	spin_lock_irqsave(&priv->tx_lock, flags);
+	esd_usb2_tx_submit(priv);
+	spin_unlock_irqrestore(&priv->tx_lock, flags);
 }
 
 #ifdef CONFIG_SYSFS
@@ -546,6 +795,10 @@ static int esd_usb2_setup_rx_urbs(struct esd_usb2 *dev)
 	if (dev->rxinitdone)
 		return 0;
 
+#ifdef ESD_USB2_NAPI
+	napi_enable(&dev->napi);
+#endif
+
 	for (i = 0; i < MAX_RX_URBS; i++) {
 		struct urb *urb = NULL;
 		u8 *buf = NULL;
@@ -592,6 +845,9 @@ freeurb:
 	/* Did we submit any URBs */
 	if (i == 0) {
 		dev_err(dev->udev->dev.parent, "couldn't setup read URBs\n");
+#ifdef ESD_USB2_NAPI
+		napi_disable(&dev->napi);
+#endif
 		return err;
 	}
 
@@ -661,17 +917,56 @@ failed:
 static void unlink_all_urbs(struct esd_usb2 *dev)
 {
 	struct esd_usb2_net_priv *priv;
-	int i;
+	unsigned long flags;
+	int i, j;
+
+#ifdef ESD_USB2_NAPI
+	if (dev->rxinitdone) {
+		napi_disable(&dev->napi);
+		dev->rxinitdone = 0;
+	}
+#endif
 
 	usb_kill_anchored_urbs(&dev->rx_submitted);
+
+#ifdef ESD_USB2_NAPI
+	/* Free the URBs the poll did not get to */
+	spin_lock_irqsave(&dev->rx_lock, flags);
+	while (dev->rx_tail != dev->rx_head) {
+		struct urb *urb;
+
+		urb = dev->rx_done[dev->rx_tail++ & (MAX_RX_URBS - 1)];
+		usb_buffer_free(dev->udev, RX_BUFFER_SIZE,
+				urb->transfer_buffer, urb->transfer_dma);
+		usb_free_urb(urb);
+	}
+	dev->rx_pos = 0;
+	spin_unlock_irqrestore(&dev->rx_lock, flags);
+#endif
+
 	for (i = 0; i < dev->net_count; i++) {
 		priv = dev->nets[i];
 		if (priv) {
 			usb_kill_anchored_urbs(&priv->tx_submitted);
+
+			/* Drop the messages not submitted yet */
+			spin_lock_irqsave(&priv->tx_lock, flags);
+			if (priv->tx_urb) {
+				esd_usb2_tx_discard(priv, priv->tx_buf,
+						    priv->tx_len);
+				usb_buffer_free(dev->udev, TX_BUFFER_SIZE,
+						priv->tx_buf,
+						priv->tx_urb->transfer_dma);
+				usb_free_urb(priv->tx_urb);
+				priv->tx_urb = NULL;
+			}
+			spin_unlock_irqrestore(&priv->tx_lock, flags);
+
 			atomic_set(&priv->active_tx_jobs, 0);
+			atomic_set(&priv->active_tx_urbs, 0);
 
-			for (i = 0; i < MAX_TX_URBS; i++)
-				priv->tx_contexts[i].echo_index = MAX_TX_URBS;
+			for (j = 0; j < MAX_TX_URBS; j++)
+				priv->tx_contexts[j].echo_index = MAX_TX_URBS;
 		}
 	}
 }
@@ -716,30 +1011,51 @@ static netdev_tx_t esd_usb2_start_xmit(struct sk_buff *skb,
 	struct net_device_stats *stats = &netdev->stats;
 	struct can_frame *cf = (struct can_frame *)skb->data;
 	struct esd_usb2_msg *msg;
-	struct urb *urb;
-	u8 *buf;
-	int i, err;
-	int ret = NETDEV_TX_OK;
-	size_t size = sizeof(struct esd_usb2_msg);
-
-	/* create a URB, and a buffer for it, and copy the data to the URB */
-	urb = usb_alloc_urb(0, GFP_ATOMIC);
-	if (!urb) {
-		dev_err(ND2D(netdev), "No memory left for URBs\n");
-		stats->tx_dropped++;
-		kfree_skb(skb);
-		goto nourbmem;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&priv->tx_lock, flags);
+
+	for (i = 0; i < MAX_TX_URBS; i++) {
+		if (priv->tx_contexts[i].echo_index == MAX_TX_URBS) {
+			context = &priv->tx_contexts[i];
+			break;
+		}
+	}
+
+	/*
+	 * This may never happen.
+	 */
+	if (!context) {
+		spin_unlock_irqrestore(&priv->tx_lock, flags);
+		dev_warn(ND2D(netdev), "couldn't find free context\n");
+		return NETDEV_TX_BUSY;
 	}
 
-	buf = usb_buffer_alloc(dev->udev, size, GFP_ATOMIC, &urb->transfer_dma);
-	if (!buf) {
-		dev_err(ND2D(netdev), "No memory left for USB buffer\n");
-		stats->tx_dropped++;
-		kfree_skb(skb);
-		goto nobufmem;
+	if (!priv->tx_urb) {
+		/* create a URB, and a buffer for it */
+		priv->tx_urb = usb_alloc_urb(0, GFP_ATOMIC);
+		if (!priv->tx_urb) {
+			dev_err(ND2D(netdev), "No memory left for URBs\n");
+			goto nomem;
+		}
+
+		priv->tx_buf = usb_buffer_alloc(dev->udev, TX_BUFFER_SIZE,
+						GFP_ATOMIC,
+						&priv->tx_urb->transfer_dma);
+		if (!priv->tx_buf) {
+			dev_err(ND2D(netdev), "No memory left for USB buffer\n");
+			usb_free_urb(priv->tx_urb);
+			priv->tx_urb = NULL;
+			goto nomem;
+		}
+
+		priv->tx_len = 0;
+		priv->tx_count = 0;
 	}
 
-	msg = (struct esd_usb2_msg *)buf;
+	/* copy the data into the pending URB */
+	msg = (struct esd_usb2_msg *)(priv->tx_buf + priv->tx_len);
 
 	msg->msg.hdr.len = 3; /* minimal length */
 	msg->msg.hdr.cmd = CMD_CAN_TX;
@@ -758,22 +1074,7 @@ static netdev_tx_t esd_usb2_start_xmit(struct sk_buff *skb,
 
 	msg->msg.hdr.len += (cf->can_dlc + 3) >> 2;
 
-	for (i = 0; i < MAX_TX_URBS; i++) {
-		if (priv->tx_contexts[i].echo_index == MAX_TX_URBS) {
-			context = &priv->tx_contexts[i];
-			break;
-		}
-	}
-
-	/*
-	 * This may never happen.
-	 */
-	if (!context) {
-		dev_warn(ND2D(netdev), "couldn't find free context\n");
-		ret = NETDEV_TX_BUSY;
-		goto releasebuf;
-	}
-
+	i = context - priv->tx_contexts;
 	context->priv = priv;
 	context->echo_index = i;
 	context->dlc = cf->can_dlc;
@@ -781,57 +1082,33 @@ static netdev_tx_t esd_usb2_start_xmit(struct sk_buff *skb,
 	/* hnd must not be 0 */
 	msg->msg.tx.hnd = 0x80000000 | i; /* returned in TX done message */
 
-	usb_fill_bulk_urb(urb, dev->udev, usb_sndbulkpipe(dev->udev, 2), buf,
-			  msg->msg.hdr.len << 2,
-			  esd_usb2_write_bulk_callback, context);
-
-	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-
-	usb_anchor_urb(urb, &priv->tx_submitted);
+	priv->tx_len += msg->msg.hdr.len << 2;
+	priv->tx_count++;
 
 	can_put_echo_skb(skb, netdev, context->echo_index);
 
 	atomic_inc(&priv->active_tx_jobs);
 
-	err = usb_submit_urb(urb, GFP_ATOMIC);
-	if (err) {
-		can_free_echo_skb(netdev, context->echo_index);
-
-		atomic_dec(&priv->active_tx_jobs);
-		usb_unanchor_urb(urb);
-
-		stats->tx_dropped++;
-
-		if (err == -ENODEV)
-			netif_device_detach(netdev);
-		else
-			dev_warn(ND2D(netdev), "failed tx_urb %d\n", err);
-
-		goto releasebuf;
-	}
-
-	netdev->trans_start = jiffies;
+	/* send at once when the bus is idle, else at the next completion */
+	if (!atomic_read(&priv->active_tx_urbs) ||
+	    priv->tx_count == MAX_TX_MSGS)
+		esd_usb2_tx_submit(priv);
 
 	/* Slow down tx path */
 	if (atomic_read(&priv->active_tx_jobs) >= MAX_TX_URBS)
 		netif_stop_queue(netdev);
 
-	/*
-	 * Release our reference to this URB, the USB core will eventually free
-	 * it entirely.
-	 */
-	usb_free_urb(urb);
+	spin_unlock_irqrestore(&priv->tx_lock, flags);
 
 	return NETDEV_TX_OK;
 
-releasebuf:
-	usb_buffer_free(dev->udev, size, buf, urb->transfer_dma);
+nomem:
+	spin_unlock_irqrestore(&priv->tx_lock, flags);
 
-nobufmem:
-	usb_free_urb(urb);
+	stats->tx_dropped++;
+	kfree_skb(skb);
 
-nourbmem:
-	return ret;
+	return NETDEV_TX_OK;
 }
 
 static int esd_usb2_close(struct net_device *netdev)
@@ -955,6 +1232,8 @@ static int esd_usb2_probe_one_net(struct usb_interface *intf, int index)
 
 	init_usb_anchor(&priv->tx_submitted);
 	atomic_set(&priv->active_tx_jobs, 0);
+	atomic_set(&priv->active_tx_urbs, 0);
+	spin_lock_init(&priv->tx_lock);
 
 	for (i = 0; i < MAX_TX_URBS; i++)
 		priv->tx_contexts[i].echo_index = MAX_TX_URBS;
@@ -1015,6 +1294,13 @@ static int esd_usb2_probe(struct usb_interface *intf,
 
 	init_usb_anchor(&dev->rx_submitted);
 
+#ifdef ESD_USB2_NAPI
+	spin_lock_init(&dev->rx_lock);
+	init_dummy_netdev(&dev->napi_dev);
+	netif_napi_add(&dev->napi_dev, &dev->napi, esd_usb2_poll,
+		       ESD_USB2_NAPI_WEIGHT);
+#endif
+
 	usb_set_intfdata(intf, dev);
 
 	/* query number of CAN interfaces (nets) */
@@ -1083,10 +1369,18 @@ static void esd_usb2_disconnect(struct usb_interface *intf)
 			if (dev->nets[i]) {
 				netdev = dev->nets[i]->netdev;
 				unregister_netdev(netdev);
-				free_candev(netdev);
 			}
 		}
 		unlink_all_urbs(dev);
+
+		/* unlink_all_urbs() still uses the nets, free them last */
+		for (i = 0; i < dev->net_count; i++) {
+			if (dev->nets[i])
+				free_candev(dev->nets[i]->netdev);
+		}
+#ifdef ESD_USB2_NAPI
+		netif_napi_del(&dev->napi);
+#endif
 	}
 }
 
@@ -47,6 +47,10 @@
 #include <linux/netdevice.h>
 #include <linux/if_arp.h>
 #include <linux/if_ether.h>
+#include <linux/jhash.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/random.h>
 #include <socketcan/can.h>
 #include <socketcan/can/dev.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,23)
@@ -91,51 +95,155 @@ static int echo; /* echo testing. Default: 0 (Off) */
 module_param(echo, bool, S_IRUGO);
 MODULE_PARM_DESC(echo, "Echo sent frames (for testing). Default: 0 (Off)");
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+/*
+ * Provide a flow hash of the CAN ID for RPS, so that the rx processing of
+ * the echoed frames can be spread over the CPUs configured in
+ * /sys/class/net/vcanX/queues/rx-0/rps_cpus keeping the order per CAN ID.
+ */
+#define VCAN_RX_HASH
+
+static int rx_hash; /* Default: 0 (Off) */
+module_param(rx_hash, bool, S_IRUGO);
+MODULE_PARM_DESC(rx_hash, "Hash CAN IDs for RPS (needs echo). Default: 0");
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24)
 static struct net_device **vcan_devs; /* root pointer to netdevice structs */
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+/*
+ * Per CPU statistics: Many senders on different CPUs must not contend on
+ * the shared dev->stats. Together with NETIF_F_LLTX this makes vcan_tx()
+ * run without any shared lock or counter.
+ */
+#define VCAN_PCPU_STATS
+
+#include <linux/u64_stats_sync.h>
+
+struct vcan_pcpu_stats {
+	u64 rx_packets;
+	u64 rx_bytes;
+	u64 tx_packets;
+	u64 tx_bytes;
+	struct u64_stats_sync syncp;
+};
+
+/*
+ * Bus emulation: With a bitrate set (sysfs 'bitrate' or the bitrate module
+ * parameter) the frames are serialized at the time the bitstream including
+ * the stuff bits takes on a real bus. The transmission is completed after
+ * an additional fixed latency plus a random jitter.
+ */
+#define VCAN_BUS_EMU
+#define VCAN_EMU_TXQ 8 /* frames in flight, like a controller tx fifo */
+
+struct vcan_priv {
+	struct vcan_pcpu_stats __percpu *stats;
+
+	struct net_device *dev;
+	unsigned int bitrate;		/* bit/s, 0 = no emulation */
+	unsigned int latency_us;	/* fixed delay of the tx completion */
+	unsigned int jitter_us;		/* maximum random extra delay */
+	spinlock_t emu_lock;
+	struct sk_buff_head emu_q;	/* frames with their completion time */
+	struct hrtimer emu_timer;
+	struct sk_buff_head emu_done;	/* sent frames for the tasklet */
+	struct tasklet_struct emu_tsklet;
+	s64 bus_free_ns;		/* end of the last frame on the bus */
+	s64 last_due_ns;		/* keeps the completions in order */
+};
+
+struct vcan_emu_cb {
+	s64 due_ns;
+};
+
+#define VCAN_EMU_CB(skb) ((struct vcan_emu_cb *)(skb)->cb)
+
+static unsigned int bitrate; /* Default: 0 (Off) */
+module_param(bitrate, uint, S_IRUGO);
+MODULE_PARM_DESC(bitrate, "Emulated bitrate of new interfaces. Default: 0");
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
 #define PRIVSIZE sizeof(struct net_device_stats)
 #elif LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24)
 #define PRIVSIZE 0
 #endif
 
-static void vcan_rx(struct sk_buff *skb, struct net_device *dev)
+static void vcan_count(struct net_device *dev, int tx, unsigned int len)
 {
-	struct can_frame *cf = (struct can_frame *)skb->data;
+#ifdef VCAN_PCPU_STATS
+	struct vcan_priv *priv = netdev_priv(dev);
+	struct vcan_pcpu_stats *st;
+
+	st = per_cpu_ptr(priv->stats, get_cpu());
+	u64_stats_update_begin(&st->syncp);
+	if (tx) {
+		st->tx_packets++;
+		st->tx_bytes += len;
+	} else {
+		st->rx_packets++;
+		st->rx_bytes += len;
+	}
+	u64_stats_update_end(&st->syncp);
+	put_cpu();
+#else
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,23)
 	struct net_device_stats *stats = &dev->stats;
 #else
 	struct net_device_stats *stats = netdev_priv(dev);
 #endif
 
-	stats->rx_packets++;
-	stats->rx_bytes += cf->can_dlc;
+	if (tx) {
+		stats->tx_packets++;
+		stats->tx_bytes += len;
+	} else {
+		stats->rx_packets++;
+		stats->rx_bytes += len;
+	}
+#endif
+}
+
+static void vcan_rx(struct sk_buff *skb, struct net_device *dev)
+{
+	struct can_frame *cf = (struct can_frame *)skb->data;
+
+	vcan_count(dev, 0, cf->can_dlc);
 
 	skb->protocol  = htons(ETH_P_CAN);
 	skb->pkt_type  = PACKET_BROADCAST;
 	skb->dev       = dev;
 	skb->ip_summed = CHECKSUM_UNNECESSARY;
 
-	netif_rx_ni(skb);
+#ifdef VCAN_RX_HASH
+	if (rx_hash) {
+		/* a zero hash means 'no hash' for the stack */
+		u32 hash = jhash_1word(cf->can_id, 0) ?: 1;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
+		skb_set_hash(skb, hash, PKT_HASH_TYPE_L4);
+#else
+		skb->rxhash = hash;
+#endif
+	}
+#endif
+
+	/* netif_rx_ni() only for process context, see vcan_emu_done() */
+	if (in_interrupt())
+		netif_rx(skb);
+	else
+		netif_rx_ni(skb);
 }
 
-static int vcan_tx(struct sk_buff *skb, struct net_device *dev)
+/* the frame has been sent on the (virtual) bus */
+static void vcan_tx_done(struct sk_buff *skb, struct net_device *dev)
 {
 	struct can_frame *cf = (struct can_frame *)skb->data;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,23)
-	struct net_device_stats *stats = &dev->stats;
-#else
-	struct net_device_stats *stats = netdev_priv(dev);
-#endif
 	int loop;
 
-	if (can_dropped_invalid_skb(dev, skb))
-		return NETDEV_TX_OK;
-
-	stats->tx_packets++;
-	stats->tx_bytes += cf->can_dlc;
+	vcan_count(dev, 1, cf->can_dlc);
 
 	/* set flag whether this packet has to be looped back */
 	loop = skb->pkt_type == PACKET_LOOPBACK;
@@ -148,11 +256,10 @@ static int vcan_tx(struct sk_buff *skb, struct net_device *dev)
 			 * only count the packets here, because the
 			 * CAN core already did the echo for us
 			 */
-			stats->rx_packets++;
-			stats->rx_bytes += cf->can_dlc;
+			vcan_count(dev, 0, cf->can_dlc);
 		}
 		kfree_skb(skb);
-		return NETDEV_TX_OK;
+		return;
 	}
 
 	/* perform standard echo handling for CAN network interfaces */
@@ -162,7 +269,7 @@ static int vcan_tx(struct sk_buff *skb, struct net_device *dev)
 
 		skb = skb_share_check(skb, GFP_ATOMIC);
 		if (!skb)
-			return NETDEV_TX_OK;
+			return;
 
 		/* receive with packet counting */
 		skb->sk = srcsk;
@@ -171,6 +278,204 @@ static int vcan_tx(struct sk_buff *skb, struct net_device *dev)
 		/* no looped packets => no counting */
 		kfree_skb(skb);
 	}
+}
+
+#ifdef VCAN_BUS_EMU
+struct vcan_bits {
+	unsigned int crc;
+	unsigned int stuff;
+	int run;
+	int last;
+};
+
+/* feed nbits of val (MSB first) into the CRC and count the stuff bits */
+static void vcan_put_bits(struct vcan_bits *b, u32 val, int nbits, int crc)
+{
+	int bit, nxt;
+
+	while (nbits--) {
+		bit = (val >> nbits) & 1;
+
+		if (crc) {
+			nxt = bit ^ ((b->crc >> 14) & 1);
+			b->crc = (b->crc << 1) & 0x7FFF;
+			if (nxt)
+				b->crc ^= 0x4599; /* CAN CRC-15 polynomial */
+		}
+
+		if (bit != b->last) {
+			b->last = bit;
+			b->run = 1;
+		} else if (++b->run == 5) {
+			/* the stuff bit starts the next run */
+			b->stuff++;
+			b->last = !bit;
+			b->run = 1;
+		}
+	}
+}
+
+/* number of bits the frame occupies on the bus including stuff bits */
+static unsigned int vcan_frame_bits(const struct can_frame *cf)
+{
+	struct vcan_bits b = { .last = -1 };
+	int rtr = (cf->can_id & CAN_RTR_FLAG) ? 1 : 0;
+	int len = rtr ? 0 : cf->can_dlc;
+	unsigned int bits;
+	canid_t id;
+	int i;
+
+	vcan_put_bits(&b, 0, 1, 1); /* SOF */
+	if (cf->can_id & CAN_EFF_FLAG) {
+		id = cf->can_id & CAN_EFF_MASK;
+		vcan_put_bits(&b, id >> 18, 11, 1);
+		vcan_put_bits(&b, 3, 2, 1); /* SRR, IDE */
+		vcan_put_bits(&b, id & 0x3FFFF, 18, 1);
+		vcan_put_bits(&b, rtr, 1, 1);
+		vcan_put_bits(&b, 0, 2, 1); /* r1, r0 */
+		bits = 1 + 11 + 2 + 18 + 1 + 2;
+	} else {
+		id = cf->can_id & CAN_SFF_MASK;
+		vcan_put_bits(&b, id, 11, 1);
+		vcan_put_bits(&b, rtr, 1, 1);
+		vcan_put_bits(&b, 0, 2, 1); /* IDE, r0 */
+		bits = 1 + 11 + 1 + 2;
+	}
+
+	vcan_put_bits(&b, cf->can_dlc, 4, 1);
+	for (i = 0; i < len; i++)
+		vcan_put_bits(&b, cf->data[i], 8, 1);
+	vcan_put_bits(&b, b.crc, 15, 0);
+
+	/* + CRC delimiter, ACK slot + delimiter, EOF and intermission */
+	return bits + 4 + 8 * len + 15 + b.stuff + 1 + 2 + 7 + 3;
+}
+
+static enum hrtimer_restart vcan_emu_timer(struct hrtimer *timer)
+{
+	struct vcan_priv *priv = container_of(timer, struct vcan_priv,
+					      emu_timer);
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	struct sk_buff_head done;
+	struct sk_buff *skb;
+	unsigned long flags;
+	s64 now = ktime_to_ns(ktime_get());
+
+	__skb_queue_head_init(&done);
+
+	spin_lock_irqsave(&priv->emu_lock, flags);
+	while ((skb = skb_peek(&priv->emu_q))) {
+		s64 due = VCAN_EMU_CB(skb)->due_ns;
+
+		if (due > now) {
+			hrtimer_set_expires(timer, ns_to_ktime(due));
+			ret = HRTIMER_RESTART;
+			break;
+		}
+		__skb_unlink(skb, &priv->emu_q);
+		__skb_queue_tail(&done, skb);
+	}
+	if (skb_queue_len(&priv->emu_q) < VCAN_EMU_TXQ &&
+	    netif_queue_stopped(priv->dev))
+		netif_wake_queue(priv->dev);
+	spin_unlock_irqrestore(&priv->emu_lock, flags);
+
+	/*
+	 * The timer runs in hardirq context where the skbs of the sockets
+	 * must not be freed or received. The tasklet completes the frames.
+	 */
+	if (!skb_queue_empty(&done)) {
+		spin_lock_irqsave(&priv->emu_done.lock, flags);
+		skb_queue_splice_tail_init(&done, &priv->emu_done);
+		spin_unlock_irqrestore(&priv->emu_done.lock, flags);
+		tasklet_schedule(&priv->emu_tsklet);
+	}
+
+	return ret;
+}
+
+static void vcan_emu_done(unsigned long data)
+{
+	struct vcan_priv *priv = (struct vcan_priv *)data;
+	struct sk_buff *skb;
+
+	while ((skb = skb_dequeue(&priv->emu_done)))
+		vcan_tx_done(skb, priv->dev);
+}
+
+/* put the frame on the emulated bus */
+static void vcan_emu_xmit(struct sk_buff *skb, struct net_device *dev)
+{
+	struct vcan_priv *priv = netdev_priv(dev);
+	struct can_frame *cf = (struct can_frame *)skb->data;
+	unsigned long flags;
+	s64 now, start, due;
+
+	spin_lock_irqsave(&priv->emu_lock, flags);
+	now = ktime_to_ns(ktime_get());
+	start = max(now, priv->bus_free_ns);
+	priv->bus_free_ns = start + div_u64((u64)vcan_frame_bits(cf) *
+					    NSEC_PER_SEC, priv->bitrate);
+
+	due = priv->bus_free_ns + (s64)priv->latency_us * NSEC_PER_USEC;
+	if (priv->jitter_us)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,8,0)
+		due += (s64)(prandom_u32() % (priv->jitter_us + 1)) *
+#else
+		due += (s64)(random32() % (priv->jitter_us + 1)) *
+#endif
+			NSEC_PER_USEC;
+
+	/* a CAN bus does not reorder frames */
+	due = max(due, priv->last_due_ns);
+	priv->last_due_ns = due;
+	VCAN_EMU_CB(skb)->due_ns = due;
+
+	__skb_queue_tail(&priv->emu_q, skb);
+	if (skb_queue_len(&priv->emu_q) == 1)
+		hrtimer_start(&priv->emu_timer, ns_to_ktime(due),
+			      HRTIMER_MODE_ABS);
+	if (skb_queue_len(&priv->emu_q) >= VCAN_EMU_TXQ)
+		netif_stop_queue(dev);
+	spin_unlock_irqrestore(&priv->emu_lock, flags);
+}
+
+static int vcan_open(struct net_device *dev)
+{
+	netif_start_queue(dev);
+
+	return 0;
+}
+
+static int vcan_close(struct net_device *dev)
+{
+	struct vcan_priv *priv = netdev_priv(dev);
+
+	netif_stop_queue(dev);
+	hrtimer_cancel(&priv->emu_timer);
+	tasklet_kill(&priv->emu_tsklet);
+	skb_queue_purge(&priv->emu_q);
+	skb_queue_purge(&priv->emu_done);
+	priv->bus_free_ns = 0;
+	priv->last_due_ns = 0;
+
+	return 0;
+}
+#endif
+
+static int vcan_tx(struct sk_buff *skb, struct net_device *dev)
+{
+	if (can_dropped_invalid_skb(dev, skb))
+		return NETDEV_TX_OK;
+
+#ifdef VCAN_BUS_EMU
+	if (((struct vcan_priv *)netdev_priv(dev))->bitrate) {
+		vcan_emu_xmit(skb, dev);
+		return NETDEV_TX_OK;
+	}
+#endif
+
+	vcan_tx_done(skb, dev);
 	return NETDEV_TX_OK;
 }
 
@@ -182,8 +487,144 @@ static struct net_device_stats *vcan_get_stats(struct net_device *dev)
 	return stats;
 }
 #endif
+#ifdef VCAN_PCPU_STATS
+static int vcan_init(struct net_device *dev)
+{
+	struct vcan_priv *priv = netdev_priv(dev);
+
+	priv->stats = alloc_percpu(struct vcan_pcpu_stats);
+	if (!priv->stats)
+		return -ENOMEM;
+
+	priv->dev = dev;
+	priv->bitrate = bitrate;
+	spin_lock_init(&priv->emu_lock);
+	skb_queue_head_init(&priv->emu_q);
+	hrtimer_init(&priv->emu_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	priv->emu_timer.function = vcan_emu_timer;
+	skb_queue_head_init(&priv->emu_done);
+	tasklet_init(&priv->emu_tsklet, vcan_emu_done, (unsigned long)priv);
+
+	return 0;
+}
+
+static void vcan_free_netdev(struct net_device *dev)
+{
+	struct vcan_priv *priv = netdev_priv(dev);
+
+	free_percpu(priv->stats);
+	free_netdev(dev);
+}
+
+static struct rtnl_link_stats64 *vcan_get_stats64(struct net_device *dev,
+						  struct rtnl_link_stats64 *tot)
+{
+	struct vcan_priv *priv = netdev_priv(dev);
+	u64 rxp, rxb, txp, txb;
+	unsigned int start;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct vcan_pcpu_stats *st = per_cpu_ptr(priv->stats, cpu);
+
+		do {
+			start = u64_stats_fetch_begin(&st->syncp);
+			rxp = st->rx_packets;
+			rxb = st->rx_bytes;
+			txp = st->tx_packets;
+			txb = st->tx_bytes;
+		} while (u64_stats_fetch_retry(&st->syncp, start));
+
+		tot->rx_packets += rxp;
+		tot->rx_bytes += rxb;
+		tot->tx_packets += txp;
+		tot->tx_bytes += txb;
+	}
+
+	/* dropped frames are still counted in dev->stats */
+	tot->rx_dropped = dev->stats.rx_dropped;
+	tot->tx_dropped = dev->stats.tx_dropped;
+
+	return tot;
+}
+#endif
+
+#if defined(VCAN_BUS_EMU) && defined(CONFIG_SYSFS)
+/* a qdisc is needed to queue the frames while the emulated bus is busy */
+static void vcan_emu_update(struct net_device *dev)
+{
+	struct vcan_priv *priv = netdev_priv(dev);
+
+	dev->tx_queue_len = priv->bitrate ? 10 : 0;
+}
+
+static int vcan_strtoul(const char *buf, unsigned long *val)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,39)
+	return kstrtoul(buf, 0, val);
+#else
+	return strict_strtoul(buf, 0, val);
+#endif
+}
+
+#define VCAN_EMU_ATTR(name, busy)					\
+static ssize_t show_##name(struct device *d,				\
+			   struct device_attribute *attr, char *buf)	\
+{									\
+	struct vcan_priv *priv = netdev_priv(to_net_dev(d));		\
+									\
+	return sprintf(buf, "%u\n", priv->name);			\
+}									\
+static ssize_t store_##name(struct device *d,				\
+			    struct device_attribute *attr,		\
+			    const char *buf, size_t count)		\
+{									\
+	struct net_device *dev = to_net_dev(d);				\
+	struct vcan_priv *priv = netdev_priv(dev);			\
+	unsigned long val;						\
+									\
+	if (!capable(CAP_NET_ADMIN))					\
+		return -EPERM;						\
+	if (vcan_strtoul(buf, &val) || val > UINT_MAX)			\
+		return -EINVAL;						\
+	if (busy && netif_running(dev))					\
+		return -EBUSY;						\
+									\
+	priv->name = val;						\
+	if (busy)							\
+		vcan_emu_update(dev);					\
+	return count;							\
+}									\
+static DEVICE_ATTR(name, S_IRUGO | S_IWUSR, show_##name, store_##name)
+
+/* the bus model may only be switched on and off while the device is down */
+VCAN_EMU_ATTR(bitrate, 1);
+VCAN_EMU_ATTR(latency_us, 0);
+VCAN_EMU_ATTR(jitter_us, 0);
+
+static struct attribute *vcan_emu_attrs[] = {
+	&dev_attr_bitrate.attr,
+	&dev_attr_latency_us.attr,
+	&dev_attr_jitter_us.attr,
+	NULL
+};
+
+static struct attribute_group vcan_emu_group = {
+	.name = "vcan",
+	.attrs = vcan_emu_attrs,
+};
+#endif
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
 static const struct net_device_ops vcan_netdev_ops = {
+#ifdef VCAN_PCPU_STATS
+	.ndo_init = vcan_init,
+	.ndo_get_stats64 = vcan_get_stats64,
+#endif
+#ifdef VCAN_BUS_EMU
+	.ndo_open = vcan_open,
+	.ndo_stop = vcan_close,
+#endif
 	.ndo_start_xmit = vcan_tx,
 };
 #endif
@@ -209,9 +650,18 @@ static void vcan_setup(struct net_device *dev)
 #else
 	dev->hard_start_xmit	= vcan_tx;
 #endif
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+#ifdef VCAN_PCPU_STATS
+	dev->destructor		= vcan_free_netdev;
+	dev->features		|= NETIF_F_LLTX;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
 	dev->destructor		= free_netdev;
 #endif
+#ifdef VCAN_BUS_EMU
+	dev->tx_queue_len	= bitrate ? 10 : 0;
+#ifdef CONFIG_SYSFS
+	dev->sysfs_groups[0]	= &vcan_emu_group;
+#endif
+#endif
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
 	dev->get_stats		= vcan_get_stats;
 #endif
@@ -220,6 +670,9 @@ static void vcan_setup(struct net_device *dev)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
 static struct rtnl_link_ops vcan_link_ops __read_mostly = {
 	.kind	= "vcan",
+#ifdef VCAN_PCPU_STATS
+	.priv_size = sizeof(struct vcan_priv),
+#endif
 	.setup	= vcan_setup,
 };
 
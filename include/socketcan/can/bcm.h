@@ -16,6 +16,8 @@
 #ifndef CAN_BCM_H
 #define CAN_BCM_H
 
+#include <socketcan/can.h>
+
 /**
  * struct bcm_msg_head - head of messages to/from the broadcast manager
  * @opcode:    opcode, see enum below.
@@ -49,7 +51,36 @@ enum {
 	TX_EXPIRED,	/* notification on performed transmissions (count=0) */
 	RX_STATUS,	/* reply to RX_READ request */
 	RX_TIMEOUT,	/* cyclic message is absent */
-	RX_CHANGED	/* updated CAN frame (detected content change) */
+	RX_CHANGED,	/* updated CAN frame (detected content change) */
+	TX_READ_STATS,	/* read timing statistics of (cyclic) transmission */
+	TX_STATS	/* reply to TX_READ_STATS request */
+};
+
+#define BCM_TX_HIST_BUCKETS 16
+
+/**
+ * struct bcm_tx_stats - timing of the cyclic transmissions of a tx task
+ * @frames:    number of cyclic transmissions that have been measured.
+ * @early:     number of transmissions before the scheduled time.
+ * @min_ns:    minimum lateness in nanoseconds (negative when early).
+ * @max_ns:    maximum lateness in nanoseconds (negative when early).
+ * @avg_ns:    average lateness in nanoseconds (negative when early).
+ * @hist:      histogram of the absolute lateness: bucket 0 counts less
+ *             than 1 usec, bucket n counts 2^(n-1) up to 2^n usecs and the
+ *             last bucket counts everything above.
+ *
+ * The lateness is the time between the scheduled and the real start of a
+ * cyclic transmission. The reply to TX_READ_STATS is a bcm_msg_head with
+ * opcode TX_STATS and nframes 0 which is followed by this structure. The
+ * statistics are reset whenever the timer values are set by SETTIMER.
+ */
+struct bcm_tx_stats {
+	__u64 frames;
+	__u64 early;
+	__s64 min_ns;
+	__s64 max_ns;
+	__s64 avg_ns;
+	__u64 hist[BCM_TX_HIST_BUCKETS];
 };
 
 #define SETTIMER            0x0001
@@ -63,5 +94,26 @@ enum {
 #define RX_ANNOUNCE_RESUME  0x0100
 #define TX_RESET_MULTI_IDX  0x0200
 #define RX_RTR_FRAME        0x0400
+#define CAN_FD_FRAME        0x0800
+
+#define SOL_CAN_BCM (SOL_CAN_BASE + CAN_BCM)
+
+/* for socket options affecting the socket (not the global system) */
+
+enum {
+	CAN_BCM_COALESCE = 1	/* struct timeval window (default:off) */
+};
+
+/*
+ * CAN_BCM_COALESCE
+ *
+ * With a non-zero window RX_CHANGED and RX_TIMEOUT notifications are
+ * collected for up to the given time and are then delivered in one
+ * datagram. The datagram contains the complete notifications (struct
+ * bcm_msg_head followed by nframes CAN frames each) back to back. Its
+ * timestamp is the one of the first notification. The interface index in
+ * the source address is 0 when the notifications come from different
+ * interfaces. Other messages flush the collected notifications first.
+ */
 
 #endif /* CAN_BCM_H */
@@ -18,6 +18,7 @@
 #define CAN_CORE_H
 
 #include <socketcan/can.h>
+#include <linux/version.h>
 #include <linux/skbuff.h>
 #include <linux/netdevice.h>
 
@@ -54,22 +55,83 @@ struct can_proto {
 #endif
 };
 
+/*
+ * flags for can_rx_register_flags()
+ *
+ * CAN_RX_OWN_SKB: the callback function takes over a private sk_buff which
+ * it has to free or enqueue. The CAN core creates the needed clones itself
+ * and hands out the original sk_buff to the last consumer of a frame.
+ *
+ * CAN_RX_SK_FILTER: data is the receiving struct sock. Its socket filter
+ * (SO_ATTACH_FILTER) is run by the CAN core before the frame is passed
+ * to the callback function. Rejected frames do not cost a clone.
+ */
+#define CAN_RX_OWN_SKB		0x01
+#define CAN_RX_SK_FILTER	0x02
+
 /* function prototypes for the CAN networklayer core (af_can.c) */
 
+struct net;
+struct sock;
+
 extern int  can_proto_register(const struct can_proto *cp);
 extern void can_proto_unregister(const struct can_proto *cp);
 
-extern int  can_rx_register(struct net_device *dev, canid_t can_id,
-			    canid_t mask,
+extern int  can_rx_register(struct net *net, struct net_device *dev,
+			    canid_t can_id, canid_t mask,
 			    void (*func)(struct sk_buff *, void *),
 			    void *data, char *ident);
 
-extern void can_rx_unregister(struct net_device *dev, canid_t can_id,
-			      canid_t mask,
+extern int  can_rx_register_flags(struct net *net, struct net_device *dev,
+				  canid_t can_id, canid_t mask,
+				  void (*func)(struct sk_buff *, void *),
+				  void *data, char *ident, unsigned int flags);
+
+extern void can_rx_unregister(struct net *net, struct net_device *dev,
+			      canid_t can_id, canid_t mask,
 			      void (*func)(struct sk_buff *, void *),
 			      void *data);
 
+extern int  can_rx_register_bulk(struct net *net, struct net_device *dev,
+				 const struct can_filter *filter, int count,
+				 void (*func)(struct sk_buff *, void *),
+				 void *data, char *ident, unsigned int flags);
+
+extern void can_rx_unregister_bulk(struct net *net, struct net_device *dev,
+				   const struct can_filter *filter, int count,
+				   void (*func)(struct sk_buff *, void *),
+				   void *data);
+
+extern int  can_rx_replace_bulk(struct net *net, struct net_device *dev,
+				const struct can_filter *old_filter,
+				int old_count,
+				const struct can_filter *new_filter,
+				int new_count,
+				void (*func)(struct sk_buff *, void *),
+				void *data, char *ident, unsigned int flags);
+
+extern int can_rx_defer_wakeup(struct sock *sk,
+			       void (*wake)(struct sock *sk));
+extern void can_rx_batch_open(void);
+extern void can_rx_batch_close(void);
+
 extern int can_send(struct sk_buff *skb, int loop);
+
+/* transmit path without the qdisc (netif_xmit_frozen_or_stopped() 3.3+) */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0)
+#define CAN_QDISC_BYPASS
+extern int can_send_bypass(struct sk_buff *skb, int loop);
+#endif
+
+/*
+ * SO_BUSY_POLL: the sockets note the NAPI context of the received frames
+ * and recvmsg() runs the poll routine of the driver while the receive
+ * queue is empty (generic NAPI busy polling 4.5+).
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,5,0)
+#define CAN_BUSY_POLL
+#endif
+
 extern int can_ioctl(struct socket *sock, unsigned int cmd, unsigned long arg);
 
 #endif /* CAN_CORE_H */
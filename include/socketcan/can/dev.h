@@ -17,8 +17,17 @@
 #define CAN_DEV_H
 
 #include <linux/version.h>
+#include <linux/workqueue.h>
+#include <linux/jhash.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+#include <linux/hrtimer.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,5,0)
+#include <net/busy_poll.h>
+#endif
 #include <socketcan/can/netlink.h>
 #include <socketcan/can/error.h>
+#include <socketcan/can/kcompat.h>
 
 /*
  * CAN mode
@@ -29,6 +38,66 @@ enum can_mode {
 	CAN_MODE_SLEEP
 };
 
+/*
+ * Sent frames that are not looped back are recycled into a small per
+ * device pool of receive skbs (skb_recycle_check() is 2.6.28 .. 3.6).
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28) && \
+	LINUX_VERSION_CODE < KERNEL_VERSION(3,7,0)
+#define CAN_SKB_POOL
+#define CAN_SKB_POOL_SIZE 16
+#endif
+
+/*
+ * Hardware acceptance filter offload: The CAN core passes the union of
+ * the subscribed filters of a device as one id/mask pair per frame format.
+ * A frame is to be received when (can_id & mask) == (id & mask). A zero
+ * mask accepts all frames of the format, CAN_HW_FILTER_NO_* marks formats
+ * without any subscriber. Drivers that filter at most a superset of that
+ * set a do_set_filter() callback and program can_get_hw_filter() on start.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33)
+#define CAN_HW_FILTER
+#endif
+
+#define CAN_HW_FILTER_NO_SFF	0x1
+#define CAN_HW_FILTER_NO_EFF	0x2
+
+struct can_hw_filter {
+	canid_t sff_id;		/* 11 bit identifier */
+	canid_t sff_mask;
+	canid_t eff_id;		/* 29 bit identifier */
+	canid_t eff_mask;
+	u32 flags;
+};
+
+/*
+ * Receive interrupt moderation (IFLA_CAN_COALESCE) for NAPI drivers. The
+ * drivers set coalesce_napi and end their polls with can_coalesce_complete()
+ * instead of napi_complete().
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+#define CAN_COALESCE
+#endif
+
+/*
+ * Bus load accounting of the received (can_rx_bus_load()) and the looped
+ * back frames in per-CPU counters, see struct can_bus_load. Needs
+ * this_cpu_ptr() and atomic64_t of 2.6.33+.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33)
+#define CAN_BUS_LOAD
+
+struct can_bus_load_pcpu {
+	u64 frames[2];		/* rx, tx */
+	u64 bits[2];
+	u64 gaps;
+	u64 gap_sum_ns;
+	u64 gap_min_ns;
+	u64 gap_max_ns;
+};
+#endif
+
 /*
  * CAN common private data
  */
@@ -58,6 +127,43 @@ struct can_priv {
 
 	unsigned int echo_skb_max;
 	struct sk_buff **echo_skb;
+	/* producer/consumer indices when echo_skb is used as a ring */
+	unsigned int echo_head;
+	unsigned int echo_tail;
+
+#ifdef CAN_SKB_POOL
+	struct sk_buff_head skb_pool;
+#endif
+
+	u32 rx_steer; /* IFLA_CAN_RX_STEER */
+
+#ifdef CAN_BUS_LOAD
+	struct can_bus_load_pcpu __percpu *bus_load;
+	atomic64_t bus_last_ns;	/* processing time of the last frame */
+	u32 bus_bit_ns;		/* from the bitrate on open */
+	struct timer_list bus_load_timer;
+	unsigned long bus_prev_jiffies;
+	u64 bus_prev_bits;
+	u64 bus_prev_frames;
+	u32 bus_load_pm;	/* of the last second */
+	u32 bus_frame_rate;
+#endif
+
+	struct can_coalesce coalesce; /* IFLA_CAN_COALESCE */
+	struct napi_struct *coalesce_napi;
+#ifdef CAN_COALESCE
+	struct hrtimer coalesce_timer;
+#endif
+
+	/* may sleep, -EBUSY retries later (called with rtnl held) */
+	int (*do_set_filter)(struct net_device *dev,
+			     const struct can_hw_filter *f);
+#ifdef CAN_HW_FILTER
+	struct net_device *dev;
+	spinlock_t hw_filter_lock;
+	struct can_hw_filter hw_filter;
+	struct delayed_work hw_filter_work;
+#endif
 };
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,21)
@@ -98,6 +204,176 @@ static inline int can_dropped_invalid_skb(struct net_device *dev,
 	return 0;
 }
 
+/*
+ * can_rx_steer - set the rx hash of a received frame for the RPS
+ *
+ * To be called by the drivers before netif_rx() / netif_receive_skb().
+ * Receive packet steering needs 2.6.35+.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+#define CAN_RX_STEER
+
+static inline void can_rx_steer(struct sk_buff *skb)
+{
+	struct can_priv *priv = netdev_priv(skb->dev);
+	u32 hash;
+
+	if (priv->rx_steer != CAN_RX_STEER_ID)
+		return;
+
+	/* a zero hash means 'no hash' for the RPS */
+	hash = jhash_1word(((struct can_frame *)skb->data)->can_id, 0);
+	if (!hash)
+		hash = 1;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
+	skb_set_hash(skb, hash, PKT_HASH_TYPE_L4);
+#else
+	skb->rxhash = hash;
+#endif
+}
+#else
+#define can_rx_steer(skb) do { } while (0)
+#endif
+
+/*
+ * can_rx_napi_id - note the NAPI context of a received frame
+ *
+ * To be called by NAPI drivers before netif_receive_skb(). Sockets with
+ * SO_BUSY_POLL can then run the poll routine of the driver while waiting
+ * for frames. Generic busy polling of any NAPI context needs 4.5+.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,5,0)
+#define can_rx_napi_id(skb, napi) skb_mark_napi_id(skb, napi)
+#else
+#define can_rx_napi_id(skb, napi) do { } while (0)
+#endif
+
+/*
+ * can_rx_list - frames of a NAPI poll handed up with one call
+ *
+ * NAPI drivers collect the received frames of a poll with can_rx_list_add()
+ * instead of netif_receive_skb() and pass them up with can_rx_list_flush()
+ * at the end of the poll. The CAN core then handles the list as one rx
+ * batch and wakes up each socket once. The list goes up with
+ * netif_receive_skb_list() on 4.19+; older kernels pass up the frames one
+ * by one inside can_rx_batch_open()/can_rx_batch_close().
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+struct can_rx_list {
+	struct list_head head;
+};
+
+static inline void can_rx_list_init(struct can_rx_list *l)
+{
+	INIT_LIST_HEAD(&l->head);
+}
+
+static inline void can_rx_list_add(struct can_rx_list *l, struct sk_buff *skb)
+{
+	list_add_tail(&skb->list, &l->head);
+}
+#else
+struct can_rx_list {
+	struct sk_buff_head queue;
+};
+
+static inline void can_rx_list_init(struct can_rx_list *l)
+{
+	__skb_queue_head_init(&l->queue);
+}
+
+static inline void can_rx_list_add(struct can_rx_list *l, struct sk_buff *skb)
+{
+	__skb_queue_tail(&l->queue, skb);
+}
+#endif
+
+void can_rx_list_flush(struct can_rx_list *l);
+
+#ifdef CAN_BUS_LOAD
+void can_bus_load_account(struct net_device *dev, struct sk_buff *skb,
+			  int tx);
+
+/* to be called by the drivers for each received frame (after can_rx_steer) */
+#define can_rx_bus_load(skb) can_bus_load_account((skb)->dev, (skb), 0)
+
+/*
+ * can_get_bus_load - sum up the bus load counters of a CAN device
+ *
+ * Also used by the CAN core for /proc/net/can/busload (without a module
+ * dependency on can-dev) for devices of the "can" rtnl link type.
+ */
+static inline void can_get_bus_load(const struct net_device *dev,
+				    struct can_bus_load *bl)
+{
+	const struct can_priv *priv = netdev_priv(dev);
+	int cpu;
+
+	memset(bl, 0, sizeof(*bl));
+
+	for_each_possible_cpu(cpu) {
+		const struct can_bus_load_pcpu *p =
+			per_cpu_ptr(priv->bus_load, cpu);
+
+		bl->rx_frames += p->frames[0];
+		bl->tx_frames += p->frames[1];
+		bl->rx_bits += p->bits[0];
+		bl->tx_bits += p->bits[1];
+
+		if (!p->gaps)
+			continue;
+
+		if (!bl->gaps || p->gap_min_ns < bl->gap_min_ns)
+			bl->gap_min_ns = p->gap_min_ns;
+		if (p->gap_max_ns > bl->gap_max_ns)
+			bl->gap_max_ns = p->gap_max_ns;
+		bl->gap_sum_ns += p->gap_sum_ns;
+		bl->gaps += p->gaps;
+	}
+
+	bl->bitrate = priv->bittiming.bitrate;
+	bl->load = READ_ONCE(priv->bus_load_pm);
+	bl->frame_rate = READ_ONCE(priv->bus_frame_rate);
+}
+#else
+#define can_rx_bus_load(skb) do { } while (0)
+#endif
+
+#ifdef CAN_HW_FILTER
+/*
+ * can_set_hw_filter - hand a new hardware filter to a CAN device
+ *
+ * Called by the CAN core (without a module dependency on can-dev) for
+ * devices of the "can" rtnl link type. The driver callback is run from a
+ * work queue as programming the filter may sleep or need the reset mode.
+ */
+static inline void can_set_hw_filter(struct net_device *dev,
+				     const struct can_hw_filter *f)
+{
+	struct can_priv *priv = netdev_priv(dev);
+	int changed;
+
+	if (!priv->do_set_filter)
+		return;
+
+	spin_lock_bh(&priv->hw_filter_lock);
+	changed = memcmp(&priv->hw_filter, f, sizeof(*f));
+	if (changed)
+		priv->hw_filter = *f;
+	spin_unlock_bh(&priv->hw_filter_lock);
+
+	if (changed)
+		schedule_delayed_work(&priv->hw_filter_work, 0);
+}
+#endif
+
+void can_get_hw_filter(struct net_device *dev, struct can_hw_filter *f);
+
+#ifdef CAN_COALESCE
+int can_coalesce_complete(struct net_device *dev, int work_done);
+#endif
+
 struct net_device *alloc_candev(int sizeof_priv, unsigned int echo_skb_max);
 void free_candev(struct net_device *dev);
 
@@ -113,8 +389,26 @@ void can_bus_off(struct net_device *dev);
 void can_put_echo_skb(struct sk_buff *skb, struct net_device *dev,
 		      unsigned int idx);
 void can_get_echo_skb(struct net_device *dev, unsigned int idx);
+void can_get_echo_skb_hwtstamp(struct net_device *dev, unsigned int idx,
+			       ktime_t hwtstamp);
 void can_free_echo_skb(struct net_device *dev, unsigned int idx);
 
+unsigned int can_put_echo_skb_ring(struct sk_buff *skb, struct net_device *dev);
+int can_get_echo_skb_ring(struct net_device *dev);
+int can_get_echo_skb_ring_hwtstamp(struct net_device *dev, ktime_t hwtstamp);
+int can_free_echo_skb_ring(struct net_device *dev);
+
+/*
+ * Attach the hardware receive timestamp of the controller to a received
+ * skb. It is reported with SO_TIMESTAMPING (SOF_TIMESTAMPING_RAW_HARDWARE).
+ */
+static inline void can_skb_set_hwtstamp(struct sk_buff *skb, ktime_t hwtstamp)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+	skb_hwtstamps(skb)->hwtstamp = hwtstamp;
+#endif
+}
+
 struct sk_buff *alloc_can_skb(struct net_device *dev, struct can_frame **cf);
 struct sk_buff *alloc_can_err_skb(struct net_device *dev,
 				  struct can_frame **cf);
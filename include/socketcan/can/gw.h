@@ -29,6 +29,10 @@ struct rtcanmsg {
 enum {
 	CGW_TYPE_UNSPEC,
 	CGW_TYPE_CAN_CAN,	/* CAN->CAN routing */
+	CGW_TYPE_CANFD_CANFD,	/* CAN FD->CAN FD routing */
+	CGW_TYPE_CAN_CANFD,	/* CAN->CAN FD forwarding */
+	CGW_TYPE_CAN_AGGR,	/* CAN->CAN FD container frame packing */
+	CGW_TYPE_AGGR_CAN,	/* CAN FD container frame->CAN unpacking */
 	__CGW_TYPE_MAX
 };
 
@@ -43,11 +47,20 @@ enum {
 	CGW_MOD_SET,	/* CAN frame modification set alternate values */
 	CGW_CS_XOR,	/* set data[] XOR checksum into data[index] */
 	CGW_CS_CRC8,	/* set data[] CRC8 checksum into data[index] */
-	CGW_HANDLED,	/* number of handled CAN frames */
-	CGW_DROPPED,	/* number of dropped CAN frames */
+	CGW_HANDLED,	/* number of handled CAN frames (lower 32 bit) */
+	CGW_DROPPED,	/* number of dropped CAN frames (lower 32 bit) */
 	CGW_SRC_IF,	/* ifindex of source network interface */
 	CGW_DST_IF,	/* ifindex of destination network interface */
 	CGW_FILTER,	/* specify struct can_filter on source CAN device */
+	CGW_FDMOD_AND,	/* CAN FD frame modification binary AND */
+	CGW_FDMOD_OR,	/* CAN FD frame modification binary OR */
+	CGW_FDMOD_XOR,	/* CAN FD frame modification binary XOR */
+	CGW_FDMOD_SET,	/* CAN FD frame modification set alternate values */
+	CGW_AGGR,	/* container frame parameters for CGW_TYPE_CAN_AGGR */
+	CGW_STATS,	/* struct cgw_stats (job dumps only) */
+	CGW_REFRESH,	/* max. refresh interval for CGW_FLAGS_CAN_CHANGED */
+	CGW_SUPPRESSED,	/* number of unchanged CAN frames (lower 32 bit) */
+	CGW_BULK,	/* route set for CGW_TYPE_UNSPEC (nested, see below) */
 	__CGW_MAX
 };
 
@@ -55,6 +68,8 @@ enum {
 
 #define CGW_FLAGS_CAN_ECHO 0x01
 #define CGW_FLAGS_CAN_SRC_TSTAMP 0x02
+#define CGW_FLAGS_CAN_LATENCY 0x04
+#define CGW_FLAGS_CAN_CHANGED 0x08
 
 #define CGW_MOD_FUNCS 4 /* AND OR XOR SET */
 
@@ -62,6 +77,7 @@ enum {
 #define CGW_MOD_ID	0x01
 #define CGW_MOD_DLC	0x02
 #define CGW_MOD_DATA	0x04
+#define CGW_MOD_FLAGS	0x08	/* CAN FD frames only */
 
 #define CGW_FRAME_MODS 3 /* ID DLC DATA */
 
@@ -74,6 +90,13 @@ struct cgw_frame_mod {
 
 #define CGW_MODATTR_LEN sizeof(struct cgw_frame_mod)
 
+struct cgw_fdframe_mod {
+	struct canfd_frame cf;
+	__u8 modtype;
+} __attribute__((packed));
+
+#define CGW_FDMODATTR_LEN sizeof(struct cgw_fdframe_mod)
+
 struct cgw_csum_xor {
 	__s8 from_idx;
 	__s8 to_idx;
@@ -92,6 +115,37 @@ struct cgw_csum_crc8 {
 	__u8 profile_data[20];
 } __attribute__((packed));
 
+struct cgw_aggr {
+	__u32 can_id;	/* CAN identifier of the container frames */
+	__u32 timeout;	/* flush deadline in usecs after the first frame */
+	__u8 flags;	/* canfd_frame.flags of the container frames */
+} __attribute__((packed));
+
+#define CGW_AGGR_LEN sizeof(struct cgw_aggr)
+#define CGW_AGGR_MAX_TIMEOUT 1000000 /* 1 second */
+
+/* record header byte in the data of container frames */
+#define CGW_AGGR_EFF	0x80	/* 4 byte CAN identifier follows */
+#define CGW_AGGR_RTR	0x40	/* remote frame - no data bytes follow */
+#define CGW_AGGR_DLC	0x0F	/* can_dlc of the packed frame */
+#define CGW_AGGR_PAD	0xFF	/* padding up to the container frame length */
+
+/*
+ * lat_hist[0] counts latencies below 1 usec, lat_hist[n] latencies of
+ * 2^(n-1) .. 2^n - 1 usecs. The last bucket takes all longer latencies.
+ */
+#define CGW_LAT_BUCKETS 16
+
+struct cgw_stats {
+	__u64 handled_frames;
+	__u64 dropped_frames;
+	__u64 lat_sum_ns;	/* sum of all latencies in lat_hist[] */
+	__u64 lat_max_ns;
+	__u64 lat_hist[CGW_LAT_BUCKETS];
+};
+
+#define CGW_STATS_LEN sizeof(struct cgw_stats)
+
 /* length of checksum operation parameters. idx = index in CAN frame data[] */
 #define CGW_CS_XOR_LEN  sizeof(struct cgw_csum_xor)
 #define CGW_CS_CRC8_LEN  sizeof(struct cgw_csum_crc8)
@@ -110,9 +164,62 @@ enum {
 /*
  * CAN rtnetlink attribute contents in detail
  *
+ * CGW_AGGR (length 9 bytes):
+ * Mandatory for CGW_TYPE_CAN_AGGR. The packed CAN frames are sent in CAN
+ * FD frames with the given can_id and flags. A container frame is sent
+ * when the next CAN frame does not fit into it or timeout usecs after the
+ * first CAN frame has been packed into it.
+ *
+ * Each packed CAN frame is a record in the container frame data:
+ *
+ * <u8> CGW_AGGR_EFF | CGW_AGGR_RTR | can_dlc
+ * <u16> resp. <u32> (CGW_AGGR_EFF) CAN identifier in network byte order
+ * <u8> can_dlc data bytes (none for CGW_AGGR_RTR)
+ *
+ * The records are followed by CGW_AGGR_PAD bytes up to the next valid
+ * CAN FD frame length.
+ *
+ * CGW_STATS (length 160 bytes):
+ * The 64 bit frame counters of a job in dumps. With CGW_FLAGS_CAN_LATENCY
+ * the latency from the reception timestamp of a CAN frame to the sending
+ * of the routed frame is recorded in lat_xxx. For container frames the
+ * latency is measured from the reception of their first CAN frame.
+ *
+ * CGW_REFRESH (length 4 bytes):
+ * With CGW_FLAGS_CAN_CHANGED a job only forwards a frame when it differs
+ * from the last forwarded frame (CAN identifier, length, flags and data
+ * after the modifications) like the RX_CHANGED filter of the broadcast
+ * manager. The optional refresh interval in usecs additionally forwards
+ * an unchanged frame when the last forwarded frame is older. The job
+ * remembers one frame only - use a CGW_FILTER for a single CAN identifier.
+ * The suppressed frames are counted in CGW_SUPPRESSED (job dumps only).
+ * Not available for the container gwtypes.
+ *
+ * CGW_BULK (nested):
+ * An RTM_NEWROUTE message with CGW_TYPE_UNSPEC loads a whole route set.
+ * Each CGW_BULK attribute nested in CGW_BULK contains a struct rtcanmsg
+ * followed by the CGW_XXX attributes of one job, like the payload of an
+ * RTM_NEWROUTE message for this job. The new set replaces the previously
+ * loaded set of the namespace at once - on any error the current set is
+ * kept. An RTM_DELROUTE message with CGW_TYPE_UNSPEC removes the set.
+ * Jobs created with single RTM_NEWROUTE messages are not affected. The
+ * jobs of a set can not route error frames.
+ *
  * CGW_XXX_IF (length 4 bytes):
  * Sets an interface index for source/destination network interfaces.
  * For the CAN->CAN gwtype the indices of _two_ CAN interfaces are mandatory.
+ * The same applies to the CAN FD gwtypes, which need a CAN FD capable
+ * destination (and source for CAN FD->CAN FD) interface.
+ *
+ * CAN FD->CAN FD routes CAN FD frames only. CAN->CAN FD converts received
+ * classic CAN frames into CAN FD frames with the CANFD_BRS flag set.
+ * Remote frames can not be converted and are dropped.
+ *
+ * CAN->CAN FD container packing (CGW_TYPE_CAN_AGGR) packs the received
+ * CAN frames into the data of CAN FD container frames, see CGW_AGGR.
+ * CGW_TYPE_AGGR_CAN regains the CAN frames from the received container
+ * frames. CGW_MOD_XXX and CGW_CS_XXX apply to the packed CAN frames for
+ * both gwtypes.
  *
  * CGW_FILTER (length 8 bytes):
  * Sets a CAN receive filter for the gateway job specified by the
@@ -125,9 +232,19 @@ enum {
  * <struct can_frame> data used as operator
  * <u8> affected CAN frame elements
  *
+ * CGW_FDMOD_XXX (length 73 bytes):
+ * The same for the CAN FD gwtypes with the CAN FD frame that is sent out.
+ * CGW_MOD_FLAGS additionally modifies canfd_frame.flags .
+ *
+ * <struct canfd_frame> data used as operator
+ * <u8> affected CAN FD frame elements
+ *
+ * Modifications that result in an invalid length make the frame drop.
+ *
  * CGW_CS_XOR (length 4 bytes):
  * Set a simple XOR checksum starting with an initial value into
  * data[result-idx] using data[start-idx] .. data[end-idx]
+ * The indices address 8 (CAN) or 64 (CAN FD gwtypes) bytes of data[].
  *
  * The XOR checksum is calculated like this:
  *
@@ -38,6 +38,42 @@
 
 #define CAN_ISOTP_LL_OPTS	5	/* pass struct can_isotp_ll_options */
 
+#define CAN_ISOTP_TX_GAP_STATS	6	/* get struct can_isotp_gap_stats   */
+					/* (read only) achieved gap between */
+					/* STmin paced consecutive frames   */
+
+#define CAN_ISOTP_CHANNELS	7	/* pass array of can_isotp_chan's   */
+					/* additional rx_id/tx_id pairs to  */
+					/* be served by one socket. Set     */
+					/* before bind(). The channel of a  */
+					/* pdu is given in msg_name.        */
+
+#define CAN_ISOTP_STATS		8	/* get struct can_isotp_stats       */
+					/* (read only) protocol counters &  */
+					/* transfer time histograms         */
+
+#define CAN_ISOTP_TIMEOUTS	9	/* pass struct can_isotp_timeouts   */
+
+#define CAN_ISOTP_FUNC_ADDR	10	/* pass struct can_isotp_func       */
+					/* pdus sent to func.tx_id (given  */
+					/* in msg_name) are functional SF  */
+					/* requests. The responses arrive  */
+					/* on the (CAN_ISOTP_CHANNELS)     */
+					/* channels of the responders.     */
+
+#define CAN_ISOTP_QDISC_BYPASS	11	/* pass int (default:0). Non-zero:  */
+					/* the SF/FF bypasses the qdisc of */
+					/* the interface. write() returns  */
+					/* -EBUSY on a full driver queue.  */
+					/* CFs and FC frames are queued.   */
+
+#define CAN_ISOTP_ROUTE		12	/* pass int: fd of a bound isotp   */
+					/* socket (-1 unlinks). Received   */
+					/* pdus are sent on this socket.   */
+					/* Segmented pdus are forwarded    */
+					/* cut-through: the outgoing FF is */
+					/* sent before the pdu is complete */
+
 struct can_isotp_options {
 
 	__u32 flags;		/* set flags for isotp behaviour.	*/
@@ -93,6 +129,70 @@ struct can_isotp_ll_options {
 				/* by the CAN netdriver configuration	*/
 };
 
+struct can_isotp_timeouts {
+
+	__u32 n_bs;		/* max. wait for a FC frame (tx path)	*/
+				/* __u32 value : time in nano secs	*/
+
+	__u32 n_cr;		/* max. wait for a CF frame (rx path)	*/
+				/* __u32 value : time in nano secs	*/
+};
+
+struct can_isotp_func {
+
+	canid_t tx_id;		/* CAN ID of functional requests	*/
+
+	__u32 timeout;		/* response deadline after a request	*/
+				/* __u32 value : time in nano secs	*/
+				/* 0 = no functional addressing		*/
+};
+
+struct can_isotp_gap_stats {
+
+	__u64 frames;		/* number of measured CF gaps		*/
+
+	__u64 sum_ns;		/* sum of all measured gaps		*/
+				/* => avg. gap = sum_ns / frames	*/
+
+	__u64 min_ns;		/* minimum measured gap in nano secs	*/
+
+	__u64 max_ns;		/* maximum measured gap in nano secs	*/
+};
+
+struct can_isotp_chan {
+
+	canid_t rx_id;		/* CAN ID of received frames		*/
+
+	canid_t tx_id;		/* CAN ID of transmitted frames		*/
+};
+
+#define CAN_ISOTP_MAX_CHANNELS	1024	/* max. entries in CAN_ISOTP_CHANNELS */
+
+#define CAN_ISOTP_HIST_SLOTS	24
+
+struct can_isotp_stats {
+
+	__u64 rx_pdus;		/* received PDUs			*/
+	__u64 tx_pdus;		/* completely sent PDUs			*/
+	__u64 rx_frames;	/* received CAN frames			*/
+	__u64 tx_frames;	/* sent CAN frames (incl. FC frames)	*/
+	__u64 rx_fc_wait;	/* received FC frames with WT status	*/
+	__u64 rx_fc_ovflw;	/* received FC frames with OVFLW status	*/
+	__u64 tx_fc_ovflw;	/* sent FC frames with OVFLW status	*/
+	__u64 rx_timeouts;	/* timeouts waiting for CF frames	*/
+	__u64 tx_timeouts;	/* timeouts waiting for FC frames	*/
+	__u64 rx_sn_errors;	/* CF frames with wrong sequence number	*/
+	__u64 rx_pad_errors;	/* CAN frames with failed padding check	*/
+
+	/* FF to last CF transfer time: slot n counts 2^n .. 2^(n+1)-1 usecs */
+	__u64 rx_time_hist[CAN_ISOTP_HIST_SLOTS];
+	__u64 tx_time_hist[CAN_ISOTP_HIST_SLOTS];
+
+	__u64 tx_fc_wait;	/* sent FC frames with WT status	*/
+	__u64 ana_evicts;	/* idle analyzer channels reused	*/
+	__u64 ana_drops;	/* SF/FF not analyzed (table full)	*/
+};
+
 
 /* flags for isotp behaviour */
 
@@ -106,6 +206,34 @@ struct can_isotp_ll_options {
 #define CAN_ISOTP_FORCE_TXSTMIN	0x080	/* ignore stmin from received FC */
 #define CAN_ISOTP_FORCE_RXSTMIN	0x100	/* ignore CFs depending on rx stmin */
 #define CAN_ISOTP_RX_EXT_ADDR	0x200	/* different rx extended addressing */
+#define CAN_ISOTP_RX_BATCH	0x400	/* wake up reader for 1st queued PDU */
+#define CAN_ISOTP_EARLY_FC	0x800	/* FC for next block with 1st CF of */
+					/* the current block (rx) and accept */
+					/* such FCs while sending (tx).      */
+					/* Non-standard: both sides need it  */
+#define CAN_ISOTP_TX_CONFIRM	0x1000	/* queue the result of each sent  */
+					/* pdu to the error queue (read   */
+					/* with MSG_ERRQUEUE). Linux 3.17+ */
+
+#define CAN_ISOTP_ANALYZER	0x2000	/* listen to all pdus matching the */
+					/* bind() rx_id/tx_id as CAN filter */
+					/* can_id/can_mask. The channel of  */
+					/* a pdu is given in msg_name.      */
+
+#define CAN_ISOTP_TX_DL_PLAN	0x4000	/* send segmented CAN FD pdus with */
+					/* the LL_DL <= tx_dl that needs   */
+					/* the least bus time (see FF)     */
+
+/* tx_id of an analyzer channel without an observed FC frame (yet) */
+#define CAN_ISOTP_ANALYZER_NO_ID	CAN_ERR_FLAG
+
+/* cmsg type of the struct sock_extended_err of a CAN_ISOTP_TX_CONFIRM */
+#define SCM_CAN_ISOTP_CONFIRM	1
+
+/* sock_extended_err.ee_code values on the socket error queue */
+#define CAN_ISOTP_EE_TX_CONFIRM	0 /* ee_info = pdu len, ee_data = txid */
+#define CAN_ISOTP_EE_FUNC_DONE	1 /* deadline expired: ee_info = number */
+				  /* of pdus, ee_data = functional ID   */
 
 
 /* default values */
@@ -122,6 +250,9 @@ struct can_isotp_ll_options {
 #define CAN_ISOTP_DEFAULT_LL_TX_DL	CAN_MAX_DLEN
 #define CAN_ISOTP_DEFAULT_LL_TX_FLAGS	0
 
+#define CAN_ISOTP_DEFAULT_N_BS		1000000000 /* 1 s */
+#define CAN_ISOTP_DEFAULT_N_CR		1000000000 /* 1 s */
+
 /*
  * Remark on CAN_ISOTP_DEFAULT_RECV_* values:
  *
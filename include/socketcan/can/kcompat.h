@@ -0,0 +1,24 @@
+/*
+ * socketcan/can/kcompat.h
+ *
+ * Compatibility definitions for the CAN core, the protocols and the
+ * drivers on older kernels
+ *
+ * $Id$
+ *
+ * Send feedback to <socketcan-users@lists.berlios.de>
+ *
+ */
+
+#ifndef CAN_KCOMPAT_H
+#define CAN_KCOMPAT_H
+
+#include <linux/compiler.h>
+
+/* READ_ONCE()/WRITE_ONCE() 3.19+ (ACCESS_ONCE() has been removed in 4.15) */
+#ifndef READ_ONCE
+#define READ_ONCE(x) (*(volatile typeof(x) *)&(x))
+#define WRITE_ONCE(x, val) (*(volatile typeof(x) *)&(x) = (val))
+#endif
+
+#endif /* CAN_KCOMPAT_H */
@@ -105,9 +105,37 @@ struct can_device_stats {
 	__u32 restarts;		/* CAN controller re-starts */
 };
 
+/*
+ * CAN bus load statistics, in IFLA_INFO_XSTATS after struct can_device_stats.
+ * The bus time of a frame is counted in bits from the start of frame to the
+ * end of the interframe space including the stuff bits. The gaps are the
+ * idle times between two frames, taken from the times the frames have been
+ * processed. load (in permille) and frame_rate are those of the last second.
+ */
+struct can_bus_load {
+	__u64 rx_frames;
+	__u64 tx_frames;	/* looped back frames */
+	__u64 rx_bits;
+	__u64 tx_bits;
+	__u64 gaps;		/* number of measured gaps */
+	__u64 gap_sum_ns;
+	__u64 gap_min_ns;
+	__u64 gap_max_ns;
+	__u32 bitrate;
+	__u32 load;
+	__u32 frame_rate;
+	__u32 __res;
+};
+
 /*
  * CAN netlink interface
+ *
+ * The ids from IFLA_CAN_BERR_COUNTER + 1 on are used by mainline Linux
+ * (IFLA_CAN_DATA_BITTIMING, ...). The ids of this tree start at
+ * IFLA_CAN_PRIVATE_BASE to stay clear of them.
  */
+#define IFLA_CAN_PRIVATE_BASE	64
+
 enum {
 	IFLA_CAN_UNSPEC,
 	IFLA_CAN_BITTIMING,
@@ -118,9 +146,37 @@ enum {
 	IFLA_CAN_RESTART_MS,
 	IFLA_CAN_RESTART,
 	IFLA_CAN_BERR_COUNTER,
+	IFLA_CAN_RX_STEER = IFLA_CAN_PRIVATE_BASE,
+	IFLA_CAN_COALESCE = IFLA_CAN_PRIVATE_BASE + 1,
 	__IFLA_CAN_MAX
 };
 
+/*
+ * IFLA_CAN_RX_STEER (u32): receive steering mode of the interface.
+ * With CAN_RX_STEER_ID the rx hash of the received frames is taken from
+ * the CAN identifier. The receive packet steering (rps_cpus of the rx
+ * queue) then spreads the frames over the CPUs while the frames of one
+ * CAN identifier stay in order on the same CPU.
+ */
+#define CAN_RX_STEER_OFF	0
+#define CAN_RX_STEER_ID		1
+
+/*
+ * IFLA_CAN_COALESCE (struct can_coalesce): receive interrupt moderation of
+ * NAPI drivers like rx-usecs/rx-frames of ethtool -C. When one poll has
+ * handled at least rx_frames frames the receive interrupt stays disabled
+ * and the next poll follows rx_usecs later. Below this load the driver
+ * returns to an interrupt per frame. rx_usecs == 0 turns it off. Only
+ * reported by drivers that support it.
+ */
+struct can_coalesce {
+	__u32 rx_usecs;
+	__u32 rx_frames;
+};
+
+/* the receive FIFOs of the controllers must not overflow in between */
+#define CAN_COALESCE_MAX_USECS	10000
+
 #define IFLA_CAN_MAX	(__IFLA_CAN_MAX - 1)
 
 #endif /* CAN_NETLINK_H */
@@ -30,4 +30,79 @@ enum {
 	CAN_RAW_RECV_OWN_MSGS	/* receive my own msgs (default:off) */
 };
 
+/*
+ * The options below are not known to the mainline CAN_RAW. They are
+ * numbered apart from the mainline options (CAN_RAW_FD_FRAMES = 5, ...)
+ * so that programs built against other headers never select them.
+ */
+#define CAN_RAW_PRIVATE_BASE	64
+
+enum {
+	CAN_RAW_RX_RING = CAN_RAW_PRIVATE_BASE, /* mmap'able receive ring */
+	CAN_RAW_RX_DROPS,	/* get number of dropped rx frames   */
+	CAN_RAW_QDISC_BYPASS,	/* tx without qdisc (default:off)    */
+	CAN_RAW_FANOUT		/* join a fanout group of sockets    */
+};
+
+/*
+ * CAN_RAW_QDISC_BYPASS
+ *
+ * With a non-zero int value the frames are handed over to the driver
+ * directly instead of passing the queueing discipline of the interface.
+ * sendmsg(2) returns -EBUSY when the driver queue is full. Packet sockets
+ * do not see the sent frames then.
+ */
+
+/*
+ * cmsg type of the struct sock_extended_err that comes with tx timestamps
+ * read by recvmsg(MSG_ERRQUEUE) (SO_TIMESTAMPING / SOF_TIMESTAMPING_TX_*)
+ */
+#define SCM_CAN_RAW_ERRQUEUE 1
+
+/*
+ * CAN_RAW_RX_RING
+ *
+ * The socket option sets up a ring of frame_nr slots that is mapped with
+ * mmap(2) at offset 0 with a length of frame_nr * sizeof(struct
+ * can_raw_ring_slot) rounded up to the page size. It has to be set before
+ * bind(2) and can not be changed later on. Matching frames are then only
+ * stored in the ring: a slot with CAN_RAW_SLOT_USER status holds a frame
+ * and has to be handed back by setting it to CAN_RAW_SLOT_KERNEL. The
+ * slots are filled in ascending order. poll(2) reports POLLIN when the
+ * last filled slot is still owned by the user. Frames are dropped when
+ * the next slot is not available to the kernel.
+ */
+struct can_raw_ring_req {
+	__u32 frame_nr;	/* number of slots */
+	__u32 flags;	/* reserved, has to be 0 */
+};
+
+#define CAN_RAW_SLOT_KERNEL	0
+#define CAN_RAW_SLOT_USER	1
+
+struct can_raw_ring_slot {
+	__u32 status;	/* CAN_RAW_SLOT_KERNEL / CAN_RAW_SLOT_USER */
+	__u32 flags;	/* MSG_DONTROUTE / MSG_CONFIRM as in msg_flags */
+	__s32 ifindex;	/* receiving interface */
+	__u32 __res;
+	__u64 tstamp;	/* receive timestamp in ns (CLOCK_REALTIME) */
+	struct can_frame frame;
+};
+
+/*
+ * CAN_RAW_FANOUT
+ *
+ * Joins a bound socket to the fanout group given by the int value
+ * (group id | type << 16). The filters (CAN_RAW_FILTER, CAN_RAW_ERR_FILTER)
+ * of the socket that creates the group become the filters of the group and
+ * each matching frame is delivered to exactly one member socket. Members
+ * have to be bound to the same interface and can not change their filters
+ * or their binding any more. A socket leaves its group when it is closed.
+ * getsockopt() returns the group id and type or 0 without a group.
+ */
+#define CAN_RAW_FANOUT_HASH	0	/* by a hash of the CAN ID (ordered) */
+#define CAN_RAW_FANOUT_LB	1	/* round robin                       */
+
+#define CAN_RAW_FANOUT_MAX	64	/* max. number of sockets in a group */
+
 #endif
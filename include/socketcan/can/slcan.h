@@ -0,0 +1,46 @@
+/*
+ * socketcan/can/slcan.h
+ *
+ * Definitions for the serial line CAN interface (slcan) line discipline
+ *
+ * $Id$
+ *
+ * Send feedback to <socketcan-users@lists.berlios.de>
+ *
+ */
+
+#ifndef CAN_SLCAN_H
+#define CAN_SLCAN_H
+
+#include <linux/sockios.h>
+
+/*
+ * tty ioctls to get/set the framing mode of a slcan channel (int argument).
+ * The mode can only be changed while the network interface is down.
+ */
+#define SLCAN_SIOCSMODE		(SIOCDEVPRIVATE)
+#define SLCAN_SIOCGMODE		(SIOCDEVPRIVATE + 1)
+
+enum {
+	SLCAN_MODE_ASCII = 0,	/* Lawicel ASCII format (default)       */
+	SLCAN_MODE_BINARY,	/* binary frames with SLIP escaping     */
+	SLCAN_MODE_BINARY_FD,	/* binary mode, CAN FD frames also      */
+	SLCAN_MODE_MAX
+};
+
+/*
+ * Binary frame layout (before SLIP escaping, terminated by SLCAN_BIN_END):
+ *
+ * <flags:1> <can_id:4 (network byte order)> <len:1> <data:len>
+ *
+ * flags contains SLCAN_BIN_FD for CAN FD frames and the canfd_frame.flags.
+ */
+#define SLCAN_BIN_FD		0x80
+#define SLCAN_BIN_HDR		6
+
+#define SLCAN_BIN_END		0xC0	/* end of frame                   */
+#define SLCAN_BIN_ESC		0xDB	/* escape next byte               */
+#define SLCAN_BIN_ESC_END	0xDC	/* escaped END byte               */
+#define SLCAN_BIN_ESC_ESC	0xDD	/* escaped ESC byte               */
+
+#endif /* CAN_SLCAN_H */
@@ -0,0 +1,93 @@
+/*
+ * socketcan/can/stats.h
+ *
+ * Definitions for the generic netlink interface to the statistics and the
+ * receive lists of the PF_CAN core (an alternative to /proc/net/can)
+ *
+ * $Id$
+ *
+ * Send feedback to <socketcan-users@lists.berlios.de>
+ *
+ */
+
+#ifndef CAN_STATS_H
+#define CAN_STATS_H
+
+#include <linux/types.h>
+
+#define CAN_STATS_GENL_NAME	"can_stats"
+#define CAN_STATS_GENL_VERSION	1
+
+/*
+ * CAN_STATS_CMD_GET returns the CAN_STATS_A_INFO of the network namespace.
+ * CAN_STATS_CMD_RESET restarts the statistics (needs CAP_NET_ADMIN).
+ * CAN_STATS_CMD_GET_RCV is a dump (NLM_F_DUMP) with one message per
+ * receiver. Large receive lists are dumped in several parts and the dump
+ * is no snapshot: receivers added or removed in between can be missed.
+ */
+enum {
+	CAN_STATS_CMD_UNSPEC,
+	CAN_STATS_CMD_GET,
+	CAN_STATS_CMD_RESET,
+	CAN_STATS_CMD_GET_RCV,
+
+	__CAN_STATS_CMD_MAX
+#define CAN_STATS_CMD_MAX	(__CAN_STATS_CMD_MAX - 1)
+};
+
+enum {
+	CAN_STATS_A_UNSPEC,
+	CAN_STATS_A_INFO,		/* struct can_stats_info */
+	CAN_STATS_A_RCV_IFINDEX,	/* u32, 0 for all devices ('any') */
+	CAN_STATS_A_RCV_LIST,		/* u8, CAN_RCV_LIST_* */
+	CAN_STATS_A_RCV_CAN_ID,		/* u32 */
+	CAN_STATS_A_RCV_MASK,		/* u32 */
+	CAN_STATS_A_RCV_MATCHES,	/* u64 */
+	CAN_STATS_A_RCV_IDENT,		/* string, e.g. "raw" */
+
+	__CAN_STATS_A_MAX
+#define CAN_STATS_A_MAX		(__CAN_STATS_A_MAX - 1)
+};
+
+/* the receive lists, see /proc/net/can/rcvlist_* */
+enum {
+	CAN_RCV_LIST_ERR,
+	CAN_RCV_LIST_ALL,
+	CAN_RCV_LIST_FIL,
+	CAN_RCV_LIST_INV,
+	CAN_RCV_LIST_EFF,
+	CAN_RCV_LIST_SFF,
+	CAN_RCV_LIST_MAX
+};
+
+/* the rate and ratio values are only valid with CAN_STATS_F_RATES */
+#define CAN_STATS_F_RATES	0x01
+
+/*
+ * The rates are computed when the statistics are read. The current rates
+ * are averaged over the time since the previous read (at least a second)
+ * and the maximum rates are the maximum of these averages.
+ */
+struct can_stats_info {
+	__u64 tx_frames;		/* since the last reset */
+	__u64 rx_frames;
+	__u64 matches;
+	__u32 flags;			/* CAN_STATS_F_* */
+	__u32 age_ms;			/* time since the last reset */
+	__u32 total_tx_rate;		/* frames/s */
+	__u32 total_rx_rate;
+	__u32 total_rx_match_ratio;	/* % */
+	__u32 current_tx_rate;
+	__u32 current_rx_rate;
+	__u32 current_rx_match_ratio;
+	__u32 max_tx_rate;
+	__u32 max_rx_rate;
+	__u32 max_rx_match_ratio;
+	__u32 rcv_entries;
+	__u32 rcv_entries_max;
+	__u32 stats_reset;
+	__u32 user_reset;
+	__u32 __res;
+};
+
+#endif /* CAN_STATS_H */
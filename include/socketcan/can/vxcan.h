@@ -0,0 +1,28 @@
+/*
+ * socketcan/can/vxcan.h
+ *
+ * Definitions for the virtual CAN tunnel (vxcan) netlink interface
+ *
+ * $Id$
+ *
+ * Send feedback to <socketcan-users@lists.berlios.de>
+ *
+ */
+
+#ifndef CAN_VXCAN_H
+#define CAN_VXCAN_H
+
+/*
+ * IFLA_INFO_DATA attributes of the "vxcan" link type. VXCAN_INFO_PEER
+ * carries a struct ifinfomsg followed by the IFLA_* attributes of the
+ * peer device, like VETH_INFO_PEER does for veth.
+ */
+enum {
+	VXCAN_INFO_UNSPEC,
+	VXCAN_INFO_PEER,
+
+	__VXCAN_INFO_MAX
+#define VXCAN_INFO_MAX	(__VXCAN_INFO_MAX - 1)
+};
+
+#endif /* CAN_VXCAN_H */
@@ -49,7 +49,15 @@
 #include <linux/slab.h>
 #include <linux/list.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/hash.h>
+#include <linux/sort.h>
 #include <linux/rcupdate.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#include <linux/sched/clock.h>
+#else
+#include <linux/sched.h>
+#endif
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18)
 #include <linux/uaccess.h>
 #else
@@ -61,18 +69,32 @@
 #include <linux/if_ether.h>
 #include <linux/if_arp.h>
 #include <linux/skbuff.h>
+#include <linux/filter.h>
 #include <socketcan/can.h>
 #include <socketcan/can/core.h>
+#include <socketcan/can/dev.h>
+#include <socketcan/can/stats.h>
+#include <net/rtnetlink.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
 #include <net/net_namespace.h>
 #endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33)
+#include <net/netns/generic.h>
+#endif
 #include <net/sock.h>
 
 #include "af_can.h"
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,25)
+
+#define CREATE_TRACE_POINTS
+#include "af_can_trace.h"
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
 #include "compat.h"
 #endif
 
+#ifndef ETH_P_CANFD
+#define ETH_P_CANFD	0x000D	/* CAN FD 2.0 frame */
+#endif
+
 #include <socketcan/can/version.h> /* for RCSID. Removed by mkpatch script */
 RCSID("$Id$");
 
@@ -86,13 +108,84 @@ MODULE_AUTHOR("Urs Thuermann <urs.thuermann@volkswagen.de>, "
 
 MODULE_ALIAS_NETPROTO(PF_CAN);
 
-static int stats_timer __read_mostly = 1;
-module_param(stats_timer, int, S_IRUGO);
-MODULE_PARM_DESC(stats_timer, "enable timer for statistics (default:on)");
+static DEFINE_MUTEX(can_eff_resize_lock);
+
+#ifdef CAN_HW_FILTER
+static int hw_filter __read_mostly;
+module_param(hw_filter, int, S_IRUGO);
+MODULE_PARM_DESC(hw_filter, "program the subscribed filters into the CAN "
+		 "controllers (default:off)");
+
+/* serializes the computation and the hand over of hardware filters */
+static DEFINE_SPINLOCK(can_hw_filter_lock);
+#endif
+
+/*
+ * The local echo of frames sent on interfaces without IFF_ECHO can be
+ * dispatched to the receivers directly from can_send() instead of the
+ * round trip through netif_rx_ni() and the NET_RX softirq. Packet sockets
+ * do not see these echo frames then. Receivers sending frames themselves
+ * may nest can_send() -> can_receive(): the per-CPU loopback_depth limits
+ * this, deeper echo frames take the backlog again.
+ */
+#ifdef CAN_NETNS /* can_rcv() drops frames of other namespaces otherwise */
+#define CAN_DIRECT_LOOPBACK
+#define CAN_LOOPBACK_DEPTH 4
+
+static int direct_loopback __read_mostly;
+module_param(direct_loopback, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(direct_loopback, "deliver the local echo of sent frames "
+		 "without the netif_rx backlog (default:off)");
+
+static DEFINE_PER_CPU(int, loopback_depth);
+#endif
+
+/*
+ * Socket wakeups deferred by the receivers (can_rx_defer_wakeup()) until
+ * the end of the current rx batch. A batch is a single frame or the list
+ * of frames a NAPI poll hands over with netif_receive_skb_list() (4.19+)
+ * or between can_rx_batch_open() and can_rx_batch_close().
+ * Nested can_receive() calls (direct loopback) join the outer batch.
+ */
+#define CAN_RX_WAKE_MAX 16
+
+struct can_rx_batch {
+	int depth;
+	unsigned int num;
+	struct {
+		struct sock *sk;
+		void (*wake)(struct sock *sk);
+	} ent[CAN_RX_WAKE_MAX];
+};
+
+static DEFINE_PER_CPU(struct can_rx_batch, can_rx_batch);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+#define CAN_RX_LIST
+#endif
 
-HLIST_HEAD(can_rx_dev_list);
-static struct dev_rcv_lists can_rx_alldev_list;
-static DEFINE_SPINLOCK(can_rcvlists_lock);
+#ifdef CAN_RCV_TIME
+static int rcv_time __read_mostly;
+module_param(rcv_time, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(rcv_time, "account the time spent in the receiver "
+		 "callbacks per ident in /proc/net/can/rcvtime (default:off)");
+
+/* copies of the idents: the strings belong to the registering modules */
+static char rcv_time_ident[CAN_RCV_TIME_SLOTS][CAN_RCV_TIME_IDLEN];
+static DEFINE_SPINLOCK(rcv_time_lock);
+
+struct can_rcv_time {
+	struct s_rcv_time slot[CAN_RCV_TIME_SLOTS];
+};
+
+static DEFINE_PER_CPU(struct can_rcv_time, can_rcv_time);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+#define can_rcv_clock() local_clock()
+#else
+#define can_rcv_clock() cpu_clock(smp_processor_id())
+#endif
+#endif
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
 static struct kmem_cache *rcv_cache __read_mostly;
@@ -104,9 +197,11 @@ static kmem_cache_t *rcv_cache;
 static const struct can_proto *proto_tab[CAN_NPROTO] __read_mostly;
 static DEFINE_MUTEX(proto_tab_lock);
 
-struct timer_list can_stattimer;   /* timer for statistics update */
-struct s_stats    can_stats;       /* packet statistics */
-struct s_pstats   can_pstats;      /* receive list statistics */
+#ifdef CAN_NETNS
+int can_net_id __read_mostly;
+#else
+struct can_net can_init_pernet;
+#endif
 
 /*
  * af_can socket functions
@@ -184,7 +279,7 @@ static int can_create(struct socket *sock, int protocol)
 	if (protocol < 0 || protocol >= CAN_NPROTO)
 		return -EINVAL;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24) && !defined(CAN_NETNS)
 	if (net != &init_net)
 		return -EAFNOSUPPORT;
 #endif
@@ -278,32 +373,96 @@ static int can_create(struct socket *sock, int protocol)
  * af_can tx path
  */
 
-/**
- * can_send - transmit a CAN frame (optional with local loopback)
- * @skb: pointer to socket buffer with CAN frame in data section
- * @loop: loopback for listeners on local CAN sockets (recommended default!)
- *
- * Due to the loopback this routine must not be called from hardirq context.
+static void can_receive(struct sk_buff *skb, struct net_device *dev);
+
+/*
+ * can_loopback - hand over the local echo of a sent CAN frame
+ */
+static void can_loopback(struct sk_buff *skb)
+{
+#ifdef CAN_DIRECT_LOOPBACK
+	int *depth;
+
+	if (direct_loopback) {
+		local_bh_disable();
+		depth = &per_cpu(loopback_depth, smp_processor_id());
+		if (*depth < CAN_LOOPBACK_DEPTH) {
+			/* netif_rx_ni() would have taken this timestamp */
+			if (!ktime_to_ns(skb->tstamp))
+				__net_timestamp(skb);
+
+			(*depth)++;
+			can_receive(skb, skb->dev);
+			(*depth)--;
+			local_bh_enable();
+			return;
+		}
+		local_bh_enable();
+	}
+#endif
+	netif_rx_ni(skb);
+}
+
+#ifdef CAN_QDISC_BYPASS
+/*
+ * can_direct_xmit - hand over a frame to the driver without the qdisc
  *
- * Return:
- *  0 on success
- *  -ENETDOWN when the selected interface is down
- *  -ENOBUFS on full driver queue (see net_xmit_errno())
- *  -ENOMEM when local loopback failed at calling skb_clone()
- *  -EPERM when trying to send on a non-CAN interface
- *  -EINVAL when the skb->data does not contain a valid CAN frame
+ * CAN interfaces have a single tx queue. The skb is consumed in any case.
  */
-int can_send(struct sk_buff *skb, int loop)
+static int can_direct_xmit(struct sk_buff *skb)
 {
-	struct sk_buff *newskb = NULL;
-	struct can_frame *cf = (struct can_frame *)skb->data;
-	int err;
+	struct net_device *dev = skb->dev;
+	struct netdev_queue *txq;
+	int ret = NETDEV_TX_BUSY;
+
+	skb_set_queue_mapping(skb, 0);
+	txq = netdev_get_tx_queue(dev, 0);
+
+	local_bh_disable();
+	__netif_tx_lock(txq, smp_processor_id());
+	if (!netif_xmit_frozen_or_stopped(txq))
+		ret = dev->netdev_ops->ndo_start_xmit(skb, dev);
+	__netif_tx_unlock(txq);
+	local_bh_enable();
 
-	if (skb->len != sizeof(struct can_frame) || cf->can_dlc > 8) {
+	if (!dev_xmit_complete(ret)) {
 		kfree_skb(skb);
-		return -EINVAL;
+		return -EBUSY;
 	}
 
+	if (ret > 0)
+		ret = net_xmit_errno(ret);
+
+	return ret;
+}
+#endif
+
+static int __can_send(struct sk_buff *skb, int loop, int bypass)
+{
+	struct can_net *cn;
+	struct sk_buff *newskb = NULL;
+	struct canfd_frame *cfd = (struct canfd_frame *)skb->data;
+	int err = -EINVAL;
+
+	if (skb->len == CAN_MTU) {
+		skb->protocol = htons(ETH_P_CAN);
+		if (unlikely(cfd->len > CAN_MAX_DLEN))
+			goto inval_skb;
+	} else if (skb->len == CANFD_MTU) {
+		skb->protocol = htons(ETH_P_CANFD);
+		if (unlikely(cfd->len > CANFD_MAX_DLEN))
+			goto inval_skb;
+	} else
+		goto inval_skb;
+
+	/*
+	 * Make sure the CAN frame can pass the selected CAN netdevice.
+	 * As structs can_frame and canfd_frame are similar, we can provide
+	 * CAN FD frames to legacy CAN drivers as long as the length is <= 8
+	 */
+	if (unlikely(skb->len > skb->dev->mtu && cfd->len > CAN_MAX_DLEN))
+		goto inval_skb;
+
 	if (skb->dev->type != ARPHRD_CAN) {
 		kfree_skb(skb);
 		return -EPERM;
@@ -314,7 +473,8 @@ int can_send(struct sk_buff *skb, int loop)
 		return -ENETDOWN;
 	}
 
-	skb->protocol = htons(ETH_P_CAN);
+	cn = can_pernet(dev_net(skb->dev));
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
 	skb_reset_network_header(skb);
 	skb_reset_transport_header(skb);
@@ -361,8 +521,25 @@ int can_send(struct sk_buff *skb, int loop)
 		skb->pkt_type = PACKET_HOST;
 	}
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+	/*
+	 * Drivers with IFF_ECHO take the tx timestamp at tx done time in
+	 * can_get_echo_skb(). Without an echo the send time is taken here.
+	 */
+	if (!(skb->dev->flags & IFF_ECHO) && skb->sk &&
+	    (skb_shinfo(skb)->tx_flags & SKBTX_SW_TSTAMP))
+		skb_tstamp_tx(skb, NULL);
+#endif
+
+	trace_can_send(skb, loop);
+
 	/* send to netdevice */
-	err = dev_queue_xmit(skb);
+#ifdef CAN_QDISC_BYPASS
+	if (bypass)
+		err = can_direct_xmit(skb);
+	else
+#endif
+		err = dev_queue_xmit(skb);
 	if (err > 0)
 		err = net_xmit_errno(err);
 
@@ -378,41 +555,86 @@ int can_send(struct sk_buff *skb, int loop)
 	}
 
 	if (newskb)
-		netif_rx_ni(newskb);
+		can_loopback(newskb);
 
 	/* update statistics */
-	can_stats.tx_frames++;
-	can_stats.tx_frames_delta++;
+	can_pcpu_stats_inc(cn, tx_frames);
 
 	return 0;
+
+inval_skb:
+	kfree_skb(skb);
+	return err;
+}
+
+/**
+ * can_send - transmit a CAN frame (optional with local loopback)
+ * @skb: pointer to socket buffer with CAN frame in data section
+ * @loop: loopback for listeners on local CAN sockets (recommended default!)
+ *
+ * Due to the loopback this routine must not be called from hardirq context.
+ *
+ * Return:
+ *  0 on success
+ *  -ENETDOWN when the selected interface is down
+ *  -ENOBUFS on full driver queue (see net_xmit_errno())
+ *  -ENOMEM when local loopback failed at calling skb_clone()
+ *  -EPERM when trying to send on a non-CAN interface
+ *  -EINVAL when the skb->data does not contain a valid CAN frame
+ *  -EINVAL when sending a CAN FD frame on a non CAN FD capable interface
+ */
+int can_send(struct sk_buff *skb, int loop)
+{
+	return __can_send(skb, loop, 0);
 }
 EXPORT_SYMBOL(can_send);
 
+#ifdef CAN_QDISC_BYPASS
+/**
+ * can_send_bypass - transmit a CAN frame without the qdisc of the interface
+ * @skb: pointer to socket buffer with CAN frame in data section
+ * @loop: loopback for listeners on local CAN sockets (recommended default!)
+ *
+ * The frame is passed to the driver under the tx queue lock. Packet
+ * sockets and the traffic control of the interface do not see the frame.
+ *
+ * Return:
+ *  -EBUSY when the driver queue is stopped, see can_send() otherwise
+ */
+int can_send_bypass(struct sk_buff *skb, int loop)
+{
+	return __can_send(skb, loop, 1);
+}
+EXPORT_SYMBOL(can_send_bypass);
+#endif
+
 /*
  * af_can rx path
  */
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
-static struct dev_rcv_lists *find_dev_rcv_lists(struct net_device *dev)
+static struct dev_rcv_lists *find_dev_rcv_lists(struct can_net *cn,
+						 struct net_device *dev)
 {
 	/*
 	 * find receive list for this device
 	 *
 	 * Since 2.6.26 a new "midlevel private" ml_priv pointer has been
 	 * introduced in struct net_device. We use this pointer to omit the
-	 * linear walk through the can_rx_dev_list. A similar speedup has been
+	 * linear walk through the rx_dev_list. A similar speedup has been
 	 * queued for 2.6.34 mainline but using the new netdev_rcu lists.
-	 * Therefore the can_rx_dev_list is still needed (e.g. in proc.c)
+	 * Therefore the rx_dev_list is still needed (e.g. in proc.c)
 	 */
 
 	/* dev == NULL is the indicator for the 'all' filterlist */
 	if (!dev)
-		return &can_rx_alldev_list;
+		return cn->rx_alldev_list;
 	else
 		return (struct dev_rcv_lists *)dev->ml_priv;
 }
 #else
-static struct dev_rcv_lists *find_dev_rcv_lists(struct net_device *dev)
+static struct dev_rcv_lists *find_dev_rcv_lists(struct can_net *cn,
+						 struct net_device *dev)
 {
 	struct dev_rcv_lists *d = NULL;
 	struct hlist_node *n;
@@ -430,7 +652,7 @@ static struct dev_rcv_lists *find_dev_rcv_lists(struct net_device *dev)
 	 * cursor variable n to decide if a match was found.
 	 */
 
-	hlist_for_each_entry_rcu(d, n, &can_rx_dev_list, list) {
+	hlist_for_each_entry_rcu(d, n, &cn->rx_dev_list, list) {
 		if (d->dev == dev)
 			break;
 	}
@@ -439,6 +661,46 @@ static struct dev_rcv_lists *find_dev_rcv_lists(struct net_device *dev)
 }
 #endif
 
+/*
+ * can_lock_rcv_lists - find and lock the receive lists of a device
+ *
+ * Filter updates on different devices only contend on the spinlock of
+ * the dev_rcv_lists structure (the 'all' CAN devices list has its own).
+ * The caller has to hold rcu_read_lock() until d->lock is released as
+ * the structure may be unlinked and freed by a concurrent NETDEV_UNREGISTER.
+ * An already unlinked structure is treated like a missing one.
+ */
+static struct dev_rcv_lists *can_lock_rcv_lists(struct can_net *cn,
+						struct net_device *dev)
+{
+	struct dev_rcv_lists *d = find_dev_rcv_lists(cn, dev);
+
+	if (!d)
+		return NULL;
+
+	spin_lock(&d->lock);
+
+	if (d->remove_on_zero_entries && !d->entries) {
+		spin_unlock(&d->lock);
+		return NULL;
+	}
+
+	return d;
+}
+
+/* unlink an empty dev_rcv_lists structure - called with d->lock */
+static void can_unlink_rcv_lists(struct can_net *cn, struct dev_rcv_lists *d)
+{
+	d->remove_on_zero_entries = 1;
+
+	spin_lock(&cn->rcvlists_lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+	d->dev->ml_priv = NULL;
+#endif
+	hlist_del_rcu(&d->list);
+	spin_unlock(&cn->rcvlists_lock);
+}
+
 /**
  * find_rcv_list - determine optimal filterlist inside device filter struct
  * @can_id: pointer to CAN identifier of a given can_filter
@@ -502,10 +764,9 @@ static struct hlist_head *find_rcv_list(canid_t *can_id, canid_t *mask,
 	    && !(*can_id & CAN_RTR_FLAG)) {
 
 		if (*can_id & CAN_EFF_FLAG) {
-			if (*mask == (CAN_EFF_MASK | CAN_EFF_RTR_FLAGS)) {
-				/* RFC: a future use-case for hash-tables? */
+			/* placeholder for the d->rx_eff hash table */
+			if (*mask == (CAN_EFF_MASK | CAN_EFF_RTR_FLAGS))
 				return &d->rx[RX_EFF];
-			}
 		} else {
 			if (*mask == (CAN_SFF_MASK | CAN_EFF_RTR_FLAGS))
 				return &d->rx_sff[*can_id];
@@ -516,142 +777,543 @@ static struct hlist_head *find_rcv_list(canid_t *can_id, canid_t *mask,
 	return &d->rx[RX_FIL];
 }
 
+/* check for one of the single SFF can_id lists returned by find_rcv_list() */
+static inline int is_sff_rcv_list(struct dev_rcv_lists *d,
+				  struct hlist_head *rl)
+{
+	return rl >= d->rx_sff && rl < d->rx_sff + ARRAY_SIZE(d->rx_sff);
+}
+
+/*
+ * RX_EFF hash table handling
+ */
+
+static struct can_eff_hash *can_eff_hash_alloc(unsigned int bits, gfp_t gfp)
+{
+	struct can_eff_hash *h;
+
+	h = kzalloc(sizeof(*h) + (sizeof(struct hlist_head) << bits), gfp);
+	if (h)
+		h->bits = bits;
+
+	return h;
+}
+
+static inline struct hlist_node *can_eff_node(struct can_eff_hash *h,
+					      struct receiver *r)
+{
+	return h->alt ? &r->eff_list : &r->list;
+}
+
+static inline struct hlist_head *can_eff_head(struct can_eff_hash *h,
+					      canid_t can_id)
+{
+	return &h->bucket[hash_32(can_id & CAN_EFF_MASK, h->bits)];
+}
+
+/* size of the RX_EFF hash table for the current entries (0 => keep it) */
+static unsigned int can_eff_hash_bits(struct dev_rcv_lists *d)
+{
+	unsigned int bits = d->rx_eff->bits;
+
+	/* keep an average of less than one entry per bucket */
+	if (d->eff_entries > (1 << bits) && bits < CAN_EFF_HASH_MAX_BITS)
+		return bits + 1;
+
+	if (d->eff_entries < (1 << bits) / 4 && bits > CAN_EFF_HASH_MIN_BITS)
+		return bits - 1;
+
+	return 0;
+}
+
 /**
- * can_rx_register - subscribe CAN frames from a specific interface
- * @dev: pointer to netdevice (NULL => subcribe from 'all' CAN devices list)
- * @can_id: CAN identifier (see description)
- * @mask: CAN mask (see description)
- * @func: callback function on filter match
- * @data: returned parameter for callback function
- * @ident: string for calling module indentification
+ * can_eff_hash_resize - adapt the RX_EFF hash table to the number of entries
+ * @cn: CAN core data of the network namespace
+ * @dev: pointer to netdevice (NULL => 'all' CAN devices list)
  *
  * Description:
- *  Invokes the callback function with the received sk_buff and the given
- *  parameter 'data' on a matching receive filter. A filter matches, when
- *
- *          <received_can_id> & mask == can_id & mask
- *
- *  The filter can be inverted (CAN_INV_FILTER bit set in can_id) or it can
- *  filter for error frames (CAN_ERR_FLAG bit set in mask).
- *
- *  The provided pointer to the sk_buff is guaranteed to be valid as long as
- *  the callback function is running. The callback function must *not* free
- *  the given sk_buff while processing it's task. When the given sk_buff is
- *  needed after the end of the callback function it must be cloned inside
- *  the callback function with skb_clone().
- *
- * Return:
- *  0 on success
- *  -ENOMEM on missing cache mem to create subscription entry
- *  -ENODEV unknown device
+ *  The receivers are linked into the new table with their currently unused
+ *  hlist node so that readers can still walk the old table. The old table
+ *  is freed after a grace period. Therefore the resize has to be called in
+ *  process context. Resizing is serialized by can_eff_resize_lock.
  */
-int can_rx_register(struct net_device *dev, canid_t can_id, canid_t mask,
-		    void (*func)(struct sk_buff *, void *), void *data,
-		    char *ident)
+static void can_eff_hash_resize(struct can_net *cn, struct net_device *dev)
 {
-	struct receiver *r;
-	struct hlist_head *rl;
 	struct dev_rcv_lists *d;
-	int err = 0;
+	struct can_eff_hash *old = NULL, *new;
+	struct receiver *r;
+	struct hlist_node *n;
+	unsigned int bits, i;
 
-	/* insert new receiver  (dev,canid,mask) -> (func,data) */
+	mutex_lock(&can_eff_resize_lock);
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
-	if (dev && dev->type != ARPHRD_CAN)
-		return -ENODEV;
-#endif
+	rcu_read_lock();
+	d = can_lock_rcv_lists(cn, dev);
+	bits = 0;
+	if (d) {
+		bits = can_eff_hash_bits(d);
+		spin_unlock(&d->lock);
+	}
+	rcu_read_unlock();
 
-	r = kmem_cache_alloc(rcv_cache, GFP_KERNEL);
-	if (!r)
-		return -ENOMEM;
+	if (!bits)
+		goto out;
 
-	spin_lock(&can_rcvlists_lock);
+	/* a failed allocation only leads to longer hash chains */
+	new = can_eff_hash_alloc(bits, GFP_KERNEL);
+	if (!new)
+		goto out;
 
-	d = find_dev_rcv_lists(dev);
-	if (d) {
-		rl = find_rcv_list(&can_id, &mask, d);
+	rcu_read_lock();
 
-		r->can_id  = can_id;
-		r->mask    = mask;
-		r->matches = 0;
-		r->func    = func;
-		r->data    = data;
-		r->ident   = ident;
+	/* the entries may have changed in the meantime */
+	d = can_lock_rcv_lists(cn, dev);
+	if (!d || can_eff_hash_bits(d) != bits) {
+		if (d)
+			spin_unlock(&d->lock);
+		rcu_read_unlock();
+		kfree(new);
+		goto out;
+	}
 
-		hlist_add_head_rcu(&r->list, rl);
-		d->entries++;
+	old = d->rx_eff;
+	new->alt = !old->alt;
 
-		can_pstats.rcv_entries++;
-		if (can_pstats.rcv_entries_max < can_pstats.rcv_entries)
-			can_pstats.rcv_entries_max = can_pstats.rcv_entries;
-	} else {
-		kmem_cache_free(rcv_cache, r);
-		err = -ENODEV;
+	for (i = 0; i < (1 << old->bits); i++) {
+		can_eff_for_each_rcu(r, n, old, &old->bucket[i])
+			hlist_add_head_rcu(can_eff_node(new, r),
+					   can_eff_head(new, r->can_id));
 	}
 
-	spin_unlock(&can_rcvlists_lock);
+	rcu_assign_pointer(d->rx_eff, new);
 
-	return err;
+	spin_unlock(&d->lock);
+	rcu_read_unlock();
+
+	/* no reader and no further resize must use the old table nodes */
+	synchronize_rcu();
+	kfree(old);
+
+ out:
+	mutex_unlock(&can_eff_resize_lock);
 }
-EXPORT_SYMBOL(can_rx_register);
 
 /*
- * can_rx_delete_device - rcu callback for dev_rcv_lists structure removal
+ * Compiled RX_FIL/RX_INV filters
+ *
+ * With more than a few entries the receivers of these lists are grouped by
+ * their mask. The receive path then needs one binary search per distinct
+ * mask instead of a compare for each registered filter. Smaller lists (or
+ * a failed allocation) are handled by walking the receiver list itself.
  */
-static void can_rx_delete_device(struct rcu_head *rp)
+
+#define CAN_FILTER_COMPILE_MIN 8
+
+static int can_filter_entry_cmp(const void *a, const void *b)
 {
-	struct dev_rcv_lists *d = container_of(rp, struct dev_rcv_lists, rcu);
+	const struct can_filter_entry *x = a;
+	const struct can_filter_entry *y = b;
 
-	kfree(d);
+	if (x->mask != y->mask)
+		return (x->mask < y->mask) ? -1 : 1;
+
+	if (x->can_id != y->can_id)
+		return (x->can_id < y->can_id) ? -1 : 1;
+
+	return 0;
+}
+
+static void can_filter_table_free(struct rcu_head *rp)
+{
+	kfree(container_of(rp, struct can_filter_table, rcu));
 }
 
 /*
- * can_rx_delete_receiver - rcu callback for single receiver entry removal
+ * can_filter_invalidate - drop the compiled filters of list idx after a
+ * change of the list. Until can_filter_compile() has built a new table the
+ * rx path walks the receiver list. Called with d->lock.
  */
-static void can_rx_delete_receiver(struct rcu_head *rp)
+static void can_filter_invalidate(struct dev_rcv_lists *d, int idx)
 {
-	struct receiver *r = container_of(rp, struct receiver, rcu);
+	struct can_filter_table *old = d->rx_tab[idx];
 
-	kmem_cache_free(rcv_cache, r);
+	d->rx_tab_seq[idx]++;
+
+	if (!old)
+		return;
+
+	rcu_assign_pointer(d->rx_tab[idx], NULL);
+	call_rcu(&old->rcu, can_filter_table_free);
 }
 
-/**
- * can_rx_unregister - unsubscribe CAN frames from a specific interface
- * @dev: pointer to netdevice (NULL => unsubcribe from 'all' CAN devices list)
- * @can_id: CAN identifier
- * @mask: CAN mask
- * @func: callback function on filter match
- * @data: returned parameter for callback function
+/*
+ * can_filter_compile - rebuild the compiled filters of list idx
+ * @cn: CAN core data of the network namespace
+ * @dev: pointer to netdevice (NULL => 'all' CAN devices list)
+ * @idx: RX_FIL or RX_INV
  *
  * Description:
- *  Removes subscription entry depending on given (subscription) values.
+ *  The table is allocated with GFP_KERNEL outside of d->lock and filled
+ *  and published under the lock when the list has not changed in the
+ *  meantime. Otherwise the concurrent change compiles the list itself.
+ *  Therefore the compile has to be called in process context.
  */
-void can_rx_unregister(struct net_device *dev, canid_t can_id, canid_t mask,
-		       void (*func)(struct sk_buff *, void *), void *data)
+static void can_filter_compile(struct can_net *cn, struct net_device *dev,
+			       int idx)
 {
-	struct receiver *r = NULL;
-	struct hlist_head *rl;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-	struct hlist_node *next;
-#endif
 	struct dev_rcv_lists *d;
+	struct can_filter_table *t;
+	struct can_filter_group *g = NULL;
+	struct hlist_node *pos;
+	struct receiver *r;
+	unsigned int num = 0;
+	unsigned int seq = 0;
+	unsigned int i;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
-	if (dev && dev->type != ARPHRD_CAN)
+	rcu_read_lock();
+	d = can_lock_rcv_lists(cn, dev);
+	if (d) {
+		hlist_for_each(pos, &d->rx[idx])
+			num++;
+		seq = d->rx_tab_seq[idx];
+		spin_unlock(&d->lock);
+	}
+	rcu_read_unlock();
+
+	if (num < CAN_FILTER_COMPILE_MIN)
+		return;
+
+	/* a failed allocation only leads to a walk of the receiver list */
+	t = kmalloc(sizeof(*t) + num * (sizeof(struct can_filter_entry) +
+					sizeof(struct can_filter_group)),
+		    GFP_KERNEL);
+	if (!t)
 		return;
+
+	rcu_read_lock();
+
+	d = can_lock_rcv_lists(cn, dev);
+	if (!d || d->rx_tab_seq[idx] != seq || d->rx_tab[idx]) {
+		if (d)
+			spin_unlock(&d->lock);
+		rcu_read_unlock();
+		kfree(t);
+		return;
+	}
+
+	t->groups = (struct can_filter_group *)&t->entries[num];
+	t->ngroups = 0;
+
+	i = 0;
+	hlist_for_each(pos, &d->rx[idx]) {
+		r = hlist_entry(pos, struct receiver, list);
+		t->entries[i].mask = r->mask;
+		t->entries[i].can_id = r->can_id;
+		t->entries[i].r = r;
+		i++;
+	}
+
+	sort(t->entries, num, sizeof(struct can_filter_entry),
+	     can_filter_entry_cmp, NULL);
+
+	for (i = 0; i < num; i++) {
+		if (!g || g->mask != t->entries[i].mask) {
+			g = &t->groups[t->ngroups++];
+			g->mask = t->entries[i].mask;
+			g->first = i;
+			g->num = 0;
+		}
+		g->num++;
+	}
+
+	rcu_assign_pointer(d->rx_tab[idx], t);
+
+	spin_unlock(&d->lock);
+	rcu_read_unlock();
+}
+
+/**
+ * can_rx_register - subscribe CAN frames from a specific interface
+ * @net: the applicable net namespace
+ * @dev: pointer to netdevice (NULL => subcribe from 'all' CAN devices list)
+ * @can_id: CAN identifier (see description)
+ * @mask: CAN mask (see description)
+ * @func: callback function on filter match
+ * @data: returned parameter for callback function
+ * @ident: string for calling module indentification
+ *
+ * Description:
+ *  Invokes the callback function with the received sk_buff and the given
+ *  parameter 'data' on a matching receive filter. A filter matches, when
+ *
+ *          <received_can_id> & mask == can_id & mask
+ *
+ *  The filter can be inverted (CAN_INV_FILTER bit set in can_id) or it can
+ *  filter for error frames (CAN_ERR_FLAG bit set in mask).
+ *
+ *  The provided pointer to the sk_buff is guaranteed to be valid as long as
+ *  the callback function is running. The callback function must *not* free
+ *  the given sk_buff while processing it's task. When the given sk_buff is
+ *  needed after the end of the callback function it must be cloned inside
+ *  the callback function with skb_clone().
+ *
+ * Return:
+ *  0 on success
+ *  -ENOMEM on missing cache mem to create subscription entry
+ *  -ENODEV unknown device
+ */
+int can_rx_register(struct net *net, struct net_device *dev, canid_t can_id,
+		    canid_t mask, void (*func)(struct sk_buff *, void *),
+		    void *data, char *ident)
+{
+	return can_rx_register_flags(net, dev, can_id, mask, func, data,
+				     ident, 0);
+}
+EXPORT_SYMBOL(can_rx_register);
+
+/**
+ * can_rx_register_flags - subscribe CAN frames with a delivery contract
+ * @net: the applicable net namespace
+ * @dev: pointer to netdevice (NULL => subcribe from 'all' CAN devices list)
+ * @can_id: CAN identifier (see can_rx_register())
+ * @mask: CAN mask (see can_rx_register())
+ * @func: callback function on filter match
+ * @data: returned parameter for callback function
+ * @ident: string for calling module indentification
+ * @flags: delivery flags (CAN_RX_OWN_SKB, CAN_RX_SK_FILTER)
+ *
+ * Description:
+ *  Works like can_rx_register(). With CAN_RX_OWN_SKB set the callback
+ *  function gets a private sk_buff, that it has to free or enqueue on its
+ *  own. The sk_buff data may be shared with other receivers and must not
+ *  be modified. skb->sk still references the originating socket.
+ *  With CAN_RX_SK_FILTER the socket filter of the struct sock given in
+ *  'data' decides about the delivery of each frame.
+ *
+ * Return:
+ *  0 on success
+ *  -EINVAL on unknown flags
+ *  -ENOMEM on missing cache mem to create subscription entry
+ *  -ENODEV unknown device
+ */
+int can_rx_register_flags(struct net *net, struct net_device *dev,
+			  canid_t can_id, canid_t mask,
+			  void (*func)(struct sk_buff *, void *),
+			  void *data, char *ident, unsigned int flags)
+{
+	struct can_filter filter;
+
+	filter.can_id = can_id;
+	filter.can_mask = mask;
+
+	return can_rx_register_bulk(net, dev, &filter, 1, func, data, ident,
+				    flags);
+}
+EXPORT_SYMBOL(can_rx_register_flags);
+
+/*
+ * can_rx_free_receivers - free a chain of (no longer visible) receivers
+ */
+static void can_rx_free_receivers(struct receiver *r)
+{
+	struct receiver *next;
+
+	while (r) {
+		next = r->next_free;
+#ifdef CAN_PCPU_MATCHES
+		free_percpu(r->matches);
 #endif
+		kmem_cache_free(rcv_cache, r);
+		r = next;
+	}
+}
 
-	spin_lock(&can_rcvlists_lock);
+/*
+ * can_rx_alloc_receivers - allocate a chain of count receivers
+ */
+static int can_rx_alloc_receivers(struct receiver **rcvs, int count)
+{
+	struct receiver *r;
+	int i;
 
-	d = find_dev_rcv_lists(dev);
-	if (!d) {
-		printk(KERN_ERR "BUG: receive list not found for "
-		       "dev %s, id %03X, mask %03X\n",
-		       DNAME(dev), can_id, mask);
-		goto out;
+	*rcvs = NULL;
+
+	for (i = 0; i < count; i++) {
+		r = kmem_cache_alloc(rcv_cache, GFP_KERNEL);
+		if (!r)
+			goto out_nomem;
+
+#ifdef CAN_PCPU_MATCHES
+		r->matches = alloc_percpu(unsigned long);
+		if (!r->matches) {
+			kmem_cache_free(rcv_cache, r);
+			goto out_nomem;
+		}
+#endif
+		r->next_free = *rcvs;
+		*rcvs = r;
 	}
 
-	rl = find_rcv_list(&can_id, &mask, d);
+	return 0;
+
+ out_nomem:
+	can_rx_free_receivers(*rcvs);
+	*rcvs = NULL;
+	return -ENOMEM;
+}
+
+#ifdef CAN_RCV_TIME
+/* find or allocate the callback time slot of an ident */
+static unsigned int can_rcv_time_slot(const char *ident)
+{
+	unsigned int i;
+
+	if (!ident)
+		return CAN_RCV_TIME_SLOTS - 1;
+
+	spin_lock(&rcv_time_lock);
+
+	for (i = 0; i < CAN_RCV_TIME_SLOTS - 1; i++) {
+		if (!rcv_time_ident[i][0]) {
+			strlcpy(rcv_time_ident[i], ident, CAN_RCV_TIME_IDLEN);
+			break;
+		}
+		if (!strncmp(rcv_time_ident[i], ident, CAN_RCV_TIME_IDLEN - 1))
+			break;
+	}
+
+	spin_unlock(&rcv_time_lock);
+
+	return i;
+}
+
+int can_rcv_time_enabled(void)
+{
+	return rcv_time;
+}
+
+/*
+ * can_get_rcv_time - sum up the callback times of a slot for the procfs
+ *
+ * Returns 0 when the slot is unused. The ident buffer has to provide
+ * CAN_RCV_TIME_IDLEN bytes.
+ */
+int can_get_rcv_time(int slot, char *ident, struct s_rcv_time *sum)
+{
+	struct s_rcv_time *t;
+	int cpu;
+
+	spin_lock(&rcv_time_lock);
+	if (slot == CAN_RCV_TIME_SLOTS - 1)
+		strlcpy(ident, "(other)", CAN_RCV_TIME_IDLEN);
+	else
+		strlcpy(ident, rcv_time_ident[slot], CAN_RCV_TIME_IDLEN);
+	spin_unlock(&rcv_time_lock);
+
+	memset(sum, 0, sizeof(*sum));
+
+	for_each_possible_cpu(cpu) {
+		t = &per_cpu(can_rcv_time, cpu).slot[slot];
+		sum->calls += t->calls;
+		sum->nsecs += t->nsecs;
+		if (t->max_nsecs > sum->max_nsecs)
+			sum->max_nsecs = t->max_nsecs;
+	}
+
+	if (slot == CAN_RCV_TIME_SLOTS - 1)
+		return sum->calls != 0;
+
+	return ident[0] != 0;
+}
+#endif
+
+/*
+ * can_rx_link_receivers - insert the receivers for a filter array
+ *
+ * Called with d->lock. The receivers are visible to the frames of
+ * generation gen and later (0 => at once). The lists that need a rebuild
+ * of their compiled filters are marked in compile[]. Returns the needed
+ * EFF hash size.
+ */
+static unsigned int can_rx_link_receivers(struct dev_rcv_lists *d,
+					  struct receiver *rcvs,
+					  const struct can_filter *filter,
+					  int count,
+					  void (*func)(struct sk_buff *,
+						       void *),
+					  void *data, char *ident,
+					  unsigned int flags, unsigned int gen,
+					  int *compile)
+{
+	struct receiver *r;
+	struct hlist_head *rl;
+	int eff = 0;
+	int i;
+#ifdef CAN_RCV_TIME
+	unsigned int tslot = can_rcv_time_slot(ident);
+#endif
+
+	for (i = 0, r = rcvs; i < count; i++, r = r->next_free) {
+		canid_t can_id = filter[i].can_id;
+		canid_t mask = filter[i].can_mask;
+
+		rl = find_rcv_list(&can_id, &mask, d);
+
+		r->can_id  = can_id;
+		r->mask    = mask;
+#ifndef CAN_PCPU_MATCHES
+		r->matches = 0;
+#endif
+		r->func    = func;
+		r->data    = data;
+		r->ident   = ident;
+		r->flags   = flags;
+		r->gen_on  = gen;
+		r->gen_off = 0;
+#ifdef CAN_RCV_TIME
+		r->tslot   = tslot;
+#endif
+
+		if (rl == &d->rx[RX_EFF]) {
+			hlist_add_head_rcu(can_eff_node(d->rx_eff, r),
+					   can_eff_head(d->rx_eff, can_id));
+			eff++;
+		} else {
+			hlist_add_head_rcu(&r->list, rl);
+			if (is_sff_rcv_list(d, rl))
+				d->sff_entries++;
+		}
+
+		if (rl == &d->rx[RX_FIL] || rl == &d->rx[RX_INV])
+			compile[rl - d->rx] = 1;
+	}
+
+	d->entries += count;
+
+	if (!eff)
+		return 0;
+
+	d->eff_entries += eff;
+	return can_eff_hash_bits(d);
+}
+
+/*
+ * can_rx_find_receiver - look up a receiver entry - called with d->lock
+ *
+ * Only receivers retired by generation gen_off (0 => not retired) match.
+ */
+static struct receiver *can_rx_find_receiver(struct dev_rcv_lists *d,
+					     struct hlist_head *rl,
+					     canid_t can_id, canid_t mask,
+					     void (*func)(struct sk_buff *,
+							  void *),
+					     void *data, unsigned int gen_off)
+{
+	struct receiver *r;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	struct hlist_node *next;
+#endif
+	struct hlist_node *n;
 
 	/*
 	 * Search the receiver list for the item to delete.  This should
@@ -659,13 +1321,26 @@ void can_rx_unregister(struct net_device *dev, canid_t can_id, canid_t mask,
 	 * been registered before.
 	 */
 
+	if (rl == &d->rx[RX_EFF]) {
+		can_eff_for_each_rcu(r, n, d->rx_eff,
+				     can_eff_head(d->rx_eff, can_id)) {
+			if (r->can_id == can_id && r->mask == mask
+			    && r->func == func && r->data == data
+			    && r->gen_off == gen_off)
+				break;
+		}
+
+		return n ? r : NULL;
+	}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
 	hlist_for_each_entry_rcu(r, next, rl, list) {
 #else
 	hlist_for_each_entry_rcu(r, rl, list) {
 #endif
 		if (r->can_id == can_id && r->mask == mask
-		    && r->func == func && r->data == data)
+		    && r->func == func && r->data == data
+		    && r->gen_off == gen_off)
 			break;
 	}
 
@@ -676,54 +1351,761 @@ void can_rx_unregister(struct net_device *dev, canid_t can_id, canid_t mask,
 	 */
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-	if (!next) {
+	if (!next)
 #else
-	if (!r) {
+	if (!r)
 #endif
-		printk(KERN_ERR "BUG: receive list entry not found for "
-		       "dev %s, id %03X, mask %03X\n",
-		       DNAME(dev), can_id, mask);
-		r = NULL;
-		d = NULL;
-		goto out;
+		return NULL;
+
+	return r;
+}
+
+/*
+ * can_rx_retire_receivers - mark the receivers of a filter array as
+ * invisible to the frames of generation gen and later
+ *
+ * Called with d->lock. The receivers stay linked until
+ * can_rx_unlink_receivers() is called with the same gen.
+ */
+static void can_rx_retire_receivers(struct dev_rcv_lists *d,
+				    const struct can_filter *filter,
+				    int count,
+				    void (*func)(struct sk_buff *, void *),
+				    void *data, unsigned int gen)
+{
+	struct receiver *r;
+	struct hlist_head *rl;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		canid_t can_id = filter[i].can_id;
+		canid_t mask = filter[i].can_mask;
+
+		rl = find_rcv_list(&can_id, &mask, d);
+
+		/* a missing entry is reported by can_rx_unlink_receivers() */
+		r = can_rx_find_receiver(d, rl, can_id, mask, func, data, 0);
+		if (r)
+			r->gen_off = gen;
 	}
+}
+
+/*
+ * can_rx_unlink_receivers - remove the receivers of a filter array
+ *
+ * Called with d->lock. Only receivers retired by generation gen_off
+ * (0 => not retired) are removed. Returns the chain of removed receivers,
+ * which have to be freed after a grace period. *removed counts them.
+ */
+static struct receiver *can_rx_unlink_receivers(struct dev_rcv_lists *d,
+						struct net_device *dev,
+						const struct can_filter *filter,
+						int count,
+						void (*func)(struct sk_buff *,
+							     void *),
+						void *data,
+						unsigned int gen_off,
+						int *compile, int *removed)
+{
+	struct receiver *r, *rcvs = NULL;
+	struct hlist_head *rl;
+	int i;
+
+	*removed = 0;
+
+	for (i = 0; i < count; i++) {
+		canid_t can_id = filter[i].can_id;
+		canid_t mask = filter[i].can_mask;
+
+		rl = find_rcv_list(&can_id, &mask, d);
+
+		r = can_rx_find_receiver(d, rl, can_id, mask, func, data,
+					 gen_off);
+		if (!r) {
+			printk(KERN_ERR "BUG: receive list entry not found "
+			       "for dev %s, id %03X, mask %03X\n",
+			       DNAME(dev), can_id, mask);
+			continue;
+		}
+
+		if (rl == &d->rx[RX_EFF]) {
+			hlist_del_rcu(can_eff_node(d->rx_eff, r));
+			d->eff_entries--;
+		} else
+			hlist_del_rcu(&r->list);
+
+		if (rl == &d->rx[RX_FIL] || rl == &d->rx[RX_INV])
+			compile[rl - d->rx] = 1;
+		else if (is_sff_rcv_list(d, rl))
+			d->sff_entries--;
+		r->next_free = rcvs;
+		rcvs = r;
+		(*removed)++;
+	}
+
+	d->entries -= *removed;
+
+	return rcvs;
+}
+
+/* drop the compiled filters of the marked lists - called with d->lock */
+static void can_rx_invalidate_lists(struct dev_rcv_lists *d, int *compile)
+{
+	if (compile[RX_FIL])
+		can_filter_invalidate(d, RX_FIL);
+	if (compile[RX_INV])
+		can_filter_invalidate(d, RX_INV);
+}
+
+/* rebuild the compiled filters of the marked lists - process context */
+static void can_rx_compile_lists(struct can_net *cn, struct net_device *dev,
+				 int *compile)
+{
+	if (compile[RX_FIL])
+		can_filter_compile(cn, dev, RX_FIL);
+	if (compile[RX_INV])
+		can_filter_compile(cn, dev, RX_INV);
+}
+
+static void can_rx_update_pstats(struct can_net *cn, int added, int removed)
+{
+	spin_lock(&cn->rcvlists_lock);
 
-	hlist_del_rcu(&r->list);
-	d->entries--;
+	cn->pstats.rcv_entries += added;
+	if (cn->pstats.rcv_entries > removed)
+		cn->pstats.rcv_entries -= removed;
+	else
+		cn->pstats.rcv_entries = 0;
 
-	if (can_pstats.rcv_entries > 0)
-		can_pstats.rcv_entries--;
+	if (cn->pstats.rcv_entries_max < cn->pstats.rcv_entries)
+		cn->pstats.rcv_entries_max = cn->pstats.rcv_entries;
+
+	spin_unlock(&cn->rcvlists_lock);
+}
+
+/* check the (dev, net) pair given to the (un)register functions */
+static inline int can_rx_check_dev(struct net *net, struct net_device *dev)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+	if (dev && dev->type != ARPHRD_CAN)
+		return -ENODEV;
+#endif
+
+#ifdef CAN_NETNS
+	if (dev && !net_eq(net, dev_net(dev)))
+		return -ENODEV;
+#endif
+
+	return 0;
+}
+
+#ifdef CAN_HW_FILTER
+/*
+ * Hardware filter offload
+ *
+ * The id/mask pairs of all receivers of a device (and of the 'all' CAN
+ * devices list) are reduced to a single pair per frame format which
+ * matches at least every frame any receiver is interested in. Bits that
+ * differ between the receivers become "don't care" bits.
+ */
+
+struct can_hw_acc {
+	canid_t id[2];		/* [0] SFF, [1] EFF */
+	canid_t mask[2];
+	unsigned int count[2];
+};
+
+static void can_hw_acc_add(struct can_hw_acc *a, int eff, canid_t id,
+			   canid_t mask)
+{
+	if (!a->count[eff]++) {
+		a->mask[eff] = mask;
+		a->id[eff] = id & mask;
+		return;
+	}
+
+	a->mask[eff] &= mask & ~(a->id[eff] ^ id);
+	a->id[eff] &= a->mask[eff];
+}
+
+static void can_hw_acc_rcv(struct can_hw_acc *a, struct receiver *r, int inv)
+{
+	/* inverted filters may match anything */
+	canid_t sff = inv ? 0 : CAN_SFF_MASK;
+	canid_t eff = inv ? 0 : CAN_EFF_MASK;
+
+	/* without CAN_EFF_FLAG in the mask both formats are subscribed */
+	if (!(r->mask & CAN_EFF_FLAG) || !(r->can_id & CAN_EFF_FLAG))
+		can_hw_acc_add(a, 0, r->can_id & sff, r->mask & sff);
+	if (!(r->mask & CAN_EFF_FLAG) || (r->can_id & CAN_EFF_FLAG))
+		can_hw_acc_add(a, 1, r->can_id & eff, r->mask & eff);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+#define can_hw_for_each_rcu(r, n, head)				\
+	hlist_for_each_entry_rcu(r, n, head, list)
+#else
+#define can_hw_for_each_rcu(r, n, head)				\
+	hlist_for_each_entry_rcu(r, head, list)
+#endif
+
+/* add all receivers of d except the error frame ones - rcu_read_lock held */
+static void can_hw_acc_lists(struct can_hw_acc *a, struct dev_rcv_lists *d)
+{
+	struct can_eff_hash *h;
+	struct receiver *r;
+	struct hlist_node *n;
+	int i;
+
+	can_hw_for_each_rcu(r, n, &d->rx[RX_ALL])
+		can_hw_acc_rcv(a, r, 0);
+	can_hw_for_each_rcu(r, n, &d->rx[RX_FIL])
+		can_hw_acc_rcv(a, r, 0);
+	can_hw_for_each_rcu(r, n, &d->rx[RX_INV])
+		can_hw_acc_rcv(a, r, 1);
+
+	if (d->sff_entries) {
+		for (i = 0; i < ARRAY_SIZE(d->rx_sff); i++)
+			can_hw_for_each_rcu(r, n, &d->rx_sff[i])
+				can_hw_acc_rcv(a, r, 0);
+	}
+
+	if (d->eff_entries) {
+		h = rcu_dereference(d->rx_eff);
+		for (i = 0; i < (1 << h->bits); i++)
+			can_eff_for_each_rcu(r, n, h, &h->bucket[i])
+				can_hw_acc_rcv(a, r, 0);
+	}
+}
+
+/* only can-dev devices carry a struct can_priv */
+static inline int can_hw_filter_capable(struct net_device *dev)
+{
+	return dev->rtnl_link_ops && !strcmp(dev->rtnl_link_ops->kind, "can");
+}
+
+/* compute and hand over the filter of dev - rcu_read_lock held */
+static void can_hw_filter_dev(struct can_net *cn, struct net_device *dev)
+{
+	struct can_hw_acc a = { .count = { 0, 0 } };
+	struct can_hw_filter f;
+	struct dev_rcv_lists *d;
+
+	if (!can_hw_filter_capable(dev))
+		return;
+
+	memset(&f, 0, sizeof(f));
+
+	/* packet taps want to see all the traffic */
+	if (!(dev->flags & IFF_PROMISC)) {
+		d = find_dev_rcv_lists(cn, dev);
+		if (d)
+			can_hw_acc_lists(&a, d);
+		can_hw_acc_lists(&a, cn->rx_alldev_list);
+
+		if (a.count[0]) {
+			f.sff_id = a.id[0];
+			f.sff_mask = a.mask[0];
+		} else
+			f.flags |= CAN_HW_FILTER_NO_SFF;
+
+		if (a.count[1]) {
+			f.eff_id = a.id[1];
+			f.eff_mask = a.mask[1];
+		} else
+			f.flags |= CAN_HW_FILTER_NO_EFF;
+	}
+
+	can_set_hw_filter(dev, &f);
+}
+
+/*
+ * can_hw_filter_update - recompute the hardware filters after a change of
+ * the receive lists of dev (NULL => of all CAN devices in net)
+ */
+static void can_hw_filter_update(struct net *net, struct can_net *cn,
+				 struct net_device *dev)
+{
+	if (!hw_filter)
+		return;
+
+	spin_lock_bh(&can_hw_filter_lock);
+	rcu_read_lock();
+
+	if (dev)
+		can_hw_filter_dev(cn, dev);
+	else {
+		for_each_netdev_rcu(net, dev) {
+			if (dev->type == ARPHRD_CAN)
+				can_hw_filter_dev(cn, dev);
+		}
+	}
+
+	rcu_read_unlock();
+	spin_unlock_bh(&can_hw_filter_lock);
+}
+#else
+static inline void can_hw_filter_update(struct net *net, struct can_net *cn,
+					struct net_device *dev)
+{
+}
+#endif
+
+/**
+ * can_rx_register_bulk - subscribe a set of CAN filters at once
+ * @net: the applicable net namespace
+ * @dev: pointer to netdevice (NULL => subcribe from 'all' CAN devices list)
+ * @filter: array of CAN filters (see can_rx_register())
+ * @count: number of entries in the filter array
+ * @func: callback function on filter match
+ * @data: returned parameter for callback function
+ * @ident: string for calling module indentification
+ * @flags: delivery flags (see can_rx_register_flags())
+ *
+ * Description:
+ *  Works like calling can_rx_register_flags() for each filter. All
+ *  receivers are allocated before the receive lists are locked once to
+ *  insert them. Either all filters are subscribed or none of them.
+ *
+ * Return:
+ *  0 on success
+ *  -EINVAL on unknown flags or a negative count
+ *  -ENOMEM on missing cache mem to create subscription entries
+ *  -ENODEV unknown device
+ */
+int can_rx_register_bulk(struct net *net, struct net_device *dev,
+			 const struct can_filter *filter, int count,
+			 void (*func)(struct sk_buff *, void *),
+			 void *data, char *ident, unsigned int flags)
+{
+	return can_rx_replace_bulk(net, dev, NULL, 0, filter, count, func,
+				   data, ident, flags);
+}
+EXPORT_SYMBOL(can_rx_register_bulk);
+
+/*
+ * can_rx_delete_device - rcu callback for dev_rcv_lists structure removal
+ */
+static void can_rx_delete_device(struct rcu_head *rp)
+{
+	struct dev_rcv_lists *d = container_of(rp, struct dev_rcv_lists, rcu);
+
+	kfree(d->rx_tab[RX_FIL]);
+	kfree(d->rx_tab[RX_INV]);
+	kfree(d->rx_eff);
+	kfree(d);
+}
+
+/*
+ * can_rx_delete_receivers - rcu callback for the removal of receiver entries
+ *
+ * The receivers removed by one can_rx_unregister_bulk() call are chained
+ * with next_free and are freed after a single grace period.
+ */
+static void can_rx_delete_receivers(struct rcu_head *rp)
+{
+	can_rx_free_receivers(container_of(rp, struct receiver, rcu));
+}
+
+/**
+ * can_rx_unregister - unsubscribe CAN frames from a specific interface
+ * @net: the applicable net namespace
+ * @dev: pointer to netdevice (NULL => unsubcribe from 'all' CAN devices list)
+ * @can_id: CAN identifier
+ * @mask: CAN mask
+ * @func: callback function on filter match
+ * @data: returned parameter for callback function
+ *
+ * Description:
+ *  Removes subscription entry depending on given (subscription) values.
+ */
+void can_rx_unregister(struct net *net, struct net_device *dev,
+		       canid_t can_id, canid_t mask,
+		       void (*func)(struct sk_buff *, void *), void *data)
+{
+	struct can_filter filter;
+
+	filter.can_id = can_id;
+	filter.can_mask = mask;
+
+	can_rx_unregister_bulk(net, dev, &filter, 1, func, data);
+}
+EXPORT_SYMBOL(can_rx_unregister);
+
+/**
+ * can_rx_unregister_bulk - unsubscribe a set of CAN filters at once
+ * @net: the applicable net namespace
+ * @dev: pointer to netdevice (NULL => unsubcribe from 'all' CAN devices list)
+ * @filter: array of CAN filters given to can_rx_register_bulk()
+ * @count: number of entries in the filter array
+ * @func: callback function on filter match
+ * @data: returned parameter for callback function
+ *
+ * Description:
+ *  Removes the subscription entries of all filters under a single lock of
+ *  the receive lists. The entries are freed after one RCU grace period.
+ */
+void can_rx_unregister_bulk(struct net *net, struct net_device *dev,
+			    const struct can_filter *filter, int count,
+			    void (*func)(struct sk_buff *, void *),
+			    void *data)
+{
+	if (count > 0)
+		can_rx_replace_bulk(net, dev, filter, count, NULL, 0, func,
+				    data, NULL, 0);
+}
+EXPORT_SYMBOL(can_rx_unregister_bulk);
+
+/**
+ * can_rx_replace_bulk - swap a set of CAN filters for another one
+ * @net: the applicable net namespace
+ * @dev: pointer to netdevice (NULL => 'all' CAN devices list)
+ * @old_filter: array of CAN filters registered before
+ * @old_count: number of entries in the old filter array
+ * @new_filter: array of CAN filters to subscribe
+ * @new_count: number of entries in the new filter array
+ * @func: callback function on filter match (of both sets)
+ * @data: returned parameter for callback function (of both sets)
+ * @ident: string for calling module indentification
+ * @flags: delivery flags (see can_rx_register_flags())
+ *
+ * Description:
+ *  The rx path switches from the old to the new set in one step: the new
+ *  receivers are linked invisible to the current frames, the old ones are
+ *  retired, and a single store to the generation of the receive lists
+ *  makes the new set visible and the old one invisible. Each frame reads
+ *  the generation once, so a frame matching both sets is delivered
+ *  exactly once. The old receivers are unlinked after a grace period,
+ *  when no frame of an older generation is left. Therefore a replace of
+ *  existing filters has to be called in process context. When the new
+ *  receivers can not be allocated the old set stays active.
+ *
+ * Return:
+ *  0 on success
+ *  -EINVAL on unknown flags or a negative count
+ *  -ENOMEM on missing cache mem to create subscription entries
+ *  -ENODEV unknown device
+ */
+int can_rx_replace_bulk(struct net *net, struct net_device *dev,
+			const struct can_filter *old_filter, int old_count,
+			const struct can_filter *new_filter, int new_count,
+			void (*func)(struct sk_buff *, void *),
+			void *data, char *ident, unsigned int flags)
+{
+	struct can_net *cn = can_pernet(net);
+	struct receiver *r, *rcvs, *old_rcvs = NULL;
+	struct dev_rcv_lists *d, *unlinked = NULL;
+	int compile[RX_MAX] = { 0 };
+	unsigned int resize = 0;
+	unsigned int gen = 0;
+	int removed = 0;
+	int err;
+
+	/* replace receivers  (dev,canid,mask) -> (func,data) */
+
+	if (flags & ~(CAN_RX_OWN_SKB | CAN_RX_SK_FILTER))
+		return -EINVAL;
+
+	if (old_count < 0 || new_count < 0)
+		return -EINVAL;
+
+	err = can_rx_check_dev(net, dev);
+	if (err)
+		return err;
+
+	if (!old_count && !new_count)
+		return 0;
+
+	err = can_rx_alloc_receivers(&rcvs, new_count);
+	if (err)
+		return err;
+
+	rcu_read_lock();
+
+	d = can_lock_rcv_lists(cn, dev);
+	if (!d) {
+		rcu_read_unlock();
+		if (old_count)
+			printk(KERN_ERR "BUG: receive list not found for "
+			       "dev %s, id %03X, mask %03X\n",
+			       DNAME(dev), old_filter[0].can_id,
+			       old_filter[0].can_mask);
+		can_rx_free_receivers(rcvs);
+		return -ENODEV;
+	}
+
+	if (old_count && new_count) {
+		gen = d->gen + 1;
+		if (!gen)
+			gen = 1;
+
+		can_rx_retire_receivers(d, old_filter, old_count, func, data,
+					gen);
+	}
+
+	if (new_count)
+		resize = can_rx_link_receivers(d, rcvs, new_filter, new_count,
+					       func, data, ident, flags, gen,
+					       compile);
+
+	if (gen) {
+		can_rx_invalidate_lists(d, compile);
+
+		/* publish the new set and hide the old one */
+		smp_wmb();
+		WRITE_ONCE(d->gen, gen);
+
+		spin_unlock(&d->lock);
+		rcu_read_unlock();
+
+		/* no frame of an older generation is in the rx path anymore */
+		synchronize_rcu();
+
+		rcu_read_lock();
+
+		/* our receivers keep the structure from being unlinked */
+		d = can_lock_rcv_lists(cn, dev);
+		BUG_ON(!d);
+
+		for (r = rcvs; r; r = r->next_free)
+			r->gen_on = 0;
+	}
+
+	if (old_count)
+		old_rcvs = can_rx_unlink_receivers(d, dev, old_filter,
+						   old_count, func, data, gen,
+						   compile, &removed);
+
+	can_rx_invalidate_lists(d, compile);
 
 	/* remove device structure requested by NETDEV_UNREGISTER */
 	if (d->remove_on_zero_entries && !d->entries) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
-		dev->ml_priv = NULL;
+		can_unlink_rcv_lists(cn, d);
+		unlinked = d;
+	}
+
+	spin_unlock(&d->lock);
+	rcu_read_unlock();
+
+	can_rx_update_pstats(cn, new_count, removed);
+
+	/* schedule the receiver items for deletion */
+	if (old_rcvs)
+		call_rcu(&old_rcvs->rcu, can_rx_delete_receivers);
+
+	/* schedule the device structure for deletion */
+	if (unlinked)
+		call_rcu(&unlinked->rcu, can_rx_delete_device);
+	else {
+		if (resize)
+			can_eff_hash_resize(cn, dev);
+
+		can_rx_compile_lists(cn, dev, compile);
+		can_hw_filter_update(net, cn, dev);
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL(can_rx_replace_bulk);
+
+/*
+ * Call the callback of a receiver. With the module parameter rcv_time the
+ * time spent in the callback is accounted in the slot of its ident.
+ */
+static inline void can_rcv_call(struct sk_buff *skb, struct receiver *r)
+{
+#ifdef CAN_RCV_TIME
+	struct s_rcv_time *t;
+	u64 start, delta;
+#endif
+
+	trace_can_deliver(skb, r->data, r->ident, r->can_id, r->mask);
+
+#ifdef CAN_RCV_TIME
+	if (unlikely(rcv_time)) {
+		start = can_rcv_clock();
+		r->func(skb, r->data);
+		delta = can_rcv_clock() - start;
+
+		/* softirq context: no migration until the update is done */
+		t = &per_cpu(can_rcv_time, smp_processor_id()).slot[r->tslot];
+		t->calls++;
+		t->nsecs += delta;
+		if (delta > t->max_nsecs)
+			t->max_nsecs = delta;
+		return;
+	}
 #endif
-		hlist_del_rcu(&d->list);
+	r->func(skb, r->data);
+}
+
+/* hand out a private clone of skb to a CAN_RX_OWN_SKB receiver */
+static void deliver_clone(struct sk_buff *skb, struct receiver *r)
+{
+	struct sk_buff *nskb = skb_clone(skb, GFP_ATOMIC);
+
+	if (!nskb)
+		return;
+
+	/* keep the reference to the originating sock */
+	nskb->sk = skb->sk;
+	can_rcv_call(nskb, r);
+}
+
+/*
+ * Run the socket filter of a CAN_RX_SK_FILTER receiver on the (shared) skb.
+ * Only the verdict is used: the skb is not trimmed to the returned length.
+ * The caller holds rcu_read_lock() in softirq context.
+ */
+static inline int can_rx_sk_filter(struct receiver *r, struct sk_buff *skb)
+{
+	struct sock *sk = r->data;
+	struct sk_filter *filter = rcu_dereference(sk->sk_filter);
+
+	if (!filter)
+		return 1;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+	return bpf_prog_run_save_cb(filter->prog, skb) != 0;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,39)
+	return SK_RUN_FILTER(filter, skb) != 0;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+	return sk_run_filter(skb, filter->insns) != 0;
+#else
+	return sk_run_filter(skb, filter->insns, filter->len) != 0;
+#endif
+}
+
+/*
+ * Generation of the receive lists for one frame (see can_rx_replace_bulk())
+ */
+static inline unsigned int can_rx_gen(struct dev_rcv_lists *d)
+{
+	unsigned int gen = READ_ONCE(d->gen);
+
+	/* pairs with the smp_wmb() in can_rx_replace_bulk() */
+	smp_rmb();
+	return gen;
+}
+
+/* is r part of the receiver set of generation gen */
+static inline int can_rcv_visible(const struct receiver *r, unsigned int gen)
+{
+	if (likely(!r->gen_on && !r->gen_off))
+		return 1;
+
+	if (r->gen_on && (int)(gen - r->gen_on) < 0)
+		return 0;
+
+	return !r->gen_off || (int)(gen - r->gen_off) < 0;
+}
+
+/*
+ * Receivers that need a private skb are delivered one step delayed via
+ * *last. This allows to hand out the original skb to the last of them in
+ * can_receive() instead of creating one more clone and freeing the
+ * original afterwards.
+ *
+ * Returns 1 when the frame has been delivered to the receiver.
+ */
+static inline int deliver(struct sk_buff *skb, struct receiver *r,
+			  unsigned int gen, struct receiver **last)
+{
+	if (!can_rcv_visible(r, gen))
+		return 0;
+
+	/* frames rejected by the socket filter never get a clone */
+	if ((r->flags & CAN_RX_SK_FILTER) && !can_rx_sk_filter(r, skb))
+		return 0;
+
+	if (r->flags & CAN_RX_OWN_SKB) {
+		if (*last)
+			deliver_clone(skb, *last);
+		*last = r;
 	} else
-		d = NULL;
+		can_rcv_call(skb, r);
+#ifdef CAN_PCPU_MATCHES
+	this_cpu_inc(*r->matches);
+#else
+	r->matches++;
+#endif
+	return 1;
+}
 
- out:
-	spin_unlock(&can_rcvlists_lock);
+/* deliver to the matching receivers of a compiled RX_FIL/RX_INV table */
+static int can_rcv_compiled(struct can_filter_table *t, int inv,
+			    struct sk_buff *skb, canid_t can_id,
+			    unsigned int gen, struct receiver **last)
+{
+	struct can_filter_entry *e;
+	struct can_filter_group *g;
+	unsigned int lo, hi, mid, i;
+	int matches = 0;
+	canid_t id;
+
+	for (g = t->groups; g < t->groups + t->ngroups; g++) {
+		e = &t->entries[g->first];
+		id = can_id & g->mask;
+
+		/* find the first entry with a can_id >= id */
+		lo = 0;
+		hi = g->num;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (e[mid].can_id < id)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (!inv) {
+			for (i = lo; i < g->num && e[i].can_id == id; i++) {
+				matches += deliver(skb, e[i].r, gen, last);
+			}
+			continue;
+		}
 
-	/* schedule the receiver item for deletion */
-	if (r)
-		call_rcu(&r->rcu, can_rx_delete_receiver);
+		/* inverted filters: all entries except the equal ones match */
+		for (i = 0; i < g->num; i++) {
+			if (i == lo) {
+				while (i < g->num && e[i].can_id == id)
+					i++;
+				if (i == g->num)
+					break;
+			}
+			matches += deliver(skb, e[i].r, gen, last);
+		}
+	}
 
-	/* schedule the device structure for deletion */
-	if (d)
-		call_rcu(&d->rcu, can_rx_delete_device);
+	return matches;
 }
-EXPORT_SYMBOL(can_rx_unregister);
 
-static inline void deliver(struct sk_buff *skb, struct receiver *r)
+/* deliver to the receivers of the single SFF can_id (non-RTR) list */
+static inline int can_rcv_sff(struct dev_rcv_lists *d, struct sk_buff *skb,
+			      canid_t can_id, unsigned int gen,
+			      struct receiver **last)
 {
-	r->func(skb, r->data);
-	r->matches++;
+	struct receiver *r;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	struct hlist_node *n;
+#endif
+	int matches = 0;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	hlist_for_each_entry_rcu(r, n, &d->rx_sff[can_id & CAN_SFF_MASK], list) {
+#else
+	hlist_for_each_entry_rcu(r, &d->rx_sff[can_id & CAN_SFF_MASK], list) {
+#endif
+		matches += deliver(skb, r, gen, last);
+	}
+
+	return matches;
 }
 
-static int can_rcv_filter(struct dev_rcv_lists *d, struct sk_buff *skb)
+static int can_rcv_filter(struct dev_rcv_lists *d, struct sk_buff *skb,
+			  struct receiver **last)
 {
+	struct can_filter_table *t;
 	struct receiver *r;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
 	struct hlist_node *n;
@@ -731,10 +2113,13 @@ static int can_rcv_filter(struct dev_rcv_lists *d, struct sk_buff *skb)
 	int matches = 0;
 	struct can_frame *cf = (struct can_frame *)skb->data;
 	canid_t can_id = cf->can_id;
+	unsigned int gen;
 
 	if (d->entries == 0)
 		return 0;
 
+	gen = can_rx_gen(d);
+
 	if (can_id & CAN_ERR_FLAG) {
 		/* check for error frame entries only */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
@@ -743,8 +2128,7 @@ static int can_rcv_filter(struct dev_rcv_lists *d, struct sk_buff *skb)
 		hlist_for_each_entry_rcu(r, &d->rx[RX_ERR], list) {
 #endif
 			if (can_id & r->mask) {
-				deliver(skb, r);
-				matches++;
+				matches += deliver(skb, r, gen, last);
 			}
 		}
 		return matches;
@@ -756,31 +2140,38 @@ static int can_rcv_filter(struct dev_rcv_lists *d, struct sk_buff *skb)
 #else
 	hlist_for_each_entry_rcu(r, &d->rx[RX_ALL], list) {
 #endif
-		deliver(skb, r);
-		matches++;
+		matches += deliver(skb, r, gen, last);
 	}
 
 	/* check for can_id/mask entries */
+	t = rcu_dereference(d->rx_tab[RX_FIL]);
+	if (t)
+		matches += can_rcv_compiled(t, 0, skb, can_id, gen, last);
+	else {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-	hlist_for_each_entry_rcu(r, n, &d->rx[RX_FIL], list) {
+		hlist_for_each_entry_rcu(r, n, &d->rx[RX_FIL], list) {
 #else
-	hlist_for_each_entry_rcu(r, &d->rx[RX_FIL], list) {
+		hlist_for_each_entry_rcu(r, &d->rx[RX_FIL], list) {
 #endif
-		if ((can_id & r->mask) == r->can_id) {
-			deliver(skb, r);
-			matches++;
+			if ((can_id & r->mask) == r->can_id) {
+				matches += deliver(skb, r, gen, last);
+			}
 		}
 	}
 
 	/* check for inverted can_id/mask entries */
+	t = rcu_dereference(d->rx_tab[RX_INV]);
+	if (t)
+		matches += can_rcv_compiled(t, 1, skb, can_id, gen, last);
+	else {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-	hlist_for_each_entry_rcu(r, n, &d->rx[RX_INV], list) {
+		hlist_for_each_entry_rcu(r, n, &d->rx[RX_INV], list) {
 #else
-	hlist_for_each_entry_rcu(r, &d->rx[RX_INV], list) {
+		hlist_for_each_entry_rcu(r, &d->rx[RX_INV], list) {
 #endif
-		if ((can_id & r->mask) != r->can_id) {
-			deliver(skb, r);
-			matches++;
+			if ((can_id & r->mask) != r->can_id) {
+				matches += deliver(skb, r, gen, last);
+			}
 		}
 	}
 
@@ -789,29 +2180,184 @@ static int can_rcv_filter(struct dev_rcv_lists *d, struct sk_buff *skb)
 		return matches;
 
 	if (can_id & CAN_EFF_FLAG) {
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-		hlist_for_each_entry_rcu(r, n, &d->rx[RX_EFF], list) {
-#else
-		hlist_for_each_entry_rcu(r, &d->rx[RX_EFF], list) {
-#endif
+		struct can_eff_hash *h = rcu_dereference(d->rx_eff);
+		struct hlist_node *pos;
+
+		if (!d->eff_entries)
+			return matches;
+
+		can_eff_for_each_rcu(r, pos, h, can_eff_head(h, can_id)) {
 			if (r->can_id == can_id) {
-				deliver(skb, r);
-				matches++;
+				matches += deliver(skb, r, gen, last);
 			}
 		}
-	} else {
-		can_id &= CAN_SFF_MASK;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-		hlist_for_each_entry_rcu(r, n, &d->rx_sff[can_id], list) {
-#else
-		hlist_for_each_entry_rcu(r, &d->rx_sff[can_id], list) {
-#endif
-			deliver(skb, r);
-			matches++;
+	} else
+		matches += can_rcv_sff(d, skb, can_id, gen, last);
+
+	return matches;
+}
+
+/*
+ * Early demux: when all receivers of the device subscribed single SFF
+ * can_ids and nobody listens on all devices, a SFF data frame only has to
+ * look at the list of its can_id. Usually this list holds one receiver.
+ */
+static inline int can_rcv_sff_only(struct dev_rcv_lists *alldev,
+				   struct dev_rcv_lists *d, canid_t can_id)
+{
+	if (can_id & (CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_ERR_FLAG))
+		return 0;
+
+	return !alldev->entries && d->entries == d->sff_entries;
+}
+
+/*
+ * The caller holds rcu_read_lock() from can_rx_batch_begin() until
+ * can_rx_batch_end(): the sockets of the deferred wakeups are not released
+ * before.
+ */
+static inline void can_rx_batch_begin(void)
+{
+	per_cpu(can_rx_batch, smp_processor_id()).depth++;
+}
+
+static void can_rx_batch_end(void)
+{
+	struct can_rx_batch *b = &per_cpu(can_rx_batch, smp_processor_id());
+	unsigned int i;
+
+	if (--b->depth)
+		return;
+
+	for (i = 0; i < b->num; i++)
+		b->ent[i].wake(b->ent[i].sk);
+
+	b->num = 0;
+}
+
+/**
+ * can_rx_defer_wakeup - wake up a socket at the end of the rx batch
+ * @sk: socket with newly queued data
+ * @wake: function to wake up the reader, called once per batch
+ *
+ * Description:
+ *  To be called by receiver callbacks (usually from the sk_data_ready()
+ *  of the socket) instead of waking up the reader for every frame.
+ *
+ * Return:
+ *  1 when the wakeup is deferred
+ *  0 outside of an rx batch or without space: the caller wakes up sk itself
+ */
+int can_rx_defer_wakeup(struct sock *sk, void (*wake)(struct sock *sk))
+{
+	struct can_rx_batch *b;
+	unsigned int i;
+
+	/* hrtimer callbacks may interrupt the rx batch of this CPU */
+	if (in_irq() || !in_softirq())
+		return 0;
+
+	b = &per_cpu(can_rx_batch, smp_processor_id());
+	if (!b->depth)
+		return 0;
+
+	for (i = 0; i < b->num; i++) {
+		if (b->ent[i].sk == sk)
+			return 1;
+	}
+
+	if (b->num == CAN_RX_WAKE_MAX)
+		return 0;
+
+	b->ent[b->num].sk = sk;
+	b->ent[b->num].wake = wake;
+	b->num++;
+
+	return 1;
+}
+EXPORT_SYMBOL(can_rx_defer_wakeup);
+
+/**
+ * can_rx_batch_open - start an rx batch for the following frames
+ *
+ * Description:
+ *  The frames passed up on this CPU until can_rx_batch_close() form one
+ *  rx batch, e.g. the frames of a NAPI poll on kernels without
+ *  netif_receive_skb_list(). To be called in softirq context.
+ */
+void can_rx_batch_open(void)
+{
+	rcu_read_lock();
+	can_rx_batch_begin();
+}
+EXPORT_SYMBOL(can_rx_batch_open);
+
+/**
+ * can_rx_batch_close - end the rx batch and do the deferred wakeups
+ */
+void can_rx_batch_close(void)
+{
+	can_rx_batch_end();
+	rcu_read_unlock();
+}
+EXPORT_SYMBOL(can_rx_batch_close);
+
+static void can_receive(struct sk_buff *skb, struct net_device *dev)
+{
+	struct can_net *cn = can_pernet(dev_net(dev));
+	struct can_frame *cf = (struct can_frame *)skb->data;
+	struct dev_rcv_lists *d;
+	struct receiver *last = NULL;
+	int matches;
+
+	trace_can_rx(skb, dev->ifindex);
+
+	/* update statistics */
+	can_pcpu_stats_inc(cn, rx_frames);
+
+	rcu_read_lock();
+	can_rx_batch_begin();
+
+	/* find receive list for this device */
+	d = find_dev_rcv_lists(cn, dev);
+
+	if (d && can_rcv_sff_only(cn->rx_alldev_list, d, cf->can_id))
+		matches = can_rcv_sff(d, skb, cf->can_id, can_rx_gen(d),
+				      &last);
+	else {
+		/* deliver the packet to sockets listening on all devices */
+		matches = can_rcv_filter(cn->rx_alldev_list, skb, &last);
+
+		if (d)
+			matches += can_rcv_filter(d, skb, &last);
+	}
+
+	/*
+	 * The last receiver that needs a private skb gets the original one,
+	 * when nobody else holds a reference or an owner to it.
+	 */
+	if (last) {
+		if (skb_shared(skb) || skb->destructor)
+			deliver_clone(skb, last);
+		else {
+			can_rcv_call(skb, last);
+			skb = NULL;
 		}
 	}
 
-	return matches;
+	can_rx_batch_end();
+	rcu_read_unlock();
+
+	/* consume the skbuff allocated by the netdevice driver */
+	if (skb)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+		consume_skb(skb);
+#else
+		kfree_skb(skb);
+#endif
+
+	if (matches > 0)
+		can_pcpu_stats_inc(cn, matches);
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,14)
@@ -822,10 +2368,9 @@ static int can_rcv(struct sk_buff *skb, struct net_device *dev,
 		   struct packet_type *pt)
 #endif
 {
-	struct dev_rcv_lists *d;
-	struct can_frame *cf = (struct can_frame *)skb->data;
-	int matches;
+	struct canfd_frame *cfd = (struct canfd_frame *)skb->data;
 
+#ifndef CAN_NETNS
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
 	if (!net_eq(dev_net(dev), &init_net))
 		goto drop;
@@ -833,58 +2378,92 @@ static int can_rcv(struct sk_buff *skb, struct net_device *dev,
 	if (dev->nd_net != &init_net)
 		goto drop;
 #endif
+#endif
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
 	if (WARN_ONCE(dev->type != ARPHRD_CAN ||
-		      skb->len != sizeof(struct can_frame) ||
-		      cf->can_dlc > 8,
-		      "PF_CAN: dropped non conform skbuf: "
-		      "dev type %d, len %d, can_dlc %d\n",
-		      dev->type, skb->len, cf->can_dlc))
+		      skb->len != CAN_MTU ||
+		      cfd->len > CAN_MAX_DLEN,
+		      "PF_CAN: dropped non conform CAN skbuf: "
+		      "dev type %d, len %d, datalen %d\n",
+		      dev->type, skb->len, cfd->len))
 		goto drop;
 #else
 	BUG_ON(dev->type != ARPHRD_CAN ||
-	       skb->len != sizeof(struct can_frame) ||
-	       cf->can_dlc > 8);
+	       skb->len != CAN_MTU ||
+	       cfd->len > CAN_MAX_DLEN);
 #endif
 
-	/* update statistics */
-	can_stats.rx_frames++;
-	can_stats.rx_frames_delta++;
-
-	rcu_read_lock();
-
-	/* deliver the packet to sockets listening on all devices */
-	matches = can_rcv_filter(&can_rx_alldev_list, skb);
-
-	/* find receive list for this device */
-	d = find_dev_rcv_lists(dev);
-	if (d)
-		matches += can_rcv_filter(d, skb);
+	can_receive(skb, dev);
+	return NET_RX_SUCCESS;
 
-	rcu_read_unlock();
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+drop:
+	kfree_skb(skb);
+	return NET_RX_DROP;
+#endif
+}
 
-	/* consume the skbuff allocated by the netdevice driver */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
-	consume_skb(skb);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,14)
+static int canfd_rcv(struct sk_buff *skb, struct net_device *dev,
+		     struct packet_type *pt, struct net_device *orig_dev)
 #else
-	kfree_skb(skb);
+static int canfd_rcv(struct sk_buff *skb, struct net_device *dev,
+		     struct packet_type *pt)
 #endif
+{
+	struct canfd_frame *cfd = (struct canfd_frame *)skb->data;
 
-	if (matches > 0) {
-		can_stats.matches++;
-		can_stats.matches_delta++;
-	}
+#ifndef CAN_NETNS
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+	if (!net_eq(dev_net(dev), &init_net))
+		goto drop;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+	if (dev->nd_net != &init_net)
+		goto drop;
+#endif
+#endif
+
+	/* unlike classic CAN frames a broken CAN FD frame is no kernel bug */
+	if (unlikely(dev->type != ARPHRD_CAN ||
+		     skb->len != CANFD_MTU ||
+		     cfd->len > CANFD_MAX_DLEN))
+		goto drop;
 
+	can_receive(skb, dev);
 	return NET_RX_SUCCESS;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
 drop:
 	kfree_skb(skb);
 	return NET_RX_DROP;
-#endif
 }
 
+#ifdef CAN_RX_LIST
+/*
+ * A list of frames from netif_receive_skb_list() is one rx batch: each
+ * socket is woken up once for all its frames of the list.
+ */
+static void can_rcv_list(struct list_head *head, struct packet_type *pt,
+			 struct net_device *orig_dev)
+{
+	struct sk_buff *skb, *next;
+
+	can_rx_batch_open();
+
+	list_for_each_entry_safe(skb, next, head, list) {
+		/* skb_list_del_init() */
+		__list_del_entry(&skb->list);
+		skb->next = NULL;
+		if (pt->type == htons(ETH_P_CANFD))
+			canfd_rcv(skb, skb->dev, pt, orig_dev);
+		else
+			can_rcv(skb, skb->dev, pt, orig_dev);
+	}
+
+	can_rx_batch_close();
+}
+#endif
+
 /*
  * af_can protocol functions
  */
@@ -964,19 +2543,24 @@ static int can_notifier(struct notifier_block *nb, unsigned long msg,
 			void *data)
 {
 	struct net_device *dev = (struct net_device *)data;
+	struct can_net *cn;
 	struct dev_rcv_lists *d;
 
+#ifndef CAN_NETNS
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
 	if (!net_eq(dev_net(dev), &init_net))
 		return NOTIFY_DONE;
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
 	if (dev->nd_net != &init_net)
 		return NOTIFY_DONE;
+#endif
 #endif
 
 	if (dev->type != ARPHRD_CAN)
 		return NOTIFY_DONE;
 
+	cn = can_pernet(dev_net(dev));
+
 	switch (msg) {
 
 	case NETDEV_REGISTER:
@@ -991,42 +2575,59 @@ static int can_notifier(struct notifier_block *nb, unsigned long msg,
 		 */
 
 		d = kzalloc(sizeof(*d), GFP_KERNEL);
+		if (d) {
+			d->rx_eff = can_eff_hash_alloc(CAN_EFF_HASH_MIN_BITS,
+						       GFP_KERNEL);
+			if (!d->rx_eff) {
+				kfree(d);
+				d = NULL;
+			}
+		}
 		if (!d) {
 			printk(KERN_ERR
 			       "can: allocation of receive list failed\n");
 			return NOTIFY_DONE;
 		}
 		d->dev = dev;
+		spin_lock_init(&d->lock);
 
-		spin_lock(&can_rcvlists_lock);
+		spin_lock(&cn->rcvlists_lock);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
 		BUG_ON(dev->ml_priv);
 		dev->ml_priv = d;
 #endif
-		hlist_add_head_rcu(&d->list, &can_rx_dev_list);
-		spin_unlock(&can_rcvlists_lock);
+		hlist_add_head_rcu(&d->list, &cn->rx_dev_list);
+		spin_unlock(&cn->rcvlists_lock);
+
+		/* receivers of the 'all' CAN devices list may exist already */
+		can_hw_filter_update(dev_net(dev), cn, dev);
+
+		break;
+
+	case NETDEV_UP:
+		/* promiscuous mode is only evaluated here (no notification) */
+		can_hw_filter_update(dev_net(dev), cn, dev);
 
 		break;
 
 	case NETDEV_UNREGISTER:
-		spin_lock(&can_rcvlists_lock);
+		rcu_read_lock();
 
-		d = find_dev_rcv_lists(dev);
+		d = can_lock_rcv_lists(cn, dev);
 		if (d) {
 			if (d->entries) {
 				d->remove_on_zero_entries = 1;
+				spin_unlock(&d->lock);
 				d = NULL;
 			} else {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
-				dev->ml_priv = NULL;
-#endif
-				hlist_del_rcu(&d->list);
+				can_unlink_rcv_lists(cn, d);
+				spin_unlock(&d->lock);
 			}
 		} else
 			printk(KERN_ERR "can: notifier: receive list not "
 			       "found for dev %s\n", dev->name);
 
-		spin_unlock(&can_rcvlists_lock);
+		rcu_read_unlock();
 
 		if (d)
 			call_rcu(&d->rcu, can_rx_delete_device);
@@ -1037,6 +2638,108 @@ static int can_notifier(struct notifier_block *nb, unsigned long msg,
 	return NOTIFY_DONE;
 }
 
+/*
+ * af_can per network namespace init/exit functions
+ */
+
+static int can_net_setup(struct can_net *cn)
+{
+	/*
+	 * Insert rx_alldev_list for reception on all devices.
+	 * This struct is zero initialized which is correct for the
+	 * embedded hlist heads, the dev pointer, and the entries counter.
+	 */
+	cn->rx_alldev_list = kzalloc(sizeof(*cn->rx_alldev_list), GFP_KERNEL);
+	if (!cn->rx_alldev_list)
+		goto out;
+
+	cn->rx_alldev_list->rx_eff = can_eff_hash_alloc(CAN_EFF_HASH_MIN_BITS,
+							GFP_KERNEL);
+	if (!cn->rx_alldev_list->rx_eff)
+		goto out_alldev;
+
+	cn->pcpu_stats = alloc_percpu(struct s_pcpu_stats);
+	if (!cn->pcpu_stats)
+		goto out_eff;
+
+	spin_lock_init(&cn->rx_alldev_list->lock);
+	spin_lock_init(&cn->rcvlists_lock);
+	INIT_HLIST_HEAD(&cn->rx_dev_list);
+	hlist_add_head_rcu(&cn->rx_alldev_list->list, &cn->rx_dev_list);
+
+	can_init_stats_net(cn);
+	can_init_proc(cn);
+
+	return 0;
+
+ out_eff:
+	kfree(cn->rx_alldev_list->rx_eff);
+ out_alldev:
+	kfree(cn->rx_alldev_list);
+ out:
+	return -ENOMEM;
+}
+
+static void can_net_cleanup(struct can_net *cn)
+{
+	struct dev_rcv_lists *d;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	struct hlist_node *n;
+#endif
+	struct hlist_node *next;
+
+	can_remove_proc(cn);
+
+	/* remove rx_dev_list */
+	spin_lock(&cn->rcvlists_lock);
+	hlist_del(&cn->rx_alldev_list->list);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	hlist_for_each_entry_safe(d, n, next, &cn->rx_dev_list, list) {
+#else
+	hlist_for_each_entry_safe(d, next, &cn->rx_dev_list, list) {
+#endif
+		hlist_del(&d->list);
+		BUG_ON(d->entries);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+		d->dev->ml_priv = NULL;
+#endif
+		kfree(d->rx_tab[RX_FIL]);
+		kfree(d->rx_tab[RX_INV]);
+		kfree(d->rx_eff);
+		kfree(d);
+	}
+	spin_unlock(&cn->rcvlists_lock);
+
+	kfree(cn->rx_alldev_list->rx_tab[RX_FIL]);
+	kfree(cn->rx_alldev_list->rx_tab[RX_INV]);
+	kfree(cn->rx_alldev_list->rx_eff);
+	kfree(cn->rx_alldev_list);
+	free_percpu(cn->pcpu_stats);
+}
+
+#ifdef CAN_NETNS
+static int __net_init can_pernet_init(struct net *net)
+{
+	struct can_net *cn = can_pernet(net);
+
+	cn->net = net;
+
+	return can_net_setup(cn);
+}
+
+static void __net_exit can_pernet_exit(struct net *net)
+{
+	can_net_cleanup(can_pernet(net));
+}
+
+static struct pernet_operations can_pernet_ops __read_mostly = {
+	.init = can_pernet_init,
+	.exit = can_pernet_exit,
+	.id   = &can_net_id,
+	.size = sizeof(struct can_net),
+};
+#endif
+
 /*
  * af_can module init/exit functions
  */
@@ -1049,6 +2752,22 @@ static struct packet_type can_packet __read_mostly = {
 #endif
 	.dev  = NULL,
 	.func = can_rcv,
+#ifdef CAN_RX_LIST
+	.list_func = can_rcv_list,
+#endif
+};
+
+static struct packet_type canfd_packet __read_mostly = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+	.type = cpu_to_be16(ETH_P_CANFD),
+#else
+	.type = __constant_htons(ETH_P_CANFD),
+#endif
+	.dev  = NULL,
+	.func = canfd_rcv,
+#ifdef CAN_RX_LIST
+	.list_func = can_rcv_list,
+#endif
 };
 
 static struct net_proto_family can_family_ops __read_mostly = {
@@ -1064,79 +2783,59 @@ static struct notifier_block can_netdev_notifier __read_mostly = {
 
 static __init int can_init(void)
 {
+	int err;
+
 	printk(banner);
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,23)
 	rcv_cache = kmem_cache_create("can_receiver", sizeof(struct receiver),
-				      0, 0, NULL);
+				      0, SLAB_HWCACHE_ALIGN, NULL);
 #else
 	rcv_cache = kmem_cache_create("can_receiver", sizeof(struct receiver),
-				      0, 0, NULL, NULL);
+				      0, SLAB_HWCACHE_ALIGN, NULL, NULL);
 #endif
 	if (!rcv_cache)
 		return -ENOMEM;
 
-	/*
-	 * Insert can_rx_alldev_list for reception on all devices.
-	 * This struct is zero initialized which is correct for the
-	 * embedded hlist heads, the dev pointer, and the entries counter.
-	 */
-
-	spin_lock(&can_rcvlists_lock);
-	hlist_add_head_rcu(&can_rx_alldev_list.list, &can_rx_dev_list);
-	spin_unlock(&can_rcvlists_lock);
-
-	if (stats_timer) {
-		/* the statistics are updated every second (timer triggered) */
-		setup_timer(&can_stattimer, can_stat_update, 0);
-		mod_timer(&can_stattimer, round_jiffies(jiffies + HZ));
-	} else
-		can_stattimer.function = NULL;
-
-	can_init_proc();
+#ifdef CAN_NETNS
+	err = register_pernet_subsys(&can_pernet_ops);
+#else
+	err = can_net_setup(&can_init_pernet);
+#endif
+	if (err) {
+		kmem_cache_destroy(rcv_cache);
+		return err;
+	}
 
 	/* protocol register */
 	sock_register(&can_family_ops);
 	register_netdevice_notifier(&can_netdev_notifier);
 	dev_add_pack(&can_packet);
+	dev_add_pack(&canfd_packet);
+
+	/* the procfs entries stay available without the netlink interface */
+	if (can_stats_genl_register())
+		printk(KERN_INFO "can: failed to register the generic netlink "
+		       "family " CAN_STATS_GENL_NAME "\n");
 
 	return 0;
 }
 
 static __exit void can_exit(void)
 {
-	struct dev_rcv_lists *d;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-	struct hlist_node *n;
-#endif
-	struct hlist_node *next;
-
-	if (stats_timer)
-		del_timer(&can_stattimer);
-
-	can_remove_proc();
+	can_stats_genl_unregister();
 
 	/* protocol unregister */
+	dev_remove_pack(&canfd_packet);
 	dev_remove_pack(&can_packet);
 	unregister_netdevice_notifier(&can_netdev_notifier);
 	sock_unregister(PF_CAN);
 
-	/* remove can_rx_dev_list */
-	spin_lock(&can_rcvlists_lock);
-	hlist_del(&can_rx_alldev_list.list);
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-	hlist_for_each_entry_safe(d, n, next, &can_rx_dev_list, list) {
+#ifdef CAN_NETNS
+	unregister_pernet_subsys(&can_pernet_ops);
 #else
-	hlist_for_each_entry_safe(d, next, &can_rx_dev_list, list) {
-#endif
-		hlist_del(&d->list);
-		BUG_ON(d->entries);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
-		d->dev->ml_priv = NULL;
+	can_net_cleanup(&can_init_pernet);
 #endif
-		kfree(d);
-	}
-	spin_unlock(&can_rcvlists_lock);
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,15)
 	rcu_barrier(); /* Wait for completion of call_rcu()'s */
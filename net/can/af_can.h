@@ -44,35 +44,159 @@
 #ifndef AF_CAN_H
 #define AF_CAN_H
 
+#include <linux/version.h>
 #include <linux/skbuff.h>
 #include <linux/netdevice.h>
 #include <linux/list.h>
 #include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33)
+#include <net/netns/generic.h>
+#endif
 #include <socketcan/can.h>
 
 /* af_can rx dispatcher structures */
 
+/*
+ * The per-receiver match counter is written for each delivered frame.
+ * To prevent cacheline bouncing with the read-mostly filter data (walked
+ * by all CPUs in the rx path) it is a per-CPU counter when free_percpu()
+ * can be called from the rcu callback. Otherwise it gets a cacheline of
+ * its own. The receivers are allocated cacheline aligned (rcv_cache).
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+#define CAN_PCPU_MATCHES
+#endif
+
+/*
+ * Optional accounting of the time spent in the receiver callbacks (module
+ * parameter rcv_time). The receivers of an ident share a slot, the last
+ * slot collects the idents that did not get a slot of their own.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+#define CAN_RCV_TIME
+#define CAN_RCV_TIME_SLOTS 16
+#define CAN_RCV_TIME_IDLEN 16
+#endif
+
 struct receiver {
+	/* read-mostly data for the rx path */
 	struct hlist_node list;
-	struct rcu_head rcu;
+	struct hlist_node eff_list; /* alternate RX_EFF hash linkage */
 	canid_t can_id;
 	canid_t mask;
-	unsigned long matches;
 	void (*func)(struct sk_buff *, void *);
 	void *data;
 	char *ident;
+	unsigned int flags;
+	/* generations of a pending can_rx_replace_bulk() (0 => none) */
+	unsigned int gen_on;
+	unsigned int gen_off;
+#ifdef CAN_RCV_TIME
+	unsigned int tslot;
+#endif
+#ifdef CAN_PCPU_MATCHES
+	unsigned long __percpu *matches;
+#endif
+	struct rcu_head rcu;
+	struct receiver *next_free; /* bulk allocation and removal */
+#ifndef CAN_PCPU_MATCHES
+	unsigned long matches ____cacheline_aligned_in_smp;
+#endif
 };
 
+static inline unsigned long can_rcv_matches(struct receiver *r)
+{
+#ifdef CAN_PCPU_MATCHES
+	unsigned long sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += *per_cpu_ptr(r->matches, cpu);
+
+	return sum;
+#else
+	return r->matches;
+#endif
+}
+
 enum { RX_ERR, RX_ALL, RX_FIL, RX_INV, RX_EFF, RX_MAX };
 
+/*
+ * Hash table for the subscriptions of single non-RTR EFF can_ids (RX_EFF).
+ * The table grows and shrinks with the number of entries. To keep the
+ * receive path lockless while the entries are moved into a resized table
+ * each receiver has two hlist nodes and every table generation uses the
+ * other one (selected by 'alt').
+ */
+struct can_eff_hash {
+	unsigned int bits;
+	int alt;
+	struct hlist_head bucket[0];
+};
+
+#define CAN_EFF_HASH_MIN_BITS 4
+#define CAN_EFF_HASH_MAX_BITS 12
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,34)
+#define rcu_dereference_raw(p) rcu_dereference(p)
+#endif
+
+static inline struct receiver *can_eff_receiver(struct can_eff_hash *h,
+						struct hlist_node *n)
+{
+	if (h->alt)
+		return hlist_entry(n, struct receiver, eff_list);
+
+	return hlist_entry(n, struct receiver, list);
+}
+
+/* iterate over the receivers in a bucket of the RX_EFF hash table */
+#define can_eff_for_each_rcu(r, n, h, head)				\
+	for (n = rcu_dereference_raw((head)->first);			\
+	     n && ({ r = can_eff_receiver(h, n); 1; });			\
+	     n = rcu_dereference_raw(n->next))
+
+/*
+ * Compiled representation of the RX_FIL and RX_INV can_id/mask receivers.
+ * The entries are grouped by their mask and sorted by their can_id within
+ * each group. Built on every list change (see can_filter_compile()).
+ */
+struct can_filter_entry {
+	canid_t mask;
+	canid_t can_id;
+	struct receiver *r;
+};
+
+struct can_filter_group {
+	canid_t mask;
+	unsigned int first;
+	unsigned int num;
+};
+
+struct can_filter_table {
+	struct rcu_head rcu;
+	unsigned int ngroups;
+	struct can_filter_group *groups;
+	struct can_filter_entry entries[0];
+};
+
 struct dev_rcv_lists {
 	struct hlist_node list;
 	struct rcu_head rcu;
 	struct net_device *dev;
-	struct hlist_head rx[RX_MAX];
+	spinlock_t lock; /* protects the receive lists of this device */
+	struct hlist_head rx[RX_MAX]; /* rx[RX_EFF] unused => rx_eff */
 	struct hlist_head rx_sff[0x800];
+	struct can_eff_hash *rx_eff;
+	int eff_entries;
+	struct can_filter_table *rx_tab[RX_MAX]; /* RX_FIL/RX_INV only */
+	unsigned int rx_tab_seq[RX_MAX]; /* changes of the compiled lists */
 	int remove_on_zero_entries;
 	int entries;
+	int sff_entries; /* entries in the rx_sff lists */
+	unsigned int gen; /* switches the sets of can_rx_replace_bulk() */
 };
 
 /* statistic structures */
@@ -102,6 +226,39 @@ struct s_stats {
 	unsigned long matches_delta;
 };
 
+/*
+ * Frame counters of the hot rx/tx paths. They are only incremented on the
+ * local CPU and are folded into struct s_stats by stats.c.
+ */
+struct s_pcpu_stats {
+	unsigned long rx_frames;
+	unsigned long tx_frames;
+	unsigned long matches;
+};
+
+#ifndef __percpu
+#define __percpu
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33)
+#define can_pcpu_stats_inc(cn, field) this_cpu_inc((cn)->pcpu_stats->field)
+#else
+#define can_pcpu_stats_inc(cn, field)					\
+	do {								\
+		per_cpu_ptr((cn)->pcpu_stats, get_cpu())->field++;	\
+		put_cpu();						\
+	} while (0)
+#endif
+
+#ifdef CAN_RCV_TIME
+/* callback time accounting of a receiver ident slot */
+struct s_rcv_time {
+	unsigned long calls;
+	u64 nsecs;
+	u64 max_nsecs;
+};
+#endif
+
 /* persistent statistics */
 struct s_pstats {
 	unsigned long stats_reset;
@@ -110,15 +267,109 @@ struct s_pstats {
 	unsigned long rcv_entries_max;
 };
 
+/*
+ * Network namespaces get their own receive lists, statistics and procfs
+ * entries when the per namespace data can be allocated by the pernet
+ * subsystem. Older kernels only have the single can_net of init_net.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33)
+#define CAN_NETNS
+#endif
+
+/* generic netlink access to the statistics and receive lists (stats.c) */
+#ifdef CAN_NETNS
+#define CAN_STATS_GENL
+#endif
+
+struct can_net;
+
+/* procfs data of the rcvlist_* entries (proc.c) */
+struct can_proc_rcvlist {
+	struct can_net *cn;
+	int idx;
+};
+
+/* per network namespace data of the CAN core */
+struct can_net {
+#ifdef CAN_NETNS
+	struct net *net;
+#endif
+	struct dev_rcv_lists *rx_alldev_list; /* reception on all devices */
+	struct hlist_head rx_dev_list;        /* rx dispatcher structures */
+	spinlock_t rcvlists_lock;             /* rx_dev_list and pstats */
+
+	struct mutex stats_lock;              /* stats, stats_base/last */
+	struct s_stats stats;                 /* packet statistics */
+	struct s_pstats pstats;               /* receive list statistics */
+	struct s_pcpu_stats __percpu *pcpu_stats; /* hot counters */
+
+	/* sums of the per-CPU counters at the last reset and the last update */
+	struct s_pcpu_stats stats_base;
+	struct s_pcpu_stats stats_last;
+	unsigned long stats_jiffies;          /* time of stats_last */
+
+	/* procfs entries (proc.c) */
+	struct proc_dir_entry *proc_dir;
+	struct proc_dir_entry *pde_version;
+	struct proc_dir_entry *pde_stats;
+	struct proc_dir_entry *pde_reset_stats;
+	struct proc_dir_entry *pde_rcvlist_all;
+	struct proc_dir_entry *pde_rcvlist_fil;
+	struct proc_dir_entry *pde_rcvlist_inv;
+	struct proc_dir_entry *pde_rcvlist_sff;
+	struct proc_dir_entry *pde_rcvlist_eff;
+	struct proc_dir_entry *pde_rcvlist_err;
+#ifdef CAN_RCV_TIME
+	struct proc_dir_entry *pde_rcvtime;
+#endif
+#ifdef CAN_BUS_LOAD
+	struct proc_dir_entry *pde_busload;
+#endif
+	struct can_proc_rcvlist proc_rcvlist[RX_MAX];
+};
+
+#ifdef CAN_NETNS
+extern int can_net_id;
+
+static inline struct can_net *can_pernet(struct net *net)
+{
+	return net_generic(net, can_net_id);
+}
+#else
+extern struct can_net can_init_pernet;
+
+static inline struct can_net *can_pernet(struct net *net)
+{
+	return &can_init_pernet;
+}
+#endif
+
 /* function prototypes for the CAN networklayer procfs (proc.c) */
-extern void can_init_proc(void);
-extern void can_remove_proc(void);
-extern void can_stat_update(unsigned long data);
-
-/* structures and variables from af_can.c needed in proc.c for reading */
-extern struct timer_list can_stattimer;    /* timer for statistics update */
-extern struct s_stats    can_stats;        /* packet statistics */
-extern struct s_pstats   can_pstats;       /* receive list statistics */
-extern struct hlist_head can_rx_dev_list;  /* rx dispatcher structures */
+extern void can_init_proc(struct can_net *cn);
+extern void can_remove_proc(struct can_net *cn);
+
+/* function prototypes for the CAN core statistics (stats.c) */
+extern void can_init_stats_net(struct can_net *cn);
+extern int can_get_stats(struct can_net *cn, struct s_stats *stats);
+extern unsigned long can_reset_stats(struct can_net *cn);
+#ifdef CAN_STATS_GENL
+extern int can_stats_genl_register(void);
+extern void can_stats_genl_unregister(void);
+#else
+static inline int can_stats_genl_register(void)
+{
+	return 0;
+}
+
+static inline void can_stats_genl_unregister(void)
+{
+}
+#endif
+
+#ifdef CAN_RCV_TIME
+/* callback time accounting (af_can.c) for the procfs */
+extern int can_rcv_time_enabled(void);
+extern int can_get_rcv_time(int slot, char *ident, struct s_rcv_time *sum);
+#endif
 
 #endif /* AF_CAN_H */
@@ -0,0 +1,130 @@
+/*
+ * af_can_trace.h - tracepoints of the PF_CAN core dispatch path
+ *
+ * The events are available in /sys/kernel/debug/tracing/events/can
+ * (ftrace, perf, trace-cmd). can_rx marks the ingress of a frame in
+ * can_rcv(), can_deliver each call of a receiver callback and can_send the
+ * hand over of a frame to the netdevice. The 'ident' of can_deliver names
+ * the protocol that registered the receiver ("raw", "bcm", "isotp", ...).
+ *
+ * $Id$
+ *
+ * Send feedback to <socketcan-users@lists.berlios.de>
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM can
+
+#if !defined(_AF_CAN_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AF_CAN_TRACE_H
+
+#include <linux/version.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
+
+#include <linux/tracepoint.h>
+
+/* a CAN frame has been received by the PF_CAN core */
+TRACE_EVENT(can_rx,
+
+	TP_PROTO(const struct sk_buff *skb, int ifindex),
+
+	TP_ARGS(skb, ifindex),
+
+	TP_STRUCT__entry(
+		__field(const void *,	skb)
+		__field(int,		ifindex)
+		__field(canid_t,	can_id)
+		__field(u8,		len)
+	),
+
+	TP_fast_assign(
+		__entry->skb	 = skb;
+		__entry->ifindex = ifindex;
+		__entry->can_id	 = ((struct canfd_frame *)skb->data)->can_id;
+		__entry->len	 = ((struct canfd_frame *)skb->data)->len;
+	),
+
+	TP_printk("skb=%p ifindex=%d can_id=%08X len=%u",
+		  __entry->skb, __entry->ifindex, __entry->can_id,
+		  __entry->len)
+);
+
+/* the callback of a matching receiver is called */
+TRACE_EVENT(can_deliver,
+
+	TP_PROTO(const struct sk_buff *skb, const void *data,
+		 const char *ident, canid_t can_id, canid_t mask),
+
+	TP_ARGS(skb, data, ident, can_id, mask),
+
+	TP_STRUCT__entry(
+		__field(const void *,	skb)
+		__field(const void *,	data)
+		__string(ident,		ident ? ident : "")
+		__field(canid_t,	can_id)
+		__field(canid_t,	mask)
+	),
+
+	TP_fast_assign(
+		__entry->skb	= skb;
+		__entry->data	= data;
+		__assign_str(ident, ident ? ident : "");
+		__entry->can_id	= can_id;
+		__entry->mask	= mask;
+	),
+
+	TP_printk("skb=%p ident=%s data=%p rcv=%08X/%08X",
+		  __entry->skb, __get_str(ident), __entry->data,
+		  __entry->can_id, __entry->mask)
+);
+
+/* a CAN frame is handed over to the netdevice by can_send() */
+TRACE_EVENT(can_send,
+
+	TP_PROTO(const struct sk_buff *skb, int loop),
+
+	TP_ARGS(skb, loop),
+
+	TP_STRUCT__entry(
+		__field(const void *,	skb)
+		__field(const void *,	sk)
+		__field(int,		ifindex)
+		__field(canid_t,	can_id)
+		__field(u8,		len)
+		__field(int,		loop)
+	),
+
+	TP_fast_assign(
+		__entry->skb	 = skb;
+		__entry->sk	 = skb->sk;
+		__entry->ifindex = skb->dev->ifindex;
+		__entry->can_id	 = ((struct canfd_frame *)skb->data)->can_id;
+		__entry->len	 = ((struct canfd_frame *)skb->data)->len;
+		__entry->loop	 = loop;
+	),
+
+	TP_printk("skb=%p sk=%p ifindex=%d can_id=%08X len=%u loop=%d",
+		  __entry->skb, __entry->sk, __entry->ifindex,
+		  __entry->can_id, __entry->len, __entry->loop)
+);
+
+#else /* no tracepoints */
+
+#define trace_can_rx(skb, ifindex) do { } while (0)
+#define trace_can_deliver(skb, data, ident, can_id, mask) do { } while (0)
+#define trace_can_send(skb, loop) do { } while (0)
+
+#endif
+
+#endif /* _AF_CAN_TRACE_H */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
+/* this part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE af_can_trace
+#include <trace/define_trace.h>
+#endif
@@ -46,7 +46,11 @@
 #include <linux/init.h>
 #include <linux/interrupt.h>
 #include <linux/hrtimer.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/log2.h>
 #include <linux/list.h>
+#include <linux/jhash.h>
 #include <linux/proc_fs.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
 #include <linux/seq_file.h>
@@ -61,10 +65,11 @@
 #include <socketcan/can/core.h>
 #include <socketcan/can/bcm.h>
 #include <net/sock.h>
+#include <asm/div64.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
 #include <net/net_namespace.h>
 #endif
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,25)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
 #include "compat.h"
 #endif
 
@@ -78,10 +83,20 @@ RCSID("$Id$");
  */
 #define MAX_NFRAMES 256
 
-/* use of last_frames[index].can_dlc */
+/*
+ * Multiplex RX ops look up the frame index for the masked mux bits in a
+ * table instead of comparing all frames. When the mux-mask only covers
+ * bits of one byte this byte indexes the table directly, otherwise the
+ * table is a hash with linear probing keyed by the masked 64 bit value.
+ */
+#define BCM_MUX_BITS 9
+#define BCM_MUX_SIZE (1 << BCM_MUX_BITS) /* > 2 * (MAX_NFRAMES + 1) */
+#define BCM_MUX_HASH -1
+
+/* use of last_frames[index].flags */
 #define RX_RECV    0x40 /* received data for this element */
 #define RX_THR     0x80 /* element not been sent due to throttle feature */
-#define BCM_CAN_DLC_MASK 0x0F /* clean private flags in can_dlc by masking */
+#define BCM_CAN_FLAGS_MASK 0x3F /* clean private flags by masking */
 
 /* get best masking value for can_rx_register() for a given single can_id */
 #define REGMASK(id) ((id & CAN_EFF_FLAG) ? \
@@ -97,19 +112,32 @@ MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR("Oliver Hartkopp <oliver.hartkopp@volkswagen.de>");
 MODULE_ALIAS("can-proto-2");
 
+static int tx_tick __read_mostly;
+module_param(tx_tick, int, S_IRUGO);
+MODULE_PARM_DESC(tx_tick, "tick in usecs of the shared cyclic tx scheduler "
+		 "(default:0 = one hrtimer per tx op)");
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
 #error This code only supports Kernel versions 2.6.22+
 #error For older 2.6 Kernels please use bcm-prior-2-6-22.c instead of bcm.c
 #endif
 
-/* easy access to can_frame payload */
-static inline u64 GET_U64(const struct can_frame *cp)
+/*
+ * Classic CAN frames and CAN FD frames are both stored in op->frames
+ * and op->last_frames with a stride of op->cfsiz. They are accessed as
+ * struct canfd_frame because can_dlc/len share the same offset and the
+ * otherwise unused padding byte of struct can_frame is used as flags.
+ */
+
+/* easy access to the CAN frame payload in 64 bit chunks */
+static inline u64 get_u64(const struct canfd_frame *cp, int offset)
 {
-	return *(u64 *)cp->data;
+	return *(u64 *)(cp->data + offset);
 }
 
 struct bcm_op {
 	struct list_head list;
+	struct hlist_node hnode;
 	int ifindex;
 	canid_t can_id;
 	u32 flags;
@@ -118,20 +146,68 @@ struct bcm_op {
 	struct hrtimer timer, thrtimer;
 	struct tasklet_struct tsklet, thrtsklet;
 	ktime_t rx_stamp, kt_ival1, kt_ival2, kt_lastmsg;
+	ktime_t kt_lastrx;
+	int rx_armed;
 	int rx_ifindex;
 	u32 count;
 	u32 nframes;
 	u32 currframe;
-	struct can_frame *frames;
-	struct can_frame *last_frames;
-	struct can_frame sframe;
-	struct can_frame last_sframe;
+	u32 cfsiz;
+	ktime_t kt_due;
+	struct bcm_tx_stats stats;
+	s64 late_sum;
+	void *frames;
+	void *last_frames;
+	u16 *mux_tbl;
+	int mux_byte;
+	struct canfd_frame sframe;
+	struct canfd_frame last_sframe;
 	struct sock *sk;
 	struct net_device *rx_reg_dev;
+	struct bcm_tx_wheel *wheel;
+	struct list_head wlist;
+	unsigned int wrounds;
+};
+
+/*
+ * With tx_tick set, cyclic tx ops are not driven by their own hrtimer but
+ * are put into the slots of a timer wheel that is shared by all tx ops
+ * sending on the same CAN interface. The wheel fires once per tick and
+ * sends all due frames in one run using a cached device reference.
+ * Cycle times are rounded to the tick.
+ */
+#define BCM_WHEEL_BITS 8
+#define BCM_WHEEL_SLOTS (1 << BCM_WHEEL_BITS)
+#define BCM_WHEEL_MASK (BCM_WHEEL_SLOTS - 1)
+
+struct bcm_tx_wheel {
+	struct list_head list;
+	struct net_device *dev;
+	int users;
+	int dead;
+	int running;
+	unsigned int queued;
+	unsigned int pos;
+	ktime_t tick, next;
+	spinlock_t lock;
+	struct hrtimer timer;
+	struct tasklet_struct tsklet;
+	struct list_head slot[BCM_WHEEL_SLOTS];
 };
 
+static LIST_HEAD(bcm_tx_wheels);
+static DEFINE_MUTEX(bcm_wheel_mutex);
+
 static struct proc_dir_entry *proc_dir;
 
+/*
+ * bcm_ops are additionally hashed by (can_id, ifindex) so that the frequent
+ * lookups of the SETUP, DELETE and READ opcodes do not need to walk the
+ * whole rx_ops/tx_ops list. The lists are kept for the ordered walks.
+ */
+#define BCM_HASH_BITS 8
+#define BCM_HASH_SIZE (1 << BCM_HASH_BITS)
+
 struct bcm_sock {
 	struct sock sk;
 	int bound;
@@ -139,9 +215,24 @@ struct bcm_sock {
 	struct notifier_block notifier;
 	struct list_head rx_ops;
 	struct list_head tx_ops;
+	struct hlist_head rx_hash[BCM_HASH_SIZE];
+	struct hlist_head tx_hash[BCM_HASH_SIZE];
 	unsigned long dropped_usr_msgs;
 	struct proc_dir_entry *bcm_proc_read;
+	struct timeval coalesce;
+	ktime_t kt_coalesce;
+	spinlock_t batch_lock;
+	struct sk_buff *batch;
+	struct hrtimer batch_timer;
+	struct tasklet_struct batch_tsklet;
+	struct sk_buff_head tx_pool;
+	struct work_struct tx_pool_work;
 	char procname [32]; /* inode number in decimal with \0 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0)
+	void (*data_ready)(struct sock *sk);
+#else
+	void (*data_ready)(struct sock *sk, int bytes);
+#endif
 };
 
 static inline struct bcm_sock *bcm_sk(const struct sock *sk)
@@ -149,14 +240,43 @@ static inline struct bcm_sock *bcm_sk(const struct sock *sk)
 	return (struct bcm_sock *)sk;
 }
 
-#define CFSIZ sizeof(struct can_frame)
+#define CFSIZ(flags) ((flags & CAN_FD_FRAME) ? CANFD_MTU : CAN_MTU)
 #define OPSIZ sizeof(struct bcm_op)
 #define MHSIZ sizeof(struct bcm_msg_head)
 
+/* max. size of a datagram with coalesced RX_CHANGED/RX_TIMEOUT records */
+#define BCM_BATCH_SIZE 16384
+
+/*
+ * Cyclic transmissions take their skbs from a per-socket pool that is
+ * refilled in process context when it runs below the half of its size.
+ * The timer context only allocates by itself when the pool is empty.
+ */
+#define BCM_TX_POOL_SIZE 64
+
+/* average lateness of the cyclic transmissions of a tx op in nsecs */
+static s64 bcm_tx_late_avg(struct bcm_op *op)
+{
+	u64 avg;
+
+	if (!op->stats.frames)
+		return 0;
+
+	avg = (op->late_sum < 0) ? -op->late_sum : op->late_sum;
+	do_div(avg, (u32)min_t(u64, op->stats.frames, 0xFFFFFFFFUL));
+
+	return (op->late_sum < 0) ? -(s64)avg : (s64)avg;
+}
+
 /*
  * procfs functions
  */
-static char *bcm_proc_getifname(char *result, int ifindex)
+
+/* the number of frames of CAN FD ops is shown in (round) brackets */
+#define BCM_PROC_OPEN(op)  (((op)->flags & CAN_FD_FRAME) ? '(' : '[')
+#define BCM_PROC_CLOSE(op) (((op)->flags & CAN_FD_FRAME) ? ')' : ']')
+
+static char *bcm_proc_getifname(struct net *net, char *result, int ifindex)
 {
 	struct net_device *dev;
 
@@ -164,7 +284,7 @@ static char *bcm_proc_getifname(char *result, int ifindex)
 		return "any";
 
 	read_lock(&dev_base_lock);
-	dev = __dev_get_by_index(&init_net, ifindex);
+	dev = __dev_get_by_index(net, ifindex);
 	if (dev)
 		strcpy(result, dev->name);
 	else
@@ -180,6 +300,7 @@ static int bcm_proc_show(struct seq_file *m, void *v)
 	char ifname[IFNAMSIZ];
 	struct sock *sk = (struct sock *)m->private;
 	struct bcm_sock *bo = bcm_sk(sk);
+	struct net *net = sock_net(sk);
 	struct bcm_op *op;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,0,0)
@@ -192,7 +313,8 @@ static int bcm_proc_show(struct seq_file *m, void *v)
 	seq_printf(m, " / bo %pK", bo);
 #endif
 	seq_printf(m, " / dropped %lu", bo->dropped_usr_msgs);
-	seq_printf(m, " / bound %s", bcm_proc_getifname(ifname, bo->ifindex));
+	seq_printf(m, " / bound %s",
+		   bcm_proc_getifname(net, ifname, bo->ifindex));
 	seq_printf(m, " <<<\n");
 
 	list_for_each_entry(op, &bo->rx_ops, list) {
@@ -203,9 +325,10 @@ static int bcm_proc_show(struct seq_file *m, void *v)
 		if (!op->frames_abs)
 			continue;
 
-		seq_printf(m, "rx_op: %03X %-5s ",
-				op->can_id, bcm_proc_getifname(ifname, op->ifindex));
-		seq_printf(m, "[%u]%c ", op->nframes,
+		seq_printf(m, "rx_op: %03X %-5s ", op->can_id,
+				bcm_proc_getifname(net, ifname, op->ifindex));
+		seq_printf(m, "%c%u%c%c ", BCM_PROC_OPEN(op), op->nframes,
+				BCM_PROC_CLOSE(op),
 				(op->flags & RX_CHECK_DLC)?'d':' ');
 		if (op->kt_ival1.tv64)
 			seq_printf(m, "timeo=%lld ",
@@ -228,10 +351,11 @@ static int bcm_proc_show(struct seq_file *m, void *v)
 
 	list_for_each_entry(op, &bo->tx_ops, list) {
 
-		seq_printf(m, "tx_op: %03X %s [%u] ",
+		seq_printf(m, "tx_op: %03X %s %c%u%c ",
 				op->can_id,
-				bcm_proc_getifname(ifname, op->ifindex),
-				op->nframes);
+				bcm_proc_getifname(net, ifname, op->ifindex),
+				BCM_PROC_OPEN(op), op->nframes,
+				BCM_PROC_CLOSE(op));
 
 		if (op->kt_ival1.tv64)
 			seq_printf(m, "t1=%lld ",
@@ -241,6 +365,12 @@ static int bcm_proc_show(struct seq_file *m, void *v)
 			seq_printf(m, "t2=%lld ",
 					(long long) ktime_to_us(op->kt_ival2));
 
+		if (op->stats.frames)
+			seq_printf(m, "late=%lld/%lld/%lldns ",
+				   (long long)op->stats.min_ns,
+				   (long long)bcm_tx_late_avg(op),
+				   (long long)op->stats.max_ns);
+
 		seq_printf(m, "# sent %ld\n", op->frames_abs);
 	}
 	seq_putc(m, '\n');
@@ -267,6 +397,7 @@ static int bcm_read_proc(char *page, char **start, off_t off,
 	int len = 0;
 	struct sock *sk = (struct sock *)data;
 	struct bcm_sock *bo = bcm_sk(sk);
+	struct net *net = sock_net(sk);
 	struct bcm_op *op;
 
 	len += snprintf(page + len, PAGE_SIZE - len, ">>> socket %p",
@@ -276,7 +407,7 @@ static int bcm_read_proc(char *page, char **start, off_t off,
 	len += snprintf(page + len, PAGE_SIZE - len, " / dropped %lu",
 			bo->dropped_usr_msgs);
 	len += snprintf(page + len, PAGE_SIZE - len, " / bound %s",
-			bcm_proc_getifname(ifname, bo->ifindex));
+			bcm_proc_getifname(net, ifname, bo->ifindex));
 	len += snprintf(page + len, PAGE_SIZE - len, " <<<\n");
 
 	list_for_each_entry(op, &bo->rx_ops, list) {
@@ -288,10 +419,11 @@ static int bcm_read_proc(char *page, char **start, off_t off,
 			continue;
 
 		len += snprintf(page + len, PAGE_SIZE - len,
-				"rx_op: %03X %-5s ",
-				op->can_id, bcm_proc_getifname(ifname, op->ifindex));
-		len += snprintf(page + len, PAGE_SIZE - len, "[%d]%c ",
-				op->nframes,
+				"rx_op: %03X %-5s ", op->can_id,
+				bcm_proc_getifname(net, ifname, op->ifindex));
+		len += snprintf(page + len, PAGE_SIZE - len, "%c%d%c%c ",
+				BCM_PROC_OPEN(op), op->nframes,
+				BCM_PROC_CLOSE(op),
 				(op->flags & RX_CHECK_DLC)?'d':' ');
 		if (op->kt_ival1.tv64)
 			len += snprintf(page + len, PAGE_SIZE - len,
@@ -324,10 +456,11 @@ static int bcm_read_proc(char *page, char **start, off_t off,
 	list_for_each_entry(op, &bo->tx_ops, list) {
 
 		len += snprintf(page + len, PAGE_SIZE - len,
-				"tx_op: %03X %s [%d] ",
+				"tx_op: %03X %s %c%d%c ",
 				op->can_id,
-				bcm_proc_getifname(ifname, op->ifindex),
-				op->nframes);
+				bcm_proc_getifname(net, ifname, op->ifindex),
+				BCM_PROC_OPEN(op), op->nframes,
+				BCM_PROC_CLOSE(op));
 
 		if (op->kt_ival1.tv64)
 			len += snprintf(page + len, PAGE_SIZE - len, "t1=%lld ",
@@ -337,6 +470,13 @@ static int bcm_read_proc(char *page, char **start, off_t off,
 			len += snprintf(page + len, PAGE_SIZE - len, "t2=%lld ",
 					(long long) ktime_to_us(op->kt_ival2));
 
+		if (op->stats.frames)
+			len += snprintf(page + len, PAGE_SIZE - len,
+					"late=%lld/%lld/%lldns ",
+					(long long)op->stats.min_ns,
+					(long long)bcm_tx_late_avg(op),
+					(long long)op->stats.max_ns);
+
 		len += snprintf(page + len, PAGE_SIZE - len, "# sent %ld\n",
 				op->frames_abs);
 
@@ -355,30 +495,58 @@ static int bcm_read_proc(char *page, char **start, off_t off,
 #endif
 
 /*
- * bcm_can_tx - send the (next) CAN frame to the appropriate CAN interface
- *              of the given bcm tx op
+ * bcm_tx_pool_fill - (re)fill the pool of skbs for cyclic transmissions
  */
-static void bcm_can_tx(struct bcm_op *op)
+static void bcm_tx_pool_fill(struct bcm_sock *bo)
 {
 	struct sk_buff *skb;
-	struct net_device *dev;
-	struct can_frame *cf = &op->frames[op->currframe];
 
-	/* no target device? => exit */
-	if (!op->ifindex)
-		return;
+	while (skb_queue_len(&bo->tx_pool) < BCM_TX_POOL_SIZE) {
+		/* big enough for classic CAN and CAN FD frames */
+		skb = alloc_skb(CANFD_MTU, GFP_KERNEL);
+		if (!skb)
+			break;
 
-	dev = dev_get_by_index(&init_net, op->ifindex);
-	if (!dev) {
-		/* RFC: should this bcm_op remove itself here? */
-		return;
+		skb_queue_tail(&bo->tx_pool, skb);
 	}
+}
+
+static void bcm_tx_pool_work(struct work_struct *work)
+{
+	struct bcm_sock *bo = container_of(work, struct bcm_sock,
+					   tx_pool_work);
+
+	bcm_tx_pool_fill(bo);
+}
+
+static struct sk_buff *bcm_tx_alloc_skb(struct bcm_op *op)
+{
+	struct bcm_sock *bo = bcm_sk(op->sk);
+	struct sk_buff *skb = skb_dequeue(&bo->tx_pool);
+
+	if (skb_queue_len(&bo->tx_pool) < BCM_TX_POOL_SIZE / 2)
+		schedule_work(&bo->tx_pool_work);
 
-	skb = alloc_skb(CFSIZ, gfp_any());
 	if (!skb)
-		goto out;
+		skb = alloc_skb(op->cfsiz, gfp_any());
+
+	return skb;
+}
+
+/*
+ * bcm_can_tx - send the (next) CAN frame to the appropriate CAN interface
+ *              of the given bcm tx op
+ */
+static void bcm_can_tx_dev(struct bcm_op *op, struct net_device *dev)
+{
+	struct sk_buff *skb;
+	struct canfd_frame *cf = op->frames + op->cfsiz * op->currframe;
+
+	skb = bcm_tx_alloc_skb(op);
+	if (!skb)
+		return;
 
-	memcpy(skb_put(skb, CFSIZ), cf, CFSIZ);
+	memcpy(skb_put(skb, op->cfsiz), cf, op->cfsiz);
 
 	/* send with loopback */
 	skb->dev = dev;
@@ -392,23 +560,172 @@ static void bcm_can_tx(struct bcm_op *op)
 	/* reached last frame? */
 	if (op->currframe >= op->nframes)
 		op->currframe = 0;
- out:
+}
+
+static void bcm_can_tx(struct bcm_op *op)
+{
+	struct net_device *dev;
+
+	/* no target device? => exit */
+	if (!op->ifindex)
+		return;
+
+	dev = dev_get_by_index(sock_net(op->sk), op->ifindex);
+	if (!dev) {
+		/* RFC: should this bcm_op remove itself here? */
+		return;
+	}
+
+	bcm_can_tx_dev(op, dev);
 	dev_put(dev);
 }
 
+/*
+ * bcm_queue_skb - put the datagram to the queue so that bcm_recvmsg() can
+ *                 get it from there
+ */
+static void bcm_queue_skb(struct sock *sk, struct sk_buff *skb)
+{
+	int err = sock_queue_rcv_skb(sk, skb);
+
+	if (err < 0) {
+		struct bcm_sock *bo = bcm_sk(sk);
+
+		kfree_skb(skb);
+		/* don't care about overflows in this statistic */
+		bo->dropped_usr_msgs++;
+	}
+}
+
+static void bcm_wakeup(struct sock *sk)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0)
+	bcm_sk(sk)->data_ready(sk);
+#else
+	bcm_sk(sk)->data_ready(sk, 0);
+#endif
+}
+
+/*
+ * bcm_data_ready - wake up the reader once per rx batch of the CAN core
+ *                  when several rx ops of the socket notify from one batch
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0)
+static void bcm_data_ready(struct sock *sk)
+#else
+static void bcm_data_ready(struct sock *sk, int bytes)
+#endif
+{
+	if (!can_rx_defer_wakeup(sk, bcm_wakeup))
+		bcm_wakeup(sk);
+}
+
+/*
+ * bcm_batch_flush - deliver the coalesced notifications (if any)
+ */
+static void bcm_batch_flush(struct bcm_sock *bo)
+{
+	struct sk_buff *skb;
+
+	spin_lock_bh(&bo->batch_lock);
+	skb = bo->batch;
+	bo->batch = NULL;
+	spin_unlock_bh(&bo->batch_lock);
+
+	if (skb)
+		bcm_queue_skb(&bo->sk, skb);
+}
+
+static void bcm_batch_tsklet(unsigned long data)
+{
+	struct bcm_sock *bo = (struct bcm_sock *)data;
+
+	bcm_batch_flush(bo);
+}
+
+static enum hrtimer_restart bcm_batch_timeout_handler(struct hrtimer *hrtimer)
+{
+	struct bcm_sock *bo = container_of(hrtimer, struct bcm_sock,
+					   batch_timer);
+
+	tasklet_schedule(&bo->batch_tsklet);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * bcm_batch_add - append a notification to the coalescing datagram
+ *                 (returns 0 when the skb has been consumed)
+ */
+static int bcm_batch_add(struct bcm_sock *bo, struct sk_buff *skb)
+{
+	struct sk_buff *full = NULL;
+	struct sockaddr_can *addr;
+	int err = 0;
+
+	spin_lock_bh(&bo->batch_lock);
+
+	/* coalescing has been switched off in the meantime? */
+	if (!bo->kt_coalesce.tv64) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (bo->batch && skb_tailroom(bo->batch) < skb->len) {
+		/* no space left => deliver it and start a new datagram */
+		full = bo->batch;
+		bo->batch = NULL;
+	}
+
+	if (!bo->batch) {
+		bo->batch = alloc_skb(BCM_BATCH_SIZE, gfp_any());
+		if (!bo->batch) {
+			err = -ENOMEM;
+			goto out;
+		}
+
+		/* first record provides the timestamp and the address */
+		bo->batch->tstamp = skb->tstamp;
+		memcpy(bo->batch->cb, skb->cb, sizeof(struct sockaddr_can));
+
+		hrtimer_start(&bo->batch_timer, bo->kt_coalesce,
+			      HRTIMER_MODE_REL);
+	} else {
+		/* records from different interfaces => no ifindex */
+		addr = (struct sockaddr_can *)bo->batch->cb;
+		if (addr->can_ifindex !=
+		    ((struct sockaddr_can *)skb->cb)->can_ifindex)
+			addr->can_ifindex = 0;
+	}
+
+	memcpy(skb_put(bo->batch, skb->len), skb->data, skb->len);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+	consume_skb(skb);
+#else
+	kfree_skb(skb);
+#endif
+ out:
+	spin_unlock_bh(&bo->batch_lock);
+
+	if (full)
+		bcm_queue_skb(&bo->sk, full);
+
+	return err;
+}
+
 /*
  * bcm_send_to_user - send a BCM message to the userspace
  *                    (consisting of bcm_msg_head + x CAN frames)
  */
 static void bcm_send_to_user(struct bcm_op *op, struct bcm_msg_head *head,
-			     struct can_frame *frames, int has_timestamp)
+			     struct canfd_frame *frames, int has_timestamp)
 {
 	struct sk_buff *skb;
-	struct can_frame *firstframe;
+	struct canfd_frame *firstframe;
 	struct sockaddr_can *addr;
 	struct sock *sk = op->sk;
-	unsigned int datalen = head->nframes * CFSIZ;
-	int err;
+	struct bcm_sock *bo = bcm_sk(sk);
+	unsigned int datalen = head->nframes * op->cfsiz;
 
 	skb = alloc_skb(sizeof(*head) + datalen, gfp_any());
 	if (!skb)
@@ -418,18 +735,18 @@ static void bcm_send_to_user(struct bcm_op *op, struct bcm_msg_head *head,
 
 	if (head->nframes) {
 		/* can_frames starting here */
-		firstframe = (struct can_frame *)skb_tail_pointer(skb);
+		firstframe = (struct canfd_frame *)skb_tail_pointer(skb);
 
 		memcpy(skb_put(skb, datalen), frames, datalen);
 
 		/*
-		 * the BCM uses the can_dlc-element of the can_frame
+		 * the BCM uses the flags-element of the canfd_frame
 		 * structure for internal purposes. This is only
 		 * relevant for updates that are generated by the
 		 * BCM, where nframes is 1
 		 */
 		if (head->nframes == 1)
-			firstframe->can_dlc &= BCM_CAN_DLC_MASK;
+			firstframe->flags &= BCM_CAN_FLAGS_MASK;
 	}
 
 	if (has_timestamp) {
@@ -450,33 +767,135 @@ static void bcm_send_to_user(struct bcm_op *op, struct bcm_msg_head *head,
 	addr->can_family  = AF_CAN;
 	addr->can_ifindex = op->rx_ifindex;
 
-	err = sock_queue_rcv_skb(sk, skb);
-	if (err < 0) {
-		struct bcm_sock *bo = bcm_sk(sk);
+	if (bo->kt_coalesce.tv64) {
+		/* content change and timeout notifications can be coalesced */
+		if (head->opcode == RX_CHANGED || head->opcode == RX_TIMEOUT) {
+			if (!bcm_batch_add(bo, skb))
+				return;
+		} else {
+			/* keep the order of the notifications */
+			bcm_batch_flush(bo);
+		}
+	}
 
-		kfree_skb(skb);
-		/* don't care about overflows in this statistic */
-		bo->dropped_usr_msgs++;
+	bcm_queue_skb(sk, skb);
+}
+
+/* queue a tx op into the wheel slot matching ival (w->lock held) */
+static void bcm_wheel_queue(struct bcm_tx_wheel *w, struct bcm_op *op,
+			    ktime_t ival)
+{
+	u64 ticks = ktime_to_ns(ival) + ktime_to_ns(w->tick) / 2;
+
+	do_div(ticks, (u32)ktime_to_ns(w->tick));
+	if (!ticks)
+		ticks = 1;
+
+	op->wrounds = (unsigned int)((ticks - 1) >> BCM_WHEEL_BITS);
+	op->kt_due = ktime_add(ktime_get(), ival);
+	list_add_tail(&op->wlist,
+		      &w->slot[(w->pos + (unsigned int)ticks) & BCM_WHEEL_MASK]);
+	w->queued++;
+
+	if (!w->running) {
+		w->running = 1;
+		w->next = ktime_add(ktime_get(), w->tick);
+		hrtimer_start(&w->timer, w->next, HRTIMER_MODE_ABS);
+	}
+}
+
+/* remove a tx op from its wheel slot (w->lock held) */
+static void bcm_wheel_dequeue(struct bcm_tx_wheel *w, struct bcm_op *op)
+{
+	if (!list_empty(&op->wlist)) {
+		list_del_init(&op->wlist);
+		w->queued--;
 	}
 }
 
+static void bcm_tx_stop_timer(struct bcm_op *op)
+{
+	struct bcm_tx_wheel *w = op->wheel;
+
+	if (w) {
+		spin_lock_bh(&w->lock);
+		bcm_wheel_dequeue(w, op);
+		spin_unlock_bh(&w->lock);
+	} else
+		hrtimer_cancel(&op->timer);
+}
+
 static void bcm_tx_start_timer(struct bcm_op *op)
 {
+	struct bcm_tx_wheel *w = op->wheel;
+	ktime_t ival;
+
 	if (op->kt_ival1.tv64 && op->count)
-		hrtimer_start(&op->timer,
-			      ktime_add(ktime_get(), op->kt_ival1),
-			      HRTIMER_MODE_ABS);
+		ival = op->kt_ival1;
 	else if (op->kt_ival2.tv64)
-		hrtimer_start(&op->timer,
-			      ktime_add(ktime_get(), op->kt_ival2),
-			      HRTIMER_MODE_ABS);
+		ival = op->kt_ival2;
+	else
+		return;
+
+	if (w) {
+		spin_lock_bh(&w->lock);
+		bcm_wheel_dequeue(w, op);
+		if (!w->dead)
+			bcm_wheel_queue(w, op, ival);
+		spin_unlock_bh(&w->lock);
+	} else {
+		op->kt_due = ktime_add(ktime_get(), ival);
+		hrtimer_start(&op->timer, op->kt_due, HRTIMER_MODE_ABS);
+	}
 }
 
-static void bcm_tx_timeout_tsklet(unsigned long data)
+/*
+ * bcm_tx_account - record the lateness of a cyclic transmission
+ */
+static void bcm_tx_account(struct bcm_op *op)
+{
+	struct bcm_tx_stats *st = &op->stats;
+	s64 late = ktime_to_ns(ktime_sub(ktime_get(), op->kt_due));
+	u64 us = (late < 0) ? -late : late;
+	unsigned int bucket = 0;
+
+	if (!op->kt_due.tv64)
+		return;
+
+	if (late < 0)
+		st->early++;
+
+	if (!st->frames || late < st->min_ns)
+		st->min_ns = late;
+	if (!st->frames || late > st->max_ns)
+		st->max_ns = late;
+
+	st->frames++;
+	op->late_sum += late;
+
+	do_div(us, NSEC_PER_USEC);
+	if (us)
+		bucket = min_t(unsigned int, ilog2(us) + 1,
+			       BCM_TX_HIST_BUCKETS - 1);
+	st->hist[bucket]++;
+}
+
+static void bcm_tx_reset_stats(struct bcm_op *op)
+{
+	memset(&op->stats, 0, sizeof(op->stats));
+	op->late_sum = 0;
+}
+
+/*
+ * bcm_tx_timeout - send the next frame of a cyclic tx op and handle the
+ *                  TX_COUNTEVT notification (dev may be NULL)
+ */
+static void bcm_tx_timeout(struct bcm_op *op, struct net_device *dev)
 {
-	struct bcm_op *op = (struct bcm_op *)data;
 	struct bcm_msg_head msg_head;
 
+	bcm_tx_account(op);
+
 	if (op->kt_ival1.tv64 && (op->count > 0)) {
 
 		op->count--;
@@ -493,11 +912,21 @@ static void bcm_tx_timeout_tsklet(unsigned long data)
 
 			bcm_send_to_user(op, &msg_head, NULL, 0);
 		}
-		bcm_can_tx(op);
 
-	} else if (op->kt_ival2.tv64)
+	} else if (!op->kt_ival2.tv64)
+		return;
+
+	if (dev)
+		bcm_can_tx_dev(op, dev);
+	else
 		bcm_can_tx(op);
+}
 
+static void bcm_tx_timeout_tsklet(unsigned long data)
+{
+	struct bcm_op *op = (struct bcm_op *)data;
+
+	bcm_tx_timeout(op, NULL);
 	bcm_tx_start_timer(op);
 }
 
@@ -513,10 +942,187 @@ static enum hrtimer_restart bcm_tx_timeout_handler(struct hrtimer *hrtimer)
 	return HRTIMER_NORESTART;
 }
 
+/*
+ * bcm_wheel_tsklet - advance the tx timer wheel and send all due frames
+ */
+static void bcm_wheel_tsklet(unsigned long data)
+{
+	struct bcm_tx_wheel *w = (struct bcm_tx_wheel *)data;
+	struct bcm_op *op, *n;
+	ktime_t now = ktime_get();
+	unsigned int ticks = 0;
+	LIST_HEAD(due);
+
+	spin_lock(&w->lock);
+
+	if (w->dead) {
+		w->running = 0;
+		goto out;
+	}
+
+	/* catch up with the ticks we missed, but walk the wheel only once */
+	do {
+		w->pos = (w->pos + 1) & BCM_WHEEL_MASK;
+		list_for_each_entry_safe(op, n, &w->slot[w->pos], wlist) {
+			if (op->wrounds) {
+				op->wrounds--;
+				continue;
+			}
+			list_move_tail(&op->wlist, &due);
+			w->queued--;
+		}
+		w->next = ktime_add(w->next, w->tick);
+	} while (w->next.tv64 <= now.tv64 && ++ticks < BCM_WHEEL_SLOTS);
+
+	if (w->next.tv64 <= now.tv64)
+		w->next = ktime_add(now, w->tick);
+
+	list_for_each_entry_safe(op, n, &due, wlist) {
+		list_del_init(&op->wlist);
+		bcm_tx_timeout(op, w->dev);
+
+		if (op->kt_ival1.tv64 && op->count)
+			bcm_wheel_queue(w, op, op->kt_ival1);
+		else if (op->kt_ival2.tv64)
+			bcm_wheel_queue(w, op, op->kt_ival2);
+	}
+
+	if (w->queued)
+		hrtimer_start(&w->timer, w->next, HRTIMER_MODE_ABS);
+	else
+		w->running = 0;
+ out:
+	spin_unlock(&w->lock);
+}
+
+static enum hrtimer_restart bcm_wheel_timer(struct hrtimer *hrtimer)
+{
+	struct bcm_tx_wheel *w = container_of(hrtimer, struct bcm_tx_wheel,
+					      timer);
+
+	tasklet_schedule(&w->tsklet);
+
+	return HRTIMER_NORESTART;
+}
+
+/* stop the wheel and drop the device reference (bcm_wheel_mutex held) */
+static void bcm_wheel_kill(struct bcm_tx_wheel *w)
+{
+	list_del(&w->list);
+
+	spin_lock_bh(&w->lock);
+	w->dead = 1;
+	spin_unlock_bh(&w->lock);
+
+	hrtimer_cancel(&w->timer);
+	tasklet_kill(&w->tsklet);
+
+	dev_put(w->dev);
+	w->dev = NULL;
+}
+
+/*
+ * bcm_wheel_get - attach to the tx timer wheel of the given interface
+ *                 (returns NULL when the per-op hrtimer has to be used)
+ */
+static struct bcm_tx_wheel *bcm_wheel_get(struct net *net, int ifindex)
+{
+	struct bcm_tx_wheel *w;
+	struct net_device *dev;
+	int i;
+
+	if (tx_tick <= 0)
+		return NULL;
+
+	dev = dev_get_by_index(net, ifindex);
+	if (!dev)
+		return NULL;
+
+	mutex_lock(&bcm_wheel_mutex);
+
+	list_for_each_entry(w, &bcm_tx_wheels, list) {
+		if (w->dev == dev) {
+			w->users++;
+			dev_put(dev);
+			goto out;
+		}
+	}
+
+	w = kzalloc(sizeof(*w), GFP_KERNEL);
+	if (!w) {
+		dev_put(dev);
+		goto out;
+	}
+
+	/* the wheel keeps the reference of dev_get_by_index() */
+	w->dev = dev;
+	w->users = 1;
+	w->tick = ns_to_ktime((u64)tx_tick * NSEC_PER_USEC);
+	spin_lock_init(&w->lock);
+	for (i = 0; i < BCM_WHEEL_SLOTS; i++)
+		INIT_LIST_HEAD(&w->slot[i]);
+
+	hrtimer_init(&w->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	w->timer.function = bcm_wheel_timer;
+	tasklet_init(&w->tsklet, bcm_wheel_tsklet, (unsigned long)w);
+
+	list_add(&w->list, &bcm_tx_wheels);
+ out:
+	mutex_unlock(&bcm_wheel_mutex);
+
+	return w;
+}
+
+static void bcm_wheel_put(struct bcm_op *op)
+{
+	struct bcm_tx_wheel *w = op->wheel;
+
+	bcm_tx_stop_timer(op);
+	op->wheel = NULL;
+
+	mutex_lock(&bcm_wheel_mutex);
+
+	if (!--w->users) {
+		if (!w->dead)
+			bcm_wheel_kill(w);
+		kfree(w);
+	}
+
+	mutex_unlock(&bcm_wheel_mutex);
+}
+
+/*
+ * bcm_wheel_notifier - stop the tx timer wheel of a vanishing CAN interface
+ */
+static int bcm_wheel_notifier(struct notifier_block *nb, unsigned long msg,
+			      void *data)
+{
+	struct net_device *dev = (struct net_device *)data;
+	struct bcm_tx_wheel *w, *n;
+
+	if (msg != NETDEV_UNREGISTER || dev->type != ARPHRD_CAN)
+		return NOTIFY_DONE;
+
+	mutex_lock(&bcm_wheel_mutex);
+
+	/* the attached tx ops free the wheel in bcm_wheel_put() */
+	list_for_each_entry_safe(w, n, &bcm_tx_wheels, list)
+		if (w->dev == dev)
+			bcm_wheel_kill(w);
+
+	mutex_unlock(&bcm_wheel_mutex);
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block bcm_wheel_nb = {
+	.notifier_call = bcm_wheel_notifier,
+};
+
 /*
  * bcm_rx_changed - create a RX_CHANGED notification due to changed content
  */
-static void bcm_rx_changed(struct bcm_op *op, struct can_frame *data)
+static void bcm_rx_changed(struct bcm_op *op, struct canfd_frame *data)
 {
 	struct bcm_msg_head head;
 
@@ -528,7 +1134,7 @@ static void bcm_rx_changed(struct bcm_op *op, struct can_frame *data)
 		op->frames_filtered = op->frames_abs = 0;
 
 	/* this element is not throttled anymore */
-	data->can_dlc &= (BCM_CAN_DLC_MASK|RX_RECV);
+	data->flags &= (BCM_CAN_FLAGS_MASK|RX_RECV);
 
 	head.opcode  = RX_CHANGED;
 	head.flags   = op->flags;
@@ -560,13 +1166,13 @@ static inline s64 ktime_us_delta(const ktime_t later, const ktime_t earlier)
  *                          2. send a notification to the user (if possible)
  */
 static void bcm_rx_update_and_send(struct bcm_op *op,
-				   struct can_frame *lastdata,
-				   const struct can_frame *rxdata)
+				   struct canfd_frame *lastdata,
+				   const struct canfd_frame *rxdata)
 {
-	memcpy(lastdata, rxdata, CFSIZ);
+	memcpy(lastdata, rxdata, op->cfsiz);
 
 	/* mark as used and throttled by default */
-	lastdata->can_dlc |= (RX_RECV|RX_THR);
+	lastdata->flags |= (RX_RECV|RX_THR);
 
 	/* throtteling mode inactive ? */
 	if (!op->kt_ival2.tv64) {
@@ -604,33 +1210,43 @@ rx_changed_settime:
  *                       received data stored in op->last_frames[]
  */
 static void bcm_rx_cmp_to_index(struct bcm_op *op, unsigned int index,
-				const struct can_frame *rxdata)
+				const struct canfd_frame *rxdata)
 {
+	struct canfd_frame *cf = op->frames + op->cfsiz * index;
+	struct canfd_frame *lcf = op->last_frames + op->cfsiz * index;
+	unsigned int len = CAN_MAX_DLEN;
+	unsigned int i;
+
 	/*
-	 * no one uses the MSBs of can_dlc for comparation,
+	 * no one uses the MSBs of flags for comparation,
 	 * so we use it here to detect the first time of reception
 	 */
 
-	if (!(op->last_frames[index].can_dlc & RX_RECV)) {
+	if (!(lcf->flags & RX_RECV)) {
 		/* received data for the first time => send update to user */
-		bcm_rx_update_and_send(op, &op->last_frames[index], rxdata);
+		bcm_rx_update_and_send(op, lcf, rxdata);
 		return;
 	}
 
-	/* do a real check in can_frame data section */
+	/*
+	 * do a real check in the data section - classic CAN frames always
+	 * compare all 8 bytes, CAN FD frames only the received length
+	 */
+	if (op->flags & CAN_FD_FRAME)
+		len = rxdata->len;
 
-	if ((GET_U64(&op->frames[index]) & GET_U64(rxdata)) !=
-	    (GET_U64(&op->frames[index]) & GET_U64(&op->last_frames[index]))) {
-		bcm_rx_update_and_send(op, &op->last_frames[index], rxdata);
-		return;
+	for (i = 0; i < len; i += 8) {
+		if ((get_u64(cf, i) & get_u64(rxdata, i)) !=
+		    (get_u64(cf, i) & get_u64(lcf, i))) {
+			bcm_rx_update_and_send(op, lcf, rxdata);
+			return;
+		}
 	}
 
 	if (op->flags & RX_CHECK_DLC) {
-		/* do a real check in can_frame dlc */
-		if (rxdata->can_dlc != (op->last_frames[index].can_dlc &
-					BCM_CAN_DLC_MASK)) {
-			bcm_rx_update_and_send(op, &op->last_frames[index],
-					       rxdata);
+		/* do a real check in CAN frame length */
+		if (rxdata->len != lcf->len) {
+			bcm_rx_update_and_send(op, lcf, rxdata);
 			return;
 		}
 	}
@@ -638,14 +1254,49 @@ static void bcm_rx_cmp_to_index(struct bcm_op *op, unsigned int index,
 
 /*
  * bcm_rx_starttimer - enable timeout monitoring for CAN frame receiption
+ *
+ * A received frame only stores its reception time which moves the timeout
+ * deadline. The hrtimer is started when it is not armed and pushes itself
+ * forward to the current deadline when it fires too early. So the timer is
+ * touched once per ival1 and not twice for every received frame.
  */
 static void bcm_rx_starttimer(struct bcm_op *op)
 {
 	if (op->flags & RX_NO_AUTOTIMER)
 		return;
 
-	if (op->kt_ival1.tv64)
-		hrtimer_start(&op->timer, op->kt_ival1, HRTIMER_MODE_REL);
+	if (!op->kt_ival1.tv64)
+		return;
+
+	op->kt_lastrx = ktime_get();
+
+	/* pairs with the barrier in bcm_rx_timeout_handler() */
+	smp_mb();
+
+	if (!op->rx_armed) {
+		op->rx_armed = 1;
+		hrtimer_start(&op->timer,
+			      ktime_add(op->kt_lastrx, op->kt_ival1),
+			      HRTIMER_MODE_ABS);
+	}
+}
+
+/*
+ * bcm_rx_stoptimer - disable timeout monitoring (process context)
+ */
+static void bcm_rx_stoptimer(struct bcm_op *op)
+{
+	hrtimer_cancel(&op->timer);
+	op->rx_armed = 0;
+}
+
+static inline void bcm_rx_set_expires(struct hrtimer *hrtimer, ktime_t t)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+	hrtimer_set_expires(hrtimer, t);
+#else
+	hrtimer->expires = t;
+#endif
 }
 
 static void bcm_rx_timeout_tsklet(unsigned long data)
@@ -671,6 +1322,25 @@ static void bcm_rx_timeout_tsklet(unsigned long data)
 static enum hrtimer_restart bcm_rx_timeout_handler(struct hrtimer *hrtimer)
 {
 	struct bcm_op *op = container_of(hrtimer, struct bcm_op, timer);
+	ktime_t lastrx = op->kt_lastrx;
+	ktime_t deadline = ktime_add(lastrx, op->kt_ival1);
+
+	/* frames have been received in the meantime */
+	if (deadline.tv64 > ktime_get().tv64) {
+		bcm_rx_set_expires(hrtimer, deadline);
+		return HRTIMER_RESTART;
+	}
+
+	op->rx_armed = 0;
+	smp_mb();
+
+	/* a frame received right now did not see the cleared rx_armed */
+	if (op->kt_lastrx.tv64 != lastrx.tv64) {
+		op->rx_armed = 1;
+		bcm_rx_set_expires(hrtimer,
+				   ktime_add(op->kt_lastrx, op->kt_ival1));
+		return HRTIMER_RESTART;
+	}
 
 	/* schedule before NET_RX_SOFTIRQ */
 	tasklet_hi_schedule(&op->tsklet);
@@ -680,7 +1350,7 @@ static enum hrtimer_restart bcm_rx_timeout_handler(struct hrtimer *hrtimer)
 	/* if user wants to be informed, when cyclic CAN-Messages come back */
 	if ((op->flags & RX_ANNOUNCE_RESUME) && op->last_frames) {
 		/* clear received can_frames to indicate 'nothing received' */
-		memset(op->last_frames, 0, op->nframes * CFSIZ);
+		memset(op->last_frames, 0, op->nframes * op->cfsiz);
 	}
 
 	return HRTIMER_NORESTART;
@@ -692,9 +1362,11 @@ static enum hrtimer_restart bcm_rx_timeout_handler(struct hrtimer *hrtimer)
 static inline int bcm_rx_do_flush(struct bcm_op *op, int update,
 				  unsigned int index)
 {
-	if ((op->last_frames) && (op->last_frames[index].can_dlc & RX_THR)) {
+	struct canfd_frame *lcf = op->last_frames + op->cfsiz * index;
+
+	if ((op->last_frames) && (lcf->flags & RX_THR)) {
 		if (update)
-			bcm_rx_changed(op, &op->last_frames[index]);
+			bcm_rx_changed(op, lcf);
 		return 1;
 	}
 	return 0;
@@ -753,17 +1425,103 @@ static enum hrtimer_restart bcm_rx_thr_handler(struct hrtimer *hrtimer)
 	}
 }
 
+static inline unsigned int bcm_mux_hash(u64 key)
+{
+	return jhash_2words((u32)key, (u32)(key >> 32), 0) &
+		(BCM_MUX_SIZE - 1);
+}
+
+/*
+ * bcm_rx_mux_build - (re)build the mux lookup table from op->frames
+ */
+static void bcm_rx_mux_build(struct bcm_op *op)
+{
+	const struct canfd_frame *mux = op->frames;
+	u64 mask = get_u64(mux, 0);
+	unsigned int i, h;
+	int b, nbytes = 0;
+
+	memset(op->mux_tbl, 0, BCM_MUX_SIZE * sizeof(*op->mux_tbl));
+
+	/* is the mux-mask limited to a single byte? */
+	op->mux_byte = 0;
+	for (b = 0; b < 8; b++) {
+		if (mux->data[b]) {
+			op->mux_byte = b;
+			nbytes++;
+		}
+	}
+
+	if (nbytes > 1)
+		op->mux_byte = BCM_MUX_HASH;
+
+	/* the first multiplex mask that fits wins => insert in order */
+	for (i = 1; i < op->nframes; i++) {
+		const struct canfd_frame *cf = op->frames + op->cfsiz * i;
+		u64 key = mask & get_u64(cf, 0);
+
+		if (op->mux_byte != BCM_MUX_HASH) {
+			h = cf->data[op->mux_byte] & mux->data[op->mux_byte];
+			if (!op->mux_tbl[h])
+				op->mux_tbl[h] = i;
+			continue;
+		}
+
+		for (h = bcm_mux_hash(key); op->mux_tbl[h];
+		     h = (h + 1) & (BCM_MUX_SIZE - 1)) {
+			cf = op->frames + op->cfsiz * op->mux_tbl[h];
+			if ((mask & get_u64(cf, 0)) == key)
+				break;
+		}
+
+		if (!op->mux_tbl[h])
+			op->mux_tbl[h] = i;
+	}
+}
+
+/*
+ * bcm_rx_mux_lookup - get the mux frame index for rxframe (0 = no match)
+ */
+static unsigned int bcm_rx_mux_lookup(struct bcm_op *op,
+				      const struct canfd_frame *rxframe)
+{
+	const struct canfd_frame *mux = op->frames;
+	const struct canfd_frame *cf;
+	u64 mask = get_u64(mux, 0);
+	u64 key = mask & get_u64(rxframe, 0);
+	unsigned int h, i;
+
+	if (op->mux_byte != BCM_MUX_HASH) {
+		i = op->mux_tbl[rxframe->data[op->mux_byte] &
+				mux->data[op->mux_byte]];
+		/* the table may be rebuilt by bcm_rx_setup() right now */
+		return (i < op->nframes) ? i : 0;
+	}
+
+	for (h = bcm_mux_hash(key); (i = op->mux_tbl[h]);
+	     h = (h + 1) & (BCM_MUX_SIZE - 1)) {
+		if (i >= op->nframes)
+			continue;
+		cf = op->frames + op->cfsiz * i;
+		if ((mask & get_u64(cf, 0)) == key)
+			return i;
+	}
+
+	return 0;
+}
+
 /*
  * bcm_rx_handler - handle a CAN frame receiption
  */
 static void bcm_rx_handler(struct sk_buff *skb, void *data)
 {
 	struct bcm_op *op = (struct bcm_op *)data;
-	const struct can_frame *rxframe = (struct can_frame *)skb->data;
+	const struct canfd_frame *rxframe = (struct canfd_frame *)skb->data;
 	unsigned int i;
 
-	/* disable timeout */
-	hrtimer_cancel(&op->timer);
+	/* CAN FD ops only handle CAN FD frames and vice versa */
+	if (skb->len != op->cfsiz)
+		return;
 
 	if (op->can_id != rxframe->can_id)
 		return;
@@ -783,7 +1541,7 @@ static void bcm_rx_handler(struct sk_buff *skb, void *data)
 
 	if (op->flags & RX_FILTER_ID) {
 		/* the easiest case */
-		bcm_rx_update_and_send(op, &op->last_frames[0], rxframe);
+		bcm_rx_update_and_send(op, op->last_frames, rxframe);
 		goto rx_starttimer;
 	}
 
@@ -801,14 +1559,9 @@ static void bcm_rx_handler(struct sk_buff *skb, void *data)
 		 * Remark: The MUX-mask is stored in index 0
 		 */
 
-		for (i = 1; i < op->nframes; i++) {
-			if ((GET_U64(&op->frames[0]) & GET_U64(rxframe)) ==
-			    (GET_U64(&op->frames[0]) &
-			     GET_U64(&op->frames[i]))) {
-				bcm_rx_cmp_to_index(op, i, rxframe);
-				break;
-			}
-		}
+		i = bcm_rx_mux_lookup(op, rxframe);
+		if (i)
+			bcm_rx_cmp_to_index(op, i, rxframe);
 	}
 
 rx_starttimer:
@@ -818,13 +1571,40 @@ rx_starttimer:
 /*
  * helpers for bcm_op handling: find & delete bcm [rx|tx] op elements
  */
-static struct bcm_op *bcm_find_op(struct list_head *ops, canid_t can_id,
-				  int ifindex)
+static inline struct hlist_head *bcm_op_head(struct hlist_head *hash,
+					     canid_t can_id, int ifindex)
 {
+	return &hash[jhash_2words(can_id, ifindex, 0) & (BCM_HASH_SIZE - 1)];
+}
+
+static void bcm_add_op(struct list_head *ops, struct hlist_head *hash,
+		       struct bcm_op *op)
+{
+	list_add(&op->list, ops);
+	hlist_add_head(&op->hnode, bcm_op_head(hash, op->can_id, op->ifindex));
+}
+
+static void bcm_del_op(struct bcm_op *op)
+{
+	list_del(&op->list);
+	hlist_del(&op->hnode);
+}
+
+static struct bcm_op *bcm_find_op(struct hlist_head *hash,
+				  struct bcm_msg_head *mh, int ifindex)
+{
+	struct hlist_head *head = bcm_op_head(hash, mh->can_id, ifindex);
 	struct bcm_op *op;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	struct hlist_node *n;
 
-	list_for_each_entry(op, ops, list) {
-		if ((op->can_id == can_id) && (op->ifindex == ifindex))
+	hlist_for_each_entry(op, n, head, hnode) {
+#else
+	hlist_for_each_entry(op, head, hnode) {
+#endif
+		/* CAN FD ops and classic CAN ops are separate */
+		if ((op->can_id == mh->can_id) && (op->ifindex == ifindex) &&
+		    (op->flags & CAN_FD_FRAME) == (mh->flags & CAN_FD_FRAME))
 			return op;
 	}
 
@@ -833,6 +1613,9 @@ static struct bcm_op *bcm_find_op(struct list_head *ops, canid_t can_id,
 
 static void bcm_remove_op(struct bcm_op *op)
 {
+	if (op->wheel)
+		bcm_wheel_put(op);
+
 	hrtimer_cancel(&op->timer);
 	hrtimer_cancel(&op->thrtimer);
 
@@ -848,6 +1631,8 @@ static void bcm_remove_op(struct bcm_op *op)
 	if ((op->last_frames) && (op->last_frames != &op->last_sframe))
 		kfree(op->last_frames);
 
+	kfree(op->mux_tbl);
+
 	kfree(op);
 
 	return;
@@ -856,8 +1641,8 @@ static void bcm_remove_op(struct bcm_op *op)
 static void bcm_rx_unreg(struct net_device *dev, struct bcm_op *op)
 {
 	if (op->rx_reg_dev == dev) {
-		can_rx_unregister(dev, op->can_id, REGMASK(op->can_id),
-				  bcm_rx_handler, op);
+		can_rx_unregister(dev_net(dev), dev, op->can_id,
+				  REGMASK(op->can_id), bcm_rx_handler, op);
 
 		/* mark as removed subscription */
 		op->rx_reg_dev = NULL;
@@ -869,73 +1654,65 @@ static void bcm_rx_unreg(struct net_device *dev, struct bcm_op *op)
 /*
  * bcm_delete_rx_op - find and remove a rx op (returns number of removed ops)
  */
-static int bcm_delete_rx_op(struct list_head *ops, canid_t can_id, int ifindex)
+static int bcm_delete_rx_op(struct hlist_head *hash, struct bcm_msg_head *mh,
+			    int ifindex)
 {
-	struct bcm_op *op, *n;
+	struct bcm_op *op = bcm_find_op(hash, mh, ifindex);
 
-	list_for_each_entry_safe(op, n, ops, list) {
-		if ((op->can_id == can_id) && (op->ifindex == ifindex)) {
+	if (!op)
+		return 0; /* not found */
 
-			/*
-			 * Don't care if we're bound or not (due to netdev
-			 * problems) can_rx_unregister() is always a save
-			 * thing to do here.
-			 */
-			if (op->ifindex) {
-				/*
-				 * Only remove subscriptions that had not
-				 * been removed due to NETDEV_UNREGISTER
-				 * in bcm_notifier()
-				 */
-				if (op->rx_reg_dev) {
-					struct net_device *dev;
-
-					dev = dev_get_by_index(&init_net,
-							       op->ifindex);
-					if (dev) {
-						bcm_rx_unreg(dev, op);
-						dev_put(dev);
-					}
-				}
-			} else
-				can_rx_unregister(NULL, op->can_id,
-						  REGMASK(op->can_id),
-						  bcm_rx_handler, op);
+	/*
+	 * Don't care if we're bound or not (due to netdev problems)
+	 * can_rx_unregister() is always a save thing to do here.
+	 */
+	if (op->ifindex) {
+		/*
+		 * Only remove subscriptions that had not
+		 * been removed due to NETDEV_UNREGISTER
+		 * in bcm_notifier()
+		 */
+		if (op->rx_reg_dev) {
+			struct net_device *dev;
 
-			list_del(&op->list);
-			bcm_remove_op(op);
-			return 1; /* done */
+			dev = dev_get_by_index(sock_net(op->sk), op->ifindex);
+			if (dev) {
+				bcm_rx_unreg(dev, op);
+				dev_put(dev);
+			}
 		}
-	}
+	} else
+		can_rx_unregister(sock_net(op->sk), NULL, op->can_id,
+				  REGMASK(op->can_id), bcm_rx_handler, op);
 
-	return 0; /* not found */
+	bcm_del_op(op);
+	bcm_remove_op(op);
+	return 1; /* done */
 }
 
 /*
  * bcm_delete_tx_op - find and remove a tx op (returns number of removed ops)
  */
-static int bcm_delete_tx_op(struct list_head *ops, canid_t can_id, int ifindex)
+static int bcm_delete_tx_op(struct hlist_head *hash, struct bcm_msg_head *mh,
+			    int ifindex)
 {
-	struct bcm_op *op, *n;
+	struct bcm_op *op = bcm_find_op(hash, mh, ifindex);
 
-	list_for_each_entry_safe(op, n, ops, list) {
-		if ((op->can_id == can_id) && (op->ifindex == ifindex)) {
-			list_del(&op->list);
-			bcm_remove_op(op);
-			return 1; /* done */
-		}
-	}
+	if (!op)
+		return 0; /* not found */
 
-	return 0; /* not found */
+	bcm_del_op(op);
+	bcm_remove_op(op);
+	return 1; /* done */
 }
 
 /*
  * bcm_read_op - read out a bcm_op and send it to the user (for bcm_sendmsg)
  */
-static int bcm_read_op(struct list_head *ops, struct bcm_msg_head *msg_head,
+static int bcm_read_op(struct hlist_head *hash, struct bcm_msg_head *msg_head,
 		       int ifindex)
 {
-	struct bcm_op *op = bcm_find_op(ops, msg_head->can_id, ifindex);
+	struct bcm_op *op = bcm_find_op(hash, msg_head, ifindex);
 
 	if (!op)
 		return -EINVAL;
@@ -952,6 +1729,52 @@ static int bcm_read_op(struct list_head *ops, struct bcm_msg_head *msg_head,
 	return MHSIZ;
 }
 
+/*
+ * bcm_read_stats - send the timing statistics of a tx op to the user
+ */
+static int bcm_read_stats(struct sock *sk, struct bcm_msg_head *msg_head,
+			  int ifindex)
+{
+	struct bcm_sock *bo = bcm_sk(sk);
+	struct bcm_op *op = bcm_find_op(bo->tx_hash, msg_head, ifindex);
+	struct bcm_tx_stats *st;
+	struct sockaddr_can *addr;
+	struct sk_buff *skb;
+
+	if (!op)
+		return -EINVAL;
+
+	skb = alloc_skb(MHSIZ + sizeof(*st), GFP_KERNEL);
+	if (!skb)
+		return -ENOMEM;
+
+	/* reply with the current values like TX_READ */
+	msg_head->opcode  = TX_STATS;
+	msg_head->flags   = op->flags;
+	msg_head->count   = op->count;
+	msg_head->ival1   = op->ival1;
+	msg_head->ival2   = op->ival2;
+	msg_head->nframes = 0;
+	memcpy(skb_put(skb, MHSIZ), msg_head, MHSIZ);
+
+	st = (struct bcm_tx_stats *)skb_put(skb, sizeof(*st));
+	memcpy(st, &op->stats, sizeof(*st));
+	st->avg_ns = bcm_tx_late_avg(op);
+
+	addr = (struct sockaddr_can *)skb->cb;
+	memset(addr, 0, sizeof(*addr));
+	addr->can_family  = AF_CAN;
+	addr->can_ifindex = op->ifindex;
+
+	/* keep the order of the notifications */
+	if (bo->kt_coalesce.tv64)
+		bcm_batch_flush(bo);
+
+	bcm_queue_skb(sk, skb);
+
+	return MHSIZ;
+}
+
 /*
  * bcm_tx_setup - create or update a bcm tx op (for bcm_sendmsg)
  */
@@ -960,6 +1783,7 @@ static int bcm_tx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 {
 	struct bcm_sock *bo = bcm_sk(sk);
 	struct bcm_op *op;
+	struct canfd_frame *cf;
 	unsigned int i;
 	int err;
 
@@ -972,7 +1796,7 @@ static int bcm_tx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 		return -EINVAL;
 
 	/* check the given can_id */
-	op = bcm_find_op(&bo->tx_ops, msg_head->can_id, ifindex);
+	op = bcm_find_op(bo->tx_hash, msg_head, ifindex);
 
 	if (op) {
 		/* update existing BCM operation */
@@ -987,18 +1811,24 @@ static int bcm_tx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 
 		/* update can_frames content */
 		for (i = 0; i < msg_head->nframes; i++) {
-			err = memcpy_fromiovec((u8 *)&op->frames[i],
-					       msg->msg_iov, CFSIZ);
-
-			if (op->frames[i].can_dlc > 8)
-				err = -EINVAL;
+			cf = op->frames + op->cfsiz * i;
+			err = memcpy_fromiovec((u8 *)cf, msg->msg_iov,
+					       op->cfsiz);
+
+			if (op->flags & CAN_FD_FRAME) {
+				if (cf->len > CANFD_MAX_DLEN)
+					err = -EINVAL;
+			} else {
+				if (cf->len > CAN_MAX_DLEN)
+					err = -EINVAL;
+			}
 
 			if (err < 0)
 				return err;
 
 			if (msg_head->flags & TX_CP_CAN_ID) {
 				/* copy can_id into frame */
-				op->frames[i].can_id = msg_head->can_id;
+				cf->can_id = msg_head->can_id;
 			}
 		}
 
@@ -1010,10 +1840,11 @@ static int bcm_tx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 			return -ENOMEM;
 
 		op->can_id    = msg_head->can_id;
+		op->cfsiz     = CFSIZ(msg_head->flags);
 
 		/* create array for can_frames and copy the data */
 		if (msg_head->nframes > 1) {
-			op->frames = kmalloc(msg_head->nframes * CFSIZ,
+			op->frames = kmalloc(msg_head->nframes * op->cfsiz,
 					     GFP_KERNEL);
 			if (!op->frames) {
 				kfree(op);
@@ -1023,11 +1854,17 @@ static int bcm_tx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 			op->frames = &op->sframe;
 
 		for (i = 0; i < msg_head->nframes; i++) {
-			err = memcpy_fromiovec((u8 *)&op->frames[i],
-					       msg->msg_iov, CFSIZ);
-
-			if (op->frames[i].can_dlc > 8)
-				err = -EINVAL;
+			cf = op->frames + op->cfsiz * i;
+			err = memcpy_fromiovec((u8 *)cf, msg->msg_iov,
+					       op->cfsiz);
+
+			if (msg_head->flags & CAN_FD_FRAME) {
+				if (cf->len > CANFD_MAX_DLEN)
+					err = -EINVAL;
+			} else {
+				if (cf->len > CAN_MAX_DLEN)
+					err = -EINVAL;
+			}
 
 			if (err < 0) {
 				if (op->frames != &op->sframe)
@@ -1038,7 +1875,7 @@ static int bcm_tx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 
 			if (msg_head->flags & TX_CP_CAN_ID) {
 				/* copy can_id into frame */
-				op->frames[i].can_id = msg_head->can_id;
+				cf->can_id = msg_head->can_id;
 			}
 		}
 
@@ -1053,6 +1890,10 @@ static int bcm_tx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 		hrtimer_init(&op->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 		op->timer.function = bcm_tx_timeout_handler;
 
+		/* cyclic transmission from the shared timer wheel? */
+		INIT_LIST_HEAD(&op->wlist);
+		op->wheel = bcm_wheel_get(sock_net(sk), ifindex);
+
 		/* initialize tasklet for tx countevent notification */
 		tasklet_init(&op->tsklet, bcm_tx_timeout_tsklet,
 			     (unsigned long) op);
@@ -1061,9 +1902,9 @@ static int bcm_tx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 		hrtimer_init(&op->thrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 
 		/* add this bcm_op to the list of the tx_ops */
-		list_add(&op->list, &bo->tx_ops);
+		bcm_add_op(&bo->tx_ops, bo->tx_hash, op);
 
-	} /* if ((op = bcm_find_op(&bo->tx_ops, msg_head->can_id, ifindex))) */
+	} /* if ((op = bcm_find_op(bo->tx_hash, msg_head, ifindex))) */
 
 	if (op->nframes != msg_head->nframes) {
 		op->nframes   = msg_head->nframes;
@@ -1087,14 +1928,19 @@ static int bcm_tx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 		op->ival2 = msg_head->ival2;
 		op->kt_ival1 = timeval_to_ktime(msg_head->ival1);
 		op->kt_ival2 = timeval_to_ktime(msg_head->ival2);
+		bcm_tx_reset_stats(op);
 
 		/* disable an active timer due to zero values? */
 		if (!op->kt_ival1.tv64 && !op->kt_ival2.tv64)
-			hrtimer_cancel(&op->timer);
+			bcm_tx_stop_timer(op);
 	}
 
+	/* cyclic transmission => provide the skbs outside the timer context */
+	if (op->kt_ival1.tv64 || op->kt_ival2.tv64)
+		bcm_tx_pool_fill(bo);
+
 	if (op->flags & STARTTIMER) {
-		hrtimer_cancel(&op->timer);
+		bcm_tx_stop_timer(op);
 		/* spec: send can_frame when starting timer */
 		op->flags |= TX_ANNOUNCE;
 	}
@@ -1108,7 +1954,7 @@ static int bcm_tx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 	if (op->flags & STARTTIMER)
 		bcm_tx_start_timer(op);
 
-	return msg_head->nframes * CFSIZ + MHSIZ;
+	return msg_head->nframes * op->cfsiz + MHSIZ;
 }
 
 /*
@@ -1139,7 +1985,7 @@ static int bcm_rx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 		return -EINVAL;
 
 	/* check the given can_id */
-	op = bcm_find_op(&bo->rx_ops, msg_head->can_id, ifindex);
+	op = bcm_find_op(bo->rx_hash, msg_head, ifindex);
 	if (op) {
 		/* update existing BCM operation */
 
@@ -1155,12 +2001,13 @@ static int bcm_rx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 			/* update can_frames content */
 			err = memcpy_fromiovec((u8 *)op->frames,
 					       msg->msg_iov,
-					       msg_head->nframes * CFSIZ);
+					       msg_head->nframes * op->cfsiz);
 			if (err < 0)
 				return err;
 
 			/* clear last_frames to indicate 'nothing received' */
-			memset(op->last_frames, 0, msg_head->nframes * CFSIZ);
+			memset(op->last_frames, 0,
+			       msg_head->nframes * op->cfsiz);
 		}
 
 		op->nframes = msg_head->nframes;
@@ -1176,10 +2023,11 @@ static int bcm_rx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 
 		op->can_id    = msg_head->can_id;
 		op->nframes   = msg_head->nframes;
+		op->cfsiz     = CFSIZ(msg_head->flags);
 
 		if (msg_head->nframes > 1) {
 			/* create array for can_frames and copy the data */
-			op->frames = kmalloc(msg_head->nframes * CFSIZ,
+			op->frames = kmalloc(msg_head->nframes * op->cfsiz,
 					     GFP_KERNEL);
 			if (!op->frames) {
 				kfree(op);
@@ -1187,7 +2035,7 @@ static int bcm_rx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 			}
 
 			/* create and init array for received can_frames */
-			op->last_frames = kzalloc(msg_head->nframes * CFSIZ,
+			op->last_frames = kzalloc(msg_head->nframes * op->cfsiz,
 						  GFP_KERNEL);
 			if (!op->last_frames) {
 				kfree(op->frames);
@@ -1195,6 +2043,16 @@ static int bcm_rx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 				return -ENOMEM;
 			}
 
+			/* create lookup table for the multiplex index */
+			op->mux_tbl = kmalloc(BCM_MUX_SIZE *
+					      sizeof(*op->mux_tbl), GFP_KERNEL);
+			if (!op->mux_tbl) {
+				kfree(op->last_frames);
+				kfree(op->frames);
+				kfree(op);
+				return -ENOMEM;
+			}
+
 		} else {
 			op->frames = &op->sframe;
 			op->last_frames = &op->last_sframe;
@@ -1202,12 +2060,13 @@ static int bcm_rx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 
 		if (msg_head->nframes) {
 			err = memcpy_fromiovec((u8 *)op->frames, msg->msg_iov,
-					       msg_head->nframes * CFSIZ);
+					       msg_head->nframes * op->cfsiz);
 			if (err < 0) {
 				if (op->frames != &op->sframe)
 					kfree(op->frames);
 				if (op->last_frames != &op->last_sframe)
 					kfree(op->last_frames);
+				kfree(op->mux_tbl);
 				kfree(op);
 				return err;
 			}
@@ -1233,21 +2092,25 @@ static int bcm_rx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 			     (unsigned long) op);
 
 		/* add this bcm_op to the list of the rx_ops */
-		list_add(&op->list, &bo->rx_ops);
+		bcm_add_op(&bo->rx_ops, bo->rx_hash, op);
 
 		/* call can_rx_register() */
 		do_rx_register = 1;
 
-	} /* if ((op = bcm_find_op(&bo->rx_ops, msg_head->can_id, ifindex))) */
+	} /* if ((op = bcm_find_op(bo->rx_hash, msg_head, ifindex))) */
 
 	/* check flags */
 	op->flags = msg_head->flags;
 
+	if (op->mux_tbl)
+		bcm_rx_mux_build(op);
+
 	if (op->flags & RX_RTR_FRAME) {
+		struct canfd_frame *frame0 = op->frames;
 
 		/* no timers in RTR-mode */
 		hrtimer_cancel(&op->thrtimer);
-		hrtimer_cancel(&op->timer);
+		bcm_rx_stoptimer(op);
 
 		/*
 		 * funny feature in RX(!)_SETUP only for RTR-mode:
@@ -1255,8 +2118,8 @@ static int bcm_rx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 		 * prevent a full-load-loopback-test ... ;-]
 		 */
 		if ((op->flags & TX_CP_CAN_ID) ||
-		    (op->frames[0].can_id == op->can_id))
-			op->frames[0].can_id = op->can_id & ~CAN_RTR_FLAG;
+		    (frame0->can_id == op->can_id))
+			frame0->can_id = op->can_id & ~CAN_RTR_FLAG;
 
 	} else {
 		if (op->flags & SETTIMER) {
@@ -1269,7 +2132,7 @@ static int bcm_rx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 
 			/* disable an active timer due to zero value? */
 			if (!op->kt_ival1.tv64)
-				hrtimer_cancel(&op->timer);
+				bcm_rx_stoptimer(op);
 
 			/*
 			 * In any case cancel the throttle timer, flush
@@ -1280,9 +2143,12 @@ static int bcm_rx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 			bcm_rx_thr_flush(op, 1);
 		}
 
-		if ((op->flags & STARTTIMER) && op->kt_ival1.tv64)
+		if ((op->flags & STARTTIMER) && op->kt_ival1.tv64) {
+			op->kt_lastrx = ktime_get();
+			op->rx_armed = 1;
 			hrtimer_start(&op->timer, op->kt_ival1,
 				      HRTIMER_MODE_REL);
+		}
 	}
 
 	/* now we can register for can_ids, if we added a new bcm_op */
@@ -1290,9 +2156,10 @@ static int bcm_rx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 		if (ifindex) {
 			struct net_device *dev;
 
-			dev = dev_get_by_index(&init_net, ifindex);
+			dev = dev_get_by_index(sock_net(sk), ifindex);
 			if (dev) {
-				err = can_rx_register(dev, op->can_id,
+				err = can_rx_register(sock_net(sk), dev,
+						      op->can_id,
 						      REGMASK(op->can_id),
 						      bcm_rx_handler, op,
 						      "bcm");
@@ -1302,24 +2169,25 @@ static int bcm_rx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 			}
 
 		} else
-			err = can_rx_register(NULL, op->can_id,
+			err = can_rx_register(sock_net(sk), NULL, op->can_id,
 					      REGMASK(op->can_id),
 					      bcm_rx_handler, op, "bcm");
 		if (err) {
 			/* this bcm rx op is broken -> remove it */
-			list_del(&op->list);
+			bcm_del_op(op);
 			bcm_remove_op(op);
 			return err;
 		}
 	}
 
-	return msg_head->nframes * CFSIZ + MHSIZ;
+	return msg_head->nframes * op->cfsiz + MHSIZ;
 }
 
 /*
  * bcm_tx_send - send a single CAN frame to the CAN interface (for bcm_sendmsg)
  */
-static int bcm_tx_send(struct msghdr *msg, int ifindex, struct sock *sk)
+static int bcm_tx_send(struct msghdr *msg, int ifindex, struct sock *sk,
+		       int cfsiz)
 {
 	struct sk_buff *skb;
 	struct net_device *dev;
@@ -1329,18 +2197,18 @@ static int bcm_tx_send(struct msghdr *msg, int ifindex, struct sock *sk)
 	if (!ifindex)
 		return -ENODEV;
 
-	skb = alloc_skb(CFSIZ, GFP_KERNEL);
+	skb = alloc_skb(cfsiz, GFP_KERNEL);
 
 	if (!skb)
 		return -ENOMEM;
 
-	err = memcpy_fromiovec(skb_put(skb, CFSIZ), msg->msg_iov, CFSIZ);
+	err = memcpy_fromiovec(skb_put(skb, cfsiz), msg->msg_iov, cfsiz);
 	if (err < 0) {
 		kfree_skb(skb);
 		return err;
 	}
 
-	dev = dev_get_by_index(&init_net, ifindex);
+	dev = dev_get_by_index(sock_net(sk), ifindex);
 	if (!dev) {
 		kfree_skb(skb);
 		return -ENODEV;
@@ -1354,7 +2222,7 @@ static int bcm_tx_send(struct msghdr *msg, int ifindex, struct sock *sk)
 	if (err)
 		return err;
 
-	return CFSIZ + MHSIZ;
+	return cfsiz + MHSIZ;
 }
 
 /*
@@ -1367,13 +2235,14 @@ static int bcm_sendmsg(struct kiocb *iocb, struct socket *sock,
 	struct bcm_sock *bo = bcm_sk(sk);
 	int ifindex = bo->ifindex; /* default ifindex for this bcm_op */
 	struct bcm_msg_head msg_head;
+	int cfsiz;
 	int ret; /* read bytes or error codes as return value */
 
 	if (!bo->bound)
 		return -ENOTCONN;
 
 	/* check for valid message length from userspace */
-	if (size < MHSIZ || (size - MHSIZ) % CFSIZ)
+	if (size < MHSIZ)
 		return -EINVAL;
 
 	/* check for alternative ifindex for this bcm_op */
@@ -1395,7 +2264,7 @@ static int bcm_sendmsg(struct kiocb *iocb, struct socket *sock,
 		if (ifindex) {
 			struct net_device *dev;
 
-			dev = dev_get_by_index(&init_net, ifindex);
+			dev = dev_get_by_index(sock_net(sk), ifindex);
 			if (!dev)
 				return -ENODEV;
 
@@ -1414,6 +2283,11 @@ static int bcm_sendmsg(struct kiocb *iocb, struct socket *sock,
 	if (ret < 0)
 		return ret;
 
+	/* the appended frames are classic CAN or CAN FD frames */
+	cfsiz = CFSIZ(msg_head.flags);
+	if ((size - MHSIZ) % cfsiz)
+		return -EINVAL;
+
 	lock_sock(sk);
 
 	switch (msg_head.opcode) {
@@ -1427,14 +2301,14 @@ static int bcm_sendmsg(struct kiocb *iocb, struct socket *sock,
 		break;
 
 	case TX_DELETE:
-		if (bcm_delete_tx_op(&bo->tx_ops, msg_head.can_id, ifindex))
+		if (bcm_delete_tx_op(bo->tx_hash, &msg_head, ifindex))
 			ret = MHSIZ;
 		else
 			ret = -EINVAL;
 		break;
 
 	case RX_DELETE:
-		if (bcm_delete_rx_op(&bo->rx_ops, msg_head.can_id, ifindex))
+		if (bcm_delete_rx_op(bo->rx_hash, &msg_head, ifindex))
 			ret = MHSIZ;
 		else
 			ret = -EINVAL;
@@ -1443,21 +2317,26 @@ static int bcm_sendmsg(struct kiocb *iocb, struct socket *sock,
 	case TX_READ:
 		/* reuse msg_head for the reply to TX_READ */
 		msg_head.opcode  = TX_STATUS;
-		ret = bcm_read_op(&bo->tx_ops, &msg_head, ifindex);
+		ret = bcm_read_op(bo->tx_hash, &msg_head, ifindex);
 		break;
 
 	case RX_READ:
 		/* reuse msg_head for the reply to RX_READ */
 		msg_head.opcode  = RX_STATUS;
-		ret = bcm_read_op(&bo->rx_ops, &msg_head, ifindex);
+		ret = bcm_read_op(bo->rx_hash, &msg_head, ifindex);
+		break;
+
+	case TX_READ_STATS:
+		/* reuse msg_head for the reply to TX_READ_STATS */
+		ret = bcm_read_stats(sk, &msg_head, ifindex);
 		break;
 
 	case TX_SEND:
 		/* we need exactly one can_frame behind the msg head */
-		if ((msg_head.nframes != 1) || (size != CFSIZ + MHSIZ))
+		if ((msg_head.nframes != 1) || (size != cfsiz + MHSIZ))
 			ret = -EINVAL;
 		else
-			ret = bcm_tx_send(msg, ifindex, sk);
+			ret = bcm_tx_send(msg, ifindex, sk, cfsiz);
 		break;
 
 	default:
@@ -1483,10 +2362,10 @@ static int bcm_notifier(struct notifier_block *nb, unsigned long msg,
 	int notify_enodev = 0;
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
-	if (!net_eq(dev_net(dev), &init_net))
+	if (!net_eq(dev_net(dev), sock_net(sk)))
 		return NOTIFY_DONE;
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
-	if (dev->nd_net != &init_net)
+	if (dev->nd_net != sock_net(sk))
 		return NOTIFY_DONE;
 #endif
 
@@ -1536,15 +2415,34 @@ static int bcm_notifier(struct notifier_block *nb, unsigned long msg,
 static int bcm_init(struct sock *sk)
 {
 	struct bcm_sock *bo = bcm_sk(sk);
+	int i;
 
 	bo->bound            = 0;
 	bo->ifindex          = 0;
 	bo->dropped_usr_msgs = 0;
 	bo->bcm_proc_read    = NULL;
+	bo->kt_coalesce      = ktime_set(0, 0);
+	bo->batch            = NULL;
+
+	spin_lock_init(&bo->batch_lock);
+	hrtimer_init(&bo->batch_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	bo->batch_timer.function = bcm_batch_timeout_handler;
+	tasklet_init(&bo->batch_tsklet, bcm_batch_tsklet, (unsigned long)bo);
 
 	INIT_LIST_HEAD(&bo->tx_ops);
 	INIT_LIST_HEAD(&bo->rx_ops);
 
+	for (i = 0; i < BCM_HASH_SIZE; i++) {
+		INIT_HLIST_HEAD(&bo->tx_hash[i]);
+		INIT_HLIST_HEAD(&bo->rx_hash[i]);
+	}
+
+	skb_queue_head_init(&bo->tx_pool);
+	INIT_WORK(&bo->tx_pool_work, bcm_tx_pool_work);
+
+	bo->data_ready = sk->sk_data_ready;
+	sk->sk_data_ready = bcm_data_ready;
+
 	/* set notifier */
 	bo->notifier.notifier_call = bcm_notifier;
 
@@ -1590,20 +2488,31 @@ static int bcm_release(struct socket *sock)
 			if (op->rx_reg_dev) {
 				struct net_device *dev;
 
-				dev = dev_get_by_index(&init_net, op->ifindex);
+				dev = dev_get_by_index(sock_net(sk),
+						       op->ifindex);
 				if (dev) {
 					bcm_rx_unreg(dev, op);
 					dev_put(dev);
 				}
 			}
 		} else
-			can_rx_unregister(NULL, op->can_id,
+			can_rx_unregister(sock_net(sk), NULL, op->can_id,
 					  REGMASK(op->can_id),
 					  bcm_rx_handler, op);
 
 		bcm_remove_op(op);
 	}
 
+	/* no more cyclic transmissions => release the skb pool */
+	cancel_work_sync(&bo->tx_pool_work);
+	skb_queue_purge(&bo->tx_pool);
+
+	/* no more notifications => drop the coalesced ones */
+	hrtimer_cancel(&bo->batch_timer);
+	tasklet_kill(&bo->batch_tsklet);
+	kfree_skb(bo->batch);
+	bo->batch = NULL;
+
 	/* remove procfs entry */
 	if (proc_dir && bo->bcm_proc_read)
 		remove_proc_entry(bo->procname, proc_dir);
@@ -1640,7 +2549,7 @@ static int bcm_connect(struct socket *sock, struct sockaddr *uaddr, int len,
 	if (addr->can_ifindex) {
 		struct net_device *dev;
 
-		dev = dev_get_by_index(&init_net, addr->can_ifindex);
+		dev = dev_get_by_index(sock_net(sk), addr->can_ifindex);
 		if (!dev)
 			return -ENODEV;
 
@@ -1712,6 +2621,91 @@ static int bcm_recvmsg(struct kiocb *iocb, struct socket *sock,
 	return size;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
+static int bcm_setsockopt(struct socket *sock, int level, int optname,
+			  char __user *optval, unsigned int optlen)
+#else
+static int bcm_setsockopt(struct socket *sock, int level, int optname,
+			  char __user *optval, int optlen)
+#endif
+{
+	struct sock *sk = sock->sk;
+	struct bcm_sock *bo = bcm_sk(sk);
+	struct timeval tv;
+
+	if (level != SOL_CAN_BCM)
+		return -EINVAL;
+	if (optlen < 0)
+		return -EINVAL;
+
+	switch (optname) {
+
+	case CAN_BCM_COALESCE:
+		if (optlen != sizeof(tv))
+			return -EINVAL;
+
+		if (copy_from_user(&tv, optval, optlen))
+			return -EFAULT;
+
+		if (tv.tv_sec < 0 || tv.tv_usec < 0 ||
+		    tv.tv_usec >= USEC_PER_SEC)
+			return -EINVAL;
+
+		lock_sock(sk);
+
+		spin_lock_bh(&bo->batch_lock);
+		bo->coalesce = tv;
+		bo->kt_coalesce = timeval_to_ktime(tv);
+		spin_unlock_bh(&bo->batch_lock);
+
+		/* deliver what has been collected with the former window */
+		hrtimer_cancel(&bo->batch_timer);
+		bcm_batch_flush(bo);
+
+		release_sock(sk);
+		break;
+
+	default:
+		return -ENOPROTOOPT;
+	}
+
+	return 0;
+}
+
+static int bcm_getsockopt(struct socket *sock, int level, int optname,
+			  char __user *optval, int __user *optlen)
+{
+	struct sock *sk = sock->sk;
+	struct bcm_sock *bo = bcm_sk(sk);
+	int len;
+	void *val;
+
+	if (level != SOL_CAN_BCM)
+		return -EINVAL;
+	if (get_user(len, optlen))
+		return -EFAULT;
+	if (len < 0)
+		return -EINVAL;
+
+	switch (optname) {
+
+	case CAN_BCM_COALESCE:
+		if (len > sizeof(struct timeval))
+			len = sizeof(struct timeval);
+		val = &bo->coalesce;
+		break;
+
+	default:
+		return -ENOPROTOOPT;
+	}
+
+	if (put_user(len, optlen))
+		return -EFAULT;
+	if (copy_to_user(optval, val, len))
+		return -EFAULT;
+	return 0;
+}
+
 static const struct proto_ops bcm_ops = {
 	.family        = PF_CAN,
 	.release       = bcm_release,
@@ -1724,8 +2718,8 @@ static const struct proto_ops bcm_ops = {
 	.ioctl         = can_ioctl,	/* use can_ioctl() from af_can.c */
 	.listen        = sock_no_listen,
 	.shutdown      = sock_no_shutdown,
-	.setsockopt    = sock_no_setsockopt,
-	.getsockopt    = sock_no_getsockopt,
+	.setsockopt    = bcm_setsockopt,
+	.getsockopt    = bcm_getsockopt,
 	.sendmsg       = bcm_sendmsg,
 	.recvmsg       = bcm_recvmsg,
 	.mmap          = sock_no_mmap,
@@ -1761,6 +2755,8 @@ static int __init bcm_module_init(void)
 		return err;
 	}
 
+	register_netdevice_notifier(&bcm_wheel_nb);
+
 	/* create /proc/net/can-bcm directory */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
 	proc_dir = proc_mkdir("can-bcm", init_net.proc_net);
@@ -1780,6 +2776,8 @@ static void __exit bcm_module_exit(void)
 {
 	can_proto_unregister(&bcm_can_proto);
 
+	unregister_netdevice_notifier(&bcm_wheel_nb);
+
 	if (proc_dir)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
 		remove_proc_entry("can-bcm", init_net.proc_net);
@@ -0,0 +1,487 @@
+/*
+ * can_bench.c - benchmark of the receive dispatch path of the PF_CAN core
+ *
+ * The module creates the dummy CAN interface canbench0, registers a mix of
+ * receivers on it and injects synthetic frames with netif_receive_skb() on
+ * one or more CPUs. The results (ns/frame, frames/s, matches/s) are printed
+ * to the kernel log, then the receivers and the interface are removed
+ * again. For another run the module has to be reloaded, e.g.
+ *
+ *   insmod can-bench.ko cpus=2 n_sff=64 n_eff=256 eff_pct=50
+ *
+ * Without any receivers the run measures the overhead of the network stack
+ * and of can_rcv() itself, which is the baseline for the receiver numbers.
+ * Keep other sockets off canbench0 (candump) as they add to the figures.
+ *
+ * Copyright (c) 2002-2007 Volkswagen Group Electronic Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Volkswagen nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * Alternatively, provided that this notice is retained in full, this
+ * software may be distributed under the terms of the GNU General
+ * Public License ("GPL") version 2, in which case the provisions of the
+ * GPL apply INSTEAD OF those given above.
+ *
+ * The provided data structures and external interfaces from this code
+ * are not restricted to be used by modules with a GPL compatible license.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * Send feedback to <socketcan-users@lists.berlios.de>
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/netdevice.h>
+#include <linux/if_arp.h>
+#include <linux/skbuff.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/math64.h>
+#include <socketcan/can.h>
+#include <socketcan/can/core.h>
+#include <socketcan/can/error.h>
+#include <net/net_namespace.h>
+
+#include <socketcan/can/version.h> /* for RCSID. Removed by mkpatch script */
+RCSID("$Id$");
+
+static __initdata const char banner[] = KERN_INFO
+	"can: receive path benchmark (" CAN_VERSION_STRING ")\n";
+
+MODULE_DESCRIPTION("PF_CAN receive path benchmark");
+MODULE_LICENSE("Dual BSD/GPL");
+
+/* frames between two points to leave the bh disabled section */
+#define CAN_BENCH_BATCH 64
+
+static unsigned int frames __read_mostly = 1000000;
+module_param(frames, uint, S_IRUGO);
+MODULE_PARM_DESC(frames, "frames to inject per CPU (default:1000000)");
+
+static int cpus __read_mostly = 1;
+module_param(cpus, int, S_IRUGO);
+MODULE_PARM_DESC(cpus, "number of CPUs injecting in parallel, 0 for all "
+		 "online CPUs (default:1)");
+
+static unsigned int pool __read_mostly = 256;
+module_param(pool, uint, S_IRUGO);
+MODULE_PARM_DESC(pool, "different frames injected in a round robin per CPU "
+		 "(default:256)");
+
+static unsigned int eff_pct __read_mostly;
+module_param(eff_pct, uint, S_IRUGO);
+MODULE_PARM_DESC(eff_pct, "percentage of EFF frames (default:0)");
+
+static unsigned int err_pct __read_mostly;
+module_param(err_pct, uint, S_IRUGO);
+MODULE_PARM_DESC(err_pct, "percentage of error frames (default:0)");
+
+/* the receiver mix, see find_rcv_list() for the receive lists */
+static unsigned int n_all __read_mostly;
+module_param(n_all, uint, S_IRUGO);
+MODULE_PARM_DESC(n_all, "receivers for all frames (mask 0)");
+
+static unsigned int n_fil __read_mostly;
+module_param(n_fil, uint, S_IRUGO);
+MODULE_PARM_DESC(n_fil, "masked receivers (mask 0x700)");
+
+static unsigned int n_inv __read_mostly;
+module_param(n_inv, uint, S_IRUGO);
+MODULE_PARM_DESC(n_inv, "inverted receivers (CAN_INV_FILTER)");
+
+static unsigned int n_sff __read_mostly;
+module_param(n_sff, uint, S_IRUGO);
+MODULE_PARM_DESC(n_sff, "receivers for single SFF identifiers");
+
+static unsigned int n_eff __read_mostly;
+module_param(n_eff, uint, S_IRUGO);
+MODULE_PARM_DESC(n_eff, "receivers for single EFF identifiers");
+
+static unsigned int n_err __read_mostly;
+module_param(n_err, uint, S_IRUGO);
+MODULE_PARM_DESC(n_err, "receivers for all error frames");
+
+struct can_bench_thread {
+	struct task_struct *task;
+	int cpu;
+	int err;
+	u64 nsecs;
+	unsigned long matches;
+};
+
+static struct net_device *can_bench_dev;
+static struct can_filter *can_bench_filters;
+static unsigned int can_bench_rcvs;
+static DEFINE_PER_CPU(unsigned long, can_bench_matches);
+static DECLARE_COMPLETION(can_bench_start);
+static DECLARE_COMPLETION(can_bench_done);
+static atomic_t can_bench_running;
+
+/* the receiver callback only counts: can_receive() is what gets measured */
+static void can_bench_rcv(struct sk_buff *skb, void *data)
+{
+	per_cpu(can_bench_matches, smp_processor_id())++;
+}
+
+/*
+ * The SFF frames are evenly distributed over the 2048 identifiers. The EFF
+ * identifiers are taken from 0 .. 2 * n_eff - 1, so half of the EFF frames
+ * hit one of the EFF receivers. The error frames carry one error class.
+ */
+static canid_t can_bench_frame_id(u32 r)
+{
+	unsigned int pct = (r >> 16) % 100;
+
+	if (pct < err_pct)
+		return CAN_ERR_FLAG | (1 << (r % 9));
+
+	if (pct < err_pct + eff_pct) {
+		if (n_eff)
+			return CAN_EFF_FLAG | (r % (2 * n_eff));
+		return CAN_EFF_FLAG | (r & CAN_EFF_MASK);
+	}
+
+	return r & CAN_SFF_MASK;
+}
+
+static struct sk_buff *can_bench_alloc_skb(canid_t can_id)
+{
+	struct sk_buff *skb;
+	struct can_frame *cf;
+
+	skb = alloc_skb(CAN_MTU, GFP_KERNEL);
+	if (!skb)
+		return NULL;
+
+	skb->dev = can_bench_dev;
+	skb->protocol = htons(ETH_P_CAN);
+	skb->pkt_type = PACKET_BROADCAST;
+	skb->ip_summed = CHECKSUM_UNNECESSARY;
+
+	cf = (struct can_frame *)skb_put(skb, CAN_MTU);
+	memset(cf, 0, CAN_MTU);
+	cf->can_id = can_id;
+	cf->can_dlc = (can_id & CAN_ERR_FLAG) ? CAN_ERR_DLC : 8;
+
+	return skb;
+}
+
+static int can_bench_thread_fn(void *data)
+{
+	struct can_bench_thread *t = data;
+	struct sk_buff **skbs;
+	u32 r = 0x9e3779b9 * (t->cpu + 1);
+	unsigned int i, j;
+	ktime_t start;
+
+	skbs = kcalloc(pool, sizeof(*skbs), GFP_KERNEL);
+	if (!skbs) {
+		t->err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < pool; i++) {
+		r = r * 1664525 + 1013904223;
+		skbs[i] = can_bench_alloc_skb(can_bench_frame_id(r));
+		if (!skbs[i]) {
+			t->err = -ENOMEM;
+			goto out_free;
+		}
+	}
+
+	wait_for_completion(&can_bench_start);
+
+	per_cpu(can_bench_matches, t->cpu) = 0;
+	start = ktime_get();
+
+	/*
+	 * The receive path runs in softirq context on a real interface. Every
+	 * injection takes an extra reference of the pool skb, that is
+	 * consumed by can_rcv() then.
+	 */
+	for (i = 0, j = 0; i < frames; ) {
+		unsigned int n = min_t(unsigned int, frames - i,
+				       CAN_BENCH_BATCH);
+
+		local_bh_disable();
+		for (i += n; n; n--) {
+			netif_receive_skb(skb_get(skbs[j]));
+			if (++j == pool)
+				j = 0;
+		}
+		local_bh_enable();
+		cond_resched();
+	}
+
+	t->nsecs = ktime_to_ns(ktime_sub(ktime_get(), start));
+	t->matches = per_cpu(can_bench_matches, t->cpu);
+
+ out_free:
+	for (i = 0; i < pool && skbs[i]; i++)
+		kfree_skb(skbs[i]);
+	kfree(skbs);
+ out:
+	if (atomic_dec_and_test(&can_bench_running))
+		complete(&can_bench_done);
+
+	return 0;
+}
+
+/* a frame sent on canbench0 (e.g. by cansend) is just dropped */
+static int can_bench_tx(struct sk_buff *skb, struct net_device *dev)
+{
+	kfree_skb(skb);
+	return NETDEV_TX_OK;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+static const struct net_device_ops can_bench_netdev_ops = {
+	.ndo_start_xmit = can_bench_tx,
+};
+#endif
+
+static void can_bench_setup(struct net_device *dev)
+{
+	dev->type		= ARPHRD_CAN;
+	dev->mtu		= CAN_MTU;
+	dev->hard_header_len	= 0;
+	dev->addr_len		= 0;
+	dev->tx_queue_len	= 0;
+	dev->flags		= IFF_NOARP;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+	dev->netdev_ops		= &can_bench_netdev_ops;
+#else
+	dev->hard_start_xmit	= can_bench_tx;
+#endif
+}
+
+static int can_bench_add_rcv(canid_t can_id, canid_t mask)
+{
+	struct can_filter *f = &can_bench_filters[can_bench_rcvs];
+	int err;
+
+	f->can_id = can_id;
+	f->can_mask = mask;
+
+	/* the filter address makes each receiver unique for unregistering */
+	err = can_rx_register(&init_net, can_bench_dev, can_id, mask,
+			      can_bench_rcv, f, "bench");
+	if (!err)
+		can_bench_rcvs++;
+
+	return err;
+}
+
+static void can_bench_del_rcvs(void)
+{
+	struct can_filter *f;
+
+	while (can_bench_rcvs) {
+		f = &can_bench_filters[--can_bench_rcvs];
+		can_rx_unregister(&init_net, can_bench_dev, f->can_id,
+				  f->can_mask, can_bench_rcv, f);
+	}
+}
+
+static int can_bench_add_rcvs(void)
+{
+	const canid_t sff_mask = CAN_SFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+	const canid_t eff_mask = CAN_EFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+	unsigned int i;
+	int err = 0;
+
+	for (i = 0; !err && i < n_all; i++)
+		err = can_bench_add_rcv(0, 0);
+
+	for (i = 0; !err && i < n_fil; i++)
+		err = can_bench_add_rcv((i << 8) & 0x700, 0x700);
+
+	for (i = 0; !err && i < n_inv; i++)
+		err = can_bench_add_rcv((i & CAN_SFF_MASK) | CAN_INV_FILTER,
+					CAN_SFF_MASK);
+
+	for (i = 0; !err && i < n_sff; i++)
+		err = can_bench_add_rcv(i & CAN_SFF_MASK, sff_mask);
+
+	for (i = 0; !err && i < n_eff; i++)
+		err = can_bench_add_rcv(CAN_EFF_FLAG | (i & CAN_EFF_MASK),
+					eff_mask);
+
+	for (i = 0; !err && i < n_err; i++)
+		err = can_bench_add_rcv(0, CAN_ERR_FLAG | CAN_ERR_MASK);
+
+	return err;
+}
+
+static int can_bench_run(void)
+{
+	struct can_bench_thread *threads;
+	u64 nsecs = 0, total = 0, matches = 0;
+	int cpu, n = 0, started = 0, err = 0;
+	int i;
+
+	if (cpus <= 0 || cpus > num_online_cpus())
+		cpus = num_online_cpus();
+
+	threads = kcalloc(cpus, sizeof(*threads), GFP_KERNEL);
+	if (!threads)
+		return -ENOMEM;
+
+	for_each_online_cpu(cpu) {
+		struct can_bench_thread *t = &threads[n];
+
+		if (n == cpus)
+			break;
+
+		t->cpu = cpu;
+		t->task = kthread_create(can_bench_thread_fn, t,
+					 "can_bench/%d", cpu);
+		if (IS_ERR(t->task)) {
+			err = PTR_ERR(t->task);
+			break;
+		}
+		kthread_bind(t->task, cpu);
+		n++;
+	}
+
+	if (err) {
+		/* the threads did not run yet and exit without calling fn */
+		for (i = 0; i < n; i++)
+			kthread_stop(threads[i].task);
+		goto out;
+	}
+
+	atomic_set(&can_bench_running, n);
+	for (i = 0; i < n; i++)
+		wake_up_process(threads[i].task);
+	started = 1;
+
+	/* let all threads enter the measurement at the same time */
+	complete_all(&can_bench_start);
+	wait_for_completion(&can_bench_done);
+
+	for (i = 0; i < n; i++) {
+		struct can_bench_thread *t = &threads[i];
+
+		if (t->err) {
+			err = t->err;
+			continue;
+		}
+
+		printk(KERN_INFO "can_bench: cpu %d: %u frames in %llu ns "
+		       "(%llu ns/frame), %lu matches\n", t->cpu, frames,
+		       (unsigned long long)t->nsecs,
+		       (unsigned long long)div64_u64(t->nsecs, frames),
+		       t->matches);
+
+		nsecs = max(nsecs, t->nsecs);
+		total += frames;
+		matches += t->matches;
+	}
+
+	if (nsecs && total)
+		printk(KERN_INFO "can_bench: %u receivers, %d cpus: "
+		       "%llu ns/frame, %llu frames/s, %llu matches/s\n",
+		       can_bench_rcvs, n,
+		       (unsigned long long)div64_u64(nsecs * n, total),
+		       (unsigned long long)div64_u64(total * NSEC_PER_SEC,
+						     nsecs),
+		       (unsigned long long)div64_u64(matches * NSEC_PER_SEC,
+						     nsecs));
+
+ out:
+	kfree(threads);
+
+	if (!started)
+		printk(KERN_ERR "can_bench: can't start threads (%d)\n", err);
+
+	return err;
+}
+
+static __init int can_bench_init(void)
+{
+	unsigned int rcvs = n_all + n_fil + n_inv + n_sff + n_eff + n_err;
+	int err;
+
+	printk(banner);
+
+	if (!frames || !pool || eff_pct + err_pct > 100)
+		return -EINVAL;
+
+	can_bench_filters = kcalloc(rcvs ? rcvs : 1, sizeof(struct can_filter),
+				    GFP_KERNEL);
+	if (!can_bench_filters)
+		return -ENOMEM;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0)
+	can_bench_dev = alloc_netdev(0, "canbench%d", NET_NAME_UNKNOWN,
+				     can_bench_setup);
+#else
+	can_bench_dev = alloc_netdev(0, "canbench%d", can_bench_setup);
+#endif
+	if (!can_bench_dev) {
+		err = -ENOMEM;
+		goto out_filters;
+	}
+
+	err = register_netdev(can_bench_dev);
+	if (err)
+		goto out_free;
+
+	err = can_bench_add_rcvs();
+	if (err) {
+		printk(KERN_ERR "can_bench: can't register receivers (%d)\n",
+		       err);
+		goto out_rcvs;
+	}
+
+	err = can_bench_run();
+
+ out_rcvs:
+	can_bench_del_rcvs();
+	unregister_netdev(can_bench_dev);
+ out_free:
+	free_netdev(can_bench_dev);
+ out_filters:
+	kfree(can_bench_filters);
+
+	return err;
+}
+
+static __exit void can_bench_exit(void)
+{
+}
+
+module_init(can_bench_init);
+module_exit(can_bench_exit);
@@ -5,6 +5,8 @@
 #ifndef CAN_COMPAT_H
 #define CAN_COMPAT_H
 
+#include <socketcan/can/kcompat.h>
+
 #ifndef PF_CAN
 #define PF_CAN 29
 #endif
@@ -57,7 +59,21 @@ static inline void setup_timer(struct timer_list * timer,
 #define __dev_get_by_index(ns, ifindex) __dev_get_by_index(ifindex)
 #endif
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24)
+/* no network namespaces => the CAN core ignores the net parameter */
+#define sock_net(sk)	((struct net *)NULL)
+#define dev_net(dev)	((struct net *)NULL)
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
+#define sock_net(sk)	((sk)->sk_net)
+#define dev_net(dev)	((dev)->nd_net)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
+#define net_eq(net1, net2)	((net1) == (net2))
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(2,6,25)
 #include <linux/hrtimer.h>
 static inline int hrtimer_callback_running(struct hrtimer *timer)
 {
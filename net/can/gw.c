@@ -44,8 +44,13 @@
 #include <linux/module.h>
 #include <linux/version.h>
 #include <linux/init.h>
+#include <linux/interrupt.h>
+#include <linux/hrtimer.h>
 #include <linux/types.h>
 #include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/hash.h>
 #include <linux/spinlock.h>
 #include <linux/rcupdate.h>
 #include <linux/rculist.h>
@@ -59,6 +64,11 @@
 #include <net/rtnetlink.h>
 #include <net/net_namespace.h>
 #include <net/sock.h>
+#include <asm/unaligned.h>
+#include <asm/div64.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
+#include "compat.h"
+#endif
 
 #include <socketcan/can/version.h> /* for RCSID. Removed by mkpatch script */
 RCSID("$Id$");
@@ -75,15 +85,51 @@ MODULE_ALIAS("can-gw");
 HLIST_HEAD(cgw_list);
 static struct notifier_block notifier;
 
+/*
+ * Jobs with a filter for exactly one CAN identifier do not get their own
+ * receiver in af_can. They are put into a routing table of their source
+ * device instead, which is hashed by the CAN identifier and served by one
+ * af_can receiver for all the jobs of this device.
+ */
+#define CGW_HASH_BITS 10
+#define CGW_HASH_SIZE (1 << CGW_HASH_BITS)
+
+struct cgw_route_tbl {
+	struct list_head list;
+	struct rcu_head rcu;
+	struct net_device *dev;
+	int jobs;
+	struct cgw_route_set *set;	/* bulk loaded tables only */
+	struct hlist_head masked;	/* bulk: jobs with other filters */
+	struct hlist_head hash[CGW_HASH_SIZE];
+};
+
+/* list of the routing tables - protected by rtnl_lock() */
+static LIST_HEAD(cgw_tables);
+
 static struct kmem_cache *cgw_cache __read_mostly;
 
-/* structure that contains the (on-the-fly) CAN frame modifications */
+/* elements of the CAN frame in cf_mod.fused[] - data is separate */
+enum {
+	CGW_FUSED_ID,
+	CGW_FUSED_DLC,	/* can_dlc resp. len */
+	CGW_FUSED_FLAGS,	/* CAN FD frames only */
+	CGW_FUSED_ELEMS
+};
+
+/* number of u64 words in the data of a CAN FD frame */
+#define CGW_DATA_WORDS (CANFD_MAX_DLEN / sizeof(u64))
+
+/*
+ * structure that contains the (on-the-fly) CAN frame modifications
+ * (struct canfd_frame is used for the classic CAN frames too)
+ */
 struct cf_mod {
 	struct {
-		struct can_frame and;
-		struct can_frame or;
-		struct can_frame xor;
-		struct can_frame set;
+		struct canfd_frame and;
+		struct canfd_frame or;
+		struct canfd_frame xor;
+		struct canfd_frame set;
 	} modframe;
 	struct {
 		u8 and;
@@ -91,8 +137,26 @@ struct cf_mod {
 		u8 xor;
 		u8 set;
 	} modtype;
-	void (*modfunc[MAX_MODFUNCTIONS])(struct can_frame *cf,
-					  struct cf_mod *mod);
+
+	/*
+	 * The AND/OR/XOR/SET modifications of each frame element folded to
+	 * one operation: element = ((element & and) | or) ^ xor
+	 *
+	 * The data is handled in u64 words. Only the words set in the bitmap
+	 * data.words are modified at all.
+	 */
+	struct {
+		u64 and;
+		u64 or;
+		u64 xor;
+	} fused[CGW_FUSED_ELEMS];
+	struct {
+		u64 and[CGW_DATA_WORDS];
+		u64 or[CGW_DATA_WORDS];
+		u64 xor[CGW_DATA_WORDS];
+		unsigned long words;
+	} data;
+	int modified;
 
 	/* CAN frame checksum calculation after CAN frame modifications */
 	struct {
@@ -100,30 +164,71 @@ struct cf_mod {
 		struct cgw_csum_crc8 crc8;
 	} csum;
 	struct {
-		void (*xor)(struct can_frame *cf, struct cgw_csum_xor *xor);
-		void (*crc8)(struct can_frame *cf, struct cgw_csum_crc8 *crc8);
-	} csumfunc;
+		u8 xor;
+		u8 crc8;
+	} csumtype;
+};
+
+
+/* processing variants of the checksums in cf_mod.csumtype */
+enum {
+	CGW_CSUM_NONE,
+	CGW_CSUM_REL,	/* indices relative to the received dlc */
+	CGW_CSUM_POS,	/* absolute indices from <= to */
+	CGW_CSUM_NEG	/* absolute indices from > to */
 };
 
 
 /*
- * So far we just support CAN -> CAN routing and frame modifications.
+ * So far we support CAN -> CAN, CAN FD -> CAN FD and CAN -> CAN FD routing,
+ * the packing of CAN frames into CAN FD container frames (and back) and
+ * frame modifications.
  *
  * The internal can_can_gw structure contains data and attributes for
- * a CAN -> CAN gateway job.
+ * the gateway jobs of all these gwtypes.
  */
 struct can_can_gw {
 	struct can_filter filter;
 	int src_idx;
 	int dst_idx;
+	struct cgw_aggr aggr;	/* CGW_TYPE_CAN_AGGR only */
+	u32 refresh;		/* usecs, CGW_FLAGS_CAN_CHANGED only */
+};
+
+/*
+ * Frame counters and latency histogram of a job. They are only updated on
+ * the local CPU and are summed up for the netlink dumps in cgw_put_job().
+ */
+struct cgw_pcpu_stats {
+	u64 handled_frames;
+	u64 dropped_frames;
+	u64 suppressed_frames;
+	u64 lat_sum_ns;
+	u64 lat_max_ns;
+	u64 lat_hist[CGW_LAT_BUCKETS];
 };
 
+#ifndef __percpu
+#define __percpu
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33)
+#define cgw_stats_inc(gwj, field) this_cpu_inc((gwj)->stats->field)
+#define cgw_stats_ptr(gwj) this_cpu_ptr((gwj)->stats)
+#else
+#define cgw_stats_inc(gwj, field)					\
+	do {								\
+		per_cpu_ptr((gwj)->stats, get_cpu())->field++;		\
+		put_cpu();						\
+	} while (0)
+#define cgw_stats_ptr(gwj) per_cpu_ptr((gwj)->stats, smp_processor_id())
+#endif
+
 /* list entry for CAN gateways jobs */
 struct cgw_job {
 	struct hlist_node list;
 	struct rcu_head rcu;
-	u32 handled_frames;
-	u32 dropped_frames;
+	struct cgw_pcpu_stats __percpu *stats;
 	struct cf_mod mod;
 	union {
 		/* CAN frame data source */
@@ -139,27 +244,162 @@ struct cgw_job {
 	};
 	u8 gwtype;
 	u16 flags;
+	struct cgw_route_tbl *tbl;
+	struct hlist_node tnode;
+	canid_t tbl_id;
+	struct cgw_crc8_slice *crc8_slice;
+	struct cgw_aggr_state *aggr;
+	struct cgw_chg_state *chg;
 };
 
-/* modification functions that are invoked in the hot path in can_can_gw_rcv */
+/* the frame sizes that are received from and sent to the interfaces */
+static inline unsigned int cgw_src_mtu(u8 gwtype)
+{
+	switch (gwtype) {
+	case CGW_TYPE_CANFD_CANFD:
+	case CGW_TYPE_AGGR_CAN:
+		return CANFD_MTU;
+	default:
+		return CAN_MTU;
+	}
+}
+
+static inline unsigned int cgw_dst_mtu(u8 gwtype)
+{
+	switch (gwtype) {
+	case CGW_TYPE_CAN_CAN:
+	case CGW_TYPE_AGGR_CAN:
+		return CAN_MTU;
+	default:
+		return CANFD_MTU;
+	}
+}
+
+/* do the modifications apply to CAN FD frames? (else to CAN frames) */
+static inline int cgw_mod_fd(u8 gwtype)
+{
+	return gwtype == CGW_TYPE_CANFD_CANFD || gwtype == CGW_TYPE_CAN_CANFD;
+}
+
+/* valid CAN FD data lengths are 0 .. 8, 12, 16, 20, 24, 32, 48, 64 */
+static inline int cgw_fd_len_valid(u8 len)
+{
+	if (len <= 8)
+		return 1;
+
+	if (len <= 24)
+		return !(len & 3);
+
+	return len == 32 || len == 48 || len == 64;
+}
+
+/* fold one modification (attr is one of CGW_MOD_AND/OR/XOR/SET) */
+static void cgw_fuse_op(u64 *and, u64 *or, u64 *xor, int attr, u64 val)
+{
+	switch (attr) {
+
+	case CGW_MOD_AND:
+		*and &= val;
+		*or &= val;
+		*xor &= val;
+		break;
+
+	case CGW_MOD_OR:
+		*and &= ~val;
+		*or |= val;
+		*xor &= ~val;
+		break;
+
+	case CGW_MOD_XOR:
+		*xor ^= val;
+		break;
+
+	case CGW_MOD_SET:
+		*and = 0;
+		*or = val;
+		*xor = 0;
+		break;
+	}
+}
+
+/*
+ * cgw_fuse - fold one modification into the fused operation of a frame
+ *            element (attr is one of CGW_MOD_AND/OR/XOR/SET)
+ */
+static void cgw_fuse(struct cf_mod *mod, int elem, int attr, u64 val)
+{
+	cgw_fuse_op(&mod->fused[elem].and, &mod->fused[elem].or,
+		    &mod->fused[elem].xor, attr, val);
+
+	mod->modified = 1;
+}
+
+/* cgw_fuse_data - the same for one u64 word of the frame data */
+static void cgw_fuse_data(struct cf_mod *mod, int word, int attr, u64 val)
+{
+	cgw_fuse_op(&mod->data.and[word], &mod->data.or[word],
+		    &mod->data.xor[word], attr, val);
+
+	mod->data.words |= 1UL << word;
+	mod->modified = 1;
+}
+
+static void cgw_fuse_modframe(struct cf_mod *mod, int attr, u8 modtype,
+			      struct canfd_frame *cf, int fd)
+{
+	int words = fd ? CGW_DATA_WORDS : 1;
+	int i;
+
+	if (modtype & CGW_MOD_ID)
+		cgw_fuse(mod, CGW_FUSED_ID, attr, cf->can_id);
+
+	if (modtype & CGW_MOD_DLC)
+		cgw_fuse(mod, CGW_FUSED_DLC, attr, cf->len);
+
+	if (fd && modtype & CGW_MOD_FLAGS)
+		cgw_fuse(mod, CGW_FUSED_FLAGS, attr, cf->flags);
+
+	if (modtype & CGW_MOD_DATA) {
+		for (i = 0; i < words; i++)
+			cgw_fuse_data(mod, i, attr, ((u64 *)cf->data)[i]);
+	}
+}
+
+/*
+ * perform all modifications in the hot path in cgw_job_rcv
+ *
+ * Only the data words that have a modification are touched, e.g. one
+ * word for a classic CAN frame or a CAN FD signal in data[8] .. data[15].
+ */
+static inline void cgw_mod_frame(struct canfd_frame *cf, struct cf_mod *mod)
+{
+	unsigned long words = mod->data.words;
+	u64 *data = (u64 *)cf->data;
+	int i;
+
+	cf->can_id = ((cf->can_id & (canid_t)mod->fused[CGW_FUSED_ID].and) |
+		      (canid_t)mod->fused[CGW_FUSED_ID].or) ^
+		(canid_t)mod->fused[CGW_FUSED_ID].xor;
+
+	cf->len = ((cf->len & (u8)mod->fused[CGW_FUSED_DLC].and) |
+		   (u8)mod->fused[CGW_FUSED_DLC].or) ^
+		(u8)mod->fused[CGW_FUSED_DLC].xor;
+
+	cf->flags = ((cf->flags & (u8)mod->fused[CGW_FUSED_FLAGS].and) |
+		     (u8)mod->fused[CGW_FUSED_FLAGS].or) ^
+		(u8)mod->fused[CGW_FUSED_FLAGS].xor;
 
-#define MODFUNC(func, op) static void func(struct can_frame *cf, \
-					   struct cf_mod *mod) { op ; }
+	while (words) {
+		i = __ffs(words);
+		words &= words - 1;
 
-MODFUNC(mod_and_id, cf->can_id &= mod->modframe.and.can_id)
-MODFUNC(mod_and_dlc, cf->can_dlc &= mod->modframe.and.can_dlc)
-MODFUNC(mod_and_data, *(u64 *)cf->data &= *(u64 *)mod->modframe.and.data)
-MODFUNC(mod_or_id, cf->can_id |= mod->modframe.or.can_id)
-MODFUNC(mod_or_dlc, cf->can_dlc |= mod->modframe.or.can_dlc)
-MODFUNC(mod_or_data, *(u64 *)cf->data |= *(u64 *)mod->modframe.or.data)
-MODFUNC(mod_xor_id, cf->can_id ^= mod->modframe.xor.can_id)
-MODFUNC(mod_xor_dlc, cf->can_dlc ^= mod->modframe.xor.can_dlc)
-MODFUNC(mod_xor_data, *(u64 *)cf->data ^= *(u64 *)mod->modframe.xor.data)
-MODFUNC(mod_set_id, cf->can_id = mod->modframe.set.can_id)
-MODFUNC(mod_set_dlc, cf->can_dlc = mod->modframe.set.can_dlc)
-MODFUNC(mod_set_data, *(u64 *)cf->data = *(u64 *)mod->modframe.set.data)
+		data[i] = ((data[i] & mod->data.and[i]) | mod->data.or[i]) ^
+			mod->data.xor[i];
+	}
+}
 
-static inline void canframecpy(struct can_frame *dst, struct can_frame *src)
+static inline void canframecpy(struct canfd_frame *dst,
+			       struct can_frame *src)
 {
 	/*
 	 * Copy the struct members separately to ensure that no uninitialized
@@ -168,11 +408,21 @@ static inline void canframecpy(struct can_frame *dst, struct can_frame *src)
 	 */
 
 	dst->can_id = src->can_id;
-	dst->can_dlc = src->can_dlc;
+	dst->len = src->can_dlc;
 	*(u64 *)dst->data = *(u64 *)src->data;
 }
 
-static int cgw_chk_csum_parms(s8 fr, s8 to, s8 re)
+static inline void canfdframecpy(struct canfd_frame *dst,
+				 struct canfd_frame *src)
+{
+	/* the same for CAN FD frames - the 2 reserved bytes are left out */
+	dst->can_id = src->can_id;
+	dst->len = src->len;
+	dst->flags = src->flags;
+	memcpy(dst->data, src->data, CANFD_MAX_DLEN);
+}
+
+static int cgw_chk_csum_parms(s8 fr, s8 to, s8 re, int max_dlen)
 {
 	/*
 	 * absolute dlc values 0 .. 7 => 0 .. 7, e.g. data [0]
@@ -181,11 +431,13 @@ static int cgw_chk_csum_parms(s8 fr, s8 to, s8 re)
 	 * -1 => index = 7 (data[7])
 	 * -3 => index = 5 (data[5])
 	 * -8 => index = 0 (data[0])
+	 *
+	 * CAN FD frames use the same scheme with max_dlen = 64
 	 */
 
-	if (fr > -9 && fr < 8 &&
-	    to > -9 && to < 8 &&
-	    re > -9 && re < 8)
+	if (fr >= -max_dlen && fr < max_dlen &&
+	    to >= -max_dlen && to < max_dlen &&
+	    re >= -max_dlen && re < max_dlen)
 		return 0;
 	else
 		return -EINVAL;
@@ -199,11 +451,15 @@ static inline int calc_idx(int idx, int rx_dlc)
 		return idx;
 }
 
-static void cgw_csum_xor_rel(struct can_frame *cf, struct cgw_csum_xor *xor)
+/*
+ * The checksum functions work on struct canfd_frame, which has the same
+ * layout for can_id, can_dlc/len and data[] as struct can_frame.
+ */
+static void cgw_csum_xor_rel(struct canfd_frame *cf, struct cgw_csum_xor *xor)
 {
-	int from = calc_idx(xor->from_idx, cf->can_dlc);
-	int to = calc_idx(xor->to_idx, cf->can_dlc);
-	int res = calc_idx(xor->result_idx, cf->can_dlc);
+	int from = calc_idx(xor->from_idx, cf->len);
+	int to = calc_idx(xor->to_idx, cf->len);
+	int res = calc_idx(xor->result_idx, cf->len);
 	u8 val = xor->init_xor_val;
 	int i;
 
@@ -221,7 +477,7 @@ static void cgw_csum_xor_rel(struct can_frame *cf, struct cgw_csum_xor *xor)
 	cf->data[res] = val;
 }
 
-static void cgw_csum_xor_pos(struct can_frame *cf, struct cgw_csum_xor *xor)
+static void cgw_csum_xor_pos(struct canfd_frame *cf, struct cgw_csum_xor *xor)
 {
 	u8 val = xor->init_xor_val;
 	int i;
@@ -232,7 +488,7 @@ static void cgw_csum_xor_pos(struct can_frame *cf, struct cgw_csum_xor *xor)
 	cf->data[xor->result_idx] = val;
 }
 
-static void cgw_csum_xor_neg(struct can_frame *cf, struct cgw_csum_xor *xor)
+static void cgw_csum_xor_neg(struct canfd_frame *cf, struct cgw_csum_xor *xor)
 {
 	u8 val = xor->init_xor_val;
 	int i;
@@ -243,25 +499,75 @@ static void cgw_csum_xor_neg(struct can_frame *cf, struct cgw_csum_xor *xor)
 	cf->data[xor->result_idx] = val;
 }
 
-static void cgw_csum_crc8_rel(struct can_frame *cf, struct cgw_csum_crc8 *crc8)
+/*
+ * When the given crctab is the table of a real (linear) CRC, four data
+ * bytes are processed with one step: slice[n] is crctab applied n + 1
+ * times, see cgw_crc8_slice_tbl(). Otherwise slice is NULL and the data
+ * is processed byte by byte.
+ */
+struct cgw_crc8_slice {
+	u8 tab[4][256];
+};
+
+static struct cgw_crc8_slice *cgw_crc8_slice_tbl(struct cgw_csum_crc8 *crc8)
 {
-	int from = calc_idx(crc8->from_idx, cf->can_dlc);
-	int to = calc_idx(crc8->to_idx, cf->can_dlc);
-	int res = calc_idx(crc8->result_idx, cf->can_dlc);
-	u8 crc = crc8->init_crc_val;
-	int i;
+	const u8 *tab = crc8->crctab;
+	struct cgw_crc8_slice *sl;
+	int i, n;
 
-	if (from < 0 || to < 0 || res < 0)
-		return;
+	/* check for tab[a ^ b] == tab[a] ^ tab[b] */
+	if (tab[0])
+		return NULL;
 
-	if (from <= to) {
-		for (i = crc8->from_idx; i <= crc8->to_idx; i++)
-			crc = crc8->crctab[crc^cf->data[i]];
-	} else {
-		for (i = crc8->from_idx; i >= crc8->to_idx; i--)
-			crc = crc8->crctab[crc^cf->data[i]];
+	for (i = 1; i < 256; i++) {
+		u8 val = 0;
+
+		for (n = 0; n < 8; n++)
+			if (i & (1 << n))
+				val ^= tab[1 << n];
+
+		if (tab[i] != val)
+			return NULL;
 	}
 
+	sl = kmalloc(sizeof(*sl), GFP_KERNEL);
+	if (!sl)
+		return NULL;
+
+	memcpy(sl->tab[0], tab, 256);
+	for (n = 1; n < 4; n++)
+		for (i = 0; i < 256; i++)
+			sl->tab[n][i] = tab[sl->tab[n - 1][i]];
+
+	return sl;
+}
+
+/* CRC8 over data[from] .. data[to] in ascending or descending order */
+static u8 cgw_crc8_span(const struct cgw_csum_crc8 *crc8,
+			const struct cgw_crc8_slice *sl,
+			const u8 *data, int from, int to, u8 crc)
+{
+	int step = (from <= to) ? 1 : -1;
+	int len = (to - from) * step + 1;
+	const u8 *p = data + from;
+
+	if (sl) {
+		for (; len >= 4; len -= 4, p += 4 * step)
+			crc = sl->tab[3][crc ^ p[0]] ^
+				sl->tab[2][p[step]] ^
+				sl->tab[1][p[2 * step]] ^
+				sl->tab[0][p[3 * step]];
+	}
+
+	for (; len > 0; len--, p += step)
+		crc = crc8->crctab[crc ^ *p];
+
+	return crc;
+}
+
+static void cgw_csum_crc8_final(struct canfd_frame *cf,
+				struct cgw_csum_crc8 *crc8, int res, u8 crc)
+{
 	switch (crc8->profile) {
 
 	case CGW_CRC8PRF_1U8:
@@ -279,77 +585,535 @@ static void cgw_csum_crc8_rel(struct can_frame *cf, struct cgw_csum_crc8 *crc8)
 
 	}
 
-	cf->data[crc8->result_idx] = crc^crc8->final_xor_val;
+	cf->data[res] = crc^crc8->final_xor_val;
 }
 
-static void cgw_csum_crc8_pos(struct can_frame *cf, struct cgw_csum_crc8 *crc8)
+static void cgw_csum_crc8_rel(struct canfd_frame *cf,
+			      struct cgw_csum_crc8 *crc8,
+			      const struct cgw_crc8_slice *sl)
 {
-	u8 crc = crc8->init_crc_val;
-	int i;
+	int from = calc_idx(crc8->from_idx, cf->len);
+	int to = calc_idx(crc8->to_idx, cf->len);
+	int res = calc_idx(crc8->result_idx, cf->len);
+	u8 crc;
 
-	for (i = crc8->from_idx; i <= crc8->to_idx; i++)
-		crc = crc8->crctab[crc^cf->data[i]];
+	if (from < 0 || to < 0 || res < 0)
+		return;
 
-	switch (crc8->profile) {
+	crc = cgw_crc8_span(crc8, sl, cf->data, from, to, crc8->init_crc_val);
+	cgw_csum_crc8_final(cf, crc8, res, crc);
+}
 
-	case CGW_CRC8PRF_1U8:
-		crc = crc8->crctab[crc^crc8->profile_data[0]];
-		break;
+/* absolute indices - from <= to and from > to use the same code */
+static void cgw_csum_crc8_abs(struct canfd_frame *cf,
+			      struct cgw_csum_crc8 *crc8,
+			      const struct cgw_crc8_slice *sl)
+{
+	u8 crc = cgw_crc8_span(crc8, sl, cf->data, crc8->from_idx,
+			       crc8->to_idx, crc8->init_crc_val);
 
-	case  CGW_CRC8PRF_16U8:
-		crc = crc8->crctab[crc^crc8->profile_data[cf->data[1] & 0xF]];
+	cgw_csum_crc8_final(cf, crc8, crc8->result_idx, crc);
+}
+
+/*
+ * perform the modifications and checksum updates on a routed frame
+ * returns -EINVAL when the modifications made the frame length invalid
+ */
+static int cgw_mod_apply(struct canfd_frame *cf, struct cgw_job *gwj, int fd)
+{
+	cgw_mod_frame(cf, &gwj->mod);
+
+	if (fd ? !cgw_fd_len_valid(cf->len) : cf->len > CAN_MAX_DLEN)
+		return -EINVAL;
+
+	/* checksum updates when the CAN frame has been modified */
+	switch (gwj->mod.csumtype.crc8) {
+	case CGW_CSUM_REL:
+		cgw_csum_crc8_rel(cf, &gwj->mod.csum.crc8, gwj->crc8_slice);
+		break;
+	case CGW_CSUM_POS:
+	case CGW_CSUM_NEG:
+		cgw_csum_crc8_abs(cf, &gwj->mod.csum.crc8, gwj->crc8_slice);
 		break;
+	}
 
-	case CGW_CRC8PRF_SFFID_XOR:
-		crc = crc8->crctab[crc^(cf->can_id & 0xFF)^
-				   (cf->can_id >> 8 & 0xFF)];
+	switch (gwj->mod.csumtype.xor) {
+	case CGW_CSUM_REL:
+		cgw_csum_xor_rel(cf, &gwj->mod.csum.xor);
+		break;
+	case CGW_CSUM_POS:
+		cgw_csum_xor_pos(cf, &gwj->mod.csum.xor);
+		break;
+	case CGW_CSUM_NEG:
+		cgw_csum_xor_neg(cf, &gwj->mod.csum.xor);
 		break;
 	}
 
-	cf->data[crc8->result_idx] = crc^crc8->final_xor_val;
+	return 0;
 }
 
-static void cgw_csum_crc8_neg(struct can_frame *cf, struct cgw_csum_crc8 *crc8)
+/*
+ * A new skb for exactly one CAN (FD) frame that is sent to the destination.
+ * Unlike skb_copy() nothing is taken over from the received skb. The data
+ * comes from the per-CPU page fragment cache of netdev_alloc_skb() and is
+ * written once by the caller - the skb is set up for sending in cgw_send().
+ */
+static inline struct sk_buff *cgw_alloc_skb(struct cgw_job *gwj,
+					    unsigned int mtu, ktime_t tstamp)
 {
-	u8 crc = crc8->init_crc_val;
-	int i;
+	struct sk_buff *nskb = netdev_alloc_skb(gwj->dst.dev, mtu);
 
-	for (i = crc8->from_idx; i >= crc8->to_idx; i--)
-		crc = crc8->crctab[crc^cf->data[i]];
+	if (!nskb)
+		return NULL;
 
-	switch (crc8->profile) {
+	skb_put(nskb, mtu);
+	nskb->tstamp = tstamp;
 
-	case CGW_CRC8PRF_1U8:
-		crc = crc8->crctab[crc^crc8->profile_data[0]];
-		break;
+	return nskb;
+}
 
-	case  CGW_CRC8PRF_16U8:
-		crc = crc8->crctab[crc^crc8->profile_data[cf->data[1] & 0xF]];
-		break;
+/* softirq context: record the latency since the reception of the frame */
+static void cgw_account_latency(struct cgw_job *gwj, ktime_t tstamp)
+{
+	struct cgw_pcpu_stats *st = cgw_stats_ptr(gwj);
+	s64 lat = ktime_to_ns(ktime_sub(ktime_get_real(), tstamp));
+	u64 us;
+	unsigned int bucket = 0;
+
+	/* the wall clock may have been set back */
+	if (lat < 0)
+		lat = 0;
+
+	st->lat_sum_ns += lat;
+	if (lat > st->lat_max_ns)
+		st->lat_max_ns = lat;
+
+	us = lat;
+	do_div(us, NSEC_PER_USEC);
+	if (us)
+		bucket = min_t(unsigned int, ilog2(us) + 1,
+			       CGW_LAT_BUCKETS - 1);
+	st->lat_hist[bucket]++;
+}
 
-	case CGW_CRC8PRF_SFFID_XOR:
-		crc = crc8->crctab[crc^(cf->can_id & 0xFF)^
-				   (cf->can_id >> 8 & 0xFF)];
-		break;
+/* mark the new skb as routed frame and send it to the destination */
+static void cgw_send(struct sk_buff *nskb, struct cgw_job *gwj)
+{
+	/*
+	 * Mark routed frames by setting some mac header length which is
+	 * not relevant for the CAN frames located in the skb->data section.
+	 *
+	 * As dev->header_ops is not set in CAN netdevices no one is ever
+	 * accessing the various header offsets in the CAN skbuffs anyway.
+	 * E.g. using the packet socket to read CAN frames is still working.
+	 */
+	skb_set_mac_header(nskb, 8);
+	nskb->dev = gwj->dst.dev;
+
+	if (gwj->flags & CGW_FLAGS_CAN_LATENCY && ktime_to_ns(nskb->tstamp))
+		cgw_account_latency(gwj, nskb->tstamp);
+
+	/* clear the skb timestamp if not configured the other way */
+	if (!(gwj->flags & CGW_FLAGS_CAN_SRC_TSTAMP))
+		nskb->tstamp = ktime_set(0, 0);
+
+	/* send to netdevice */
+	if (can_send(nskb, gwj->flags & CGW_FLAGS_CAN_ECHO))
+		cgw_stats_inc(gwj, dropped_frames);
+	else
+		cgw_stats_inc(gwj, handled_frames);
+}
+
+/*
+ * CAN frame aggregation (CGW_TYPE_CAN_AGGR)
+ *
+ * The records of the received CAN frames are collected in the data of
+ * the container frame aggr_state.cf, which is sent when the next record
+ * does not fit into it or when the flush deadline has expired. The
+ * hrtimer of the deadline hands over to a tasklet as can_send() must not
+ * be called from hardirq context.
+ *
+ * The timer can not be cancelled reliably when a full container is taken
+ * in softirq context, so the tasklet may run for an already sent container.
+ * It only flushes the current container when its own deadline is over.
+ */
+struct cgw_aggr_state {
+	struct cgw_job *gwj;
+	spinlock_t lock;
+	struct hrtimer timer;
+	struct tasklet_struct tsklet;
+	ktime_t tstamp;		/* of the first packed CAN frame */
+	ktime_t deadline;	/* flush time of the container (monotonic) */
+	int dead;
+	int pos;		/* used bytes in cf.data */
+	struct canfd_frame cf;
+};
+
+/* the smallest record: header byte and SFF identifier of a RTR frame */
+#define CGW_AGGR_MIN_REC 3
+
+static inline int cgw_aggr_rec_len(struct canfd_frame *cf)
+{
+	int len = (cf->can_id & CAN_EFF_FLAG) ? 5 : 3;
+
+	if (!(cf->can_id & CAN_RTR_FLAG))
+		len += cf->len;
+
+	return len;
+}
+
+/* the smallest valid CAN FD frame length for the given data bytes */
+static inline u8 cgw_aggr_fd_len(int pos)
+{
+	if (pos <= 8)
+		return pos;
+
+	if (pos <= 24)
+		return (pos + 3) & ~3;
+
+	if (pos <= 32)
+		return 32;
+
+	if (pos <= 48)
+		return 48;
+
+	return 64;
+}
+
+/* take the container frame for sending - aggr_state.lock held */
+static struct sk_buff *cgw_aggr_take(struct cgw_aggr_state *ag)
+{
+	struct cgw_job *gwj = ag->gwj;
+	struct sk_buff *nskb;
+	u8 len;
+
+	if (!ag->pos)
+		return NULL;
+
+	hrtimer_try_to_cancel(&ag->timer);
+
+	nskb = cgw_alloc_skb(gwj, CANFD_MTU, ag->tstamp);
+	if (!nskb) {
+		cgw_stats_inc(gwj, dropped_frames);
+		ag->pos = 0;
+		return NULL;
+	}
+
+	len = cgw_aggr_fd_len(ag->pos);
+	memset(ag->cf.data + ag->pos, CGW_AGGR_PAD, CANFD_MAX_DLEN - ag->pos);
+	ag->cf.len = len;
+
+	memcpy(nskb->data, &ag->cf, CANFD_MTU);
+
+	ag->pos = 0;
+
+	return nskb;
+}
+
+/* append the record of the CAN frame - aggr_state.lock held */
+static void cgw_aggr_put(struct cgw_aggr_state *ag, struct canfd_frame *cf)
+{
+	u8 *rec = ag->cf.data + ag->pos;
+	int len = 0;
+
+	if (cf->can_id & CAN_EFF_FLAG) {
+		rec[len++] = CGW_AGGR_EFF | cf->len;
+		put_unaligned_be32(cf->can_id & CAN_EFF_MASK, rec + len);
+		len += 4;
+	} else {
+		rec[len++] = cf->len;
+		put_unaligned_be16(cf->can_id & CAN_SFF_MASK, rec + len);
+		len += 2;
+	}
+
+	if (cf->can_id & CAN_RTR_FLAG)
+		rec[0] |= CGW_AGGR_RTR;
+	else {
+		memcpy(rec + len, cf->data, cf->len);
+		len += cf->len;
 	}
 
-	cf->data[crc8->result_idx] = crc^crc8->final_xor_val;
+	ag->pos += len;
+}
+
+static void cgw_aggr_pack(struct sk_buff *skb, struct cgw_job *gwj)
+{
+	struct cgw_aggr_state *ag = gwj->aggr;
+	struct can_frame *rxcf = (struct can_frame *)skb->data;
+	struct sk_buff *full = NULL;
+	struct sk_buff *done = NULL;
+	struct canfd_frame cf;
+
+	/* error frames are never routed */
+	if (rxcf->can_id & CAN_ERR_FLAG)
+		return;
+
+	cf.can_id = rxcf->can_id;
+	cf.len = rxcf->can_dlc;
+	cf.flags = 0;
+	*(u64 *)cf.data = *(u64 *)rxcf->data;
+
+	if (gwj->mod.modified && cgw_mod_apply(&cf, gwj, 0)) {
+		cgw_stats_inc(gwj, dropped_frames);
+		return;
+	}
+
+	spin_lock(&ag->lock);
+
+	if (ag->dead) {
+		spin_unlock(&ag->lock);
+		return;
+	}
+
+	if (ag->pos + cgw_aggr_rec_len(&cf) > CANFD_MAX_DLEN)
+		full = cgw_aggr_take(ag);
+
+	/* the first record starts the flush deadline */
+	if (!ag->pos) {
+		ag->tstamp = skb->tstamp;
+		ag->deadline = ktime_add_us(ktime_get(),
+					    gwj->ccgw.aggr.timeout);
+		hrtimer_start(&ag->timer, ag->deadline, HRTIMER_MODE_ABS);
+	}
+
+	cgw_aggr_put(ag, &cf);
+
+	/* no more record fits into the container frame */
+	if (ag->pos > CANFD_MAX_DLEN - CGW_AGGR_MIN_REC)
+		done = cgw_aggr_take(ag);
+
+	spin_unlock(&ag->lock);
+
+	if (full)
+		cgw_send(full, gwj);
+
+	if (done)
+		cgw_send(done, gwj);
+}
+
+static void cgw_aggr_tsklet(unsigned long data)
+{
+	struct cgw_aggr_state *ag = (struct cgw_aggr_state *)data;
+	struct sk_buff *nskb = NULL;
+
+	spin_lock(&ag->lock);
+	/* not a newer container after a failed hrtimer_try_to_cancel() */
+	if (!ag->dead &&
+	    ktime_to_ns(ktime_get()) >= ktime_to_ns(ag->deadline))
+		nskb = cgw_aggr_take(ag);
+	spin_unlock(&ag->lock);
+
+	if (nskb)
+		cgw_send(nskb, ag->gwj);
+}
+
+static enum hrtimer_restart cgw_aggr_timeout(struct hrtimer *hrtimer)
+{
+	struct cgw_aggr_state *ag = container_of(hrtimer,
+						 struct cgw_aggr_state, timer);
+
+	tasklet_schedule(&ag->tsklet);
+
+	return HRTIMER_NORESTART;
+}
+
+static struct cgw_aggr_state *cgw_aggr_alloc(struct cgw_job *gwj)
+{
+	struct cgw_aggr_state *ag = kzalloc(sizeof(*ag), GFP_KERNEL);
+
+	if (!ag)
+		return NULL;
+
+	ag->gwj = gwj;
+	spin_lock_init(&ag->lock);
+	hrtimer_init(&ag->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	ag->timer.function = cgw_aggr_timeout;
+	tasklet_init(&ag->tsklet, cgw_aggr_tsklet, (unsigned long)ag);
+
+	ag->cf.can_id = gwj->ccgw.aggr.can_id;
+	ag->cf.flags = gwj->ccgw.aggr.flags;
+
+	return ag;
+}
+
+/* stop the aggregation of a removed job - a pending container is lost */
+static void cgw_aggr_stop(struct cgw_aggr_state *ag)
+{
+	spin_lock_bh(&ag->lock);
+	ag->dead = 1;
+	spin_unlock_bh(&ag->lock);
+
+	hrtimer_cancel(&ag->timer);
+	tasklet_kill(&ag->tsklet);
+}
+
+/* CGW_TYPE_AGGR_CAN: send the CAN frames packed into the container frame */
+static void cgw_aggr_unpack(struct sk_buff *skb, struct cgw_job *gwj)
+{
+	struct canfd_frame *cfd = (struct canfd_frame *)skb->data;
+	struct canfd_frame cf;
+	struct sk_buff *nskb;
+	int pos = 0;
+	u8 hdr;
+
+	while (pos < cfd->len) {
+		hdr = cfd->data[pos];
+
+		/* CGW_AGGR_PAD or a broken record end the container */
+		if ((hdr & CGW_AGGR_DLC) > CAN_MAX_DLEN)
+			break;
+
+		memset(&cf, 0, CAN_MTU);
+		cf.len = hdr & CGW_AGGR_DLC;
+
+		if (hdr & CGW_AGGR_EFF) {
+			if (pos + 5 > cfd->len)
+				break;
+			cf.can_id = get_unaligned_be32(cfd->data + pos + 1);
+			cf.can_id = (cf.can_id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+			pos += 5;
+		} else {
+			if (pos + 3 > cfd->len)
+				break;
+			cf.can_id = get_unaligned_be16(cfd->data + pos + 1);
+			cf.can_id &= CAN_SFF_MASK;
+			pos += 3;
+		}
+
+		if (hdr & CGW_AGGR_RTR)
+			cf.can_id |= CAN_RTR_FLAG;
+		else {
+			if (pos + cf.len > cfd->len)
+				break;
+			memcpy(cf.data, cfd->data + pos, cf.len);
+			pos += cf.len;
+		}
+
+		if (gwj->mod.modified && cgw_mod_apply(&cf, gwj, 0)) {
+			cgw_stats_inc(gwj, dropped_frames);
+			continue;
+		}
+
+		nskb = cgw_alloc_skb(gwj, CAN_MTU, skb->tstamp);
+		if (!nskb) {
+			cgw_stats_inc(gwj, dropped_frames);
+			return;
+		}
+
+		/* struct can_frame is the first part of struct canfd_frame */
+		memcpy(nskb->data, &cf, CAN_MTU);
+
+		cgw_send(nskb, gwj);
+	}
+}
+
+/* CAN -> CAN FD: convert the received frame into a new CAN FD skb */
+static struct sk_buff *cgw_skb_can2canfd(struct sk_buff *skb,
+					 struct cgw_job *gwj)
+{
+	struct can_frame *cf = (struct can_frame *)skb->data;
+	struct canfd_frame *cfd;
+	struct sk_buff *nskb;
+
+	/* there are no remote frames in CAN FD */
+	if (cf->can_id & CAN_RTR_FLAG)
+		return NULL;
+
+	nskb = cgw_alloc_skb(gwj, CANFD_MTU, skb->tstamp);
+	if (!nskb)
+		return NULL;
+
+	cfd = (struct canfd_frame *)nskb->data;
+	memset(cfd, 0, CANFD_MTU);
+	cfd->can_id = cf->can_id;
+	cfd->len = cf->can_dlc;
+	cfd->flags = CANFD_BRS;
+	*(u64 *)cfd->data = *(u64 *)cf->data;
+
+	return nskb;
+}
+
+/*
+ * Change detection (CGW_FLAGS_CAN_CHANGED)
+ *
+ * The frames of a job can be received on several CPUs at the same time,
+ * so the last forwarded frame is protected by a spinlock. It is always
+ * taken in softirq context (can_rcv()).
+ */
+struct cgw_chg_state {
+	spinlock_t lock;
+	int valid;
+	ktime_t last;		/* time of the last forwarded frame */
+	struct canfd_frame cf;
+};
+
+/* check if the frame is to be forwarded and remember it in this case */
+static int cgw_chg_forward(struct cgw_job *gwj, struct canfd_frame *cf,
+			   int fd)
+{
+	struct cgw_chg_state *chg = gwj->chg;
+	u32 refresh = gwj->ccgw.refresh;
+	ktime_t now = refresh ? ktime_get() : ktime_set(0, 0);
+	int fwd;
+
+	spin_lock(&chg->lock);
+
+	fwd = !chg->valid || cf->can_id != chg->cf.can_id ||
+		cf->len != chg->cf.len || (fd && cf->flags != chg->cf.flags);
+
+	/* the data of remote frames is not transmitted */
+	if (!fwd && !(cf->can_id & CAN_RTR_FLAG))
+		fwd = memcmp(cf->data, chg->cf.data, cf->len) != 0;
+
+	if (!fwd && refresh)
+		fwd = ktime_to_us(ktime_sub(now, chg->last)) >= refresh;
+
+	if (fwd) {
+		memcpy(&chg->cf, cf, fd ? CANFD_MTU : CAN_MTU);
+		chg->valid = 1;
+		if (refresh)
+			chg->last = now;
+	}
+
+	spin_unlock(&chg->lock);
+
+	return fwd;
+}
+
+static struct cgw_chg_state *cgw_chg_alloc(void)
+{
+	struct cgw_chg_state *chg = kzalloc(sizeof(*chg), GFP_KERNEL);
+
+	if (chg)
+		spin_lock_init(&chg->lock);
+
+	return chg;
 }
 
 /* the receive & process & send function */
-static void can_can_gw_rcv(struct sk_buff *skb, void *data)
+static void cgw_job_rcv(struct sk_buff *skb, struct cgw_job *gwj)
 {
-	struct cgw_job *gwj = (struct cgw_job *)data;
-	struct can_frame *cf;
 	struct sk_buff *nskb;
-	int modidx = 0;
 
-	/* do not handle already routed frames - see comment below */
+	/* only handle the CAN frame type of this gwtype */
+	if (skb->len != cgw_src_mtu(gwj->gwtype))
+		return;
+
+	/* do not handle already routed frames - see comment in cgw_send() */
 	if (skb_mac_header_was_set(skb))
 		return;
 
 	if (!(gwj->dst.dev->flags & IFF_UP)) {
-		gwj->dropped_frames++;
+		cgw_stats_inc(gwj, dropped_frames);
+		return;
+	}
+
+	switch (gwj->gwtype) {
+	case CGW_TYPE_CAN_AGGR:
+		cgw_aggr_pack(skb, gwj);
+		return;
+	case CGW_TYPE_AGGR_CAN:
+		cgw_aggr_unpack(skb, gwj);
 		return;
 	}
 
@@ -357,67 +1121,498 @@ static void can_can_gw_rcv(struct sk_buff *skb, void *data)
 	 * clone the given skb, which has not been done in can_rcv()
 	 *
 	 * When there is at least one modification function activated,
-	 * we need to copy the skb as we want to modify skb->data.
+	 * we need our own data as we want to modify it. Instead of copying
+	 * the whole skb only the CAN frame is written into a new skb.
+	 * CAN frames that are forwarded as CAN FD frames get a new skb too.
 	 */
-	if (gwj->mod.modfunc[0])
-		nskb = skb_copy(skb, GFP_ATOMIC);
-	else
+	if (gwj->gwtype == CGW_TYPE_CAN_CANFD)
+		nskb = cgw_skb_can2canfd(skb, gwj);
+	else if (gwj->mod.modified) {
+		nskb = cgw_alloc_skb(gwj, skb->len, skb->tstamp);
+		if (nskb)
+			memcpy(nskb->data, skb->data, skb->len);
+	} else
 		nskb = skb_clone(skb, GFP_ATOMIC);
 
 	if (!nskb) {
-		gwj->dropped_frames++;
+		cgw_stats_inc(gwj, dropped_frames);
 		return;
 	}
 
-	/*
-	 * Mark routed frames by setting some mac header length which is
-	 * not relevant for the CAN frames located in the skb->data section.
-	 *
-	 * As dev->header_ops is not set in CAN netdevices no one is ever
-	 * accessing the various header offsets in the CAN skbuffs anyway.
-	 * E.g. using the packet socket to read CAN frames is still working.
-	 */
-	skb_set_mac_header(nskb, 8);
-	nskb->dev = gwj->dst.dev;
+	/* perform the preprocessed modifications if there are any */
+	if (gwj->mod.modified &&
+	    cgw_mod_apply((struct canfd_frame *)nskb->data, gwj,
+			  nskb->len == CANFD_MTU)) {
+		/* the modifications made the frame length invalid */
+		kfree_skb(nskb);
+		cgw_stats_inc(gwj, dropped_frames);
+		return;
+	}
+
+	/* compare the frame as it would be sent out */
+	if (gwj->chg &&
+	    !cgw_chg_forward(gwj, (struct canfd_frame *)nskb->data,
+			     nskb->len == CANFD_MTU)) {
+		consume_skb(nskb);
+		cgw_stats_inc(gwj, suppressed_frames);
+		return;
+	}
+
+	cgw_send(nskb, gwj);
+}
+
+static void can_can_gw_rcv(struct sk_buff *skb, void *data)
+{
+	cgw_job_rcv(skb, (struct cgw_job *)data);
+}
+
+/* all bits of the CAN identifier including the EFF and RTR flags */
+static inline canid_t cgw_id_mask(canid_t can_id)
+{
+	if (can_id & CAN_EFF_FLAG)
+		return CAN_EFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+	else
+		return CAN_SFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+}
+
+/* does the filter match exactly one CAN identifier? */
+static inline int cgw_exact_filter(struct can_filter *f)
+{
+	canid_t mask = cgw_id_mask(f->can_id);
+
+	if (f->can_id & CAN_INV_FILTER || f->can_mask & CAN_ERR_FLAG)
+		return 0;
+
+	return (f->can_mask & mask) == mask;
+}
+
+static inline struct hlist_head *cgw_tbl_head(struct cgw_route_tbl *tbl,
+					      canid_t id)
+{
+	return &tbl->hash[hash_32(id, CGW_HASH_BITS)];
+}
+
+/* the receive function of a routing table */
+static void cgw_tbl_rcv(struct sk_buff *skb, void *data)
+{
+	struct cgw_route_tbl *tbl = (struct cgw_route_tbl *)data;
+	canid_t id = ((struct can_frame *)skb->data)->can_id;
+	struct cgw_job *gwj;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	struct hlist_node *n;
+#endif
+
+	id &= cgw_id_mask(id);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	hlist_for_each_entry_rcu(gwj, n, cgw_tbl_head(tbl, id), tnode) {
+#else
+	hlist_for_each_entry_rcu(gwj, cgw_tbl_head(tbl, id), tnode) {
+#endif
+		if (gwj->tbl_id == id)
+			cgw_job_rcv(skb, gwj);
+	}
+}
+
+static void cgw_tbl_free(struct rcu_head *rp)
+{
+	kfree(container_of(rp, struct cgw_route_tbl, rcu));
+}
+
+static int cgw_tbl_add_job(struct cgw_job *gwj)
+{
+	struct net_device *dev = gwj->src.dev;
+	struct cgw_route_tbl *tbl;
+	int err, i;
+
+	list_for_each_entry(tbl, &cgw_tables, list) {
+		if (tbl->dev == dev)
+			goto add;
+	}
+
+	tbl = kzalloc(sizeof(*tbl), GFP_KERNEL);
+	if (!tbl)
+		return -ENOMEM;
+
+	tbl->dev = dev;
+	for (i = 0; i < CGW_HASH_SIZE; i++)
+		INIT_HLIST_HEAD(&tbl->hash[i]);
+
+	/* receive all frames of the device and look up the jobs by can_id */
+	err = can_rx_register(dev_net(dev), dev, 0, 0, cgw_tbl_rcv, tbl, "gw");
+	if (err) {
+		kfree(tbl);
+		return err;
+	}
+
+	list_add(&tbl->list, &cgw_tables);
+add:
+	gwj->tbl = tbl;
+	gwj->tbl_id = gwj->ccgw.filter.can_id & gwj->ccgw.filter.can_mask;
+	hlist_add_head_rcu(&gwj->tnode, cgw_tbl_head(tbl, gwj->tbl_id));
+	tbl->jobs++;
+
+	return 0;
+}
+
+static void cgw_tbl_del_job(struct cgw_job *gwj)
+{
+	struct cgw_route_tbl *tbl = gwj->tbl;
+
+	hlist_del_rcu(&gwj->tnode);
+	gwj->tbl = NULL;
+
+	/* the tables of a bulk loaded set go away with the set */
+	if (--tbl->jobs || tbl->set)
+		return;
+
+	list_del(&tbl->list);
+	can_rx_unregister(dev_net(tbl->dev), tbl->dev, 0, 0, cgw_tbl_rcv, tbl);
+	call_rcu(&tbl->rcu, cgw_tbl_free);
+}
+
+static inline int cgw_register_filter(struct cgw_job *gwj)
+{
+	if (cgw_exact_filter(&gwj->ccgw.filter))
+		return cgw_tbl_add_job(gwj);
+
+	gwj->tbl = NULL;
+	return can_rx_register(dev_net(gwj->src.dev), gwj->src.dev,
+			       gwj->ccgw.filter.can_id,
+			       gwj->ccgw.filter.can_mask, can_can_gw_rcv,
+			       gwj, "gw");
+}
+
+static inline void cgw_unregister_filter(struct cgw_job *gwj)
+{
+	if (gwj->tbl) {
+		cgw_tbl_del_job(gwj);
+		return;
+	}
+
+	can_rx_unregister(dev_net(gwj->src.dev), gwj->src.dev,
+			  gwj->ccgw.filter.can_id,
+			  gwj->ccgw.filter.can_mask, can_can_gw_rcv, gwj);
+}
+
+static void cgw_free_job(struct cgw_job *gwj)
+{
+	free_percpu(gwj->stats);
+	kfree(gwj->crc8_slice);
+	kfree(gwj->aggr);
+	kfree(gwj->chg);
+	kmem_cache_free(cgw_cache, gwj);
+}
+
+static void cgw_job_free_rcu(struct rcu_head *rp)
+{
+	cgw_free_job(container_of(rp, struct cgw_job, rcu));
+}
+
+/* remove a job (rtnl_lock() held) - readers may still use it until rcu */
+static void cgw_remove_job_rcu(struct cgw_job *gwj)
+{
+	hlist_del_rcu(&gwj->list);
+	cgw_unregister_filter(gwj);
+
+	if (gwj->aggr)
+		cgw_aggr_stop(gwj->aggr);
+
+	if (gwj->flags & CGW_FLAGS_CAN_LATENCY)
+		net_disable_timestamp();
+
+	call_rcu(&gwj->rcu, cgw_job_free_rcu);
+}
+
+/*
+ * Both devices of a job belong to the network namespace of the netlink
+ * socket that created it. The job is only visible from this namespace.
+ */
+static inline int cgw_job_in_net(struct cgw_job *gwj, struct net *net)
+{
+	return !net || net_eq(dev_net(gwj->src.dev), net);
+}
+
+/*
+ * Bulk loaded route sets (RTM_NEWROUTE with CGW_TYPE_UNSPEC, see CGW_BULK)
+ *
+ * All jobs of a set are put into routing tables of their source devices,
+ * which are built completely before the set is published with a single
+ * rcu_assign_pointer(). One af_can receiver per source device serves the
+ * current set of the namespace, so a new set replaces the old one for all
+ * CAN frames at once and without af_can (un)registrations for each job.
+ */
+struct cgw_route_set {
+	struct rcu_head rcu;
+	struct list_head tables;	/* struct cgw_route_tbl */
+};
+
+/* the bulk routing of a network namespace */
+struct cgw_bulk {
+	struct list_head list;
+	struct rcu_head rcu;
+	struct net *net;
+	struct cgw_route_set *set;	/* current set - may be NULL */
+	struct list_head rx;		/* struct cgw_bulk_rx */
+};
+
+/* a source device with an af_can receiver for cgw_bulk_rcv() */
+struct cgw_bulk_rx {
+	struct list_head list;
+	struct net_device *dev;
+};
+
+/* list of the struct cgw_bulk - protected by rtnl_lock() */
+static LIST_HEAD(cgw_bulks);
+
+/* af_can filter semantics for the jobs in cgw_route_tbl.masked */
+static inline int cgw_filter_match(struct can_filter *f, canid_t id)
+{
+	canid_t mask = f->can_mask & (CAN_EFF_MASK | CAN_EFF_FLAG |
+				      CAN_RTR_FLAG);
+	int match = !((id ^ f->can_id) & mask);
+
+	return (f->can_id & CAN_INV_FILTER) ? !match : match;
+}
+
+static struct cgw_route_tbl *cgw_set_find_tbl(struct cgw_route_set *set,
+					      struct net_device *dev)
+{
+	struct cgw_route_tbl *tbl;
+
+	list_for_each_entry_rcu(tbl, &set->tables, list) {
+		if (tbl->dev == dev)
+			return tbl;
+	}
+
+	return NULL;
+}
+
+/* the receive function for all source devices of a namespace's set */
+static void cgw_bulk_rcv(struct sk_buff *skb, void *data)
+{
+	struct cgw_bulk *bulk = (struct cgw_bulk *)data;
+	struct cgw_route_set *set = rcu_dereference(bulk->set);
+	canid_t id = ((struct can_frame *)skb->data)->can_id;
+	struct cgw_route_tbl *tbl;
+	struct cgw_job *gwj;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	struct hlist_node *n;
+#endif
+
+	if (!set)
+		return;
+
+	tbl = cgw_set_find_tbl(set, skb->dev);
+	if (!tbl)
+		return;
+
+	cgw_tbl_rcv(skb, tbl);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	hlist_for_each_entry_rcu(gwj, n, &tbl->masked, tnode) {
+#else
+	hlist_for_each_entry_rcu(gwj, &tbl->masked, tnode) {
+#endif
+		if (cgw_filter_match(&gwj->ccgw.filter, id))
+			cgw_job_rcv(skb, gwj);
+	}
+}
+
+/* put a job of a set that is not yet published into its routing table */
+static int cgw_set_add_job(struct cgw_route_set *set, struct cgw_job *gwj)
+{
+	struct cgw_route_tbl *tbl;
+	int i;
+
+	/* error frames are not served by the receivers of the sets */
+	if (gwj->ccgw.filter.can_mask & CAN_ERR_FLAG)
+		return -EINVAL;
+
+	tbl = cgw_set_find_tbl(set, gwj->src.dev);
+	if (!tbl) {
+		tbl = kzalloc(sizeof(*tbl), GFP_KERNEL);
+		if (!tbl)
+			return -ENOMEM;
+
+		tbl->dev = gwj->src.dev;
+		tbl->set = set;
+		INIT_HLIST_HEAD(&tbl->masked);
+		for (i = 0; i < CGW_HASH_SIZE; i++)
+			INIT_HLIST_HEAD(&tbl->hash[i]);
+
+		list_add(&tbl->list, &set->tables);
+	}
+
+	gwj->tbl = tbl;
+
+	if (cgw_exact_filter(&gwj->ccgw.filter)) {
+		gwj->tbl_id = gwj->ccgw.filter.can_id &
+			gwj->ccgw.filter.can_mask;
+		hlist_add_head(&gwj->tnode, cgw_tbl_head(tbl, gwj->tbl_id));
+	} else
+		hlist_add_head(&gwj->tnode, &tbl->masked);
+
+	tbl->jobs++;
+
+	return 0;
+}
+
+static void cgw_set_free(struct rcu_head *rp)
+{
+	struct cgw_route_set *set = container_of(rp, struct cgw_route_set,
+						 rcu);
+	struct cgw_route_tbl *tbl, *n;
+
+	list_for_each_entry_safe(tbl, n, &set->tables, list)
+		kfree(tbl);
+
+	kfree(set);
+}
+
+static void cgw_bulk_free(struct rcu_head *rp)
+{
+	kfree(container_of(rp, struct cgw_bulk, rcu));
+}
+
+/* find or create the bulk routing of the namespace */
+static struct cgw_bulk *cgw_bulk_get(struct net *net)
+{
+	struct cgw_bulk *bulk;
+
+	list_for_each_entry(bulk, &cgw_bulks, list) {
+		if (net_eq(bulk->net, net))
+			return bulk;
+	}
+
+	bulk = kzalloc(sizeof(*bulk), GFP_KERNEL);
+	if (!bulk)
+		return NULL;
+
+	bulk->net = net;
+	INIT_LIST_HEAD(&bulk->rx);
+	list_add(&bulk->list, &cgw_bulks);
+
+	return bulk;
+}
+
+/* the receivers may still run until rcu */
+static void cgw_bulk_put(struct cgw_bulk *bulk)
+{
+	if (bulk->set || !list_empty(&bulk->rx))
+		return;
+
+	list_del(&bulk->list);
+	call_rcu(&bulk->rcu, cgw_bulk_free);
+}
+
+static int cgw_bulk_rx_add(struct cgw_bulk *bulk, struct net_device *dev)
+{
+	struct cgw_bulk_rx *rx;
+	int err;
+
+	list_for_each_entry(rx, &bulk->rx, list) {
+		if (rx->dev == dev)
+			return 0;
+	}
+
+	rx = kmalloc(sizeof(*rx), GFP_KERNEL);
+	if (!rx)
+		return -ENOMEM;
 
-	/* pointer to modifiable CAN frame */
-	cf = (struct can_frame *)nskb->data;
+	err = can_rx_register(dev_net(dev), dev, 0, 0, cgw_bulk_rcv, bulk,
+			      "gw");
+	if (err) {
+		kfree(rx);
+		return err;
+	}
+
+	rx->dev = dev;
+	list_add(&rx->list, &bulk->rx);
+
+	return 0;
+}
 
-	/* perform preprocessed modification functions if there are any */
-	while (modidx < MAX_MODFUNCTIONS && gwj->mod.modfunc[modidx])
-		(*gwj->mod.modfunc[modidx++])(cf, &gwj->mod);
+static void cgw_bulk_rx_del(struct cgw_bulk *bulk, struct cgw_bulk_rx *rx)
+{
+	can_rx_unregister(dev_net(rx->dev), rx->dev, 0, 0, cgw_bulk_rcv,
+			  bulk);
+	list_del(&rx->list);
+	kfree(rx);
+}
 
-	/* check for checksum updates when the CAN frame has been modified */
-	if (modidx) {
-		if (gwj->mod.csumfunc.crc8)
-			(*gwj->mod.csumfunc.crc8)(cf, &gwj->mod.csum.crc8);
+/* remove the receivers of the devices that are not in the current set */
+static void cgw_bulk_rx_prune(struct cgw_bulk *bulk)
+{
+	struct cgw_bulk_rx *rx, *n;
 
-		if (gwj->mod.csumfunc.xor)
-			(*gwj->mod.csumfunc.xor)(cf, &gwj->mod.csum.xor);
+	list_for_each_entry_safe(rx, n, &bulk->rx, list) {
+		if (!bulk->set || !cgw_set_find_tbl(bulk->set, rx->dev))
+			cgw_bulk_rx_del(bulk, rx);
 	}
+}
 
-	/* clear the skb timestamp if not configured the other way */
-	if (!(gwj->flags & CGW_FLAGS_CAN_SRC_TSTAMP))
-		nskb->tstamp.tv64 = 0;
+/* publish the new set (may be NULL) and retire the old one */
+static void cgw_bulk_swap(struct cgw_bulk *bulk, struct cgw_route_set *set)
+{
+	struct cgw_route_set *old = bulk->set;
+	struct cgw_job *gwj = NULL;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	struct hlist_node *n;
+#endif
+	struct hlist_node *nx;
 
-	/* send to netdevice */
-	if (can_send(nskb, gwj->flags & CGW_FLAGS_CAN_ECHO))
-		gwj->dropped_frames++;
-	else
-		gwj->handled_frames++;
+	rcu_assign_pointer(bulk->set, set);
+	cgw_bulk_rx_prune(bulk);
+
+	if (!old)
+		return;
+
+	/* the jobs of the old set are removed together with it */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	hlist_for_each_entry_safe(gwj, n, nx, &cgw_list, list) {
+#else
+	hlist_for_each_entry_safe(gwj, nx, &cgw_list, list) {
+#endif
+		if (gwj->tbl && gwj->tbl->set == old)
+			cgw_remove_job_rcu(gwj);
+	}
+
+	call_rcu(&old->rcu, cgw_set_free);
 }
 
-static inline int cgw_register_filter(struct cgw_job *gwj)
+/* remove the bulk loaded sets of the namespace (net == NULL => all) */
+static void cgw_bulk_unload(struct net *net)
 {
-	return can_rx_register(gwj->src.dev, gwj->ccgw.filter.can_id,
-			       gwj->ccgw.filter.can_mask, can_can_gw_rcv,
-			       gwj, "gw");
+	struct cgw_bulk *bulk, *n;
+
+	list_for_each_entry_safe(bulk, n, &cgw_bulks, list) {
+		if (net && !net_eq(bulk->net, net))
+			continue;
+
+		cgw_bulk_swap(bulk, NULL);
+		cgw_bulk_put(bulk);
+	}
 }
 
-static inline void cgw_unregister_filter(struct cgw_job *gwj)
+/* the device goes away - its jobs have already been removed */
+static void cgw_bulk_dev_gone(struct net_device *dev)
 {
-	can_rx_unregister(gwj->src.dev, gwj->ccgw.filter.can_id,
-			  gwj->ccgw.filter.can_mask, can_can_gw_rcv, gwj);
+	struct cgw_bulk *bulk, *n;
+	struct cgw_bulk_rx *rx, *nrx;
+
+	list_for_each_entry_safe(bulk, n, &cgw_bulks, list) {
+		list_for_each_entry_safe(rx, nrx, &bulk->rx, list) {
+			if (rx->dev == dev)
+				cgw_bulk_rx_del(bulk, rx);
+		}
+
+		/* all devices of the current set are gone */
+		if (list_empty(&bulk->rx)) {
+			cgw_bulk_swap(bulk, NULL);
+			cgw_bulk_put(bulk);
+		}
+	}
 }
 
 static int cgw_notifier(struct notifier_block *nb,
@@ -425,13 +1620,7 @@ static int cgw_notifier(struct notifier_block *nb,
 {
 	struct net_device *dev = (struct net_device *)data;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
-	if (!net_eq(dev_net(dev), &init_net))
-		return NOTIFY_DONE;
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
-	if (dev->nd_net != &init_net)
-		return NOTIFY_DONE;
-#endif
+	/* jobs are removed in any namespace - see cgw_job_in_net() */
 	if (dev->type != ARPHRD_CAN)
 		return NOTIFY_DONE;
 
@@ -451,20 +1640,75 @@ static int cgw_notifier(struct notifier_block *nb,
 		hlist_for_each_entry_safe(gwj, nx, &cgw_list, list) {
 #endif
 
-			if (gwj->src.dev == dev || gwj->dst.dev == dev) {
-				hlist_del(&gwj->list);
-				cgw_unregister_filter(gwj);
-				kfree(gwj);
-			}
+			if (gwj->src.dev == dev || gwj->dst.dev == dev)
+				cgw_remove_job_rcu(gwj);
 		}
+
+		cgw_bulk_dev_gone(dev);
 	}
 
 	return NOTIFY_DONE;
 }
 
+/* put one modification as CGW_MOD_XXX resp. CGW_FDMOD_XXX attribute */
+static int cgw_put_mod(struct sk_buff *skb, struct nlmsghdr *nlh, int attr,
+		       int fdattr, int fd, struct canfd_frame *cf, u8 modtype)
+{
+	if (!modtype)
+		return 0;
+
+	if (fd) {
+		struct cgw_fdframe_mod mb;
+
+		memcpy(&mb.cf, cf, sizeof(mb.cf));
+		mb.modtype = modtype;
+		if (nla_put(skb, fdattr, sizeof(mb), &mb) < 0)
+			return -EMSGSIZE;
+
+		nlh->nlmsg_len += NLA_HDRLEN + NLA_ALIGN(sizeof(mb));
+	} else {
+		struct cgw_frame_mod mb;
+
+		/* struct can_frame is the first part of struct canfd_frame */
+		memcpy(&mb.cf, cf, sizeof(mb.cf));
+		mb.modtype = modtype;
+		if (nla_put(skb, attr, sizeof(mb), &mb) < 0)
+			return -EMSGSIZE;
+
+		nlh->nlmsg_len += NLA_HDRLEN + NLA_ALIGN(sizeof(mb));
+	}
+
+	return 0;
+}
+
+static void cgw_sum_stats(struct cgw_job *gwj, struct cgw_stats *sum,
+			  u64 *suppressed)
+{
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	*suppressed = 0;
+
+	for_each_possible_cpu(cpu) {
+		struct cgw_pcpu_stats *p = per_cpu_ptr(gwj->stats, cpu);
+
+		sum->handled_frames += p->handled_frames;
+		sum->dropped_frames += p->dropped_frames;
+		*suppressed += p->suppressed_frames;
+		sum->lat_sum_ns += p->lat_sum_ns;
+		if (p->lat_max_ns > sum->lat_max_ns)
+			sum->lat_max_ns = p->lat_max_ns;
+
+		for (i = 0; i < CGW_LAT_BUCKETS; i++)
+			sum->lat_hist[i] += p->lat_hist[i];
+	}
+}
+
 static int cgw_put_job(struct sk_buff *skb, struct cgw_job *gwj)
 {
-	struct cgw_frame_mod mb;
+	int fd = cgw_mod_fd(gwj->gwtype);
+	struct cgw_stats st;
+	u64 suppressed;
 	struct rtcanmsg *rtcan;
 	struct nlmsghdr *nlh = nlmsg_put(skb, 0, 0, 0, sizeof(*rtcan), 0);
 	if (!nlh)
@@ -477,59 +1721,53 @@ static int cgw_put_job(struct sk_buff *skb, struct cgw_job *gwj)
 
 	/* add statistics if available */
 
-	if (gwj->handled_frames) {
-		if (nla_put_u32(skb, CGW_HANDLED, gwj->handled_frames) < 0)
+	cgw_sum_stats(gwj, &st, &suppressed);
+
+	if (st.handled_frames) {
+		if (nla_put_u32(skb, CGW_HANDLED, (u32)st.handled_frames) < 0)
 			goto cancel;
 		else
 			nlh->nlmsg_len += NLA_HDRLEN + NLA_ALIGN(sizeof(u32));
 	}
 
-	if (gwj->dropped_frames) {
-		if (nla_put_u32(skb, CGW_DROPPED, gwj->dropped_frames) < 0)
+	if (st.dropped_frames) {
+		if (nla_put_u32(skb, CGW_DROPPED, (u32)st.dropped_frames) < 0)
 			goto cancel;
 		else
 			nlh->nlmsg_len += NLA_HDRLEN + NLA_ALIGN(sizeof(u32));
 	}
 
-	/* check non default settings of attributes */
+	if (nla_put(skb, CGW_STATS, CGW_STATS_LEN, &st) < 0)
+		goto cancel;
+	else
+		nlh->nlmsg_len += NLA_HDRLEN + NLA_ALIGN(CGW_STATS_LEN);
 
-	if (gwj->mod.modtype.and) {
-		memcpy(&mb.cf, &gwj->mod.modframe.and, sizeof(mb.cf));
-		mb.modtype = gwj->mod.modtype.and;
-		if (nla_put(skb, CGW_MOD_AND, sizeof(mb), &mb) < 0)
+	if (suppressed) {
+		if (nla_put_u32(skb, CGW_SUPPRESSED, (u32)suppressed) < 0)
 			goto cancel;
 		else
-			nlh->nlmsg_len += NLA_HDRLEN + NLA_ALIGN(sizeof(mb));
+			nlh->nlmsg_len += NLA_HDRLEN + NLA_ALIGN(sizeof(u32));
 	}
 
-	if (gwj->mod.modtype.or) {
-		memcpy(&mb.cf, &gwj->mod.modframe.or, sizeof(mb.cf));
-		mb.modtype = gwj->mod.modtype.or;
-		if (nla_put(skb, CGW_MOD_OR, sizeof(mb), &mb) < 0)
-			goto cancel;
-		else
-			nlh->nlmsg_len += NLA_HDRLEN + NLA_ALIGN(sizeof(mb));
-	}
+	/* check non default settings of attributes */
 
-	if (gwj->mod.modtype.xor) {
-		memcpy(&mb.cf, &gwj->mod.modframe.xor, sizeof(mb.cf));
-		mb.modtype = gwj->mod.modtype.xor;
-		if (nla_put(skb, CGW_MOD_XOR, sizeof(mb), &mb) < 0)
-			goto cancel;
-		else
-			nlh->nlmsg_len += NLA_HDRLEN + NLA_ALIGN(sizeof(mb));
-	}
+	if (cgw_put_mod(skb, nlh, CGW_MOD_AND, CGW_FDMOD_AND, fd,
+			&gwj->mod.modframe.and, gwj->mod.modtype.and) < 0)
+		goto cancel;
 
-	if (gwj->mod.modtype.set) {
-		memcpy(&mb.cf, &gwj->mod.modframe.set, sizeof(mb.cf));
-		mb.modtype = gwj->mod.modtype.set;
-		if (nla_put(skb, CGW_MOD_SET, sizeof(mb), &mb) < 0)
-			goto cancel;
-		else
-			nlh->nlmsg_len += NLA_HDRLEN + NLA_ALIGN(sizeof(mb));
-	}
+	if (cgw_put_mod(skb, nlh, CGW_MOD_OR, CGW_FDMOD_OR, fd,
+			&gwj->mod.modframe.or, gwj->mod.modtype.or) < 0)
+		goto cancel;
 
-	if (gwj->mod.csumfunc.crc8) {
+	if (cgw_put_mod(skb, nlh, CGW_MOD_XOR, CGW_FDMOD_XOR, fd,
+			&gwj->mod.modframe.xor, gwj->mod.modtype.xor) < 0)
+		goto cancel;
+
+	if (cgw_put_mod(skb, nlh, CGW_MOD_SET, CGW_FDMOD_SET, fd,
+			&gwj->mod.modframe.set, gwj->mod.modtype.set) < 0)
+		goto cancel;
+
+	if (gwj->mod.csumtype.crc8) {
 		if (nla_put(skb, CGW_CS_CRC8, CGW_CS_CRC8_LEN,
 			    &gwj->mod.csum.crc8) < 0)
 			goto cancel;
@@ -538,7 +1776,7 @@ static int cgw_put_job(struct sk_buff *skb, struct cgw_job *gwj)
 				NLA_ALIGN(CGW_CS_CRC8_LEN);
 	}
 
-	if (gwj->mod.csumfunc.xor) {
+	if (gwj->mod.csumtype.xor) {
 		if (nla_put(skb, CGW_CS_XOR, CGW_CS_XOR_LEN,
 			    &gwj->mod.csum.xor) < 0)
 			goto cancel;
@@ -547,23 +1785,36 @@ static int cgw_put_job(struct sk_buff *skb, struct cgw_job *gwj)
 				NLA_ALIGN(CGW_CS_XOR_LEN);
 	}
 
-	if (gwj->gwtype == CGW_TYPE_CAN_CAN) {
+	/* all gwtypes route between two CAN interfaces (struct can_can_gw) */
 
-		if (gwj->ccgw.filter.can_id || gwj->ccgw.filter.can_mask) {
-			if (nla_put(skb, CGW_FILTER, sizeof(struct can_filter),
-				    &gwj->ccgw.filter) < 0)
-				goto cancel;
-			else
-				nlh->nlmsg_len += NLA_HDRLEN +
-					NLA_ALIGN(sizeof(struct can_filter));
-		}
+	if (gwj->ccgw.filter.can_id || gwj->ccgw.filter.can_mask) {
+		if (nla_put(skb, CGW_FILTER, sizeof(struct can_filter),
+			    &gwj->ccgw.filter) < 0)
+			goto cancel;
+		else
+			nlh->nlmsg_len += NLA_HDRLEN +
+				NLA_ALIGN(sizeof(struct can_filter));
+	}
+
+	if (nla_put_u32(skb, CGW_SRC_IF, gwj->ccgw.src_idx) < 0)
+		goto cancel;
+	else
+		nlh->nlmsg_len += NLA_HDRLEN + NLA_ALIGN(sizeof(u32));
+
+	if (nla_put_u32(skb, CGW_DST_IF, gwj->ccgw.dst_idx) < 0)
+		goto cancel;
+	else
+		nlh->nlmsg_len += NLA_HDRLEN + NLA_ALIGN(sizeof(u32));
 
-		if (nla_put_u32(skb, CGW_SRC_IF, gwj->ccgw.src_idx) < 0)
+	if (gwj->gwtype == CGW_TYPE_CAN_AGGR) {
+		if (nla_put(skb, CGW_AGGR, CGW_AGGR_LEN, &gwj->ccgw.aggr) < 0)
 			goto cancel;
 		else
-			nlh->nlmsg_len += NLA_HDRLEN + NLA_ALIGN(sizeof(u32));
+			nlh->nlmsg_len += NLA_HDRLEN + NLA_ALIGN(CGW_AGGR_LEN);
+	}
 
-		if (nla_put_u32(skb, CGW_DST_IF, gwj->ccgw.dst_idx) < 0)
+	if (gwj->ccgw.refresh) {
+		if (nla_put_u32(skb, CGW_REFRESH, gwj->ccgw.refresh) < 0)
 			goto cancel;
 		else
 			nlh->nlmsg_len += NLA_HDRLEN + NLA_ALIGN(sizeof(u32));
@@ -592,6 +1843,9 @@ static int cgw_dump_jobs(struct sk_buff *skb, struct netlink_callback *cb)
 #else
 	hlist_for_each_entry_rcu(gwj, &cgw_list, list) {
 #endif
+		if (!cgw_job_in_net(gwj, sock_net(skb->sk)))
+			continue;
+
 		if (idx < s_idx)
 			goto cont;
 
@@ -607,94 +1861,78 @@ cont:
 	return skb->len;
 }
 
-/* check for common and gwtype specific attributes */
-static int cgw_parse_attr(struct nlmsghdr *nlh, struct cf_mod *mod,
-			  u8 gwtype, void *gwtypeattr)
+/*
+ * check for one AND/OR/XOR/SET modification - CGW_MOD_XXX for CAN frames
+ * and CGW_FDMOD_XXX for the gwtypes that send CAN FD frames
+ */
+static void cgw_parse_mod(struct cf_mod *mod, struct nlattr *tb[],
+			  int attr, int fdattr, int fd,
+			  struct canfd_frame *modframe, u8 *modtype)
 {
-	struct nlattr *tb[CGW_MAX+1];
-	struct cgw_frame_mod mb;
-	int modidx = 0;
-	int err = 0;
-
-	/* initialize modification & checksum data space */
-	memset(mod, 0, sizeof(*mod));
+	if (fd) {
+		struct cgw_fdframe_mod mb;
 
-	err = nlmsg_parse(nlh, sizeof(struct rtcanmsg), tb, CGW_MAX, NULL);
-	if (err < 0)
-		return err;
-
-	/* check for AND/OR/XOR/SET modifications */
+		if (!tb[fdattr] || nla_len(tb[fdattr]) != CGW_FDMODATTR_LEN)
+			return;
 
-	if (tb[CGW_MOD_AND] &&
-	    nla_len(tb[CGW_MOD_AND]) == CGW_MODATTR_LEN) {
-		nla_memcpy(&mb, tb[CGW_MOD_AND], CGW_MODATTR_LEN);
+		nla_memcpy(&mb, tb[fdattr], CGW_FDMODATTR_LEN);
 
-		canframecpy(&mod->modframe.and, &mb.cf);
-		mod->modtype.and = mb.modtype;
+		canfdframecpy(modframe, &mb.cf);
+		*modtype = mb.modtype;
+	} else {
+		struct cgw_frame_mod mb;
 
-		if (mb.modtype & CGW_MOD_ID)
-			mod->modfunc[modidx++] = mod_and_id;
+		if (!tb[attr] || nla_len(tb[attr]) != CGW_MODATTR_LEN)
+			return;
 
-		if (mb.modtype & CGW_MOD_DLC)
-			mod->modfunc[modidx++] = mod_and_dlc;
+		nla_memcpy(&mb, tb[attr], CGW_MODATTR_LEN);
 
-		if (mb.modtype & CGW_MOD_DATA)
-			mod->modfunc[modidx++] = mod_and_data;
+		canframecpy(modframe, &mb.cf);
+		*modtype = mb.modtype;
 	}
 
-	if (tb[CGW_MOD_OR] &&
-	    nla_len(tb[CGW_MOD_OR]) == CGW_MODATTR_LEN) {
-		nla_memcpy(&mb, tb[CGW_MOD_OR], CGW_MODATTR_LEN);
-
-		canframecpy(&mod->modframe.or, &mb.cf);
-		mod->modtype.or = mb.modtype;
-
-		if (mb.modtype & CGW_MOD_ID)
-			mod->modfunc[modidx++] = mod_or_id;
-
-		if (mb.modtype & CGW_MOD_DLC)
-			mod->modfunc[modidx++] = mod_or_dlc;
-
-		if (mb.modtype & CGW_MOD_DATA)
-			mod->modfunc[modidx++] = mod_or_data;
-	}
+	cgw_fuse_modframe(mod, attr, *modtype, modframe, fd);
+}
 
-	if (tb[CGW_MOD_XOR] &&
-	    nla_len(tb[CGW_MOD_XOR]) == CGW_MODATTR_LEN) {
-		nla_memcpy(&mb, tb[CGW_MOD_XOR], CGW_MODATTR_LEN);
+/* check for common and gwtype specific attributes */
+static int cgw_parse_attr(struct nlattr *attrs, int len, struct cf_mod *mod,
+			  u8 gwtype, void *gwtypeattr)
+{
+	struct nlattr *tb[CGW_MAX+1];
+	int fd = cgw_mod_fd(gwtype);
+	int max_dlen = fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+	int i, err = 0;
 
-		canframecpy(&mod->modframe.xor, &mb.cf);
-		mod->modtype.xor = mb.modtype;
+	/* initialize modification & checksum data space */
+	memset(mod, 0, sizeof(*mod));
 
-		if (mb.modtype & CGW_MOD_ID)
-			mod->modfunc[modidx++] = mod_xor_id;
+	/* no modifications => the identity operation */
+	for (i = 0; i < CGW_FUSED_ELEMS; i++)
+		mod->fused[i].and = ~0ULL;
 
-		if (mb.modtype & CGW_MOD_DLC)
-			mod->modfunc[modidx++] = mod_xor_dlc;
+	for (i = 0; i < CGW_DATA_WORDS; i++)
+		mod->data.and[i] = ~0ULL;
 
-		if (mb.modtype & CGW_MOD_DATA)
-			mod->modfunc[modidx++] = mod_xor_data;
-	}
+	err = nla_parse(tb, CGW_MAX, attrs, len, NULL);
+	if (err < 0)
+		return err;
 
-	if (tb[CGW_MOD_SET] &&
-	    nla_len(tb[CGW_MOD_SET]) == CGW_MODATTR_LEN) {
-		nla_memcpy(&mb, tb[CGW_MOD_SET], CGW_MODATTR_LEN);
+	/* check for AND/OR/XOR/SET modifications */
 
-		canframecpy(&mod->modframe.set, &mb.cf);
-		mod->modtype.set = mb.modtype;
+	cgw_parse_mod(mod, tb, CGW_MOD_AND, CGW_FDMOD_AND, fd,
+		      &mod->modframe.and, &mod->modtype.and);
 
-		if (mb.modtype & CGW_MOD_ID)
-			mod->modfunc[modidx++] = mod_set_id;
+	cgw_parse_mod(mod, tb, CGW_MOD_OR, CGW_FDMOD_OR, fd,
+		      &mod->modframe.or, &mod->modtype.or);
 
-		if (mb.modtype & CGW_MOD_DLC)
-			mod->modfunc[modidx++] = mod_set_dlc;
+	cgw_parse_mod(mod, tb, CGW_MOD_XOR, CGW_FDMOD_XOR, fd,
+		      &mod->modframe.xor, &mod->modtype.xor);
 
-		if (mb.modtype & CGW_MOD_DATA)
-			mod->modfunc[modidx++] = mod_set_data;
-	}
+	cgw_parse_mod(mod, tb, CGW_MOD_SET, CGW_FDMOD_SET, fd,
+		      &mod->modframe.set, &mod->modtype.set);
 
 	/* check for checksum operations after CAN frame modifications */
-	if (modidx) {
+	if (mod->modified) {
 
 		if (tb[CGW_CS_CRC8] &&
 		    nla_len(tb[CGW_CS_CRC8]) == CGW_CS_CRC8_LEN) {
@@ -703,7 +1941,7 @@ static int cgw_parse_attr(struct nlmsghdr *nlh, struct cf_mod *mod,
 				nla_data(tb[CGW_CS_CRC8]);
 
 			err = cgw_chk_csum_parms(c->from_idx, c->to_idx,
-						 c->result_idx);
+						 c->result_idx, max_dlen);
 			if (err)
 				return err;
 
@@ -716,11 +1954,11 @@ static int cgw_parse_attr(struct nlmsghdr *nlh, struct cf_mod *mod,
 			 */
 			if (c->from_idx < 0 || c->to_idx < 0 ||
 			    c->result_idx < 0)
-				mod->csumfunc.crc8 = cgw_csum_crc8_rel;
+				mod->csumtype.crc8 = CGW_CSUM_REL;
 			else if (c->from_idx <= c->to_idx)
-				mod->csumfunc.crc8 = cgw_csum_crc8_pos;
+				mod->csumtype.crc8 = CGW_CSUM_POS;
 			else
-				mod->csumfunc.crc8 = cgw_csum_crc8_neg;
+				mod->csumtype.crc8 = CGW_CSUM_NEG;
 		}
 
 		if (tb[CGW_CS_XOR] &&
@@ -730,7 +1968,7 @@ static int cgw_parse_attr(struct nlmsghdr *nlh, struct cf_mod *mod,
 				nla_data(tb[CGW_CS_XOR]);
 
 			err = cgw_chk_csum_parms(c->from_idx, c->to_idx,
-						 c->result_idx);
+						 c->result_idx, max_dlen);
 			if (err)
 				return err;
 
@@ -743,17 +1981,17 @@ static int cgw_parse_attr(struct nlmsghdr *nlh, struct cf_mod *mod,
 			 */
 			if (c->from_idx < 0 || c->to_idx < 0 ||
 			    c->result_idx < 0)
-				mod->csumfunc.xor = cgw_csum_xor_rel;
+				mod->csumtype.xor = CGW_CSUM_REL;
 			else if (c->from_idx <= c->to_idx)
-				mod->csumfunc.xor = cgw_csum_xor_pos;
+				mod->csumtype.xor = CGW_CSUM_POS;
 			else
-				mod->csumfunc.xor = cgw_csum_xor_neg;
+				mod->csumtype.xor = CGW_CSUM_NEG;
 		}
 	}
 
-	if (gwtype == CGW_TYPE_CAN_CAN) {
+	if (gwtype != CGW_TYPE_UNSPEC && gwtype <= CGW_TYPE_MAX) {
 
-		/* check CGW_TYPE_CAN_CAN specific attributes */
+		/* check the attributes of the CAN/CAN FD routing gwtypes */
 
 		struct can_can_gw *ccgw = (struct can_can_gw *)gwtypeattr;
 		memset(ccgw, 0, sizeof(*ccgw));
@@ -785,6 +2023,30 @@ static int cgw_parse_attr(struct nlmsghdr *nlh, struct cf_mod *mod,
 		/* only one index set to 0 is an error */
 		if (!ccgw->src_idx || !ccgw->dst_idx)
 			return err;
+
+		if (tb[CGW_REFRESH]) {
+			if (nla_len(tb[CGW_REFRESH]) != sizeof(u32))
+				return -EINVAL;
+
+			ccgw->refresh = nla_get_u32(tb[CGW_REFRESH]);
+		}
+
+		if (gwtype == CGW_TYPE_CAN_AGGR) {
+			struct cgw_aggr *aggr = &ccgw->aggr;
+
+			/* the container frame parameters are mandatory */
+			if (!tb[CGW_AGGR] ||
+			    nla_len(tb[CGW_AGGR]) != CGW_AGGR_LEN)
+				return -EINVAL;
+
+			nla_memcpy(aggr, tb[CGW_AGGR], CGW_AGGR_LEN);
+
+			if (aggr->can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG) ||
+			    aggr->flags & ~CANFD_BRS ||
+			    !aggr->timeout ||
+			    aggr->timeout > CGW_AGGR_MAX_TIMEOUT)
+				return -EINVAL;
+		}
 	}
 
 	/* add the checks for other gwtypes here */
@@ -792,44 +2054,78 @@ static int cgw_parse_attr(struct nlmsghdr *nlh, struct cf_mod *mod,
 	return 0;
 }
 
-static int cgw_create_job(struct sk_buff *skb,  struct nlmsghdr *nlh,
-			  void *arg)
+/*
+ * Allocate a job from a struct rtcanmsg and its attributes and check the
+ * devices (rtnl_lock() held). The job is neither registered nor in cgw_list.
+ */
+static int cgw_build_job(struct net *net, struct rtcanmsg *r,
+			 struct nlattr *attrs, int len, struct cgw_job **jobp)
 {
-	struct rtcanmsg *r;
 	struct cgw_job *gwj;
 	int err = 0;
 
-	if (nlmsg_len(nlh) < sizeof(*r))
-		return -EINVAL;
-
-	r = nlmsg_data(nlh);
 	if (r->can_family != AF_CAN)
 		return -EPFNOSUPPORT;
 
-	/* so far we only support CAN -> CAN routings */
-	if (r->gwtype != CGW_TYPE_CAN_CAN)
+	/* all gwtypes route between two CAN interfaces */
+	if (r->gwtype == CGW_TYPE_UNSPEC || r->gwtype > CGW_TYPE_MAX)
 		return -EINVAL;
 
 	gwj = kmem_cache_alloc(cgw_cache, GFP_KERNEL);
 	if (!gwj)
 		return -ENOMEM;
 
-	gwj->handled_frames = 0;
-	gwj->dropped_frames = 0;
+	/* zeroed per-CPU counters */
+	gwj->stats = alloc_percpu(struct cgw_pcpu_stats);
+	if (!gwj->stats) {
+		kmem_cache_free(cgw_cache, gwj);
+		return -ENOMEM;
+	}
+
 	gwj->flags = r->flags;
 	gwj->gwtype = r->gwtype;
+	gwj->crc8_slice = NULL;
+	gwj->aggr = NULL;
+	gwj->chg = NULL;
 
-	err = cgw_parse_attr(nlh, &gwj->mod, CGW_TYPE_CAN_CAN, &gwj->ccgw);
+	err = cgw_parse_attr(attrs, len, &gwj->mod, gwj->gwtype, &gwj->ccgw);
 	if (err < 0)
 		goto out;
 
+	/* select the CRC8 engine - slice-by-4 for linear CRC tables */
+	if (gwj->mod.csumtype.crc8)
+		gwj->crc8_slice = cgw_crc8_slice_tbl(&gwj->mod.csum.crc8);
+
+	if (gwj->gwtype == CGW_TYPE_CAN_AGGR && gwj->ccgw.src_idx) {
+		err = -ENOMEM;
+		gwj->aggr = cgw_aggr_alloc(gwj);
+		if (!gwj->aggr)
+			goto out;
+	}
+
+	/* the change detection works on single frames and needs the flag */
+	if (gwj->flags & CGW_FLAGS_CAN_CHANGED) {
+		err = -EINVAL;
+		if (gwj->gwtype == CGW_TYPE_CAN_AGGR ||
+		    gwj->gwtype == CGW_TYPE_AGGR_CAN)
+			goto out;
+
+		err = -ENOMEM;
+		gwj->chg = cgw_chg_alloc();
+		if (!gwj->chg)
+			goto out;
+	} else if (gwj->ccgw.refresh) {
+		err = -EINVAL;
+		goto out;
+	}
+
 	err = -ENODEV;
 
 	/* ifindex == 0 is not allowed for job creation */
 	if (!gwj->ccgw.src_idx || !gwj->ccgw.dst_idx)
 		goto out;
 
-	gwj->src.dev = dev_get_by_index(&init_net, gwj->ccgw.src_idx);
+	gwj->src.dev = dev_get_by_index(net, gwj->ccgw.src_idx);
 
 	if (!gwj->src.dev)
 		goto out;
@@ -838,7 +2134,7 @@ static int cgw_create_job(struct sk_buff *skb,  struct nlmsghdr *nlh,
 	if (gwj->src.dev->type != ARPHRD_CAN || gwj->src.dev->header_ops)
 		goto put_src_out;
 
-	gwj->dst.dev = dev_get_by_index(&init_net, gwj->ccgw.dst_idx);
+	gwj->dst.dev = dev_get_by_index(net, gwj->ccgw.dst_idx);
 
 	if (!gwj->dst.dev)
 		goto put_src_out;
@@ -847,11 +2143,14 @@ static int cgw_create_job(struct sk_buff *skb,  struct nlmsghdr *nlh,
 	if (gwj->dst.dev->type != ARPHRD_CAN || gwj->dst.dev->header_ops)
 		goto put_src_dst_out;
 
-	ASSERT_RTNL();
+	/* the CAN FD gwtypes need CAN FD capable interfaces */
+	err = -EINVAL;
+	if (gwj->src.dev->mtu < cgw_src_mtu(gwj->gwtype) ||
+	    gwj->dst.dev->mtu < cgw_dst_mtu(gwj->gwtype))
+		goto put_src_dst_out;
 
-	err = cgw_register_filter(gwj);
-	if (!err)
-		hlist_add_head_rcu(&gwj->list, &cgw_list);
+	/* the notifier removes the job together with one of its devices */
+	err = 0;
 
 put_src_dst_out:
 	dev_put(gwj->dst.dev);
@@ -859,12 +2158,168 @@ put_src_out:
 	dev_put(gwj->src.dev);
 out:
 	if (err)
-		kmem_cache_free(cgw_cache, gwj);
+		cgw_free_job(gwj);
+	else
+		*jobp = gwj;
+
+	return err;
+}
+
+/*
+ * Load a route set: the CGW_BULK attributes of the message are built into
+ * a new cgw_route_set, which replaces the bulk loaded route set of the
+ * namespace in cgw_bulk_swap(). Any error leaves the current set in place.
+ */
+static int cgw_bulk_load(struct sk_buff *skb, struct nlmsghdr *nlh)
+{
+	struct net *net = sock_net(skb->sk);
+	struct rtcanmsg *r = nlmsg_data(nlh);
+	struct nlattr *tb[CGW_MAX+1];
+	struct cgw_route_set *set;
+	struct cgw_route_tbl *tbl, *ntbl;
+	struct cgw_bulk *bulk;
+	struct cgw_job *gwj;
+	struct hlist_head jobs;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	struct hlist_node *n;
+#endif
+	struct hlist_node *nx;
+	struct nlattr *nla;
+	int hdrlen = NLMSG_ALIGN(sizeof(*r));
+	int rem, err;
+
+	if (r->can_family != AF_CAN)
+		return -EPFNOSUPPORT;
+
+	err = nlmsg_parse(nlh, sizeof(*r), tb, CGW_MAX, NULL);
+	if (err < 0)
+		return err;
+
+	if (!tb[CGW_BULK])
+		return -EINVAL;
+
+	ASSERT_RTNL();
+
+	bulk = cgw_bulk_get(net);
+	if (!bulk)
+		return -ENOMEM;
+
+	err = -ENOMEM;
+	set = kzalloc(sizeof(*set), GFP_KERNEL);
+	if (!set)
+		goto out_put;
+
+	INIT_LIST_HEAD(&set->tables);
+	INIT_HLIST_HEAD(&jobs);
+
+	/* build the jobs and the routing tables offline */
+	nla_for_each_nested(nla, tb[CGW_BULK], rem) {
+		err = -EINVAL;
+		if (nla_type(nla) != CGW_BULK || nla_len(nla) < hdrlen)
+			goto out_free;
+
+		err = cgw_build_job(net, nla_data(nla),
+				    (struct nlattr *)((u8 *)nla_data(nla) +
+						      hdrlen),
+				    nla_len(nla) - hdrlen, &gwj);
+		if (err)
+			goto out_free;
+
+		hlist_add_head(&gwj->list, &jobs);
+
+		err = cgw_set_add_job(set, gwj);
+		if (err)
+			goto out_free;
+	}
+
+	/* an af_can receiver for each source device of the new set */
+	list_for_each_entry(tbl, &set->tables, list) {
+		err = cgw_bulk_rx_add(bulk, tbl->dev);
+		if (err) {
+			cgw_bulk_rx_prune(bulk);
+			goto out_free;
+		}
+	}
+
+	/* the jobs show up in the dumps before they become active */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	hlist_for_each_entry_safe(gwj, n, nx, &jobs, list) {
+#else
+	hlist_for_each_entry_safe(gwj, nx, &jobs, list) {
+#endif
+		if (gwj->flags & CGW_FLAGS_CAN_LATENCY)
+			net_enable_timestamp();
+
+		hlist_del(&gwj->list);
+		hlist_add_head_rcu(&gwj->list, &cgw_list);
+	}
+
+	cgw_bulk_swap(bulk, set);
+
+	return 0;
+
+out_free:
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	hlist_for_each_entry_safe(gwj, n, nx, &jobs, list)
+#else
+	hlist_for_each_entry_safe(gwj, nx, &jobs, list)
+#endif
+		cgw_free_job(gwj);
+
+	list_for_each_entry_safe(tbl, ntbl, &set->tables, list)
+		kfree(tbl);
+
+	kfree(set);
+out_put:
+	cgw_bulk_put(bulk);
 
 	return err;
 }
 
-static void cgw_remove_all_jobs(void)
+static int cgw_create_job(struct sk_buff *skb,  struct nlmsghdr *nlh,
+			  void *arg)
+{
+	struct rtcanmsg *r;
+	struct cgw_job *gwj;
+	int err;
+
+	if (nlmsg_len(nlh) < sizeof(*r))
+		return -EINVAL;
+
+	r = nlmsg_data(nlh);
+
+	/* CGW_TYPE_UNSPEC carries a whole route set in CGW_BULK */
+	if (r->gwtype == CGW_TYPE_UNSPEC)
+		return cgw_bulk_load(skb, nlh);
+
+	err = cgw_build_job(sock_net(skb->sk), r,
+			    nlmsg_attrdata(nlh, sizeof(*r)),
+			    nlmsg_attrlen(nlh, sizeof(*r)), &gwj);
+	if (err)
+		return err;
+
+	ASSERT_RTNL();
+
+	/* the latency is measured from the reception timestamp */
+	if (gwj->flags & CGW_FLAGS_CAN_LATENCY)
+		net_enable_timestamp();
+
+	err = cgw_register_filter(gwj);
+	if (err) {
+		if (gwj->flags & CGW_FLAGS_CAN_LATENCY)
+			net_disable_timestamp();
+
+		cgw_free_job(gwj);
+		return err;
+	}
+
+	hlist_add_head_rcu(&gwj->list, &cgw_list);
+
+	return 0;
+}
+
+/* remove the jobs of the given namespace (net == NULL => all jobs) */
+static void cgw_remove_all_jobs(struct net *net)
 {
 	struct cgw_job *gwj = NULL;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
@@ -874,14 +2329,18 @@ static void cgw_remove_all_jobs(void)
 
 	ASSERT_RTNL();
 
+	/* the bulk loaded jobs stop routing at once with their set */
+	cgw_bulk_unload(net);
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
 	hlist_for_each_entry_safe(gwj, n, nx, &cgw_list, list) {
 #else
 	hlist_for_each_entry_safe(gwj, nx, &cgw_list, list) {
 #endif
-		hlist_del(&gwj->list);
-		cgw_unregister_filter(gwj);
-		kfree(gwj);
+		if (!cgw_job_in_net(gwj, net))
+			continue;
+
+		cgw_remove_job_rcu(gwj);
 	}
 }
 
@@ -904,17 +2363,26 @@ static int cgw_remove_job(struct sk_buff *skb,  struct nlmsghdr *nlh, void *arg)
 	if (r->can_family != AF_CAN)
 		return -EPFNOSUPPORT;
 
-	/* so far we only support CAN -> CAN routings */
-	if (r->gwtype != CGW_TYPE_CAN_CAN)
+	/* CGW_TYPE_UNSPEC removes the bulk loaded route set */
+	if (r->gwtype == CGW_TYPE_UNSPEC) {
+		ASSERT_RTNL();
+		cgw_bulk_unload(sock_net(skb->sk));
+		return 0;
+	}
+
+	/* all gwtypes route between two CAN interfaces */
+	if (r->gwtype > CGW_TYPE_MAX)
 		return -EINVAL;
 
-	err = cgw_parse_attr(nlh, &mod, CGW_TYPE_CAN_CAN, &ccgw);
+	err = cgw_parse_attr(nlmsg_attrdata(nlh, sizeof(*r)),
+			     nlmsg_attrlen(nlh, sizeof(*r)),
+			     &mod, r->gwtype, &ccgw);
 	if (err < 0)
 		return err;
 
 	/* two interface indices both set to 0 => remove all entries */
 	if (!ccgw.src_idx && !ccgw.dst_idx) {
-		cgw_remove_all_jobs();
+		cgw_remove_all_jobs(sock_net(skb->sk));
 		return 0;
 	}
 
@@ -929,19 +2397,23 @@ static int cgw_remove_job(struct sk_buff *skb,  struct nlmsghdr *nlh, void *arg)
 	hlist_for_each_entry_safe(gwj, nx, &cgw_list, list) {
 #endif
 
+		if (!cgw_job_in_net(gwj, sock_net(skb->sk)))
+			continue;
+
+		if (gwj->gwtype != r->gwtype)
+			continue;
+
 		if (gwj->flags != r->flags)
 			continue;
 
 		if (memcmp(&gwj->mod, &mod, sizeof(mod)))
 			continue;
 
-		/* if (r->gwtype == CGW_TYPE_CAN_CAN) - is made sure here */
+		/* all gwtypes use struct can_can_gw so far */
 		if (memcmp(&gwj->ccgw, &ccgw, sizeof(ccgw)))
 			continue;
 
-		hlist_del(&gwj->list);
-		cgw_unregister_filter(gwj);
-		kfree(gwj);
+		cgw_remove_job_rcu(gwj);
 		err = 0;
 		break;
 	}
@@ -992,7 +2464,7 @@ static __exit void cgw_module_exit(void)
 	unregister_netdevice_notifier(&notifier);
 
 	rtnl_lock();
-	cgw_remove_all_jobs();
+	cgw_remove_all_jobs(NULL);
 	rtnl_unlock();
 
 	rcu_barrier(); /* Wait for completion of call_rcu()'s */
@@ -7,9 +7,11 @@
  * In the discussion the Socket-API to the userspace or the ISO-TP socket
  * options or the return values we may change! Current behaviour:
  *
- * - no ISO-TP specific return values are provided to the userspace
- * - when a transfer (tx) is on the run the next write() blocks until it's done
- * - no support for sending wait frames to the data source in the rx path
+ * - protocol errors are reported via sk_err (ETIMEDOUT, ECOMM, EILSEQ, ...)
+ * - write() queues complete PDUs (bounded by sk_sndbuf) that are sent
+ *   back to back. write() only blocks when the send buffer is exhausted
+ * - wait frames are sent in the rx path (up to wftmax) while the socket
+ *   receive queue has no room for the PDU
  *
  * Copyright (c) 2008 Volkswagen Group Electronic Research
  * All rights reserved.
@@ -59,10 +61,18 @@
 #include <linux/wait.h>
 #include <linux/uio.h>
 #include <linux/net.h>
+#include <linux/file.h>
 #include <linux/netdevice.h>
 #include <linux/socket.h>
 #include <linux/if_arp.h>
 #include <linux/skbuff.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/errqueue.h>
 #include <socketcan/can.h>
 #include <socketcan/can/core.h>
 #include <socketcan/can/isotp.h>
@@ -70,7 +80,10 @@
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
 #include <net/net_namespace.h>
 #endif
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,25)
+#ifdef CAN_BUSY_POLL
+#include <net/busy_poll.h>
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
 #include "compat.h"
 #endif
 
@@ -101,11 +114,10 @@ MODULE_ALIAS("can-proto-6");
 
 /*
   ISO 15765-2:2015 supports more than 4095 byte per ISO PDU as the FF_DL can
-  take full 32 bit values (4 Gbyte). We would need some good concept to handle
-  this between user space and kernel space. For now increase the static buffer
-  to something about 8 kbyte to be able to test this new functionality.
+  take full 32 bit values (4 Gbyte). The PDU buffers are allocated on demand
+  when a FF is received or a PDU is sent. Their size is only limited by the
+  sockets receive and send buffer sizes (SO_RCVBUF / SO_SNDBUF).
 */
-#define MAX_MSG_LENGTH 8200
 
 /* N_PCI type values in bits 7-4 of N_PCI bytes */
 #define N_PCI_SF	0x00 /* single frame */
@@ -122,6 +134,36 @@ MODULE_ALIAS("can-proto-6");
 
 #define ISOTP_CHECK_PADDING (CAN_ISOTP_CHK_PAD_LEN | CAN_ISOTP_CHK_PAD_DATA)
 
+/* the socket options of the specialized receive handlers (rcv_key) */
+#define ISOTP_RCV_AE	0x01	/* CAN_ISOTP_EXTEND_ADDR */
+#define ISOTP_RCV_FD	0x02	/* ll.mtu == CANFD_MTU */
+#define ISOTP_RCV_PAD	0x04	/* ISOTP_CHECK_PADDING */
+
+/* tx confirmations are read with the generic sock_recv_errqueue() */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0)
+#define ISOTP_TX_CONFIRM
+#endif
+
+#define ISOTP_TX_BURST	32		/* max. CFs created in one go */
+#define ISOTP_TX_RETRY	1000000		/* retry CF creation after 1 ms */
+#define ISOTP_RX_WT_GAP	100000000	/* FC.WT every 100 ms (< N_Bs) */
+
+/*
+ * Since Linux 4.16 hrtimers can expire in softirq context. The CFs are then
+ * sent directly from the tx timer without the additional tasklet hop which
+ * adds latency and jitter to STmin paced transmissions.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,16,0)
+#define ISOTP_SOFT_HRTIMER
+#define ISOTP_TX_HRTIMER_REL HRTIMER_MODE_REL_SOFT
+#define ISOTP_TX_HRTIMER_ABS HRTIMER_MODE_ABS_SOFT
+#define ISOTP_RX_HRTIMER_REL HRTIMER_MODE_REL_SOFT
+#else
+#define ISOTP_TX_HRTIMER_REL HRTIMER_MODE_REL
+#define ISOTP_TX_HRTIMER_ABS HRTIMER_MODE_ABS
+#define ISOTP_RX_HRTIMER_REL HRTIMER_MODE_REL
+#endif
+
 /* Flow Status given in FC frame */
 #define ISOTP_FC_CTS	0	/* clear to send */
 #define ISOTP_FC_WT	1	/* wait */
@@ -132,37 +174,126 @@ enum {
 	ISOTP_WAIT_FIRST_FC,
 	ISOTP_WAIT_FC,
 	ISOTP_WAIT_DATA,
-	ISOTP_SENDING
+	ISOTP_SENDING,
+	ISOTP_WAIT_ROOM		/* rx: FC.WT sent, no room in the socket */
 };
 
+#define ISOTP_TRACE_STATES				\
+	{ ISOTP_IDLE,		"IDLE" },		\
+	{ ISOTP_WAIT_FIRST_FC,	"WAIT_FIRST_FC" },	\
+	{ ISOTP_WAIT_FC,	"WAIT_FC" },		\
+	{ ISOTP_WAIT_DATA,	"WAIT_DATA" },		\
+	{ ISOTP_SENDING,	"SENDING" },		\
+	{ ISOTP_WAIT_ROOM,	"WAIT_ROOM" }
+
+#define CREATE_TRACE_POINTS
+#include "isotp_trace.h"
+
 struct tpcon {
-	int idx;
-	int len;
-	u8  state;
+	u32 idx;
+	u32 len;
+	u32 state;
 	u8  bs;
 	u8  sn;
 	u8  ll_dl;
-	u8  buf[MAX_MSG_LENGTH+1];
+	struct sk_buff *skb;	/* holds the buffer of the current pdu */
+};
+
+/*
+ * An ISO-TP channel is a rx_id/tx_id pair with its own reassembly state.
+ * Besides the channel given in bind() a socket can serve a table of
+ * additional channels (CAN_ISOTP_CHANNELS), e.g. for ECU simulations that
+ * answer many tester addresses with one socket.
+ */
+struct isotp_chan {
+	struct hlist_node list;
+	struct isotp_sock *so;
+	canid_t rxid;
+	canid_t txid;
+	ktime_t lastrxcf_tstamp;
+	ktime_t ff_tstamp;	/* start of the current rx pdu */
+	struct hrtimer rxtimer;
+#ifndef ISOTP_SOFT_HRTIMER
+	struct tasklet_struct rxtsklet;
+	unsigned int rx_tmr_gen;	/* bumped by isotp_rx_timer_cancel() */
+	unsigned int rx_tsk_gen;	/* rx_tmr_gen of the expired timer */
+#endif
+	u8 rx_wft;		/* FC.WT frames sent since the last CTS */
+	u8 rx_early_fc;		/* CTS of the next block already sent */
+	unsigned long ana_used;	/* jiffies of the last analyzed frame */
+	struct tpcon rx;
+};
+
+struct isotp_chan_tab {
+	unsigned int num;
+	unsigned int hash_bits;
+	struct hlist_head *hash;
+	struct isotp_chan chan[0];
+};
+
+/* destination of a queued tx pdu */
+struct isotp_pdu_cb {
+	canid_t txid;
+	canid_t rxid;
+	int func;		/* functional request (CAN_ISOTP_FUNC_ADDR) */
+	int route;		/* cut-through pdu that is still received */
+	int aborted;		/* route: the reception has failed */
+	u32 avail;		/* route: bytes received so far */
+	struct isotp_sock *to;	/* route: sending socket (reference held) */
 };
 
+#define ISOTP_PDU_CB(skb) ((struct isotp_pdu_cb *)(skb)->cb)
+
 struct isotp_sock {
 	struct sock sk;
 	int bound;
 	int ifindex;
-	canid_t txid;
-	canid_t rxid;
+	struct net_device *dev;	/* bound netdevice (RCU, reference held) */
+	struct isotp_chan chan;	/* channel given in bind() */
+	struct isotp_chan_tab *chantab; /* additional channels (sockopt) */
+	struct isotp_chan_tab *anatab;	/* observed channels (analyzer) */
+	struct isotp_chan *ana_ff;	/* analyzer channel waiting for FC */
+	spinlock_t ana_lock;
+	canid_t tx_id;		/* CAN ID of the current tx pdu */
+	canid_t tx_fcid;	/* CAN ID of the expected FC for the tx pdu */
+	atomic_t tx_fc_credit;	/* blocks granted early (CAN_ISOTP_EARLY_FC) */
 	ktime_t tx_gap;
-	ktime_t lastrxcf_tstamp;
-	struct hrtimer rxtimer, txtimer;
+	ktime_t lasttxcf_tstamp;
+	ktime_t tx_ff_tstamp;	/* start of the current segmented tx pdu */
+	struct hrtimer txtimer;
+#ifndef ISOTP_SOFT_HRTIMER
 	struct tasklet_struct txtsklet;
+#endif
+	struct can_isotp_gap_stats txgap;
+	struct can_isotp_stats stats;
+	struct hlist_node proc_list;
 	struct can_isotp_options opt;
 	struct can_isotp_fc_options rxfc, txfc;
 	struct can_isotp_ll_options ll;
+	struct can_isotp_timeouts tmo;
+	int qdisc_bypass;
+	struct can_isotp_func func;
+	struct hrtimer functimer; /* response deadline of functional requests */
+#ifndef ISOTP_SOFT_HRTIMER
+	struct tasklet_struct functsklet;
+#endif
+	int func_active;
+	u32 func_rsp;		/* pdus received before the deadline */
 	__u32 force_tx_stmin;
 	__u32 force_rx_stmin;
-	struct tpcon rx, tx;
+	struct tpcon tx;
+	struct sk_buff_head tx_queue;
 	struct notifier_block notifier;
 	wait_queue_head_t wait;
+	struct isotp_sock *route; /* CAN_ISOTP_ROUTE (RCU, reference held) */
+	int tx_closed;		/* no more route kicks (release) */
+	int rcv_key;		/* ISOTP_RCV_* of the current options */
+	void (*rcv_func)(struct sk_buff *skb, void *data); /* registered */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0)
+	void (*data_ready)(struct sock *sk);
+#else
+	void (*data_ready)(struct sock *sk, int bytes);
+#endif
 };
 
 static inline struct isotp_sock *isotp_sk(const struct sock *sk)
@@ -170,27 +301,542 @@ static inline struct isotp_sock *isotp_sk(const struct sock *sk)
 	return (struct isotp_sock *)sk;
 }
 
-static enum hrtimer_restart isotp_rx_timer_handler(struct hrtimer *hrtimer)
+/* state transitions of the rx path of a channel and of the tx path */
+static inline void isotp_rx_state(struct isotp_chan *ch, u32 state)
+{
+	trace_isotp_state(ch->so, 1, ch->rxid, ch->rx.state, state,
+			  ch->rx.idx, ch->rx.len);
+	ch->rx.state = state;
+}
+
+static inline void isotp_tx_state(struct isotp_sock *so, u32 state)
+{
+	trace_isotp_state(so, 0, so->tx_id, so->tx.state, state,
+			  so->tx.idx, so->tx.len);
+	so->tx.state = state;
+}
+
+/* key of the specialized receive handler, see isotp_rcv_func() */
+static inline void isotp_update_rcv_key(struct isotp_sock *so)
+{
+	int key = 0;
+
+	if (so->opt.flags & CAN_ISOTP_EXTEND_ADDR)
+		key |= ISOTP_RCV_AE;
+	if (so->ll.mtu == CANFD_MTU)
+		key |= ISOTP_RCV_FD;
+	if (so->opt.flags & ISOTP_CHECK_PADDING)
+		key |= ISOTP_RCV_PAD;
+
+	so->rcv_key = key;
+}
+
+/* all isotp sockets for the /proc/net/can-isotp table */
+static HLIST_HEAD(isotp_sockets);
+static DEFINE_SPINLOCK(isotp_sockets_lock);
+
+static struct proc_dir_entry *proc_entry;
+
+/*
+ * The statistics counters are updated without locking. Concurrent updates
+ * from rx softirqs on different CPUs may get lost which is acceptable for
+ * the intended diagnostic use.
+ */
+static void isotp_hist_add(__u64 *hist, ktime_t start)
+{
+	s64 us = ktime_to_us(ktime_sub(ktime_get(), start));
+	int slot = 0;
+
+	if (us > 1)
+		slot = min_t(int, ilog2(us), CAN_ISOTP_HIST_SLOTS - 1);
+
+	hist[slot]++;
+}
+
+/* report a failed rx/tx pdu to the socket (POLLERR, -err on next call) */
+static void isotp_report_err(struct isotp_sock *so, int err)
+{
+	struct sock *sk = &so->sk;
+
+	/* the analyzer only counts the errors of the observed transfers */
+	if (so->opt.flags & CAN_ISOTP_ANALYZER)
+		return;
+
+	sk->sk_err = err;
+	if (!sock_flag(sk, SOCK_DEAD))
+		sk->sk_error_report(sk);
+}
+
+/* queue a notification to the error queue of the socket (MSG_ERRQUEUE) */
+static void isotp_queue_ee(struct isotp_sock *so, u8 code, int err,
+			   u32 info, u32 data)
+{
+#ifdef ISOTP_TX_CONFIRM
+	struct sock_exterr_skb *serr;
+	struct sk_buff *skb;
+
+	skb = alloc_skb(0, GFP_ATOMIC);
+	if (!skb)
+		return;
+
+	serr = SKB_EXT_ERR(skb);
+	memset(serr, 0, sizeof(*serr));
+	serr->ee.ee_errno = err;
+	serr->ee.ee_origin = SO_EE_ORIGIN_LOCAL;
+	serr->ee.ee_code = code;
+	serr->ee.ee_info = info;
+	serr->ee.ee_data = data;
+
+	if (sock_queue_err_skb(&so->sk, skb))
+		kfree_skb(skb);
+#endif
+}
+
+/*
+ * With CAN_ISOTP_TX_CONFIRM the result of each pdu that has been taken
+ * from the tx queue is queued to the error queue of the socket:
+ * ee_errno = 0 (success) or the error, ee_info = pdu length and
+ * ee_data = tx_id of the pdu.
+ */
+static void isotp_tx_confirm(struct isotp_sock *so, int err)
+{
+	if (so->opt.flags & CAN_ISOTP_TX_CONFIRM)
+		isotp_queue_ee(so, CAN_ISOTP_EE_TX_CONFIRM, err, so->tx.len,
+			       so->tx_id);
+}
+
+/*
+ * The response deadline of a functional request expired: report the
+ * number of pdus that have been received since the request was sent.
+ */
+static void isotp_func_timer_work(struct isotp_sock *so)
+{
+	so->func_active = 0;
+	isotp_queue_ee(so, CAN_ISOTP_EE_FUNC_DONE, 0, so->func_rsp,
+		       so->func.tx_id);
+}
+
+/* the error queue skb can only be allocated and queued in softirq context */
+#ifdef ISOTP_SOFT_HRTIMER
+static enum hrtimer_restart isotp_func_timer_handler(struct hrtimer *hrtimer)
+{
+	isotp_func_timer_work(container_of(hrtimer, struct isotp_sock,
+					   functimer));
+
+	return HRTIMER_NORESTART;
+}
+#else
+static void isotp_func_timer_tsklet(unsigned long data)
+{
+	isotp_func_timer_work((struct isotp_sock *)data);
+}
+
+static enum hrtimer_restart isotp_func_timer_handler(struct hrtimer *hrtimer)
 {
 	struct isotp_sock *so = container_of(hrtimer, struct isotp_sock,
-					     rxtimer);
-	if (so->rx.state == ISOTP_WAIT_DATA) {
-#if 0
-		struct sock *sk = &so->sk;
+					     functimer);
+	tasklet_schedule(&so->functsklet);
 
-		/* report 'timeout' */
-		sk->sk_err = E?????;
-		if (!sock_flag(sk, SOCK_DEAD))
-			sk->sk_error_report(sk);
+	return HRTIMER_NORESTART;
+}
 #endif
+
+static void isotp_tx_next(struct isotp_sock *so);
+static void isotp_rx_grant(struct sock *sk, struct isotp_chan *ch, int ae);
+
+/*
+ * The bound netdevice is held for the lifetime of the binding to omit the
+ * netdevice lookup for each transmitted CAN frame. The tx path accesses
+ * so->dev under rcu_read_lock() without taking an additional reference.
+ */
+static void isotp_dev_release(struct isotp_sock *so)
+{
+	struct net_device *dev = so->dev;
+
+	if (!dev)
+		return;
+
+	rcu_assign_pointer(so->dev, NULL);
+	synchronize_rcu();
+	dev_put(dev);
+}
+
+/*
+ * CAN_ISOTP_ROUTE: the pdus received by a socket are sent on the linked
+ * socket. The reassembly buffer of a segmented pdu is queued as tx pdu as
+ * soon as it holds the data of the outgoing FF. The outgoing CFs follow
+ * the incoming ones (tx state ISOTP_WAIT_DATA while the data is missing).
+ * Both sides run their own flow control.
+ */
+
+/* continue a cut-through transmission that waits for data */
+static void isotp_tx_kick(struct isotp_sock *so)
+{
+	rcu_read_lock();
+	if (!READ_ONCE(so->tx_closed) &&
+	    cmpxchg(&so->tx.state, ISOTP_WAIT_DATA,
+		    ISOTP_SENDING) == ISOTP_WAIT_DATA)
+		hrtimer_start(&so->txtimer, ktime_set(0, 0),
+			      ISOTP_TX_HRTIMER_REL);
+	rcu_read_unlock();
+}
+
+/* publish the received data of a cut-through pdu to the sending socket */
+static void isotp_route_update(struct isotp_chan *ch, int aborted)
+{
+	struct isotp_pdu_cb *cb = ISOTP_PDU_CB(ch->rx.skb);
+
+	/* the payload has to be visible before the new length */
+	smp_wmb();
+	if (aborted)
+		WRITE_ONCE(cb->aborted, 1);
+	else
+		WRITE_ONCE(cb->avail, min(ch->rx.idx, ch->rx.len));
+
+	isotp_tx_kick(cb->to);
+}
+
+/* hand over the completed or aborted cut-through pdu to the sender */
+static void isotp_route_release(struct isotp_chan *ch, int aborted)
+{
+	struct sk_buff *pdu = ch->rx.skb;
+	struct isotp_sock *to = ISOTP_PDU_CB(pdu)->to;
+
+	isotp_route_update(ch, aborted);
+
+	ch->rx.skb = NULL;
+	consume_skb(pdu);
+	sock_put(&to->sk);
+}
+
+/*
+ * Queue a received pdu for the transmission on the linked socket. Called
+ * under rcu_read_lock(): isotp_release() closes the tx path of the socket
+ * and waits for a grace period before it purges the tx queue and stops
+ * the txtimer. A pdu for a closed socket is dropped.
+ */
+static void isotp_route_pdu(struct isotp_sock *to, struct sk_buff *pdu)
+{
+	struct isotp_pdu_cb *cb = ISOTP_PDU_CB(pdu);
+
+	BUILD_BUG_ON(sizeof(pdu->cb) < sizeof(struct isotp_pdu_cb));
+
+	if (READ_ONCE(to->tx_closed)) {
+		kfree_skb(pdu);
+		return;
+	}
+
+	cb->txid = to->chan.txid;
+	cb->rxid = to->chan.rxid;
+	cb->func = 0;
+
+	skb_queue_tail(&to->tx_queue, pdu);
+	isotp_tx_next(to);
+}
+
+/*
+ * New data of a segmented rx pdu: start the cut-through transmission when
+ * the data of the outgoing FF is there, or update the running one.
+ */
+static void isotp_route_data(struct isotp_sock *so, struct isotp_chan *ch)
+{
+	struct isotp_pdu_cb *cb = ISOTP_PDU_CB(ch->rx.skb);
+	struct isotp_sock *to;
+	int ae, ff_pci_sz;
+
+	if (cb->route) {
+		isotp_route_update(ch, 0);
+		return;
+	}
+
+	to = rcu_dereference(so->route);
+	if (!to || !to->bound || READ_ONCE(to->tx_closed))
+		return;
+
+	ae = (to->opt.flags & CAN_ISOTP_EXTEND_ADDR)? 1:0;
+	ff_pci_sz = (ch->rx.len > 4095)? FF_PCI_SZ32 : FF_PCI_SZ12;
+
+	/* an outgoing SF needs the complete pdu (see isotp_rcv_skb()) */
+	if (ch->rx.idx < min_t(u32, ch->rx.len,
+			       to->ll.tx_dl - ae - ff_pci_sz))
+		return;
+
+	cb->route = 1;
+	cb->aborted = 0;
+	cb->avail = min(ch->rx.idx, ch->rx.len);
+	cb->to = to;
+	sock_hold(&to->sk);
+
+	isotp_route_pdu(to, skb_get(ch->rx.skb));
+}
+
+/* release the reassembly buffer of an incomplete rx pdu */
+static inline void isotp_rx_free(struct isotp_chan *ch)
+{
+	if (ch->rx.skb && ISOTP_PDU_CB(ch->rx.skb)->route) {
+		/* abort the outgoing cut-through pdu */
+		isotp_route_release(ch, 1);
+		return;
+	}
+
+	if (ch->rx.skb) {
+		kfree_skb(ch->rx.skb);
+		ch->rx.skb = NULL;
+	}
+}
+
+static void isotp_rx_timer_work(struct isotp_chan *ch)
+{
+	struct isotp_sock *so = ch->so;
+
+	/* check for room in the socket again and send CTS, WT or OVFLW */
+	if (ch->rx.state == ISOTP_WAIT_ROOM) {
+		isotp_rx_grant(&so->sk, ch,
+			       (so->opt.flags & CAN_ISOTP_EXTEND_ADDR)? 1:0);
+		return;
+	}
+
+	if (ch->rx.state == ISOTP_WAIT_DATA) {
 		DBG("we did not get new data frames in time.\n");
+		ch->so->stats.rx_timeouts++;
+
+		/* report 'timeout' */
+		isotp_report_err(ch->so, ETIMEDOUT);
 
-		/* reset tx state */
-		so->rx.state = ISOTP_IDLE;
+		/* the outgoing cut-through pdu is aborted right away */
+		if (ch->rx.skb && ISOTP_PDU_CB(ch->rx.skb)->route)
+			isotp_rx_free(ch);
+
+		/*
+		 * reset rx state - the reassembly buffer is released
+		 * with the next received SF/FF or at socket release time
+		 */
+		isotp_rx_state(ch, ISOTP_IDLE);
 	}
+}
+
+/* FC frames can only be sent from the rx timer in softirq context */
+#ifdef ISOTP_SOFT_HRTIMER
+static enum hrtimer_restart isotp_rx_timer_handler(struct hrtimer *hrtimer)
+{
+	isotp_rx_timer_work(container_of(hrtimer, struct isotp_chan, rxtimer));
+
+	return HRTIMER_NORESTART;
+}
+#else
+static void isotp_rx_timer_tsklet(unsigned long data)
+{
+	struct isotp_chan *ch = (struct isotp_chan *)data;
+
+	/* the timer has been cancelled after it scheduled the tasklet */
+	if (READ_ONCE(ch->rx_tsk_gen) != READ_ONCE(ch->rx_tmr_gen))
+		return;
+
+	isotp_rx_timer_work(ch);
+}
+
+static enum hrtimer_restart isotp_rx_timer_handler(struct hrtimer *hrtimer)
+{
+	struct isotp_chan *ch = container_of(hrtimer, struct isotp_chan,
+					     rxtimer);
+
+	WRITE_ONCE(ch->rx_tsk_gen, READ_ONCE(ch->rx_tmr_gen));
+	tasklet_schedule(&ch->rxtsklet);
 
 	return HRTIMER_NORESTART;
 }
+#endif
+
+/*
+ * hrtimer_cancel() does not stop a tasklet that has already been scheduled
+ * by the timer. The rx path runs in softirq context where tasklet_kill()
+ * can not be used, so a pending tasklet is invalidated instead.
+ */
+static inline void isotp_rx_timer_cancel(struct isotp_chan *ch)
+{
+	hrtimer_cancel(&ch->rxtimer);
+#ifndef ISOTP_SOFT_HRTIMER
+	WRITE_ONCE(ch->rx_tmr_gen, ch->rx_tmr_gen + 1);
+#endif
+}
+
+static void isotp_chan_init(struct isotp_sock *so, struct isotp_chan *ch,
+			    canid_t rxid, canid_t txid)
+{
+	ch->so = so;
+	ch->rxid = rxid;
+	ch->txid = txid;
+	ch->rx.state = ISOTP_IDLE;
+	hrtimer_init(&ch->rxtimer, CLOCK_MONOTONIC, ISOTP_RX_HRTIMER_REL);
+	ch->rxtimer.function = isotp_rx_timer_handler;
+#ifndef ISOTP_SOFT_HRTIMER
+	tasklet_init(&ch->rxtsklet, isotp_rx_timer_tsklet, (unsigned long)ch);
+#endif
+}
+
+static void isotp_chan_stop(struct isotp_chan *ch)
+{
+	hrtimer_cancel(&ch->rxtimer);
+#ifndef ISOTP_SOFT_HRTIMER
+	tasklet_kill(&ch->rxtsklet);
+#endif
+	isotp_rx_state(ch, ISOTP_IDLE);
+	isotp_rx_free(ch);
+}
+
+/* get the channel of a received CAN ID from a channel table */
+static struct isotp_chan *isotp_tab_chan(struct isotp_chan_tab *tab,
+					 canid_t can_id)
+{
+	struct isotp_chan *ch;
+	struct hlist_node *pos;
+
+	if (!tab)
+		return NULL;
+
+	hlist_for_each(pos, &tab->hash[hash_32(can_id, tab->hash_bits)]) {
+		ch = hlist_entry(pos, struct isotp_chan, list);
+		if (ch->rxid == can_id)
+			return ch;
+	}
+
+	return NULL;
+}
+
+/* get the channel of a received CAN ID */
+static struct isotp_chan *isotp_find_chan(struct isotp_sock *so,
+					  canid_t can_id)
+{
+	if (can_id == so->chan.rxid)
+		return &so->chan;
+
+	return isotp_tab_chan(so->chantab, can_id);
+}
+
+static void isotp_free_chantab(struct isotp_chan_tab *tab)
+{
+	unsigned int i;
+
+	if (!tab)
+		return;
+
+	for (i = 0; i < tab->num; i++)
+		isotp_chan_stop(&tab->chan[i]);
+
+	kfree(tab->hash);
+	vfree(tab);
+}
+
+/*
+ * create the channel table from the user provided rx_id/tx_id pairs
+ * (uchan == NULL: empty table for up to num channels)
+ */
+static struct isotp_chan_tab *isotp_alloc_chantab(struct isotp_sock *so,
+					const struct can_isotp_chan *uchan,
+					unsigned int num)
+{
+	size_t size = sizeof(struct isotp_chan_tab) +
+		      num * sizeof(struct isotp_chan);
+	struct isotp_chan_tab *tab;
+	struct isotp_chan *ch;
+	unsigned int i;
+
+	tab = vmalloc(size);
+	if (!tab)
+		return NULL;
+
+	memset(tab, 0, size);
+
+	/* at least two buckets and a load factor <= 0.5 */
+	tab->hash_bits = ilog2(roundup_pow_of_two(num)) + 1;
+	tab->hash = kcalloc(1 << tab->hash_bits, sizeof(struct hlist_head),
+			    GFP_KERNEL);
+	if (!tab->hash) {
+		vfree(tab);
+		return NULL;
+	}
+
+	for (i = 0; uchan && i < num; i++) {
+		ch = &tab->chan[i];
+		isotp_chan_init(so, ch, uchan[i].rx_id, uchan[i].tx_id);
+		hlist_add_head(&ch->list,
+			       &tab->hash[hash_32(ch->rxid, tab->hash_bits)]);
+	}
+	tab->num = uchan ? num : 0;
+
+	return tab;
+}
+
+static int isotp_check_chan(canid_t rxid, canid_t txid)
+{
+	if (rxid == txid)
+		return -EADDRNOTAVAIL;
+
+	if ((rxid | txid) & (CAN_ERR_FLAG | CAN_RTR_FLAG))
+		return -EADDRNOTAVAIL;
+
+	return 0;
+}
+
+static void isotp_rcv(struct sk_buff *skb, void *data);
+static void (*isotp_rcv_func(struct isotp_sock *so))(struct sk_buff *, void *);
+
+/* remove the filters of the bind() channel and num table channels */
+static void isotp_unregister_chans(struct isotp_sock *so,
+				   struct net_device *dev, unsigned int num)
+{
+	struct isotp_chan_tab *tab = so->chantab;
+	unsigned int i;
+
+	if (so->opt.flags & CAN_ISOTP_ANALYZER) {
+		can_rx_unregister(dev_net(dev), dev, so->chan.rxid,
+				  so->chan.txid, so->rcv_func, &so->sk);
+		return;
+	}
+
+	can_rx_unregister(dev_net(dev), dev, so->chan.rxid,
+			  SINGLE_MASK(so->chan.rxid), so->rcv_func, &so->sk);
+
+	for (i = 0; tab && i < min(num, tab->num); i++)
+		can_rx_unregister(dev_net(dev), dev, tab->chan[i].rxid,
+				  SINGLE_MASK(tab->chan[i].rxid),
+				  so->rcv_func, &so->sk);
+}
+
+static int isotp_register_chans(struct isotp_sock *so,
+				struct net_device *dev)
+{
+	struct isotp_chan_tab *tab = so->chantab;
+	unsigned int i;
+	int err;
+
+	/* the filters are removed with the callback they were added with */
+	so->rcv_func = isotp_rcv_func(so);
+
+	/* the analyzer gets all frames matching the bind() id/mask pair */
+	if (so->opt.flags & CAN_ISOTP_ANALYZER)
+		return can_rx_register(dev_net(dev), dev, so->chan.rxid,
+				       so->chan.txid, so->rcv_func, &so->sk,
+				       "isotp");
+
+	err = can_rx_register(dev_net(dev), dev, so->chan.rxid,
+			      SINGLE_MASK(so->chan.rxid),
+			      so->rcv_func, &so->sk, "isotp");
+	if (err)
+		return err;
+
+	for (i = 0; tab && i < tab->num; i++) {
+		err = can_rx_register(dev_net(dev), dev, tab->chan[i].rxid,
+				      SINGLE_MASK(tab->chan[i].rxid),
+				      so->rcv_func, &so->sk, "isotp");
+		if (err) {
+			isotp_unregister_chans(so, dev, i);
+			return err;
+		}
+	}
+
+	return 0;
+}
 
 static void isotp_skb_destructor(struct sk_buff *skb)
 {
@@ -206,7 +852,23 @@ static inline void isotp_skb_set_owner(struct sk_buff *skb, struct sock *sk)
 	}
 }
 
-static int isotp_send_fc(struct sock *sk, int ae, u8 flowstatus)
+/*
+ * CAN_ISOTP_QDISC_BYPASS selects the tx path of the SF/FF in sendmsg only.
+ * That is where an -EBUSY of a stopped driver queue can be returned to the
+ * caller. Drivers like sja1000 stop their queue after every frame, so the
+ * CFs and the FC frames of the timers stay on dev_queue_xmit().
+ */
+static inline int isotp_can_send(struct isotp_sock *so, struct sk_buff *skb)
+{
+#ifdef CAN_QDISC_BYPASS
+	if (so->qdisc_bypass)
+		return can_send_bypass(skb, 1);
+#endif
+	return can_send(skb, 1);
+}
+
+static int isotp_send_fc(struct sock *sk, struct isotp_chan *ch, int ae,
+			 u8 flowstatus)
 {
 	struct net_device *dev;
 	struct sk_buff *nskb;
@@ -217,8 +879,10 @@ static int isotp_send_fc(struct sock *sk, int ae, u8 flowstatus)
 	if (!nskb)
 		return 1;
 
-	dev = dev_get_by_index(&init_net, so->ifindex);
+	rcu_read_lock();
+	dev = rcu_dereference(so->dev);
 	if (!dev) {
+		rcu_read_unlock();
 		kfree_skb(nskb);
 		return 1;
 	}
@@ -228,10 +892,11 @@ static int isotp_send_fc(struct sock *sk, int ae, u8 flowstatus)
 	skb_put(nskb, so->ll.mtu);
 
 	/* create & send flow control reply */
-	ncf->can_id = so->txid;
+	ncf->can_id = ch->txid;
 
 	if (so->opt.flags & CAN_ISOTP_TX_PADDING) {
-		memset(ncf->data, so->opt.txpad_content, CAN_MAX_DLEN);
+		memset(&ncf->data[ae + FC_CONTENT_SZ], so->opt.txpad_content,
+		       CAN_MAX_DLEN - ae - FC_CONTENT_SZ);
 		ncf->len = CAN_MAX_DLEN;
 	} else
 		ncf->len = ae + FC_CONTENT_SZ;
@@ -240,38 +905,157 @@ static int isotp_send_fc(struct sock *sk, int ae, u8 flowstatus)
 	ncf->data[ae + 1] = so->rxfc.bs;
 	ncf->data[ae + 2] = so->rxfc.stmin;
 
+	trace_isotp_fc(so, 1, ch->txid, flowstatus, so->rxfc.bs,
+		       so->rxfc.stmin);
+
 	if (ae)
 		ncf->data[0] = so->opt.ext_address;
 
 	if (so->ll.mtu == CANFD_MTU)
 		ncf->flags = so->ll.tx_flags;
 
-	can_send(nskb, 1);
-	dev_put(dev);
+	if (!can_send(nskb, 1))
+		so->stats.tx_frames++;
+	rcu_read_unlock();
 
-	/* reset blocksize counter */
-	so->rx.bs = 0;
+	if (flowstatus == ISOTP_FC_OVFLW)
+		so->stats.tx_fc_ovflw++;
 
 	/* reset last CF frame rx timestamp for rx stmin enforcement */
-	so->lastrxcf_tstamp = ktime_set(0,0);
+	ch->lastrxcf_tstamp = ktime_set(0,0);
 
 	/* start rx timeout watchdog */
-	hrtimer_start(&so->rxtimer, ktime_set(1,0), HRTIMER_MODE_REL);
+	hrtimer_start(&ch->rxtimer, ns_to_ktime(so->tmo.n_cr),
+		      ISOTP_RX_HRTIMER_REL);
 	return 0;
 }
 
-static void isotp_rcv_skb(struct sk_buff *skb, struct sock *sk)
+/* does the pdu in the reassembly buffer fit into the socket receive queue */
+static inline int isotp_rx_room(struct sock *sk, struct isotp_chan *ch)
+{
+	/* a cut-through pdu is not queued to this socket */
+	return !isotp_sk(sk)->rxfc.wftmax || ISOTP_PDU_CB(ch->rx.skb)->route ||
+		atomic_read(&sk->sk_rmem_alloc) + ch->rx.skb->truesize <=
+		(unsigned int)sk->sk_rcvbuf;
+}
+
+/*
+ * Grant the next block (or the first one after the FF) to the sender.
+ *
+ * When the socket receive queue has no room for the pdu the CTS is held
+ * back with up to rxfc.wftmax FC.WT frames instead of receiving a pdu
+ * that would be dropped in isotp_rcv_skb() at the end. The room is checked
+ * again every ISOTP_RX_WT_GAP and when the reader consumed a pdu.
+ */
+static void isotp_rx_grant(struct sock *sk, struct isotp_chan *ch, int ae)
+{
+	struct isotp_sock *so = isotp_sk(sk);
+
+	if (isotp_rx_room(sk, ch)) {
+		ch->rx_wft = 0;
+		isotp_rx_state(ch, ISOTP_WAIT_DATA);
+		isotp_send_fc(sk, ch, ae, ISOTP_FC_CTS);
+		return;
+	}
+
+	if (ch->rx_wft >= so->rxfc.wftmax) {
+		/* the reader did not make room in time */
+		isotp_rx_state(ch, ISOTP_IDLE);
+		isotp_rx_free(ch);
+		isotp_send_fc(sk, ch, ae, ISOTP_FC_OVFLW);
+		return;
+	}
+
+	ch->rx_wft++;
+	isotp_rx_state(ch, ISOTP_WAIT_ROOM);
+	isotp_send_fc(sk, ch, ae, ISOTP_FC_WT);
+	so->stats.tx_fc_wait++;
+
+	hrtimer_start(&ch->rxtimer, ktime_set(0, ISOTP_RX_WT_GAP),
+		      ISOTP_RX_HRTIMER_REL);
+}
+
+/* a pdu has been consumed: recheck the channels that wait for room */
+static void isotp_rx_kick(struct isotp_sock *so)
+{
+	struct isotp_chan_tab *tab = so->chantab;
+	unsigned int i;
+
+	if (!so->rxfc.wftmax)
+		return;
+
+	if (so->chan.rx.state == ISOTP_WAIT_ROOM)
+		hrtimer_start(&so->chan.rxtimer, ktime_set(0,0),
+			      ISOTP_RX_HRTIMER_REL);
+
+	for (i = 0; tab && i < tab->num; i++) {
+		if (tab->chan[i].rx.state == ISOTP_WAIT_ROOM)
+			hrtimer_start(&tab->chan[i].rxtimer, ktime_set(0,0),
+				      ISOTP_RX_HRTIMER_REL);
+	}
+}
+
+static void isotp_rcv_skb(struct sk_buff *skb, struct sock *sk,
+			  struct isotp_chan *ch)
 {
 	struct sockaddr_can *addr = (struct sockaddr_can *)skb->cb;
+	struct isotp_sock *to = rcu_dereference(isotp_sk(sk)->route);
 
 	BUILD_BUG_ON(sizeof(skb->cb) < sizeof(struct sockaddr_can));
 
+	/* CAN_ISOTP_ROUTE: single frame and completely received pdus */
+	if (to) {
+		if (!to->bound) {
+			kfree_skb(skb);
+			return;
+		}
+
+		isotp_sk(sk)->stats.rx_pdus++;
+		isotp_route_pdu(to, skb);
+		return;
+	}
+
 	memset(addr, 0, sizeof(*addr));
 	addr->can_family  = AF_CAN;
 	addr->can_ifindex = skb->dev->ifindex;
 
+	/* tell the reader which channel the pdu has been received on */
+	addr->can_addr.tp.rx_id = ch->rxid;
+	addr->can_addr.tp.tx_id = ch->txid;
+
 	if (sock_queue_rcv_skb(sk, skb) < 0)
 		kfree_skb(skb);
+	else {
+		isotp_sk(sk)->stats.rx_pdus++;
+
+		/* a response to the pending functional request */
+		if (isotp_sk(sk)->func_active)
+			isotp_sk(sk)->func_rsp++;
+	}
+}
+
+/*
+ * With CAN_ISOTP_RX_BATCH the reader is only woken up by the pdu that makes
+ * the receive queue non-empty. The woken reader is expected to drain the
+ * queue (e.g. with recvmmsg()) instead of being woken up for every pdu.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0)
+static void isotp_data_ready(struct sock *sk)
+#else
+static void isotp_data_ready(struct sock *sk, int bytes)
+#endif
+{
+	struct isotp_sock *so = isotp_sk(sk);
+
+	if ((so->opt.flags & CAN_ISOTP_RX_BATCH) &&
+	    skb_queue_len(&sk->sk_receive_queue) > 1)
+		return;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0)
+	so->data_ready(sk);
+#else
+	so->data_ready(sk, bytes);
+#endif
 }
 
 static u8 padlen(u8 datalen)
@@ -314,8 +1098,8 @@ static int check_optimized(struct canfd_frame *cf, int start_index)
 }
 
 /* check padding and return 1/true when the check fails */
-static int check_pad(struct isotp_sock *so, struct canfd_frame *cf,
-		     int start_index, __u8 content)
+static int __check_pad(struct isotp_sock *so, struct canfd_frame *cf,
+		       int start_index, __u8 content)
 {
 	int i;
 
@@ -343,8 +1127,33 @@ static int check_pad(struct isotp_sock *so, struct canfd_frame *cf,
 	return 0;
 }
 
-static int isotp_rcv_fc(struct isotp_sock *so, struct canfd_frame *cf, int ae)
+static int check_pad(struct isotp_sock *so, struct canfd_frame *cf,
+		     int start_index, __u8 content)
+{
+	if (!__check_pad(so, cf, start_index, content))
+		return 0;
+
+	so->stats.rx_pad_errors++;
+	return 1;
+}
+
+static int isotp_rcv_fc(struct isotp_sock *so, struct canfd_frame *cf, int ae,
+			int chkpad)
 {
+	if (cf->len >= ae + FC_CONTENT_SZ)
+		trace_isotp_fc(so, 0, cf->can_id, cf->data[ae] & 0x0F,
+			       cf->data[ae + 1], cf->data[ae + 2]);
+
+	/* an early CTS grants the block after the one that is being sent */
+	if ((so->tx.state == ISOTP_SENDING ||
+	     so->tx.state == ISOTP_WAIT_DATA) &&
+	    (so->opt.flags & CAN_ISOTP_EARLY_FC)) {
+		if (cf->len >= ae + FC_CONTENT_SZ &&
+		    (cf->data[ae] & 0x0F) == ISOTP_FC_CTS)
+			atomic_inc(&so->tx_fc_credit);
+		return 0;
+	}
+
 	if (so->tx.state != ISOTP_WAIT_FC &&
 	    so->tx.state != ISOTP_WAIT_FIRST_FC)
 		return 0;
@@ -352,10 +1161,14 @@ static int isotp_rcv_fc(struct isotp_sock *so, struct canfd_frame *cf, int ae)
 	hrtimer_cancel(&so->txtimer);
 
 	if ((cf->len < ae + FC_CONTENT_SZ) ||
-	    ((so->opt.flags & ISOTP_CHECK_PADDING) &&
+	    (chkpad &&
 	     check_pad(so, cf, ae + FC_CONTENT_SZ, so->opt.rxpad_content))) {
-		so->tx.state = ISOTP_IDLE;
+		/* malformed FC frame */
+		isotp_report_err(so, EBADMSG);
+		isotp_tx_confirm(so, EBADMSG);
+		isotp_tx_state(so, ISOTP_IDLE);
 		wake_up_interruptible(&so->wait);
+		isotp_tx_next(so);
 		return 1;
 	}
 
@@ -384,56 +1197,69 @@ static int isotp_rcv_fc(struct isotp_sock *so, struct canfd_frame *cf, int ae)
 			so->tx_gap = ktime_add_ns(so->tx_gap,
 						  (so->txfc.stmin - 0xF0)
 						  * 100000);
-		so->tx.state = ISOTP_WAIT_FC;
+		isotp_tx_state(so, ISOTP_WAIT_FC);
 	}
 
 	DBG("FC frame: FS %d, BS %d, STmin 0x%02X, tx_gap %lld\n",
 	    cf->data[ae] & 0x0F & 0x0F, so->txfc.bs, so->txfc.stmin,
-	    (long long)so->tx_gap.tv64);
+	    (long long)ktime_to_ns(so->tx_gap));
 
 	switch (cf->data[ae] & 0x0F) {
 
 	case ISOTP_FC_CTS:
 		so->tx.bs = 0;
-		so->tx.state = ISOTP_SENDING;
+		isotp_tx_state(so, ISOTP_SENDING);
+		/* the gap to the FC is not part of the CF gap statistics */
+		so->lasttxcf_tstamp = ktime_set(0,0);
 		DBG("starting txtimer for sending\n");
 		/* start cyclic timer for sending CF frame */
 		hrtimer_start(&so->txtimer, so->tx_gap,
-			      HRTIMER_MODE_REL);
+			      ISOTP_TX_HRTIMER_REL);
 		break;
 
 	case ISOTP_FC_WT:
 		DBG("starting waiting for next FC\n");
+		so->stats.rx_fc_wait++;
 		/* start timer to wait for next FC frame */
-		hrtimer_start(&so->txtimer, ktime_set(1,0),
-			      HRTIMER_MODE_REL);
+		hrtimer_start(&so->txtimer, ns_to_ktime(so->tmo.n_bs),
+			      ISOTP_TX_HRTIMER_REL);
 		break;
 
 	case ISOTP_FC_OVFLW:
 		DBG("overflow in receiver side\n");
+		so->stats.rx_fc_ovflw++;
+		isotp_report_err(so, EMSGSIZE);
+		isotp_tx_confirm(so, EMSGSIZE);
+		goto out_stop;
 
 	default:
-		/* stop this tx job. TODO: error reporting? */
-		so->tx.state = ISOTP_IDLE;
+		/* reserved flow status */
+		isotp_report_err(so, EBADMSG);
+		isotp_tx_confirm(so, EBADMSG);
+ out_stop:
+		/* stop this tx job */
+		isotp_tx_state(so, ISOTP_IDLE);
 		wake_up_interruptible(&so->wait);
+		isotp_tx_next(so);
 	}
 	return 0;
 }
 
-static int isotp_rcv_sf(struct sock *sk, struct canfd_frame *cf, int pcilen,
-			struct sk_buff *skb, int len)
+static int isotp_rcv_sf(struct sock *sk, struct isotp_chan *ch,
+			struct canfd_frame *cf, int pcilen,
+			struct sk_buff *skb, int len, int chkpad)
 {
 	struct isotp_sock *so = isotp_sk(sk);
 	struct sk_buff *nskb;
 
-	hrtimer_cancel(&so->rxtimer);
-	so->rx.state = ISOTP_IDLE;
+	isotp_rx_timer_cancel(ch);
+	isotp_rx_state(ch, ISOTP_IDLE);
+	isotp_rx_free(ch);
 
 	if (!len || len > cf->len - pcilen)
 		return 1;
 
-	if ((so->opt.flags & ISOTP_CHECK_PADDING) &&
-	    check_pad(so, cf, pcilen + len, so->opt.rxpad_content))
+	if (chkpad && check_pad(so, cf, pcilen + len, so->opt.rxpad_content))
 		return 1;
 
 	nskb = alloc_skb(len, gfp_any());
@@ -444,177 +1270,401 @@ static int isotp_rcv_sf(struct sock *sk, struct canfd_frame *cf, int pcilen,
 
 	nskb->tstamp = skb->tstamp;
 	nskb->dev = skb->dev;
-	isotp_rcv_skb(nskb, sk);
+	isotp_rcv_skb(nskb, sk, ch);
 	return 0;
 }
 
-static int isotp_rcv_ff(struct sock *sk, struct canfd_frame *cf, int ae)
+/*
+ * The reassembly buffer of a segmented rx pdu. It is allocated in softirq
+ * context, so pdus that exceed SKB_MAX_ALLOC are built from page fragments
+ * instead of one high order allocation.
+ */
+static struct sk_buff *isotp_alloc_rx_pdu(u32 len)
+{
+	struct sk_buff *skb;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,18,0)
+	if (len > SKB_MAX_ALLOC) {
+		int err;
+
+		skb = alloc_skb_with_frags(0, len, PAGE_ALLOC_COSTLY_ORDER,
+					   &err, gfp_any());
+		if (!skb)
+			return NULL;
+
+		skb->data_len = len;
+		skb->len = len;
+		return skb;
+	}
+#endif
+	skb = alloc_skb(len, gfp_any());
+	if (skb)
+		skb_put(skb, len);
+
+	return skb;
+}
+
+static int isotp_rcv_ff(struct sock *sk, struct isotp_chan *ch,
+			struct canfd_frame *cf, int ae)
 {
 	struct isotp_sock *so = isotp_sk(sk);
-	int i;
 	int off;
 	int ff_pci_sz;
 
-	hrtimer_cancel(&so->rxtimer);
-	so->rx.state = ISOTP_IDLE;
+	isotp_rx_timer_cancel(ch);
+	isotp_rx_state(ch, ISOTP_IDLE);
+	isotp_rx_free(ch);
 
 	/* get the used sender LL_DL from the (first) CAN frame data length */
-	so->rx.ll_dl = padlen(cf->len);
+	ch->rx.ll_dl = padlen(cf->len);
 
 	/* the first frame has to use the entire frame up to LL_DL length */
-	if (cf->len != so->rx.ll_dl)
+	if (cf->len != ch->rx.ll_dl)
 		return 1;
 
 	/* get the FF_DL */
-	so->rx.len = (cf->data[ae] & 0x0F) << 8;
-	so->rx.len += cf->data[ae + 1];
+	ch->rx.len = (cf->data[ae] & 0x0F) << 8;
+	ch->rx.len += cf->data[ae + 1];
 
 	/* Check for FF_DL escape sequence supporting 32 bit PDU length */
-	if (so->rx.len)
+	if (ch->rx.len)
 		ff_pci_sz = FF_PCI_SZ12;
 	else {
 		/* FF_DL = 0 => get real length from next 4 bytes */
-		so->rx.len = cf->data[ae + 2] << 24;
-		so->rx.len += cf->data[ae + 3] << 16;
-		so->rx.len += cf->data[ae + 4] << 8;
-		so->rx.len += cf->data[ae + 5];
+		ch->rx.len = cf->data[ae + 2] << 24;
+		ch->rx.len += cf->data[ae + 3] << 16;
+		ch->rx.len += cf->data[ae + 4] << 8;
+		ch->rx.len += cf->data[ae + 5];
 		ff_pci_sz = FF_PCI_SZ32;
 	}
 
 	/* take care of a potential SF_DL ESC offset for TX_DL > 8 */
-	off = (so->rx.ll_dl > CAN_MAX_DLEN)? 1:0;
+	off = (ch->rx.ll_dl > CAN_MAX_DLEN)? 1:0;
 
-	if (so->rx.len + ae + off + ff_pci_sz < so->rx.ll_dl)
+	if (ch->rx.len + ae + off + ff_pci_sz < ch->rx.ll_dl)
 		return 1;
 
-	if (so->rx.len > MAX_MSG_LENGTH) {
-		/* send FC frame with overflow status */
-		isotp_send_fc(sk, ae, ISOTP_FC_OVFLW);
-		return 1;
-	}
+	/* the pdu would never fit into our receive buffer */
+	if (ch->rx.len > (u32)sk->sk_rcvbuf)
+		goto overflow;
+
+	/* allocate the reassembly buffer with the announced FF_DL size */
+	ch->rx.skb = isotp_alloc_rx_pdu(ch->rx.len);
+	if (!ch->rx.skb)
+		goto overflow;
 
 	/* copy the first received data bytes */
-	so->rx.idx = 0;
-	for (i = ae + ff_pci_sz; i < so->rx.ll_dl; i++)
-		so->rx.buf[so->rx.idx++] = cf->data[i];
+	ch->rx.idx = ch->rx.ll_dl - ae - ff_pci_sz;
+	skb_store_bits(ch->rx.skb, 0, &cf->data[ae + ff_pci_sz], ch->rx.idx);
 
 	/* initial setup for this pdu receiption */
-	so->rx.sn = 1;
-	so->rx.state = ISOTP_WAIT_DATA;
+	ch->rx.sn = 1;
+	ch->rx.bs = 0;
+	ch->rx_wft = 0;
+	ch->rx_early_fc = 0;
+	isotp_rx_state(ch, ISOTP_WAIT_DATA);
+	ch->ff_tstamp = ktime_get();
+
+	isotp_route_data(so, ch);
 
 	/* no creation of flow control frames */
 	if (so->opt.flags & CAN_ISOTP_LISTEN_MODE)
 		return 0;
 
 	/* send our first FC frame */
-	isotp_send_fc(sk, ae, ISOTP_FC_CTS);
+	isotp_rx_grant(sk, ch, ae);
 	return 0;
+
+ overflow:
+	/* send FC frame with overflow status */
+	if (!(so->opt.flags & CAN_ISOTP_LISTEN_MODE))
+		isotp_send_fc(sk, ch, ae, ISOTP_FC_OVFLW);
+	return 1;
 }
 
-static int isotp_rcv_cf(struct sock *sk, struct canfd_frame *cf, int ae,
-			struct sk_buff *skb)
+static int isotp_rcv_cf(struct sock *sk, struct isotp_chan *ch,
+			struct canfd_frame *cf, int ae, struct sk_buff *skb,
+			int chkpad)
 {
 	struct isotp_sock *so = isotp_sk(sk);
 	struct sk_buff *nskb;
-	int i;
+	int num;
 
-	if (so->rx.state != ISOTP_WAIT_DATA)
+	if (ch->rx.state != ISOTP_WAIT_DATA || !ch->rx.skb)
 		return 0;
 
 	/* drop if timestamp gap is less than force_rx_stmin nano secs */
 	if (so->opt.flags & CAN_ISOTP_FORCE_RXSTMIN) {
 
-		if (ktime_to_ns(ktime_sub(skb->tstamp, so->lastrxcf_tstamp)) <
+		if (ktime_to_ns(ktime_sub(skb->tstamp, ch->lastrxcf_tstamp)) <
 		    so->force_rx_stmin)
 			return 0;
 
-		so->lastrxcf_tstamp = skb->tstamp; 
+		ch->lastrxcf_tstamp = skb->tstamp; 
 	}
 
-	hrtimer_cancel(&so->rxtimer);
+	isotp_rx_timer_cancel(ch);
 
 	/* CFs are never longer than the FF */
-	if (cf->len > so->rx.ll_dl)
+	if (cf->len > ch->rx.ll_dl)
 		return 1;
 
 	/* CFs have usually the LL_DL length */
-	if (cf->len < so->rx.ll_dl) {
+	if (cf->len < ch->rx.ll_dl) {
 		/* this is only allowed for the last CF */
-		if (so->rx.len - so->rx.idx > so->rx.ll_dl - ae - N_PCI_SZ)
+		if (ch->rx.len - ch->rx.idx > ch->rx.ll_dl - ae - N_PCI_SZ)
 			return 1;
 	}
 
-	if ((cf->data[ae] & 0x0F) != so->rx.sn) {
+	if ((cf->data[ae] & 0x0F) != ch->rx.sn) {
 		DBG("wrong sn %d. expected %d.\n",
-		    cf->data[ae] & 0x0F, so->rx.sn);
+		    cf->data[ae] & 0x0F, ch->rx.sn);
 		/* some error reporting? */
-		so->rx.state = ISOTP_IDLE;
+		so->stats.rx_sn_errors++;
+		isotp_report_err(so, EILSEQ);
+		isotp_rx_state(ch, ISOTP_IDLE);
+		isotp_rx_free(ch);
 		return 1;
 	}
-	so->rx.sn++;
-	so->rx.sn %= 16;
-
-	for (i = ae + N_PCI_SZ; i < cf->len; i++) {
-		so->rx.buf[so->rx.idx++] = cf->data[i];
-		if (so->rx.idx >= so->rx.len)
-			break;
+	ch->rx.sn++;
+	ch->rx.sn %= 16;
+
+	/* copy the payload up to the end of the pdu */
+	num = min_t(int, cf->len - ae - N_PCI_SZ, ch->rx.len - ch->rx.idx);
+	if (num > 0) {
+		skb_store_bits(ch->rx.skb, ch->rx.idx,
+			       &cf->data[ae + N_PCI_SZ], num);
+		ch->rx.idx += num;
 	}
 
-	if (so->rx.idx >= so->rx.len) {
+	if (ch->rx.idx >= ch->rx.len) {
 
 		/* we are done */
-		so->rx.state = ISOTP_IDLE;
+		isotp_rx_state(ch, ISOTP_IDLE);
 
-		if ((so->opt.flags & ISOTP_CHECK_PADDING) &&
-		    check_pad(so, cf, i+1, so->opt.rxpad_content))
+		if (chkpad && check_pad(so, cf, ae + N_PCI_SZ + num,
+					so->opt.rxpad_content)) {
+			isotp_rx_free(ch);
 			return 1;
+		}
 
-		nskb = alloc_skb(so->rx.len, gfp_any());
-		if (!nskb)
-			return 1;
+		isotp_hist_add(so->stats.rx_time_hist, ch->ff_tstamp);
+
+		/* the cut-through pdu is sent to its end by the other side */
+		if (ISOTP_PDU_CB(ch->rx.skb)->route) {
+			so->stats.rx_pdus++;
+			isotp_route_release(ch, 0);
+			return 0;
+		}
 
-		memcpy(skb_put(nskb, so->rx.len), so->rx.buf,
-		       so->rx.len);
+		/* hand over the reassembly buffer to the socket */
+		nskb = ch->rx.skb;
+		ch->rx.skb = NULL;
 
 		nskb->tstamp = skb->tstamp;
 		nskb->dev = skb->dev;
-		isotp_rcv_skb(nskb, sk);
+		isotp_rcv_skb(nskb, sk, ch);
 		return 0;
 	}
 
+	isotp_route_data(so, ch);
+
 	/* no creation of flow control frames */
 	if (so->opt.flags & CAN_ISOTP_LISTEN_MODE)
 		return 0;
 
-	/* perform blocksize handling, if enabled */
-	if (!so->rxfc.bs || ++so->rx.bs < so->rxfc.bs) {
+	/* perform blocksize handling, if enabled */
+	if (!so->rxfc.bs)
+		goto out_restart;
+
+	ch->rx.bs++;
+
+	/*
+	 * The reassembly buffer holds the entire pdu since the FF. So the
+	 * next block can be granted with the first CF of the current block
+	 * when the pdu does not end within it. Without room in the socket
+	 * the grant (or FC.WT) is sent at the end of the block as usual.
+	 */
+	if ((so->opt.flags & CAN_ISOTP_EARLY_FC) && ch->rx.bs == 1 &&
+	    ch->rx.len - ch->rx.idx >
+	    (so->rxfc.bs - 1) * (u32)(ch->rx.ll_dl - ae - N_PCI_SZ) &&
+	    isotp_rx_room(sk, ch)) {
+		ch->rx_early_fc = 1;
+		isotp_send_fc(sk, ch, ae, ISOTP_FC_CTS);
+	}
+
+	if (ch->rx.bs < so->rxfc.bs)
+		goto out_restart;
+
+	/* we reached the specified blocksize so->rxfc.bs */
+	ch->rx.bs = 0;
+
+	if (ch->rx_early_fc) {
+		ch->rx_early_fc = 0;
+		goto out_restart;
+	}
+
+	isotp_rx_grant(sk, ch, ae);
+	return 0;
+
+ out_restart:
+	/* start rx timeout watchdog */
+	hrtimer_start(&ch->rxtimer, ns_to_ktime(so->tmo.n_cr),
+		      ISOTP_RX_HRTIMER_REL);
+	return 0;
+}
+
+/*
+ * Analyzer: hand the least recently used idle channel of a full table over
+ * to a new CAN ID. Called with ana_lock held.
+ */
+static struct isotp_chan *isotp_ana_evict(struct isotp_sock *so,
+					  struct isotp_chan_tab *tab,
+					  canid_t can_id)
+{
+	struct isotp_chan *ch = NULL;
+	unsigned int i;
+
+	for (i = 0; i < tab->num; i++) {
+		struct isotp_chan *c = &tab->chan[i];
+
+		if (c->rx.state != ISOTP_IDLE)
+			continue;
+		if (!ch || time_before(c->ana_used, ch->ana_used))
+			ch = c;
+	}
+
+	if (!ch)
+		return NULL;
+
+	/* a timed out pdu may still hold its reassembly buffer */
+	isotp_rx_timer_cancel(ch);
+	isotp_rx_free(ch);
+	if (so->ana_ff == ch)
+		so->ana_ff = NULL;
+
+	hlist_del(&ch->list);
+	ch->rxid = can_id;
+	ch->txid = CAN_ISOTP_ANALYZER_NO_ID;
+	ch->rx_wft = 0;
+	ch->rx_early_fc = 0;
+	hlist_add_head(&ch->list, &tab->hash[hash_32(can_id, tab->hash_bits)]);
+
+	so->stats.ana_evicts++;
+
+	return ch;
+}
+
+/*
+ * Analyzer: look up the channel of a CAN ID or create it for a new SF/FF.
+ * Called with ana_lock held.
+ */
+static struct isotp_chan *isotp_ana_chan(struct isotp_sock *so,
+					 canid_t can_id, int create)
+{
+	struct isotp_chan_tab *tab = so->anatab;
+	struct isotp_chan *ch = isotp_tab_chan(tab, can_id);
+
+	if (!ch && create && tab) {
+		if (tab->num < CAN_ISOTP_MAX_CHANNELS) {
+			ch = &tab->chan[tab->num++];
+			isotp_chan_init(so, ch, can_id,
+					CAN_ISOTP_ANALYZER_NO_ID);
+			hlist_add_head(&ch->list,
+				       &tab->hash[hash_32(can_id,
+							  tab->hash_bits)]);
+		} else {
+			ch = isotp_ana_evict(so, tab, can_id);
+			if (!ch)
+				so->stats.ana_drops++;
+		}
+	}
+
+	if (ch)
+		ch->ana_used = jiffies;
+
+	return ch;
+}
+
+/*
+ * Analyzer: reassemble the pdus of all CAN IDs the socket receives. The
+ * tx_id of a channel is learned from the first FC frame that follows a FF
+ * of this channel. The frames of one socket may be processed on several
+ * CPUs, so the channel table is protected by ana_lock.
+ */
+static void isotp_ana_rcv(struct sock *sk, struct canfd_frame *cf, int ae,
+			  struct sk_buff *skb)
+{
+	struct isotp_sock *so = isotp_sk(sk);
+	struct isotp_chan *ch;
+	u8 n_pci_type = cf->data[ae] & 0xF0;
+	u8 sf_dl = cf->data[ae] & 0x0F;
+	int chkpad = so->opt.flags & ISOTP_CHECK_PADDING;
+
+	spin_lock(&so->ana_lock);
+
+	so->stats.rx_frames++;
+
+	switch (n_pci_type) {
+	case N_PCI_FC:
+		/* the FC answers the last FF: pair the two CAN IDs */
+		ch = so->ana_ff;
+		if (ch && ch->rxid != cf->can_id) {
+			ch->txid = cf->can_id;
+			so->ana_ff = NULL;
+		}
+		break;
+
+	case N_PCI_SF:
+		ch = isotp_ana_chan(so, cf->can_id, 1);
+		if (!ch)
+			break;
+
+		/* see __isotp_rcv() */
+		if (cf->len <= CAN_MAX_DLEN)
+			isotp_rcv_sf(sk, ch, cf, SF_PCI_SZ4 + ae, skb, sf_dl,
+				     chkpad);
+		else if (skb->len == CANFD_MTU && sf_dl == 0)
+			isotp_rcv_sf(sk, ch, cf, SF_PCI_SZ8 + ae,
+				     skb, cf->data[SF_PCI_SZ4 + ae], chkpad);
+		break;
+
+	case N_PCI_FF:
+		ch = isotp_ana_chan(so, cf->can_id, 1);
+		if (ch && !isotp_rcv_ff(sk, ch, cf, ae))
+			so->ana_ff = ch;
+		break;
 
-		/* start rx timeout watchdog */
-		hrtimer_start(&so->rxtimer, ktime_set(1,0),
-			      HRTIMER_MODE_REL);
-		return 0;
+	case N_PCI_CF:
+		ch = isotp_ana_chan(so, cf->can_id, 0);
+		if (ch)
+			isotp_rcv_cf(sk, ch, cf, ae, skb, chkpad);
+		break;
 	}
 
-	/* we reached the specified blocksize so->rxfc.bs */
-	isotp_send_fc(sk, ae, ISOTP_FC_CTS);
-	return 0;
+	spin_unlock(&so->ana_lock);
 }
 
-static void isotp_rcv(struct sk_buff *skb, void *data)
+/*
+ * The receive path of all socket options. ae (extended addressing), mtu
+ * and chkpad (padding checks) are constants in the specialized receive
+ * handlers below, so that the compiler removes the branches of the other
+ * options from their copy. The analyzer always takes isotp_rcv().
+ */
+static __always_inline void __isotp_rcv(struct sk_buff *skb, struct sock *sk,
+					const int ae, const int mtu,
+					const int chkpad, const int ana)
 {
-	struct sock *sk = (struct sock *)data;
 	struct isotp_sock *so = isotp_sk(sk);
+	struct isotp_chan *ch;
 	struct canfd_frame *cf;
-	int ae = (so->opt.flags & CAN_ISOTP_EXTEND_ADDR)? 1:0;
 	u8 n_pci_type, sf_dl;
 
-	BUG_ON(skb->len != CAN_MTU && skb->len != CANFD_MTU);
-
 	/*
 	 * Strictly receive only frames with the configured MTU size
 	 * => clear separation of CAN2.0 / CAN FD transport channels
 	 */
-	if (skb->len != so->ll.mtu)
+	if (skb->len != mtu)
 		return;
 
 	cf = (struct canfd_frame *) skb->data;
@@ -623,19 +1673,37 @@ static void isotp_rcv(struct sk_buff *skb, void *data)
 	if (ae && cf->data[0] != so->opt.rx_ext_address)
 		return;
 
+	trace_isotp_rx_frame(so, cf->can_id, &cf->data[ae], cf->len);
+
+	if (ana) {
+		isotp_ana_rcv(sk, cf, ae, skb);
+		return;
+	}
+
+	ch = isotp_find_chan(so, cf->can_id);
+	if (!ch)
+		return;
+
+#ifdef CAN_BUSY_POLL
+	sk_mark_napi_id(sk, skb);
+#endif
+
+	so->stats.rx_frames++;
+
 	n_pci_type = cf->data[ae] & 0xF0;
 
 	if (so->opt.flags & CAN_ISOTP_HALF_DUPLEX) {
 		/* check rx/tx path half duplex expectations */
 		if ((so->tx.state != ISOTP_IDLE && n_pci_type != N_PCI_FC) ||
-		    (so->rx.state != ISOTP_IDLE && n_pci_type == N_PCI_FC))
+		    (ch->rx.state != ISOTP_IDLE && n_pci_type == N_PCI_FC))
 			return;
 	}
 
 	switch (n_pci_type) {
 	case N_PCI_FC:
-		/* tx path: flow control frame containing the FC parameters */
-		isotp_rcv_fc(so, cf, ae);
+		/* tx path: only the addressed channel may send the FC */
+		if (ch->rxid == so->tx_fcid)
+			isotp_rcv_fc(so, cf, ae, chkpad);
 		break;
 
 	case N_PCI_SF:
@@ -650,9 +1718,10 @@ static void isotp_rcv(struct sk_buff *skb, void *data)
 		/* get the SF_DL from the N_PCI byte */
 		sf_dl = cf->data[ae] & 0x0F;
 
-		if (cf->len <= CAN_MAX_DLEN)
-			isotp_rcv_sf(sk, cf, SF_PCI_SZ4 + ae, skb, sf_dl);
-		else if (skb->len == CANFD_MTU) {
+		if (mtu == CAN_MTU || cf->len <= CAN_MAX_DLEN)
+			isotp_rcv_sf(sk, ch, cf, SF_PCI_SZ4 + ae, skb, sf_dl,
+				     chkpad);
+		else {
 			/*
 			 * We have a CAN FD frame and CAN_DL is greater than 8:
 			 * Only frames with the SF_DL == 0 ESC value are valid.
@@ -663,62 +1732,205 @@ static void isotp_rcv(struct sk_buff *skb, void *data)
 			 * length value from the formerly first data byte.
 			 */
 			if (sf_dl == 0)
-				isotp_rcv_sf(sk, cf, SF_PCI_SZ8 + ae, skb,
-					     cf->data[SF_PCI_SZ4 + ae]);
+				isotp_rcv_sf(sk, ch, cf, SF_PCI_SZ8 + ae,
+					     skb, cf->data[SF_PCI_SZ4 + ae],
+					     chkpad);
 		}
 		break;
 
 	case N_PCI_FF:
 		/* rx path: first frame */
-		isotp_rcv_ff(sk, cf, ae);
+		isotp_rcv_ff(sk, ch, cf, ae);
 		break;
 
 	case N_PCI_CF:
 		/* rx path: consecutive frame */
-		isotp_rcv_cf(sk, cf, ae, skb);
+		isotp_rcv_cf(sk, ch, cf, ae, skb, chkpad);
 		break;
 
 	}
 }
 
+/* the receive handler for any socket options */
+static void isotp_rcv(struct sk_buff *skb, void *data)
+{
+	struct sock *sk = (struct sock *)data;
+	struct isotp_sock *so = isotp_sk(sk);
+
+	BUG_ON(skb->len != CAN_MTU && skb->len != CANFD_MTU);
+
+	__isotp_rcv(skb, sk, (so->opt.flags & CAN_ISOTP_EXTEND_ADDR)? 1:0,
+		    so->ll.mtu, so->opt.flags & ISOTP_CHECK_PADDING,
+		    so->opt.flags & CAN_ISOTP_ANALYZER);
+}
+
+/*
+ * Receive handlers specialized for the ISOTP_RCV_* key of the socket
+ * options at bind() time. Options that are changed while the socket is
+ * bound take the generic path until the next bind().
+ */
+#define ISOTP_RCV_FUNC(name, key)					\
+static void name(struct sk_buff *skb, void *data)			\
+{									\
+	struct sock *sk = (struct sock *)data;				\
+									\
+	if (unlikely(isotp_sk(sk)->rcv_key != (key))) {			\
+		isotp_rcv(skb, data);					\
+		return;							\
+	}								\
+									\
+	__isotp_rcv(skb, sk, ((key) & ISOTP_RCV_AE) ? 1 : 0,		\
+		    ((key) & ISOTP_RCV_FD) ? CANFD_MTU : CAN_MTU,	\
+		    (key) & ISOTP_RCV_PAD, 0);				\
+}
+
+ISOTP_RCV_FUNC(isotp_rcv_n, 0)
+ISOTP_RCV_FUNC(isotp_rcv_x, ISOTP_RCV_AE)
+ISOTP_RCV_FUNC(isotp_rcv_fd, ISOTP_RCV_FD)
+ISOTP_RCV_FUNC(isotp_rcv_xfd, ISOTP_RCV_AE | ISOTP_RCV_FD)
+ISOTP_RCV_FUNC(isotp_rcv_n_pad, ISOTP_RCV_PAD)
+ISOTP_RCV_FUNC(isotp_rcv_x_pad, ISOTP_RCV_AE | ISOTP_RCV_PAD)
+ISOTP_RCV_FUNC(isotp_rcv_fd_pad, ISOTP_RCV_FD | ISOTP_RCV_PAD)
+ISOTP_RCV_FUNC(isotp_rcv_xfd_pad,
+	       ISOTP_RCV_AE | ISOTP_RCV_FD | ISOTP_RCV_PAD)
+
+static void (* const isotp_rcv_funcs[])(struct sk_buff *, void *) = {
+	[0]						= isotp_rcv_n,
+	[ISOTP_RCV_AE]					= isotp_rcv_x,
+	[ISOTP_RCV_FD]					= isotp_rcv_fd,
+	[ISOTP_RCV_AE | ISOTP_RCV_FD]			= isotp_rcv_xfd,
+	[ISOTP_RCV_PAD]					= isotp_rcv_n_pad,
+	[ISOTP_RCV_AE | ISOTP_RCV_PAD]			= isotp_rcv_x_pad,
+	[ISOTP_RCV_FD | ISOTP_RCV_PAD]			= isotp_rcv_fd_pad,
+	[ISOTP_RCV_AE | ISOTP_RCV_FD | ISOTP_RCV_PAD]	= isotp_rcv_xfd_pad,
+};
+
+/* pick the receive handler to register for the current socket options */
+static void (*isotp_rcv_func(struct isotp_sock *so))(struct sk_buff *, void *)
+{
+	if (so->opt.flags & CAN_ISOTP_ANALYZER)
+		return isotp_rcv;
+
+	return isotp_rcv_funcs[so->rcv_key];
+}
+
+/*
+ * Copy the next num bytes of the pdu into the CAN frame. The pdu skb may
+ * consist of page fragments for large pdus (see isotp_alloc_pdu()).
+ */
+static inline void isotp_tx_copy(struct isotp_sock *so, u8 *dst, int num)
+{
+	skb_copy_bits(so->tx.skb, so->tx.idx, dst, num);
+	so->tx.idx += num;
+}
+
 static void isotp_fill_dataframe(struct canfd_frame *cf, struct isotp_sock *so,
 				 int ae, int off)
 {
 	int pcilen = N_PCI_SZ + ae + off;
 	int space = so->tx.ll_dl - pcilen;
 	int num = min_t(int, so->tx.len - so->tx.idx, space);
-	int i;
 
-	cf->can_id = so->txid;
+	cf->can_id = so->tx_id;
 	cf->len = num + pcilen;
 
+	isotp_tx_copy(so, &cf->data[pcilen], num);
+
+	/* the PCI bytes are set by the caller => only pad the tail */
 	if (num < space) {
 		if (so->opt.flags & CAN_ISOTP_TX_PADDING) {
 			/* user requested padding */
 			cf->len = padlen(cf->len);
-			memset(cf->data, so->opt.txpad_content, cf->len);
+			memset(&cf->data[pcilen + num], so->opt.txpad_content,
+			       cf->len - pcilen - num);
 		} else if (cf->len > CAN_MAX_DLEN) {
 			/* mandatory padding for CAN FD frames */
 			cf->len = padlen(cf->len);
-			memset(cf->data, CAN_ISOTP_DEFAULT_PAD_CONTENT,
-			       cf->len);
+			memset(&cf->data[pcilen + num],
+			       CAN_ISOTP_DEFAULT_PAD_CONTENT,
+			       cf->len - pcilen - num);
 		}
 	}
 
-	for (i = 0; i < num; i++)
-		cf->data[pcilen + i] = so->tx.buf[so->tx.idx++];
-
 	if (ae)
 		cf->data[0] = so->opt.ext_address;
 }
 
+/* the CAN_DL of a (last) frame with len bytes, see isotp_fill_dataframe() */
+static inline int isotp_tx_frame_len(struct isotp_sock *so, int len)
+{
+	if ((so->opt.flags & CAN_ISOTP_TX_PADDING) || len > CAN_MAX_DLEN)
+		return padlen(len);
+
+	return len;
+}
+
+/*
+ * Bus time of a CAN FD frame in data phase bit times without stuff bits.
+ * The arbitration phase and the frame end take four times longer with
+ * the bitrate switch (assumed nominal/data bitrate ratio).
+ */
+static unsigned int isotp_fd_frame_bits(struct isotp_sock *so, int len)
+{
+	/* SOF, identifier up to BRS + ACK, ACK delimiter, EOF, IFS */
+	unsigned int nbits = ((so->tx_id & CAN_EFF_FLAG)? 36 : 17) + 12;
+
+	if (so->ll.tx_flags & CANFD_BRS)
+		nbits *= 4;
+
+	/* ESI, DLC, stuff count, CRC with fixed stuff bits, CRC delimiter */
+	return nbits + 8 * len + ((len > 16)? 38 : 33);
+}
+
+/* bus time of the current pdu when it is segmented with the given LL_DL */
+static u64 isotp_tx_plan_bits(struct isotp_sock *so, int ae, int ll_dl)
+{
+	int ff_pci_sz = (so->tx.len > 4095)? FF_PCI_SZ32 : FF_PCI_SZ12;
+	u32 cf_dl = ll_dl - ae - N_PCI_SZ;
+	u32 rest = so->tx.len - (ll_dl - ae - ff_pci_sz);
+	u64 bits;
+
+	/* the FF and all CFs but the last one have the LL_DL length */
+	bits = (u64)(rest / cf_dl + 1) * isotp_fd_frame_bits(so, ll_dl);
+
+	if (rest % cf_dl)
+		bits += isotp_fd_frame_bits(so, isotp_tx_frame_len(so,
+					    rest % cf_dl + ae + N_PCI_SZ));
+	return bits;
+}
+
+/*
+ * Segmentation planner (CAN_ISOTP_TX_DL_PLAN): the receiver takes the
+ * LL_DL of a pdu from the length of its FF (ISO 15765-2) and only the
+ * last CF may be shorter. So e.g. 95 bytes with TX_DL = 64 are sent in
+ * 64 + 48 byte frames and with LL_DL = 48 in 48 + 48 + 3 byte frames.
+ * Take the valid LL_DL up to TX_DL with the least bus time for the pdu,
+ * the larger one (fewer frames and flow control) on equal bus times.
+ */
+static void isotp_tx_plan(struct isotp_sock *so, int ae)
+{
+	static const u8 ll_dls[] = { 64, 48, 32, 24, 20, 16, 12, 8 };
+	u64 bits, best = ~0ULL;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ll_dls); i++) {
+		if (ll_dls[i] > so->ll.tx_dl)
+			continue;
+
+		bits = isotp_tx_plan_bits(so, ae, ll_dls[i]);
+		if (bits < best) {
+			best = bits;
+			so->tx.ll_dl = ll_dls[i];
+		}
+	}
+}
+
 static void isotp_create_fframe(struct canfd_frame *cf, struct isotp_sock *so,
 				int ae)
 {
-	int i;
 	int ff_pci_sz;
 
-	cf->can_id = so->txid;
+	cf->can_id = so->tx_id;
 	cf->len = so->tx.ll_dl;
 	if (ae)
 		cf->data[0] = so->opt.ext_address;
@@ -741,21 +1953,264 @@ static void isotp_create_fframe(struct canfd_frame *cf, struct isotp_sock *so,
 	}
 
 	/* add first data bytes depending on ae */
-	for (i = ae + ff_pci_sz; i < so->tx.ll_dl; i++)
-		cf->data[i] = so->tx.buf[so->tx.idx++];
+	isotp_tx_copy(so, &cf->data[ae + ff_pci_sz],
+		      so->tx.ll_dl - ae - ff_pci_sz);
 
 	so->tx.sn = 1;
-	so->tx.state = ISOTP_WAIT_FIRST_FC;
+	isotp_tx_state(so, ISOTP_WAIT_FIRST_FC);
+	atomic_set(&so->tx_fc_credit, 0);
 }
 
-static void isotp_tx_timer_tsklet(unsigned long data)
+/* send the SF or FF of the given pdu - the tx path has to be owned by us */
+static void isotp_tx_pdu(struct isotp_sock *so, struct sk_buff *pdu)
 {
-	struct isotp_sock *so = (struct isotp_sock *)data;
 	struct sock *sk = &so->sk;
 	struct sk_buff *skb;
 	struct net_device *dev;
 	struct canfd_frame *cf;
 	int ae = (so->opt.flags & CAN_ISOTP_EXTEND_ADDR)? 1:0;
+	int size = pdu->len;
+	int off, sf = 0;
+	int err = ENETDOWN;
+
+	/* the queued skb is the tx buffer until the pdu is completed */
+	so->tx.skb = pdu;
+	so->tx_id = ISOTP_PDU_CB(pdu)->txid;
+	so->tx_fcid = ISOTP_PDU_CB(pdu)->rxid;
+	so->tx.len = size;
+	so->tx.idx = 0;
+	so->tx.ll_dl = so->ll.tx_dl;
+
+	rcu_read_lock();
+	dev = rcu_dereference(so->dev);
+	if (!dev)
+		goto out_unlock;
+
+	err = ENOBUFS;
+	skb = alloc_skb(so->ll.mtu, gfp_any());
+	if (!skb)
+		goto out_unlock;
+
+	cf = (struct canfd_frame *)skb->data;
+	skb_put(skb, so->ll.mtu);
+
+	/* take care of a potential SF_DL ESC offset for TX_DL > 8 */
+	off = (so->tx.ll_dl > CAN_MAX_DLEN)? 1:0;
+
+	/* check for single frame transmission depending on TX_DL */
+	if (size <= so->tx.ll_dl - SF_PCI_SZ4 - ae - off) {
+
+		/*
+		 * The message size generally fits into a SingleFrame - good.
+		 *
+		 * SF_DL ESC offset optimization:
+		 *
+		 * When TX_DL is greater 8 but the message would still fit
+		 * into a 8 byte CAN frame, we can omit the offset.
+		 * This prevents a protocol caused length extension from
+		 * CAN_DL = 8 to CAN_DL = 12 due to the SF_SL ESC handling.
+		 */
+		if (size <= CAN_MAX_DLEN - SF_PCI_SZ4 - ae)
+			off = 0;
+
+		isotp_fill_dataframe(cf, so, ae, off);
+
+		/* place single frame N_PCI w/o length in appropriate index */
+		cf->data[ae] = N_PCI_SF;
+
+		/* place SF_DL size value depending on the SF_DL ESC offset */
+		if (off)
+			cf->data[SF_PCI_SZ4 + ae] = size;
+		else
+			cf->data[ae] |= size;
+
+		isotp_tx_state(so, ISOTP_IDLE);
+		sf = 1;
+	} else {
+		/* send first frame and wait for FC */
+
+		if ((so->opt.flags & CAN_ISOTP_TX_DL_PLAN) &&
+		    so->ll.mtu == CANFD_MTU)
+			isotp_tx_plan(so, ae);
+
+		isotp_create_fframe(cf, so, ae);
+		so->tx_ff_tstamp = ktime_get();
+
+		DBG("starting txtimer for fc\n");
+		/* start timeout for FC */
+		hrtimer_start(&so->txtimer, ns_to_ktime(so->tmo.n_bs),
+			      ISOTP_TX_HRTIMER_REL);
+	}
+
+	/* send the first or only CAN frame */
+	if (so->ll.mtu == CANFD_MTU)
+		cf->flags = so->ll.tx_flags;
+
+	skb->dev = dev;
+	isotp_skb_set_owner(skb, sk);
+	err = -isotp_can_send(so, skb);
+	if (!err) {
+		so->stats.tx_frames++;
+		so->stats.tx_pdus += sf;
+	}
+	rcu_read_unlock();
+
+	/* collect the responses until the deadline (restarted by each req) */
+	if (ISOTP_PDU_CB(pdu)->func && !err) {
+		so->func_rsp = 0;
+		so->func_active = 1;
+		hrtimer_start(&so->functimer, ns_to_ktime(so->func.timeout),
+			      ISOTP_RX_HRTIMER_REL);
+	}
+
+	/* a segmented pdu is confirmed at its end */
+	if (sf)
+		isotp_tx_confirm(so, err);
+	return;
+
+ out_unlock:
+	rcu_read_unlock();
+	isotp_tx_confirm(so, err);
+	isotp_tx_state(so, ISOTP_IDLE);
+}
+
+/*
+ * Take the next pdu from the tx queue when the tx path is idle.
+ * Single frame pdus are completed immediately, so we loop here until the
+ * queue is empty or a segmented transmission is on the run.
+ */
+static void isotp_tx_next(struct isotp_sock *so)
+{
+	struct sk_buff *pdu;
+
+	while (cmpxchg(&so->tx.state, ISOTP_IDLE,
+		       ISOTP_SENDING) == ISOTP_IDLE) {
+
+		/* release the send buffer space of the completed pdu */
+		if (so->tx.skb) {
+			consume_skb(so->tx.skb);
+			so->tx.skb = NULL;
+		}
+
+		pdu = skb_dequeue(&so->tx_queue);
+		if (!pdu) {
+			so->tx.state = ISOTP_IDLE;
+			wake_up_interruptible(&so->wait);
+
+			/* check for a pdu that has been queued meanwhile */
+			if (skb_queue_empty(&so->tx_queue))
+				return;
+			continue;
+		}
+
+		trace_isotp_state(so, 0, ISOTP_PDU_CB(pdu)->txid, ISOTP_IDLE,
+				  ISOTP_SENDING, 0, pdu->len);
+		isotp_tx_pdu(so, pdu);
+	}
+}
+
+/* update the statistics of the achieved gap between paced CFs */
+static void isotp_tx_gap_update(struct isotp_sock *so)
+{
+	ktime_t now = ktime_get();
+	u64 gap;
+
+	if (ktime_to_ns(so->lasttxcf_tstamp)) {
+		gap = ktime_to_ns(ktime_sub(now, so->lasttxcf_tstamp));
+
+		if (!so->txgap.frames || gap < so->txgap.min_ns)
+			so->txgap.min_ns = gap;
+		if (gap > so->txgap.max_ns)
+			so->txgap.max_ns = gap;
+
+		so->txgap.sum_ns += gap;
+		so->txgap.frames++;
+	}
+
+	so->lasttxcf_tstamp = now;
+}
+
+/* create the next consecutive frame of the current pdu */
+static struct sk_buff *isotp_create_cframe(struct isotp_sock *so,
+					   struct net_device *dev, int ae)
+{
+	struct sk_buff *skb;
+	struct canfd_frame *cf;
+
+	skb = alloc_skb(so->ll.mtu, gfp_any());
+	if (!skb)
+		return NULL;
+
+	cf = (struct canfd_frame *)skb->data;
+	skb_put(skb, so->ll.mtu);
+
+	/* create consecutive frame */
+	isotp_fill_dataframe(cf, so, ae, 0);
+
+	/* place consecutive frame N_PCI in appropriate index */
+	cf->data[ae] = N_PCI_CF | so->tx.sn++;
+	so->tx.sn %= 16;
+	so->tx.bs++;
+
+	trace_isotp_tx_cf(so, so->tx_id, cf->data[ae] & 0x0F, so->tx.bs,
+			  so->tx.idx, so->tx.len);
+
+	if (so->ll.mtu == CANFD_MTU)
+		cf->flags = so->ll.tx_flags;
+
+	skb->dev = dev;
+	isotp_skb_set_owner(skb, &so->sk);
+
+	return skb;
+}
+
+/* is the data of the next CF there (CAN_ISOTP_ROUTE) */
+static inline int isotp_tx_ready(struct isotp_sock *so, int ae)
+{
+	struct isotp_pdu_cb *cb = ISOTP_PDU_CB(so->tx.skb);
+	u32 need;
+
+	if (!cb->route)
+		return 1;
+
+	need = min_t(u32, so->tx.len,
+		     so->tx.idx + so->tx.ll_dl - ae - N_PCI_SZ);
+
+	if (READ_ONCE(cb->avail) < need && !READ_ONCE(cb->aborted))
+		return 0;
+
+	/* the payload is read after the length */
+	smp_rmb();
+	return 1;
+}
+
+/*
+ * Wait for the data of the next CF of a cut-through pdu. Returns 1 when
+ * the tx path has been handed over to isotp_tx_kick().
+ */
+static int isotp_tx_wait_data(struct isotp_sock *so, int ae)
+{
+	if (isotp_tx_ready(so, ae))
+		return 0;
+
+	isotp_tx_state(so, ISOTP_WAIT_DATA);
+	smp_mb();
+
+	if (!isotp_tx_ready(so, ae))
+		return 1;
+
+	/* the data has arrived meanwhile - unless already kicked */
+	return cmpxchg(&so->tx.state, ISOTP_WAIT_DATA,
+		       ISOTP_SENDING) != ISOTP_WAIT_DATA;
+}
+
+static void isotp_tx_work(struct isotp_sock *so)
+{
+	struct sk_buff_head burst;
+	struct sk_buff *skb;
+	struct net_device *dev;
+	int ae = (so->opt.flags & CAN_ISOTP_EXTEND_ADDR)? 1:0;
+	int nomem;
 
 	switch (so->tx.state) {
 
@@ -765,16 +2220,16 @@ static void isotp_tx_timer_tsklet(unsigned long data)
 		/* we did not get any flow control frame in time */
 
 		DBG("we did not get FC frame in time.\n");
+		so->stats.tx_timeouts++;
 
-#if 0
 		/* report 'communication error on send' */
-		sk->sk_err = ECOMM;
-		if (!sock_flag(sk, SOCK_DEAD))
-			sk->sk_error_report(sk);
-#endif
-		/* reset tx state */
-		so->tx.state = ISOTP_IDLE;
+		isotp_report_err(so, ECOMM);
+		isotp_tx_confirm(so, ECOMM);
+
+		/* reset tx state and continue with the next queued pdu */
+		isotp_tx_state(so, ISOTP_IDLE);
 		wake_up_interruptible(&so->wait);
+		isotp_tx_next(so);
 		break;
 
 	case ISOTP_SENDING:
@@ -783,64 +2238,109 @@ static void isotp_tx_timer_tsklet(unsigned long data)
 
 		DBG("next pdu to send.\n");
 
-		dev = dev_get_by_index(&init_net, so->ifindex);
-		if (!dev)
+		rcu_read_lock();
+		dev = rcu_dereference(so->dev);
+		if (!dev) {
+			rcu_read_unlock();
+			isotp_tx_confirm(so, ENETDOWN);
+			isotp_tx_state(so, ISOTP_IDLE);
+			isotp_tx_next(so);
 			break;
+		}
 
 isotp_tx_burst:
-		skb = alloc_skb(so->ll.mtu, gfp_any());
-		if (!skb) {
-			dev_put(dev);
+		if (isotp_tx_wait_data(so, ae)) {
+			rcu_read_unlock();
+			break;
+		}
+
+		/* the incoming pdu of the route has been aborted */
+		if (READ_ONCE(ISOTP_PDU_CB(so->tx.skb)->aborted)) {
+			rcu_read_unlock();
+			isotp_report_err(so, ECONNABORTED);
+			isotp_tx_confirm(so, ECONNABORTED);
+			isotp_tx_state(so, ISOTP_IDLE);
+			wake_up_interruptible(&so->wait);
+			isotp_tx_next(so);
 			break;
 		}
 
-		cf = (struct canfd_frame *)skb->data;
-		skb_put(skb, so->ll.mtu);
+		/*
+		 * Create the CFs of the current burst in one go before they
+		 * are pushed into the netdevice. Without a gap between the
+		 * CFs a burst lasts up to the end of the block (txfc.bs) or
+		 * the end of the pdu - in chunks of ISOTP_TX_BURST frames.
+		 */
+		__skb_queue_head_init(&burst);
+		nomem = 0;
+		do {
+			skb = isotp_create_cframe(so, dev, ae);
+			if (!skb) {
+				nomem = 1;
+				break;
+			}
 
-		/* create consecutive frame */
-		isotp_fill_dataframe(cf, so, ae, 0);
+			__skb_queue_tail(&burst, skb);
 
-		/* place consecutive frame N_PCI in appropriate index */
-		cf->data[ae] = N_PCI_CF | so->tx.sn++;
-		so->tx.sn %= 16;
-		so->tx.bs++;
+		} while (!ktime_to_ns(so->tx_gap) && so->tx.idx < so->tx.len &&
+			 skb_queue_len(&burst) < ISOTP_TX_BURST &&
+			 !(so->txfc.bs && so->tx.bs >= so->txfc.bs) &&
+			 isotp_tx_ready(so, ae));
 
-		if (so->ll.mtu == CANFD_MTU)
-			cf->flags = so->ll.tx_flags;
+		if (ktime_to_ns(so->tx_gap))
+			isotp_tx_gap_update(so);
 
-		skb->dev = dev;
-		isotp_skb_set_owner(skb, sk);
-		can_send(skb, 1);
+		while ((skb = __skb_dequeue(&burst)))
+			if (!can_send(skb, 1))
+				so->stats.tx_frames++;
 
 		if (so->tx.idx >= so->tx.len) {
 			/* we are done */
 			DBG("we are done\n");
-			so->tx.state = ISOTP_IDLE;
-			dev_put(dev);
+			so->stats.tx_pdus++;
+			isotp_hist_add(so->stats.tx_time_hist, so->tx_ff_tstamp);
+			isotp_tx_confirm(so, 0);
+			isotp_tx_state(so, ISOTP_IDLE);
+			rcu_read_unlock();
 			wake_up_interruptible(&so->wait);
+			isotp_tx_next(so);
 			break;
 		}
 
+		/* the next block may have been granted by an early FC */
+		if (so->txfc.bs && so->tx.bs >= so->txfc.bs &&
+		    atomic_add_unless(&so->tx_fc_credit, -1, 0))
+			so->tx.bs = 0;
+
 		if (so->txfc.bs && so->tx.bs >= so->txfc.bs) {
 			/* stop and wait for FC */
 			DBG("BS stop and wait for FC\n");
-			so->tx.state = ISOTP_WAIT_FC;
-			dev_put(dev);
+			isotp_tx_state(so, ISOTP_WAIT_FC);
+			rcu_read_unlock();
 			hrtimer_start(&so->txtimer,
-				      ktime_add(ktime_get(), ktime_set(1,0)),
-				      HRTIMER_MODE_ABS);
+				      ktime_add_ns(ktime_get(), so->tmo.n_bs),
+				      ISOTP_TX_HRTIMER_ABS);
 			break;
-		} 
+		}
 
-		/* no gap between data frames needed => use burst mode */
-		if (!so->tx_gap.tv64)
+		/* no gap between data frames needed => continue burst mode */
+		if (!ktime_to_ns(so->tx_gap) && !nomem)
 			goto isotp_tx_burst;
 
+		rcu_read_unlock();
+
+		/* out of memory => retry to send the pending CF later */
+		if (nomem) {
+			hrtimer_start(&so->txtimer,
+				      ktime_add_ns(ktime_get(), ISOTP_TX_RETRY),
+				      ISOTP_TX_HRTIMER_ABS);
+			break;
+		}
+
 		/* start timer to send next data frame with correct delay */
-		dev_put(dev);
 		hrtimer_start(&so->txtimer,
 			      ktime_add(ktime_get(), so->tx_gap),
-			      HRTIMER_MODE_ABS);
+			      ISOTP_TX_HRTIMER_ABS);
 		break;
 
 	default:
@@ -848,13 +2348,82 @@ isotp_tx_burst:
 	}
 }
 
+#ifdef ISOTP_SOFT_HRTIMER
+static enum hrtimer_restart isotp_tx_timer_handler(struct hrtimer *hrtimer)
+{
+	struct isotp_sock *so = container_of(hrtimer, struct isotp_sock,
+					     txtimer);
+	/* we are in softirq context => send the next CF(s) directly */
+	isotp_tx_work(so);
+
+	return HRTIMER_NORESTART;
+}
+#else
+static void isotp_tx_timer_tsklet(unsigned long data)
+{
+	isotp_tx_work((struct isotp_sock *)data);
+}
+
 static enum hrtimer_restart isotp_tx_timer_handler(struct hrtimer *hrtimer)
 {
 	struct isotp_sock *so = container_of(hrtimer, struct isotp_sock,
 					     txtimer);
 	tasklet_schedule(&so->txtsklet);
 
-	return HRTIMER_NORESTART;
+	return HRTIMER_NORESTART;
+}
+#endif
+
+/*
+ * Allocate the pdu skb and copy the data from userspace.
+ *
+ * The CAN frames are built from this skb directly, so a pdu is copied
+ * only once from userspace into the kernel. Pinning the user pages
+ * (MSG_ZEROCOPY) is no option here as SO_ZEROCOPY is restricted to inet
+ * sockets and the CAN netdevices need linear CAN frame skbs anyway.
+ * To support large (e.g. flash download) pdus without high-order
+ * allocations, pdus that exceed SKB_MAX_ALLOC are built from page
+ * fragments.
+ */
+static struct sk_buff *isotp_alloc_pdu(struct sock *sk, struct msghdr *msg,
+				       size_t size, int *err)
+{
+	int noblock = msg->msg_flags & MSG_DONTWAIT;
+	struct sk_buff *skb;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0)
+	if (size > SKB_MAX_ALLOC) {
+		skb = sock_alloc_send_pskb(sk, 0, size, noblock, err,
+					   PAGE_ALLOC_COSTLY_ORDER);
+		if (!skb)
+			return NULL;
+
+		skb->data_len = size;
+		skb->len = size;
+
+		*err = skb_copy_datagram_from_iter(skb, 0, &msg->msg_iter,
+						   size);
+		if (*err < 0) {
+			kfree_skb(skb);
+			return NULL;
+		}
+		return skb;
+	}
+#endif
+	skb = sock_alloc_send_skb(sk, size, noblock, err);
+	if (!skb)
+		return NULL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0)
+	*err = memcpy_from_msg(skb_put(skb, size), msg, size);
+#else
+	*err = memcpy_fromiovec(skb_put(skb, size), msg->msg_iov, size);
+#endif
+	if (*err < 0) {
+		kfree_skb(skb);
+		return NULL;
+	}
+	return skb;
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0)
@@ -866,106 +2435,73 @@ static int isotp_sendmsg(struct kiocb *iocb, struct socket *sock,
 {
 	struct sock *sk = sock->sk;
 	struct isotp_sock *so = isotp_sk(sk);
+	struct isotp_chan *ch = &so->chan;
 	struct sk_buff *skb;
-	struct net_device *dev;
-	struct canfd_frame *cf;
-	int ae = (so->opt.flags & CAN_ISOTP_EXTEND_ADDR)? 1:0;
-	int off;
+	int func = 0;
 	int err;
 
 	if (!so->bound)
 		return -EADDRNOTAVAIL;
 
-	/* we do not support multiple buffers - for now */
-	if (so->tx.state != ISOTP_IDLE) {
-		if (msg->msg_flags & MSG_DONTWAIT)
-			return -EAGAIN;
-
-		/* wait for complete transmission of current pdu */
-		wait_event_interruptible(so->wait, so->tx.state == ISOTP_IDLE);
-	}
-
-	if (!size || size > MAX_MSG_LENGTH)
-		return -EINVAL;
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0)
-	err = memcpy_from_msg(so->tx.buf, msg, size);
-#else
-	err = memcpy_fromiovec(so->tx.buf, msg->msg_iov, size);
-#endif
-	if (err < 0)
-		return err;
+	if (msg->msg_name && so->func.timeout) {
+		struct sockaddr_can *addr =
+			(struct sockaddr_can *)msg->msg_name;
 
-	dev = dev_get_by_index(&init_net, so->ifindex);
-	if (!dev)
-		return -ENXIO;
+		if (msg->msg_namelen < sizeof(*addr))
+			return -EINVAL;
 
-	skb = sock_alloc_send_skb(sk, so->ll.mtu,
-				  msg->msg_flags & MSG_DONTWAIT, &err);
-	if (!skb) {
-		dev_put(dev);
-		return err;
+		func = (addr->can_addr.tp.tx_id == so->func.tx_id);
 	}
 
-	so->tx.state = ISOTP_SENDING;
-	so->tx.len = size;
-	so->tx.idx = 0;
-
-	cf = (struct canfd_frame *)skb->data;
-	skb_put(skb, so->ll.mtu);
-
-	/* take care of a potential SF_DL ESC offset for TX_DL > 8 */
-	off = (so->tx.ll_dl > CAN_MAX_DLEN)? 1:0;
+	/* functional requests are single frames only (ISO 15765-2) */
+	if (func) {
+		int ae = (so->opt.flags & CAN_ISOTP_EXTEND_ADDR)? 1:0;
+		int off = (so->ll.tx_dl > CAN_MAX_DLEN)? 1:0;
 
-	/* check for single frame transmission depending on TX_DL */
-	if (size <= so->tx.ll_dl - SF_PCI_SZ4 - ae - off) {
+		if (size > so->ll.tx_dl - SF_PCI_SZ4 - ae - off)
+			return -EMSGSIZE;
+	}
 
-		/*
-		 * The message size generally fits into a SingleFrame - good.
-		 *
-		 * SF_DL ESC offset optimization:
-		 *
-		 * When TX_DL is greater 8 but the message would still fit
-		 * into a 8 byte CAN frame, we can omit the offset.
-		 * This prevents a protocol caused length extension from
-		 * CAN_DL = 8 to CAN_DL = 12 due to the SF_SL ESC handling.
-		 */
-		if (size <= CAN_MAX_DLEN - SF_PCI_SZ4 - ae)
-			off = 0;
+	/* select one of the additional channels by its rx_id/tx_id pair */
+	if (msg->msg_name && so->chantab && !func) {
+		struct sockaddr_can *addr =
+			(struct sockaddr_can *)msg->msg_name;
 
-		isotp_fill_dataframe(cf, so, ae, off);
+		if (msg->msg_namelen < sizeof(*addr))
+			return -EINVAL;
 
-		/* place single frame N_PCI w/o length in appropriate index */
-		cf->data[ae] = N_PCI_SF;
+		ch = isotp_find_chan(so, addr->can_addr.tp.rx_id);
+		if (!ch || ch->txid != addr->can_addr.tp.tx_id)
+			return -EADDRNOTAVAIL;
+	}
 
-		/* place SF_DL size value depending on the SF_DL ESC offset */
-		if (off)
-			cf->data[SF_PCI_SZ4 + ae] = size;
-		else
-			cf->data[ae] |= size;
+	if (!size || size > sk->sk_sndbuf)
+		return -EINVAL;
 
-		so->tx.state = ISOTP_IDLE;
-		wake_up_interruptible(&so->wait);
-	} else {
-		/* send first frame and wait for FC */
+	if (!so->dev)
+		return -ENXIO;
 
-		isotp_create_fframe(cf, so, ae);
+	/*
+	 * The PDU is queued as a whole and is charged to the sockets send
+	 * buffer. Therefore this only blocks (or returns -EAGAIN) when
+	 * sk_sndbuf is exhausted by the PDUs that are still queued.
+	 *
+	 * The socket lock is not taken here: the pdus of a sendmmsg() batch
+	 * are appended to the tx queue and are picked up back to back by the
+	 * running tx path.
+	 */
+	skb = isotp_alloc_pdu(sk, msg, size, &err);
+	if (!skb)
+		return err;
 
-		DBG("starting txtimer for fc\n");
-		/* start timeout for FC */
-		hrtimer_start(&so->txtimer, ktime_set(1,0), HRTIMER_MODE_REL);
-	}
+	ISOTP_PDU_CB(skb)->txid = func ? so->func.tx_id : ch->txid;
+	ISOTP_PDU_CB(skb)->rxid = ch->rxid;
+	ISOTP_PDU_CB(skb)->func = func;
 
-	/* send the first or only CAN frame */
-	if (so->ll.mtu == CANFD_MTU)
-		cf->flags = so->ll.tx_flags;
+	skb_queue_tail(&so->tx_queue, skb);
 
-	skb->dev = dev;
-	skb->sk  = sk;
-	err = can_send(skb, 1);
-	dev_put(dev);
-	if (err)
-		return err;
+	/* start the transmission when the tx path is idle */
+	isotp_tx_next(so);
 
 	return size;
 }
@@ -983,9 +2519,21 @@ static int isotp_recvmsg(struct kiocb *iocb, struct socket *sock,
 	int err = 0;
 	int noblock;
 
+#ifdef ISOTP_TX_CONFIRM
+	if (flags & MSG_ERRQUEUE)
+		return sock_recv_errqueue(sk, msg, size, SOL_CAN_ISOTP,
+					  SCM_CAN_ISOTP_CONFIRM);
+#endif
+
 	noblock =  flags & MSG_DONTWAIT;
 	flags   &= ~MSG_DONTWAIT;
 
+#ifdef CAN_BUSY_POLL
+	/* the frames of a PDU complete it within the busy polled NAPI */
+	if (sk_can_busy_loop(sk) && skb_queue_empty(&sk->sk_receive_queue))
+		sk_busy_loop(sk, noblock);
+#endif
+
 	skb = skb_recv_datagram(sk, flags, noblock, &err);
 	if (!skb)
 		return err;
@@ -995,10 +2543,11 @@ static int isotp_recvmsg(struct kiocb *iocb, struct socket *sock,
 	else
 		size = skb->len;
 
+	/* large pdus are not linear (see isotp_alloc_rx_pdu()) */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0)
-	err = memcpy_to_msg(msg, skb->data, size);
+	err = skb_copy_datagram_msg(skb, 0, msg, size);
 #else
-	err = memcpy_toiovec(msg->msg_iov, skb->data, size);
+	err = skb_copy_datagram_iovec(skb, 0, msg->msg_iov, size);
 #endif
 	if (err < 0) {
 		skb_free_datagram(sk, skb);
@@ -1014,9 +2563,43 @@ static int isotp_recvmsg(struct kiocb *iocb, struct socket *sock,
 
 	skb_free_datagram(sk, skb);
 
+	isotp_rx_kick(isotp_sk(sk));
+
 	return size;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,16,0)
+#define isotp_poll_t __poll_t
+#define ISOTP_POLLOUT (EPOLLOUT | EPOLLWRNORM | EPOLLWRBAND)
+#else
+#define isotp_poll_t unsigned int
+#define ISOTP_POLLOUT (POLLOUT | POLLWRNORM | POLLWRBAND)
+#endif
+
+/*
+ * isotp_sendmsg() queues pdus until the send buffer is exhausted. So the
+ * writability of datagram_poll() matches the tx path: POLLOUT is given
+ * when the queued pdus leave room for more and the release of a sent pdu
+ * wakes up the poller (sk_write_space). A FC timeout shows up as POLLERR.
+ * Sockets that would fail in sendmsg() (not bound, netdevice gone) are
+ * not writable.
+ */
+static isotp_poll_t isotp_poll(struct file *file, struct socket *sock,
+			       poll_table *wait)
+{
+	struct sock *sk = sock->sk;
+	struct isotp_sock *so = isotp_sk(sk);
+	isotp_poll_t mask = datagram_poll(file, sock, wait);
+
+	/* completed transmissions */
+	poll_wait(file, &so->wait, wait);
+
+	if (!so->bound || !so->dev)
+		mask &= ~ISOTP_POLLOUT;
+
+	return mask;
+}
+
 static int isotp_release(struct socket *sock)
 {
 	struct sock *sk = sock->sk;
@@ -1027,30 +2610,50 @@ static int isotp_release(struct socket *sock)
 
 	so = isotp_sk(sk);
 
-	/* wait for complete transmission of current pdu */
-	wait_event_interruptible(so->wait, so->tx.state == ISOTP_IDLE);
+	/* wait for complete transmission of all queued pdus */
+	wait_event_interruptible(so->wait, so->tx.state == ISOTP_IDLE &&
+				 skb_queue_empty(&so->tx_queue));
 
 	unregister_netdevice_notifier(&so->notifier);
 
+	spin_lock_bh(&isotp_sockets_lock);
+	hlist_del(&so->proc_list);
+	spin_unlock_bh(&isotp_sockets_lock);
+
 	lock_sock(sk);
 
+	/* no routed pdus and no rearming of the txtimer after this */
+	WRITE_ONCE(so->tx_closed, 1);
+	synchronize_rcu();
+
 	hrtimer_cancel(&so->txtimer);
-	hrtimer_cancel(&so->rxtimer);
+#ifndef ISOTP_SOFT_HRTIMER
 	tasklet_kill(&so->txtsklet);
+#endif
+	hrtimer_cancel(&so->functimer);
+#ifndef ISOTP_SOFT_HRTIMER
+	tasklet_kill(&so->functsklet);
+#endif
+	skb_queue_purge(&so->tx_queue);
+	kfree_skb(so->tx.skb);
 
 	/* remove current filters & unregister */
-	if (so->bound) {
-		if (so->ifindex) {
-			struct net_device *dev;
-
-			dev = dev_get_by_index(&init_net, so->ifindex);
-			if (dev) {
-				can_rx_unregister(dev, so->rxid,
-						  SINGLE_MASK(so->rxid),
-						  isotp_rcv, sk);
-				dev_put(dev);
-			}
-		}
+	if (so->bound && so->dev)
+		isotp_unregister_chans(so, so->dev, UINT_MAX);
+
+	isotp_dev_release(so);
+
+	/* the rx path is gone after the grace period in isotp_dev_release() */
+	isotp_chan_stop(&so->chan);
+	isotp_free_chantab(so->chantab);
+	so->chantab = NULL;
+	isotp_free_chantab(so->anatab);
+	so->anatab = NULL;
+
+	/* the cut-through pdus have been aborted by isotp_chan_stop() */
+	if (so->route) {
+		sock_put(&so->route->sk);
+		so->route = NULL;
 	}
 
 	so->ifindex = 0;
@@ -1070,20 +2673,23 @@ static int isotp_bind(struct socket *sock, struct sockaddr *uaddr, int len)
 	struct sockaddr_can *addr = (struct sockaddr_can *)uaddr;
 	struct sock *sk = sock->sk;
 	struct isotp_sock *so = isotp_sk(sk);
-	int ifindex;
-	struct net_device *dev;
+	struct net_device *dev, *olddev;
 	int err = 0;
 	int notify_enetdown = 0;
 
 	if (len < sizeof(*addr))
 		return -EINVAL;
 
-	if (addr->can_addr.tp.rx_id == addr->can_addr.tp.tx_id)
-		return -EADDRNOTAVAIL;
-
-	if ((addr->can_addr.tp.rx_id | addr->can_addr.tp.tx_id) &
-	    (CAN_ERR_FLAG | CAN_RTR_FLAG))
-		return -EADDRNOTAVAIL;
+	/* the analyzer takes a CAN filter id/mask pair instead */
+	if (so->opt.flags & CAN_ISOTP_ANALYZER) {
+		if (so->chantab)
+			return -EINVAL;
+	} else {
+		err = isotp_check_chan(addr->can_addr.tp.rx_id,
+				       addr->can_addr.tp.tx_id);
+		if (err)
+			return err;
+	}
 
 	if (!addr->can_ifindex)
 		return -ENODEV;
@@ -1091,11 +2697,21 @@ static int isotp_bind(struct socket *sock, struct sockaddr *uaddr, int len)
 	lock_sock(sk);
 
 	if (so->bound && addr->can_ifindex == so->ifindex &&
-	    addr->can_addr.tp.rx_id == so->rxid &&
-	    addr->can_addr.tp.tx_id == so->txid)
+	    addr->can_addr.tp.rx_id == so->chan.rxid &&
+	    addr->can_addr.tp.tx_id == so->chan.txid)
+		goto out;
+
+	/*
+	 * The bind() channel must not be part of the channel table. Look into
+	 * the table itself: isotp_find_chan() returns the bind() channel for
+	 * the rx_id of a former or failed binding.
+	 */
+	if (isotp_tab_chan(so->chantab, addr->can_addr.tp.rx_id)) {
+		err = -EADDRINUSE;
 		goto out;
+	}
 
-	dev = dev_get_by_index(&init_net, addr->can_ifindex);
+	dev = dev_get_by_index(sock_net(sk), addr->can_ifindex);
 	if (!dev) {
 		err = -ENODEV;
 		goto out;
@@ -1113,31 +2729,54 @@ static int isotp_bind(struct socket *sock, struct sockaddr *uaddr, int len)
 	if (!(dev->flags & IFF_UP))
 		notify_enetdown = 1;
 
-	ifindex = dev->ifindex;
-
-	can_rx_register(dev, addr->can_addr.tp.rx_id,
-			SINGLE_MASK(addr->can_addr.tp.rx_id),
-			isotp_rcv, sk, "isotp");
-	dev_put(dev);
-
-	if (so->bound) {
-		/* unregister old filter */
-		if (so->ifindex) {
-			dev = dev_get_by_index(&init_net, so->ifindex);
-			if (dev) {
-				can_rx_unregister(dev, so->rxid,
-						  SINGLE_MASK(so->rxid),
-						  isotp_rcv, sk);
-				dev_put(dev);
-			}
+	/* unregister old filters and wait for running rx callbacks */
+	if (so->bound && so->dev) {
+		isotp_unregister_chans(so, so->dev, UINT_MAX);
+		synchronize_rcu();
+	}
+	so->bound = 0;
+
+	isotp_chan_stop(&so->chan);
+	so->chan.rxid = addr->can_addr.tp.rx_id;
+	so->chan.txid = addr->can_addr.tp.tx_id;
+
+	/* start with an empty table of observed channels */
+	isotp_free_chantab(so->anatab);
+	so->anatab = NULL;
+	so->ana_ff = NULL;
+
+	if (so->opt.flags & CAN_ISOTP_ANALYZER) {
+		so->anatab = isotp_alloc_chantab(so, NULL,
+						 CAN_ISOTP_MAX_CHANNELS);
+		if (!so->anatab) {
+			err = -ENOMEM;
+			goto out_unbound;
 		}
 	}
 
+	err = isotp_register_chans(so, dev);
+	if (err)
+		goto out_unbound;
+
+	/* keep the reference of the new netdevice for the tx path */
+	olddev = so->dev;
+	rcu_assign_pointer(so->dev, dev);
+	if (olddev) {
+		synchronize_rcu();
+		dev_put(olddev);
+	}
+
 	/* switch to new settings */
-	so->ifindex = ifindex;
-	so->rxid = addr->can_addr.tp.rx_id;
-	so->txid = addr->can_addr.tp.tx_id;
+	so->ifindex = dev->ifindex;
 	so->bound = 1;
+	goto out;
+
+ out_unbound:
+	/* the old binding is gone => do not hold the old netdevice anymore */
+	dev_put(dev);
+	isotp_dev_release(so);
+	so->ifindex = 0;
+	notify_enetdown = 0;
 
  out:
 	release_sock(sk);
@@ -1191,13 +2830,29 @@ static int isotp_setsockopt(struct socket *sock, int level, int optname,
 	case CAN_ISOTP_OPTS:
 		if (optlen != sizeof(struct can_isotp_options))
 			return -EINVAL;
+		else {
+			struct can_isotp_options opt;
 
-		if (copy_from_user(&so->opt, optval, optlen))
-			return -EFAULT;
+			if (copy_from_user(&opt, optval, optlen))
+				return -EFAULT;
+
+			/* the analyzer mode changes the filter of the binding */
+			if (so->bound &&
+			    ((opt.flags ^ so->opt.flags) & CAN_ISOTP_ANALYZER))
+				return -EISCONN;
+
+			memcpy(&so->opt, &opt, sizeof(opt));
+		}
+
+		/* the analyzer never sends FC frames */
+		if (so->opt.flags & CAN_ISOTP_ANALYZER)
+			so->opt.flags |= CAN_ISOTP_LISTEN_MODE;
 
 		/* no separate rx_ext_address is given => use ext_address */
 		if (!(so->opt.flags & CAN_ISOTP_RX_EXT_ADDR))
 			so->opt.rx_ext_address = so->opt.ext_address;
+
+		isotp_update_rcv_key(so);
 		break;
 
 	case CAN_ISOTP_RECV_FC:
@@ -1224,6 +2879,59 @@ static int isotp_setsockopt(struct socket *sock, int level, int optname,
 			return -EFAULT;
 		break;
 
+	case CAN_ISOTP_CHANNELS:
+		if (optlen % sizeof(struct can_isotp_chan) ||
+		    optlen > CAN_ISOTP_MAX_CHANNELS *
+			     sizeof(struct can_isotp_chan))
+			return -EINVAL;
+		else {
+			struct can_isotp_chan *uchan = NULL;
+			struct isotp_chan_tab *tab = NULL;
+			int num = optlen / sizeof(struct can_isotp_chan);
+			int i, j;
+
+			if (num) {
+				uchan = memdup_user(optval, optlen);
+				if (IS_ERR(uchan))
+					return PTR_ERR(uchan);
+			}
+
+			/* check for valid and unique rx_id/tx_id pairs */
+			for (i = 0; i < num && !ret; i++) {
+				ret = isotp_check_chan(uchan[i].rx_id,
+						       uchan[i].tx_id);
+				for (j = 0; j < i && !ret; j++)
+					if (uchan[i].rx_id == uchan[j].rx_id)
+						ret = -EADDRINUSE;
+			}
+
+			if (num && !ret) {
+				tab = isotp_alloc_chantab(so, uchan, num);
+				if (!tab)
+					ret = -ENOMEM;
+			}
+			kfree(uchan);
+			if (ret)
+				return ret;
+
+			lock_sock(sk);
+			/* the channels can only be changed when unbound */
+			if (so->bound) {
+				release_sock(sk);
+				isotp_free_chantab(tab);
+				return -EISCONN;
+			}
+			swap(so->chantab, tab);
+			release_sock(sk);
+
+			/* rx callbacks of a former binding may still run */
+			if (tab) {
+				synchronize_rcu();
+				isotp_free_chantab(tab);
+			}
+		}
+		break;
+
 	case CAN_ISOTP_LL_OPTS:
 		if (optlen != sizeof(struct can_isotp_ll_options))
 			return -EINVAL;
@@ -1247,6 +2955,100 @@ static int isotp_setsockopt(struct socket *sock, int level, int optname,
 
 			/* set ll_dl for tx path to similar place as for rx */
 			so->tx.ll_dl = ll.tx_dl;
+
+			isotp_update_rcv_key(so);
+		}
+		break;
+
+	case CAN_ISOTP_FUNC_ADDR:
+		if (optlen != sizeof(struct can_isotp_func))
+			return -EINVAL;
+		else {
+			struct can_isotp_func func;
+
+			if (copy_from_user(&func, optval, optlen))
+				return -EFAULT;
+
+			if (func.timeout &&
+			    (func.tx_id & (CAN_ERR_FLAG | CAN_RTR_FLAG)))
+				return -EINVAL;
+
+			hrtimer_cancel(&so->functimer);
+#ifndef ISOTP_SOFT_HRTIMER
+			tasklet_kill(&so->functsklet);
+#endif
+			so->func_active = 0;
+			memcpy(&so->func, &func, sizeof(func));
+		}
+		break;
+
+	case CAN_ISOTP_TIMEOUTS:
+		if (optlen != sizeof(struct can_isotp_timeouts))
+			return -EINVAL;
+		else {
+			struct can_isotp_timeouts tmo;
+
+			if (copy_from_user(&tmo, optval, optlen))
+				return -EFAULT;
+
+			/* zero would abort every segmented transfer */
+			if (!tmo.n_bs || !tmo.n_cr)
+				return -EINVAL;
+
+			memcpy(&so->tmo, &tmo, sizeof(tmo));
+		}
+		break;
+
+#ifdef CAN_QDISC_BYPASS
+	case CAN_ISOTP_QDISC_BYPASS:
+		if (optlen != sizeof(so->qdisc_bypass))
+			return -EINVAL;
+
+		if (copy_from_user(&so->qdisc_bypass, optval, optlen))
+			return -EFAULT;
+		break;
+#endif
+
+	case CAN_ISOTP_ROUTE:
+		if (optlen != sizeof(int))
+			return -EINVAL;
+		else {
+			struct isotp_sock *to = NULL, *old;
+			struct socket *tsock;
+			int fd;
+
+			if (copy_from_user(&fd, optval, optlen))
+				return -EFAULT;
+
+			if (fd >= 0) {
+				tsock = sockfd_lookup(fd, &ret);
+				if (!tsock)
+					return ret;
+
+				/* the sending socket has to be an isotp one */
+				if (!tsock->sk || tsock->sk == sk ||
+				    tsock->sk->sk_family != PF_CAN ||
+				    tsock->sk->sk_protocol != CAN_ISOTP ||
+				    (so->opt.flags & CAN_ISOTP_ANALYZER)) {
+					sockfd_put(tsock);
+					return -EINVAL;
+				}
+
+				to = isotp_sk(tsock->sk);
+				sock_hold(&to->sk);
+				sockfd_put(tsock);
+			}
+
+			lock_sock(sk);
+			old = so->route;
+			rcu_assign_pointer(so->route, to);
+			release_sock(sk);
+
+			/* running cut-through pdus hold their own reference */
+			if (old) {
+				synchronize_rcu();
+				sock_put(&old->sk);
+			}
 		}
 		break;
 
@@ -1257,6 +3059,43 @@ static int isotp_setsockopt(struct socket *sock, int level, int optname,
 	return ret;
 }
 
+/* copy the channel table to userspace (-ERANGE reports the needed size) */
+static int isotp_get_chans(struct isotp_sock *so, char __user *optval,
+			   int __user *optlen, int len)
+{
+	struct isotp_chan_tab *tab;
+	struct can_isotp_chan uchan;
+	int i, num, ret = 0;
+
+	lock_sock(&so->sk);
+	tab = so->chantab;
+	num = tab ? tab->num : 0;
+
+	if (len < num * sizeof(uchan)) {
+		ret = -ERANGE;
+		len = num * sizeof(uchan);
+		goto out;
+	}
+
+	len = num * sizeof(uchan);
+	for (i = 0; i < num; i++) {
+		uchan.rx_id = tab->chan[i].rxid;
+		uchan.tx_id = tab->chan[i].txid;
+		if (copy_to_user(optval + i * sizeof(uchan), &uchan,
+				 sizeof(uchan))) {
+			ret = -EFAULT;
+			goto out;
+		}
+	}
+
+ out:
+	release_sock(&so->sk);
+
+	if (put_user(len, optlen))
+		return -EFAULT;
+	return ret;
+}
+
 static int isotp_getsockopt(struct socket *sock, int level, int optname,
 			  char __user *optval, int __user *optlen)
 {
@@ -1299,6 +3138,36 @@ static int isotp_getsockopt(struct socket *sock, int level, int optname,
 		val = &so->ll;
 		break;
 
+	case CAN_ISOTP_TIMEOUTS:
+		len = min_t(int, len, sizeof(struct can_isotp_timeouts));
+		val = &so->tmo;
+		break;
+
+	case CAN_ISOTP_FUNC_ADDR:
+		len = min_t(int, len, sizeof(struct can_isotp_func));
+		val = &so->func;
+		break;
+
+#ifdef CAN_QDISC_BYPASS
+	case CAN_ISOTP_QDISC_BYPASS:
+		len = min_t(int, len, sizeof(int));
+		val = &so->qdisc_bypass;
+		break;
+#endif
+
+	case CAN_ISOTP_TX_GAP_STATS:
+		len = min_t(int, len, sizeof(struct can_isotp_gap_stats));
+		val = &so->txgap;
+		break;
+
+	case CAN_ISOTP_CHANNELS:
+		return isotp_get_chans(so, optval, optlen, len);
+
+	case CAN_ISOTP_STATS:
+		len = min_t(int, len, sizeof(struct can_isotp_stats));
+		val = &so->stats;
+		break;
+
 	default:
 		return -ENOPROTOOPT;
 	}
@@ -1311,6 +3180,94 @@ static int isotp_getsockopt(struct socket *sock, int level, int optname,
 }
 
 
+/*
+ * procfs functions
+ */
+static void isotp_proc_show_hist(struct seq_file *m, const char *name,
+				 const __u64 *hist)
+{
+	int i, last = -1;
+
+	for (i = 0; i < CAN_ISOTP_HIST_SLOTS; i++)
+		if (hist[i])
+			last = i;
+
+	/* print only used histograms up to the last used slot */
+	if (last < 0)
+		return;
+
+	seq_printf(m, "  %s log2(us):", name);
+	for (i = 0; i <= last; i++)
+		seq_printf(m, " %llu", (unsigned long long)hist[i]);
+	seq_printf(m, "\n");
+}
+
+static int isotp_proc_show(struct seq_file *m, void *v)
+{
+	struct isotp_sock *so;
+	struct hlist_node *pos;
+
+	seq_printf(m, "inode    if  rx_id    tx_id    rx_pdus  tx_pdus  "
+		   "rx_frames tx_frames fc_wt fc_ovfl tx_ovfl "
+		   "rx_tmo tx_tmo sn_err pad_err tx_wt ana_ev ana_drop\n");
+
+	spin_lock_bh(&isotp_sockets_lock);
+	hlist_for_each(pos, &isotp_sockets) {
+		struct can_isotp_stats *st;
+
+		so = hlist_entry(pos, struct isotp_sock, proc_list);
+		st = &so->stats;
+
+		seq_printf(m, "%-8lu %-3d %08X %08X %-8llu %-8llu %-9llu "
+			   "%-9llu %-5llu %-7llu %-7llu %-6llu %-6llu "
+			   "%-6llu %-7llu %-5llu %-6llu %llu\n",
+			   sock_i_ino(&so->sk), so->ifindex,
+			   so->chan.rxid, so->chan.txid,
+			   (unsigned long long)st->rx_pdus,
+			   (unsigned long long)st->tx_pdus,
+			   (unsigned long long)st->rx_frames,
+			   (unsigned long long)st->tx_frames,
+			   (unsigned long long)st->rx_fc_wait,
+			   (unsigned long long)st->rx_fc_ovflw,
+			   (unsigned long long)st->tx_fc_ovflw,
+			   (unsigned long long)st->rx_timeouts,
+			   (unsigned long long)st->tx_timeouts,
+			   (unsigned long long)st->rx_sn_errors,
+			   (unsigned long long)st->rx_pad_errors,
+			   (unsigned long long)st->tx_fc_wait,
+			   (unsigned long long)st->ana_evicts,
+			   (unsigned long long)st->ana_drops);
+
+		isotp_proc_show_hist(m, "rx", st->rx_time_hist);
+		isotp_proc_show_hist(m, "tx", st->tx_time_hist);
+	}
+	spin_unlock_bh(&isotp_sockets_lock);
+
+	return 0;
+}
+
+static int isotp_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, isotp_proc_show, NULL);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+static const struct proc_ops isotp_proc_fops = {
+	.proc_open	= isotp_proc_open,
+	.proc_read	= seq_read,
+	.proc_lseek	= seq_lseek,
+	.proc_release	= single_release,
+};
+#else
+static const struct file_operations isotp_proc_fops = {
+	.owner		= THIS_MODULE,
+	.open		= isotp_proc_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif
+
 static int isotp_notifier(struct notifier_block *nb,
 			unsigned long msg, void *data)
 {
@@ -1319,10 +3276,10 @@ static int isotp_notifier(struct notifier_block *nb,
 	struct sock *sk = &so->sk;
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
-	if (dev_net(dev) != &init_net)
+	if (!net_eq(dev_net(dev), sock_net(sk)))
 		return NOTIFY_DONE;
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
-	if (dev->nd_net != &init_net)
+	if (dev->nd_net != sock_net(sk))
 		return NOTIFY_DONE;
 #endif
 
@@ -1338,13 +3295,26 @@ static int isotp_notifier(struct notifier_block *nb,
 		lock_sock(sk);
 		/* remove current filters & unregister */
 		if (so->bound)
-			can_rx_unregister(dev, so->rxid, SINGLE_MASK(so->rxid),
-					  isotp_rcv, sk);
+			isotp_unregister_chans(so, dev, UINT_MAX);
+
+		/* stop the tx path before releasing the netdevice */
+		hrtimer_cancel(&so->txtimer);
+#ifndef ISOTP_SOFT_HRTIMER
+		tasklet_kill(&so->txtsklet);
+#endif
+		isotp_dev_release(so);
+		if (so->tx.state != ISOTP_IDLE)
+			isotp_tx_confirm(so, ENODEV);
+		isotp_tx_state(so, ISOTP_IDLE);
 
 		so->ifindex = 0;
 		so->bound   = 0;
 		release_sock(sk);
 
+		/* drop the pdus that can not be sent anymore */
+		skb_queue_purge(&so->tx_queue);
+		wake_up_interruptible(&so->wait);
+
 		sk->sk_err = ENODEV;
 		if (!sock_flag(sk, SOCK_DEAD))
 			sk->sk_error_report(sk);
@@ -1367,6 +3337,7 @@ static int isotp_init(struct sock *sk)
 
 	so->ifindex = 0;
 	so->bound   = 0;
+	so->dev     = NULL;
 
 	so->opt.flags		= CAN_ISOTP_DEFAULT_FLAGS;
 	so->opt.ext_address	= CAN_ISOTP_DEFAULT_EXT_ADDRESS;
@@ -1380,22 +3351,49 @@ static int isotp_init(struct sock *sk)
 	so->ll.mtu		= CAN_ISOTP_DEFAULT_LL_MTU;
 	so->ll.tx_dl		= CAN_ISOTP_DEFAULT_LL_TX_DL;
 	so->ll.tx_flags		= CAN_ISOTP_DEFAULT_LL_TX_FLAGS;
+	so->tmo.n_bs		= CAN_ISOTP_DEFAULT_N_BS;
+	so->tmo.n_cr		= CAN_ISOTP_DEFAULT_N_CR;
+	so->qdisc_bypass	= 0;
+	so->route		= NULL;
+	so->tx_closed		= 0;
+	isotp_update_rcv_key(so);
+	so->rcv_func		= isotp_rcv;
+	spin_lock_init(&so->ana_lock);
 
 	/* set ll_dl for tx path to similar place as for rx */
 	so->tx.ll_dl		= so->ll.tx_dl;
 
-	so->rx.state = ISOTP_IDLE;
 	so->tx.state = ISOTP_IDLE;
 
-	hrtimer_init(&so->rxtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-	so->rxtimer.function = isotp_rx_timer_handler;
-	hrtimer_init(&so->txtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	isotp_chan_init(so, &so->chan, 0, 0);
+	so->chantab = NULL;
+
+	memset(&so->txgap, 0, sizeof(so->txgap));
+	memset(&so->stats, 0, sizeof(so->stats));
+
+	skb_queue_head_init(&so->tx_queue);
+
+	hrtimer_init(&so->txtimer, CLOCK_MONOTONIC, ISOTP_TX_HRTIMER_REL);
 	so->txtimer.function = isotp_tx_timer_handler;
 
+	hrtimer_init(&so->functimer, CLOCK_MONOTONIC, ISOTP_RX_HRTIMER_REL);
+	so->functimer.function = isotp_func_timer_handler;
+
+#ifndef ISOTP_SOFT_HRTIMER
 	tasklet_init(&so->txtsklet, isotp_tx_timer_tsklet, (unsigned long)so);
+	tasklet_init(&so->functsklet, isotp_func_timer_tsklet,
+		     (unsigned long)so);
+#endif
 
 	init_waitqueue_head(&so->wait);
 
+	so->data_ready = sk->sk_data_ready;
+	sk->sk_data_ready = isotp_data_ready;
+
+	spin_lock_bh(&isotp_sockets_lock);
+	hlist_add_head(&so->proc_list, &isotp_sockets);
+	spin_unlock_bh(&isotp_sockets_lock);
+
 	so->notifier.notifier_call = isotp_notifier;
 	register_netdevice_notifier(&so->notifier);
 
@@ -1411,7 +3409,7 @@ static const struct proto_ops isotp_ops = {
 	.socketpair    = sock_no_socketpair,
 	.accept        = sock_no_accept,
 	.getname       = isotp_getname,
-	.poll          = datagram_poll,
+	.poll          = isotp_poll,
 	.ioctl         = can_ioctl,	/* use can_ioctl() from af_can.c */
 	.listen        = sock_no_listen,
 	.shutdown      = sock_no_shutdown,
@@ -1447,14 +3445,23 @@ static __init int isotp_module_init(void)
 	printk(banner);
 
 	err = can_proto_register(&isotp_can_proto);
-	if (err < 0)
+	if (err < 0) {
 		printk(KERN_ERR "can: registration of isotp protocol failed\n");
+		return err;
+	}
 
-	return err;
+	/* create /proc/net/can-isotp statistics table */
+	proc_entry = proc_create("can-isotp", 0444, init_net.proc_net,
+				 &isotp_proc_fops);
+
+	return 0;
 }
 
 static __exit void isotp_module_exit(void)
 {
+	if (proc_entry)
+		remove_proc_entry("can-isotp", init_net.proc_net);
+
 	can_proto_unregister(&isotp_can_proto);
 }
 
@@ -0,0 +1,167 @@
+/*
+ * isotp_trace.h - tracepoints of the ISO 15765-2 CAN transport protocol
+ *
+ * The events are available in /sys/kernel/debug/tracing/events/can_isotp
+ * (ftrace, perf, trace-cmd). The 'sk' field identifies the socket, rx_id
+ * and tx_id the channel within a socket with several channels.
+ *
+ * $Id$
+ *
+ * Send feedback to <socketcan-users@lists.berlios.de>
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM can_isotp
+
+#if !defined(_ISOTP_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ISOTP_TRACE_H
+
+#include <linux/version.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
+
+#include <linux/tracepoint.h>
+
+/* a CAN frame (SF/FF/CF/FC) has been received on a channel */
+TRACE_EVENT(isotp_rx_frame,
+
+	TP_PROTO(const void *sk, canid_t can_id, const u8 *pci, u8 len),
+
+	TP_ARGS(sk, can_id, pci, len),
+
+	TP_STRUCT__entry(
+		__field(const void *,	sk)
+		__field(canid_t,	can_id)
+		__field(u8,		pci)
+		__field(u8,		len)
+	),
+
+	TP_fast_assign(
+		__entry->sk	= sk;
+		__entry->can_id	= can_id;
+		__entry->pci	= *pci;
+		__entry->len	= len;
+	),
+
+	TP_printk("sk=%p can_id=%08X pci=0x%02X len=%u",
+		  __entry->sk, __entry->can_id, __entry->pci, __entry->len)
+);
+
+/* a CF has been created for transmission */
+TRACE_EVENT(isotp_tx_cf,
+
+	TP_PROTO(const void *sk, canid_t can_id, u8 sn, u8 bs, u32 idx,
+		 u32 len),
+
+	TP_ARGS(sk, can_id, sn, bs, idx, len),
+
+	TP_STRUCT__entry(
+		__field(const void *,	sk)
+		__field(canid_t,	can_id)
+		__field(u8,		sn)
+		__field(u8,		bs)
+		__field(u32,		idx)
+		__field(u32,		len)
+	),
+
+	TP_fast_assign(
+		__entry->sk	= sk;
+		__entry->can_id	= can_id;
+		__entry->sn	= sn;
+		__entry->bs	= bs;
+		__entry->idx	= idx;
+		__entry->len	= len;
+	),
+
+	TP_printk("sk=%p can_id=%08X sn=%u bs=%u idx=%u/%u",
+		  __entry->sk, __entry->can_id, __entry->sn, __entry->bs,
+		  __entry->idx, __entry->len)
+);
+
+/* flow control frames: sent in the rx path (tx == 1), received (tx == 0) */
+TRACE_EVENT(isotp_fc,
+
+	TP_PROTO(const void *sk, int tx, canid_t can_id, u8 fs, u8 bs,
+		 u8 stmin),
+
+	TP_ARGS(sk, tx, can_id, fs, bs, stmin),
+
+	TP_STRUCT__entry(
+		__field(const void *,	sk)
+		__field(int,		tx)
+		__field(canid_t,	can_id)
+		__field(u8,		fs)
+		__field(u8,		bs)
+		__field(u8,		stmin)
+	),
+
+	TP_fast_assign(
+		__entry->sk	= sk;
+		__entry->tx	= tx;
+		__entry->can_id	= can_id;
+		__entry->fs	= fs;
+		__entry->bs	= bs;
+		__entry->stmin	= stmin;
+	),
+
+	TP_printk("sk=%p %s can_id=%08X fs=%u bs=%u stmin=0x%02X",
+		  __entry->sk, __entry->tx ? "tx" : "rx", __entry->can_id,
+		  __entry->fs, __entry->bs, __entry->stmin)
+);
+
+/* state transition of the rx path of a channel or the tx path (rx == 0) */
+TRACE_EVENT(isotp_state,
+
+	TP_PROTO(const void *sk, int rx, canid_t can_id, u32 old, u32 new,
+		 u32 idx, u32 len),
+
+	TP_ARGS(sk, rx, can_id, old, new, idx, len),
+
+	TP_STRUCT__entry(
+		__field(const void *,	sk)
+		__field(int,		rx)
+		__field(canid_t,	can_id)
+		__field(u32,		old)
+		__field(u32,		new)
+		__field(u32,		idx)
+		__field(u32,		len)
+	),
+
+	TP_fast_assign(
+		__entry->sk	= sk;
+		__entry->rx	= rx;
+		__entry->can_id	= can_id;
+		__entry->old	= old;
+		__entry->new	= new;
+		__entry->idx	= idx;
+		__entry->len	= len;
+	),
+
+	TP_printk("sk=%p %s can_id=%08X state=%s->%s idx=%u/%u",
+		  __entry->sk, __entry->rx ? "rx" : "tx", __entry->can_id,
+		  __print_symbolic(__entry->old, ISOTP_TRACE_STATES),
+		  __print_symbolic(__entry->new, ISOTP_TRACE_STATES),
+		  __entry->idx, __entry->len)
+);
+
+#else /* no tracepoints */
+
+#define trace_isotp_rx_frame(sk, can_id, pci, len) do { } while (0)
+#define trace_isotp_tx_cf(sk, can_id, sn, bs, idx, len) do { } while (0)
+#define trace_isotp_fc(sk, tx, can_id, fs, bs, stmin) do { } while (0)
+#define trace_isotp_state(sk, rx, can_id, old, new, idx, len) \
+	do { } while (0)
+
+#endif
+
+#endif /* _ISOTP_TRACE_H */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
+/* this part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE isotp_trace
+#include <trace/define_trace.h>
+#endif
@@ -46,7 +46,11 @@
 #include <linux/proc_fs.h>
 #include <linux/list.h>
 #include <linux/rcupdate.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+#include <linux/math64.h>
+#endif
 #include <socketcan/can/core.h>
+#include <socketcan/can/dev.h>
 
 #include "af_can.h"
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,25)
@@ -69,19 +73,8 @@ RCSID("$Id$");
 #define CAN_PROC_RCVLIST_SFF "rcvlist_sff"
 #define CAN_PROC_RCVLIST_EFF "rcvlist_eff"
 #define CAN_PROC_RCVLIST_ERR "rcvlist_err"
-
-static struct proc_dir_entry *can_dir;
-static struct proc_dir_entry *pde_version;
-static struct proc_dir_entry *pde_stats;
-static struct proc_dir_entry *pde_reset_stats;
-static struct proc_dir_entry *pde_rcvlist_all;
-static struct proc_dir_entry *pde_rcvlist_fil;
-static struct proc_dir_entry *pde_rcvlist_inv;
-static struct proc_dir_entry *pde_rcvlist_sff;
-static struct proc_dir_entry *pde_rcvlist_eff;
-static struct proc_dir_entry *pde_rcvlist_err;
-
-static int user_reset;
+#define CAN_PROC_RCVTIME     "rcvtime"
+#define CAN_PROC_BUSLOAD     "busload"
 
 static const char rx_list_name[][8] = {
 	[RX_ERR] = "rx_err",
@@ -91,110 +84,6 @@ static const char rx_list_name[][8] = {
 	[RX_EFF] = "rx_eff",
 };
 
-/*
- * af_can statistics stuff
- */
-
-static void can_init_stats(void)
-{
-	/*
-	 * This memset function is called from a timer context (when
-	 * can_stattimer is active which is the default) OR in a process
-	 * context (reading the proc_fs when can_stattimer is disabled).
-	 */
-	memset(&can_stats, 0, sizeof(can_stats));
-	can_stats.jiffies_init = jiffies;
-
-	can_pstats.stats_reset++;
-
-	if (user_reset) {
-		user_reset = 0;
-		can_pstats.user_reset++;
-	}
-}
-
-static unsigned long calc_rate(unsigned long oldjif, unsigned long newjif,
-			       unsigned long count)
-{
-	unsigned long rate;
-
-	if (oldjif == newjif)
-		return 0;
-
-	/* see can_stat_update() - this should NEVER happen! */
-	if (count > (ULONG_MAX / HZ)) {
-		printk(KERN_ERR "can: calc_rate: count exceeded! %ld\n",
-		       count);
-		return 99999999;
-	}
-
-	rate = (count * HZ) / (newjif - oldjif);
-
-	return rate;
-}
-
-void can_stat_update(unsigned long data)
-{
-	unsigned long j = jiffies; /* snapshot */
-
-	/* restart counting in timer context on user request */
-	if (user_reset)
-		can_init_stats();
-
-	/* restart counting on jiffies overflow */
-	if (j < can_stats.jiffies_init)
-		can_init_stats();
-
-	/* prevent overflow in calc_rate() */
-	if (can_stats.rx_frames > (ULONG_MAX / HZ))
-		can_init_stats();
-
-	/* prevent overflow in calc_rate() */
-	if (can_stats.tx_frames > (ULONG_MAX / HZ))
-		can_init_stats();
-
-	/* matches overflow - very improbable */
-	if (can_stats.matches > (ULONG_MAX / 100))
-		can_init_stats();
-
-	/* calc total values */
-	if (can_stats.rx_frames)
-		can_stats.total_rx_match_ratio = (can_stats.matches * 100) /
-			can_stats.rx_frames;
-
-	can_stats.total_tx_rate = calc_rate(can_stats.jiffies_init, j,
-					    can_stats.tx_frames);
-	can_stats.total_rx_rate = calc_rate(can_stats.jiffies_init, j,
-					    can_stats.rx_frames);
-
-	/* calc current values */
-	if (can_stats.rx_frames_delta)
-		can_stats.current_rx_match_ratio =
-			(can_stats.matches_delta * 100) /
-			can_stats.rx_frames_delta;
-
-	can_stats.current_tx_rate = calc_rate(0, HZ, can_stats.tx_frames_delta);
-	can_stats.current_rx_rate = calc_rate(0, HZ, can_stats.rx_frames_delta);
-
-	/* check / update maximum values */
-	if (can_stats.max_tx_rate < can_stats.current_tx_rate)
-		can_stats.max_tx_rate = can_stats.current_tx_rate;
-
-	if (can_stats.max_rx_rate < can_stats.current_rx_rate)
-		can_stats.max_rx_rate = can_stats.current_rx_rate;
-
-	if (can_stats.max_rx_match_ratio < can_stats.current_rx_match_ratio)
-		can_stats.max_rx_match_ratio = can_stats.current_rx_match_ratio;
-
-	/* clear values for 'current rate' calculation */
-	can_stats.tx_frames_delta = 0;
-	can_stats.rx_frames_delta = 0;
-	can_stats.matches_delta   = 0;
-
-	/* restart timer (one second) */
-	mod_timer(&can_stattimer, round_jiffies(jiffies + HZ));
-}
-
 /*
  * proc read functions
  *
@@ -204,6 +93,22 @@ void can_stat_update(unsigned long data)
  */
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+static void can_print_receiver(struct seq_file *m, struct receiver *r,
+			       struct net_device *dev)
+{
+	char *fmt = (r->can_id & CAN_EFF_FLAG)?
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,0,0)
+		"   %-5s  %08x  %08x  %p  %p  %8ld  %s\n" :
+		"   %-5s     %03x    %08x  %p  %p  %8ld  %s\n";
+#else
+		"   %-5s  %08x  %08x  %pK  %pK  %8ld  %s\n" :
+		"   %-5s     %03x    %08x  %pK  %pK  %8ld  %s\n";
+#endif
+
+	seq_printf(m, fmt, DNAME(dev), r->can_id, r->mask,
+			r->func, r->data, can_rcv_matches(r), r->ident);
+}
+
 static void can_print_rcvlist(struct seq_file *m, struct hlist_head *rx_list,
 			      struct net_device *dev)
 {
@@ -217,17 +122,21 @@ static void can_print_rcvlist(struct seq_file *m, struct hlist_head *rx_list,
 #else
 	hlist_for_each_entry_rcu(r, rx_list, list) {
 #endif
-		char *fmt = (r->can_id & CAN_EFF_FLAG)?
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3,0,0)
-			"   %-5s  %08x  %08x  %p  %p  %8ld  %s\n" :
-			"   %-5s     %03x    %08x  %p  %p  %8ld  %s\n";
-#else
-			"   %-5s  %08x  %08x  %pK  %pK  %8ld  %s\n" :
-			"   %-5s     %03x    %08x  %pK  %pK  %8ld  %s\n";
-#endif
+		can_print_receiver(m, r, dev);
+	}
+}
 
-		seq_printf(m, fmt, DNAME(dev), r->can_id, r->mask,
-				r->func, r->data, r->matches, r->ident);
+/* print the RX_EFF entries from the hash table of the device */
+static void can_print_eff_rcvlist(struct seq_file *m, struct dev_rcv_lists *d)
+{
+	struct can_eff_hash *h = rcu_dereference(d->rx_eff);
+	struct receiver *r;
+	struct hlist_node *n;
+	unsigned int i;
+
+	for (i = 0; i < (1 << h->bits); i++) {
+		can_eff_for_each_rcu(r, n, h, &h->bucket[i])
+			can_print_receiver(m, r, d->dev);
 	}
 }
 
@@ -243,57 +152,64 @@ static void can_print_recv_banner(struct seq_file *m)
 
 static int can_stats_proc_show(struct seq_file *m, void *v)
 {
+	struct can_net *cn = m->private;
+	struct s_stats st;
+	int rates;
+
+	/* the rates are computed here, there is no statistics timer */
+	rates = can_get_stats(cn, &st);
+
 	seq_putc(m, '\n');
-	seq_printf(m, " %8ld transmitted frames (TXF)\n", can_stats.tx_frames);
-	seq_printf(m, " %8ld received frames (RXF)\n", can_stats.rx_frames);
-	seq_printf(m, " %8ld matched frames (RXMF)\n", can_stats.matches);
+	seq_printf(m, " %8ld transmitted frames (TXF)\n", st.tx_frames);
+	seq_printf(m, " %8ld received frames (RXF)\n", st.rx_frames);
+	seq_printf(m, " %8ld matched frames (RXMF)\n", st.matches);
 
 	seq_putc(m, '\n');
 
-	if (can_stattimer.function == can_stat_update) {
+	if (rates) {
 		seq_printf(m, " %8ld %% total match ratio (RXMR)\n",
-				can_stats.total_rx_match_ratio);
+				st.total_rx_match_ratio);
 
 		seq_printf(m, " %8ld frames/s total tx rate (TXR)\n",
-				can_stats.total_tx_rate);
+				st.total_tx_rate);
 		seq_printf(m, " %8ld frames/s total rx rate (RXR)\n",
-				can_stats.total_rx_rate);
+				st.total_rx_rate);
 
 		seq_putc(m, '\n');
 
 		seq_printf(m, " %8ld %% current match ratio (CRXMR)\n",
-				can_stats.current_rx_match_ratio);
+				st.current_rx_match_ratio);
 
 		seq_printf(m, " %8ld frames/s current tx rate (CTXR)\n",
-				can_stats.current_tx_rate);
+				st.current_tx_rate);
 		seq_printf(m, " %8ld frames/s current rx rate (CRXR)\n",
-				can_stats.current_rx_rate);
+				st.current_rx_rate);
 
 		seq_putc(m, '\n');
 
 		seq_printf(m, " %8ld %% max match ratio (MRXMR)\n",
-				can_stats.max_rx_match_ratio);
+				st.max_rx_match_ratio);
 
 		seq_printf(m, " %8ld frames/s max tx rate (MTXR)\n",
-				can_stats.max_tx_rate);
+				st.max_tx_rate);
 		seq_printf(m, " %8ld frames/s max rx rate (MRXR)\n",
-				can_stats.max_rx_rate);
+				st.max_rx_rate);
 
 		seq_putc(m, '\n');
 	}
 
 	seq_printf(m, " %8ld current receive list entries (CRCV)\n",
-			can_pstats.rcv_entries);
+			cn->pstats.rcv_entries);
 	seq_printf(m, " %8ld maximum receive list entries (MRCV)\n",
-			can_pstats.rcv_entries_max);
+			cn->pstats.rcv_entries_max);
 
-	if (can_pstats.stats_reset)
+	if (cn->pstats.stats_reset)
 		seq_printf(m, "\n %8ld statistic resets (STR)\n",
-				can_pstats.stats_reset);
+				cn->pstats.stats_reset);
 
-	if (can_pstats.user_reset)
+	if (cn->pstats.user_reset)
 		seq_printf(m, " %8ld user statistic resets (USTR)\n",
-				can_pstats.user_reset);
+				cn->pstats.user_reset);
 
 	seq_putc(m, '\n');
 	return 0;
@@ -301,7 +217,7 @@ static int can_stats_proc_show(struct seq_file *m, void *v)
 
 static int can_stats_proc_open(struct inode *inode, struct file *file)
 {
-	return single_open(file, can_stats_proc_show, NULL);
+	return single_open(file, can_stats_proc_show, PDE(inode)->data);
 }
 
 static const struct file_operations can_stats_proc_fops = {
@@ -314,25 +230,16 @@ static const struct file_operations can_stats_proc_fops = {
 
 static int can_reset_stats_proc_show(struct seq_file *m, void *v)
 {
-	user_reset = 1;
-
-	if (can_stattimer.function == can_stat_update) {
-		seq_printf(m, "Scheduled statistic reset #%ld.\n",
-				can_pstats.stats_reset + 1);
+	struct can_net *cn = m->private;
 
-	} else {
-		if (can_stats.jiffies_init != jiffies)
-			can_init_stats();
-
-		seq_printf(m, "Performed statistic reset #%ld.\n",
-				can_pstats.stats_reset);
-	}
+	seq_printf(m, "Performed statistic reset #%ld.\n",
+			can_reset_stats(cn));
 	return 0;
 }
 
 static int can_reset_stats_proc_open(struct inode *inode, struct file *file)
 {
-	return single_open(file, can_reset_stats_proc_show, NULL);
+	return single_open(file, can_reset_stats_proc_show, PDE(inode)->data);
 }
 
 static const struct file_operations can_reset_stats_proc_fops = {
@@ -362,10 +269,106 @@ static const struct file_operations can_version_proc_fops = {
 	.release	= single_release,
 };
 
+#ifdef CAN_RCV_TIME
+/* the callback times are accounted for all network namespaces together */
+static int can_rcvtime_proc_show(struct seq_file *m, void *v)
+{
+	char ident[CAN_RCV_TIME_IDLEN];
+	struct s_rcv_time t;
+	u64 avg;
+	int slot;
+
+	if (!can_rcv_time_enabled())
+		seq_puts(m, "  (accounting disabled: set the module parameter"
+			 " rcv_time of can.ko)\n");
+
+	seq_puts(m, "  ident             calls   total [us]   avg [ns]"
+		 "   max [ns]\n");
+
+	for (slot = 0; slot < CAN_RCV_TIME_SLOTS; slot++) {
+		if (!can_get_rcv_time(slot, ident, &t))
+			continue;
+
+		avg = t.calls ? div64_u64(t.nsecs, t.calls) : 0;
+		seq_printf(m, "  %-8s %14lu %12llu %10llu %10llu\n", ident,
+			   t.calls, (unsigned long long)div_u64(t.nsecs, 1000),
+			   (unsigned long long)avg,
+			   (unsigned long long)t.max_nsecs);
+	}
+
+	seq_putc(m, '\n');
+	return 0;
+}
+
+static int can_rcvtime_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, can_rcvtime_proc_show, NULL);
+}
+
+static const struct file_operations can_rcvtime_proc_fops = {
+	.owner		= THIS_MODULE,
+	.open		= can_rcvtime_proc_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif
+
+#ifdef CAN_BUS_LOAD
+/* the devices of the "can" rtnl link type carry the counters of can-dev */
+static int can_busload_proc_show(struct seq_file *m, void *v)
+{
+	struct can_net *cn = m->private;
+	struct net_device *dev;
+	struct can_bus_load bl;
+	u64 avg;
+
+	seq_puts(m, "  device    bitrate  load [%]  frames/s     rx_frames"
+		 "     tx_frames  gap min/avg/max [us]\n");
+
+	rcu_read_lock();
+	for_each_netdev_rcu(cn->net, dev) {
+		if (!dev->rtnl_link_ops ||
+		    strcmp(dev->rtnl_link_ops->kind, "can"))
+			continue;
+
+		can_get_bus_load(dev, &bl);
+		avg = bl.gaps ? div64_u64(bl.gap_sum_ns, bl.gaps) : 0;
+
+		seq_printf(m, "  %-8s %8u %7u.%u %9u %13llu %13llu"
+			   "  %llu/%llu/%llu\n", dev->name, bl.bitrate,
+			   bl.load / 10, bl.load % 10, bl.frame_rate,
+			   (unsigned long long)bl.rx_frames,
+			   (unsigned long long)bl.tx_frames,
+			   (unsigned long long)div_u64(bl.gap_min_ns, 1000),
+			   (unsigned long long)div_u64(avg, 1000),
+			   (unsigned long long)div_u64(bl.gap_max_ns, 1000));
+	}
+	rcu_read_unlock();
+
+	seq_putc(m, '\n');
+	return 0;
+}
+
+static int can_busload_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, can_busload_proc_show, PDE(inode)->data);
+}
+
+static const struct file_operations can_busload_proc_fops = {
+	.owner		= THIS_MODULE,
+	.open		= can_busload_proc_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif
+
 static int can_rcvlist_proc_show(struct seq_file *m, void *v)
 {
-	/* double cast to prevent GCC warning */
-	int idx = (int)(long)m->private;
+	struct can_proc_rcvlist *pr = m->private;
+	struct can_net *cn = pr->cn;
+	int idx = pr->idx;
 	struct dev_rcv_lists *d;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
 	struct hlist_node *n;
@@ -375,12 +378,15 @@ static int can_rcvlist_proc_show(struct seq_file *m, void *v)
 
 	rcu_read_lock();
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-	hlist_for_each_entry_rcu(d, n, &can_rx_dev_list, list) {
+	hlist_for_each_entry_rcu(d, n, &cn->rx_dev_list, list) {
 #else
-	hlist_for_each_entry_rcu(d, &can_rx_dev_list, list) {
+	hlist_for_each_entry_rcu(d, &cn->rx_dev_list, list) {
 #endif
 
-		if (!hlist_empty(&d->rx[idx])) {
+		if (idx == RX_EFF && d->eff_entries) {
+			can_print_recv_banner(m);
+			can_print_eff_rcvlist(m, d);
+		} else if (!hlist_empty(&d->rx[idx])) {
 			can_print_recv_banner(m);
 			can_print_rcvlist(m, &d->rx[idx], d->dev);
 		} else
@@ -407,6 +413,7 @@ static const struct file_operations can_rcvlist_proc_fops = {
 
 static int can_rcvlist_sff_proc_show(struct seq_file *m, void *v)
 {
+	struct can_net *cn = m->private;
 	struct dev_rcv_lists *d;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
 	struct hlist_node *n;
@@ -417,19 +424,14 @@ static int can_rcvlist_sff_proc_show(struct seq_file *m, void *v)
 
 	rcu_read_lock();
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-	hlist_for_each_entry_rcu(d, n, &can_rx_dev_list, list) {
+	hlist_for_each_entry_rcu(d, n, &cn->rx_dev_list, list) {
 #else
-	hlist_for_each_entry_rcu(d, &can_rx_dev_list, list) {
+	hlist_for_each_entry_rcu(d, &cn->rx_dev_list, list) {
 #endif
-		int i, all_empty = 1;
-		/* check wether at least one list is non-empty */
-		for (i = 0; i < 0x800; i++)
-			if (!hlist_empty(&d->rx_sff[i])) {
-				all_empty = 0;
-				break;
-			}
+		int i;
 
-		if (!all_empty) {
+		/* skip the 0x800 lists of devices without SFF entries */
+		if (d->sff_entries) {
 			can_print_recv_banner(m);
 			for (i = 0; i < 0x800; i++) {
 				if (!hlist_empty(&d->rx_sff[i]))
@@ -447,7 +449,7 @@ static int can_rcvlist_sff_proc_show(struct seq_file *m, void *v)
 
 static int can_rcvlist_sff_proc_open(struct inode *inode, struct file *file)
 {
-	return single_open(file, can_rcvlist_sff_proc_show, NULL);
+	return single_open(file, can_rcvlist_sff_proc_show, PDE(inode)->data);
 }
 
 static const struct file_operations can_rcvlist_sff_proc_fops = {
@@ -458,6 +460,30 @@ static const struct file_operations can_rcvlist_sff_proc_fops = {
 	.release	= single_release,
 };
 #else
+static int can_print_receiver(char *page, int len, struct receiver *r,
+			      struct net_device *dev)
+{
+	char *fmt = (r->can_id & CAN_EFF_FLAG)?
+		"   %-5s  %08X  %08x  %08x  %08x  %8ld  %s\n" :
+		"   %-5s     %03X    %08x  %08lx  %08lx  %8ld  %s\n";
+
+	len += snprintf(page + len, PAGE_SIZE - len, fmt,
+			DNAME(dev), r->can_id, r->mask,
+			(unsigned long)r->func, (unsigned long)r->data,
+			can_rcv_matches(r), r->ident);
+
+	/* does a typical line fit into the current buffer? */
+
+	/* 100 Bytes before end of buffer */
+	if (len > PAGE_SIZE - 100) {
+		/* mark output cut off */
+		len += snprintf(page + len, PAGE_SIZE - len,
+				"   (..)\n");
+	}
+
+	return len;
+}
+
 static int can_print_rcvlist(char *page, int len, struct hlist_head *rx_list,
 			     struct net_device *dev)
 {
@@ -471,23 +497,27 @@ static int can_print_rcvlist(char *page, int len, struct hlist_head *rx_list,
 #else
 	hlist_for_each_entry_rcu(r, rx_list, list) {
 #endif
-		char *fmt = (r->can_id & CAN_EFF_FLAG)?
-			"   %-5s  %08X  %08x  %08x  %08x  %8ld  %s\n" :
-			"   %-5s     %03X    %08x  %08lx  %08lx  %8ld  %s\n";
+		len = can_print_receiver(page, len, r, dev);
+		if (len > PAGE_SIZE - 100)
+			break;
+	}
 
-		len += snprintf(page + len, PAGE_SIZE - len, fmt,
-				DNAME(dev), r->can_id, r->mask,
-				(unsigned long)r->func, (unsigned long)r->data,
-				r->matches, r->ident);
+	return len;
+}
 
-		/* does a typical line fit into the current buffer? */
+/* print the RX_EFF entries from the hash table of the device */
+static int can_print_eff_rcvlist(char *page, int len, struct dev_rcv_lists *d)
+{
+	struct can_eff_hash *h = rcu_dereference(d->rx_eff);
+	struct receiver *r;
+	struct hlist_node *n;
+	unsigned int i;
 
-		/* 100 Bytes before end of buffer */
-		if (len > PAGE_SIZE - 100) {
-			/* mark output cut off */
-			len += snprintf(page + len, PAGE_SIZE - len,
-					"   (..)\n");
-			break;
+	for (i = 0; i < (1 << h->bits); i++) {
+		can_eff_for_each_rcu(r, n, h, &h->bucket[i]) {
+			len = can_print_receiver(page, len, r, d->dev);
+			if (len > PAGE_SIZE - 100)
+				return len;
 		}
 	}
 
@@ -510,76 +540,82 @@ static int can_print_recv_banner(char *page, int len)
 static int can_proc_read_stats(char *page, char **start, off_t off,
 			       int count, int *eof, void *data)
 {
+	struct can_net *cn = data;
+	struct s_stats st;
 	int len = 0;
+	int rates;
+
+	/* the rates are computed here, there is no statistics timer */
+	rates = can_get_stats(cn, &st);
 
 	len += snprintf(page + len, PAGE_SIZE - len, "\n");
 	len += snprintf(page + len, PAGE_SIZE - len,
 			" %8ld transmitted frames (TXF)\n",
-			can_stats.tx_frames);
+			st.tx_frames);
 	len += snprintf(page + len, PAGE_SIZE - len,
-			" %8ld received frames (RXF)\n", can_stats.rx_frames);
+			" %8ld received frames (RXF)\n", st.rx_frames);
 	len += snprintf(page + len, PAGE_SIZE - len,
-			" %8ld matched frames (RXMF)\n", can_stats.matches);
+			" %8ld matched frames (RXMF)\n", st.matches);
 
 	len += snprintf(page + len, PAGE_SIZE - len, "\n");
 
-	if (can_stattimer.function == can_stat_update) {
+	if (rates) {
 		len += snprintf(page + len, PAGE_SIZE - len,
 				" %8ld %% total match ratio (RXMR)\n",
-				can_stats.total_rx_match_ratio);
+				st.total_rx_match_ratio);
 
 		len += snprintf(page + len, PAGE_SIZE - len,
 				" %8ld frames/s total tx rate (TXR)\n",
-				can_stats.total_tx_rate);
+				st.total_tx_rate);
 		len += snprintf(page + len, PAGE_SIZE - len,
 				" %8ld frames/s total rx rate (RXR)\n",
-				can_stats.total_rx_rate);
+				st.total_rx_rate);
 
 		len += snprintf(page + len, PAGE_SIZE - len, "\n");
 
 		len += snprintf(page + len, PAGE_SIZE - len,
 				" %8ld %% current match ratio (CRXMR)\n",
-				can_stats.current_rx_match_ratio);
+				st.current_rx_match_ratio);
 
 		len += snprintf(page + len, PAGE_SIZE - len,
 				" %8ld frames/s current tx rate (CTXR)\n",
-				can_stats.current_tx_rate);
+				st.current_tx_rate);
 		len += snprintf(page + len, PAGE_SIZE - len,
 				" %8ld frames/s current rx rate (CRXR)\n",
-				can_stats.current_rx_rate);
+				st.current_rx_rate);
 
 		len += snprintf(page + len, PAGE_SIZE - len, "\n");
 
 		len += snprintf(page + len, PAGE_SIZE - len,
 				" %8ld %% max match ratio (MRXMR)\n",
-				can_stats.max_rx_match_ratio);
+				st.max_rx_match_ratio);
 
 		len += snprintf(page + len, PAGE_SIZE - len,
 				" %8ld frames/s max tx rate (MTXR)\n",
-				can_stats.max_tx_rate);
+				st.max_tx_rate);
 		len += snprintf(page + len, PAGE_SIZE - len,
 				" %8ld frames/s max rx rate (MRXR)\n",
-				can_stats.max_rx_rate);
+				st.max_rx_rate);
 
 		len += snprintf(page + len, PAGE_SIZE - len, "\n");
 	}
 
 	len += snprintf(page + len, PAGE_SIZE - len,
 			" %8ld current receive list entries (CRCV)\n",
-			can_pstats.rcv_entries);
+			cn->pstats.rcv_entries);
 	len += snprintf(page + len, PAGE_SIZE - len,
 			" %8ld maximum receive list entries (MRCV)\n",
-			can_pstats.rcv_entries_max);
+			cn->pstats.rcv_entries_max);
 
-	if (can_pstats.stats_reset)
+	if (cn->pstats.stats_reset)
 		len += snprintf(page + len, PAGE_SIZE - len,
 				"\n %8ld statistic resets (STR)\n",
-				can_pstats.stats_reset);
+				cn->pstats.stats_reset);
 
-	if (can_pstats.user_reset)
+	if (cn->pstats.user_reset)
 		len += snprintf(page + len, PAGE_SIZE - len,
 				" %8ld user statistic resets (USTR)\n",
-				can_pstats.user_reset);
+				cn->pstats.user_reset);
 
 	len += snprintf(page + len, PAGE_SIZE - len, "\n");
 
@@ -590,23 +626,12 @@ static int can_proc_read_stats(char *page, char **start, off_t off,
 static int can_proc_read_reset_stats(char *page, char **start, off_t off,
 				     int count, int *eof, void *data)
 {
+	struct can_net *cn = data;
 	int len = 0;
 
-	user_reset = 1;
-
-	if (can_stattimer.function == can_stat_update) {
-		len += snprintf(page + len, PAGE_SIZE - len,
-				"Scheduled statistic reset #%ld.\n",
-				can_pstats.stats_reset + 1);
-
-	} else {
-		if (can_stats.jiffies_init != jiffies)
-			can_init_stats();
-
-		len += snprintf(page + len, PAGE_SIZE - len,
-				"Performed statistic reset #%ld.\n",
-				can_pstats.stats_reset);
-	}
+	len += snprintf(page + len, PAGE_SIZE - len,
+			"Performed statistic reset #%ld.\n",
+			can_reset_stats(cn));
 
 	*eof = 1;
 	return len;
@@ -626,8 +651,9 @@ static int can_proc_read_version(char *page, char **start, off_t off,
 static int can_proc_read_rcvlist(char *page, char **start, off_t off,
 				 int count, int *eof, void *data)
 {
-	/* double cast to prevent GCC warning */
-	int idx = (int)(long)data;
+	struct can_proc_rcvlist *pr = data;
+	struct can_net *cn = pr->cn;
+	int idx = pr->idx;
 	int len = 0;
 	struct dev_rcv_lists *d;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
@@ -639,12 +665,15 @@ static int can_proc_read_rcvlist(char *page, char **start, off_t off,
 
 	rcu_read_lock();
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-	hlist_for_each_entry_rcu(d, n, &can_rx_dev_list, list) {
+	hlist_for_each_entry_rcu(d, n, &cn->rx_dev_list, list) {
 #else
-	hlist_for_each_entry_rcu(d, &can_rx_dev_list, list) {
+	hlist_for_each_entry_rcu(d, &cn->rx_dev_list, list) {
 #endif
 
-		if (!hlist_empty(&d->rx[idx])) {
+		if (idx == RX_EFF && d->eff_entries) {
+			len = can_print_recv_banner(page, len);
+			len = can_print_eff_rcvlist(page, len, d);
+		} else if (!hlist_empty(&d->rx[idx])) {
 			len = can_print_recv_banner(page, len);
 			len = can_print_rcvlist(page, len, &d->rx[idx], d->dev);
 		} else
@@ -666,6 +695,7 @@ static int can_proc_read_rcvlist(char *page, char **start, off_t off,
 static int can_proc_read_rcvlist_sff(char *page, char **start, off_t off,
 				     int count, int *eof, void *data)
 {
+	struct can_net *cn = data;
 	int len = 0;
 	struct dev_rcv_lists *d;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
@@ -678,19 +708,14 @@ static int can_proc_read_rcvlist_sff(char *page, char **start, off_t off,
 
 	rcu_read_lock();
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-	hlist_for_each_entry_rcu(d, n, &can_rx_dev_list, list) {
+	hlist_for_each_entry_rcu(d, n, &cn->rx_dev_list, list) {
 #else
-	hlist_for_each_entry_rcu(d, &can_rx_dev_list, list) {
+	hlist_for_each_entry_rcu(d, &cn->rx_dev_list, list) {
 #endif
-		int i, all_empty = 1;
-		/* check wether at least one list is non-empty */
-		for (i = 0; i < 0x800; i++)
-			if (!hlist_empty(&d->rx_sff[i])) {
-				all_empty = 0;
-				break;
-			}
+		int i;
 
-		if (!all_empty) {
+		/* skip the 0x800 lists of devices without SFF entries */
+		if (d->sff_entries) {
 			len = can_print_recv_banner(page, len);
 			for (i = 0; i < 0x800; i++) {
 				if (!hlist_empty(&d->rx_sff[i]) &&
@@ -721,123 +746,179 @@ static int can_proc_read_rcvlist_sff(char *page, char **start, off_t off,
  */
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
-static struct proc_dir_entry *can_create_proc_readentry(const char *name,
+static struct proc_dir_entry *can_create_proc_readentry(struct can_net *cn,
+							const char *name,
 							mode_t mode,
 							read_proc_t *read_proc,
 							void *data)
 {
-	if (can_dir)
-		return create_proc_read_entry(name, mode, can_dir, read_proc,
-					      data);
+	if (cn->proc_dir)
+		return create_proc_read_entry(name, mode, cn->proc_dir,
+					      read_proc, data);
 	else
 		return NULL;
 }
 #endif
 
-static void can_remove_proc_readentry(const char *name)
+static void can_remove_proc_readentry(struct can_net *cn, const char *name)
 {
-	if (can_dir)
-		remove_proc_entry(name, can_dir);
+	if (cn->proc_dir)
+		remove_proc_entry(name, cn->proc_dir);
 }
 
 /*
  * can_init_proc - create main CAN proc directory and procfs entries
  */
-void can_init_proc(void)
+void can_init_proc(struct can_net *cn)
 {
+	int idx;
+
+	for (idx = 0; idx < RX_MAX; idx++) {
+		cn->proc_rcvlist[idx].cn = cn;
+		cn->proc_rcvlist[idx].idx = idx;
+	}
+
 	/* create /proc/net/can directory */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
-	can_dir = proc_mkdir("can", init_net.proc_net);
+#ifdef CAN_NETNS
+	cn->proc_dir = proc_mkdir("can", cn->net->proc_net);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+	cn->proc_dir = proc_mkdir("can", init_net.proc_net);
 #else
-	can_dir = proc_mkdir("can", proc_net);
+	cn->proc_dir = proc_mkdir("can", proc_net);
 #endif
 
-	if (!can_dir) {
+	if (!cn->proc_dir) {
 		printk(KERN_INFO "can: failed to create /proc/net/can . "
 		       "CONFIG_PROC_FS missing?\n");
 		return;
 	}
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,30)
-	can_dir->owner = THIS_MODULE;
+	cn->proc_dir->owner = THIS_MODULE;
 #endif
 
 	/* own procfs entries from the AF_CAN core */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
-	pde_version     = proc_create(CAN_PROC_VERSION, 0644, can_dir,
-				      &can_version_proc_fops);
-	pde_stats       = proc_create(CAN_PROC_STATS, 0644, can_dir,
-				      &can_stats_proc_fops);
-	pde_reset_stats = proc_create(CAN_PROC_RESET_STATS, 0644, can_dir,
-				      &can_reset_stats_proc_fops);
-	pde_rcvlist_err = proc_create_data(CAN_PROC_RCVLIST_ERR, 0644, can_dir,
-					   &can_rcvlist_proc_fops, (void *)RX_ERR);
-	pde_rcvlist_all = proc_create_data(CAN_PROC_RCVLIST_ALL, 0644, can_dir,
-					   &can_rcvlist_proc_fops, (void *)RX_ALL);
-	pde_rcvlist_fil = proc_create_data(CAN_PROC_RCVLIST_FIL, 0644, can_dir,
-					   &can_rcvlist_proc_fops, (void *)RX_FIL);
-	pde_rcvlist_inv = proc_create_data(CAN_PROC_RCVLIST_INV, 0644, can_dir,
-					   &can_rcvlist_proc_fops, (void *)RX_INV);
-	pde_rcvlist_eff = proc_create_data(CAN_PROC_RCVLIST_EFF, 0644, can_dir,
-					   &can_rcvlist_proc_fops, (void *)RX_EFF);
-	pde_rcvlist_sff = proc_create(CAN_PROC_RCVLIST_SFF, 0644, can_dir,
-				      &can_rcvlist_sff_proc_fops);
+	cn->pde_version     = proc_create(CAN_PROC_VERSION, 0644, cn->proc_dir,
+					  &can_version_proc_fops);
+	cn->pde_stats       = proc_create_data(CAN_PROC_STATS, 0644,
+					       cn->proc_dir,
+					       &can_stats_proc_fops, cn);
+	cn->pde_reset_stats = proc_create_data(CAN_PROC_RESET_STATS, 0644,
+					       cn->proc_dir,
+					       &can_reset_stats_proc_fops, cn);
+	cn->pde_rcvlist_err = proc_create_data(CAN_PROC_RCVLIST_ERR, 0644,
+					       cn->proc_dir,
+					       &can_rcvlist_proc_fops,
+					       &cn->proc_rcvlist[RX_ERR]);
+	cn->pde_rcvlist_all = proc_create_data(CAN_PROC_RCVLIST_ALL, 0644,
+					       cn->proc_dir,
+					       &can_rcvlist_proc_fops,
+					       &cn->proc_rcvlist[RX_ALL]);
+	cn->pde_rcvlist_fil = proc_create_data(CAN_PROC_RCVLIST_FIL, 0644,
+					       cn->proc_dir,
+					       &can_rcvlist_proc_fops,
+					       &cn->proc_rcvlist[RX_FIL]);
+	cn->pde_rcvlist_inv = proc_create_data(CAN_PROC_RCVLIST_INV, 0644,
+					       cn->proc_dir,
+					       &can_rcvlist_proc_fops,
+					       &cn->proc_rcvlist[RX_INV]);
+	cn->pde_rcvlist_eff = proc_create_data(CAN_PROC_RCVLIST_EFF, 0644,
+					       cn->proc_dir,
+					       &can_rcvlist_proc_fops,
+					       &cn->proc_rcvlist[RX_EFF]);
+	cn->pde_rcvlist_sff = proc_create_data(CAN_PROC_RCVLIST_SFF, 0644,
+					       cn->proc_dir,
+					       &can_rcvlist_sff_proc_fops, cn);
+#ifdef CAN_RCV_TIME
+	cn->pde_rcvtime     = proc_create(CAN_PROC_RCVTIME, 0644, cn->proc_dir,
+					  &can_rcvtime_proc_fops);
+#endif
+#ifdef CAN_BUS_LOAD
+	cn->pde_busload     = proc_create_data(CAN_PROC_BUSLOAD, 0644,
+					       cn->proc_dir,
+					       &can_busload_proc_fops, cn);
+#endif
 #else
-	pde_version     = can_create_proc_readentry(CAN_PROC_VERSION, 0644,
-					can_proc_read_version, NULL);
-	pde_stats       = can_create_proc_readentry(CAN_PROC_STATS, 0644,
-					can_proc_read_stats, NULL);
-	pde_reset_stats = can_create_proc_readentry(CAN_PROC_RESET_STATS, 0644,
-					can_proc_read_reset_stats, NULL);
-	pde_rcvlist_err = can_create_proc_readentry(CAN_PROC_RCVLIST_ERR, 0644,
-					can_proc_read_rcvlist, (void *)RX_ERR);
-	pde_rcvlist_all = can_create_proc_readentry(CAN_PROC_RCVLIST_ALL, 0644,
-					can_proc_read_rcvlist, (void *)RX_ALL);
-	pde_rcvlist_fil = can_create_proc_readentry(CAN_PROC_RCVLIST_FIL, 0644,
-					can_proc_read_rcvlist, (void *)RX_FIL);
-	pde_rcvlist_inv = can_create_proc_readentry(CAN_PROC_RCVLIST_INV, 0644,
-					can_proc_read_rcvlist, (void *)RX_INV);
-	pde_rcvlist_eff = can_create_proc_readentry(CAN_PROC_RCVLIST_EFF, 0644,
-					can_proc_read_rcvlist, (void *)RX_EFF);
-	pde_rcvlist_sff = can_create_proc_readentry(CAN_PROC_RCVLIST_SFF, 0644,
-					can_proc_read_rcvlist_sff, NULL);
+	cn->pde_version     = can_create_proc_readentry(cn, CAN_PROC_VERSION,
+					0644, can_proc_read_version, NULL);
+	cn->pde_stats       = can_create_proc_readentry(cn, CAN_PROC_STATS,
+					0644, can_proc_read_stats, cn);
+	cn->pde_reset_stats = can_create_proc_readentry(cn,
+					CAN_PROC_RESET_STATS, 0644,
+					can_proc_read_reset_stats, cn);
+	cn->pde_rcvlist_err = can_create_proc_readentry(cn,
+					CAN_PROC_RCVLIST_ERR, 0644,
+					can_proc_read_rcvlist,
+					&cn->proc_rcvlist[RX_ERR]);
+	cn->pde_rcvlist_all = can_create_proc_readentry(cn,
+					CAN_PROC_RCVLIST_ALL, 0644,
+					can_proc_read_rcvlist,
+					&cn->proc_rcvlist[RX_ALL]);
+	cn->pde_rcvlist_fil = can_create_proc_readentry(cn,
+					CAN_PROC_RCVLIST_FIL, 0644,
+					can_proc_read_rcvlist,
+					&cn->proc_rcvlist[RX_FIL]);
+	cn->pde_rcvlist_inv = can_create_proc_readentry(cn,
+					CAN_PROC_RCVLIST_INV, 0644,
+					can_proc_read_rcvlist,
+					&cn->proc_rcvlist[RX_INV]);
+	cn->pde_rcvlist_eff = can_create_proc_readentry(cn,
+					CAN_PROC_RCVLIST_EFF, 0644,
+					can_proc_read_rcvlist,
+					&cn->proc_rcvlist[RX_EFF]);
+	cn->pde_rcvlist_sff = can_create_proc_readentry(cn,
+					CAN_PROC_RCVLIST_SFF, 0644,
+					can_proc_read_rcvlist_sff, cn);
 #endif
 }
 
 /*
  * can_remove_proc - remove procfs entries and main CAN proc directory
  */
-void can_remove_proc(void)
+void can_remove_proc(struct can_net *cn)
 {
-	if (pde_version)
-		can_remove_proc_readentry(CAN_PROC_VERSION);
+	if (cn->pde_version)
+		can_remove_proc_readentry(cn, CAN_PROC_VERSION);
 
-	if (pde_stats)
-		can_remove_proc_readentry(CAN_PROC_STATS);
+	if (cn->pde_stats)
+		can_remove_proc_readentry(cn, CAN_PROC_STATS);
 
-	if (pde_reset_stats)
-		can_remove_proc_readentry(CAN_PROC_RESET_STATS);
+	if (cn->pde_reset_stats)
+		can_remove_proc_readentry(cn, CAN_PROC_RESET_STATS);
 
-	if (pde_rcvlist_err)
-		can_remove_proc_readentry(CAN_PROC_RCVLIST_ERR);
+	if (cn->pde_rcvlist_err)
+		can_remove_proc_readentry(cn, CAN_PROC_RCVLIST_ERR);
 
-	if (pde_rcvlist_all)
-		can_remove_proc_readentry(CAN_PROC_RCVLIST_ALL);
+	if (cn->pde_rcvlist_all)
+		can_remove_proc_readentry(cn, CAN_PROC_RCVLIST_ALL);
 
-	if (pde_rcvlist_fil)
-		can_remove_proc_readentry(CAN_PROC_RCVLIST_FIL);
+	if (cn->pde_rcvlist_fil)
+		can_remove_proc_readentry(cn, CAN_PROC_RCVLIST_FIL);
 
-	if (pde_rcvlist_inv)
-		can_remove_proc_readentry(CAN_PROC_RCVLIST_INV);
+	if (cn->pde_rcvlist_inv)
+		can_remove_proc_readentry(cn, CAN_PROC_RCVLIST_INV);
 
-	if (pde_rcvlist_eff)
-		can_remove_proc_readentry(CAN_PROC_RCVLIST_EFF);
+	if (cn->pde_rcvlist_eff)
+		can_remove_proc_readentry(cn, CAN_PROC_RCVLIST_EFF);
 
-	if (pde_rcvlist_sff)
-		can_remove_proc_readentry(CAN_PROC_RCVLIST_SFF);
+	if (cn->pde_rcvlist_sff)
+		can_remove_proc_readentry(cn, CAN_PROC_RCVLIST_SFF);
+
+#ifdef CAN_RCV_TIME
+	if (cn->pde_rcvtime)
+		can_remove_proc_readentry(cn, CAN_PROC_RCVTIME);
+#endif
+
+#ifdef CAN_BUS_LOAD
+	if (cn->pde_busload)
+		can_remove_proc_readentry(cn, CAN_PROC_BUSLOAD);
+#endif
 
-	if (can_dir)
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+	if (cn->proc_dir)
+#ifdef CAN_NETNS
+		remove_proc_entry("can", cn->net->proc_net);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
 		remove_proc_entry("can", init_net.proc_net);
 #else
 		proc_net_remove("can");
@@ -50,6 +50,12 @@
 #include <linux/socket.h>
 #include <linux/if_arp.h>
 #include <linux/skbuff.h>
+#include <linux/poll.h>
+#include <linux/vmalloc.h>
+#include <linux/errqueue.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/jhash.h>
 #include <socketcan/can.h>
 #include <socketcan/can/core.h>
 #include <socketcan/can/raw.h>
@@ -57,7 +63,10 @@
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
 #include <net/net_namespace.h>
 #endif
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,25)
+#ifdef CAN_BUSY_POLL
+#include <net/busy_poll.h>
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
 #include "compat.h"
 #endif
 
@@ -75,6 +84,55 @@ MODULE_ALIAS("can-proto-1");
 
 #define MASK_ALL 0
 
+/* /proc/net/can-raw lists the receive queue state of the raw sockets */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+#define CAN_RAW_PROC
+#define CAN_RAW_PROCNAME "can-raw"
+static LIST_HEAD(raw_sockets);
+static DEFINE_SPINLOCK(raw_sockets_lock);
+#endif
+
+/* vmalloc_user() and remap_vmalloc_range() are needed for the rx ring */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18)
+#define CAN_RAW_RING
+#define RAW_RING_MAX_FRAMES (1 << 16)
+
+struct raw_ring {
+	struct can_raw_ring_slot *slot;
+	unsigned int frame_nr;
+	unsigned int head;  /* next slot to be filled */
+	unsigned long size; /* page aligned size of the mapping */
+	spinlock_t lock;
+};
+#endif
+
+/*
+ * A fanout group registers one set of receivers for all its members and
+ * raw_fanout_rcv() hands each frame to a single member socket. The member
+ * array is changed under raw_fanout_mutex and read locklessly in the rx
+ * path. The group is freed with its last member.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+#define CAN_RAW_FANOUT_GROUPS
+
+struct raw_fanout {
+	struct list_head list;
+	struct net *net;
+	int ifindex;
+	u16 id;
+	u16 type;
+	struct can_filter *filter; /* copy of the first member's filters */
+	int count;
+	can_err_mask_t err_mask;
+	atomic_t rr;
+	unsigned int num;
+	struct sock *arr[CAN_RAW_FANOUT_MAX];
+};
+
+static LIST_HEAD(raw_fanouts);
+static DEFINE_MUTEX(raw_fanout_mutex);
+#endif
+
 /*
  * A raw socket has a list of can_filters attached to it, each receiving
  * the CAN frames matching that filter.  If the filter list is empty,
@@ -83,6 +141,8 @@ MODULE_ALIAS("can-proto-1");
  * The filter list is allocated dynamically with the exception of the
  * list containing only one item.  This common case is optimized by
  * storing the single filter in dfilter, to avoid using dynamic memory.
+ * The space of a replaced filter list is kept in spare for the next
+ * CAN_RAW_FILTER setsockopt() that fits into it.
  */
 
 struct raw_sock {
@@ -96,10 +156,29 @@ struct raw_sock {
 	struct notifier_block notifier;
 	int loopback;
 	int recv_own_msgs;
+	int qdisc_bypass;
 	int count;                 /* number of active filters */
 	struct can_filter dfilter; /* default/single filter */
 	struct can_filter *filter; /* pointer to filter(s) */
+	int filter_max;            /* space of dynamic filter (count > 1) */
+	struct can_filter *spare;  /* unused filter space */
+	int spare_max;
 	can_err_mask_t err_mask;
+	atomic_t drops;            /* rx frames lost on a full queue/ring */
+#ifdef CAN_RAW_FANOUT_GROUPS
+	struct raw_fanout *fanout;
+#endif
+#ifdef CAN_RAW_PROC
+	struct list_head list;     /* raw_sockets */
+#endif
+#ifdef CAN_RAW_RING
+	struct raw_ring *rx_ring;  /* set before bind() => not locked */
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0)
+	void (*data_ready)(struct sock *sk);
+#else
+	void (*data_ready)(struct sock *sk, int bytes);
+#endif
 };
 
 /*
@@ -125,22 +204,57 @@ static inline struct raw_sock *raw_sk(const struct sock *sk)
 #endif
 }
 
-static void raw_rcv(struct sk_buff *oskb, void *data)
+static void raw_wakeup(struct sock *sk)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0)
+	raw_sk(sk)->data_ready(sk);
+#else
+	raw_sk(sk)->data_ready(sk, 0);
+#endif
+}
+
+/* wake up the reader once per rx batch of the CAN core */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0)
+static void raw_data_ready(struct sock *sk)
+#else
+static void raw_data_ready(struct sock *sk, int bytes)
+#endif
+{
+	if (!can_rx_defer_wakeup(sk, raw_wakeup))
+		raw_wakeup(sk);
+}
+
+/*
+ * The socket filter runs once per frame. The CAN core runs it before the
+ * clone (CAN_RX_SK_FILTER) when the skb can be queued without a second run
+ * (__sock_queue_rcv_skb() 4.10+). Otherwise it only runs in
+ * sock_queue_rcv_skb().
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+#define RAW_RCV_SK_FILTER	CAN_RX_SK_FILTER
+#else
+#define RAW_RCV_SK_FILTER	0
+#endif
+
+/*
+ * Enqueue or free the private skb of a raw_rcv() or raw_fanout_rcv() call.
+ * sk_filtered tells that the socket filter of sk already accepted it.
+ */
+static void raw_queue(struct sk_buff *skb, struct sock *sk, int sk_filtered)
 {
-	struct sock *sk = (struct sock *)data;
 	struct raw_sock *ro = raw_sk(sk);
+	struct sock *srcsk = skb->sk;
 	struct sockaddr_can *addr;
-	struct sk_buff *skb;
 	unsigned int *pflags;
+	int err;
 
-	/* check the received tx sock reference */
-	if (!ro->recv_own_msgs && oskb->sk == sk)
-		return;
+	/* CAN_RAW sockets only deal with classic CAN frames */
+	if (skb->len != CAN_MTU)
+		goto drop;
 
-	/* clone the given skb to be able to enqueue it into the rcv queue */
-	skb = skb_clone(oskb, GFP_ATOMIC);
-	if (!skb)
-		return;
+	/* check the received tx sock reference */
+	if (!ro->recv_own_msgs && srcsk == sk)
+		goto drop;
 
 	/*
 	 *  Put the datagram to the queue so that raw_recvmsg() can
@@ -158,36 +272,259 @@ static void raw_rcv(struct sk_buff *oskb, void *data)
 	/* add CAN specific message flags for raw_recvmsg() */
 	pflags = raw_flags(skb);
 	*pflags = 0;
-	if (oskb->sk)
+	if (srcsk)
 		*pflags |= MSG_DONTROUTE;
-	if (oskb->sk == sk)
+	if (srcsk == sk)
 		*pflags |= MSG_CONFIRM;
 
-	if (sock_queue_rcv_skb(sk, skb) < 0)
+	/* the originating sock is no owner of this skb */
+	skb->sk = NULL;
+
+#ifdef CAN_BUSY_POLL
+	sk_mark_napi_id(sk, skb);
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	if (sk_filtered)
+		err = __sock_queue_rcv_skb(sk, skb);
+	else
+#endif
+		err = sock_queue_rcv_skb(sk, skb);
+	if (err < 0) {
+		atomic_inc(&ro->drops);
 		kfree_skb(skb);
+	}
+	return;
+
+drop:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+	consume_skb(skb);
+#else
+	kfree_skb(skb);
+#endif
+}
+
+/*
+ * raw_rcv() is registered with CAN_RX_OWN_SKB: the CAN core hands out a
+ * private skb, which is either enqueued or freed here.
+ */
+static void raw_rcv(struct sk_buff *skb, void *data)
+{
+	raw_queue(skb, (struct sock *)data, RAW_RCV_SK_FILTER);
+}
+
+#ifdef CAN_RAW_RING
+/* receive timestamp of skb in ns (CLOCK_REALTIME), now without one */
+static u64 raw_ring_tstamp(const struct sk_buff *skb)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+	s64 ns = ktime_to_ns(skb->tstamp);
+
+	return ns ? ns : ktime_to_ns(ktime_get_real());
+#else
+	struct timeval tv;
+
+	skb_get_timestamp(skb, &tv);
+	if (!tv.tv_sec)
+		do_gettimeofday(&tv);
+
+	return (u64)tv.tv_sec * NSEC_PER_SEC + tv.tv_usec * NSEC_PER_USEC;
+#endif
+}
+
+/*
+ * raw_rcv_ring() is registered for sockets with a rx ring. It copies the
+ * frame into the next ring slot and does not need an own skb.
+ */
+static void raw_rcv_ring(struct sk_buff *skb, void *data)
+{
+	struct sock *sk = (struct sock *)data;
+	struct raw_sock *ro = raw_sk(sk);
+	struct raw_ring *ring = ro->rx_ring;
+	struct can_raw_ring_slot *slot;
+	u64 tstamp;
+
+	if (skb->len != CAN_MTU)
+		return;
+
+	if (!ro->recv_own_msgs && skb->sk == sk)
+		return;
+
+#ifdef CAN_BUSY_POLL
+	/* poll() on the ring busy polls with SO_BUSY_POLL */
+	sk_mark_napi_id(sk, skb);
+#endif
+
+	tstamp = raw_ring_tstamp(skb);
+
+	spin_lock(&ring->lock);
+
+	slot = &ring->slot[ring->head];
+	if (slot->status != CAN_RAW_SLOT_KERNEL) {
+		spin_unlock(&ring->lock);
+		atomic_inc(&ro->drops);
+		return;
+	}
+
+	memcpy(&slot->frame, skb->data, sizeof(slot->frame));
+	slot->ifindex = skb->dev->ifindex;
+	slot->tstamp  = tstamp;
+	slot->flags   = 0;
+	if (skb->sk)
+		slot->flags |= MSG_DONTROUTE;
+	if (skb->sk == sk)
+		slot->flags |= MSG_CONFIRM;
+
+	/* the frame content has to be visible before the status */
+	smp_wmb();
+	slot->status = CAN_RAW_SLOT_USER;
+
+	if (++ring->head == ring->frame_nr)
+		ring->head = 0;
+
+	spin_unlock(&ring->lock);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0)
+	sk->sk_data_ready(sk);
+#else
+	sk->sk_data_ready(sk, 0);
+#endif
+}
+
+static struct raw_ring *raw_alloc_ring(unsigned int frame_nr)
+{
+	struct raw_ring *ring;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return NULL;
+
+	ring->size = PAGE_ALIGN(frame_nr * sizeof(struct can_raw_ring_slot));
+
+	/* zeroed memory => all slots have CAN_RAW_SLOT_KERNEL status */
+	ring->slot = vmalloc_user(ring->size);
+	if (!ring->slot) {
+		kfree(ring);
+		return NULL;
+	}
+
+	ring->frame_nr = frame_nr;
+	spin_lock_init(&ring->lock);
+
+	return ring;
+}
+
+static void raw_free_ring(struct raw_ring *ring)
+{
+	vfree(ring->slot);
+	kfree(ring);
+}
+
+static int raw_mmap(struct file *file, struct socket *sock,
+		    struct vm_area_struct *vma)
+{
+	struct raw_ring *ring = raw_sk(sock->sk)->rx_ring;
+
+	if (!ring)
+		return -EINVAL;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != ring->size)
+		return -EINVAL;
+
+	/* the ring lives until the socket is released */
+	return remap_vmalloc_range(vma, ring->slot, 0);
+}
+
+static unsigned int raw_poll(struct file *file, struct socket *sock,
+			     poll_table *wait)
+{
+	struct raw_ring *ring = raw_sk(sock->sk)->rx_ring;
+	unsigned int mask = datagram_poll(file, sock, wait);
+	unsigned int last;
+
+	if (ring) {
+		spin_lock_bh(&ring->lock);
+		last = ring->head ? ring->head - 1 : ring->frame_nr - 1;
+		if (ring->slot[last].status != CAN_RAW_SLOT_KERNEL)
+			mask |= POLLIN | POLLRDNORM;
+		spin_unlock_bh(&ring->lock);
+	}
+
+	return mask;
+}
+#endif
+
+/* sockets with a rx ring use raw_rcv_ring() without an own skb */
+static inline void (*raw_rcv_func(struct raw_sock *ro))(struct sk_buff *,
+							 void *)
+{
+#ifdef CAN_RAW_RING
+	if (ro->rx_ring)
+		return raw_rcv_ring;
+#endif
+	return raw_rcv;
+}
+
+/* the socket filter of a ring socket is only run by the CAN core */
+static inline unsigned int raw_rcv_flags(struct raw_sock *ro)
+{
+#ifdef CAN_RAW_RING
+	if (ro->rx_ring)
+		return CAN_RX_SK_FILTER;
+#endif
+	return CAN_RX_OWN_SKB | RAW_RCV_SK_FILTER;
 }
 
 static int raw_enable_filters(struct net_device *dev, struct sock *sk,
 			      struct can_filter *filter, int count)
 {
-	int err = 0;
-	int i;
-
-	for (i = 0; i < count; i++) {
-		err = can_rx_register(dev, filter[i].can_id,
-				      filter[i].can_mask,
-				      raw_rcv, sk, "raw");
-		if (err) {
-			/* clean up successfully registered filters */
-			while (--i >= 0)
-				can_rx_unregister(dev, filter[i].can_id,
-						  filter[i].can_mask,
-						  raw_rcv, sk);
-			break;
-		}
+	struct raw_sock *ro = raw_sk(sk);
+
+	return can_rx_register_bulk(sock_net(sk), dev, filter, count,
+				    raw_rcv_func(ro), sk, "raw",
+				    raw_rcv_flags(ro));
+}
+
+/* swap the current filters for new ones without a reception gap */
+static int raw_replace_filters(struct net_device *dev, struct sock *sk,
+			       struct can_filter *filter, int count)
+{
+	struct raw_sock *ro = raw_sk(sk);
+
+	return can_rx_replace_bulk(sock_net(sk), dev, ro->filter, ro->count,
+				   filter, count, raw_rcv_func(ro), sk, "raw",
+				   raw_rcv_flags(ro));
+}
+
+/* get space for count > 1 filters - preferably the spare filter space */
+static struct can_filter *raw_get_filter_space(struct raw_sock *ro,
+					       int count, int *max)
+{
+	struct can_filter *filter = ro->spare;
+
+	if (filter && ro->spare_max >= count) {
+		*max = ro->spare_max;
+		ro->spare = NULL;
+		ro->spare_max = 0;
+		return filter;
 	}
 
-	return err;
+	*max = count;
+	return kmalloc(count * sizeof(*filter), GFP_KERNEL);
+}
+
+/* keep unused filter space for reuse (the bigger one wins) */
+static void raw_put_filter_space(struct raw_sock *ro,
+				 struct can_filter *filter, int max)
+{
+	if (ro->spare && ro->spare_max >= max) {
+		kfree(filter);
+		return;
+	}
+
+	kfree(ro->spare);
+	ro->spare = filter;
+	ro->spare_max = max;
 }
 
 static int raw_enable_errfilter(struct net_device *dev, struct sock *sk,
@@ -196,8 +533,10 @@ static int raw_enable_errfilter(struct net_device *dev, struct sock *sk,
 	int err = 0;
 
 	if (err_mask)
-		err = can_rx_register(dev, 0, err_mask | CAN_ERR_FLAG,
-				      raw_rcv, sk, "raw");
+		err = can_rx_register_flags(sock_net(sk), dev, 0,
+					    err_mask | CAN_ERR_FLAG,
+					    raw_rcv_func(raw_sk(sk)), sk, "raw",
+					    raw_rcv_flags(raw_sk(sk)));
 
 	return err;
 }
@@ -205,11 +544,8 @@ static int raw_enable_errfilter(struct net_device *dev, struct sock *sk,
 static void raw_disable_filters(struct net_device *dev, struct sock *sk,
 			      struct can_filter *filter, int count)
 {
-	int i;
-
-	for (i = 0; i < count; i++)
-		can_rx_unregister(dev, filter[i].can_id, filter[i].can_mask,
-				  raw_rcv, sk);
+	can_rx_unregister_bulk(sock_net(sk), dev, filter, count,
+			       raw_rcv_func(raw_sk(sk)), sk);
 }
 
 static inline void raw_disable_errfilter(struct net_device *dev,
@@ -218,15 +554,245 @@ static inline void raw_disable_errfilter(struct net_device *dev,
 
 {
 	if (err_mask)
-		can_rx_unregister(dev, 0, err_mask | CAN_ERR_FLAG,
-				  raw_rcv, sk);
+		can_rx_unregister(sock_net(sk), dev, 0, err_mask | CAN_ERR_FLAG,
+				  raw_rcv_func(raw_sk(sk)), sk);
+}
+
+#ifdef CAN_RAW_FANOUT_GROUPS
+static void raw_fanout_rcv(struct sk_buff *skb, void *data)
+{
+	struct raw_fanout *f = (struct raw_fanout *)data;
+	const struct can_frame *cf = (struct can_frame *)skb->data;
+	unsigned int num = READ_ONCE(f->num);
+	unsigned int idx;
+	struct sock *sk;
+
+	if (!num)
+		goto drop;
+
+	/* the same CAN ID always hits the same member */
+	if (f->type == CAN_RAW_FANOUT_HASH)
+		idx = ((u64)jhash_1word(cf->can_id, 0) * num) >> 32;
+	else
+		idx = (unsigned int)atomic_inc_return(&f->rr) % num;
+
+	/* NULL while the last member of the array is leaving */
+	sk = READ_ONCE(f->arr[idx]);
+	if (!sk)
+		goto drop;
+
+	/* the filter of the member socket has not run yet */
+	raw_queue(skb, sk, 0);
+	return;
+
+drop:
+	kfree_skb(skb);
+}
+
+static int raw_fanout_register(struct net_device *dev, struct raw_fanout *f)
+{
+	int err = 0;
+
+	if (f->count)
+		err = can_rx_register_bulk(f->net, dev, f->filter, f->count,
+					   raw_fanout_rcv, f, "raw",
+					   CAN_RX_OWN_SKB);
+
+	if (!err && f->err_mask) {
+		err = can_rx_register_flags(f->net, dev, 0,
+					    f->err_mask | CAN_ERR_FLAG,
+					    raw_fanout_rcv, f, "raw",
+					    CAN_RX_OWN_SKB);
+		if (err && f->count)
+			can_rx_unregister_bulk(f->net, dev, f->filter,
+					       f->count, raw_fanout_rcv, f);
+	}
+
+	return err;
+}
+
+static void raw_fanout_unregister(struct net_device *dev,
+				  struct raw_fanout *f)
+{
+	if (f->count)
+		can_rx_unregister_bulk(f->net, dev, f->filter, f->count,
+				       raw_fanout_rcv, f);
+	if (f->err_mask)
+		can_rx_unregister(f->net, dev, 0, f->err_mask | CAN_ERR_FLAG,
+				  raw_fanout_rcv, f);
+}
+
+/* create a fanout group with the filters of its first member */
+static struct raw_fanout *raw_fanout_create(struct net_device *dev,
+					    struct sock *sk, u16 id, u16 type)
+{
+	struct raw_sock *ro = raw_sk(sk);
+	struct raw_fanout *f;
+	int err;
+
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (!f)
+		return ERR_PTR(-ENOMEM);
+
+	if (ro->count) {
+		f->filter = kmemdup(ro->filter,
+				    ro->count * sizeof(struct can_filter),
+				    GFP_KERNEL);
+		if (!f->filter) {
+			kfree(f);
+			return ERR_PTR(-ENOMEM);
+		}
+	}
+
+	f->net = sock_net(sk);
+	f->ifindex = ro->ifindex;
+	f->id = id;
+	f->type = type;
+	f->count = ro->count;
+	f->err_mask = ro->err_mask;
+	atomic_set(&f->rr, 0);
+
+	err = raw_fanout_register(dev, f);
+	if (err) {
+		kfree(f->filter);
+		kfree(f);
+		return ERR_PTR(err);
+	}
+
+	list_add(&f->list, &raw_fanouts);
+
+	return f;
+}
+
+static void raw_disable_allfilters(struct net_device *dev, struct sock *sk);
+
+/*
+ * raw_fanout_add - join the bound socket to a fanout group
+ *
+ * The own receivers of the socket are removed: its frames arrive via the
+ * receivers of the group from now on.
+ */
+static int raw_fanout_add(struct sock *sk, int val)
+{
+	struct raw_sock *ro = raw_sk(sk);
+	struct net_device *dev = NULL;
+	struct raw_fanout *f;
+	u16 id = val & 0xFFFF;
+	u16 type = val >> 16;
+	int err = 0;
+
+	if (type > CAN_RAW_FANOUT_LB || !ro->bound)
+		return -EINVAL;
+
+	if (ro->fanout)
+		return -EALREADY;
+
+#ifdef CAN_RAW_RING
+	if (ro->rx_ring)
+		return -EINVAL;
+#endif
+
+	if (ro->ifindex) {
+		dev = dev_get_by_index(sock_net(sk), ro->ifindex);
+		if (!dev)
+			return -ENODEV;
+	}
+
+	mutex_lock(&raw_fanout_mutex);
+
+	list_for_each_entry(f, &raw_fanouts, list) {
+		if (f->id == id && f->ifindex == ro->ifindex &&
+		    net_eq(f->net, sock_net(sk)))
+			break;
+	}
+
+	if (&f->list == &raw_fanouts) {
+		f = raw_fanout_create(dev, sk, id, type);
+		if (IS_ERR(f)) {
+			err = PTR_ERR(f);
+			goto out;
+		}
+	} else if (f->type != type) {
+		err = -EINVAL;
+		goto out;
+	} else if (f->num == CAN_RAW_FANOUT_MAX) {
+		err = -ENOSPC;
+		goto out;
+	}
+
+	raw_disable_allfilters(dev, sk);
+
+	f->arr[f->num] = sk;
+	smp_wmb();
+	f->num++;
+	ro->fanout = f;
+
+ out:
+	mutex_unlock(&raw_fanout_mutex);
+
+	if (dev)
+		dev_put(dev);
+
+	return err;
+}
+
+/*
+ * raw_fanout_leave - remove a socket from its fanout group
+ *
+ * The receivers of the group are removed with its last member. Without a
+ * device for a bound ifindex the device is gone together with them.
+ */
+static void raw_fanout_leave(struct net_device *dev, struct sock *sk)
+{
+	struct raw_sock *ro = raw_sk(sk);
+	struct raw_fanout *f = ro->fanout;
+	unsigned int i;
+
+	mutex_lock(&raw_fanout_mutex);
+
+	for (i = 0; i < f->num - 1; i++) {
+		if (f->arr[i] == sk)
+			break;
+	}
+
+	/* move the last member into the gap */
+	f->arr[i] = f->arr[f->num - 1];
+	f->arr[f->num - 1] = NULL;
+	smp_wmb();
+	f->num--;
+
+	if (!f->num) {
+		list_del(&f->list);
+		if (dev || !f->ifindex)
+			raw_fanout_unregister(dev, f);
+	} else
+		f = NULL;
+
+	mutex_unlock(&raw_fanout_mutex);
+
+	ro->fanout = NULL;
+
+	/* wait for raw_fanout_rcv() calls on other CPUs */
+	synchronize_rcu();
+
+	if (f) {
+		kfree(f->filter);
+		kfree(f);
+	}
 }
+#endif
 
-static inline void raw_disable_allfilters(struct net_device *dev,
-					  struct sock *sk)
+static void raw_disable_allfilters(struct net_device *dev, struct sock *sk)
 {
 	struct raw_sock *ro = raw_sk(sk);
 
+#ifdef CAN_RAW_FANOUT_GROUPS
+	if (ro->fanout) {
+		raw_fanout_leave(dev, sk);
+		return;
+	}
+#endif
+
 	raw_disable_filters(dev, sk, ro->filter, ro->count);
 	raw_disable_errfilter(dev, sk, ro->err_mask);
 }
@@ -258,10 +824,10 @@ static int raw_notifier(struct notifier_block *nb,
 #endif
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
-	if (!net_eq(dev_net(dev), &init_net))
+	if (!net_eq(dev_net(dev), sock_net(sk)))
 		return NOTIFY_DONE;
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
-	if (dev->nd_net != &init_net)
+	if (dev->nd_net != sock_net(sk))
 		return NOTIFY_DONE;
 #endif
 
@@ -317,16 +883,37 @@ static int raw_init(struct sock *sk)
 	ro->dfilter.can_mask = MASK_ALL;
 	ro->filter           = &ro->dfilter;
 	ro->count            = 1;
+	ro->filter_max       = 0;
+	ro->spare            = NULL;
+	ro->spare_max        = 0;
+	atomic_set(&ro->drops, 0);
+#ifdef CAN_RAW_FANOUT_GROUPS
+	ro->fanout           = NULL;
+#endif
 
 	/* set default loopback behaviour */
 	ro->loopback         = 1;
 	ro->recv_own_msgs    = 0;
+	ro->qdisc_bypass     = 0;
+
+#ifdef CAN_RAW_RING
+	ro->rx_ring          = NULL;
+#endif
+
+	ro->data_ready = sk->sk_data_ready;
+	sk->sk_data_ready = raw_data_ready;
 
 	/* set notifier */
 	ro->notifier.notifier_call = raw_notifier;
 
 	register_netdevice_notifier(&ro->notifier);
 
+#ifdef CAN_RAW_PROC
+	spin_lock(&raw_sockets_lock);
+	list_add_tail(&ro->list, &raw_sockets);
+	spin_unlock(&raw_sockets_lock);
+#endif
+
 	return 0;
 }
 
@@ -342,6 +929,12 @@ static int raw_release(struct socket *sock)
 
 	unregister_netdevice_notifier(&ro->notifier);
 
+#ifdef CAN_RAW_PROC
+	spin_lock(&raw_sockets_lock);
+	list_del(&ro->list);
+	spin_unlock(&raw_sockets_lock);
+#endif
+
 	lock_sock(sk);
 
 	/* remove current filters & unregister */
@@ -349,7 +942,7 @@ static int raw_release(struct socket *sock)
 		if (ro->ifindex) {
 			struct net_device *dev;
 
-			dev = dev_get_by_index(&init_net, ro->ifindex);
+			dev = dev_get_by_index(sock_net(sk), ro->ifindex);
 			if (dev) {
 				raw_disable_allfilters(dev, sk);
 				dev_put(dev);
@@ -358,13 +951,30 @@ static int raw_release(struct socket *sock)
 			raw_disable_allfilters(NULL, sk);
 	}
 
+#ifdef CAN_RAW_FANOUT_GROUPS
+	/* the bound device has just vanished */
+	if (ro->fanout)
+		raw_fanout_leave(NULL, sk);
+#endif
+
 	if (ro->count > 1)
 		kfree(ro->filter);
+	kfree(ro->spare);
+	ro->spare = NULL;
 
 	ro->ifindex = 0;
 	ro->bound   = 0;
 	ro->count   = 0;
 
+#ifdef CAN_RAW_RING
+	if (ro->rx_ring) {
+		/* wait for raw_rcv_ring() calls on other CPUs */
+		synchronize_rcu();
+		raw_free_ring(ro->rx_ring);
+		ro->rx_ring = NULL;
+	}
+#endif
+
 	sock_orphan(sk);
 	sock->sk = NULL;
 
@@ -391,10 +1001,18 @@ static int raw_bind(struct socket *sock, struct sockaddr *uaddr, int len)
 	if (ro->bound && addr->can_ifindex == ro->ifindex)
 		goto out;
 
+#ifdef CAN_RAW_FANOUT_GROUPS
+	/* the receivers of the group are bound to the interface */
+	if (ro->fanout) {
+		err = -EBUSY;
+		goto out;
+	}
+#endif
+
 	if (addr->can_ifindex) {
 		struct net_device *dev;
 
-		dev = dev_get_by_index(&init_net, addr->can_ifindex);
+		dev = dev_get_by_index(sock_net(sk), addr->can_ifindex);
 		if (!dev) {
 			err = -ENODEV;
 			goto out;
@@ -425,7 +1043,8 @@ static int raw_bind(struct socket *sock, struct sockaddr *uaddr, int len)
 			if (ro->ifindex) {
 				struct net_device *dev;
 
-				dev = dev_get_by_index(&init_net, ro->ifindex);
+				dev = dev_get_by_index(sock_net(sk),
+						       ro->ifindex);
 				if (dev) {
 					raw_disable_allfilters(dev, sk);
 					dev_put(dev);
@@ -481,8 +1100,16 @@ static int raw_setsockopt(struct socket *sock, int level, int optname,
 	struct can_filter sfilter;         /* single filter */
 	struct net_device *dev = NULL;
 	can_err_mask_t err_mask = 0;
+#ifdef CAN_RAW_RING
+	struct can_raw_ring_req req;
+	struct raw_ring *ring;
+#endif
 	int count = 0;
+	int max = 0;
 	int err = 0;
+#ifdef CAN_RAW_FANOUT_GROUPS
+	int val;
+#endif
 
 	if (level != SOL_CAN_RAW)
 		return -EINVAL;
@@ -497,46 +1124,53 @@ static int raw_setsockopt(struct socket *sock, int level, int optname,
 
 		count = optlen / sizeof(struct can_filter);
 
-		if (count > 1) {
-			/* filter does not fit into dfilter => alloc space */
-			filter = kmalloc(optlen, GFP_KERNEL);
-			if (!filter)
-				return -ENOMEM;
-
-			if (copy_from_user(filter, optval, optlen)) {
-				kfree(filter);
-				return -EFAULT;
-			}
-		} else if (count == 1) {
+		if (count == 1) {
 			if (copy_from_user(&sfilter, optval, sizeof(sfilter)))
 				return -EFAULT;
 		}
 
 		lock_sock(sk);
 
+#ifdef CAN_RAW_FANOUT_GROUPS
+		/* the filters of a group are those of its first member */
+		if (ro->fanout) {
+			err = -EBUSY;
+			goto out_fil;
+		}
+#endif
+
+		if (count > 1) {
+			/* filter does not fit into dfilter => get space */
+			filter = raw_get_filter_space(ro, count, &max);
+			if (!filter) {
+				err = -ENOMEM;
+				goto out_fil;
+			}
+
+			if (copy_from_user(filter, optval, optlen)) {
+				raw_put_filter_space(ro, filter, max);
+				err = -EFAULT;
+				goto out_fil;
+			}
+		} else if (count == 1)
+			filter = &sfilter;
+
 		if (ro->bound && ro->ifindex)
-			dev = dev_get_by_index(&init_net, ro->ifindex);
+			dev = dev_get_by_index(sock_net(sk), ro->ifindex);
 
 		if (ro->bound) {
-			/* (try to) register the new filters */
-			if (count == 1)
-				err = raw_enable_filters(dev, sk, &sfilter, 1);
-			else
-				err = raw_enable_filters(dev, sk, filter,
-							 count);
+			/* swap the old filter registrations for the new ones */
+			err = raw_replace_filters(dev, sk, filter, count);
 			if (err) {
 				if (count > 1)
-					kfree(filter);
+					raw_put_filter_space(ro, filter, max);
 				goto out_fil;
 			}
-
-			/* remove old filter registrations */
-			raw_disable_filters(dev, sk, ro->filter, ro->count);
 		}
 
-		/* remove old filter space */
+		/* keep old filter space */
 		if (ro->count > 1)
-			kfree(ro->filter);
+			raw_put_filter_space(ro, ro->filter, ro->filter_max);
 
 		/* link new filters to the socket */
 		if (count == 1) {
@@ -546,6 +1180,7 @@ static int raw_setsockopt(struct socket *sock, int level, int optname,
 		}
 		ro->filter = filter;
 		ro->count  = count;
+		ro->filter_max = max;
 
  out_fil:
 		if (dev)
@@ -566,8 +1201,15 @@ static int raw_setsockopt(struct socket *sock, int level, int optname,
 
 		lock_sock(sk);
 
+#ifdef CAN_RAW_FANOUT_GROUPS
+		if (ro->fanout) {
+			err = -EBUSY;
+			goto out_err;
+		}
+#endif
+
 		if (ro->bound && ro->ifindex)
-			dev = dev_get_by_index(&init_net, ro->ifindex);
+			dev = dev_get_by_index(sock_net(sk), ro->ifindex);
 
 		/* remove current error mask */
 		if (ro->bound) {
@@ -610,6 +1252,65 @@ static int raw_setsockopt(struct socket *sock, int level, int optname,
 
 		break;
 
+#ifdef CAN_QDISC_BYPASS
+	case CAN_RAW_QDISC_BYPASS:
+		if (optlen != sizeof(ro->qdisc_bypass))
+			return -EINVAL;
+
+		if (copy_from_user(&ro->qdisc_bypass, optval, optlen))
+			return -EFAULT;
+
+		break;
+#endif
+
+#ifdef CAN_RAW_RING
+	case CAN_RAW_RX_RING:
+		/* never an int: the value of a CAN_RAW_FD_FRAMES probe */
+		if (optlen != sizeof(req))
+			return -EINVAL;
+
+		if (copy_from_user(&req, optval, optlen))
+			return -EFAULT;
+
+		if (req.flags || !req.frame_nr ||
+		    req.frame_nr > RAW_RING_MAX_FRAMES)
+			return -EINVAL;
+
+		ring = raw_alloc_ring(req.frame_nr);
+		if (!ring)
+			return -ENOMEM;
+
+		lock_sock(sk);
+
+		/* the receive function is fixed once filters are registered */
+		if (ro->bound || ro->rx_ring)
+			err = -EBUSY;
+		else
+			ro->rx_ring = ring;
+
+		release_sock(sk);
+
+		if (err)
+			raw_free_ring(ring);
+
+		break;
+#endif
+
+#ifdef CAN_RAW_FANOUT_GROUPS
+	case CAN_RAW_FANOUT:
+		if (optlen != sizeof(val))
+			return -EINVAL;
+
+		if (copy_from_user(&val, optval, optlen))
+			return -EFAULT;
+
+		lock_sock(sk);
+		err = raw_fanout_add(sk, val);
+		release_sock(sk);
+
+		break;
+#endif
+
 	default:
 		return -ENOPROTOOPT;
 	}
@@ -621,6 +1322,10 @@ static int raw_getsockopt(struct socket *sock, int level, int optname,
 {
 	struct sock *sk = sock->sk;
 	struct raw_sock *ro = raw_sk(sk);
+	__u32 drops;
+#ifdef CAN_RAW_FANOUT_GROUPS
+	int fanout;
+#endif
 	int len;
 	void *val;
 	int err = 0;
@@ -668,6 +1373,35 @@ static int raw_getsockopt(struct socket *sock, int level, int optname,
 		val = &ro->recv_own_msgs;
 		break;
 
+#ifdef CAN_QDISC_BYPASS
+	case CAN_RAW_QDISC_BYPASS:
+		if (len > sizeof(int))
+			len = sizeof(int);
+		val = &ro->qdisc_bypass;
+		break;
+#endif
+
+	case CAN_RAW_RX_DROPS:
+		drops = atomic_read(&ro->drops);
+		if (len > sizeof(drops))
+			len = sizeof(drops);
+		val = &drops;
+		break;
+
+#ifdef CAN_RAW_FANOUT_GROUPS
+	case CAN_RAW_FANOUT:
+		lock_sock(sk);
+		fanout = 0;
+		if (ro->fanout)
+			fanout = ro->fanout->id | ro->fanout->type << 16;
+		release_sock(sk);
+
+		if (len > sizeof(int))
+			len = sizeof(int);
+		val = &fanout;
+		break;
+#endif
+
 	default:
 		return -ENOPROTOOPT;
 	}
@@ -679,13 +1413,18 @@ static int raw_getsockopt(struct socket *sock, int level, int optname,
 	return 0;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0)
+static int raw_sendmsg(struct socket *sock, struct msghdr *msg, size_t size)
+#else
 static int raw_sendmsg(struct kiocb *iocb, struct socket *sock,
 		       struct msghdr *msg, size_t size)
+#endif
 {
 	struct sock *sk = sock->sk;
 	struct raw_sock *ro = raw_sk(sk);
 	struct sk_buff *skb;
 	struct net_device *dev;
+	size_t sent = 0;
 	int ifindex;
 	int err;
 
@@ -703,52 +1442,134 @@ static int raw_sendmsg(struct kiocb *iocb, struct socket *sock,
 	} else
 		ifindex = ro->ifindex;
 
-	if (size != sizeof(struct can_frame))
+	/* a sendmsg() may carry an array of CAN frames */
+	if (!size || size % sizeof(struct can_frame))
 		return -EINVAL;
 
-	dev = dev_get_by_index(&init_net, ifindex);
+	dev = dev_get_by_index(sock_net(sk), ifindex);
 	if (!dev)
 		return -ENXIO;
 
-	skb = sock_alloc_send_skb(sk, size, msg->msg_flags & MSG_DONTWAIT,
-				  &err);
-	if (!skb)
-		goto put_dev;
+	while (sent < size) {
+		skb = sock_alloc_send_skb(sk, sizeof(struct can_frame),
+					  msg->msg_flags & MSG_DONTWAIT, &err);
+		if (!skb)
+			break;
 
-	err = memcpy_fromiovec(skb_put(skb, size), msg->msg_iov, size);
-	if (err < 0)
-		goto free_skb;
-	skb->dev = dev;
-	skb->sk  = sk;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0)
+		err = memcpy_from_msg(skb_put(skb, sizeof(struct can_frame)),
+				      msg, sizeof(struct can_frame));
+#else
+		err = memcpy_fromiovec(skb_put(skb, sizeof(struct can_frame)),
+				       msg->msg_iov, sizeof(struct can_frame));
+#endif
+		if (err < 0) {
+			kfree_skb(skb);
+			break;
+		}
+		skb->dev = dev;
+		skb->sk  = sk;
+		/* SO_TIMESTAMPING tx timestamp requests of the socket */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,7,0)
+		sock_tx_timestamp(sk, sk->sk_tsflags,
+				  &skb_shinfo(skb)->tx_flags);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+		sock_tx_timestamp(sk, &skb_shinfo(skb)->tx_flags);
+#endif
+
+#ifdef CAN_QDISC_BYPASS
+		if (ro->qdisc_bypass)
+			err = can_send_bypass(skb, ro->loopback);
+		else
+#endif
+			err = can_send(skb, ro->loopback);
+		if (err)
+			break;
 
-	err = can_send(skb, ro->loopback);
+		sent += sizeof(struct can_frame);
+	}
 
 	dev_put(dev);
 
-	if (err)
-		goto send_failed;
+	/*
+	 * Report the already sent frames e.g. on -ENOBUFS from a full tx
+	 * queue. The caller can resume with the remaining frames.
+	 */
+	if (sent)
+		return sent;
 
-	return size;
+	return err;
+}
 
-free_skb:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+/*
+ * Deliver a tx timestamp from the error queue. The data is the sent CAN
+ * frame, the timestamps are given in the usual SCM_TIMESTAMPING cmsg.
+ */
+static int raw_recv_errqueue(struct sock *sk, struct msghdr *msg, size_t size)
+{
+	struct sock_exterr_skb *serr;
+	struct sk_buff *skb;
+	int err;
+
+	skb = skb_dequeue(&sk->sk_error_queue);
+	if (!skb)
+		return -EAGAIN;
+
+	if (size < skb->len)
+		msg->msg_flags |= MSG_TRUNC;
+	else
+		size = skb->len;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0)
+	err = memcpy_to_msg(msg, skb->data, size);
+#else
+	err = memcpy_toiovec(msg->msg_iov, skb->data, size);
+#endif
+	if (err < 0)
+		goto out;
+
+	sock_recv_timestamp(msg, sk, skb);
+
+	serr = SKB_EXT_ERR(skb);
+	put_cmsg(msg, SOL_CAN_RAW, SCM_CAN_RAW_ERRQUEUE, sizeof(serr->ee),
+		 &serr->ee);
+
+	msg->msg_flags |= MSG_ERRQUEUE;
+	err = size;
+
+ out:
 	kfree_skb(skb);
-put_dev:
-	dev_put(dev);
-send_failed:
 	return err;
 }
+#endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0)
+static int raw_recvmsg(struct socket *sock, struct msghdr *msg, size_t size,
+		       int flags)
+#else
 static int raw_recvmsg(struct kiocb *iocb, struct socket *sock,
 		       struct msghdr *msg, size_t size, int flags)
+#endif
 {
 	struct sock *sk = sock->sk;
 	struct sk_buff *skb;
 	int err = 0;
 	int noblock;
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+	if (flags & MSG_ERRQUEUE)
+		return raw_recv_errqueue(sk, msg, size);
+#endif
+
 	noblock =  flags & MSG_DONTWAIT;
 	flags   &= ~MSG_DONTWAIT;
 
+#ifdef CAN_BUSY_POLL
+	if (sk_can_busy_loop(sk) && skb_queue_empty(&sk->sk_receive_queue))
+		sk_busy_loop(sk, noblock);
+#endif
+
 	skb = skb_recv_datagram(sk, flags, noblock, &err);
 	if (!skb)
 		return err;
@@ -758,13 +1579,22 @@ static int raw_recvmsg(struct kiocb *iocb, struct socket *sock,
 	else
 		size = skb->len;
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0)
+	err = memcpy_to_msg(msg, skb->data, size);
+#else
 	err = memcpy_toiovec(msg->msg_iov, skb->data, size);
+#endif
 	if (err < 0) {
 		skb_free_datagram(sk, skb);
 		return err;
 	}
 
+	/* SO_RXQ_OVFL reports the drops before this skb as ancillary data */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33)
+	sock_recv_ts_and_drops(msg, sk, skb);
+#else
 	sock_recv_timestamp(msg, sk, skb);
+#endif
 
 	if (msg->msg_name) {
 		msg->msg_namelen = sizeof(struct sockaddr_can);
@@ -779,6 +1609,69 @@ static int raw_recvmsg(struct kiocb *iocb, struct socket *sock,
 	return size;
 }
 
+#ifdef CAN_RAW_PROC
+static int raw_proc_show(struct seq_file *m, void *v)
+{
+	struct net *net = m->private;
+	struct raw_sock *ro;
+	struct sock *sk;
+
+	seq_printf(m, "%-8s %-5s %-7s %-8s %-8s %-6s %s\n", "inode",
+		   "if", "filters", "rmem", "rcvbuf", "queued", "drops");
+
+	spin_lock(&raw_sockets_lock);
+
+	list_for_each_entry(ro, &raw_sockets, list) {
+		sk = &ro->sk;
+		if (!net_eq(sock_net(sk), net))
+			continue;
+
+		seq_printf(m, "%-8lu %-5d %-7d %-8d %-8d %-6u %d\n",
+			   sock_i_ino(sk), ro->ifindex, ro->count,
+			   atomic_read(&sk->sk_rmem_alloc), sk->sk_rcvbuf,
+			   skb_queue_len(&sk->sk_receive_queue),
+			   atomic_read(&ro->drops));
+	}
+
+	spin_unlock(&raw_sockets_lock);
+
+	return 0;
+}
+
+static int raw_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, raw_proc_show, PDE(inode)->data);
+}
+
+static const struct file_operations raw_proc_fops = {
+	.owner		= THIS_MODULE,
+	.open		= raw_proc_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* each network namespace shows its own sockets */
+static int __net_init raw_pernet_init(struct net *net)
+{
+	/* the socket queue statistics are optional */
+	proc_create_data(CAN_RAW_PROCNAME, 0444, net->proc_net,
+			 &raw_proc_fops, net);
+
+	return 0;
+}
+
+static void __net_exit raw_pernet_exit(struct net *net)
+{
+	remove_proc_entry(CAN_RAW_PROCNAME, net->proc_net);
+}
+
+static struct pernet_operations raw_pernet_ops __read_mostly = {
+	.init = raw_pernet_init,
+	.exit = raw_pernet_exit,
+};
+#endif
+
 static const struct proto_ops raw_ops = {
 	.family        = PF_CAN,
 	.release       = raw_release,
@@ -787,7 +1680,11 @@ static const struct proto_ops raw_ops = {
 	.socketpair    = sock_no_socketpair,
 	.accept        = sock_no_accept,
 	.getname       = raw_getname,
+#ifdef CAN_RAW_RING
+	.poll          = raw_poll,
+#else
 	.poll          = datagram_poll,
+#endif
 	.ioctl         = can_ioctl,	/* use can_ioctl() from af_can.c */
 	.listen        = sock_no_listen,
 	.shutdown      = sock_no_shutdown,
@@ -795,7 +1692,11 @@ static const struct proto_ops raw_ops = {
 	.getsockopt    = raw_getsockopt,
 	.sendmsg       = raw_sendmsg,
 	.recvmsg       = raw_recvmsg,
+#ifdef CAN_RAW_RING
+	.mmap          = raw_mmap,
+#else
 	.mmap          = sock_no_mmap,
+#endif
 	.sendpage      = sock_no_sendpage,
 };
 
@@ -848,14 +1749,27 @@ static __init int raw_module_init(void)
 	printk(banner);
 
 	err = can_proto_register(&raw_can_proto);
-	if (err < 0)
+	if (err < 0) {
 		printk(KERN_ERR "can: registration of raw protocol failed\n");
+		return err;
+	}
 
-	return err;
+#ifdef CAN_RAW_PROC
+	err = register_pernet_subsys(&raw_pernet_ops);
+	if (err < 0) {
+		can_proto_unregister(&raw_can_proto);
+		return err;
+	}
+#endif
+
+	return 0;
 }
 
 static __exit void raw_module_exit(void)
 {
+#ifdef CAN_RAW_PROC
+	unregister_pernet_subsys(&raw_pernet_ops);
+#endif
 	can_proto_unregister(&raw_can_proto);
 }
 
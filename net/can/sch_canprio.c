@@ -0,0 +1,282 @@
+/*
+ * sch_canprio.c - CAN identifier priority queueing discipline
+ *
+ * The host tx queue in front of a CAN driver is FIFO while the CAN bus
+ * arbitrates by identifier. This qdisc dequeues the frames in the order
+ * of the bus arbitration (lowest CAN identifier first) so that a burst of
+ * low priority frames (e.g. ISO-TP consecutive frames) does not delay a
+ * high priority frame by the whole length of the queue. Frames with the
+ * same identifier keep their order.
+ *
+ * Drivers with several tx mailboxes (at91_can, mscan, mcp251x) take the
+ * next frames from the qdisc as soon as a mailbox is free. So a high
+ * priority frame waits at most for the frames that are already in the
+ * mailboxes and the controller arbitrates the rest.
+ *
+ * Usage: tc qdisc add dev can0 root canprio
+ *
+ * The queue limit defaults to the tx_queue_len of the interface. It can
+ * be passed as struct tc_fifo_qopt, like for pfifo.
+ *
+ * Copyright (c) 2011 Volkswagen Group Electronic Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Volkswagen nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * Alternatively, provided that this notice is retained in full, this
+ * software may be distributed under the terms of the GNU General
+ * Public License ("GPL") version 2, in which case the provisions of the
+ * GPL apply INSTEAD OF those given above.
+ *
+ * The provided data structures and external interfaces from this code
+ * are not restricted to be used by modules with a GPL compatible license.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * Send feedback to <socketcan-users@lists.berlios.de>
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/init.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/skbuff.h>
+#include <linux/netdevice.h>
+#include <net/pkt_sched.h>
+#include <socketcan/can.h>
+
+#include <socketcan/can/version.h> /* for RCSID. Removed by mkpatch script */
+RCSID("$Id$");
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,29)
+#error This code only supports Kernel versions 2.6.29+ (qdisc peek)
+#endif
+
+MODULE_DESCRIPTION("CAN identifier priority queueing discipline");
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_AUTHOR("Oliver Hartkopp <oliver.hartkopp@volkswagen.de>");
+
+/*
+ * The frames are kept in a private sk_buff_head, because the list helpers
+ * of the qdisc core changed: Qdisc::q is a singly linked qdisc_skb_head
+ * since 4.9. Only sch->q.qlen is updated for the qdisc core.
+ */
+struct canprio_sched_data {
+	u32 limit;
+	struct sk_buff_head queue;
+};
+
+/*
+ * canprio_key - arbitration key of a CAN frame (lower key wins)
+ *
+ * The bits are ordered like on the bus: base identifier, RTR (SFF) or SRR
+ * (EFF, always recessive), IDE, extended identifier and RTR (EFF).
+ */
+static inline u32 canprio_key(const struct sk_buff *skb)
+{
+	canid_t id = ((struct can_frame *)skb->data)->can_id;
+	u32 rtr = (id & CAN_RTR_FLAG) ? 1 : 0;
+
+	if (id & CAN_EFF_FLAG)
+		return ((id & CAN_EFF_MASK) >> 18) << 21 | 3 << 19 |
+			(id & 0x3FFFF) << 1 | rtr;
+
+	return (id & CAN_SFF_MASK) << 21 | rtr << 20;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
+static int canprio_enqueue(struct sk_buff *skb, struct Qdisc *sch,
+			   struct sk_buff **to_free)
+#else
+static int canprio_enqueue(struct sk_buff *skb, struct Qdisc *sch)
+#endif
+{
+	struct canprio_sched_data *q = qdisc_priv(sch);
+	u32 key = canprio_key(skb);
+	struct sk_buff *p;
+
+	if (unlikely(skb_queue_len(&q->queue) >= q->limit))
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
+		return qdisc_drop(skb, sch, to_free);
+#else
+		return qdisc_drop(skb, sch);
+#endif
+
+	/*
+	 * Insert behind the last frame that wins the arbitration against
+	 * this frame or has the same identifier. The queue is short (the
+	 * tx_queue_len of CAN interfaces is 10 by default) and new frames
+	 * mostly end up at the tail.
+	 */
+	skb_queue_reverse_walk(&q->queue, p) {
+		if (canprio_key(p) <= key)
+			break;
+	}
+
+	/* p is the queue head itself when the frame wins against all */
+	__skb_queue_after(&q->queue, p, skb);
+	sch->qstats.backlog += qdisc_pkt_len(skb);
+	sch->q.qlen++;
+
+	return NET_XMIT_SUCCESS;
+}
+
+static struct sk_buff *canprio_dequeue(struct Qdisc *sch)
+{
+	struct canprio_sched_data *q = qdisc_priv(sch);
+	struct sk_buff *skb = __skb_dequeue(&q->queue);
+
+	if (!skb)
+		return NULL;
+
+	sch->qstats.backlog -= qdisc_pkt_len(skb);
+	sch->q.qlen--;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+	qdisc_bstats_update(sch, skb);
+#else
+	sch->bstats.bytes += qdisc_pkt_len(skb);
+	sch->bstats.packets++;
+#endif
+
+	return skb;
+}
+
+static struct sk_buff *canprio_peek(struct Qdisc *sch)
+{
+	struct canprio_sched_data *q = qdisc_priv(sch);
+
+	return skb_peek(&q->queue);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,8,0)
+/* the tail holds the frame with the lowest priority */
+static unsigned int canprio_drop(struct Qdisc *sch)
+{
+	struct canprio_sched_data *q = qdisc_priv(sch);
+	struct sk_buff *skb = __skb_dequeue_tail(&q->queue);
+	unsigned int len;
+
+	if (!skb)
+		return 0;
+
+	len = qdisc_pkt_len(skb);
+	sch->qstats.backlog -= len;
+	sch->q.qlen--;
+	qdisc_drop(skb, sch);
+
+	return len;
+}
+#endif
+
+static void canprio_reset(struct Qdisc *sch)
+{
+	struct canprio_sched_data *q = qdisc_priv(sch);
+
+	__skb_queue_purge(&q->queue);
+	sch->qstats.backlog = 0;
+	sch->q.qlen = 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,16,0)
+static int canprio_change(struct Qdisc *sch, struct nlattr *opt,
+			  struct netlink_ext_ack *extack)
+#else
+static int canprio_change(struct Qdisc *sch, struct nlattr *opt)
+#endif
+{
+	struct canprio_sched_data *q = qdisc_priv(sch);
+
+	if (!opt) {
+		q->limit = max_t(u32, qdisc_dev(sch)->tx_queue_len, 1);
+	} else {
+		struct tc_fifo_qopt *ctl = nla_data(opt);
+
+		if (nla_len(opt) < sizeof(*ctl))
+			return -EINVAL;
+
+		q->limit = ctl->limit;
+	}
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,16,0)
+static int canprio_init(struct Qdisc *sch, struct nlattr *opt,
+			struct netlink_ext_ack *extack)
+#else
+static int canprio_init(struct Qdisc *sch, struct nlattr *opt)
+#endif
+{
+	struct canprio_sched_data *q = qdisc_priv(sch);
+
+	skb_queue_head_init(&q->queue);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,16,0)
+	return canprio_change(sch, opt, extack);
+#else
+	return canprio_change(sch, opt);
+#endif
+}
+
+static int canprio_dump(struct Qdisc *sch, struct sk_buff *skb)
+{
+	struct canprio_sched_data *q = qdisc_priv(sch);
+	struct tc_fifo_qopt opt = { .limit = q->limit };
+
+	if (nla_put(skb, TCA_OPTIONS, sizeof(opt), &opt))
+		return -1;
+
+	return skb->len;
+}
+
+static struct Qdisc_ops canprio_qdisc_ops __read_mostly = {
+	.id		= "canprio",
+	.priv_size	= sizeof(struct canprio_sched_data),
+	.enqueue	= canprio_enqueue,
+	.dequeue	= canprio_dequeue,
+	.peek		= canprio_peek,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,8,0)
+	.drop		= canprio_drop,
+#endif
+	.init		= canprio_init,
+	.reset		= canprio_reset,
+	.change		= canprio_change,
+	.dump		= canprio_dump,
+	.owner		= THIS_MODULE,
+};
+
+static __init int canprio_module_init(void)
+{
+	return register_qdisc(&canprio_qdisc_ops);
+}
+
+static __exit void canprio_module_exit(void)
+{
+	unregister_qdisc(&canprio_qdisc_ops);
+}
+
+module_init(canprio_module_init);
+module_exit(canprio_module_exit);
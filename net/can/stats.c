@@ -0,0 +1,542 @@
+/*
+ * stats.c - statistics of the Protocol family CAN core module
+ *
+ * The rates are computed when the statistics are read, there is no
+ * periodic timer. Besides the procfs (proc.c) the statistics and the
+ * receive lists are available by the generic netlink family "can_stats"
+ * (see include/socketcan/can/stats.h). The receive lists are dumped in
+ * several parts there and not under a single rcu read lock.
+ *
+ * Copyright (c) 2002-2007 Volkswagen Group Electronic Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Volkswagen nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * Alternatively, provided that this notice is retained in full, this
+ * software may be distributed under the terms of the GNU General
+ * Public License ("GPL") version 2, in which case the provisions of the
+ * GPL apply INSTEAD OF those given above.
+ *
+ * The provided data structures and external interfaces from this code
+ * are not restricted to be used by modules with a GPL compatible license.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * Send feedback to <socketcan-users@lists.berlios.de>
+ *
+ */
+
+
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/kernel.h>
+#include <linux/jiffies.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/netdevice.h>
+#include <socketcan/can/core.h>
+#include <socketcan/can/stats.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33)
+#include <net/genetlink.h>
+#include <net/sock.h>
+#endif
+
+#include "af_can.h"
+
+#include <socketcan/can/version.h> /* for RCSID. Removed by mkpatch script */
+RCSID("$Id$");
+
+/* the name stems from the former 1 second timer of the rate statistics */
+static int stats_timer __read_mostly = 1;
+module_param(stats_timer, int, S_IRUGO);
+MODULE_PARM_DESC(stats_timer, "compute the rates of the statistics when "
+		 "they are read (default:on)");
+
+/*
+ * af_can statistics stuff
+ */
+
+static void can_sum_pcpu_stats(struct can_net *cn, struct s_pcpu_stats *sum)
+{
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for_each_possible_cpu(cpu) {
+		struct s_pcpu_stats *p = per_cpu_ptr(cn->pcpu_stats, cpu);
+
+		sum->rx_frames += p->rx_frames;
+		sum->tx_frames += p->tx_frames;
+		sum->matches   += p->matches;
+	}
+}
+
+/* update the counters since the last reset from the per-CPU counters */
+static void can_fold_stats(struct can_net *cn, struct s_pcpu_stats *sum)
+{
+	cn->stats.rx_frames = sum->rx_frames - cn->stats_base.rx_frames;
+	cn->stats.tx_frames = sum->tx_frames - cn->stats_base.tx_frames;
+	cn->stats.matches   = sum->matches   - cn->stats_base.matches;
+}
+
+static void can_init_stats(struct can_net *cn)
+{
+	memset(&cn->stats, 0, sizeof(cn->stats));
+	cn->stats.jiffies_init = jiffies;
+
+	/* the per-CPU counters are never reset => remember the base values */
+	can_sum_pcpu_stats(cn, &cn->stats_base);
+	cn->stats_last = cn->stats_base;
+	cn->stats_jiffies = cn->stats.jiffies_init;
+
+	cn->pstats.stats_reset++;
+}
+
+static unsigned long calc_rate(unsigned long oldjif, unsigned long newjif,
+			       unsigned long count)
+{
+	unsigned long jif = newjif - oldjif;
+
+	if (!jif)
+		return 0;
+
+	/* there can be a long time between two reads: trade precision */
+	if (count > (ULONG_MAX / HZ))
+		return count / max(jif / HZ, 1UL);
+
+	return (count * HZ) / jif;
+}
+
+static unsigned long calc_ratio(unsigned long matches, unsigned long frames)
+{
+	if (matches > (ULONG_MAX / 100))
+		return matches / max(frames / 100, 1UL);
+
+	return (matches * 100) / frames;
+}
+
+/*
+ * Update the rates from the frames counted since the previous update.
+ * The current values are averaged over the time since the previous read.
+ * Reads within a second keep them, polling readers would mostly see the
+ * jitter of the short intervals otherwise.
+ */
+static void can_stat_update(struct can_net *cn)
+{
+	unsigned long j = jiffies; /* snapshot */
+	struct s_pcpu_stats sum;
+
+	can_sum_pcpu_stats(cn, &sum);
+	can_fold_stats(cn, &sum);
+
+	if (!stats_timer)
+		return;
+
+	/* calc total values */
+	if (cn->stats.rx_frames)
+		cn->stats.total_rx_match_ratio = calc_ratio(cn->stats.matches,
+							    cn->stats.rx_frames);
+
+	cn->stats.total_tx_rate = calc_rate(cn->stats.jiffies_init, j,
+					    cn->stats.tx_frames);
+	cn->stats.total_rx_rate = calc_rate(cn->stats.jiffies_init, j,
+					    cn->stats.rx_frames);
+
+	if (time_before(j, cn->stats_jiffies + HZ))
+		return;
+
+	/* the frames since the last update */
+	cn->stats.rx_frames_delta = sum.rx_frames - cn->stats_last.rx_frames;
+	cn->stats.tx_frames_delta = sum.tx_frames - cn->stats_last.tx_frames;
+	cn->stats.matches_delta   = sum.matches   - cn->stats_last.matches;
+
+	/* calc current values */
+	if (cn->stats.rx_frames_delta)
+		cn->stats.current_rx_match_ratio =
+			calc_ratio(cn->stats.matches_delta,
+				   cn->stats.rx_frames_delta);
+
+	cn->stats.current_tx_rate = calc_rate(cn->stats_jiffies, j,
+					      cn->stats.tx_frames_delta);
+	cn->stats.current_rx_rate = calc_rate(cn->stats_jiffies, j,
+					      cn->stats.rx_frames_delta);
+
+	cn->stats_last = sum;
+	cn->stats_jiffies = j;
+
+	/* check / update maximum values */
+	if (cn->stats.max_tx_rate < cn->stats.current_tx_rate)
+		cn->stats.max_tx_rate = cn->stats.current_tx_rate;
+
+	if (cn->stats.max_rx_rate < cn->stats.current_rx_rate)
+		cn->stats.max_rx_rate = cn->stats.current_rx_rate;
+
+	if (cn->stats.max_rx_match_ratio < cn->stats.current_rx_match_ratio)
+		cn->stats.max_rx_match_ratio = cn->stats.current_rx_match_ratio;
+}
+
+/* the statistics of a new namespace start without a counted reset */
+void can_init_stats_net(struct can_net *cn)
+{
+	mutex_init(&cn->stats_lock);
+	cn->stats.jiffies_init = jiffies;
+	cn->stats_jiffies = cn->stats.jiffies_init;
+}
+
+/*
+ * can_get_stats - update the statistics and copy them for a reader
+ *
+ * Returns non-zero when the rate and ratio values are computed.
+ */
+int can_get_stats(struct can_net *cn, struct s_stats *stats)
+{
+	mutex_lock(&cn->stats_lock);
+	can_stat_update(cn);
+	*stats = cn->stats;
+	mutex_unlock(&cn->stats_lock);
+
+	return stats_timer;
+}
+
+/*
+ * can_reset_stats - restart the statistics on user request
+ *
+ * Returns the number of the performed reset.
+ */
+unsigned long can_reset_stats(struct can_net *cn)
+{
+	unsigned long resets;
+
+	mutex_lock(&cn->stats_lock);
+
+	/* the procfs may call us several times for a single read */
+	if (cn->stats.jiffies_init != jiffies) {
+		can_init_stats(cn);
+		cn->pstats.user_reset++;
+	}
+	resets = cn->pstats.stats_reset;
+
+	mutex_unlock(&cn->stats_lock);
+
+	return resets;
+}
+
+#ifdef CAN_STATS_GENL
+
+/*
+ * generic netlink interface
+ */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0)
+#define CAN_NL_PORTID(skb) (NETLINK_CB(skb).portid)
+#else
+#define CAN_NL_PORTID(skb) (NETLINK_CB(skb).pid)
+#endif
+
+static struct genl_family can_stats_family;
+
+static void can_stats_fill_info(struct can_net *cn, struct can_stats_info *si)
+{
+	struct s_stats st;
+
+	memset(si, 0, sizeof(*si));
+
+	if (can_get_stats(cn, &st))
+		si->flags |= CAN_STATS_F_RATES;
+
+	si->tx_frames = st.tx_frames;
+	si->rx_frames = st.rx_frames;
+	si->matches   = st.matches;
+	si->age_ms    = jiffies_to_msecs(jiffies - st.jiffies_init);
+
+	si->total_tx_rate          = st.total_tx_rate;
+	si->total_rx_rate          = st.total_rx_rate;
+	si->total_rx_match_ratio   = st.total_rx_match_ratio;
+	si->current_tx_rate        = st.current_tx_rate;
+	si->current_rx_rate        = st.current_rx_rate;
+	si->current_rx_match_ratio = st.current_rx_match_ratio;
+	si->max_tx_rate            = st.max_tx_rate;
+	si->max_rx_rate            = st.max_rx_rate;
+	si->max_rx_match_ratio     = st.max_rx_match_ratio;
+
+	si->rcv_entries     = cn->pstats.rcv_entries;
+	si->rcv_entries_max = cn->pstats.rcv_entries_max;
+	si->stats_reset     = cn->pstats.stats_reset;
+	si->user_reset      = cn->pstats.user_reset;
+}
+
+static int can_stats_get(struct sk_buff *skb, struct genl_info *info)
+{
+	struct can_stats_info si;
+	struct sk_buff *msg;
+	void *hdr;
+
+	can_stats_fill_info(can_pernet(genl_info_net(info)), &si);
+
+	msg = genlmsg_new(nla_total_size(sizeof(si)), GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+
+	hdr = genlmsg_put_reply(msg, info, &can_stats_family, 0,
+				CAN_STATS_CMD_GET);
+	if (!hdr || nla_put(msg, CAN_STATS_A_INFO, sizeof(si), &si) < 0) {
+		nlmsg_free(msg);
+		return -EMSGSIZE;
+	}
+
+	genlmsg_end(msg, hdr);
+
+	return genlmsg_reply(msg, info);
+}
+
+static int can_stats_reset(struct sk_buff *skb, struct genl_info *info)
+{
+	can_reset_stats(can_pernet(genl_info_net(info)));
+
+	return 0;
+}
+
+static int can_stats_fill_rcv(struct sk_buff *skb, struct netlink_callback *cb,
+			      struct dev_rcv_lists *d, int list,
+			      struct receiver *r)
+{
+	u64 matches = can_rcv_matches(r);
+	void *hdr;
+
+	hdr = genlmsg_put(skb, CAN_NL_PORTID(cb->skb), cb->nlh->nlmsg_seq,
+			  &can_stats_family, NLM_F_MULTI,
+			  CAN_STATS_CMD_GET_RCV);
+	if (!hdr)
+		return -EMSGSIZE;
+
+	if (nla_put_u32(skb, CAN_STATS_A_RCV_IFINDEX,
+			d->dev ? d->dev->ifindex : 0) < 0 ||
+	    nla_put_u8(skb, CAN_STATS_A_RCV_LIST, list) < 0 ||
+	    nla_put_u32(skb, CAN_STATS_A_RCV_CAN_ID, r->can_id) < 0 ||
+	    nla_put_u32(skb, CAN_STATS_A_RCV_MASK, r->mask) < 0 ||
+	    nla_put(skb, CAN_STATS_A_RCV_MATCHES, sizeof(matches),
+		    &matches) < 0 ||
+	    nla_put_string(skb, CAN_STATS_A_RCV_IDENT,
+			   r->ident ? r->ident : "") < 0) {
+		genlmsg_cancel(skb, hdr);
+		return -EMSGSIZE;
+	}
+
+	genlmsg_end(skb, hdr);
+
+	return 0;
+}
+
+/*
+ * The dump cursor in cb->args:
+ * [0] position in rx_dev_list, [1] receive list (CAN_RCV_LIST_*),
+ * [2] bucket of the RX_SFF lists or the RX_EFF hash, [3] receiver
+ * position in the list or bucket.
+ */
+
+static int can_stats_dump_hlist(struct sk_buff *skb,
+				struct netlink_callback *cb,
+				struct dev_rcv_lists *d, int list,
+				struct hlist_head *head)
+{
+	struct receiver *r;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	struct hlist_node *n;
+#endif
+	long idx = 0;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	hlist_for_each_entry_rcu(r, n, head, list) {
+#else
+	hlist_for_each_entry_rcu(r, head, list) {
+#endif
+		if (idx++ < cb->args[3])
+			continue;
+
+		if (can_stats_fill_rcv(skb, cb, d, list, r))
+			return -EMSGSIZE;
+
+		cb->args[3] = idx;
+	}
+
+	cb->args[3] = 0;
+	return 0;
+}
+
+static int can_stats_dump_sff(struct sk_buff *skb, struct netlink_callback *cb,
+			      struct dev_rcv_lists *d)
+{
+	/* do not walk the 0x800 lists of the devices without SFF entries */
+	if (!d->sff_entries)
+		return 0;
+
+	for (; cb->args[2] < 0x800; cb->args[2]++) {
+		if (can_stats_dump_hlist(skb, cb, d, CAN_RCV_LIST_SFF,
+					 &d->rx_sff[cb->args[2]]))
+			return -EMSGSIZE;
+	}
+
+	cb->args[2] = 0;
+	return 0;
+}
+
+static int can_stats_dump_eff(struct sk_buff *skb, struct netlink_callback *cb,
+			      struct dev_rcv_lists *d)
+{
+	struct can_eff_hash *h;
+	struct receiver *r;
+	struct hlist_node *n;
+	long idx;
+
+	if (!d->eff_entries)
+		return 0;
+
+	/* a resize in between the parts of the dump may skip receivers */
+	h = rcu_dereference(d->rx_eff);
+
+	for (; cb->args[2] < (1 << h->bits); cb->args[2]++) {
+		idx = 0;
+		can_eff_for_each_rcu(r, n, h, &h->bucket[cb->args[2]]) {
+			if (idx++ < cb->args[3])
+				continue;
+
+			if (can_stats_fill_rcv(skb, cb, d, CAN_RCV_LIST_EFF, r))
+				return -EMSGSIZE;
+
+			cb->args[3] = idx;
+		}
+		cb->args[3] = 0;
+	}
+
+	cb->args[2] = 0;
+	return 0;
+}
+
+static int can_stats_dump_dev(struct sk_buff *skb, struct netlink_callback *cb,
+			      struct dev_rcv_lists *d)
+{
+	int list, err;
+
+	for (; cb->args[1] < CAN_RCV_LIST_MAX; cb->args[1]++) {
+		list = cb->args[1];
+
+		if (list == CAN_RCV_LIST_EFF)
+			err = can_stats_dump_eff(skb, cb, d);
+		else if (list == CAN_RCV_LIST_SFF)
+			err = can_stats_dump_sff(skb, cb, d);
+		else
+			err = can_stats_dump_hlist(skb, cb, d, list,
+						   &d->rx[list]);
+		if (err)
+			return err;
+	}
+
+	cb->args[1] = 0;
+	return 0;
+}
+
+static int can_stats_dump_rcv(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct can_net *cn = can_pernet(sock_net(skb->sk));
+	struct dev_rcv_lists *d;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	struct hlist_node *n;
+#endif
+	long pos = 0;
+
+	rcu_read_lock();
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	hlist_for_each_entry_rcu(d, n, &cn->rx_dev_list, list) {
+#else
+	hlist_for_each_entry_rcu(d, &cn->rx_dev_list, list) {
+#endif
+		if (pos++ < cb->args[0])
+			continue;
+
+		/* the skb is full => continue here with the next part */
+		if (can_stats_dump_dev(skb, cb, d))
+			break;
+
+		cb->args[0] = pos;
+	}
+	rcu_read_unlock();
+
+	return skb->len;
+}
+
+static struct genl_ops can_stats_ops[] = {
+	{
+		.cmd	= CAN_STATS_CMD_GET,
+		.doit	= can_stats_get,
+	},
+	{
+		.cmd	= CAN_STATS_CMD_RESET,
+		.flags	= GENL_ADMIN_PERM,
+		.doit	= can_stats_reset,
+	},
+	{
+		.cmd	= CAN_STATS_CMD_GET_RCV,
+		.dumpit	= can_stats_dump_rcv,
+	},
+};
+
+static struct genl_family can_stats_family = {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0)
+	.id		= GENL_ID_GENERATE,
+#endif
+	.name		= CAN_STATS_GENL_NAME,
+	.version	= CAN_STATS_GENL_VERSION,
+	.netnsok	= true,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	.module		= THIS_MODULE,
+	.ops		= can_stats_ops,
+	.n_ops		= ARRAY_SIZE(can_stats_ops),
+#endif
+};
+
+int can_stats_genl_register(void)
+{
+	/* the receive lists below RX_EFF are dumped by their RX_* index */
+	BUILD_BUG_ON(CAN_RCV_LIST_ERR != RX_ERR ||
+		     CAN_RCV_LIST_ALL != RX_ALL ||
+		     CAN_RCV_LIST_FIL != RX_FIL ||
+		     CAN_RCV_LIST_INV != RX_INV ||
+		     CAN_RCV_LIST_EFF != RX_EFF);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	return genl_register_family(&can_stats_family);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0)
+	return genl_register_family_with_ops(&can_stats_family, can_stats_ops);
+#else
+	return genl_register_family_with_ops(&can_stats_family, can_stats_ops,
+					     ARRAY_SIZE(can_stats_ops));
+#endif
+}
+
+void can_stats_genl_unregister(void)
+{
+	genl_unregister_family(&can_stats_family);
+}
+
+#endif /* CAN_STATS_GENL */
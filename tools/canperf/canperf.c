@@ -0,0 +1,277 @@
+/*
+ * canperf.c - throughput and latency benchmarks of the CAN protocols
+ *
+ * canperf runs ISO-TP, CAN_RAW and BCM benchmarks on a CAN interface
+ * (vcan0 by default) and prints the results as one JSON object per line,
+ * see run-suite.sh for a complete sweep. All times are taken from the
+ * software receive timestamps (SO_TIMESTAMPNS) or CLOCK_MONOTONIC, so the
+ * results of different kernel versions can be compared directly.
+ *
+ * $Id$
+ *
+ * Send feedback to <socketcan-users@lists.berlios.de>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+
+#include <socketcan/can/raw.h>
+
+#include "canperf.h"
+
+const char *ifname = "vcan0";
+
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* comma separated list of numbers, e.g. "0,0xF1,1" for STmin values */
+int parse_list(const char *s, unsigned long *list)
+{
+	char *end;
+	int n = 0;
+
+	while (*s && n < CANPERF_MAX_LIST) {
+		list[n++] = strtoul(s, &end, 0);
+		if (end == s || (*end && *end != ','))
+			return -1;
+		s = *end ? end + 1 : end;
+	}
+
+	return n;
+}
+
+int set_rcvbuf(int s, int size)
+{
+	/* SO_RCVBUFFORCE exceeds rmem_max but needs CAP_NET_ADMIN */
+#ifdef SO_RCVBUFFORCE
+	if (!setsockopt(s, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)))
+		return 0;
+#endif
+	return setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+/* raw socket on ifname with timestamps and drop counter */
+int open_raw(const struct can_filter *filter, int count)
+{
+	struct sockaddr_can addr;
+	int s, on = 1;
+
+	s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (s < 0) {
+		perror("socket CAN_RAW");
+		return -1;
+	}
+
+	if (setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, filter,
+		       count * sizeof(*filter)) < 0) {
+		perror("setsockopt CAN_RAW_FILTER");
+		goto fail;
+	}
+
+	setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+	setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = if_nametoindex(ifname);
+	if (!addr.can_ifindex) {
+		perror(ifname);
+		goto fail;
+	}
+
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind CAN_RAW");
+		goto fail;
+	}
+
+	return s;
+
+ fail:
+	close(s);
+	return -1;
+}
+
+/*
+ * Receive a frame with its timestamp (0 without SO_TIMESTAMPNS support)
+ * and the drop counter of the socket. Returns the recvmsg() result.
+ */
+int recv_frame(int s, struct can_frame *cf, uint64_t *ts, uint32_t *drops)
+{
+	char ctrl[CMSG_SPACE(sizeof(struct timespec)) +
+		  CMSG_SPACE(sizeof(uint32_t))];
+	struct iovec iov = { cf, sizeof(*cf) };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int nbytes;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl;
+	msg.msg_controllen = sizeof(ctrl);
+
+	nbytes = recvmsg(s, &msg, 0);
+	if (nbytes < 0)
+		return nbytes;
+
+	*ts = 0;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+
+		if (cmsg->cmsg_type == SO_TIMESTAMPNS) {
+			struct timespec t;
+
+			memcpy(&t, CMSG_DATA(cmsg), sizeof(t));
+			*ts = (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+		} else if (cmsg->cmsg_type == SO_RXQ_OVFL && drops)
+			memcpy(drops, CMSG_DATA(cmsg), sizeof(*drops));
+	}
+
+	return nbytes;
+}
+
+void out_begin(const char *test)
+{
+	struct utsname u;
+
+	if (uname(&u) < 0)
+		strcpy(u.release, "unknown");
+
+	printf("{\"test\":\"%s\",\"version\":%d,\"kernel\":\"%s\","
+	       "\"if\":\"%s\"", test, CANPERF_VERSION, u.release, ifname);
+}
+
+void out_u64(const char *key, uint64_t val)
+{
+	printf(",\"%s\":%llu", key, (unsigned long long)val);
+}
+
+void out_dbl(const char *key, double val)
+{
+	printf(",\"%s\":%.3f", key, val);
+}
+
+void out_end(void)
+{
+	printf("}\n");
+	fflush(stdout);
+}
+
+void samples_add(struct samples *sp, int64_t val)
+{
+	if (sp->num == sp->max) {
+		size_t max = sp->max ? 2 * sp->max : 4096;
+		int64_t *v = realloc(sp->val, max * sizeof(*v));
+
+		/* keep the samples we have */
+		if (!v)
+			return;
+		sp->val = v;
+		sp->max = max;
+	}
+
+	sp->val[sp->num++] = val;
+}
+
+static int cmp_s64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* prints <prefix>_min, _avg, _p50, _p99 and _max in usecs */
+void samples_out(struct samples *sp, const char *prefix)
+{
+	static const char *const sfx[] = { "min", "avg", "p50", "p99", "max" };
+	double v[5] = { 0, 0, 0, 0, 0 };
+	char key[64];
+	size_t i;
+
+	if (sp->num) {
+		double sum = 0;
+
+		qsort(sp->val, sp->num, sizeof(*sp->val), cmp_s64);
+		for (i = 0; i < sp->num; i++)
+			sum += sp->val[i];
+
+		v[0] = sp->val[0];
+		v[1] = sum / sp->num;
+		v[2] = sp->val[sp->num / 2];
+		v[3] = sp->val[(sp->num * 99) / 100];
+		v[4] = sp->val[sp->num - 1];
+	}
+
+	for (i = 0; i < 5; i++) {
+		snprintf(key, sizeof(key), "%s_%s", prefix, sfx[i]);
+		out_dbl(key, v[i] / 1000.0);
+	}
+}
+
+void samples_free(struct samples *sp)
+{
+	free(sp->val);
+	memset(sp, 0, sizeof(*sp));
+}
+
+static void usage(const char *prg)
+{
+	fprintf(stderr,
+		"Usage: %s [-i <ifname>] <test> [test options]\n\n"
+		"Tests:\n"
+		"  isotp  ISO-TP PDU throughput and FF to last CF latency\n"
+		"         -s <sizes> -b <blocksizes> -m <stmins> -n <pdus>\n"
+		"  raw    CAN_RAW frames/s with several receiving sockets\n"
+		"         -S <sockets> -f <filters per socket> -n <frames>\n"
+		"  bcm    jitter of cyclic BCM transmissions\n"
+		"         -o <ops> -t <interval usecs> -d <duration secs>\n\n"
+		"The lists are comma separated, e.g. '-s 7,64,4095'. Each run\n"
+		"of a parameter combination prints one JSON object.\n",
+		prg);
+}
+
+int main(int argc, char **argv)
+{
+	const char *prg = argv[0];
+	char *test;
+
+	if (argc > 2 && !strcmp(argv[1], "-i")) {
+		ifname = argv[2];
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (argc < 2) {
+		usage(prg);
+		return 1;
+	}
+
+	test = argv[1];
+	argc--;
+	argv++;
+
+	if (!strcmp(test, "isotp"))
+		return isotp_main(argc, argv);
+	if (!strcmp(test, "raw"))
+		return raw_main(argc, argv);
+	if (!strcmp(test, "bcm"))
+		return bcm_main(argc, argv);
+
+	usage(prg);
+	return 1;
+}
@@ -0,0 +1,75 @@
+/*
+ * canperf.h - common definitions of the canperf benchmark suite
+ *
+ * $Id$
+ *
+ * Send feedback to <socketcan-users@lists.berlios.de>
+ *
+ */
+
+#ifndef CANPERF_H
+#define CANPERF_H
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include <socketcan/can.h>
+
+#ifndef AF_CAN
+#define AF_CAN 29
+#endif
+#ifndef PF_CAN
+#define PF_CAN AF_CAN
+#endif
+#ifndef SO_TIMESTAMPNS
+#define SO_TIMESTAMPNS 35
+#endif
+#ifndef SO_RXQ_OVFL
+#define SO_RXQ_OVFL 40
+#endif
+
+/* bumped when the meaning of an output field changes */
+#define CANPERF_VERSION 1
+
+#define CANPERF_MAX_LIST 64
+
+extern const char *ifname;
+
+/* frames of the ISO-TP and raw tests, cyclic frames of the bcm test */
+#define CANPERF_ISOTP_TX_ID	0x700
+#define CANPERF_ISOTP_RX_ID	0x708
+
+int isotp_main(int argc, char **argv);
+int raw_main(int argc, char **argv);
+int bcm_main(int argc, char **argv);
+
+/* helpers in canperf.c */
+uint64_t now_ns(void);
+int parse_list(const char *s, unsigned long *list);
+int open_raw(const struct can_filter *filter, int count);
+int set_rcvbuf(int s, int size);
+int recv_frame(int s, struct can_frame *cf, uint64_t *ts, uint32_t *drops);
+
+/*
+ * A result is one JSON object per line. Every record carries the test
+ * name, the kernel release and the interface, followed by the parameters
+ * and the results of the run.
+ */
+void out_begin(const char *test);
+void out_u64(const char *key, uint64_t val);
+void out_dbl(const char *key, double val);
+void out_end(void);
+
+/* latency samples in nano seconds */
+struct samples {
+	int64_t *val;
+	size_t num;
+	size_t max;
+};
+
+void samples_add(struct samples *sp, int64_t val);
+void samples_out(struct samples *sp, const char *prefix);
+void samples_free(struct samples *sp);
+
+#endif /* CANPERF_H */
@@ -0,0 +1,196 @@
+/*
+ * canperf_bcm.c - jitter of cyclic BCM transmissions
+ *
+ * A BCM socket sets up the given number of cyclic tx tasks, each with its
+ * own EFF identifier and the same interval. A CAN_RAW socket timestamps
+ * the sent frames for the given duration. The jitter is the deviation of
+ * the time between two frames of a task from the interval.
+ *
+ * $Id$
+ *
+ * Send feedback to <socketcan-users@lists.berlios.de>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <net/if.h>
+
+#include <socketcan/can/bcm.h>
+
+#include "canperf.h"
+
+#define BCM_MAX_OPS 65536
+
+struct bcm_tx_msg {
+	struct bcm_msg_head head;
+	struct can_frame frame;
+};
+
+static int open_bcm(void)
+{
+	struct sockaddr_can addr;
+	int s;
+
+	s = socket(PF_CAN, SOCK_DGRAM, CAN_BCM);
+	if (s < 0) {
+		perror("socket CAN_BCM");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = if_nametoindex(ifname);
+
+	if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("connect CAN_BCM");
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+static int run_bcm(unsigned int ops, unsigned long ival_us,
+		   unsigned long secs)
+{
+	struct can_filter filter;
+	struct samples jit = { 0 };
+	struct bcm_tx_msg msg;
+	struct can_frame cf;
+	struct pollfd pfd;
+	uint64_t *last, ts, end, frames = 0, late = 0;
+	int64_t ival = ival_us * 1000LL, d;
+	uint32_t drops = 0;
+	unsigned int i, idx;
+	int bcm, sniff;
+
+	/*
+	 * The EFF identifiers 0 .. ops - 1 rounded up to a power of two, the
+	 * extra identifiers are ignored.
+	 */
+	for (i = 1; i < ops; i <<= 1)
+		;
+	filter.can_id = CAN_EFF_FLAG;
+	filter.can_mask = CAN_EFF_FLAG | (CAN_EFF_MASK & ~(i - 1));
+
+	last = calloc(ops, sizeof(*last));
+	if (!last) {
+		perror("calloc");
+		return 1;
+	}
+
+	sniff = open_raw(&filter, 1);
+	bcm = open_bcm();
+	if (sniff < 0 || bcm < 0)
+		return 1;
+
+	/* the frames of all tasks may come within a short time */
+	set_rcvbuf(sniff, 1 << 24);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.head.opcode = TX_SETUP;
+	msg.head.flags = SETTIMER | STARTTIMER;
+	msg.head.ival2.tv_sec = ival_us / 1000000;
+	msg.head.ival2.tv_usec = ival_us % 1000000;
+	msg.head.nframes = 1;
+	msg.frame.can_dlc = 8;
+
+	for (i = 0; i < ops; i++) {
+		msg.head.can_id = CAN_EFF_FLAG | i;
+		msg.frame.can_id = CAN_EFF_FLAG | i;
+		if (write(bcm, &msg, sizeof(msg)) != sizeof(msg)) {
+			perror("write TX_SETUP");
+			return 1;
+		}
+	}
+
+	pfd.fd = sniff;
+	pfd.events = POLLIN;
+
+	end = now_ns() + secs * 1000000000ULL;
+	while (now_ns() < end) {
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+
+		if (recv_frame(sniff, &cf, &ts, &drops) < 0 || !ts)
+			break;
+
+		idx = cf.can_id & CAN_EFF_MASK;
+		if (idx >= ops)
+			continue;
+
+		frames++;
+		if (last[idx]) {
+			d = (int64_t)(ts - last[idx]) - ival;
+			if (d > 0)
+				late++;
+			samples_add(&jit, d < 0 ? -d : d);
+		}
+		last[idx] = ts;
+	}
+
+	/* closing the socket removes the tx tasks */
+	close(bcm);
+
+	out_begin("bcm");
+	out_u64("ops", ops);
+	out_u64("ival_us", ival_us);
+	out_u64("secs", secs);
+	out_u64("expected", (uint64_t)ops * secs * 1000000 / ival_us);
+	out_u64("frames", frames);
+	out_u64("rx_drops", drops);
+	out_u64("late", late);
+	samples_out(&jit, "jitter_us");
+	out_end();
+
+	samples_free(&jit);
+	free(last);
+	close(sniff);
+
+	return 0;
+}
+
+int bcm_main(int argc, char **argv)
+{
+	unsigned long ops[CANPERF_MAX_LIST] = { 100, 1000, 5000 };
+	unsigned long ival_us = 100000, secs = 10;
+	int nops = 3, o, opt;
+
+	while ((opt = getopt(argc, argv, "o:t:d:")) != -1) {
+		switch (opt) {
+		case 'o':
+			nops = parse_list(optarg, ops);
+			break;
+		case 't':
+			ival_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			secs = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return 1;
+		}
+	}
+
+	if (nops <= 0 || !ival_us || !secs) {
+		fprintf(stderr, "bcm: invalid option\n");
+		return 1;
+	}
+
+	for (o = 0; o < nops; o++) {
+		if (!ops[o] || ops[o] > BCM_MAX_OPS) {
+			fprintf(stderr, "bcm: %lu ops out of range\n", ops[o]);
+			return 1;
+		}
+	}
+
+	for (o = 0; o < nops; o++)
+		if (run_bcm(ops[o], ival_us, secs))
+			return 1;
+
+	return 0;
+}
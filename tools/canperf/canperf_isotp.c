@@ -0,0 +1,237 @@
+/*
+ * canperf_isotp.c - ISO-TP PDU throughput and FF to last CF latency
+ *
+ * A PDU is sent from an ISO-TP socket (CAN ID 0x700) to a second ISO-TP
+ * socket (CAN ID 0x708) that provides the block size and STmin of the run
+ * in its flow control frames. A CAN_RAW socket timestamps the frames of
+ * the sender to get the time from the FF to the last CF of each PDU.
+ * The PDUs are sent one after the other, the next one when the previous
+ * PDU has been received completely.
+ *
+ * $Id$
+ *
+ * Send feedback to <socketcan-users@lists.berlios.de>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <net/if.h>
+
+#include <socketcan/can/isotp.h>
+
+#include "canperf.h"
+
+#define ISOTP_MAX_PDU 4095
+
+/* give up on a PDU that did not complete within this time */
+#define ISOTP_PDU_TIMEOUT_MS 1000
+
+static int open_isotp(canid_t rx_id, canid_t tx_id, int bs, int stmin)
+{
+	struct can_isotp_fc_options fc;
+	struct sockaddr_can addr;
+	int s;
+
+	s = socket(PF_CAN, SOCK_DGRAM, CAN_ISOTP);
+	if (s < 0) {
+		perror("socket CAN_ISOTP");
+		return -1;
+	}
+
+	if (bs >= 0) {
+		memset(&fc, 0, sizeof(fc));
+		fc.bs = bs;
+		fc.stmin = stmin;
+		if (setsockopt(s, SOL_CAN_ISOTP, CAN_ISOTP_RECV_FC, &fc,
+			       sizeof(fc)) < 0) {
+			perror("setsockopt CAN_ISOTP_RECV_FC");
+			goto fail;
+		}
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = if_nametoindex(ifname);
+	addr.can_addr.tp.rx_id = rx_id;
+	addr.can_addr.tp.tx_id = tx_id;
+
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind CAN_ISOTP");
+		goto fail;
+	}
+
+	return s;
+
+ fail:
+	close(s);
+	return -1;
+}
+
+static int run_isotp(unsigned int size, int bs, int stmin, unsigned int pdus)
+{
+	struct can_filter filter = {
+		CANPERF_ISOTP_TX_ID, CAN_SFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG
+	};
+	unsigned char tbuf[ISOTP_MAX_PDU], rbuf[ISOTP_MAX_PDU + 1];
+	struct samples lat = { 0 }, pdu = { 0 };
+	unsigned int i, k, cf_needed, errors = 0;
+	uint64_t start, t0, ff_ts = 0, last_ts = 0;
+	uint32_t drops = 0;
+	struct pollfd pfd[2];
+	int tx, rx, sniff;
+	double secs;
+
+	/* all CFs but the last one carry 7 bytes, the FF carries 6 bytes */
+	cf_needed = size > 7 ? size / 7 : 0;
+
+	tx = open_isotp(CANPERF_ISOTP_RX_ID, CANPERF_ISOTP_TX_ID, -1, 0);
+	rx = open_isotp(CANPERF_ISOTP_TX_ID, CANPERF_ISOTP_RX_ID, bs, stmin);
+	sniff = open_raw(&filter, 1);
+	if (tx < 0 || rx < 0 || sniff < 0)
+		return 1;
+
+	set_rcvbuf(sniff, 1 << 22);
+
+	pfd[0].fd = rx;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = sniff;
+	pfd[1].events = POLLIN;
+
+	start = now_ns();
+
+	for (i = 0; i < pdus; i++) {
+		unsigned int cfs = 0;
+		int got = 0, ok = 0;
+
+		for (k = 0; k < size; k++)
+			tbuf[k] = i + k;
+
+		t0 = now_ns();
+		if (write(tx, tbuf, size) != (ssize_t)size) {
+			perror("write CAN_ISOTP");
+			errors++;
+			continue;
+		}
+
+		/* the sniffer is drained while the PDU is on the way */
+		while (!got || cfs < cf_needed) {
+			if (poll(pfd, 2, ISOTP_PDU_TIMEOUT_MS) <= 0)
+				break;
+
+			if (pfd[1].revents & POLLIN) {
+				struct can_frame cf;
+				uint64_t ts;
+
+				if (recv_frame(sniff, &cf, &ts, &drops) < 0)
+					break;
+
+				switch (cf.data[0] >> 4) {
+				case 0: /* SF */
+				case 1: /* FF */
+					ff_ts = last_ts = ts;
+					cfs = 0;
+					break;
+				case 2: /* CF */
+					last_ts = ts;
+					cfs++;
+					break;
+				}
+			}
+
+			if (pfd[0].revents & POLLIN) {
+				ssize_t n = read(rx, rbuf, sizeof(rbuf));
+
+				got = 1;
+				ok = n == (ssize_t)size &&
+					!memcmp(tbuf, rbuf, size);
+			}
+		}
+
+		if (!got || !ok || cfs < cf_needed) {
+			errors++;
+			continue;
+		}
+
+		samples_add(&pdu, now_ns() - t0);
+		if (cf_needed && ff_ts)
+			samples_add(&lat, last_ts - ff_ts);
+	}
+
+	secs = (now_ns() - start) / 1e9;
+
+	out_begin("isotp");
+	out_u64("size", size);
+	out_u64("bs", bs);
+	out_u64("stmin", stmin);
+	out_u64("pdus", pdus);
+	out_u64("errors", errors);
+	out_u64("sniffer_drops", drops);
+	out_dbl("pdu_s", (pdus - errors) / secs);
+	out_dbl("kbyte_s", (double)(pdus - errors) * size / secs / 1000);
+	samples_out(&lat, "ff_cf_us");
+	samples_out(&pdu, "pdu_us");
+	out_end();
+
+	samples_free(&lat);
+	samples_free(&pdu);
+	close(sniff);
+	close(rx);
+	close(tx);
+
+	return 0;
+}
+
+int isotp_main(int argc, char **argv)
+{
+	unsigned long sizes[CANPERF_MAX_LIST] = { 7, 62, 256, 1024, 4095 };
+	unsigned long bss[CANPERF_MAX_LIST] = { 0, 8 };
+	unsigned long stmins[CANPERF_MAX_LIST] = { 0 };
+	int nsizes = 5, nbss = 2, nstmins = 1;
+	unsigned long pdus = 1000;
+	int s, b, m, opt;
+
+	while ((opt = getopt(argc, argv, "s:b:m:n:")) != -1) {
+		switch (opt) {
+		case 's':
+			nsizes = parse_list(optarg, sizes);
+			break;
+		case 'b':
+			nbss = parse_list(optarg, bss);
+			break;
+		case 'm':
+			nstmins = parse_list(optarg, stmins);
+			break;
+		case 'n':
+			pdus = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return 1;
+		}
+	}
+
+	if (nsizes <= 0 || nbss <= 0 || nstmins <= 0 || !pdus) {
+		fprintf(stderr, "isotp: invalid option\n");
+		return 1;
+	}
+
+	for (s = 0; s < nsizes; s++) {
+		if (!sizes[s] || sizes[s] > ISOTP_MAX_PDU) {
+			fprintf(stderr, "isotp: size %lu out of range\n",
+				sizes[s]);
+			return 1;
+		}
+	}
+
+	for (s = 0; s < nsizes; s++)
+		for (b = 0; b < nbss; b++)
+			for (m = 0; m < nstmins; m++)
+				if (run_isotp(sizes[s], bss[b] & 0xFF,
+					      stmins[m] & 0xFF, pdus))
+					return 1;
+
+	return 0;
+}
@@ -0,0 +1,208 @@
+/*
+ * canperf_raw.c - CAN_RAW send and receive rates with several sockets
+ *
+ * One CAN_RAW socket sends the frames as fast as possible while 1..N
+ * receiving CAN_RAW sockets count them in their own threads. Each
+ * receiving socket has the given number of single identifier filters and
+ * the sent identifiers cycle through them, so every frame matches exactly
+ * one filter of every receiving socket.
+ *
+ * $Id$
+ *
+ * Send feedback to <socketcan-users@lists.berlios.de>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "canperf.h"
+
+/* a receiver stops when no frame arrived for this time */
+#define RAW_IDLE_TIMEOUT_MS 500
+
+struct raw_rcv {
+	pthread_t thread;
+	int s;
+	unsigned long frames;
+	unsigned long count;
+	uint32_t drops;
+	uint64_t first;
+	uint64_t last;
+};
+
+static void *raw_rcv_thread(void *data)
+{
+	struct raw_rcv *r = data;
+	struct pollfd pfd = { r->s, POLLIN, 0 };
+	struct can_frame cf;
+	uint64_t ts;
+
+	while (r->count < r->frames) {
+		if (poll(&pfd, 1, RAW_IDLE_TIMEOUT_MS) <= 0)
+			break;
+
+		if (recv_frame(r->s, &cf, &ts, &r->drops) < 0)
+			break;
+
+		r->last = now_ns();
+		if (!r->count++)
+			r->first = r->last;
+	}
+
+	return NULL;
+}
+
+static int run_raw(unsigned int nsock, unsigned int nfilt,
+		   unsigned long frames)
+{
+	struct can_filter *filter;
+	struct raw_rcv *rcv;
+	struct can_frame cf;
+	uint64_t start, end, first = 0, last = 0, count = 0, drops = 0;
+	unsigned long i, retries = 0;
+	unsigned int k;
+	int tx, err = 1;
+
+	filter = calloc(nfilt, sizeof(*filter));
+	rcv = calloc(nsock, sizeof(*rcv));
+	if (!filter || !rcv) {
+		perror("calloc");
+		goto out;
+	}
+
+	for (k = 0; k < nfilt; k++) {
+		filter[k].can_id = k;
+		filter[k].can_mask = CAN_SFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+	}
+
+	/* no filters: the sending socket receives nothing */
+	tx = open_raw(NULL, 0);
+	if (tx < 0)
+		goto out;
+
+	for (k = 0; k < nsock; k++) {
+		rcv[k].s = open_raw(filter, nfilt);
+		if (rcv[k].s < 0)
+			goto out_close;
+
+		set_rcvbuf(rcv[k].s, 1 << 22);
+		rcv[k].frames = frames;
+	}
+
+	for (k = 0; k < nsock; k++)
+		pthread_create(&rcv[k].thread, NULL, raw_rcv_thread, &rcv[k]);
+
+	memset(&cf, 0, sizeof(cf));
+	cf.can_dlc = 8;
+
+	start = now_ns();
+	for (i = 0; i < frames; i++) {
+		cf.can_id = i % nfilt;
+		memcpy(cf.data, &i, sizeof(i) < 8 ? sizeof(i) : 8);
+
+		/* a full tx queue of a real interface returns ENOBUFS */
+		while (write(tx, &cf, sizeof(cf)) != sizeof(cf)) {
+			if (errno != ENOBUFS) {
+				perror("write CAN_RAW");
+				goto out_join;
+			}
+			retries++;
+			usleep(100);
+		}
+	}
+	end = now_ns();
+
+	err = 0;
+
+ out_join:
+	for (k = 0; k < nsock; k++) {
+		pthread_join(rcv[k].thread, NULL);
+
+		count += rcv[k].count;
+		drops += rcv[k].drops;
+		if (!rcv[k].count)
+			continue;
+		if (!first || rcv[k].first < first)
+			first = rcv[k].first;
+		if (rcv[k].last > last)
+			last = rcv[k].last;
+	}
+
+	if (!err) {
+		out_begin("raw");
+		out_u64("sockets", nsock);
+		out_u64("filters", nfilt);
+		out_u64("frames", frames);
+		out_u64("tx_retries", retries);
+		out_u64("rx_frames", count);
+		out_u64("rx_lost", (uint64_t)nsock * frames - count);
+		out_u64("rx_drops", drops);
+		out_dbl("tx_fps", frames / ((end - start) / 1e9));
+		/* frames delivered to all sockets per second */
+		out_dbl("rx_fps", last > first ?
+			count / ((last - first) / 1e9) : 0);
+		out_end();
+	}
+
+ out_close:
+	for (k = 0; k < nsock; k++)
+		if (rcv[k].s > 0)
+			close(rcv[k].s);
+	close(tx);
+ out:
+	free(rcv);
+	free(filter);
+
+	return err;
+}
+
+int raw_main(int argc, char **argv)
+{
+	unsigned long socks[CANPERF_MAX_LIST] = { 1, 2, 4, 8 };
+	unsigned long filts[CANPERF_MAX_LIST] = { 1, 64 };
+	int nsocks = 4, nfilts = 2;
+	unsigned long frames = 100000;
+	int s, f, opt;
+
+	while ((opt = getopt(argc, argv, "S:f:n:")) != -1) {
+		switch (opt) {
+		case 'S':
+			nsocks = parse_list(optarg, socks);
+			break;
+		case 'f':
+			nfilts = parse_list(optarg, filts);
+			break;
+		case 'n':
+			frames = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return 1;
+		}
+	}
+
+	if (nsocks <= 0 || nfilts <= 0 || !frames) {
+		fprintf(stderr, "raw: invalid option\n");
+		return 1;
+	}
+
+	for (f = 0; f < nfilts; f++) {
+		if (!filts[f] || filts[f] > CAN_SFF_MASK + 1) {
+			fprintf(stderr, "raw: %lu filters out of range\n",
+				filts[f]);
+			return 1;
+		}
+	}
+
+	for (s = 0; s < nsocks; s++)
+		for (f = 0; f < nfilts; f++)
+			if (socks[s] && run_raw(socks[s], filts[f], frames))
+				return 1;
+
+	return 0;
+}
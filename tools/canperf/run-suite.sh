@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+#  $Id$
+#
+#  run-suite.sh - run the canperf benchmarks with the default sweeps
+#
+#  Usage: run-suite.sh [ifname] [outfile]
+#
+#  The interface defaults to vcan0, which is created when it does not
+#  exist (needs root). The JSON results go to the outfile, by default
+#  canperf-<kernel release>-<ifname>.json, one object per line. The
+#  records of two files with the same test and parameter fields can be
+#  compared directly, e.g. with jq.
+#
+
+IF=${1:-vcan0}
+OUT=${2:-canperf-$(uname -r)-$IF.json}
+PERF=$(dirname $0)/canperf
+
+[ -x $PERF ] || { echo "$PERF not found, run 'make canperf'" >&2; exit 1; }
+
+if ! ip link show $IF >/dev/null 2>&1; then
+	case $IF in
+	vcan*)
+		modprobe vcan 2>/dev/null
+		ip link add dev $IF type vcan || exit 1
+		;;
+	*)
+		echo "interface $IF not found" >&2
+		exit 1
+		;;
+	esac
+fi
+ip link set $IF up 2>/dev/null
+
+: > $OUT
+
+run() {
+	echo "canperf $*" >&2
+	$PERF -i $IF "$@" >> $OUT || echo "canperf $* failed" >&2
+}
+
+# ISO-TP: sizes and block sizes without STmin, STmin only on mid sizes
+run isotp -s 7,62,256,1024,4095 -b 0,1,8 -m 0 -n 1000
+run isotp -s 256,1024 -b 0,8 -m 0xF1,0xF5,1 -n 20
+
+# CAN_RAW: 1..16 receiving sockets with 1 and 64 filters each
+run raw -S 1,2,4,8,16 -f 1,64 -n 200000
+
+# BCM: cyclic tx jitter with 100..5000 tasks
+run bcm -o 100,500,1000,5000 -t 100000 -d 10
+
+echo "results in $OUT" >&2